@@ -46,6 +46,21 @@ ktlint {
     }
 }
 
+// Options shared by all native (C++) projects. They are defined here once,
+// since they change class layouts and must be the same across all of them.
+//
+// Instrumentation builds count heap allocations (see allocation_tracking.hpp).
+// Enable with -PcomboctlAllocationTracking.
+val nativeAllocationTrackingEnabled by extra { project.hasProperty("comboctlAllocationTracking") }
+// D-Bus backend selection. The default is GDBus. -PcomboctlDBusBackend=native
+// selects the epoll based native D-Bus implementation (see dbus_connection.hpp).
+val nativeDBusBackendEnabled by extra { project.findProperty("comboctlDBusBackend") == "native" }
+// Preprocessor flags corresponding to the options above.
+val nativeOptionCflags by extra {
+    (if (nativeAllocationTrackingEnabled) listOf("-DCOMBOCTL_ENABLE_ALLOCATION_TRACKING") else listOf()) +
+    (if (nativeDBusBackendEnabled) listOf("-DCOMBOCTL_NATIVE_DBUS_BACKEND") else listOf())
+}
+
 allprojects {
     val projectPath = project.path.split(":")
     if (projectPath.any { it.endsWith("Cpp") }) {
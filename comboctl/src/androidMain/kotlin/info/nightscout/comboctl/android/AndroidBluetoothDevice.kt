@@ -169,7 +169,9 @@ class AndroidBluetoothDevice(
         }
     }
 
-    override fun blockingSend(dataToSend: List<Byte>) {
+    override fun blockingSend(dataToSend: List<Byte>) = blockingSend(dataToSend.toByteArray(), dataToSend.size)
+
+    override fun blockingSend(data: ByteArray, length: Int) {
         // Handle corner case when disconnect() is called in a different coroutine
         // shortly before this function is run.
         if (!canDoIO) {
@@ -180,7 +182,7 @@ class AndroidBluetoothDevice(
         check(outputStream != null) { "Device is not connected - cannot send data" }
 
         try {
-            outputStream!!.write(dataToSend.toByteArray())
+            outputStream!!.write(data, 0, length)
         } catch (e: IOException) {
             // If we are disconnecting, don't bother re-throwing the exception;
             // one is always thrown when the stream is closed while write() blocks,
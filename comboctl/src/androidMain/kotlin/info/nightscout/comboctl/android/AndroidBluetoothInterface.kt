@@ -84,6 +84,9 @@ class AndroidBluetoothInterface(private val androidContext: Context) : Bluetooth
     // Set to true once a device is found. Used in onDiscoveryFinished()
     // to suppress a discoveryStopped callback invocation.
     private var foundDevice = false
+    // In continuous mode, found devices neither stop discovery
+    // nor suppress the discoveryStopped callback invocation.
+    private var discoveryMode = BluetoothInterface.DiscoveryMode.SINGLE_DEVICE
 
     // Invoked if discovery stops for any reason other than that
     // a device was found.
@@ -93,6 +96,10 @@ class AndroidBluetoothInterface(private val androidContext: Context) : Bluetooth
 
     override var deviceFilterCallback: (deviceAddress: BluetoothAddress) -> Boolean = { true }
 
+    // Android's discovery API has no address based filter,
+    // so this hint is not used here.
+    override var discoveryAddressPrefix: List<Byte> = listOf()
+
     /**
      * Safe version of getParcelableExtra depending on Android version running
      */
@@ -172,6 +179,7 @@ class AndroidBluetoothInterface(private val androidContext: Context) : Bluetooth
         sdpServiceDescription: String,
         btPairingPin: String,
         discoveryDuration: Int,
+        discoveryMode: BluetoothInterface.DiscoveryMode,
         onDiscoveryStopped: (reason: BluetoothInterface.DiscoveryStoppedReason) -> Unit,
         onFoundNewPairedDevice: (deviceAddress: BluetoothAddress) -> Unit
     ) {
@@ -180,6 +188,7 @@ class AndroidBluetoothInterface(private val androidContext: Context) : Bluetooth
         previouslyDiscoveredDevices.clear()
         foundDevice = false
         discoveryStoppedReason = null
+        this.discoveryMode = discoveryMode
 
         // The Combo communicates over RFCOMM using the SDP Serial Port Profile.
         // We use an insecure socket, which means that it lacks an authenticated
@@ -438,8 +447,10 @@ class AndroidBluetoothInterface(private val androidContext: Context) : Bluetooth
             // BluetoothInterface.startDiscovery()
             // documentation requires.
             if (deviceFilterCallback(comboctlBtAddress)) {
-                foundDevice = true
-                stopDiscoveryInternal()
+                if (discoveryMode == BluetoothInterface.DiscoveryMode.SINGLE_DEVICE) {
+                    foundDevice = true
+                    stopDiscoveryInternal()
+                }
                 foundNewPairedDevice(comboctlBtAddress)
             }
         } catch (t: Throwable) {
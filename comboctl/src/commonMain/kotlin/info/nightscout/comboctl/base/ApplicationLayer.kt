@@ -757,6 +757,61 @@ object ApplicationLayer {
         }
     }
 
+    /**
+     * Precomputed outgoing application layer packet.
+     *
+     * This is meant for packets that are sent frequently and never change,
+     * like heartbeat packets. The transport layer DATA packet payload is
+     * produced once out of the given packet and stored in a
+     * [TransportLayer.DataPacketTemplate]. If this is an RT packet, the
+     * first 2 payload bytes are used as the template's patchable field,
+     * since that's where the RT sequence number is stored.
+     *
+     * See [PacketTemplates] for the predefined templates.
+     *
+     * @param packet Application layer packet to produce the template out of.
+     * @throws IllegalArgumentException if this is an RT packet, and its
+     *         payload has no room for the RT sequence number.
+     */
+    class PacketTemplate(packet: Packet) {
+        /**
+         * The command of the packet.
+         */
+        val command = packet.command
+
+        /**
+         * The transport layer DATA packet template.
+         */
+        val dataPacketTemplate = TransportLayer.DataPacketTemplate(
+            payload = packet.toTransportLayerPacketInfo().payload,
+            reliable = command.reliable,
+            patchableFieldOffset = if (command.serviceID == ServiceID.RT_MODE) PAYLOAD_BYTES_OFFSET else null
+        )
+
+        /**
+         * True if this is an RT packet that needs an RT sequence number.
+         */
+        val isRTPacket = (dataPacketTemplate.patchableFieldOffset != null)
+
+        private val description = packet.toString()
+
+        override fun toString() = description
+    }
+
+    /**
+     * Predefined templates for packets that are sent frequently.
+     *
+     * Templates are immutable, so these can be shared by all pumps.
+     */
+    object PacketTemplates {
+        val CMD_PING = PacketTemplate(createCMDPingPacket())
+        val CMD_READ_PUMP_STATUS = PacketTemplate(createCMDReadPumpStatusPacket())
+        val CMD_READ_HISTORY_BLOCK = PacketTemplate(createCMDReadHistoryBlockPacket())
+        val CMD_CONFIRM_HISTORY_BLOCK = PacketTemplate(createCMDConfirmHistoryBlockPacket())
+        val RT_KEEP_ALIVE = PacketTemplate(createRTKeepAlivePacket())
+        val RT_NO_BUTTON_STATUS_CHANGED = PacketTemplate(createRTButtonStatusPacket(RTButton.NO_BUTTON.id, buttonStatusChanged = true))
+    }
+
     /**
      * Parses the first 2 bytes of a packet's payload.
      *
@@ -11,6 +11,17 @@ open class BluetoothException(message: String?, cause: Throwable?) : ComboIOExce
     constructor(cause: Throwable) : this(null, cause)
 }
 
+/**
+ * Exception thrown when the Bluetooth link to a device is lost.
+ *
+ * Implementations throw this when they detect that the device went out of
+ * range or disconnected, typically sooner than a plain IO error would show
+ * up. It is safe to attempt reconnecting right away when this is caught.
+ *
+ * @param message The detail message.
+ */
+open class BluetoothLinkLostException(message: String) : BluetoothException(message)
+
 /**
  * Base class for exceptions that get thrown when permissions for scanning, connecting etc. are missing.
  *
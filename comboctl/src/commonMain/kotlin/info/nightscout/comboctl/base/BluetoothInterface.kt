@@ -23,6 +23,25 @@ interface BluetoothInterface {
         DISCOVERY_TIMEOUT("discovery timeout reached")
     }
 
+    /**
+     * What discovery does once it found a new paired device.
+     *
+     * Used as the discoveryMode argument of [startDiscovery].
+     */
+    enum class DiscoveryMode(val str: String) {
+        /**
+         * Stop discovery and announce the device. This is
+         * what is used for pairing with one device.
+         */
+        SINGLE_DEVICE("single device"),
+
+        /**
+         * Announce the device and keep discovery running, so that
+         * more devices can be paired in the same discovery session.
+         */
+        CONTINUOUS("continuous")
+    }
+
     /**
      * Callback for when a previously paired device is unpaired.
      *
@@ -71,6 +90,19 @@ interface BluetoothInterface {
      */
     var deviceFilterCallback: (deviceAddress: BluetoothAddress) -> Boolean
 
+    /**
+     * Address prefix of the devices that discovery shall look for.
+     *
+     * This is a hint that implementations can pass on to the Bluetooth
+     * stack, so that it drops devices with other addresses before they
+     * even reach the [deviceFilterCallback]. It does not replace that
+     * callback; implementations that cannot use this hint ignore it.
+     * The new value is used by the next [startDiscovery] call.
+     *
+     * The default value is an empty list, meaning no prefix.
+     */
+    var discoveryAddressPrefix: List<Byte>
+
     /**
      * Starts discovery of Bluetooth devices that haven't been paired yet.
      *
@@ -109,12 +141,22 @@ interface BluetoothInterface {
      * 3. The discovery timeout was reached and no device was discovered.
      *    The discoveryStopped callback is then called with its "reason"
      *    argument value set to [DiscoveryStoppedReason.DISCOVERY_TIMEOUT].
-     * 4. A device is discovered and paired (with the given pairing PIN).
+     *    (In [DiscoveryMode.CONTINUOUS] mode, this is also what happens
+     *    if devices were discovered.)
+     * 4. A device is discovered and paired (with the given pairing PIN),
+     *    and [discoveryMode] is [DiscoveryMode.SINGLE_DEVICE].
      *    The discoveryStopped callback is _not_ called in that case.
      *    The foundNewPairedDevice callback is called (after discovery
      *    was shut down), both announcing the newly discovered device to
      *    the caller and implicitly notifying that discovery stopped.
      *
+     * In [DiscoveryMode.CONTINUOUS] mode, discovery keeps running after a
+     * device was discovered and paired, and the foundNewPairedDevice
+     * callback is called for each such device. The pairing setup (SDP
+     * service, pairing PIN handling) stays in place for the entire
+     * session, which makes pairing many devices in a row much faster.
+     * Devices that get paired after discovery stopped are not announced.
+     *
      * @param sdpServiceName Name for the SDP service record.
      *        Must not be empty.
      * @param sdpServiceProvider Human-readable name of the provider of
@@ -126,14 +168,22 @@ interface BluetoothInterface {
      *        This PIN is a sequence of characters used by the Bluetooth
      *        stack for its pairing/authorization.
      * @param discoveryDuration How long the discovery shall go on,
-     *        in seconds. Must be a value between 1 and 300.
+     *        in seconds. Must be a value between 1 and 300. In
+     *        [DiscoveryMode.CONTINUOUS] mode, this is the duration
+     *        of the entire session.
+     * @param discoveryMode Whether to stop discovery after the first
+     *        discovered device or not. See [DiscoveryMode].
      * @param onDiscoveryStopped: Callback that gets invoked when discovery
      *        is stopped for any reason _other_ than that a device
      *        was discovered.
      * @param onFoundNewPairedDevice Callback that gets invoked when a device
      *        was found that passed the filter (see [deviceFilterCallback])
      *        and is paired. Exceptions thrown by this callback are logged,
-     *        but not propagated. Discovery is stopped before this is called.
+     *        but not propagated. In [DiscoveryMode.SINGLE_DEVICE] mode,
+     *        discovery is stopped before this is called. This may be called
+     *        from an internal thread that also handles the discovery, so
+     *        in [DiscoveryMode.CONTINUOUS] mode, hand the device over to
+     *        a coroutine instead of pairing with it in the callback.
      * @throws IllegalStateException if this is called again after
      *         discovery has been started already, or if the interface
      *         is in a state in which discovery is not possible, such as
@@ -153,6 +203,7 @@ interface BluetoothInterface {
         sdpServiceDescription: String,
         btPairingPin: String,
         discoveryDuration: Int,
+        discoveryMode: DiscoveryMode = DiscoveryMode.SINGLE_DEVICE,
         onDiscoveryStopped: (reason: DiscoveryStoppedReason) -> Unit,
         onFoundNewPairedDevice: (deviceAddress: BluetoothAddress) -> Unit
     )
@@ -14,27 +14,49 @@ package info.nightscout.comboctl.base
  * @return The computed checksum.
  */
 fun calculateCRC16MCRF4XX(data: List<Byte>, currentChecksum: Int = 0xFFFF): Int {
-    // Original implementation from https://gist.github.com/aurelj/270bb8af82f65fa645c1#gistcomment-2884584
+    var newChecksum = currentChecksum
 
-    if (data.isEmpty())
-        return currentChecksum
+    for (dataByte in data)
+        newChecksum = updateCRC16MCRF4XX(newChecksum, dataByte)
+
+    return newChecksum
+}
 
+/**
+ * Computes the CRC-16-MCRF4XX checksum out of a region of the given byte array.
+ *
+ * This behaves just like the [List] based variant, but does not require
+ * the data to be boxed. Outgoing packets are assembled in byte arrays,
+ * so this variant is used for those.
+ *
+ * @param data Byte array containing the data to compute the checksum out of.
+ * @param offset Offset of the first byte in the data array to use.
+ * @param length Number of bytes to use.
+ * @param currentChecksum Current checksum, or 0xFFFF as initial seed.
+ * @return The computed checksum.
+ */
+fun calculateCRC16MCRF4XX(data: ByteArray, offset: Int, length: Int, currentChecksum: Int = 0xFFFF): Int {
     var newChecksum = currentChecksum
 
-    for (dataByte in data) {
-        var t: Int
-        var L: Int
-
-        newChecksum = newChecksum xor dataByte.toPosInt()
-        // The "and 0xFF" are needed since the original C implementation
-        // worked with implicit 8-bit logic, meaning that only the lower
-        // 8 bits are kept - the rest is thrown away.
-        L = (newChecksum xor (newChecksum shl 4)) and 0xFF
-        t = ((L shl 3) or (L shr 5)) and 0xFF
-        L = L xor (t and 0x07)
-        t = (t and 0xF8) xor (((t shl 1) or (t shr 7)) and 0x0F) xor (newChecksum shr 8)
-        newChecksum = (L shl 8) or t
-    }
+    for (i in offset until (offset + length))
+        newChecksum = updateCRC16MCRF4XX(newChecksum, data[i])
 
     return newChecksum
 }
+
+private fun updateCRC16MCRF4XX(currentChecksum: Int, dataByte: Byte): Int {
+    // Original implementation from https://gist.github.com/aurelj/270bb8af82f65fa645c1#gistcomment-2884584
+
+    var t: Int
+    var L: Int
+
+    val newChecksum = currentChecksum xor dataByte.toPosInt()
+    // The "and 0xFF" are needed since the original C implementation
+    // worked with implicit 8-bit logic, meaning that only the lower
+    // 8 bits are kept - the rest is thrown away.
+    L = (newChecksum xor (newChecksum shl 4)) and 0xFF
+    t = ((L shl 3) or (L shr 5)) and 0xFF
+    L = L xor (t and 0x07)
+    t = (t and 0xF8) xor (((t shl 1) or (t shr 7)) and 0x0F) xor (newChecksum shr 8)
+    return (L shl 8) or t
+}
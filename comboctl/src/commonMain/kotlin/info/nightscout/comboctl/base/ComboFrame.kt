@@ -259,3 +259,56 @@ fun List<Byte>.toComboFrame(): List<Byte> {
 
     return escapedFrameData
 }
+
+/**
+ * Returns the maximum size of a Combo frame for a payload of the given size.
+ *
+ * This is the size of a frame in the worst case, which is when every
+ * payload byte has to be escaped. Buffers passed to [writeComboFrame]
+ * must be at least this large.
+ *
+ * @param payloadLength Size of the payload, in bytes.
+ * @return Maximum size of the resulting frame, in bytes.
+ */
+fun maxComboFrameSize(payloadLength: Int) = 1 + payloadLength * 2 + 1
+
+/**
+ * Writes a Combo frame out of the first bytes of this array into another array.
+ *
+ * This produces the same frame as [List<Byte>.toComboFrame], but writes it into
+ * a caller supplied array instead of allocating a new list. This allows for
+ * reusing one buffer for all outgoing frames.
+ *
+ * @param length Number of bytes from this array to use as the frame payload.
+ * @param destination Array to write the frame into. Its size must be at least
+ *        [maxComboFrameSize] of length.
+ * @return Number of bytes written into destination.
+ */
+fun ByteArray.writeComboFrame(length: Int, destination: ByteArray): Int {
+    require(length <= size)
+    require(destination.size >= maxComboFrameSize(length))
+
+    var frameLength = 0
+
+    destination[frameLength++] = FRAME_DELIMITER
+
+    for (i in 0 until length) {
+        when (val inputByte = this[i]) {
+            FRAME_DELIMITER -> {
+                destination[frameLength++] = ESCAPE_BYTE
+                destination[frameLength++] = ESCAPED_FRAME_DELIMITER
+            }
+
+            ESCAPE_BYTE -> {
+                destination[frameLength++] = ESCAPE_BYTE
+                destination[frameLength++] = ESCAPED_ESCAPE_BYTE
+            }
+
+            else -> destination[frameLength++] = inputByte
+        }
+    }
+
+    destination[frameLength++] = FRAME_DELIMITER
+
+    return frameLength
+}
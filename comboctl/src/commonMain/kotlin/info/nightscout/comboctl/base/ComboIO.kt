@@ -2,6 +2,7 @@ package info.nightscout.comboctl.base
 
 import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.CoroutineDispatcher
+import kotlinx.coroutines.sync.Mutex
 import kotlinx.coroutines.withContext
 
 /**
@@ -42,6 +43,28 @@ interface ComboIO {
      */
     suspend fun send(dataToSend: List<Byte>)
 
+    /**
+     * Sends the first bytes of the given array, suspending the coroutine until it is done.
+     *
+     * This behaves like the [List] based [send] variant. The array is only
+     * read during this call, so callers can reuse it afterwards. This allows
+     * for sending outgoing packets without having to box their bytes.
+     *
+     * The default implementation copies the bytes and calls the [List]
+     * based variant. Subclasses can override this to avoid that copy.
+     *
+     * @param data Array containing the data to send.
+     * @param length Number of bytes from the array to send. Must not be zero.
+     * @throws CancellationException if sending is aboted due to
+     *         a terminated IO, typically due to some sort of
+     *         disconnect function call.
+     * @throws ComboIOException if sending fails.
+     * @throws IllegalStateException if this object is in a state
+     *         that does not permit sending, such as a device
+     *         that has been shut down or isn't connected.
+     */
+    suspend fun send(data: ByteArray, length: Int) = send(data.copyOf(length).asList())
+
     /**
      * Receives a block of bytes, suspending the coroutine until it finishes.
      *
@@ -85,6 +108,12 @@ abstract class BlockingComboIO(val ioDispatcher: CoroutineDispatcher) : ComboIO
         }
     }
 
+    final override suspend fun send(data: ByteArray, length: Int) {
+        withContext(ioDispatcher) {
+            blockingSend(data, length)
+        }
+    }
+
     final override suspend fun receive(): List<Byte> {
         return withContext(ioDispatcher) {
             blockingReceive()
@@ -115,6 +144,28 @@ abstract class BlockingComboIO(val ioDispatcher: CoroutineDispatcher) : ComboIO
      */
     abstract fun blockingSend(dataToSend: List<Byte>)
 
+    /**
+     * Blocks the calling thread until the first bytes of the given array are fully sent.
+     *
+     * This behaves like the [List] based [blockingSend] variant. The array
+     * must not be accessed anymore once this function returns, since the
+     * caller may reuse it.
+     *
+     * The default implementation copies the bytes and calls the [List]
+     * based variant. Subclasses can override this to avoid that copy.
+     *
+     * @param data Array containing the data to send.
+     * @param length Number of bytes from the array to send. Must not be zero.
+     * @throws CancellationException if sending is aboted due to
+     *         a terminated IO, typically due to some sort of
+     *         disconnect function call.
+     * @throws ComboIOException if sending fails.
+     * @throws IllegalStateException if this object is in a state
+     *         that does not permit sending, such as a device
+     *         that has been shut down or isn't connected.
+     */
+    open fun blockingSend(data: ByteArray, length: Int) = blockingSend(data.copyOf(length).asList())
+
     /**
      * Blocks the calling thread until a given block of bytes is received.
      *
@@ -152,6 +203,31 @@ abstract class BlockingComboIO(val ioDispatcher: CoroutineDispatcher) : ComboIO
 class FramedComboIO(private val io: ComboIO) : ComboIO {
     override suspend fun send(dataToSend: List<Byte>) = io.send(dataToSend.toComboFrame())
 
+    override suspend fun send(data: ByteArray, length: Int) {
+        val maxFrameSize = maxComboFrameSize(length)
+
+        // The frame buffer is reused, so it must not be modified while
+        // an earlier frame is still being sent. Waiting for that send
+        // operation to finish is not an option, since it may be stuck
+        // in blocking IO (this happens when a disconnect packet is sent
+        // while the connection is stalled). Use a temporary buffer then.
+        if (!frameBufferMutex.tryLock()) {
+            val temporaryFrameBuffer = ByteArray(maxFrameSize)
+            io.send(temporaryFrameBuffer, data.writeComboFrame(length, temporaryFrameBuffer))
+            return
+        }
+
+        try {
+            if (frameBuffer.size < maxFrameSize)
+                frameBuffer = ByteArray(maxFrameSize)
+
+            val frameLength = data.writeComboFrame(length, frameBuffer)
+            io.send(frameBuffer, frameLength)
+        } finally {
+            frameBufferMutex.unlock()
+        }
+    }
+
     override suspend fun receive(): List<Byte> {
         try {
             // Loop until a full frame is parsed, an
@@ -160,7 +236,7 @@ class FramedComboIO(private val io: ComboIO) : ComboIO {
             // is thrown, so we won't end up in an
             // infinite loop here.
             while (true) {
-                val parseResult = frameParser.parseFrame()
+                val parseResult = traceSpan("transport", "deframe") { frameParser.parseFrame() }
                 if (parseResult == null) {
                     frameParser.pushData(io.receive())
                     continue
@@ -189,6 +265,8 @@ class FramedComboIO(private val io: ComboIO) : ComboIO {
     }
 
     private val frameParser = ComboFrameParser()
+    private val frameBufferMutex = Mutex()
+    private var frameBuffer = ByteArray(0)
 }
 
 /**
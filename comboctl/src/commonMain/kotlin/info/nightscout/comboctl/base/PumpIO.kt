@@ -16,8 +16,7 @@ import kotlinx.coroutines.flow.MutableStateFlow
 import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.flow.asStateFlow
 import kotlinx.coroutines.launch
-import kotlinx.coroutines.sync.Mutex
-import kotlinx.coroutines.sync.withLock
+import kotlinx.coroutines.selects.select
 import kotlinx.coroutines.withContext
 import kotlinx.datetime.Clock
 import kotlinx.datetime.LocalDateTime
@@ -123,8 +122,9 @@ class PumpIO(
     private val onNewDisplayFrame: (displayFrame: DisplayFrame?) -> Unit,
     private val onPacketReceiverException: (e: TransportLayer.PacketReceiverException) -> Unit
 ) {
-    // Mutex to synchronize sendPacketWithResponse and sendPacketWithoutResponse calls.
-    private val sendPacketMutex = Mutex()
+    // Scheduler to synchronize sendPacketWithResponse and sendPacketWithoutResponse
+    // calls. If several calls wait, the one with the highest priority goes first.
+    private val sendScheduler = SendScheduler()
 
     // RT sequence number. Used in outgoing RT packets.
     private var currentRTSequence: Int = 0
@@ -182,6 +182,17 @@ class PumpIO(
     // overflow behavior).
     private var rtButtonConfirmationBarrier = newRtButtonConfirmationBarrier()
 
+    // Informational RT packets (RT_DISPLAY, RT_BUTTON_CONFIRMATION etc.)
+    // are not processed by the packet receiver itself. Instead, they are
+    // passed through this channel to the RT packet processor coroutine.
+    // That way, assembling display frames and invoking onNewDisplayFrame
+    // never delays the forwarding of command responses and control
+    // packets, which are forwarded by the packet receiver right away.
+    // The channel is unlimited, since the packet receiver callback
+    // must not suspend. The Combo sends RT packets at a low rate, so
+    // the channel does not grow unless the processor gets stuck.
+    private var rtPacketChannel = newRtPacketChannel()
+
     private val displayFrameAssembler = DisplayFrameAssembler()
 
     // Whether we are in RT or COMMAND mode, or null at startup
@@ -265,6 +276,21 @@ class PumpIO(
      */
     fun isPaired() = pumpStateStore.hasPumpState(bluetoothDevice.address)
 
+    /**
+     * Returns statistics about the outgoing packet queues.
+     *
+     * Outgoing packets are sent one after the other, and if several wait
+     * to be sent, those with the highest [SendPriority] are sent first.
+     * The returned statistics contain the current and maximum queue
+     * depth and the wait times of each priority class. This is useful
+     * for checking that safety critical packets get sent in time.
+     *
+     * This can be called at any time, even when not connected.
+     *
+     * @return Statistics of all priority classes, ordered by priority.
+     */
+    suspend fun getSendQueueStats(): List<SendQueueStats> = sendScheduler.getStats()
+
     /**
      * Performs a pairing procedure with a Combo.
      *
@@ -646,6 +672,11 @@ class PumpIO(
         // (See the transportLayerIO initialization code.)
         rtButtonConfirmationBarrier = newRtButtonConfirmationBarrier()
 
+        // Discard any RT packets that may still be queued up from
+        // an earlier connection or from pairing.
+        rtPacketChannel.close()
+        rtPacketChannel = newRtPacketChannel()
+
         // Start the internal coroutine scope that will run the heartbeat,
         // packet receiver, and other internal coroutines. Enforce the
         // default dispatcher to rule out that something like the UI
@@ -657,6 +688,8 @@ class PumpIO(
         this.internalScopeJob = newScopeJob
         this.internalScope = newScope
 
+        startRTPacketProcessor(newScope)
+
         // Make sure the frame parser has no leftover data from
         // a previous connection.
         framedComboIO.reset()
@@ -789,6 +822,7 @@ class PumpIO(
         internalScope = null
         internalScopeJob?.cancelAndJoin()
         internalScopeJob = null
+        rtPacketChannel.close()
         _currentModeFlow.value = null
         onNewDisplayFrame(null)
 
@@ -835,7 +869,7 @@ class PumpIO(
      */
     suspend fun readCMDPumpStatus(): ApplicationLayer.CMDPumpStatus = runPumpIOCall("get pump status", Mode.COMMAND) {
         val packet = sendPacketWithResponse(
-            ApplicationLayer.createCMDReadPumpStatusPacket(),
+            ApplicationLayer.PacketTemplates.CMD_READ_PUMP_STATUS,
             ApplicationLayer.Command.CMD_READ_PUMP_STATUS_RESPONSE
         )
         return@runPumpIOCall ApplicationLayer.parseCMDReadPumpStatusResponsePacket(packet)
@@ -906,34 +940,52 @@ class PumpIO(
             val historyDelta = mutableListOf<ApplicationLayer.CMDHistoryEvent>()
             var reachedEnd = false
 
+            // The read and confirm packets carry no payload that changes
+            // between requests, so use their predefined templates.
+            val readHistoryBlockPacket = ApplicationLayer.PacketTemplates.CMD_READ_HISTORY_BLOCK
+            val confirmHistoryBlockPacket = ApplicationLayer.PacketTemplates.CMD_CONFIRM_HISTORY_BLOCK
+
             // Keep requesting history blocks until we reach the end,
             // and fill historyDelta with the events from each block,
             // skipping those events whose IDs are unknown (this is
             // taken care of by parseCMDReadHistoryBlockResponsePacket()).
             for (requestNr in 1 until maxRequests) {
-                // Request the current history block from the Combo.
-                val packet = sendPacketWithResponse(
-                    ApplicationLayer.createCMDReadHistoryBlockPacket(),
-                    ApplicationLayer.Command.CMD_READ_HISTORY_BLOCK_RESPONSE
-                )
+                // Each block is read and confirmed while holding the
+                // sendScheduler turn, instead of acquiring it (and restarting
+                // the heartbeat) for each individual packet. This way, no
+                // heartbeat packet can be interleaved between a history
+                // block and its confirmation. The turn is released between
+                // blocks, so other packets are not held back for the entire
+                // exchange, and cancellation takes effect between blocks.
+                val historyBlock = sendScheduler.withLock(SendPriority.COMMAND) {
+                    withContext(NonCancellable) {
+                        restartHeartbeat()
 
-                // Try to parse and validate the packet data.
-                val historyBlock = try {
-                    ApplicationLayer.parseCMDReadHistoryBlockResponsePacket(packet)
-                } catch (t: Throwable) {
-                    logger(LogLevel.ERROR) {
-                        "Could not parse history block; data may have been corrupted; requesting the block again (throwable: $t)"
-                    }
-                    continue
-                }
+                        // Request the current history block from the Combo.
+                        sendAppLayerPacket(readHistoryBlockPacket)
+                        val packet = receiveAppLayerPacket(ApplicationLayer.Command.CMD_READ_HISTORY_BLOCK_RESPONSE)
 
-                // Confirm this history block to let the Combo consider
-                // it processed. The Combo can then move on to the next
-                // history block.
-                sendPacketWithResponse(
-                    ApplicationLayer.createCMDConfirmHistoryBlockPacket(),
-                    ApplicationLayer.Command.CMD_CONFIRM_HISTORY_BLOCK_RESPONSE
-                )
+                        // Try to parse and validate the packet data.
+                        val block = try {
+                            ApplicationLayer.parseCMDReadHistoryBlockResponsePacket(packet)
+                        } catch (t: Throwable) {
+                            logger(LogLevel.ERROR) {
+                                "Could not parse history block; data may have been corrupted; requesting the block again (throwable: $t)"
+                            }
+                            null
+                        }
+
+                        // Confirm this history block to let the Combo consider
+                        // it processed. The Combo can then move on to the next
+                        // history block.
+                        if (block != null) {
+                            sendAppLayerPacket(confirmHistoryBlockPacket)
+                            receiveAppLayerPacket(ApplicationLayer.Command.CMD_CONFIRM_HISTORY_BLOCK_RESPONSE)
+                        }
+
+                        block
+                    }
+                } ?: continue
 
                 historyDelta.addAll(historyBlock.events)
 
@@ -952,6 +1004,8 @@ class PumpIO(
                     "Did not reach an end of the history event list even after $maxRequests request(s)"
                 )
 
+            logger(LogLevel.DEBUG) { "Retrieved history delta with ${historyDelta.size} event(s)" }
+
             return@runPumpIOCall historyDelta
         }
     }
@@ -1125,9 +1179,7 @@ class PumpIO(
                 // code to finish the short button press, even if
                 // an exception is thrown.
                 try {
-                    sendPacketWithoutResponse(
-                        ApplicationLayer.createRTButtonStatusPacket(ApplicationLayer.RTButton.NO_BUTTON.id, true)
-                    )
+                    sendPacketWithoutResponse(ApplicationLayer.PacketTemplates.RT_NO_BUTTON_STATUS_CHANGED)
                 } catch (t: Throwable) {
                     // The various IO operations in this function need to be viewed as being part
                     // of one big IO activity. That is, the RT button sending above _and_ the
@@ -1191,7 +1243,8 @@ class PumpIO(
      * [stopLongRTButtonPress] is called. In both cases, a command is
      * sent to the Combo to signal that the user "released" the buttons.
      *
-     * If the [keepGoing] predicate is set, it is called before sending
+     * If the [keepGoing] predicate is set, it is called once before
+     * sending the first confirmation command, and then after sending
      * each confirmation command. This is particularly useful for
      * aborting the loop at just the right time. In the Combo, this
      * command triggers updates associated with the button(s) and the
@@ -1206,6 +1259,14 @@ class PumpIO(
      * see that the bolus amount is incremented even after "releasing"
      * the button.
      *
+     * The calls after sending a confirmation command run while the
+     * Combo's button confirmation is being waited for, so waiting for
+     * the display frame and waiting for the confirmation overlap. If
+     * keepGoing returns false before the confirmation arrives, the
+     * buttons are released right away instead of waiting for it. This
+     * way, each step of the long press takes as long as the slower one
+     * of these two waits, and not as long as both of them combined.
+     *
      * @param buttons What button(s) to long-press.
      * @param keepGoing Predicate for deciding whether to continue
      *        the internal loop. If this is set to null, the loop
@@ -1321,7 +1382,7 @@ class PumpIO(
             // context. We must make sure that _nothing_ else is communicated with the
             // Combo during the mode switch. Using these blocks guarantees that. That's why
             // we don't use sendPacketWithResponse() here and instead handle this manually.
-            sendPacketMutex.withLock {
+            sendScheduler.withLock(SendPriority.CONTROL) {
                 withContext(NonCancellable) {
                     _currentModeFlow.value?.let { modeToDeactivate ->
                         logger(LogLevel.DEBUG) { "Deactivating current service" }
@@ -1401,13 +1462,16 @@ class PumpIO(
     private fun newRtButtonConfirmationBarrier() =
         Channel<Boolean>(capacity = Channel.CONFLATED)
 
+    private fun newRtPacketChannel() =
+        Channel<TransportLayer.Packet>(capacity = Channel.UNLIMITED)
+
     private fun getCombinedButtonCodes(buttons: List<ApplicationLayer.RTButton>) =
         buttons.fold(0) { codes, button -> codes or button.id }
 
     private fun toString(buttons: List<ApplicationLayer.RTButton>) = buttons.joinToString(" ") { it.str }
 
     // The sendPacketWithResponse and sendPacketWithoutResponse calls
-    // are surrounded by a sendPacketMutex lock to prevent these functions
+    // are surrounded by a sendScheduler lock to prevent these functions
     // from being called concurrently. This is essential, since the Combo
     // cannot handle such concurrent calls. In particular, if a command
     // that is sent to the Combo will cause the pump to respond with
@@ -1415,8 +1479,10 @@ class PumpIO(
     // _before_ sending another command to the pump. (The main potential
     // cause of concurrent send calls are the heartbeat coroutines.)
     //
-    // Note that these functions use a coroutine mutex, not a "classical",
-    // thread level mutex. See kotlinx.coroutines.sync.Mutex for details.
+    // Note that these functions use a coroutine lock, not a "classical",
+    // thread level mutex. See SendScheduler for details. If several of
+    // these calls wait for the lock, the one whose packet has the highest
+    // priority (see getSendPriority()) is let through first.
     //
     // Furthermore, these use the NonCancellable context to prevent the
     // prompt cancellation guarantee from cancelling any send attempts.
@@ -1424,7 +1490,7 @@ class PumpIO(
     private suspend fun sendPacketWithResponse(
         tpLayerPacketInfo: TransportLayer.OutgoingPacketInfo,
         expectedResponseCommand: TransportLayer.Command? = null
-    ): TransportLayer.Packet = sendPacketMutex.withLock {
+    ): TransportLayer.Packet = sendScheduler.withLock(SendPriority.CONTROL) {
         return withContext(NonCancellable) {
             transportLayerIO.send(tpLayerPacketInfo)
             transportLayerIO.receive(expectedResponseCommand)
@@ -1435,33 +1501,33 @@ class PumpIO(
         appLayerPacketToSend: ApplicationLayer.Packet,
         expectedResponseCommand: ApplicationLayer.Command? = null,
         doRestartHeartbeat: Boolean = true
-    ): ApplicationLayer.Packet = sendPacketMutex.withLock {
+    ): ApplicationLayer.Packet = sendScheduler.withLock(getSendPriority(appLayerPacketToSend.command)) {
         return withContext(NonCancellable) {
             if (doRestartHeartbeat)
                 restartHeartbeat()
 
             sendAppLayerPacket(appLayerPacketToSend)
+            receiveAppLayerPacket(expectedResponseCommand)
+        }
+    }
 
-            logger(LogLevel.VERBOSE) {
-                if (expectedResponseCommand == null)
-                    "Waiting for application layer packet (will arrive in a transport layer DATA packet)"
-                else
-                    "Waiting for application layer ${expectedResponseCommand.name} " +
-                    "packet (will arrive in a transport layer DATA packet)"
-            }
-
-            val receivedAppLayerPacket = transportLayerIO.receive(TransportLayer.Command.DATA).toAppLayerPacket()
-
-            if ((expectedResponseCommand != null) && (receivedAppLayerPacket.command != expectedResponseCommand))
-                throw ApplicationLayer.IncorrectPacketException(receivedAppLayerPacket, expectedResponseCommand)
+    private suspend fun sendPacketWithResponse(
+        packetTemplate: ApplicationLayer.PacketTemplate,
+        expectedResponseCommand: ApplicationLayer.Command? = null,
+        doRestartHeartbeat: Boolean = true
+    ): ApplicationLayer.Packet = sendScheduler.withLock(getSendPriority(packetTemplate.command)) {
+        return withContext(NonCancellable) {
+            if (doRestartHeartbeat)
+                restartHeartbeat()
 
-            receivedAppLayerPacket
+            sendAppLayerPacket(packetTemplate)
+            receiveAppLayerPacket(expectedResponseCommand)
         }
     }
 
     private suspend fun sendPacketWithoutResponse(
         tpLayerPacketInfo: TransportLayer.OutgoingPacketInfo
-    ) = sendPacketMutex.withLock {
+    ) = sendScheduler.withLock(SendPriority.CONTROL) {
         withContext(NonCancellable) {
             transportLayerIO.send(tpLayerPacketInfo)
         }
@@ -1470,7 +1536,7 @@ class PumpIO(
     private suspend fun sendPacketWithoutResponse(
         appLayerPacketToSend: ApplicationLayer.Packet,
         doRestartHeartbeat: Boolean = true
-    ) = sendPacketMutex.withLock {
+    ) = sendScheduler.withLock(getSendPriority(appLayerPacketToSend.command)) {
         withContext(NonCancellable) {
             if (doRestartHeartbeat)
                 restartHeartbeat()
@@ -1478,10 +1544,39 @@ class PumpIO(
         }
     }
 
+    private suspend fun sendPacketWithoutResponse(
+        packetTemplate: ApplicationLayer.PacketTemplate,
+        doRestartHeartbeat: Boolean = true
+    ) = sendScheduler.withLock(getSendPriority(packetTemplate.command)) {
+        withContext(NonCancellable) {
+            if (doRestartHeartbeat)
+                restartHeartbeat()
+            sendAppLayerPacket(packetTemplate)
+        }
+    }
+
+    // Heartbeat packets get the CONTROL priority, since the Combo
+    // terminates the connection if they do not arrive in time.
+    private fun getSendPriority(command: ApplicationLayer.Command) =
+        when (command) {
+            ApplicationLayer.Command.CMD_PING,
+            ApplicationLayer.Command.RT_KEEP_ALIVE -> SendPriority.CONTROL
+
+            ApplicationLayer.Command.CMD_DELIVER_BOLUS,
+            ApplicationLayer.Command.CMD_CANCEL_BOLUS,
+            ApplicationLayer.Command.CMD_GET_BOLUS_STATUS -> SendPriority.CRITICAL
+
+            else -> when (command.serviceID) {
+                ApplicationLayer.ServiceID.CONTROL -> SendPriority.CONTROL
+                ApplicationLayer.ServiceID.RT_MODE -> SendPriority.RT_INPUT
+                ApplicationLayer.ServiceID.COMMAND_MODE -> SendPriority.COMMAND
+            }
+        }
+
     private suspend fun sendAppLayerPacket(appLayerPacket: ApplicationLayer.Packet) {
         // NOTE: This function does NOT lock a mutex and does NOT use
         // NonCancellable. Make sure to set these up before calling this.
-        check(sendPacketMutex.isLocked)
+        check(sendScheduler.isLocked)
 
         logger(LogLevel.VERBOSE) {
             "Sending application layer packet via transport layer:  $appLayerPacket"
@@ -1497,7 +1592,7 @@ class PumpIO(
                 )
             }
 
-            logger(LogLevel.VERBOSE) { "Writing current RT sequence number $currentRTSequence into packet" }
+            val rtSequence = takeRTSequence()
 
             // The RT sequence is always stored in the
             // first 2 bytes  of an RT packet's payload.
@@ -1509,21 +1604,68 @@ class PumpIO(
             // By writing the RT sequence into outgoingPacketInfo
             // instead, that change stays contained in here.
             outgoingPacketInfo.payload[ApplicationLayer.PAYLOAD_BYTES_OFFSET + 0] =
-                ((currentRTSequence shr 0) and 0xFF).toByte()
+                ((rtSequence shr 0) and 0xFF).toByte()
             outgoingPacketInfo.payload[ApplicationLayer.PAYLOAD_BYTES_OFFSET + 1] =
-                ((currentRTSequence shr 8) and 0xFF).toByte()
-
-            // After using the RT sequence, increment it to
-            // make sure the next RT packet doesn't use the
-            // same RT sequence.
-            currentRTSequence++
-            if (currentRTSequence > 65535)
-                currentRTSequence = 0
+                ((rtSequence shr 8) and 0xFF).toByte()
         }
 
         transportLayerIO.send(outgoingPacketInfo)
     }
 
+    private suspend fun sendAppLayerPacket(packetTemplate: ApplicationLayer.PacketTemplate) {
+        // NOTE: Like the ApplicationLayer.Packet variant above, this
+        // function does NOT lock a mutex and does NOT use NonCancellable.
+        check(sendScheduler.isLocked)
+
+        logger(LogLevel.VERBOSE) {
+            "Sending application layer packet template via transport layer:  $packetTemplate"
+        }
+
+        // The template's patchable field is where the RT sequence is
+        // stored in RT packets. Other packets have no such field.
+        val rtSequence = if (packetTemplate.isRTPacket) takeRTSequence() else 0
+
+        transportLayerIO.send(packetTemplate.dataPacketTemplate, rtSequence)
+    }
+
+    // Returns the RT sequence number to use in the next outgoing
+    // RT packet, and increments the current RT sequence number.
+    private fun takeRTSequence(): Int {
+        logger(LogLevel.VERBOSE) { "Writing current RT sequence number $currentRTSequence into packet" }
+
+        val rtSequence = currentRTSequence
+
+        // After using the RT sequence, increment it to
+        // make sure the next RT packet doesn't use the
+        // same RT sequence.
+        currentRTSequence++
+        if (currentRTSequence > 65535)
+            currentRTSequence = 0
+
+        return rtSequence
+    }
+
+    private suspend fun receiveAppLayerPacket(expectedResponseCommand: ApplicationLayer.Command?): ApplicationLayer.Packet {
+        // NOTE: Like sendAppLayerPacket(), this function does NOT lock
+        // a mutex and does NOT use NonCancellable.
+        check(sendScheduler.isLocked)
+
+        logger(LogLevel.VERBOSE) {
+            if (expectedResponseCommand == null)
+                "Waiting for application layer packet (will arrive in a transport layer DATA packet)"
+            else
+                "Waiting for application layer ${expectedResponseCommand.name} " +
+                "packet (will arrive in a transport layer DATA packet)"
+        }
+
+        val receivedAppLayerPacket = transportLayerIO.receive(TransportLayer.Command.DATA).toAppLayerPacket()
+
+        if ((expectedResponseCommand != null) && (receivedAppLayerPacket.command != expectedResponseCommand))
+            throw ApplicationLayer.IncorrectPacketException(receivedAppLayerPacket, expectedResponseCommand)
+
+        return receivedAppLayerPacket
+    }
+
     private fun processReceivedPacket(tpLayerPacket: TransportLayer.Packet) =
         if (tpLayerPacket.command == TransportLayer.Command.DATA) {
             when (ApplicationLayer.extractAppLayerPacketCommand(tpLayerPacket)) {
@@ -1533,27 +1675,17 @@ class PumpIO(
                     TransportLayer.IO.ReceiverBehavior.FORWARD_PACKET
                 }
 
-                ApplicationLayer.Command.RT_DISPLAY -> {
-                    processRTDisplayPayload(
-                        ApplicationLayer.parseRTDisplayPacket(tpLayerPacket.toAppLayerPacket())
-                    )
-                    // Signal the arrival of the button confirmation.
-                    // (Either RT_BUTTON_CONFIRMATION or RT_DISPLAY
-                    // function as confirmations.) Transmit "true"
-                    // to let the receivers know that everything
-                    // is OK and that they don't need to abort.
-                    rtButtonConfirmationBarrier.trySend(true)
-                    TransportLayer.IO.ReceiverBehavior.DROP_PACKET
-                }
-
-                ApplicationLayer.Command.RT_BUTTON_CONFIRMATION -> {
-                    logger(LogLevel.VERBOSE) { "Got RT_BUTTON_CONFIRMATION packet from the Combo" }
-                    // Signal the arrival of the button confirmation.
-                    // (Either RT_BUTTON_CONFIRMATION or RT_DISPLAY
-                    // function as confirmations.) Transmit "true"
-                    // to let the receivers know that everything
-                    // is OK and that they don't need to abort.
-                    rtButtonConfirmationBarrier.trySend(true)
+                // These packets are handed over to the RT packet processor.
+                // They are queued in the order they arrive, so for example
+                // a button confirmation is still signaled only after the
+                // display packets that preceded it were processed.
+                ApplicationLayer.Command.RT_DISPLAY,
+                ApplicationLayer.Command.RT_BUTTON_CONFIRMATION,
+                ApplicationLayer.Command.RT_AUDIO,
+                ApplicationLayer.Command.RT_PAUSE,
+                ApplicationLayer.Command.RT_RELEASE,
+                ApplicationLayer.Command.RT_VIBRATION -> {
+                    rtPacketChannel.trySend(tpLayerPacket)
                     TransportLayer.IO.ReceiverBehavior.DROP_PACKET
                 }
 
@@ -1563,37 +1695,6 @@ class PumpIO(
                     TransportLayer.IO.ReceiverBehavior.DROP_PACKET
                 }
 
-                // RT_AUDIO, RT_PAUSE, RT_RELEASE, RT_VIBRATION packets
-                // are purely for information. We just log them and
-                // otherwise ignore them.
-
-                ApplicationLayer.Command.RT_AUDIO -> {
-                    logger(LogLevel.VERBOSE) {
-                        val audioType = ApplicationLayer.parseRTAudioPacket(tpLayerPacket.toAppLayerPacket())
-                        "Got RT_AUDIO packet with audio type ${audioType.toHexString(8)}; ignoring"
-                    }
-                    TransportLayer.IO.ReceiverBehavior.DROP_PACKET
-                }
-
-                ApplicationLayer.Command.RT_PAUSE,
-                ApplicationLayer.Command.RT_RELEASE -> {
-                    logger(LogLevel.VERBOSE) {
-                        "Got ${ApplicationLayer.Command} packet with payload " +
-                                "${tpLayerPacket.toAppLayerPacket().payload.toHexString()}; ignoring"
-                    }
-                    TransportLayer.IO.ReceiverBehavior.DROP_PACKET
-                }
-
-                ApplicationLayer.Command.RT_VIBRATION -> {
-                    logger(LogLevel.VERBOSE) {
-                        val vibrationType = ApplicationLayer.parseRTVibrationPacket(
-                            tpLayerPacket.toAppLayerPacket()
-                        )
-                        "Got RT_VIBRATION packet with vibration type ${vibrationType.toHexString(8)}; ignoring"
-                    }
-                    TransportLayer.IO.ReceiverBehavior.DROP_PACKET
-                }
-
                 // This is an information by the pump that something is wrong
                 // with the connection / with the service. This error is
                 // not recoverable. Throw an exception here to let the
@@ -1611,6 +1712,84 @@ class PumpIO(
         } else
             TransportLayer.IO.ReceiverBehavior.FORWARD_PACKET
 
+    private fun startRTPacketProcessor(scope: CoroutineScope) {
+        val channel = rtPacketChannel
+
+        scope.launch {
+            try {
+                for (tpLayerPacket in channel)
+                    processRTPacket(tpLayerPacket)
+            } catch (e: CancellationException) {
+                throw e
+            } catch (t: Throwable) {
+                // Treat this like a failure in the packet receiver, since
+                // before the RT packet processor existed, RT packets were
+                // processed there. Close the barrier to wake up any caller
+                // that is waiting for a button confirmation, and let the
+                // callback know that the connection is no longer usable.
+                val packetReceiverException = TransportLayer.PacketReceiverException(t)
+                rtButtonConfirmationBarrier.close(packetReceiverException)
+                onPacketReceiverException(packetReceiverException)
+            }
+        }
+    }
+
+    private fun processRTPacket(tpLayerPacket: TransportLayer.Packet) {
+        when (ApplicationLayer.extractAppLayerPacketCommand(tpLayerPacket)) {
+            ApplicationLayer.Command.RT_DISPLAY -> {
+                processRTDisplayPayload(
+                    ApplicationLayer.parseRTDisplayPacket(tpLayerPacket.toAppLayerPacket())
+                )
+                // Signal the arrival of the button confirmation.
+                // (Either RT_BUTTON_CONFIRMATION or RT_DISPLAY
+                // function as confirmations.) Transmit "true"
+                // to let the receivers know that everything
+                // is OK and that they don't need to abort.
+                rtButtonConfirmationBarrier.trySend(true)
+            }
+
+            ApplicationLayer.Command.RT_BUTTON_CONFIRMATION -> {
+                logger(LogLevel.VERBOSE) { "Got RT_BUTTON_CONFIRMATION packet from the Combo" }
+                // Signal the arrival of the button confirmation.
+                // (Either RT_BUTTON_CONFIRMATION or RT_DISPLAY
+                // function as confirmations.) Transmit "true"
+                // to let the receivers know that everything
+                // is OK and that they don't need to abort.
+                rtButtonConfirmationBarrier.trySend(true)
+            }
+
+            // RT_AUDIO, RT_PAUSE, RT_RELEASE, RT_VIBRATION packets
+            // are purely for information. We just log them and
+            // otherwise ignore them.
+
+            ApplicationLayer.Command.RT_AUDIO -> {
+                logger(LogLevel.VERBOSE) {
+                    val audioType = ApplicationLayer.parseRTAudioPacket(tpLayerPacket.toAppLayerPacket())
+                    "Got RT_AUDIO packet with audio type ${audioType.toHexString(8)}; ignoring"
+                }
+            }
+
+            ApplicationLayer.Command.RT_PAUSE,
+            ApplicationLayer.Command.RT_RELEASE -> {
+                logger(LogLevel.VERBOSE) {
+                    "Got ${ApplicationLayer.Command} packet with payload " +
+                            "${tpLayerPacket.toAppLayerPacket().payload.toHexString()}; ignoring"
+                }
+            }
+
+            ApplicationLayer.Command.RT_VIBRATION -> {
+                logger(LogLevel.VERBOSE) {
+                    val vibrationType = ApplicationLayer.parseRTVibrationPacket(
+                        tpLayerPacket.toAppLayerPacket()
+                    )
+                    "Got RT_VIBRATION packet with vibration type ${vibrationType.toHexString(8)}; ignoring"
+                }
+            }
+
+            else -> Unit
+        }
+    }
+
     private fun processRTDisplayPayload(rtDisplayPayload: ApplicationLayer.RTDisplayPayload) {
         // Feed the payload to the display frame assembler to let it piece together
         // frames and output them via the callback.
@@ -1670,7 +1849,7 @@ class PumpIO(
                 logger(LogLevel.VERBOSE) { "Transmitting CMD ping packet" }
                 try {
                     sendPacketWithResponse(
-                        ApplicationLayer.createCMDPingPacket(),
+                        ApplicationLayer.PacketTemplates.CMD_PING,
                         ApplicationLayer.Command.CMD_PING_RESPONSE,
                         doRestartHeartbeat = false
                     )
@@ -1750,7 +1929,7 @@ class PumpIO(
                 logger(LogLevel.VERBOSE) { "Transmitting RT keep-alive packet" }
                 try {
                     sendPacketWithoutResponse(
-                        ApplicationLayer.createRTKeepAlivePacket(),
+                        ApplicationLayer.PacketTemplates.RT_KEEP_ALIVE,
                         doRestartHeartbeat = false
                     )
                 } catch (e: CancellationException) {
@@ -1851,25 +2030,27 @@ class PumpIO(
                 // the pressed buttons.
                 var buttonStatusChanged = true
 
-                while (longRTPressLoopRunning) {
-                    // If there is a keepGoing predicate, call it _before_ sending
-                    // a button status packet in case keepGoing() wishes to abort
-                    // this loop already in its first iteration (for example, because
-                    // a quantity that is shown on-screen is already correct).
-                    if (keepGoing != null) {
-                        try {
-                            if (!keepGoing()) {
-                                logger(LogLevel.DEBUG) { "Aborting long RT button press flow" }
-                                break
-                            }
-                        } catch (e: CancellationException) {
-                            throw e
-                        } catch (t: Throwable) {
-                            logger(LogLevel.DEBUG) { "keepGoing callback threw error: $t" }
-                            throw t
-                        }
+                suspend fun evaluateKeepGoing(keepGoing: suspend () -> Boolean): Boolean {
+                    val result = try {
+                        keepGoing()
+                    } catch (e: CancellationException) {
+                        throw e
+                    } catch (t: Throwable) {
+                        logger(LogLevel.DEBUG) { "keepGoing callback threw error: $t" }
+                        throw t
                     }
+                    if (!result)
+                        logger(LogLevel.DEBUG) { "Aborting long RT button press flow" }
+                    return result
+                }
 
+                // If there is a keepGoing predicate, call it _before_ sending
+                // the first button status packet in case keepGoing() wishes to
+                // abort this loop right away (for example, because a quantity
+                // that is shown on-screen is already correct).
+                var keepPressing = (keepGoing == null) || evaluateKeepGoing(keepGoing)
+
+                while (longRTPressLoopRunning && keepPressing) {
                     // Dummy tryReceive() call to clear out the barrier in case it isn't empty.
                     rtButtonConfirmationBarrier.tryReceive()
 
@@ -1885,15 +2066,40 @@ class PumpIO(
                         ApplicationLayer.createRTButtonStatusPacket(buttonCodes, buttonStatusChanged)
                     )
 
-                    // Wait for the Combo to send us a button
-                    // confirmation. We cannot send more button
-                    // status commands until then.
+                    // Wait for the Combo to send us a button confirmation. We
+                    // cannot send more button status commands until then. The
+                    // keepGoing predicate typically waits for the display frame
+                    // that this button status produces, so it is evaluated at
+                    // the same time. If it returns false, the confirmation is not
+                    // waited for, since no more button status commands are sent.
+                    // (The NO_BUTTON packet below is still spaced apart from this
+                    // one by the transport layer's send throttling.)
                     logger(LogLevel.DEBUG) { "Waiting for button confirmation" }
-                    val canContinue = rtButtonConfirmationBarrier.receive()
-                    logger(LogLevel.DEBUG) { "Got button confirmation; canContinue = $canContinue" }
-
-                    if (!canContinue)
-                        break
+                    val keepGoingResult = keepGoing?.let { async { evaluateKeepGoing(it) } }
+                    try {
+                        var confirmed = false
+                        var evaluatedKeepGoing = (keepGoingResult == null)
+                        while (keepPressing && !(confirmed && evaluatedKeepGoing)) {
+                            select<Unit> {
+                                if (!confirmed) {
+                                    rtButtonConfirmationBarrier.onReceive { canContinue ->
+                                        logger(LogLevel.DEBUG) { "Got button confirmation; canContinue = $canContinue" }
+                                        confirmed = true
+                                        keepPressing = canContinue
+                                    }
+                                }
+                                if (!evaluatedKeepGoing) {
+                                    keepGoingResult!!.onAwait { result ->
+                                        evaluatedKeepGoing = true
+                                        keepPressing = result
+                                    }
+                                }
+                            }
+                        }
+                    } finally {
+                        // Only still running if the Combo told us to abort.
+                        keepGoingResult?.cancel()
+                    }
 
                     // The next time we send the button status, we must
                     // send NOT_CHANGED to the Combo.
@@ -1922,14 +2128,9 @@ class PumpIO(
                         // cancelled or not, and we shouldn't send button status packets
                         // to the Combo too quickly.
                         if (delayBeforeNoButton)
-                            delay(200L)
+                            delay(TransportLayer.PACKET_SEND_INTERVAL_IN_MS)
 
-                        sendPacketWithoutResponse(
-                            ApplicationLayer.createRTButtonStatusPacket(
-                                ApplicationLayer.RTButton.NO_BUTTON.id,
-                                buttonStatusChanged = true
-                            )
-                        )
+                        sendPacketWithoutResponse(ApplicationLayer.PacketTemplates.RT_NO_BUTTON_STATUS_CHANGED)
                     }
                 } catch (t: Throwable) {
                     // See the explanation inside sendShortRTButtonPress()
@@ -0,0 +1,216 @@
+package info.nightscout.comboctl.base
+
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.NonCancellable
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import kotlinx.coroutines.withContext
+
+/**
+ * Priority classes for outgoing packets.
+ *
+ * The order of the values defines the priority. Values that come
+ * first have a higher priority than the ones that come after them.
+ */
+enum class SendPriority {
+    /**
+     * Connection setup / teardown, mode switches, and heartbeat packets.
+     * If these are delayed too much, the Combo terminates the connection.
+     */
+    CONTROL,
+
+    /**
+     * Bolus delivery, bolus cancellation, and bolus status packets.
+     */
+    CRITICAL,
+
+    /**
+     * All other command mode packets.
+     */
+    COMMAND,
+
+    /**
+     * Remote terminal mode button packets.
+     */
+    RT_INPUT
+}
+
+/**
+ * Statistics about one [SendPriority] class of a [SendScheduler].
+ *
+ * @property priority Priority class these statistics are about.
+ * @property queueDepth Number of coroutines currently waiting for their turn.
+ * @property maxQueueDepth Highest number of coroutines that were waiting
+ *           at the same time.
+ * @property numTurns How many turns were granted so far.
+ * @property totalWaitTimeMs Sum of the time coroutines spent waiting
+ *           for their turn, in milliseconds.
+ * @property maxWaitTimeMs Longest time a coroutine spent waiting for
+ *           its turn, in milliseconds.
+ */
+data class SendQueueStats(
+    val priority: SendPriority,
+    val queueDepth: Int,
+    val maxQueueDepth: Int,
+    val numTurns: Long,
+    val totalWaitTimeMs: Long,
+    val maxWaitTimeMs: Long
+)
+
+/**
+ * Coroutine lock that grants turns to send packets based on priority.
+ *
+ * This behaves like a [Mutex], except that when it is unlocked and
+ * coroutines are waiting for it, the coroutine with the highest
+ * [SendPriority] is granted the next turn. Within a priority class,
+ * turns are granted in FIFO order. This makes sure that for example
+ * a bolus cancellation does not have to wait until all queued up RT
+ * button packets were sent.
+ *
+ * Turns are never preempted. A coroutine that got a turn keeps it until
+ * it calls [unlock]. The spacing between the packets themselves is done
+ * by the transport layer, which applies [TransportLayer.PACKET_SEND_INTERVAL_IN_MS]
+ * to all packets, regardless of their priority class, since the Combo's
+ * packet ring buffer is shared by all of them.
+ */
+class SendScheduler {
+    private class Waiter(val waitStartTimestamp: Long) {
+        val turnGranted = CompletableDeferred<Unit>()
+    }
+
+    private class PriorityClassState {
+        val waiters = ArrayDeque<Waiter>()
+        var maxQueueDepth = 0
+        var numTurns = 0L
+        var totalWaitTimeMs = 0L
+        var maxWaitTimeMs = 0L
+    }
+
+    // Guards all of the states below. It is only ever held
+    // for short periods, never while a turn is being used.
+    private val stateMutex = Mutex()
+    private var locked = false
+    private val priorityClassStates = Array(SendPriority.values().size) { PriorityClassState() }
+
+    /**
+     * True if a coroutine currently holds the turn.
+     */
+    val isLocked: Boolean
+        get() = locked
+
+    /**
+     * Suspends the calling coroutine until it is granted a turn.
+     *
+     * If the coroutine is cancelled while waiting, it leaves the queue
+     * (or, if it was granted the turn in the meantime, gives it up).
+     *
+     * @param priority Priority class of the packets that are to be sent.
+     */
+    suspend fun lock(priority: SendPriority) {
+        val classState = priorityClassStates[priority.ordinal]
+        val waitStartTimestamp = getMonotonicTimeInMs()
+
+        val waiter = stateMutex.withLock {
+            if (!locked) {
+                locked = true
+                recordTurn(classState, waitTimeMs = 0)
+                return
+            }
+
+            Waiter(waitStartTimestamp).also {
+                classState.waiters.addLast(it)
+                classState.maxQueueDepth = kotlin.math.max(classState.maxQueueDepth, classState.waiters.size)
+            }
+        }
+
+        // The turn is recorded by grantNextTurn() when it is granted, so
+        // nothing that could be cancelled has to happen after await().
+        // Otherwise, a cancellation at that point would leave the
+        // scheduler locked, with no coroutine holding the turn.
+        try {
+            waiter.turnGranted.await()
+        } catch (t: Throwable) {
+            // This is typically a CancellationException.
+            withContext(NonCancellable) {
+                stateMutex.withLock {
+                    // If the waiter is not in the queue anymore, then the
+                    // turn was granted to it right before the cancellation.
+                    // Pass that turn on, otherwise it would be lost.
+                    if (!classState.waiters.remove(waiter))
+                        grantNextTurn()
+                }
+            }
+            throw t
+        }
+    }
+
+    /**
+     * Ends the current turn and grants the next one, if any coroutine is waiting.
+     *
+     * @throws IllegalStateException if no coroutine currently holds the turn.
+     */
+    suspend fun unlock() {
+        stateMutex.withLock {
+            check(locked) { "Attempted to unlock a send scheduler that is not locked" }
+            grantNextTurn()
+        }
+    }
+
+    /**
+     * Runs the given block once the calling coroutine was granted a turn.
+     *
+     * The turn is ended when the block finishes, even if it throws.
+     *
+     * @param priority Priority class of the packets that are sent in the block.
+     * @param block Block to run.
+     * @return The block's return value.
+     */
+    suspend inline fun <T> withLock(priority: SendPriority, block: () -> T): T {
+        lock(priority)
+        try {
+            return block()
+        } finally {
+            withContext(NonCancellable) {
+                unlock()
+            }
+        }
+    }
+
+    /**
+     * Returns statistics about all priority classes, ordered by priority.
+     */
+    suspend fun getStats(): List<SendQueueStats> = stateMutex.withLock {
+        SendPriority.values().map { priority ->
+            val classState = priorityClassStates[priority.ordinal]
+            SendQueueStats(
+                priority = priority,
+                queueDepth = classState.waiters.size,
+                maxQueueDepth = classState.maxQueueDepth,
+                numTurns = classState.numTurns,
+                totalWaitTimeMs = classState.totalWaitTimeMs,
+                maxWaitTimeMs = classState.maxWaitTimeMs
+            )
+        }
+    }
+
+    // Must be called with stateMutex held.
+    private fun grantNextTurn() {
+        for (classState in priorityClassStates) {
+            val nextWaiter = classState.waiters.removeFirstOrNull() ?: continue
+            // The lock stays locked, since the turn is handed
+            // directly over to the next waiting coroutine.
+            recordTurn(classState, waitTimeMs = getMonotonicTimeInMs() - nextWaiter.waitStartTimestamp)
+            nextWaiter.turnGranted.complete(Unit)
+            return
+        }
+
+        locked = false
+    }
+
+    // Must be called with stateMutex held.
+    private fun recordTurn(classState: PriorityClassState, waitTimeMs: Long) {
+        classState.numTurns++
+        classState.totalWaitTimeMs += waitTimeMs
+        classState.maxWaitTimeMs = kotlin.math.max(classState.maxWaitTimeMs, waitTimeMs)
+    }
+}
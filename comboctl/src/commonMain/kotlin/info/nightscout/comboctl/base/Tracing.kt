@@ -0,0 +1,63 @@
+package info.nightscout.comboctl.base
+
+/**
+ * Interface for backends that record timing spans.
+ *
+ * Backends are supposed to put these spans into one timeline together
+ * with spans recorded by the platform's own code (for example, the
+ * native BlueZ code on Linux), which is why the backend also supplies
+ * the timestamps.
+ */
+interface TraceBackend {
+    /**
+     * Returns the current timestamp in nanoseconds.
+     *
+     * The timestamp must come from a monotonic clock. Its origin
+     * is unspecified; only differences between timestamps matter.
+     */
+    fun getTimestampInNs(): Long
+
+    /**
+     * Records a span.
+     *
+     * @param category Category of the span, like "transport".
+     * @param name Name of the span.
+     * @param startTimestampInNs Timestamp of the span's beginning,
+     *        as returned by [getTimestampInNs].
+     * @param durationInNs Duration of the span in nanoseconds.
+     */
+    fun addSpan(category: String, name: String, startTimestampInNs: Long, durationInNs: Long)
+}
+
+/**
+ * Main tracing interface.
+ *
+ * Tracing is disabled by default. Applications can enable it by
+ * setting [Tracer.backend] to a backend. Spans are recorded with
+ * [traceSpan], which does nothing other than running its block
+ * if no backend is set.
+ */
+object Tracer {
+    var backend: TraceBackend? = null
+}
+
+/**
+ * Runs the given block and records its duration as a span.
+ *
+ * If no [Tracer.backend] is set, this just runs the block.
+ *
+ * @param category Category of the span.
+ * @param name Name of the span.
+ * @param block Block to run.
+ * @return The return value of the block.
+ */
+inline fun <T> traceSpan(category: String, name: String, block: () -> T): T {
+    val backend = Tracer.backend ?: return block()
+
+    val startTimestamp = backend.getTimestampInNs()
+    try {
+        return block()
+    } finally {
+        backend.addSpan(category, name, startTimestamp, backend.getTimestampInNs() - startTimestamp)
+    }
+}
@@ -10,6 +10,8 @@ import kotlinx.coroutines.channels.Channel
 import kotlinx.coroutines.delay
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.plus
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
 import kotlinx.coroutines.withContext
 
 private val logger = Logger.get("TransportLayer")
@@ -339,76 +341,11 @@ object TransportLayer {
         fun verifyAuthentication(cipher: Cipher): Boolean =
             calculateMAC(cipher) == machineAuthenticationCode
 
-        // This computes the MAC using Two-Fish and a modified RFC3610 CCM authentication
-        // process. See "Packet authentication" in combo-comm-spec.adoc for details.
         private fun calculateMAC(cipher: Cipher): MachineAuthCode {
-            val macBytes = ArrayList<Byte>(NUM_MAC_BYTES)
-            var block = ByteArray(CIPHER_BLOCK_SIZE)
-
-            // Set up B_0.
-            block[0] = 0x79
-            for (i in 0 until NUM_NONCE_BYTES) block[i + 1] = nonce[i]
-            block[14] = 0x00
-            block[15] = 0x00
-
-            // Produce X_1 out of B_0.
-            block = cipher.encrypt(block)
-
-            val packetData = toByteList(withMAC = false, withPayload = true)
-            val numDataBlocks = packetData.size / CIPHER_BLOCK_SIZE
-
-            // Repeatedly produce X_i+1 out of X_i and B_i.
-            // X_i is the current block value, B_i is the
-            // data from packetData that is being accessed
-            // inside the loop.
-            for (dataBlockNr in 0 until numDataBlocks) {
-                for (i in 0 until CIPHER_BLOCK_SIZE) {
-                    val a: Int = block[i].toPosInt()
-                    val b: Int = packetData[dataBlockNr * CIPHER_BLOCK_SIZE + i].toPosInt()
-                    block[i] = (a xor b).toByte()
-                }
-
-                block = cipher.encrypt(block)
-            }
-
-            // Handle the last block, and apply padding if needed.
-            val remainingDataBytes = packetData.size - numDataBlocks * CIPHER_BLOCK_SIZE
-            if (remainingDataBytes > 0) {
-                for (i in 0 until remainingDataBytes) {
-                    val a: Int = block[i].toPosInt()
-                    val b: Int = packetData[packetData.size - remainingDataBytes + i].toPosInt()
-                    block[i] = (a xor b).toByte()
-                }
-
-                val paddingValue = 16 - remainingDataBytes
-
-                for (i in remainingDataBytes until CIPHER_BLOCK_SIZE)
-                    block[i] = ((block[i].toPosInt()) xor paddingValue).toByte()
-
-                block = cipher.encrypt(block)
-            }
-
-            // Here, the non-standard portion of the authentication starts.
-
-            // Produce the "U" value.
-            for (i in 0 until NUM_MAC_BYTES)
-                macBytes.add(block[i])
-
-            // Produce the new B_0.
-            block[0] = 0x41
-            for (i in 0 until NUM_NONCE_BYTES) block[i + 1] = nonce[i]
-            block[14] = 0x00
-            block[15] = 0x00
-
-            // Produce X_1 out of the new B_0.
-            block = cipher.encrypt(block)
-
-            // Compute the final MAC out of U and the
-            // first 8 bytes of X_1 XORed together.
-            for (i in 0 until NUM_MAC_BYTES)
-                macBytes[i] = ((macBytes[i].toPosInt()) xor (block[i].toPosInt())).toByte()
-
-            return MachineAuthCode(macBytes)
+            val packetData = toByteList(withMAC = false, withPayload = true).toByteArray()
+            val macBytes = ByteArray(NUM_MAC_BYTES)
+            writeMachineAuthCode(cipher, packetData, packetData.size, macBytes, 0)
+            return MachineAuthCode(macBytes.asList())
         }
 
         override fun toString() =
@@ -455,6 +392,235 @@ object TransportLayer {
                     "  payload: ${payload.size} byte(s): [${payload.toHexString()}]"
     }
 
+    /**
+     * Precomputed template for outgoing DATA packets.
+     *
+     * Some packets are sent very frequently, and their payload never changes,
+     * except for an optional 16-bit field (the RT sequence number of RT mode
+     * packets). Instead of producing an [OutgoingPacketInfo] for each of them,
+     * their header and payload bytes are computed once and stored here. The
+     * [OutgoingPacketEncoder] then only needs to copy these bytes, patch the
+     * per-packet fields (sequence bit, address, nonce, and the optional 16-bit
+     * field), and compute the MAC.
+     *
+     * Note that the MAC itself cannot be partially precomputed. The first
+     * block of the CCM chain already contains the nonce, so every cipher
+     * block depends on per-packet data.
+     *
+     * Instances are immutable and can be shared.
+     *
+     * @param payload Payload of the DATA packet.
+     * @property reliable True if the packet's reliability bit shall be set to 1.
+     * @property patchableFieldOffset Offset of a 16-bit little endian field in the
+     *           payload that is patched when encoding the packet, or null if the
+     *           payload contains no such field.
+     * @throws IllegalArgumentException if the payload size exceeds
+     *         [MAX_VALID_PAYLOAD_SIZE], or if the patchable field
+     *         lies outside of the payload.
+     */
+    class DataPacketTemplate(
+        payload: List<Byte>,
+        val reliable: Boolean,
+        val patchableFieldOffset: Int? = null
+    ) {
+        /**
+         * Size of the payload, in bytes.
+         */
+        val payloadSize = payload.size
+
+        // Header and payload bytes. The sequence bit, address
+        // and nonce are left at zero. They are set by the
+        // encoder, since they are different for each packet.
+        internal val headerAndPayload = ByteArray(PACKET_HEADER_SIZE + payloadSize)
+
+        init {
+            require(payloadSize <= MAX_VALID_PAYLOAD_SIZE) {
+                "Payload size $payloadSize exceeds allowed maximum of $MAX_VALID_PAYLOAD_SIZE bytes"
+            }
+            require((patchableFieldOffset == null) || ((patchableFieldOffset >= 0) && ((patchableFieldOffset + 2) <= payloadSize))) {
+                "Patchable field at offset $patchableFieldOffset does not fit in payload with $payloadSize byte(s)"
+            }
+
+            headerAndPayload[VERSION_BYTE_OFFSET] = 0x10
+            headerAndPayload[SEQ_REL_CMD_BYTE_OFFSET] = ((if (reliable) 0x20 else 0) or Command.DATA.id).toByte()
+            headerAndPayload[PAYLOAD_LENGTH_BYTES_OFFSET + 0] = (payloadSize and 0xFF).toByte()
+            headerAndPayload[PAYLOAD_LENGTH_BYTES_OFFSET + 1] = ((payloadSize shr 8) and 0xFF).toByte()
+            for (i in 0 until payloadSize)
+                headerAndPayload[PAYLOAD_BYTES_OFFSET + i] = payload[i]
+        }
+
+        override fun toString() =
+            "reliable: $reliable" +
+                    "  patchable field offset: ${patchableFieldOffset ?: "<none>"}" +
+                    "  payload: $payloadSize byte(s): [${headerAndPayload.asList().drop(PAYLOAD_BYTES_OFFSET).toHexString()}]"
+    }
+
+    /**
+     * Class for encoding outgoing packets into a reusable byte array.
+     *
+     * This produces the same bytes as setting up a [Packet], calling its
+     * [Packet.computeCRC16Payload] or [Packet.authenticate] function, and
+     * serializing it with [Packet.toByteList]. However, the header, payload,
+     * and MAC are written in one pass directly into [packetData], without
+     * boxing any of the bytes and without intermediate lists. That array is
+     * reused for subsequent packets, and only reallocated if a packet does
+     * not fit into it.
+     *
+     * The [IO] class uses this for all of its outgoing packets. Instances are
+     * not thread safe, and [packetData] is overwritten by the next [encode]
+     * call, so the encoded packet must be consumed before then.
+     */
+    class OutgoingPacketEncoder {
+        /**
+         * Array containing the most recently encoded packet.
+         *
+         * Only the first [packetLength] bytes are valid.
+         */
+        var packetData = ByteArray(PACKET_HEADER_SIZE + DEFAULT_PAYLOAD_CAPACITY + NUM_MAC_BYTES)
+            private set
+
+        /**
+         * Size of the most recently encoded packet, in bytes.
+         */
+        var packetLength = 0
+            private set
+
+        /**
+         * Encodes a packet into [packetData].
+         *
+         * @param command The command of the packet.
+         * @param sequenceBit The packet's sequence bit.
+         * @param reliabilityBit The packet's reliability bit.
+         * @param address The packet's address byte.
+         * @param nonce The packet's nonce.
+         * @param payload The packet's payload. Ignored if withCRC16Payload is true.
+         * @param cipher Cipher to authenticate the packet with. If this is null,
+         *        the packet gets a MAC made of nullbytes.
+         * @param withCRC16Payload If true, the payload is replaced by the 2-byte
+         *        CRC-16-MCRF4XX checksum of the packet header, like
+         *        [Packet.computeCRC16Payload] does.
+         * @param version The packet's version byte.
+         * @return Size of the encoded packet, in bytes.
+         * @throws IllegalArgumentException if the payload size exceeds
+         *         [MAX_VALID_PAYLOAD_SIZE].
+         */
+        fun encode(
+            command: Command,
+            sequenceBit: Boolean,
+            reliabilityBit: Boolean,
+            address: Byte,
+            nonce: Nonce,
+            payload: List<Byte>,
+            cipher: Cipher?,
+            withCRC16Payload: Boolean,
+            version: Byte = 0x10
+        ): Int {
+            val payloadSize = if (withCRC16Payload) 2 else payload.size
+            if (payloadSize > MAX_VALID_PAYLOAD_SIZE) {
+                throw IllegalArgumentException(
+                    "Payload size $payloadSize exceeds allowed maximum of $MAX_VALID_PAYLOAD_SIZE bytes"
+                )
+            }
+
+            val macOffset = PAYLOAD_BYTES_OFFSET + payloadSize
+            val length = macOffset + NUM_MAC_BYTES
+            if (packetData.size < length)
+                packetData = ByteArray(length)
+
+            val data = packetData
+
+            data[VERSION_BYTE_OFFSET] = version
+            data[SEQ_REL_CMD_BYTE_OFFSET] = ((if (sequenceBit) 0x80 else 0)
+                    or (if (reliabilityBit) 0x20 else 0)
+                    or command.id).toByte()
+            data[PAYLOAD_LENGTH_BYTES_OFFSET + 0] = (payloadSize and 0xFF).toByte()
+            data[PAYLOAD_LENGTH_BYTES_OFFSET + 1] = ((payloadSize shr 8) and 0xFF).toByte()
+            data[ADDRESS_BYTE_OFFSET] = address
+            for (i in 0 until NUM_NONCE_BYTES)
+                data[NONCE_BYTES_OFFSET + i] = nonce[i]
+
+            if (withCRC16Payload) {
+                val calculatedCRC16 = calculateCRC16MCRF4XX(data, 0, PACKET_HEADER_SIZE)
+                data[PAYLOAD_BYTES_OFFSET + 0] = (calculatedCRC16 and 0xFF).toByte()
+                data[PAYLOAD_BYTES_OFFSET + 1] = ((calculatedCRC16 shr 8) and 0xFF).toByte()
+            } else {
+                for (i in 0 until payloadSize)
+                    data[PAYLOAD_BYTES_OFFSET + i] = payload[i]
+            }
+
+            if (cipher != null)
+                writeMachineAuthCode(cipher, data, macOffset, data, macOffset)
+            else
+                data.fill(0x00, macOffset, length)
+
+            packetLength = length
+            return length
+        }
+
+        /**
+         * Encodes a DATA packet out of a template into [packetData].
+         *
+         * This copies the template's precomputed header and payload bytes,
+         * patches in the per-packet fields, and authenticates the packet.
+         *
+         * @param template Template of the DATA packet to encode.
+         * @param sequenceBit The packet's sequence bit.
+         * @param address The packet's address byte.
+         * @param nonce The packet's nonce.
+         * @param cipher Cipher to authenticate the packet with.
+         * @param patchedFieldValue Value to write into the template's patchable
+         *        16-bit field. Ignored if the template has no such field.
+         * @return Size of the encoded packet, in bytes.
+         */
+        fun encode(
+            template: DataPacketTemplate,
+            sequenceBit: Boolean,
+            address: Byte,
+            nonce: Nonce,
+            cipher: Cipher,
+            patchedFieldValue: Int = 0
+        ): Int {
+            val macOffset = template.headerAndPayload.size
+            val length = macOffset + NUM_MAC_BYTES
+            if (packetData.size < length)
+                packetData = ByteArray(length)
+
+            val data = packetData
+
+            template.headerAndPayload.copyInto(data)
+
+            if (sequenceBit)
+                data[SEQ_REL_CMD_BYTE_OFFSET] = (data[SEQ_REL_CMD_BYTE_OFFSET].toPosInt() or 0x80).toByte()
+            data[ADDRESS_BYTE_OFFSET] = address
+            for (i in 0 until NUM_NONCE_BYTES)
+                data[NONCE_BYTES_OFFSET + i] = nonce[i]
+
+            template.patchableFieldOffset?.let { fieldOffset ->
+                data[PAYLOAD_BYTES_OFFSET + fieldOffset + 0] = ((patchedFieldValue shr 0) and 0xFF).toByte()
+                data[PAYLOAD_BYTES_OFFSET + fieldOffset + 1] = ((patchedFieldValue shr 8) and 0xFF).toByte()
+            }
+
+            writeMachineAuthCode(cipher, data, macOffset, data, macOffset)
+
+            packetLength = length
+            return length
+        }
+
+        /**
+         * Parses the most recently encoded packet into a [Packet] instance.
+         *
+         * This allocates, and is meant for logging and testing.
+         */
+        fun toPacket() = Packet(packetData.copyOf(packetLength).asList())
+
+        private companion object {
+            // Capacity for the payload that the initially allocated
+            // array has. This covers all application layer commands
+            // that are typically sent during a session.
+            const val DEFAULT_PAYLOAD_CAPACITY = 64
+        }
+    }
+
     /**
      * Creates a REQUEST_PAIRING_CONNECTION OutgoingPacketInfo instance.
      *
@@ -615,10 +781,17 @@ object TransportLayer {
         // for each reliable packet.
         private var currentSequenceFlag = false
 
-        // Timestamp (in ms) of the last time a packet was sent.
-        // Used for throttling the output.
+        // Monotonic timestamp (in ms) of the last time a packet was
+        // actually sent. Used for throttling the output.
         private var lastSentPacketTimestamp: Long? = null
 
+        // Encoder for outgoing packets. Its buffer is reused for
+        // each packet, so encodeAndSendMutex is used to prevent
+        // the packet receiver's ACK_RESPONSE packets from being
+        // encoded while another packet is still being sent.
+        private val outgoingPacketEncoder = OutgoingPacketEncoder()
+        private val encodeAndSendMutex = Mutex()
+
         // The last PacketReceiverException encountered in the
         // packet receiver coroutine.
         private var lastPacketReceiverException: PacketReceiverException? = null
@@ -730,13 +903,18 @@ object TransportLayer {
 
             try {
                 if (disconnectPacketInfo != null) {
-                    val packet = produceOutgoingPacket(disconnectPacketInfo)
-
                     // We use comboIO.send() directly instead of send()
                     // here, since we need to send the disconnect packet
                     // even if the packet receiver failed.
-                    logger(LogLevel.VERBOSE) { "Sending transport layer packet: $packet" }
-                    comboIO.send(packet.toByteList())
+                    // A separate encoder is used for the same reason. If a
+                    // send operation is stuck, encodeAndSendMutex would stay
+                    // locked, and the disconnect device callback below that
+                    // unblocks that operation would never be reached.
+                    val disconnectPacketEncoder = OutgoingPacketEncoder()
+                    val packetLength = encodeOutgoingPacket(disconnectPacketInfo, disconnectPacketEncoder)
+
+                    logger(LogLevel.VERBOSE) { "Sending transport layer packet: ${disconnectPacketEncoder.toPacket()}" }
+                    comboIO.send(disconnectPacketEncoder.packetData, packetLength)
                     logger(LogLevel.VERBOSE) { "Packet sent" }
                 }
             } catch (e: CancellationException) {
@@ -812,6 +990,38 @@ object TransportLayer {
             sendInternal(packetInfo)
         }
 
+        /**
+         * Sends a DATA packet produced out of the given template to the Combo.
+         *
+         * This behaves just like the [OutgoingPacketInfo] based [send] variant.
+         * It is the cheaper option for frequently sent packets, since the
+         * header and payload are precomputed in the template.
+         *
+         * @param template Template of the DATA packet to send.
+         * @param patchedFieldValue Value to write into the template's patchable
+         *        16-bit field. Ignored if the template has no such field.
+         * @throws IllegalStateException if IO is not running or if it has failed.
+         * @throws PacketReceiverException if an exception was thrown inside the
+         *         packet receiver prior to this call.
+         * @throws ComboIOException if sending fails due to an underlying IO error.
+         * @throws PumpStateStoreAccessException if accessing the current Tx
+         *         nonce in the pump state store failed while preparing the packet
+         *         for sending.
+         */
+        suspend fun send(template: DataPacketTemplate, patchedFieldValue: Int = 0) {
+            check(isIORunning()) {
+                "Attempted to send packet even though IO is not running"
+            }
+
+            if (!receiverIsOK()) {
+                lastPacketReceiverException?.let {
+                    throw it
+                } ?: throw Error("Packet receiver channel failed for unknown reason")
+            }
+
+            sendInternal { encoder -> encodeOutgoingPacket(template, patchedFieldValue, encoder) }
+        }
+
         /**
          * Receives transport layer packets from the Combo.
          *
@@ -924,7 +1134,12 @@ object TransportLayer {
             }
         }
 
-        private suspend fun sendInternal(packetInfo: OutgoingPacketInfo) = withContext(sequencedDispatcher) {
+        private suspend fun sendInternal(packetInfo: OutgoingPacketInfo): Unit =
+            sendInternal { encoder -> encodeOutgoingPacket(packetInfo, encoder) }
+
+        // Sends a packet that is encoded by the given function. That
+        // function is called right before the packet is transmitted.
+        private suspend fun sendInternal(encodePacket: (encoder: OutgoingPacketEncoder) -> Int): Unit = withContext(sequencedDispatcher) {
             // It is important to throttle the output to not overload
             // the Combo's packet ring buffer. Otherwise, old packets
             // get overwritten by new ones, and the Combo begins to
@@ -933,24 +1148,31 @@ object TransportLayer {
             // check how much time has passed since the last packet
             // transmission. If less than 200 ms have passed, we wait
             // with delay() until a total of 200 ms elapsed.
-
-            val elapsedTime = getElapsedTimeInMs()
-
-            if (lastSentPacketTimestamp != null) {
-                val timePassed = elapsedTime - lastSentPacketTimestamp!!
-                if (timePassed < PACKET_SEND_INTERVAL_IN_MS) {
-                    val waitPeriod = PACKET_SEND_INTERVAL_IN_MS - timePassed
+            //
+            // A monotonic clock is used, since wall-clock adjustments
+            // would otherwise shorten or stretch the interval. Also,
+            // the timestamp is taken _after_ the wait, that is, at the
+            // moment the packet is actually transmitted. Recording the
+            // timestamp from before the wait would make the following
+            // packet's interval too short, which causes uneven spacing
+            // during long RT button presses (where packets are sent
+            // back to back) and makes their duration hard to predict.
+
+            val lastTimestamp = lastSentPacketTimestamp
+            if (lastTimestamp != null) {
+                val waitPeriod = (lastTimestamp + PACKET_SEND_INTERVAL_IN_MS) - getMonotonicTimeInMs()
+                if (waitPeriod > 0) {
                     logger(LogLevel.VERBOSE) { "Waiting for $waitPeriod ms until a packet can be sent" }
                     delay(waitPeriod)
                 }
             }
 
-            lastSentPacketTimestamp = elapsedTime
+            lastSentPacketTimestamp = getMonotonicTimeInMs()
 
             // Proceed with sending the packet.
             // Do this in a NonCancellable context to prevent cancellations
-            // from happening between produceOutgoingPacket() and send().
-            // This is because produceOutgoingPacket() updates internal
+            // from happening between encodeOutgoingPacket() and send().
+            // This is because encodeOutgoingPacket() updates internal
             // states in a way that the pump expects (specifically the
             // reliability bit and sequence flag updates). If we allow
             // cancellations in between the functions here, we may not
@@ -964,11 +1186,13 @@ object TransportLayer {
             // tunnel etc., and that function immediately aborts any
             // blocking send/receive operations.
             withContext(NonCancellable) {
-                val packet = produceOutgoingPacket(packetInfo)
+                encodeAndSendMutex.withLock {
+                    val packetLength = encodePacket(outgoingPacketEncoder)
 
-                logger(LogLevel.VERBOSE) { "Sending transport layer packet: $packet" }
-                comboIO.send(packet.toByteList())
-                logger(LogLevel.VERBOSE) { "Packet sent" }
+                    logger(LogLevel.VERBOSE) { "Sending transport layer packet: ${outgoingPacketEncoder.toPacket()}" }
+                    comboIO.send(outgoingPacketEncoder.packetData, packetLength)
+                    logger(LogLevel.VERBOSE) { "Packet sent" }
+                }
             }
         }
 
@@ -1002,7 +1226,9 @@ object TransportLayer {
                     check(pumpStateStore.hasPumpState(pumpAddress)) {
                         "Cannot verify incoming ${packet.command} packet without a pump-client cipher"
                     }
-                    packet.verifyAuthentication(cachedInvariantPumpData.pumpClientCipher)
+                    traceSpan("transport", "MAC verify") {
+                        packet.verifyAuthentication(cachedInvariantPumpData.pumpClientCipher)
+                    }
                 }
 
                 else -> true
@@ -1075,13 +1301,14 @@ object TransportLayer {
             return packet
         }
 
-        // Produces a Packet that is to be sent to the Combo,
-        // and updates the state object's nonce (since every
-        // outgoing packet must have a unique nonce). It
-        // also flips the state's currentSequenceFlag if this
-        // is a reliable packet, and authenticates the packet
-        // with the appropriate cipher if necessary.
-        private fun produceOutgoingPacket(outgoingPacketInfo: OutgoingPacketInfo): Packet {
+        // Encodes a packet that is to be sent to the Combo into
+        // the given encoder, and updates the state object's
+        // nonce (since every outgoing packet must have a unique
+        // nonce). It also flips the state's currentSequenceFlag
+        // if this is a reliable packet, and authenticates the
+        // packet with the appropriate cipher if necessary.
+        // Returns the size of the encoded packet.
+        private fun encodeOutgoingPacket(outgoingPacketInfo: OutgoingPacketInfo, encoder: OutgoingPacketEncoder): Int {
             logger(LogLevel.VERBOSE) { "About to produce outgoing packet from info: $outgoingPacketInfo" }
 
             val nonce = when (outgoingPacketInfo.command) {
@@ -1138,42 +1365,7 @@ object TransportLayer {
 
             val reliabilityBit = outgoingPacketInfo.reliable
 
-            // For reliable packets, use the current currentSequenceFlag
-            // as the sequence bit, then flip the currentSequenceFlag.
-            // For unreliable packets, don't touch the currentSequenceFlag,
-            // and clear the sequence bit.
-            // This behavior is overridden if sequenceBitOverride is
-            // non-null. In that case, the value of sequenceBitOverride
-            // is used for the sequence bit, and currentSequenceFlag
-            // is not touched. sequenceBitOverride is used for when
-            // ACK_RESPONSE packets have to be sent to the Combo.
-            val sequenceBit =
-                when {
-                    outgoingPacketInfo.sequenceBitOverride != null -> outgoingPacketInfo.sequenceBitOverride
-                    reliabilityBit -> {
-                        val currentSequenceFlag = this.currentSequenceFlag
-                        this.currentSequenceFlag = !this.currentSequenceFlag
-                        currentSequenceFlag
-                    }
-                    else -> false
-                }
-
-            val packet = Packet(
-                command = outgoingPacketInfo.command,
-                sequenceBit = sequenceBit,
-                reliabilityBit = reliabilityBit,
-                address = address,
-                nonce = nonce,
-                payload = outgoingPacketInfo.payload
-            )
-
-            if (isCRCPacket) {
-                packet.computeCRC16Payload()
-                logger(LogLevel.DEBUG) {
-                    val crc16 = (packet.payload[1].toPosInt() shl 8) or packet.payload[0].toPosInt()
-                    "Computed CRC16 payload ${crc16.toHexString(4)}"
-                }
-            }
+            val sequenceBit = nextSequenceBit(reliabilityBit, outgoingPacketInfo.sequenceBitOverride)
 
             // Outgoing packets either use no cipher (limited to some
             // of the initial pairing commands) or the client-pump cipher.
@@ -1191,15 +1383,72 @@ object TransportLayer {
                 else -> throw Error("This is not a valid outgoing packet")
             }
 
-            // Authenticate the packet if necessary.
-            if (cipher != null) {
-                logger(LogLevel.VERBOSE) { "Authenticating outgoing packet" }
-                packet.authenticate(cipher)
+            val packetLength = traceSpan("transport", "encode") {
+                encoder.encode(
+                    command = outgoingPacketInfo.command,
+                    sequenceBit = sequenceBit,
+                    reliabilityBit = reliabilityBit,
+                    address = address,
+                    nonce = nonce,
+                    payload = outgoingPacketInfo.payload,
+                    cipher = cipher,
+                    withCRC16Payload = isCRCPacket
+                )
             }
 
-            return packet
+            if (isCRCPacket) {
+                logger(LogLevel.DEBUG) {
+                    val packetData = encoder.packetData
+                    val crc16 = (packetData[PAYLOAD_BYTES_OFFSET + 1].toPosInt() shl 8) or packetData[PAYLOAD_BYTES_OFFSET + 0].toPosInt()
+                    "Computed CRC16 payload ${crc16.toHexString(4)}"
+                }
+            }
+
+            if (cipher != null)
+                logger(LogLevel.VERBOSE) { "Authenticated outgoing packet" }
+
+            return packetLength
         }
 
+        // Encodes a DATA packet out of a template into the given encoder.
+        // This updates the nonce and sequence flag just like the
+        // OutgoingPacketInfo based variant above does for DATA packets.
+        private fun encodeOutgoingPacket(template: DataPacketTemplate, patchedFieldValue: Int, encoder: OutgoingPacketEncoder): Int {
+            val nonce = pumpStateStore.incrementTxNonce(pumpAddress)
+            val sequenceBit = nextSequenceBit(template.reliable, sequenceBitOverride = null)
+
+            return traceSpan("transport", "encode") {
+                encoder.encode(
+                    template = template,
+                    sequenceBit = sequenceBit,
+                    address = cachedInvariantPumpData.keyResponseAddress,
+                    nonce = nonce,
+                    cipher = cachedInvariantPumpData.clientPumpCipher,
+                    patchedFieldValue = patchedFieldValue
+                )
+            }
+        }
+
+        // For reliable packets, use the current currentSequenceFlag
+        // as the sequence bit, then flip the currentSequenceFlag.
+        // For unreliable packets, don't touch the currentSequenceFlag,
+        // and clear the sequence bit.
+        // This behavior is overridden if sequenceBitOverride is
+        // non-null. In that case, the value of sequenceBitOverride
+        // is used for the sequence bit, and currentSequenceFlag
+        // is not touched. sequenceBitOverride is used for when
+        // ACK_RESPONSE packets have to be sent to the Combo.
+        private fun nextSequenceBit(reliable: Boolean, sequenceBitOverride: Boolean?): Boolean =
+            when {
+                sequenceBitOverride != null -> sequenceBitOverride
+                reliable -> {
+                    val currentSequenceFlag = this.currentSequenceFlag
+                    this.currentSequenceFlag = !this.currentSequenceFlag
+                    currentSequenceFlag
+                }
+                else -> false
+            }
+
         // Reads the error ID out of the packet and throws an exception.
         // This is appropriate, since an error message coming from the
         // Combo is non-recoverable.
@@ -1238,3 +1487,84 @@ object TransportLayer {
 fun List<Byte>.toTransportLayerPacket(): TransportLayer.Packet {
     return TransportLayer.Packet(this)
 }
+
+// This computes the MAC using Two-Fish and a modified RFC3610 CCM authentication
+// process. See "Packet authentication" in combo-comm-spec.adoc for details.
+// packetData must contain the packet's header and payload, but not the MAC.
+// The nonce is read from the header. The MAC is written into the destination
+// array, starting at destinationOffset. The destination may be packetData
+// itself, as long as the MAC is written past packetDataLength.
+private fun writeMachineAuthCode(
+    cipher: Cipher,
+    packetData: ByteArray,
+    packetDataLength: Int,
+    destination: ByteArray,
+    destinationOffset: Int
+) {
+    val nonceOffset = TransportLayer.NONCE_BYTES_OFFSET
+    var block = ByteArray(CIPHER_BLOCK_SIZE)
+
+    // Set up B_0.
+    block[0] = 0x79
+    for (i in 0 until NUM_NONCE_BYTES) block[i + 1] = packetData[nonceOffset + i]
+    block[14] = 0x00
+    block[15] = 0x00
+
+    // Produce X_1 out of B_0.
+    block = cipher.encrypt(block)
+
+    val numDataBlocks = packetDataLength / CIPHER_BLOCK_SIZE
+
+    // Repeatedly produce X_i+1 out of X_i and B_i.
+    // X_i is the current block value, B_i is the
+    // data from packetData that is being accessed
+    // inside the loop.
+    for (dataBlockNr in 0 until numDataBlocks) {
+        for (i in 0 until CIPHER_BLOCK_SIZE) {
+            val a: Int = block[i].toPosInt()
+            val b: Int = packetData[dataBlockNr * CIPHER_BLOCK_SIZE + i].toPosInt()
+            block[i] = (a xor b).toByte()
+        }
+
+        block = cipher.encrypt(block)
+    }
+
+    // Handle the last block, and apply padding if needed.
+    val remainingDataBytes = packetDataLength - numDataBlocks * CIPHER_BLOCK_SIZE
+    if (remainingDataBytes > 0) {
+        for (i in 0 until remainingDataBytes) {
+            val a: Int = block[i].toPosInt()
+            val b: Int = packetData[packetDataLength - remainingDataBytes + i].toPosInt()
+            block[i] = (a xor b).toByte()
+        }
+
+        val paddingValue = 16 - remainingDataBytes
+
+        for (i in remainingDataBytes until CIPHER_BLOCK_SIZE)
+            block[i] = ((block[i].toPosInt()) xor paddingValue).toByte()
+
+        block = cipher.encrypt(block)
+    }
+
+    // Here, the non-standard portion of the authentication starts.
+
+    // Produce the "U" value.
+    for (i in 0 until NUM_MAC_BYTES)
+        destination[destinationOffset + i] = block[i]
+
+    // Produce the new B_0.
+    block[0] = 0x41
+    for (i in 0 until NUM_NONCE_BYTES) block[i + 1] = packetData[nonceOffset + i]
+    block[14] = 0x00
+    block[15] = 0x00
+
+    // Produce X_1 out of the new B_0.
+    block = cipher.encrypt(block)
+
+    // Compute the final MAC out of U and the
+    // first 8 bytes of X_1 XORed together.
+    for (i in 0 until NUM_MAC_BYTES) {
+        val u = destination[destinationOffset + i].toPosInt()
+        destination[destinationOffset + i] = (u xor (block[i].toPosInt())).toByte()
+    }
+}
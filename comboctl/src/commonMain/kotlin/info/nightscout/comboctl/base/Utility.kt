@@ -6,6 +6,8 @@ import kotlinx.datetime.LocalDateTime
 import kotlinx.datetime.atTime
 import kotlin.math.max
 import kotlin.math.min
+import kotlin.time.ExperimentalTime
+import kotlin.time.TimeSource
 
 // Utility function for cases when only the time and no date is known.
 // monthNumber and dayOfMonth are set to 1 instead of 0 since 0 is
@@ -281,3 +283,16 @@ internal fun Long.toStringWithDecimal(numDecimals: Int): String {
  * such as when log lines are produced.
  */
 internal fun getElapsedTimeInMs(): Long = Clock.System.now().toEpochMilliseconds()
+
+@OptIn(ExperimentalTime::class)
+private val monotonicTimeOrigin = TimeSource.Monotonic.markNow()
+
+/**
+ * Returns the time in milliseconds since an arbitrary, fixed origin, using a monotonic clock.
+ *
+ * Unlike [getElapsedTimeInMs], this is unaffected by wall-clock adjustments
+ * (NTP corrections, manual time changes etc.), so it is suitable for
+ * scheduling packet transmissions at fixed intervals.
+ */
+@OptIn(ExperimentalTime::class)
+internal fun getMonotonicTimeInMs(): Long = monotonicTimeOrigin.elapsedNow().inWholeMilliseconds
@@ -23,6 +23,7 @@ import info.nightscout.comboctl.base.PumpStateStore
 import info.nightscout.comboctl.base.Tbr
 import info.nightscout.comboctl.base.TransportLayer
 import info.nightscout.comboctl.base.toStringWithDecimal
+import info.nightscout.comboctl.base.traceSpan
 import info.nightscout.comboctl.base.withFixedYearFrom
 import info.nightscout.comboctl.parser.AlertScreenContent
 import info.nightscout.comboctl.parser.AlertScreenException
@@ -2112,8 +2113,10 @@ class Pump(
                     if (pumpMode != null)
                         pumpIO.switchMode(pumpMode)
 
-                    retval = coroutineScope {
-                        block.invoke(this)
+                    retval = traceSpan("pump", description::class.simpleName ?: "command") {
+                        coroutineScope {
+                            block.invoke(this)
+                        }
                     }
 
                     doAlertCheck = true
@@ -3251,8 +3254,11 @@ class Pump(
             // 1 second per quantity to factor in the waiting period while reading each initial quantity.
             // We handle 5 quantities (hour/minute/year/month/day), so we factor in 5*1 seconds.
             5.toDuration(DurationUnit.SECONDS) +
-            // Factor in the individual factor changes (1 increment/decrement takes ~300 ms to finish).
-            (totalDistance * 300).toDuration(DurationUnit.MILLISECONDS) +
+            // Factor in the individual quantity changes. Each increment/decrement needs at least one
+            // RT_BUTTON_STATUS packet, and the transport layer never sends these more than once per
+            // PACKET_SEND_INTERVAL_IN_MS. Long RT button presses stop as soon as the target quantity
+            // is seen on screen, so this is a lower bound no matter how quickly the Combo responds.
+            (totalDistance * TransportLayer.PACKET_SEND_INTERVAL_IN_MS).toDuration(DurationUnit.MILLISECONDS) +
             // if a long RT button press happens, there's a waiting period after the button press stopped.
             // IMPORTANT: This is evaluated for each distance individually instead of evaluating
             // totalDistance once. That's because whether to do long RT button press is decided per-quantity
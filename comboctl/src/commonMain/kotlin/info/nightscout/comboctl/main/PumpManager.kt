@@ -13,13 +13,18 @@ import info.nightscout.comboctl.base.PumpIO
 import info.nightscout.comboctl.base.PumpStateStore
 import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.NonCancellable
 import kotlinx.coroutines.coroutineScope
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.sync.Mutex
 import kotlinx.coroutines.sync.withLock
+import kotlinx.coroutines.withContext
 
 private val logger = Logger.get("PumpManager")
 
+// All Combo pumps have Bluetooth addresses that start with these bytes.
+private val COMBO_ADDRESS_PREFIX = listOf<Byte>(0x00, 0x0E, 0x2F)
+
 /**
  * Manager class for acquiring and creating [Pump] instances.
  *
@@ -92,11 +97,29 @@ class PumpManager(
         object DiscoveryTimeout : PairingResult()
     }
 
+    /**
+     * Summary of a [pairWithNewPumps] session.
+     *
+     * @property pairedPumps Pumps that were paired during the session,
+     *   in the order in which their pairing finished.
+     * @property failedPumps Pumps whose pairing failed, along with
+     *   the exception that caused the failure.
+     * @property discoveryStoppedReason Why discovery stopped, or null
+     *   if the session ended because the maximum number of pumps
+     *   was paired.
+     */
+    data class PairingSessionResult(
+        val pairedPumps: List<PairingResult.Success>,
+        val failedPumps: Map<BluetoothAddress, Exception>,
+        val discoveryStoppedReason: BluetoothInterface.DiscoveryStoppedReason?
+    )
+
     init {
         logger(LogLevel.INFO) { "Pump manager started" }
 
         // Install a filter to make sure we only ever get notified about Combo pumps.
         bluetoothInterface.deviceFilterCallback = { deviceAddress -> isCombo(deviceAddress) }
+        bluetoothInterface.discoveryAddressPrefix = COMBO_ADDRESS_PREFIX
     }
 
     /**
@@ -231,6 +254,9 @@ class PumpManager(
      * that Combo _is_ still paired (that is, the OS has it listed among its
      * paired devices).
      *
+     * To pair with several pumps in one discovery session, use
+     * [pairWithNewPumps] instead.
+     *
      * @param discoveryDuration How long the discovery shall go on,
      *   in seconds. Must be a value between 1 and 300.
      * @param onPairingPIN Suspending block that asks the user for
@@ -247,26 +273,7 @@ class PumpManager(
         lateinit var result: PairingResult
 
         // Before doing the actual pairing, unpair devices that have no corresponding pump state.
-
-        val pairedDeviceAddresses = bluetoothInterface.getPairedDeviceAddresses()
-        logger(LogLevel.DEBUG) { "${pairedDeviceAddresses.size} paired Bluetooth device(s)" }
-
-        val availablePumpStates = pumpStateStore.getAvailablePumpStateAddresses()
-        logger(LogLevel.DEBUG) { "${availablePumpStates.size} available pump state(s)" }
-
-        // Check for paired pumps that have no corresponding state. This can happen if
-        // the state was deleted and the application crashed before it could unpair the
-        // pump, or if some other application paired the pump. Those devices get unpaired.
-        for (pairedDeviceAddress in pairedDeviceAddresses) {
-            val pumpStatePresent = availablePumpStates.contains(pairedDeviceAddress)
-            if (!pumpStatePresent) {
-                if (isCombo(pairedDeviceAddress)) {
-                    logger(LogLevel.DEBUG) { "There is no pump state for paired pump with address $pairedDeviceAddresses; unpairing" }
-                    val bluetoothDevice = bluetoothInterface.getDevice(pairedDeviceAddress)
-                    bluetoothDevice.unpair()
-                }
-            }
-        }
+        unpairPumpsWithoutState()
 
         // Unpairing unknown devices done. Actual pairing of a new pump continues now.
 
@@ -352,6 +359,197 @@ class PumpManager(
         return result
     }
 
+    /**
+     * Starts a discovery session and pairs with every new pump that is discovered during it.
+     *
+     * This is the multi-pump counterpart to [pairWithNewPump], meant for
+     * pairing many pumps in one go. Discovery is started once, in the
+     * [BluetoothInterface.DiscoveryMode.CONTINUOUS] mode, so the Bluetooth
+     * pairing setup stays in place for the entire session instead of being
+     * set up and torn down for each pump. Each discovered pump gets its own
+     * coroutine that performs the Combo-level pairing, so pumps are paired
+     * concurrently, and discovery continues while they are being paired.
+     *
+     * The session ends when the discovery duration is over, when discovery
+     * fails, or when [maxNumPumps] pumps were paired. Pairings that are still
+     * going on at that point are allowed to finish before this function
+     * returns. Cancelling the calling coroutine cancels these as well.
+     *
+     * A pump whose pairing fails does not end the session. Its failure is
+     * recorded in the returned [PairingSessionResult] instead. This does not
+     * apply to exceptions thrown by [onPumpPaired]; these abort the session.
+     *
+     * Stale Bluetooth pairings are removed before discovery starts, just
+     * like [pairWithNewPump] does.
+     *
+     * The [pairingProgressFlow] only reports the progress of the session
+     * as a whole (scanning, then finished or aborted), since the stages
+     * of concurrent pairings cannot be reported through one flow.
+     *
+     * [onPairingPIN] may be called for several pumps at the same time.
+     * It and [onPumpPaired] are called from coroutines that run on a
+     * different thread than the one that called this function. See the
+     * [pairWithNewPump] documentation for the implications of this.
+     *
+     * @param discoveryDuration How long the discovery session shall go on,
+     *   in seconds. Must be a value between 1 and 300.
+     * @param maxNumPumps Maximum number of pumps to pair. The session ends
+     *   early once this many pumps were paired. Pumps that are found while
+     *   this many pairings are finished or going on are skipped. Must be
+     *   at least 1.
+     * @param onPumpPaired Callback that is invoked each time a pump was paired.
+     * @param onPairingPIN Suspending block that asks the user for
+     *   the 10-digit pairing PIN of the given pump.
+     * @return Summary of the pairing session.
+     * @throws info.nightscout.comboctl.base.BluetoothException if discovery
+     *   fails due to an underlying Bluetooth issue.
+     */
+    suspend fun pairWithNewPumps(
+        discoveryDuration: Int,
+        maxNumPumps: Int = Int.MAX_VALUE,
+        onPumpPaired: (result: PairingResult.Success) -> Unit = { },
+        onPairingPIN: suspend (newPumpAddress: BluetoothAddress, previousAttemptFailed: Boolean) -> PairingPIN
+    ): PairingSessionResult {
+        require(maxNumPumps >= 1) { "maxNumPumps must be at least 1" }
+
+        // Completed with the reason for why discovery stopped,
+        // or with null if maxNumPumps pumps were paired.
+        val sessionEnd = CompletableDeferred<BluetoothInterface.DiscoveryStoppedReason?>()
+
+        // Session state. Only accessed with pumpStateAccessMutex locked.
+        val pumpsBeingPaired = mutableSetOf<BluetoothAddress>()
+        val pairedPumps = mutableListOf<PairingResult.Success>()
+        val failedPumps = mutableMapOf<BluetoothAddress, Exception>()
+
+        var discoveryStoppedReason: BluetoothInterface.DiscoveryStoppedReason? = null
+
+        unpairPumpsWithoutState()
+
+        pairingProgressReporter.reset(Unit)
+
+        coroutineScope {
+            val thisScope = this
+            try {
+                pairingProgressReporter.setCurrentProgressStage(BasicProgressStage.ScanningForPumpStage)
+
+                bluetoothInterface.startDiscovery(
+                    sdpServiceName = Constants.BT_SDP_SERVICE_NAME,
+                    sdpServiceProvider = "ComboCtl SDP service",
+                    sdpServiceDescription = "ComboCtl",
+                    btPairingPin = Constants.BT_PAIRING_PIN,
+                    discoveryDuration = discoveryDuration,
+                    discoveryMode = BluetoothInterface.DiscoveryMode.CONTINUOUS,
+                    onDiscoveryStopped = { reason ->
+                        logger(LogLevel.DEBUG) { "Discovery stopped: ${reason.str}" }
+                        sessionEnd.complete(reason)
+                    },
+                    onFoundNewPairedDevice = { deviceAddress ->
+                        // This is called from the Bluetooth implementation's
+                        // internal thread, which must not be blocked, since it
+                        // also handles the discovery of other pumps. Therefore,
+                        // each pump is paired in its own coroutine.
+                        thisScope.launch {
+                            logger(LogLevel.DEBUG) { "Found pump with address $deviceAddress" }
+
+                            // Pumps that are found after the session ended are skipped. So are
+                            // pumps that are already paired or whose pairing is going on already.
+                            // Pairings that are going on count towards maxNumPumps, otherwise
+                            // more than maxNumPumps pumps could end up being paired if several
+                            // are found at the same time. If such a pairing fails, its slot is
+                            // freed again, and a pump that is found later can take it.
+                            // Note that the lock is released before the pairing starts. Otherwise,
+                            // the pumps would be paired one after the other. This is fine, since
+                            // the states of different pumps can be created concurrently.
+                            val skipPump = pumpStateAccessMutex.withLock {
+                                when {
+                                    sessionEnd.isCompleted -> true
+                                    pumpStateStore.hasPumpState(deviceAddress) -> true
+                                    (pairedPumps.size + pumpsBeingPaired.size) >= maxNumPumps -> true
+                                    else -> !pumpsBeingPaired.add(deviceAddress)
+                                }
+                            }
+                            if (skipPump) {
+                                logger(LogLevel.DEBUG) { "Skipping pump with address $deviceAddress" }
+                                return@launch
+                            }
+
+                            val pairingResult = try {
+                                performPairing(deviceAddress, onPairingPIN, null)
+
+                                val pumpID = pumpStateStore.getInvariantPumpData(deviceAddress).pumpID
+                                logger(LogLevel.DEBUG) { "Paired pump with address $deviceAddress ; pump ID = $pumpID" }
+
+                                PairingResult.Success(deviceAddress, pumpID)
+                            } catch (e: CancellationException) {
+                                withContext(NonCancellable) {
+                                    pumpStateAccessMutex.withLock { pumpsBeingPaired.remove(deviceAddress) }
+                                }
+                                throw e
+                            } catch (e: Exception) {
+                                logger(LogLevel.ERROR) { "Caught exception while pairing to pump with address $deviceAddress: $e" }
+                                pumpStateAccessMutex.withLock {
+                                    pumpsBeingPaired.remove(deviceAddress)
+                                    failedPumps[deviceAddress] = e
+                                }
+                                return@launch
+                            }
+
+                            // The pump is moved from pumpsBeingPaired to pairedPumps
+                            // in one step, so its slot is never counted as free.
+                            val numPairedPumps = pumpStateAccessMutex.withLock {
+                                pumpsBeingPaired.remove(deviceAddress)
+                                pairedPumps.add(pairingResult)
+                                pairedPumps.size
+                            }
+
+                            if (numPairedPumps >= maxNumPumps) {
+                                logger(LogLevel.DEBUG) { "Paired $numPairedPumps pump(s); ending pairing session" }
+                                sessionEnd.complete(null)
+                            }
+
+                            // This is called outside of the try block above, since the
+                            // pump _was_ paired, even if this callback throws an exception.
+                            // Such an exception aborts the session like any other exception
+                            // from the caller's code would.
+                            onPumpPaired(pairingResult)
+                        }
+                    }
+                )
+
+                discoveryStoppedReason = sessionEnd.await()
+            } catch (e: CancellationException) {
+                logger(LogLevel.DEBUG) { "Pairing session cancelled" }
+                pairingProgressReporter.setCurrentProgressStage(BasicProgressStage.Cancelled)
+                throw e
+            } catch (e: Exception) {
+                pairingProgressReporter.setCurrentProgressStage(BasicProgressStage.Error(e))
+                throw e
+            } finally {
+                bluetoothInterface.stopDiscovery()
+            }
+
+            // Leaving the coroutineScope waits for the
+            // pairings that are still going on to finish.
+        }
+
+        logger(LogLevel.INFO) {
+            "Pairing session finished; ${pairedPumps.size} pump(s) paired, ${failedPumps.size} pump(s) failed"
+        }
+
+        pairingProgressReporter.setCurrentProgressStage(
+            when (discoveryStoppedReason) {
+                null, BluetoothInterface.DiscoveryStoppedReason.DISCOVERY_TIMEOUT ->
+                    // Running into the timeout is the normal way for this
+                    // session to end, so only report it if nothing was paired.
+                    if (pairedPumps.isEmpty()) BasicProgressStage.Timeout else BasicProgressStage.Finished
+                BluetoothInterface.DiscoveryStoppedReason.MANUALLY_STOPPED -> BasicProgressStage.Cancelled
+                BluetoothInterface.DiscoveryStoppedReason.DISCOVERY_ERROR -> DiscoveryError
+            }
+        )
+
+        return PairingSessionResult(pairedPumps.toList(), failedPumps.toMap(), discoveryStoppedReason)
+    }
+
     /**
      * Returns a set of Bluetooth addresses of the paired pumps.
      *
@@ -440,12 +638,34 @@ class PumpManager(
         }
     }
 
+    private fun unpairPumpsWithoutState() {
+        val pairedDeviceAddresses = bluetoothInterface.getPairedDeviceAddresses()
+        logger(LogLevel.DEBUG) { "${pairedDeviceAddresses.size} paired Bluetooth device(s)" }
+
+        val availablePumpStates = pumpStateStore.getAvailablePumpStateAddresses()
+        logger(LogLevel.DEBUG) { "${availablePumpStates.size} available pump state(s)" }
+
+        // Check for paired pumps that have no corresponding state. This can happen if
+        // the state was deleted and the application crashed before it could unpair the
+        // pump, or if some other application paired the pump. Those devices get unpaired.
+        for (pairedDeviceAddress in pairedDeviceAddresses) {
+            val pumpStatePresent = availablePumpStates.contains(pairedDeviceAddress)
+            if (!pumpStatePresent) {
+                if (isCombo(pairedDeviceAddress)) {
+                    logger(LogLevel.DEBUG) { "There is no pump state for paired pump with address $pairedDeviceAddresses; unpairing" }
+                    val bluetoothDevice = bluetoothInterface.getDevice(pairedDeviceAddress)
+                    bluetoothDevice.unpair()
+                }
+            }
+        }
+    }
+
     // Filter for Combo devices based on their address.
     // The first 3 bytes of a Combo are always the same.
     private fun isCombo(deviceAddress: BluetoothAddress) =
-        (deviceAddress[0] == 0x00.toByte()) &&
-                (deviceAddress[1] == 0x0E.toByte()) &&
-                (deviceAddress[2] == 0x2F.toByte())
+        (deviceAddress[0] == COMBO_ADDRESS_PREFIX[0]) &&
+                (deviceAddress[1] == COMBO_ADDRESS_PREFIX[1]) &&
+                (deviceAddress[2] == COMBO_ADDRESS_PREFIX[2])
 
     private suspend fun performPairing(
         pumpAddress: BluetoothAddress,
@@ -23,9 +23,23 @@ fun getJNICflags(): List<String> {
     return listOf("-I$javaHome/include", "-I$javaHome/include/linux")
 }
 
+// Native build options are defined in the root build script.
+val nativeDBusBackendEnabled = rootProject.extra["nativeDBusBackendEnabled"] as Boolean
+val allocationTrackingEnabled = rootProject.extra["nativeAllocationTrackingEnabled"] as Boolean
+@Suppress("UNCHECKED_CAST")
+val nativeOptionCflags = rootProject.extra["nativeOptionCflags"] as List<String>
+
+// The native D-Bus backend does not use GLib, so pkg-config is not run for it then.
+fun getGlibCflags(): List<String> =
+    if (!nativeDBusBackendEnabled) glibCflagsStdout.toString().trim().split(" ") else listOf()
+
+fun getGlibLibs(): List<String> =
+    if (!nativeDBusBackendEnabled) glibLibsStdout.toString().trim().split(" ") else listOf()
+
 fun getGccAndClangCflags(): List<String> {
     return listOf("-Wextra", "-Wall", "-O0", "-g3", "-ggdb", "-fPIC", "-DPIC", "-std=c++17") +
-    glibCflagsStdout.toString().trim().split(" ")
+    getGlibCflags() +
+    nativeOptionCflags
 }
 
 task<Exec>("glib2PkgConfigCflags") {
@@ -39,7 +53,8 @@ task<Exec>("glib2PkgConfigLibs") {
 }
 
 tasks.withType(CppCompile::class.java).configureEach {
-    dependsOn("glib2PkgConfigCflags")
+    if (!nativeDBusBackendEnabled)
+        dependsOn("glib2PkgConfigCflags")
     compilerArgs.addAll(toolChain.map { toolChain ->
         when (toolChain) {
             is Gcc, is Clang -> getGccAndClangCflags() + getJNICflags()
@@ -49,10 +64,12 @@ tasks.withType(CppCompile::class.java).configureEach {
 }
 
 tasks.withType(LinkSharedLibrary::class.java).configureEach {
-    dependsOn("glib2PkgConfigLibs")
+    if (!nativeDBusBackendEnabled)
+        dependsOn("glib2PkgConfigLibs")
     linkerArgs.addAll(toolChain.map { toolChain ->
         when (toolChain) {
-            is Gcc, is Clang -> glibLibsStdout.toString().trim().split(" ")
+            is Gcc, is Clang -> getGlibLibs() +
+                (if (allocationTrackingEnabled) listOf("-Wl,-Bsymbolic") else listOf())
             else -> listOf()
         }
     })
@@ -1,4 +1,5 @@
 #include <jni/jni.hpp>
+#include <algorithm>
 #include <stdexcept>
 #include <cstddef>
 #include <cstdlib>
@@ -9,13 +10,23 @@
 #include <mutex>
 #include <condition_variable>
 #include <deque>
+#include <array>
 #include <map>
+#include <vector>
+#include <chrono>
 #include <fmt/format.h>
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 #include <glib.h>
 #include <gio/gio.h>
+#endif
 #include "bluez_interface.hpp"
+#include "allocation_tracking.hpp"
 #include "exception.hpp"
+#include "dbus_error_exception.hpp"
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 #include "gerror_exception.hpp"
+#endif
+#include "tracepoints.hpp"
 #include "log.hpp"
 
 
@@ -50,6 +61,29 @@ comboctl::bluetooth_address to_bt_address(jni::JNIEnv &env, jni::Array<jni::jbyt
 	return address;
 }
 
+// RAII helper to emit the jni_enter and jni_exit tracepoints. The
+// name must be a string literal (or otherwise outlive this object).
+class jni_tracepoint_scope
+{
+public:
+	explicit jni_tracepoint_scope(char const *method_name)
+		: m_method_name(method_name)
+	{
+		COMBOCTL_TRACEPOINT(jni_enter, m_method_name);
+	}
+
+	~jni_tracepoint_scope()
+	{
+		COMBOCTL_TRACEPOINT(jni_exit, m_method_name);
+	}
+
+	jni_tracepoint_scope(jni_tracepoint_scope const &) = delete;
+	jni_tracepoint_scope& operator = (jni_tracepoint_scope const &) = delete;
+
+private:
+	char const *m_method_name;
+};
+
 // Helper functions to catch exceptions coming from
 // a function and translate these functions to JNI
 // ThrowNew calls to make sure Java/Kotlin get
@@ -61,7 +95,12 @@ comboctl::bluetooth_address to_bt_address(jni::JNIEnv &env, jni::Array<jni::jbyt
 // properly cancels a coroutine. So, if the
 // GError's code is set to G_IO_ERROR_CANCELLED,
 // we throw CancellationException. Otherwise,
-// we throw BluetoothException.
+// we throw BluetoothException. Cancelled native
+// D-Bus calls and cancellation_exception are
+// mapped to CancellationException as well.
+// A lost Bluetooth link is reported as the more
+// specific BluetoothLinkLostException, so callers
+// can start reconnecting right away.
 
 template<typename Func, typename ReturnType = decltype(std::declval<Func>()())>
 auto call_with_jni_rethrow(jni::JNIEnv &env, Func &&func) -> typename std::enable_if<std::is_void<ReturnType>::value, ReturnType>::type
@@ -74,10 +113,19 @@ auto call_with_jni_rethrow(jni::JNIEnv &env, Func &&func) -> typename std::enabl
 	{
 		jni::ThrowNew(env, jni::FindClass(env, "java/lang/IllegalStateException"), exc.what());
 	}
+	catch (comboctl::link_lost_exception const &exc)
+	{
+		jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/BluetoothLinkLostException"), exc.what());
+	}
 	catch (comboctl::io_exception const &exc)
 	{
 		jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/ComboIOException"), exc.what());
 	}
+	catch (comboctl::cancellation_exception const &exc)
+	{
+		jni::ThrowNew(env, jni::FindClass(env, "java/util/concurrent/CancellationException"), exc.what());
+	}
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 	catch (comboctl::gerror_exception const &exc)
 	{
 		if (g_error_matches(exc.get_gerror(), G_IO_ERROR, G_IO_ERROR_CANCELLED))
@@ -85,6 +133,14 @@ auto call_with_jni_rethrow(jni::JNIEnv &env, Func &&func) -> typename std::enabl
 		else
 			jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/BluetoothException"), exc.what());
 	}
+#endif
+	catch (comboctl::dbus_error_exception const &exc)
+	{
+		if (exc.is_cancelled())
+			jni::ThrowNew(env, jni::FindClass(env, "java/util/concurrent/CancellationException"), exc.what());
+		else
+			jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/BluetoothException"), exc.what());
+	}
 	catch (comboctl::exception const &exc)
 	{
 		jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/ComboException"), exc.what());
@@ -102,10 +158,19 @@ auto call_with_jni_rethrow(jni::JNIEnv &env, Func &&func) -> typename std::enabl
 	{
 		jni::ThrowNew(env, jni::FindClass(env, "java/lang/IllegalStateException"), exc.what());
 	}
+	catch (comboctl::link_lost_exception const &exc)
+	{
+		jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/BluetoothLinkLostException"), exc.what());
+	}
 	catch (comboctl::io_exception const &exc)
 	{
 		jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/ComboIOException"), exc.what());
 	}
+	catch (comboctl::cancellation_exception const &exc)
+	{
+		jni::ThrowNew(env, jni::FindClass(env, "java/util/concurrent/CancellationException"), exc.what());
+	}
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 	catch (comboctl::gerror_exception const &exc)
 	{
 		if (g_error_matches(exc.get_gerror(), G_IO_ERROR, G_IO_ERROR_CANCELLED))
@@ -113,6 +178,14 @@ auto call_with_jni_rethrow(jni::JNIEnv &env, Func &&func) -> typename std::enabl
 		else
 			jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/BluetoothException"), exc.what());
 	}
+#endif
+	catch (comboctl::dbus_error_exception const &exc)
+	{
+		if (exc.is_cancelled())
+			jni::ThrowNew(env, jni::FindClass(env, "java/util/concurrent/CancellationException"), exc.what());
+		else
+			jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/BluetoothException"), exc.what());
+	}
 	catch (comboctl::exception const &exc)
 	{
 		jni::ThrowNew(env, jni::FindClass(env, "info/nightscout/comboctl/base/ComboException"), exc.what());
@@ -120,6 +193,48 @@ auto call_with_jni_rethrow(jni::JNIEnv &env, Func &&func) -> typename std::enabl
 }
 
 
+// Exception classes for the errors that send, receive, and
+// wait_until_drained report through io_result. Cancellations
+// and lost links happen routinely (for example, every disconnect
+// cancels the ongoing receive call), so these classes are looked
+// up once in JNI_OnLoad, and the Java exceptions are raised
+// directly, without throwing and catching a C++ exception first.
+jclass cancellation_exception_class = nullptr;
+jclass link_lost_exception_class = nullptr;
+jclass bluetooth_exception_class = nullptr;
+// Used for rejecting invalid arguments in the hot path natives.
+jclass illegal_argument_exception_class = nullptr;
+
+jclass find_global_class(jni::JNIEnv &env, char const *name)
+{
+	jclass local_class = env.FindClass(name);
+	if (local_class == nullptr)
+		throw std::runtime_error(fmt::format("Could not find class {}", name));
+
+	jclass global_class = static_cast<jclass>(env.NewGlobalRef(local_class));
+	env.DeleteLocalRef(local_class);
+
+	return global_class;
+}
+
+// Raises the Java exception that corresponds to the failed result.
+// The caller must return to Java right after this call.
+template<typename T>
+void raise_io_failure(jni::JNIEnv &env, comboctl::io_result<T> const &result)
+{
+	jclass exception_class;
+
+	switch (result.error())
+	{
+		case comboctl::io_error::canceled: exception_class = cancellation_exception_class; break;
+		case comboctl::io_error::link_lost: exception_class = link_lost_exception_class; break;
+		default: exception_class = bluetooth_exception_class; break;
+	}
+
+	env.ThrowNew(exception_class, result.error_message().c_str());
+}
+
+
 ///////////////////////////////////
 // bluetooth_device JNI bindings //
 ///////////////////////////////////
@@ -164,60 +279,168 @@ public:
 
 	void connect_impl(jni::JNIEnv &env)
 	{
+		jni_tracepoint_scope tracepoint_scope("connectImpl");
+
 		assert(m_device != nullptr);
 		call_with_jni_rethrow(env, [&]() { m_device->connect(); });
 	}
 
 	void disconnect(jni::JNIEnv &)
 	{
+		jni_tracepoint_scope tracepoint_scope("disconnect");
+
 		assert(m_device != nullptr);
 		m_device->disconnect();
 	}
 
-	void send_impl(jni::JNIEnv &env, jni::Array<jni::jbyte> const &data)
+	// send() and receive() are the hot path, so these are not
+	// registered through jni.hpp's native peer support like the
+	// other functions. Instead, they are static natives that get
+	// the peer pointer (the Kotlin nativePtr field) as an argument
+	// (see register_device_hot_path_natives()). This saves the
+	// nativePtr field access and the jni.hpp argument wrappers.
+
+	void send(JNIEnv &env, jbyteArray data, jint length)
 	{
+		jni_tracepoint_scope tracepoint_scope("nativeSend");
+		comboctl::no_allocation_scope allocation_scope("JNI send");
+
 		assert(m_device != nullptr);
 
-		jni::jsize length = data.Length(env);
+		if (!copy_to_send_buffer(env, data, length))
+			return;
 
-		// Expand the send buffer as needed.
-		if (m_intermediate_send_buffer.size() < length)
-			m_intermediate_send_buffer.resize(length);
+		// Now send the bytes over RFCOMM.
+		auto result = m_device->send(m_intermediate_send_buffer.data(), length);
+		if (!result)
+			raise_io_failure(env, result);
+	}
 
-		// This copies the bytes from the JNI array into our send buffer.
-		// Note that we don't just pass m_intermediate_send_buffer
-		// to GetRegion(). Instead, we pass a pointer & length. This is
-		// because the code above only expands m_intermediate_send_buffer.
-		// If length is shorter than the existing size of that buffer,
-		// it won't be resized. (This is intentional, to avoid unnecessary
-		// reallocations.) If we passed m_intermediate_send_buffer to
-		// GetRegion(), it may end up being instructed to copy more bytes
-		// than there are available.
-		data.GetRegion(env, 0, length, reinterpret_cast<jni::jbyte *>(m_intermediate_send_buffer.data()));
+	jint receive(JNIEnv &env, jbyteArray dest)
+	{
+		jni_tracepoint_scope tracepoint_scope("nativeReceive");
+		comboctl::no_allocation_scope allocation_scope("JNI receive");
 
-		// Now send the bytes over RFCOMM.
-		call_with_jni_rethrow(env, [&]() { m_device->send(&m_intermediate_send_buffer[0], length); });
+		assert(m_device != nullptr);
+
+		// Receive bytes over RFCOMM. The destination array is reused by
+		// the Kotlin side, so no array needs to be created here.
+		jint max_num_bytes = std::min(env.GetArrayLength(dest), jint(m_intermediate_receive_buffer.size()));
+		auto result = m_device->receive(m_intermediate_receive_buffer.data(), max_num_bytes);
+		if (!result)
+		{
+			raise_io_failure(env, result);
+			return -1;
+		}
+
+		int num_received_bytes = result.value();
+		env.SetByteArrayRegion(dest, 0, num_received_bytes, m_intermediate_receive_buffer.data());
+
+		return num_received_bytes;
+	}
+
+	// Probes for BlueZDevice.measureNativeDispatchTimings(). Both do
+	// what send() does, minus the actual sending, so that the timings
+	// only differ in how the call gets from Kotlin to this class.
+
+	void dispatch_probe_impl(jni::JNIEnv &env, jni::Array<jni::jbyte> const &data, jni::jint length)
+	{
+		// jni.hpp array references are raw JNI references underneath.
+		copy_to_send_buffer(env, reinterpret_cast<jbyteArray>(data.get()), length);
 	}
 
-	jni::Local<jni::Array<jni::jbyte>> receive_impl(jni::JNIEnv &env)
+	void dispatch_probe(JNIEnv &env, jbyteArray data, jint length)
 	{
+		copy_to_send_buffer(env, data, length);
+	}
+
+	void set_flow_control_config_impl(
+		jni::JNIEnv &,
+		jni::jint send_buffer_size,
+		jni::jint receive_buffer_size,
+		jni::jint pacing_threshold,
+		jni::jlong max_pacing_wait_in_milliseconds,
+		jni::jboolean track_send_queue,
+		jni::jlong coalescing_window_in_microseconds,
+		jni::jint max_coalesced_write_size
+	)
+	{
+		jni_tracepoint_scope tracepoint_scope("setFlowControlConfigImpl");
+
 		assert(m_device != nullptr);
 
-		return call_with_jni_rethrow(env, [&]() {
-			// Receive bytes over RFCOMM.
-			int num_received_bytes = m_device->receive(&m_intermediate_receive_buffer[0], m_intermediate_receive_buffer.size());
+		comboctl::rfcomm_flow_control_config config;
+		config.m_send_buffer_size = send_buffer_size;
+		config.m_receive_buffer_size = receive_buffer_size;
+		config.m_pacing_threshold = pacing_threshold;
+		config.m_max_pacing_wait = std::chrono::milliseconds(max_pacing_wait_in_milliseconds);
+		config.m_track_send_queue = track_send_queue;
+		config.m_coalescing_window = std::chrono::microseconds(coalescing_window_in_microseconds);
+		config.m_max_coalesced_write_size = std::size_t(max_coalesced_write_size);
 
-			// Create a new JNI array and copy the receivd bytes into it.
-			auto array = jni::Array<jni::jbyte>::New(env, num_received_bytes);
-			array.SetRegion(env, 0, num_received_bytes, &m_intermediate_receive_buffer[0]);
+		m_device->set_flow_control_config(config);
+	}
 
-			// Hand over the newly created and filled array.
-			return array;
-		});
+	jni::Local<jni::Array<jni::jlong>> get_flow_control_stats_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getFlowControlStatsImpl");
+
+		assert(m_device != nullptr);
+
+		comboctl::rfcomm_flow_control_stats stats = m_device->get_flow_control_stats();
+
+		// Layout: send buffer size, receive buffer size, outstanding
+		// send bytes, maximum outstanding send bytes, number of paced
+		// sends, number of pacing timeouts, total pacing wait time and
+		// maximum pacing wait time (both in microseconds), number of
+		// packets sent, number of bytes sent, number of writes, number
+		// of write syscalls, number of coalesced writes, maximum number
+		// of packets per write.
+		std::array<jni::jlong, 14> values = {{
+			jni::jlong(stats.m_send_buffer_size),
+			jni::jlong(stats.m_receive_buffer_size),
+			jni::jlong(stats.m_outstanding_send_bytes),
+			jni::jlong(stats.m_max_outstanding_send_bytes),
+			jni::jlong(stats.m_num_paced_sends),
+			jni::jlong(stats.m_num_pacing_timeouts),
+			jni::jlong(stats.m_total_pacing_wait.count()),
+			jni::jlong(stats.m_max_pacing_wait.count()),
+			jni::jlong(stats.m_num_packets_sent),
+			jni::jlong(stats.m_num_bytes_sent),
+			jni::jlong(stats.m_num_writes),
+			jni::jlong(stats.m_num_write_syscalls),
+			jni::jlong(stats.m_num_coalesced_writes),
+			jni::jlong(stats.m_max_packets_per_write)
+		}};
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	jni::jboolean wait_until_drained_impl(jni::JNIEnv &env, jni::jlong timeout_in_milliseconds)
+	{
+		jni_tracepoint_scope tracepoint_scope("waitUntilDrainedImpl");
+
+		assert(m_device != nullptr);
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_in_milliseconds);
+
+		auto result = m_device->wait_until_drained(deadline);
+		if (!result)
+		{
+			raise_io_failure(env, result);
+			return jni::jni_false;
+		}
+
+		return result.value() ? jni::jni_true : jni::jni_false;
 	}
 
 	void set_native_device_ptr(jni::JNIEnv &, jni::jlong native_device_ptr)
 	{
+		jni_tracepoint_scope tracepoint_scope("setNativeDevicePtr");
+
 		m_device = reinterpret_cast<comboctl::bluez_bluetooth_device *>(native_device_ptr);
 		assert(m_device != nullptr);
 	}
@@ -226,6 +449,29 @@ public:
 
 
 private:
+	bool copy_to_send_buffer(JNIEnv &env, jbyteArray data, jint length)
+	{
+		// Only the first "length" bytes of the array are sent. The Kotlin
+		// side encodes outgoing packets into a reusable array that is
+		// typically larger than the packet, so this avoids a copy there.
+		if ((length <= 0) || (length > env.GetArrayLength(data)))
+		{
+			env.ThrowNew(illegal_argument_exception_class, "Invalid send length");
+			return false;
+		}
+
+		// Expand the send buffer as needed. It is never shrunk,
+		// to avoid reallocations when packet sizes vary.
+		if (m_intermediate_send_buffer.size() < std::size_t(length))
+			m_intermediate_send_buffer.resize(length);
+
+		// Pass a pointer & length instead of the buffer itself, since
+		// the buffer may be larger than the number of bytes to copy.
+		env.GetByteArrayRegion(data, 0, length, m_intermediate_send_buffer.data());
+
+		return true;
+	}
+
 	std::vector<jni::jbyte> m_intermediate_send_buffer;
 	std::vector<jni::jbyte> m_intermediate_receive_buffer;
 	comboctl::bluez_bluetooth_device *m_device = nullptr;
@@ -330,6 +576,8 @@ public:
 
 	void shutdown(jni::JNIEnv &)
 	{
+		jni_tracepoint_scope tracepoint_scope("shutdown");
+
 		m_iface.teardown();
 	}
 
@@ -340,10 +588,13 @@ public:
 		jni::String const &sdp_service_description,
 		jni::String const &bt_pairing_pin_code,
 		jint discovery_duration,
+		jni::jboolean continuous_discovery,
 		int_argument_no_return_callback_wrapper::jni_object &discovery_stopped,
 		bluetooth_device_no_return_callback_wrapper::jni_object &found_new_paired_device
 	)
 	{
+		jni_tracepoint_scope tracepoint_scope("startDiscoveryImpl");
+
 		call_with_jni_rethrow(env, [&]() mutable {
 			m_iface.start_discovery(
 				jni::Make<std::string>(env, sdp_service_name),
@@ -351,6 +602,7 @@ public:
 				jni::Make<std::string>(env, sdp_service_description),
 				jni::Make<std::string>(env, bt_pairing_pin_code),
 				discovery_duration,
+				continuous_discovery ? comboctl::discovery_mode::continuous : comboctl::discovery_mode::single_device,
 				// on_discovery_started callback
 				[&]() {
 					std::unique_lock<std::mutex> lock(m_thread_env_map_mutex);
@@ -390,15 +642,22 @@ public:
 
 	void stop_discovery(jni::JNIEnv &env)
 	{
+		jni_tracepoint_scope tracepoint_scope("stopDiscovery");
+
 		call_with_jni_rethrow(env, [&]() { m_iface.stop_discovery(); });
 	}
 
 	jni::Local<jni::String> get_adapter_friendly_name(jni::JNIEnv &env)
 	{
-		return jni::Make<jni::String>(env, m_iface.get_adapter_friendly_name());
+		jni_tracepoint_scope tracepoint_scope("getAdapterFriendlyName");
+
+		std::string name = call_with_jni_rethrow(env, [&]() { return m_iface.get_adapter_friendly_name(); });
+		return jni::Make<jni::String>(env, name);
 	}
 
 	void on_device_unpaired_impl(jni::JNIEnv &env, bluetooth_device_no_return_callback_wrapper::jni_object &device_unpaired_callback) {
+		jni_tracepoint_scope tracepoint_scope("onDeviceUnpairedImpl");
+
 		m_jni_device_unpaired_callback_object = jni::NewGlobal(env, device_unpaired_callback);
 
 		m_iface.on_device_unpaired([this](comboctl::bluetooth_address paired_device_address) {
@@ -414,6 +673,8 @@ public:
 	}
 
 	void set_device_filter_impl(jni::JNIEnv &env, bluetooth_device_boolean_return_callback_wrapper::jni_object &device_filter_callback) {
+		jni_tracepoint_scope tracepoint_scope("setDeviceFilterImpl");
+
 		m_jni_filter_device_object = jni::NewGlobal(env, device_filter_callback);
 
 		m_iface.set_device_filter([this](comboctl::bluetooth_address device_address) -> bool {
@@ -428,14 +689,30 @@ public:
 		});
 	}
 
+	void set_discovery_address_prefix_impl(jni::JNIEnv &env, jni::Array<jni::jbyte> const &prefix)
+	{
+		jni_tracepoint_scope tracepoint_scope("setDiscoveryAddressPrefixImpl");
+
+		jni::jsize prefix_size = prefix.Length(env);
+		std::vector<std::uint8_t> prefix_bytes(prefix_size);
+		for (jni::jsize i = 0; i < prefix_size; ++i)
+			prefix_bytes[i] = prefix.Get(env, i);
+
+		m_iface.set_discovery_address_prefix(prefix_bytes);
+	}
+
 	void unpair_device_impl(jni::JNIEnv &env, jni::Array<jni::jbyte> const &device_address)
 	{
+		jni_tracepoint_scope tracepoint_scope("unpairDeviceImpl");
+
 		comboctl::bluetooth_address address = to_bt_address(env, device_address);
-		m_iface.unpair_device(std::move(address));
+		call_with_jni_rethrow(env, [&]() { m_iface.unpair_device(std::move(address)); });
 	}
 
 	jni::jlong get_device_impl(jni::JNIEnv &env, jni::Array<jni::jbyte> const &device_address)
 	{
+		jni_tracepoint_scope tracepoint_scope("getDeviceImpl");
+
 		return call_with_jni_rethrow(env, [&]() {
 			comboctl::bluetooth_address address = to_bt_address(env, device_address);
 			auto new_device_uptr = m_iface.get_device(address);
@@ -451,7 +728,9 @@ public:
 
 	jni::Local<jni::Array<jni::jbyte>> get_paired_device_addresses_impl(jni::JNIEnv &env)
 	{
-		comboctl::bluetooth_address_set addresses = m_iface.get_paired_device_addresses();
+		jni_tracepoint_scope tracepoint_scope("getPairedDeviceAddressesImpl");
+
+		comboctl::bluetooth_address_set addresses = call_with_jni_rethrow(env, [&]() { return m_iface.get_paired_device_addresses(); });
 		auto num_bytes_per_address = comboctl::bluetooth_address().size();
 
 		// Passing a collection of ByteArrays from C+++ to
@@ -478,6 +757,286 @@ public:
 		return result;
 	}
 
+	void wait_for_startup(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("waitForStartup");
+
+		call_with_jni_rethrow(env, [&]() { m_iface.wait_for_startup(); });
+	}
+
+	jni::Local<jni::Array<jni::jlong>> get_startup_timings_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getStartupTimingsImpl");
+
+		comboctl::startup_timings timings = m_iface.get_startup_timings();
+
+		// Layout: D-Bus connection duration, adapter setup duration,
+		// total duration, RFCOMM listener setup duration. All values
+		// are in microseconds; phases that did not finish yet are -1.
+		auto to_jlong = [](std::optional<std::chrono::microseconds> const &duration) -> jni::jlong {
+			return duration ? jni::jlong(duration->count()) : jni::jlong(-1);
+		};
+
+		std::array<jni::jlong, 4> values = {{
+			to_jlong(timings.m_dbus_connection_duration),
+			to_jlong(timings.m_adapter_setup_duration),
+			to_jlong(timings.m_total_duration),
+			to_jlong(timings.m_rfcomm_listener_setup_duration)
+		}};
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	void set_teardown_deadline_impl(jni::JNIEnv &, jni::jlong deadline_in_milliseconds)
+	{
+		jni_tracepoint_scope tracepoint_scope("setTeardownDeadlineImpl");
+
+		m_iface.set_teardown_deadline(std::chrono::milliseconds(deadline_in_milliseconds));
+	}
+
+	jni::Local<jni::Array<jni::jlong>> get_teardown_timings_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getTeardownTimingsImpl");
+
+		comboctl::teardown_timings timings = m_iface.get_teardown_timings();
+
+		// Layout: stop discovery duration, mainloop stop duration,
+		// total duration (all in microseconds; -1 if the phase did
+		// not run), deadline exceeded flag, mainloop thread abandoned
+		// flag (flags are 0 or 1).
+		auto to_jlong = [](std::optional<std::chrono::microseconds> const &duration) -> jni::jlong {
+			return duration ? jni::jlong(duration->count()) : jni::jlong(-1);
+		};
+
+		std::array<jni::jlong, 5> values = {{
+			to_jlong(timings.m_stop_discovery_duration),
+			to_jlong(timings.m_mainloop_stop_duration),
+			to_jlong(timings.m_total_duration),
+			timings.m_deadline_exceeded ? 1 : 0,
+			timings.m_mainloop_thread_abandoned ? 1 : 0
+		}};
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	void set_max_observed_devices_impl(jni::JNIEnv &, jni::jlong max_num_devices)
+	{
+		jni_tracepoint_scope tracepoint_scope("setMaxObservedDevicesImpl");
+
+		m_iface.set_max_observed_devices(std::size_t(max_num_devices));
+	}
+
+	jni::Local<jni::Array<jni::jlong>> get_device_table_stats_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getDeviceTableStatsImpl");
+
+		comboctl::device_table_stats stats = m_iface.get_device_table_stats();
+
+		// Layout: number of devices, number of paired devices, number
+		// of connected devices, maximum number of devices, number of
+		// evictions, estimated memory usage in bytes.
+		std::array<jni::jlong, 6> values = {{
+			jni::jlong(stats.m_num_devices),
+			jni::jlong(stats.m_num_paired_devices),
+			jni::jlong(stats.m_num_connected_devices),
+			jni::jlong(stats.m_max_num_devices),
+			jni::jlong(stats.m_num_evictions),
+			jni::jlong(stats.m_estimated_memory_usage)
+		}};
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	jni::Local<jni::Array<jni::jlong>> get_mainloop_stats_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getMainloopStatsImpl");
+
+		comboctl::mainloop_stats stats = m_iface.get_mainloop_stats();
+
+		// Like with the paired device addresses above, we use
+		// ONE array to transfer all of the numeric values, since
+		// creating Kotlin objects from C++ requires a lot of
+		// boilerplate. The layout is (all values are 64-bit):
+		//
+		// - queue latency histogram
+		// - dispatch duration histogram
+		// - number of slow callbacks
+		// - slowest callback duration in microseconds
+		// - slow callback budget in microseconds
+		// - length of the slowest callback's source name in bytes
+		// - the bytes of that name, one per value
+		//
+		// Each histogram is laid out like this, with N being
+		// the number of buckets:
+		//
+		// - N
+		// - N-1 bucket upper bounds in microseconds
+		// - N bucket counts
+		// - number of samples
+		// - total duration in microseconds
+		// - maximum duration in microseconds
+		//
+		// The source name is part of the array (instead of being
+		// fetched with a separate call) so that it belongs to the
+		// same snapshot as the numbers. Source names are short
+		// ASCII identifiers, so this costs little.
+
+		std::vector<jni::jlong> values;
+
+		auto add_histogram = [&](comboctl::duration_histogram const &histogram) {
+			values.push_back(histogram.m_bucket_counts.size());
+			for (auto const &upper_bound : comboctl::duration_histogram::bucket_upper_bounds)
+				values.push_back(upper_bound.count());
+			for (auto const &bucket_count : histogram.m_bucket_counts)
+				values.push_back(bucket_count);
+			values.push_back(histogram.m_num_samples);
+			values.push_back(histogram.m_total_duration.count());
+			values.push_back(histogram.m_max_duration.count());
+		};
+
+		add_histogram(stats.m_queue_latency);
+		add_histogram(stats.m_dispatch_duration);
+		values.push_back(stats.m_num_slow_callbacks);
+		values.push_back(stats.m_slowest_callback_duration.count());
+		values.push_back(stats.m_slow_callback_budget.count());
+		values.push_back(stats.m_slowest_callback_source.size());
+		for (char c : stats.m_slowest_callback_source)
+			values.push_back(static_cast<unsigned char>(c));
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	void reset_mainloop_stats(jni::JNIEnv &)
+	{
+		jni_tracepoint_scope tracepoint_scope("resetMainloopStats");
+
+		m_iface.reset_mainloop_stats();
+	}
+
+	void set_slow_mainloop_callback_budget_impl(jni::JNIEnv &, jni::jlong budget_in_microseconds)
+	{
+		jni_tracepoint_scope tracepoint_scope("setSlowMainloopCallbackBudgetImpl");
+
+		m_iface.set_slow_mainloop_callback_budget(std::chrono::microseconds(budget_in_microseconds));
+	}
+
+	void set_tracing_enabled(jni::JNIEnv &, jni::jboolean enabled)
+	{
+		jni_tracepoint_scope tracepoint_scope("setTracingEnabled");
+
+		m_iface.set_tracing_enabled(enabled);
+	}
+
+	void add_trace_span(jni::JNIEnv &env, jni::String const &category, jni::String const &name, jni::jlong start_timestamp_ns, jni::jlong duration_ns)
+	{
+		jni_tracepoint_scope tracepoint_scope("addTraceSpan");
+
+		m_iface.add_trace_span(jni::Make<std::string>(env, category), jni::Make<std::string>(env, name), start_timestamp_ns, duration_ns);
+	}
+
+	void clear_trace(jni::JNIEnv &)
+	{
+		jni_tracepoint_scope tracepoint_scope("clearTrace");
+
+		m_iface.clear_trace();
+	}
+
+	jni::Local<jni::String> export_chrome_trace(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("exportChromeTrace");
+
+		return jni::Make<jni::String>(env, m_iface.export_chrome_trace());
+	}
+
+	void start_binary_log_impl(jni::JNIEnv &env, jni::String const &path, jni::jint buffer_size_per_thread, jni::jlong flush_interval_in_milliseconds, jni::jint text_log_level)
+	{
+		jni_tracepoint_scope tracepoint_scope("startBinaryLogImpl");
+
+		comboctl::binary_log_config config;
+		config.m_path = jni::Make<std::string>(env, path);
+		config.m_buffer_size_per_thread = std::size_t(buffer_size_per_thread);
+		config.m_flush_interval = std::chrono::milliseconds(flush_interval_in_milliseconds);
+		config.m_text_log_level = comboctl::log_level(text_log_level);
+
+		call_with_jni_rethrow(env, [&]() { comboctl::binary_logger::instance().start(config); });
+	}
+
+	void stop_binary_log(jni::JNIEnv &)
+	{
+		jni_tracepoint_scope tracepoint_scope("stopBinaryLog");
+
+		comboctl::binary_logger::instance().stop();
+	}
+
+	jni::Local<jni::Array<jni::jlong>> get_binary_log_stats_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getBinaryLogStatsImpl");
+
+		comboctl::binary_log_stats stats = comboctl::binary_logger::instance().get_stats();
+
+		// Layout: number of entries, number of dropped entries,
+		// number of sites, number of bytes written.
+		std::array<jni::jlong, 4> values = {{
+			jni::jlong(stats.m_num_entries),
+			jni::jlong(stats.m_num_dropped_entries),
+			jni::jlong(stats.m_num_sites),
+			jni::jlong(stats.m_num_bytes_written)
+		}};
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	void set_native_log_threshold_impl(jni::JNIEnv &, jni::jint min_log_level)
+	{
+		jni_tracepoint_scope tracepoint_scope("setNativeLogThresholdImpl");
+
+		comboctl::set_min_log_level(comboctl::log_level(min_log_level));
+	}
+
+	jni::Local<jni::Array<jni::jlong>> get_native_allocation_stats_impl(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("getNativeAllocationStatsImpl");
+
+		comboctl::allocation_counters counters = comboctl::get_process_allocation_counters();
+
+		// Layout: 1 if allocation tracking is available (0 otherwise),
+		// number of allocations, number of allocated bytes, number
+		// of allocations inside no-allocation regions.
+		std::array<jni::jlong, 4> values = {{
+			comboctl::allocation_tracking_available ? 1 : 0,
+			jni::jlong(counters.m_num_allocations),
+			jni::jlong(counters.m_num_allocated_bytes),
+			jni::jlong(counters.m_num_region_allocations)
+		}};
+
+		auto result = jni::Array<jni::jlong>::New(env, values.size());
+		result.SetRegion(env, 0, values.size(), values.data());
+
+		return result;
+	}
+
+	jni::Local<jni::String> format_native_allocation_site_report(jni::JNIEnv &env)
+	{
+		jni_tracepoint_scope tracepoint_scope("formatNativeAllocationSiteReport");
+
+		return jni::Make<jni::String>(env, comboctl::format_allocation_site_report());
+	}
+
 	static void log_to_kotlin(std::string const &tag, comboctl::log_level level, std::string log_string)
 	{
 		std::unique_lock<std::mutex> instance_lock(m_instance_mutex);
@@ -575,6 +1134,50 @@ std::mutex bluez_interface_jni::m_instance_mutex;
 bluez_interface_jni *bluez_interface_jni::m_instance = nullptr;
 
 
+//////////////////////////////////////////////
+// bluetooth_device static hot path natives //
+//////////////////////////////////////////////
+
+
+// These are plain JNI functions, registered with RegisterNatives().
+// The peer argument is the bluetooth_device_jni instance that jni.hpp
+// created for the BlueZDevice and stored in its nativePtr field.
+
+void JNICALL native_send(JNIEnv *env, jclass, jlong peer, jbyteArray data, jint length)
+{
+	reinterpret_cast<bluetooth_device_jni *>(peer)->send(*env, data, length);
+}
+
+jint JNICALL native_receive(JNIEnv *env, jclass, jlong peer, jbyteArray dest)
+{
+	return reinterpret_cast<bluetooth_device_jni *>(peer)->receive(*env, dest);
+}
+
+void JNICALL native_dispatch_probe(JNIEnv *env, jclass, jlong peer, jbyteArray data, jint length)
+{
+	reinterpret_cast<bluetooth_device_jni *>(peer)->dispatch_probe(*env, data, length);
+}
+
+void register_device_hot_path_natives(JNIEnv &env)
+{
+	::JNINativeMethod const methods[] = {
+		{ const_cast<char *>("nativeSend"), const_cast<char *>("(J[BI)V"), reinterpret_cast<void *>(&native_send) },
+		{ const_cast<char *>("nativeReceive"), const_cast<char *>("(J[B)I"), reinterpret_cast<void *>(&native_receive) },
+		{ const_cast<char *>("nativeDispatchProbe"), const_cast<char *>("(J[BI)V"), reinterpret_cast<void *>(&native_dispatch_probe) }
+	};
+
+	jclass device_class = env.FindClass(bluetooth_device_jni::Name());
+	if (device_class == nullptr)
+		throw std::runtime_error("Could not find BlueZDevice class");
+
+	jint result = env.RegisterNatives(device_class, methods, jint(sizeof(methods) / sizeof(methods[0])));
+	env.DeleteLocalRef(device_class);
+
+	if (result != JNI_OK)
+		throw std::runtime_error(fmt::format("Could not register BlueZDevice hot path natives (error {})", result));
+}
+
+
 } // unnamed namespace end
 
 
@@ -584,6 +1187,11 @@ extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
 	{
 		jni::JNIEnv &env { jni::GetEnv(*vm) };
 
+		cancellation_exception_class = find_global_class(env, "java/util/concurrent/CancellationException");
+		link_lost_exception_class = find_global_class(env, "info/nightscout/comboctl/base/BluetoothLinkLostException");
+		bluetooth_exception_class = find_global_class(env, "info/nightscout/comboctl/base/BluetoothException");
+		illegal_argument_exception_class = find_global_class(env, "java/lang/IllegalArgumentException");
+
 		#define METHOD(MethodPtr, name) jni::MakeNativePeerMethod<decltype(MethodPtr), (MethodPtr)>(name)
 
 		jni::RegisterNativePeer<bluez_interface_jni>(
@@ -599,9 +1207,29 @@ extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
 			METHOD(&bluez_interface_jni::start_discovery_impl, "startDiscoveryImpl"),
 			METHOD(&bluez_interface_jni::on_device_unpaired_impl, "onDeviceUnpairedImpl"),
 			METHOD(&bluez_interface_jni::set_device_filter_impl, "setDeviceFilterImpl"),
+			METHOD(&bluez_interface_jni::set_discovery_address_prefix_impl, "setDiscoveryAddressPrefixImpl"),
 			METHOD(&bluez_interface_jni::unpair_device_impl, "unpairDeviceImpl"),
 			METHOD(&bluez_interface_jni::get_device_impl, "getDeviceImpl"),
-			METHOD(&bluez_interface_jni::get_paired_device_addresses_impl, "getPairedDeviceAddressesImpl")
+			METHOD(&bluez_interface_jni::get_paired_device_addresses_impl, "getPairedDeviceAddressesImpl"),
+			METHOD(&bluez_interface_jni::wait_for_startup, "waitForStartup"),
+			METHOD(&bluez_interface_jni::get_startup_timings_impl, "getStartupTimingsImpl"),
+			METHOD(&bluez_interface_jni::set_teardown_deadline_impl, "setTeardownDeadlineImpl"),
+			METHOD(&bluez_interface_jni::get_teardown_timings_impl, "getTeardownTimingsImpl"),
+			METHOD(&bluez_interface_jni::set_max_observed_devices_impl, "setMaxObservedDevicesImpl"),
+			METHOD(&bluez_interface_jni::get_device_table_stats_impl, "getDeviceTableStatsImpl"),
+			METHOD(&bluez_interface_jni::get_mainloop_stats_impl, "getMainloopStatsImpl"),
+			METHOD(&bluez_interface_jni::reset_mainloop_stats, "resetMainloopStats"),
+			METHOD(&bluez_interface_jni::set_slow_mainloop_callback_budget_impl, "setSlowMainloopCallbackBudgetImpl"),
+			METHOD(&bluez_interface_jni::set_tracing_enabled, "setTracingEnabled"),
+			METHOD(&bluez_interface_jni::add_trace_span, "addTraceSpan"),
+			METHOD(&bluez_interface_jni::clear_trace, "clearTrace"),
+			METHOD(&bluez_interface_jni::export_chrome_trace, "exportChromeTrace"),
+			METHOD(&bluez_interface_jni::start_binary_log_impl, "startBinaryLogImpl"),
+			METHOD(&bluez_interface_jni::stop_binary_log, "stopBinaryLog"),
+			METHOD(&bluez_interface_jni::get_binary_log_stats_impl, "getBinaryLogStatsImpl"),
+			METHOD(&bluez_interface_jni::set_native_log_threshold_impl, "setNativeLogThresholdImpl"),
+			METHOD(&bluez_interface_jni::get_native_allocation_stats_impl, "getNativeAllocationStatsImpl"),
+			METHOD(&bluez_interface_jni::format_native_allocation_site_report, "formatNativeAllocationSiteReport")
 		);
 
 		jni::RegisterNativePeer<bluetooth_device_jni>(
@@ -613,11 +1241,15 @@ extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
 			"finalize",
 			METHOD(&bluetooth_device_jni::connect_impl, "connectImpl"),
 			METHOD(&bluetooth_device_jni::disconnect, "disconnect"),
-			METHOD(&bluetooth_device_jni::send_impl, "sendImpl"),
-			METHOD(&bluetooth_device_jni::receive_impl, "receiveImpl"),
+			METHOD(&bluetooth_device_jni::set_flow_control_config_impl, "setFlowControlConfigImpl"),
+			METHOD(&bluetooth_device_jni::get_flow_control_stats_impl, "getFlowControlStatsImpl"),
+			METHOD(&bluetooth_device_jni::wait_until_drained_impl, "waitUntilDrainedImpl"),
+			METHOD(&bluetooth_device_jni::dispatch_probe_impl, "dispatchProbeImpl"),
 			METHOD(&bluetooth_device_jni::set_native_device_ptr, "setNativeDevicePtr")
 		);
 
+		register_device_hot_path_natives(env);
+
 		return jni::Unwrap(jni::jni_version_1_2);
 	}
 	catch (jni::PendingJavaException const &e)
@@ -0,0 +1,28 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Statistics about the native binary logger.
+ *
+ * See [BlueZInterface.startBinaryLog] for details.
+ *
+ * @property numEntries Number of log entries that were recorded.
+ * @property numDroppedEntries Number of log entries that were dropped,
+ *           because the logging thread's buffer was full.
+ * @property numSites Number of native log call sites that logged so far.
+ * @property numBytesWritten Number of bytes written to the current log file.
+ */
+data class BinaryLogStats(
+    val numEntries: Long,
+    val numDroppedEntries: Long,
+    val numSites: Long,
+    val numBytesWritten: Long
+)
+
+// Parses the LongArray produced by the native getBinaryLogStatsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseBinaryLogStats(values: LongArray) = BinaryLogStats(
+    numEntries = values[0],
+    numDroppedEntries = values[1],
+    numSites = values[2],
+    numBytesWritten = values[3]
+)
@@ -3,6 +3,7 @@ package info.nightscout.comboctl.linuxBlueZ
 import info.nightscout.comboctl.base.BluetoothAddress
 import info.nightscout.comboctl.base.BluetoothDevice
 import info.nightscout.comboctl.base.BluetoothInterface
+import info.nightscout.comboctl.base.traceSpan
 import kotlinx.coroutines.Dispatchers
 import java.lang.AutoCloseable
 
@@ -31,12 +32,25 @@ class BlueZDevice(
         setNativeDevicePtr(nativeDevicePtr)
     }
 
+    // Reused by blockingReceive(), which is only ever
+    // called by one thread at a time.
+    private val receiveBuffer = ByteArray(RECEIVE_BUFFER_SIZE)
+
     // Base class overrides.
 
     // These aren't directly external, since we have to convert
-    // the byte lists to bytearrays first.
-    override fun blockingSend(dataToSend: List<Byte>) = sendImpl(dataToSend.toByteArray())
-    override fun blockingReceive(): List<Byte> = receiveImpl().toList()
+    // the byte lists to bytearrays first, and pass the native peer.
+    override fun blockingSend(dataToSend: List<Byte>) =
+        traceSpan("jni", "BlueZDevice.send") { nativeSend(nativePtr, dataToSend.toByteArray(), dataToSend.size) }
+    // Outgoing transport layer packets are encoded into a reusable
+    // array, so these can be passed on without any conversion.
+    override fun blockingSend(data: ByteArray, length: Int) =
+        traceSpan("jni", "BlueZDevice.send") { nativeSend(nativePtr, data, length) }
+    override fun blockingReceive(): List<Byte> =
+        traceSpan("jni", "BlueZDevice.receive") {
+            val numReceivedBytes = nativeReceive(nativePtr, receiveBuffer)
+            List(numReceivedBytes) { receiveBuffer[it] }
+        }
 
     override fun connect() = connectImpl()
     external override fun disconnect()
@@ -45,6 +59,87 @@ class BlueZDevice(
         bluezInterface.unpairDevice(address)
     }
 
+    /**
+     * Sets the flow control configuration of the RFCOMM connection.
+     *
+     * Buffer sizes take effect the next time the device is connected.
+     * See [RfcommFlowControlConfig] for details.
+     */
+    fun setFlowControlConfig(config: RfcommFlowControlConfig) =
+        setFlowControlConfigImpl(
+            config.sendBufferSize,
+            config.receiveBufferSize,
+            config.pacingThreshold,
+            config.maxPacingWaitInMilliseconds,
+            config.trackSendQueue,
+            config.coalescingWindowInMicroseconds,
+            config.maxCoalescedWriteSize
+        )
+
+    /**
+     * Returns flow control statistics of the RFCOMM connection.
+     *
+     * See [RfcommFlowControlStats].
+     */
+    fun getFlowControlStats(): RfcommFlowControlStats = parseRfcommFlowControlStats(getFlowControlStatsImpl())
+
+    /**
+     * Blocks until all bytes that were sent were also transmitted.
+     *
+     * Sending returns as soon as the kernel accepted the bytes. This
+     * can be used to find out when they actually left the socket.
+     * Like sending, this is aborted by [disconnect].
+     *
+     * @param timeoutInMilliseconds Maximum time to wait. Must be positive.
+     * @return true if all bytes were transmitted, false if the timeout
+     *         elapsed before that.
+     */
+    fun waitUntilDrained(timeoutInMilliseconds: Long): Boolean {
+        require(timeoutInMilliseconds > 0) { "Timeout must be positive; got $timeoutInMilliseconds" }
+        return traceSpan("jni", "BlueZDevice.waitUntilDrained") { waitUntilDrainedImpl(timeoutInMilliseconds) }
+    }
+
+    /**
+     * Measures how long it takes to call into native code.
+     *
+     * Sending and receiving use static natives that get the native peer
+     * pointer as an argument. All other functions use instance natives,
+     * which look up that pointer through the nativePtr field and go
+     * through the argument wrappers of the jni.hpp library on each call.
+     * This times both variants with a probe that does what sending does,
+     * minus the actual sending: it copies the bytes into the native send
+     * buffer. The difference is the per-call saving of the static natives.
+     * Receiving saves the same, plus the allocation of a new byte array.
+     *
+     * This must not be called while the device is sending, since the
+     * probes use the same native send buffer.
+     *
+     * @param numCalls Number of calls to time per variant. Must be positive.
+     * @param packetSize Number of bytes to pass per call. Must be positive.
+     */
+    fun measureNativeDispatchTimings(numCalls: Int = 100000, packetSize: Int = 32): NativeDispatchTimings {
+        require(numCalls > 0) { "Number of calls must be positive; got $numCalls" }
+        require(packetSize > 0) { "Packet size must be positive; got $packetSize" }
+
+        val packet = ByteArray(packetSize)
+
+        fun measure(call: () -> Unit): Double {
+            // Warm up first so that the JIT compiled the call site.
+            repeat(numCalls / 10) { call() }
+
+            val startTimestamp = System.nanoTime()
+            repeat(numCalls) { call() }
+            return (System.nanoTime() - startTimestamp).toDouble() / numCalls
+        }
+
+        return NativeDispatchTimings(
+            numCalls = numCalls,
+            packetSize = packetSize,
+            instanceNativeCallDurationInNanoseconds = measure { dispatchProbeImpl(packet, packetSize) },
+            staticNativeCallDurationInNanoseconds = measure { nativeDispatchProbe(nativePtr, packet, packetSize) }
+        )
+    }
+
     // AutoCloseable overrides
 
     override fun close() = disconnect()
@@ -53,8 +148,19 @@ class BlueZDevice(
 
     private external fun connectImpl()
 
-    private external fun sendImpl(data: ByteArray)
-    private external fun receiveImpl(): ByteArray
+    private external fun setFlowControlConfigImpl(
+        sendBufferSize: Int,
+        receiveBufferSize: Int,
+        pacingThreshold: Int,
+        maxPacingWaitInMilliseconds: Long,
+        trackSendQueue: Boolean,
+        coalescingWindowInMicroseconds: Long,
+        maxCoalescedWriteSize: Int
+    )
+    private external fun getFlowControlStatsImpl(): LongArray
+    private external fun waitUntilDrainedImpl(timeoutInMilliseconds: Long): Boolean
+
+    private external fun dispatchProbeImpl(data: ByteArray, length: Int)
 
     private external fun setNativeDevicePtr(nativeDevicePtr: Long)
 
@@ -63,8 +169,21 @@ class BlueZDevice(
     private external fun initialize()
     private external fun finalize()
 
-    // NOTE: This is never used in Kotlin code
-    // but it is needed by jni.hpp for the C++
-    // bindings, so don't remove nativePtr.
+    // NOTE: This is needed by jni.hpp for the C++
+    // bindings, so don't remove nativePtr. It is
+    // also passed to the static natives below.
     private var nativePtr: Long = 0
+
+    private companion object {
+        // Must be at least as large as the native receive buffer.
+        const val RECEIVE_BUFFER_SIZE = 512
+
+        // Static natives for the hot path. These are registered
+        // directly instead of through jni.hpp. They get the native
+        // peer pointer (nativePtr) as their first argument.
+
+        @JvmStatic private external fun nativeSend(nativePeer: Long, data: ByteArray, length: Int)
+        @JvmStatic private external fun nativeReceive(nativePeer: Long, dest: ByteArray): Int
+        @JvmStatic private external fun nativeDispatchProbe(nativePeer: Long, data: ByteArray, length: Int)
+    }
 }
@@ -43,6 +43,7 @@ class BlueZInterface : BluetoothInterface {
         System.loadLibrary("linuxBlueZCppJNI")
         // This calls the constructor of the native C++ class.
         initialize()
+        setNativeLogThreshold(Logger.threshold)
     }
 
     /**
@@ -61,6 +62,11 @@ class BlueZInterface : BluetoothInterface {
      *
      * If discovery is ongoing, this implicitly calls stopDiscovery().
      *
+     * Shutting down is bounded by a deadline (see [setTeardownDeadline]).
+     * D-Bus calls that are in flight are cancelled. If the native mainloop
+     * thread still does not finish in time, it is abandoned. See
+     * [getTeardownTimings] for how long the shutdown took.
+     *
      * A repeated call will do nothing.
      */
     external fun shutdown()
@@ -77,12 +83,20 @@ class BlueZInterface : BluetoothInterface {
     override var deviceFilterCallback: (deviceAddress: BluetoothAddress) -> Boolean = { true }
         set(value) { setDeviceFilterImpl(BluetoothDeviceBooleanReturnCallback(value)) }
 
+    override var discoveryAddressPrefix: List<Byte> = listOf()
+        set(value) {
+            require(value.size <= NUM_BLUETOOTH_ADDRESS_BYTES) { "Prefix is longer than a Bluetooth address" }
+            setDiscoveryAddressPrefixImpl(value.toByteArray())
+            field = value
+        }
+
     override fun startDiscovery(
         sdpServiceName: String,
         sdpServiceProvider: String,
         sdpServiceDescription: String,
         btPairingPin: String,
         discoveryDuration: Int,
+        discoveryMode: BluetoothInterface.DiscoveryMode,
         onDiscoveryStopped: (reason: BluetoothInterface.DiscoveryStoppedReason) -> Unit,
         onFoundNewPairedDevice: (deviceAddress: BluetoothAddress) -> Unit
     ) {
@@ -92,6 +106,7 @@ class BlueZInterface : BluetoothInterface {
             sdpServiceDescription,
             btPairingPin,
             discoveryDuration,
+            discoveryMode == BluetoothInterface.DiscoveryMode.CONTINUOUS,
             IntArgumentNoReturnCallback {
                 onDiscoveryStopped(
                     when (it) {
@@ -146,6 +161,210 @@ class BlueZInterface : BluetoothInterface {
         return result
     }
 
+    /**
+     * Waits until the native code finished its background startup.
+     *
+     * The native code connects to D-Bus and sets up the Bluetooth adapter
+     * in the background. Functions that need these wait for the startup
+     * anyway, so calling this is optional. It is useful for detecting
+     * startup errors early.
+     *
+     * @throws info.nightscout.comboctl.base.ComboIOException if no Bluetooth adapter was found.
+     * @throws info.nightscout.comboctl.base.BluetoothException if BlueZ could not be connected to.
+     */
+    external fun waitForStartup()
+
+    /**
+     * Returns the durations of the native code's startup phases.
+     *
+     * This does not wait for the startup to finish. See [StartupTimings].
+     */
+    fun getStartupTimings(): StartupTimings = parseStartupTimings(getStartupTimingsImpl())
+
+    /**
+     * Sets the deadline for [shutdown].
+     *
+     * The default deadline is 2 seconds.
+     *
+     * @param deadlineInMilliseconds New deadline. Must be positive.
+     */
+    fun setTeardownDeadline(deadlineInMilliseconds: Long) {
+        require(deadlineInMilliseconds > 0) { "Deadline must be positive; got $deadlineInMilliseconds" }
+        setTeardownDeadlineImpl(deadlineInMilliseconds)
+    }
+
+    /**
+     * Returns the durations of the phases of the last [shutdown] call.
+     *
+     * See [TeardownTimings].
+     */
+    fun getTeardownTimings(): TeardownTimings = parseTeardownTimings(getTeardownTimingsImpl())
+
+    /**
+     * Sets the maximum number of devices the native code keeps track of.
+     *
+     * Once that number is reached, the least recently seen devices that
+     * are neither paired nor connected are forgotten. Paired devices
+     * are never forgotten. The default is 256. See [DeviceTableStats].
+     *
+     * @param maxNumDevices New maximum. Must be positive.
+     */
+    fun setMaxObservedDevices(maxNumDevices: Int) {
+        require(maxNumDevices > 0) { "Maximum number of devices must be positive; got $maxNumDevices" }
+        setMaxObservedDevicesImpl(maxNumDevices.toLong())
+    }
+
+    /**
+     * Returns statistics about the devices the native code keeps track of.
+     *
+     * See [DeviceTableStats].
+     */
+    fun getDeviceTableStats(): DeviceTableStats = parseDeviceTableStats(getDeviceTableStatsImpl())
+
+    /**
+     * Returns statistics about the native BlueZ code's internal mainloop thread.
+     *
+     * This does not go through that thread, so it can be used for
+     * diagnosing stalls while they happen. See [MainloopStats].
+     */
+    fun getMainloopStats(): MainloopStats =
+        parseMainloopStats(getMainloopStatsImpl())
+
+    /**
+     * Resets the statistics returned by [getMainloopStats].
+     *
+     * The slow callback budget is not affected.
+     */
+    external fun resetMainloopStats()
+
+    /**
+     * Sets the budget for a single callback in the native mainloop thread.
+     *
+     * Callbacks that take longer than this are logged (with their source)
+     * and counted in [MainloopStats.numSlowCallbacks]. The default is 100 ms.
+     *
+     * @param budgetInMicroseconds New budget. Must be positive.
+     */
+    fun setSlowMainloopCallbackBudget(budgetInMicroseconds: Long) {
+        require(budgetInMicroseconds > 0) { "Budget must be positive; got $budgetInMicroseconds" }
+        setSlowMainloopCallbackBudgetImpl(budgetInMicroseconds)
+    }
+
+    /**
+     * Enables or disables recording of timing spans in the native code.
+     *
+     * The native code records spans for RFCOMM sends and receives and
+     * for tasks in its mainloop thread. Spans from the Kotlin code can
+     * be added to the same timeline by setting [info.nightscout.comboctl.base.Tracer.backend]
+     * to a [BlueZTraceBackend].
+     *
+     * The native trace recorder is process-wide. It is disabled by default.
+     */
+    external fun setTracingEnabled(enabled: Boolean)
+
+    /**
+     * Records a timing span in the native trace recorder.
+     *
+     * Does nothing if tracing is disabled.
+     *
+     * @param category Category of the span. Truncated to 15 characters.
+     * @param name Name of the span. Truncated to 47 characters.
+     * @param startTimestampInNs Timestamp of the span's beginning, as returned by [System.nanoTime].
+     * @param durationInNs Duration of the span in nanoseconds.
+     */
+    external fun addTraceSpan(category: String, name: String, startTimestampInNs: Long, durationInNs: Long)
+
+    /**
+     * Discards all timing spans recorded so far.
+     */
+    external fun clearTrace()
+
+    /**
+     * Exports the recorded timing spans as Chrome trace event JSON.
+     *
+     * The output can be loaded by chrome://tracing and by the Perfetto UI.
+     */
+    external fun exportChromeTrace(): String
+
+    /**
+     * Starts writing the native log output to a binary log file.
+     *
+     * Instead of formatting log lines and passing them to the [Logger],
+     * the native code then only records the raw arguments of each log
+     * call, and a background thread writes them to the file. This is
+     * cheap enough to keep debug logging enabled all the time. Use the
+     * tools/decode-binary-log.py script to render the file to text.
+     *
+     * Log lines of [textLogLevel] or above are still passed to the
+     * [Logger] as well. The binary logger is process-wide. If it is
+     * already running, it is restarted with the new file.
+     *
+     * @param path Path of the log file. An existing file is overwritten.
+     * @param bufferSizePerThread Size of each native thread's log buffer in bytes.
+     *        Log lines are dropped while the buffer is full.
+     * @param flushIntervalInMilliseconds How often the buffers are written to the file.
+     * @param textLogLevel Level at which log lines are also passed to the [Logger].
+     * @throws info.nightscout.comboctl.base.ComboIOException if the file cannot be opened.
+     */
+    fun startBinaryLog(
+        path: String,
+        bufferSizePerThread: Int = 64 * 1024,
+        flushIntervalInMilliseconds: Long = 250,
+        textLogLevel: LogLevel = LogLevel.WARN
+    ) {
+        require(path.isNotEmpty()) { "Path must not be empty" }
+        require(bufferSizePerThread > 0) { "Buffer size must be positive; got $bufferSizePerThread" }
+        require(flushIntervalInMilliseconds > 0) { "Flush interval must be positive; got $flushIntervalInMilliseconds" }
+
+        startBinaryLogImpl(path, bufferSizePerThread, flushIntervalInMilliseconds, toCppLogLevel(textLogLevel))
+    }
+
+    /**
+     * Stops the binary logger after writing all pending log lines to the file.
+     *
+     * Afterwards, all native log lines are passed to the [Logger] again.
+     * Does nothing if the binary logger is not running.
+     */
+    external fun stopBinaryLog()
+
+    /**
+     * Returns statistics about the binary logger. See [BinaryLogStats].
+     */
+    fun getBinaryLogStats(): BinaryLogStats = parseBinaryLogStats(getBinaryLogStatsImpl())
+
+    /**
+     * Sets the threshold for native log lines.
+     *
+     * Native log lines that are less important than the threshold are
+     * discarded before they are formatted, instead of being passed to
+     * the [Logger] only to be filtered out there. This is considerably
+     * cheaper, and keeps the native send and receive paths free of
+     * allocations. The threshold is set to [Logger.threshold] when the
+     * interface is created. Call this again if [Logger.threshold]
+     * changes later. Native log lines are still filtered by
+     * [Logger.threshold] as well.
+     *
+     * @param threshold New threshold for native log lines.
+     */
+    fun setNativeLogThreshold(threshold: LogLevel) = setNativeLogThresholdImpl(toCppLogLevel(threshold))
+
+    /**
+     * Returns the native heap allocation counters.
+     *
+     * These are only available in instrumentation builds of the native
+     * code (see [NativeAllocationStats] for details).
+     */
+    fun getNativeAllocationStats(): NativeAllocationStats = parseNativeAllocationStats(getNativeAllocationStatsImpl())
+
+    /**
+     * Returns a human readable list of the native allocations that
+     * happened in code that is supposed to not allocate, along with
+     * their call stacks.
+     *
+     * See [NativeAllocationStats] for details.
+     */
+    external fun formatNativeAllocationSiteReport(): String
+
     // Private external C++ functions.
 
     private external fun startDiscoveryImpl(
@@ -154,6 +373,7 @@ class BlueZInterface : BluetoothInterface {
         sdpServiceDescription: String,
         btPairingPin: String,
         discoveryDuration: Int,
+        continuousDiscovery: Boolean,
         discoveryStopped: IntArgumentNoReturnCallback,
         foundNewPairedDevice: BluetoothDeviceNoReturnCallback
     )
@@ -162,12 +382,36 @@ class BlueZInterface : BluetoothInterface {
 
     private external fun setDeviceFilterImpl(callback: BluetoothDeviceBooleanReturnCallback)
 
+    private external fun setDiscoveryAddressPrefixImpl(prefix: ByteArray)
+
     private external fun unpairDeviceImpl(deviceAddress: ByteArray)
 
     private external fun getDeviceImpl(deviceAddress: ByteArray): Long
 
     private external fun getPairedDeviceAddressesImpl(): ByteArray
 
+    private external fun getStartupTimingsImpl(): LongArray
+
+    private external fun setTeardownDeadlineImpl(deadlineInMilliseconds: Long)
+
+    private external fun getTeardownTimingsImpl(): LongArray
+
+    private external fun setMaxObservedDevicesImpl(maxNumDevices: Long)
+
+    private external fun getDeviceTableStatsImpl(): LongArray
+
+    private external fun getMainloopStatsImpl(): LongArray
+
+    private external fun setSlowMainloopCallbackBudgetImpl(budgetInMicroseconds: Long)
+
+    private external fun startBinaryLogImpl(path: String, bufferSizePerThread: Int, flushIntervalInMilliseconds: Long, textLogLevel: Int)
+
+    private external fun getBinaryLogStatsImpl(): LongArray
+
+    private external fun setNativeLogThresholdImpl(minLogLevel: Int)
+
+    private external fun getNativeAllocationStatsImpl(): LongArray
+
     // jni.hpp specifics.
 
     private external fun initialize()
@@ -193,3 +437,12 @@ internal fun nativeLoggerCall(tag: String, cppLogLevel: Int, message: String) {
     if (logLevel.numericLevel <= Logger.threshold.numericLevel)
         Logger.backend.log(tag, logLevel, null, message)
 }
+
+// This is the inverse of the mapping in nativeLoggerCall().
+private fun toCppLogLevel(logLevel: LogLevel) = when (logLevel) {
+    LogLevel.VERBOSE -> 0
+    LogLevel.DEBUG -> 1
+    LogLevel.INFO -> 2
+    LogLevel.WARN -> 3
+    LogLevel.ERROR -> 4
+}
@@ -0,0 +1,23 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+import info.nightscout.comboctl.base.TraceBackend
+
+/**
+ * Trace backend that records spans in the native trace recorder.
+ *
+ * This puts spans from the Kotlin code into the same timeline as
+ * the spans recorded by the native BlueZ code, which can then be
+ * exported with [BlueZInterface.exportChromeTrace]. To use it,
+ * set [info.nightscout.comboctl.base.Tracer.backend] to an
+ * instance of this class, and enable tracing with
+ * [BlueZInterface.setTracingEnabled].
+ *
+ * On Linux, [System.nanoTime] uses the CLOCK_MONOTONIC clock,
+ * which is the clock the native code uses as well.
+ */
+class BlueZTraceBackend(private val bluezInterface: BlueZInterface) : TraceBackend {
+    override fun getTimestampInNs() = System.nanoTime()
+
+    override fun addSpan(category: String, name: String, startTimestampInNs: Long, durationInNs: Long) =
+        bluezInterface.addTraceSpan(category, name, startTimestampInNs, durationInNs)
+}
@@ -0,0 +1,36 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Statistics about the table of devices the native BlueZ code keeps track of.
+ *
+ * The native code records every device that passes the device filter.
+ * That table is bounded (see [BlueZInterface.setMaxObservedDevices]).
+ * Paired devices are never evicted from it, so it can hold more devices
+ * than its maximum if there are more paired devices than that.
+ *
+ * @property numDevices Number of devices currently in the table.
+ * @property numPairedDevices Number of paired devices in the table.
+ * @property numConnectedDevices Number of connected devices in the table.
+ * @property maxNumDevices Maximum number of devices in the table.
+ * @property numEvictions Number of devices that were evicted so far.
+ * @property estimatedMemoryUsageInBytes Estimated heap memory the table occupies.
+ */
+data class DeviceTableStats(
+    val numDevices: Long,
+    val numPairedDevices: Long,
+    val numConnectedDevices: Long,
+    val maxNumDevices: Long,
+    val numEvictions: Long,
+    val estimatedMemoryUsageInBytes: Long
+)
+
+// Parses the LongArray produced by the native getDeviceTableStatsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseDeviceTableStats(values: LongArray) = DeviceTableStats(
+    numDevices = values[0],
+    numPairedDevices = values[1],
+    numConnectedDevices = values[2],
+    maxNumDevices = values[3],
+    numEvictions = values[4],
+    estimatedMemoryUsageInBytes = values[5]
+)
@@ -0,0 +1,84 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Histogram of durations, as recorded by the native BlueZ code.
+ *
+ * Bucket #i counts samples that are shorter than [bucketUpperBoundsInMicroseconds]`[i]`.
+ * The last bucket counts all samples that are at least as long as the last upper bound.
+ * This is why [bucketCounts] has one more element than [bucketUpperBoundsInMicroseconds].
+ */
+data class DurationHistogram(
+    val bucketUpperBoundsInMicroseconds: List<Long>,
+    val bucketCounts: List<Long>,
+    val numSamples: Long,
+    val totalDurationInMicroseconds: Long,
+    val maxDurationInMicroseconds: Long
+) {
+    val averageDurationInMicroseconds: Long
+        get() = if (numSamples > 0) (totalDurationInMicroseconds / numSamples) else 0
+}
+
+/**
+ * Statistics about the internal mainloop thread of the native BlueZ code.
+ *
+ * All D-Bus signals, agent calls, and tasks that [BlueZInterface] posts
+ * internally are serialized onto that one thread. These statistics help
+ * with diagnosing stalls and saturation of that thread.
+ *
+ * @property queueLatency Time between a task being posted to the mainloop
+ *           and the mainloop starting to execute it.
+ * @property dispatchDuration How long mainloop callbacks took to run.
+ * @property numSlowCallbacks Number of callbacks that took longer than
+ *           [slowCallbackBudgetInMicroseconds].
+ * @property slowestCallbackDurationInMicroseconds Duration of the slowest callback so far.
+ * @property slowestCallbackSource Name of the slowest callback's source.
+ *           Empty if no callback was observed yet.
+ * @property slowCallbackBudgetInMicroseconds Currently configured budget for a single callback.
+ */
+data class MainloopStats(
+    val queueLatency: DurationHistogram,
+    val dispatchDuration: DurationHistogram,
+    val numSlowCallbacks: Long,
+    val slowestCallbackDurationInMicroseconds: Long,
+    val slowestCallbackSource: String,
+    val slowCallbackBudgetInMicroseconds: Long
+)
+
+// Parses the LongArray produced by the native getMainloopStatsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseMainloopStats(values: LongArray): MainloopStats {
+    var offset = 0
+
+    fun parseHistogram(): DurationHistogram {
+        val numBuckets = values[offset++].toInt()
+        val upperBounds = values.slice(offset until (offset + numBuckets - 1))
+        offset += numBuckets - 1
+        val bucketCounts = values.slice(offset until (offset + numBuckets))
+        offset += numBuckets
+        return DurationHistogram(
+            bucketUpperBoundsInMicroseconds = upperBounds,
+            bucketCounts = bucketCounts,
+            numSamples = values[offset++],
+            totalDurationInMicroseconds = values[offset++],
+            maxDurationInMicroseconds = values[offset++]
+        )
+    }
+
+    val queueLatency = parseHistogram()
+    val dispatchDuration = parseHistogram()
+    val numSlowCallbacks = values[offset++]
+    val slowestCallbackDurationInMicroseconds = values[offset++]
+    val slowCallbackBudgetInMicroseconds = values[offset++]
+
+    val sourceNameLength = values[offset++].toInt()
+    val slowestCallbackSource = ByteArray(sourceNameLength) { values[offset + it].toByte() }.decodeToString()
+
+    return MainloopStats(
+        queueLatency = queueLatency,
+        dispatchDuration = dispatchDuration,
+        numSlowCallbacks = numSlowCallbacks,
+        slowestCallbackDurationInMicroseconds = slowestCallbackDurationInMicroseconds,
+        slowestCallbackSource = slowestCallbackSource,
+        slowCallbackBudgetInMicroseconds = slowCallbackBudgetInMicroseconds
+    )
+}
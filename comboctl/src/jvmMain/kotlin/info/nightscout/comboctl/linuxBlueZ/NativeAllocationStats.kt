@@ -0,0 +1,39 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Heap allocation counters of the native code.
+ *
+ * The native send and receive paths as well as the native mainloop
+ * task dispatch are not supposed to allocate memory in their steady
+ * state. Instrumentation builds of the native code (built with the
+ * comboctlAllocationTracking Gradle property set) count all native
+ * allocations, and separately those that happen in these paths. Use
+ * [BlueZInterface.formatNativeAllocationSiteReport] to find out where
+ * the latter come from.
+ *
+ * Only allocations made by the native library's own code are counted,
+ * not the ones made by GLib on its behalf. The comboctl-mock-bluez
+ * alloc-check mode covers these as well.
+ *
+ * @property isAvailable true if the native code is an instrumentation build.
+ *           If this is false, all counters are zero.
+ * @property numAllocations Number of native allocations.
+ * @property numAllocatedBytes Number of bytes requested by these allocations.
+ * @property numHotPathAllocations Number of allocations that happened in
+ *           the send and receive paths and the mainloop task dispatch.
+ */
+data class NativeAllocationStats(
+    val isAvailable: Boolean,
+    val numAllocations: Long,
+    val numAllocatedBytes: Long,
+    val numHotPathAllocations: Long
+)
+
+// Parses the LongArray produced by the native getNativeAllocationStatsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseNativeAllocationStats(values: LongArray) = NativeAllocationStats(
+    isAvailable = (values[0] != 0L),
+    numAllocations = values[1],
+    numAllocatedBytes = values[2],
+    numHotPathAllocations = values[3]
+)
@@ -0,0 +1,24 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Per-call durations of the two ways [BlueZDevice] calls into native code.
+ *
+ * See [BlueZDevice.measureNativeDispatchTimings] for details.
+ *
+ * @property numCalls Number of calls that were timed per variant.
+ * @property packetSize Number of bytes that were passed per call.
+ * @property instanceNativeCallDurationInNanoseconds Average duration of a call
+ *           through an instance native that is registered through jni.hpp.
+ * @property staticNativeCallDurationInNanoseconds Average duration of a call
+ *           through a static native that gets the native peer pointer.
+ */
+data class NativeDispatchTimings(
+    val numCalls: Int,
+    val packetSize: Int,
+    val instanceNativeCallDurationInNanoseconds: Double,
+    val staticNativeCallDurationInNanoseconds: Double
+) {
+    /** Time saved per call by using the static native. */
+    val savingsPerCallInNanoseconds: Double
+        get() = instanceNativeCallDurationInNanoseconds - staticNativeCallDurationInNanoseconds
+}
@@ -0,0 +1,120 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Flow control configuration for a [BlueZDevice]'s RFCOMM connection.
+ *
+ * Sending returns as soon as the kernel accepted the bytes. If the
+ * RFCOMM link is congested, these bytes pile up in the socket's send
+ * queue. If pacing is enabled, sending first waits until the amount
+ * of outstanding bytes drops to [pacingThreshold], or until
+ * [maxPacingWaitInMilliseconds] elapsed.
+ *
+ * Outstanding bytes are measured the way the kernel accounts for
+ * socket memory, which includes its per-buffer overhead. A single
+ * small packet therefore accounts for several hundred bytes.
+ * Measuring them costs a syscall, so sending only does that if
+ * pacing is enabled or [trackSendQueue] is set.
+ *
+ * With write coalescing, sends from several threads that happen within
+ * [coalescingWindowInMicroseconds] are gathered into one write, so the
+ * RFCOMM layer can transmit them in fewer baseband packets. This adds
+ * up to one window of latency to each send. It is only useful if several
+ * threads send at the same time, which is why it is disabled by default.
+ *
+ * @property sendBufferSize Socket send buffer size, or 0 to use the kernel default.
+ * @property receiveBufferSize Socket receive buffer size, or 0 to use the kernel default.
+ * @property pacingThreshold Outstanding bytes above which sending waits, or 0 to disable pacing.
+ * @property maxPacingWaitInMilliseconds Maximum time sending waits due to pacing.
+ * @property trackSendQueue Whether sending records the outstanding bytes in the
+ *           statistics (see [RfcommFlowControlStats.outstandingSendBytes]).
+ * @property coalescingWindowInMicroseconds How long a send waits for other sends
+ *           to join its write, or 0 to disable write coalescing.
+ * @property maxCoalescedWriteSize Number of gathered bytes at which a coalesced
+ *           write is done without waiting for the rest of the window.
+ */
+data class RfcommFlowControlConfig(
+    val sendBufferSize: Int = 0,
+    val receiveBufferSize: Int = 0,
+    val pacingThreshold: Int = 0,
+    val maxPacingWaitInMilliseconds: Long = 500,
+    val trackSendQueue: Boolean = false,
+    val coalescingWindowInMicroseconds: Long = 0,
+    val maxCoalescedWriteSize: Int = 1024
+) {
+    init {
+        require(sendBufferSize >= 0) { "Send buffer size must not be negative; got $sendBufferSize" }
+        require(receiveBufferSize >= 0) { "Receive buffer size must not be negative; got $receiveBufferSize" }
+        require(pacingThreshold >= 0) { "Pacing threshold must not be negative; got $pacingThreshold" }
+        require(maxPacingWaitInMilliseconds > 0) { "Maximum pacing wait must be positive; got $maxPacingWaitInMilliseconds" }
+        require(coalescingWindowInMicroseconds >= 0) { "Coalescing window must not be negative; got $coalescingWindowInMicroseconds" }
+        require(maxCoalescedWriteSize > 0) { "Maximum coalesced write size must be positive; got $maxCoalescedWriteSize" }
+    }
+}
+
+/**
+ * Flow control statistics of a [BlueZDevice]'s RFCOMM connection.
+ *
+ * The buffer sizes are the ones the kernel actually uses, which can
+ * differ from the ones in [RfcommFlowControlConfig].
+ *
+ * @property sendBufferSize Actual socket send buffer size, or 0 if not connected.
+ * @property receiveBufferSize Actual socket receive buffer size, or 0 if not connected.
+ * @property outstandingSendBytes Outstanding bytes observed by the most recent send that
+ *           measured them. Only updated if pacing is enabled or
+ *           [RfcommFlowControlConfig.trackSendQueue] is set.
+ * @property maxOutstandingSendBytes Highest number of outstanding bytes observed so far.
+ * @property numPacedSends Number of sends that had to wait due to pacing.
+ * @property numPacingTimeouts Number of sends whose pacing wait hit the maximum.
+ * @property totalPacingWaitInMicroseconds Total time sends spent waiting due to pacing.
+ * @property maxPacingWaitInMicroseconds Longest time a send spent waiting due to pacing.
+ * @property numPacketsSent Number of packets (that is, sends) whose bytes were written.
+ * @property numBytesSent Number of bytes written.
+ * @property numWrites Number of writes. A coalesced write counts once.
+ * @property numWriteSyscalls Number of write syscalls. This exceeds [numWrites]
+ *           if the kernel accepted only part of a write.
+ * @property numCoalescedWrites Number of writes that contained more than one packet.
+ * @property maxPacketsPerWrite Highest number of packets that were contained in one write.
+ */
+data class RfcommFlowControlStats(
+    val sendBufferSize: Long,
+    val receiveBufferSize: Long,
+    val outstandingSendBytes: Long,
+    val maxOutstandingSendBytes: Long,
+    val numPacedSends: Long,
+    val numPacingTimeouts: Long,
+    val totalPacingWaitInMicroseconds: Long,
+    val maxPacingWaitInMicroseconds: Long,
+    val numPacketsSent: Long,
+    val numBytesSent: Long,
+    val numWrites: Long,
+    val numWriteSyscalls: Long,
+    val numCoalescedWrites: Long,
+    val maxPacketsPerWrite: Long
+) {
+    /** Average number of bytes per write syscall, or 0 if nothing was written yet. */
+    val bytesPerSyscall: Double
+        get() = if (numWriteSyscalls > 0) numBytesSent.toDouble() / numWriteSyscalls else 0.0
+
+    /** Average number of packets per write, or 0 if nothing was written yet. */
+    val packetsPerWrite: Double
+        get() = if (numWrites > 0) numPacketsSent.toDouble() / numWrites else 0.0
+}
+
+// Parses the LongArray produced by the native getFlowControlStatsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseRfcommFlowControlStats(values: LongArray) = RfcommFlowControlStats(
+    sendBufferSize = values[0],
+    receiveBufferSize = values[1],
+    outstandingSendBytes = values[2],
+    maxOutstandingSendBytes = values[3],
+    numPacedSends = values[4],
+    numPacingTimeouts = values[5],
+    totalPacingWaitInMicroseconds = values[6],
+    maxPacingWaitInMicroseconds = values[7],
+    numPacketsSent = values[8],
+    numBytesSent = values[9],
+    numWrites = values[10],
+    numWriteSyscalls = values[11],
+    numCoalescedWrites = values[12],
+    maxPacketsPerWrite = values[13]
+)
@@ -0,0 +1,40 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Durations of the startup phases of the native BlueZ code.
+ *
+ * Creating a [BlueZInterface] only starts the native mainloop thread.
+ * That thread acquires the D-Bus connection and sets up the Bluetooth
+ * adapter in the background, while already paired pumps can be connected
+ * to right away. The RFCOMM listener (needed only for the SDP record that
+ * lets the pump find us during pairing) is set up by the first
+ * [BlueZInterface.startDiscovery] call.
+ *
+ * All durations are in microseconds. Phases that have not finished yet are null.
+ *
+ * @property dbusConnectionDurationInMicroseconds Time it took to get the D-Bus system bus connection.
+ * @property adapterSetupDurationInMicroseconds Time it took to enumerate BlueZ objects,
+ *           create the adapter proxy, and subscribe to BlueZ signals.
+ * @property totalDurationInMicroseconds Time from creating the interface until the
+ *           background startup finished (successfully or not).
+ * @property rfcommListenerSetupDurationInMicroseconds Time it took to set up the RFCOMM listener.
+ */
+data class StartupTimings(
+    val dbusConnectionDurationInMicroseconds: Long?,
+    val adapterSetupDurationInMicroseconds: Long?,
+    val totalDurationInMicroseconds: Long?,
+    val rfcommListenerSetupDurationInMicroseconds: Long?
+)
+
+// Parses the LongArray produced by the native getStartupTimingsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseStartupTimings(values: LongArray): StartupTimings {
+    fun valueAt(index: Int) = values[index].takeIf { it >= 0 }
+
+    return StartupTimings(
+        dbusConnectionDurationInMicroseconds = valueAt(0),
+        adapterSetupDurationInMicroseconds = valueAt(1),
+        totalDurationInMicroseconds = valueAt(2),
+        rfcommListenerSetupDurationInMicroseconds = valueAt(3)
+    )
+}
@@ -0,0 +1,40 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+/**
+ * Durations of the phases of shutting down the native BlueZ code.
+ *
+ * [BlueZInterface.shutdown] first cancels all in-flight D-Bus calls, then
+ * stops the discovery, and then stops the native mainloop thread. The last
+ * two phases share one deadline (see [BlueZInterface.setTeardownDeadline]).
+ *
+ * All durations are in microseconds. Phases that did not run are null.
+ *
+ * @property stopDiscoveryDurationInMicroseconds Time it took to stop the discovery
+ *           and to unregister the agent and the SDP service.
+ * @property mainloopStopDurationInMicroseconds Time it took to stop the mainloop thread.
+ * @property totalDurationInMicroseconds Total duration of the shutdown.
+ * @property deadlineExceeded true if one of the phases did not finish before the deadline.
+ * @property mainloopThreadAbandoned true if the mainloop thread did not finish before
+ *           the deadline and was abandoned. Its native resources are leaked then.
+ */
+data class TeardownTimings(
+    val stopDiscoveryDurationInMicroseconds: Long?,
+    val mainloopStopDurationInMicroseconds: Long?,
+    val totalDurationInMicroseconds: Long?,
+    val deadlineExceeded: Boolean,
+    val mainloopThreadAbandoned: Boolean
+)
+
+// Parses the LongArray produced by the native getTeardownTimingsImpl()
+// function. See the C++ JNI bindings for details about the layout.
+internal fun parseTeardownTimings(values: LongArray): TeardownTimings {
+    fun valueAt(index: Int) = values[index].takeIf { it >= 0 }
+
+    return TeardownTimings(
+        stopDiscoveryDurationInMicroseconds = valueAt(0),
+        mainloopStopDurationInMicroseconds = valueAt(1),
+        totalDurationInMicroseconds = valueAt(2),
+        deadlineExceeded = (values[3] != 0L),
+        mainloopThreadAbandoned = (values[4] != 0L)
+    )
+}
@@ -44,6 +44,18 @@ class ComboFrameTest {
         assertEquals(frameDataWithEscapedSpecialBytes, producedEscapedFrameData)
     }
 
+    @Test
+    fun writeEscapedFrameDataIntoArray() {
+        // Frame the payload into a larger, reused array and check that
+        // the framing matches the one produced by toComboFrame().
+
+        val payloadArray = payloadDataWithSpecialBytes.toByteArray() + ByteArray(4) { 0xCC.toByte() }
+        val frameBuffer = ByteArray(maxComboFrameSize(payloadArray.size))
+
+        val frameLength = payloadArray.writeComboFrame(payloadDataWithSpecialBytes.size, frameBuffer)
+        assertEquals(frameDataWithEscapedSpecialBytes, frameBuffer.copyOf(frameLength).toList())
+    }
+
     @Test
     fun parseEscapedFrameData() {
         // Parse escaped frame data and check that the original payload is recovered.
@@ -7,13 +7,20 @@ import info.nightscout.comboctl.base.testUtils.TestRefPacketItem
 import info.nightscout.comboctl.base.testUtils.checkTestPacketSequence
 import info.nightscout.comboctl.base.testUtils.produceTpLayerPacket
 import info.nightscout.comboctl.base.testUtils.runBlockingWithWatchdog
+import kotlinx.coroutines.channels.Channel
 import kotlinx.coroutines.delay
 import kotlinx.datetime.LocalDateTime
 import kotlinx.datetime.UtcOffset
 import kotlin.test.Test
 import kotlin.test.assertEquals
+import kotlin.test.assertNull
 import kotlin.test.assertTrue
 
+// Each RT_DISPLAY packet contains one of the 4 rows of a display
+// frame, and pixels are stored as bits, so one row is made of
+// NUM_DISPLAY_FRAME_PIXELS / 8 / 4 bytes.
+private const val NUM_RT_DISPLAY_ROW_BYTES = NUM_DISPLAY_FRAME_PIXELS / 8 / 4
+
 class PumpIOTest {
     // Common test code.
     class TestStates(setupInvariantPumpData: Boolean) {
@@ -22,6 +29,12 @@ class PumpIOTest {
         var testIO: TestComboIO
         var pumpIO: PumpIO
 
+        // Completed display frames that PumpIO passed to its
+        // onNewDisplayFrame callback. The null frames that PumpIO
+        // passes to that callback when connecting and disconnecting
+        // are not recorded here.
+        val displayFrameChannel = Channel<DisplayFrame>(Channel.UNLIMITED)
+
         init {
             Logger.threshold = LogLevel.VERBOSE
 
@@ -49,7 +62,15 @@ class PumpIOTest {
                 testIO.pumpClientCipher = invariantPumpData.pumpClientCipher
             }
 
-            pumpIO = PumpIO(testPumpStateStore, testBluetoothDevice, onNewDisplayFrame = {}, onPacketReceiverException = {})
+            pumpIO = PumpIO(
+                testPumpStateStore,
+                testBluetoothDevice,
+                onNewDisplayFrame = { displayFrame ->
+                    if (displayFrame != null)
+                        displayFrameChannel.trySend(displayFrame)
+                },
+                onPacketReceiverException = {}
+            )
         }
 
         // Tests that a long button press is handled correctly.
@@ -127,6 +148,29 @@ class PumpIOTest {
             )
         }
 
+        // Feeds an RT_DISPLAY packet with the given display
+        // frame index, row (in the 0-3 range), and row pixel
+        // bytes into the test IO.
+        suspend fun feedRTDisplayPacket(index: Int, row: Int, rowBytes: List<Byte>) {
+            val invariantPumpData = testPumpStateStore.getInvariantPumpData(testBluetoothDevice.address)
+            val rowID = listOf(0x47, 0x48, 0xB7, 0xB8)[row]
+
+            testIO.feedIncomingData(
+                produceTpLayerPacket(
+                    ApplicationLayer.Packet(
+                        command = ApplicationLayer.Command.RT_DISPLAY,
+                        payload = byteArrayListOfInts(
+                            0x00, 0x00,
+                            ApplicationLayer.RTDisplayUpdateReason.UPDATED_BY_COMBO.id,
+                            index,
+                            rowID
+                        ).apply { addAll(rowBytes) }
+                    ).toTransportLayerPacketInfo(),
+                    invariantPumpData.pumpClientCipher
+                ).toByteList()
+            )
+        }
+
         // This removes initial connection setup packets that are
         // normally sent to the Combo. Outgoing packets are recorded
         // in the testIO.sentPacketData list. In the tests here, we
@@ -296,6 +340,46 @@ class PumpIOTest {
         }
     }
 
+    @Test
+    fun checkLongRTButtonPressStopsWithoutConfirmation() {
+        // Check that keepGoing is evaluated while the button confirmation
+        // is being waited for, and that the long press stops as soon as
+        // keepGoing returns false, without waiting for the confirmation.
+        // To that end, the simulated Combo never confirms the button press.
+        // If the long press waited for the confirmation before calling
+        // keepGoing again, this test would never finish.
+
+        runBlockingWithWatchdog(6000) {
+            val testStates = TestStates(true)
+            val testIO = testStates.testIO
+            val pumpIO = testStates.pumpIO
+
+            testIO.respondToRTKeypressWithConfirmation = false
+
+            testStates.feedInitialPackets()
+
+            pumpIO.connect(runHeartbeat = false)
+
+            var counter = 0
+            pumpIO.startLongRTButtonPress(ApplicationLayer.RTButton.UP) {
+                // Return true the first time, which causes one
+                // button status to be sent, and false afterwards.
+                counter++
+                counter <= 1
+            }
+            pumpIO.waitForLongRTButtonPressToFinish()
+
+            pumpIO.disconnect()
+
+            assertEquals(2, counter)
+
+            testStates.checkAndRemoveInitialSentPackets()
+            testStates.checkLongRTButtonPressPacketSequence(ApplicationLayer.RTButton.UP)
+            // Only the first button status must have been sent.
+            assertTrue(testIO.sentPacketData.isEmpty())
+        }
+    }
+
     @Test
     fun checkDoubleLongButtonPress() {
         // Check what happens if the user issues redundant startLongRTButtonPress()
@@ -656,4 +740,114 @@ class PumpIOTest {
                 assertEquals(events.first, events.second)
         }
     }
+
+    @Test
+    fun checkRTDisplayFramesAreProcessedInOrder() {
+        // Feed the RT_DISPLAY packets of several display frames into
+        // the test IO and check that PumpIO's RT packet processor
+        // assembles these frames and outputs them in the order in
+        // which the packets arrived. Each frame's rows use different
+        // pixel bytes, so frames that are reordered, mixed up, or
+        // dropped show up as a mismatch.
+
+        runBlockingWithWatchdog(6000) {
+            val testStates = TestStates(true)
+            val pumpIO = testStates.pumpIO
+
+            val rowBytesList = (0 until 5).map { frameIndex ->
+                (0 until 4).map { row -> List(NUM_RT_DISPLAY_ROW_BYTES) { (frameIndex * 4 + row + 1).toByte() } }
+            }
+
+            val referenceAssembler = DisplayFrameAssembler()
+            val expectedDisplayFrames = rowBytesList.mapIndexed { frameIndex, rows ->
+                rows.mapIndexed { row, rowBytes ->
+                    referenceAssembler.processRTDisplayPayload(frameIndex, row, rowBytes)
+                }.last()!!
+            }
+
+            testStates.feedInitialPackets()
+
+            pumpIO.connect(runHeartbeat = false)
+
+            rowBytesList.forEachIndexed { frameIndex, rows ->
+                rows.forEachIndexed { row, rowBytes ->
+                    testStates.feedRTDisplayPacket(frameIndex, row, rowBytes)
+                }
+            }
+
+            val receivedDisplayFrames = expectedDisplayFrames.map { testStates.displayFrameChannel.receive() }
+
+            pumpIO.disconnect()
+
+            assertEquals(expectedDisplayFrames, receivedDisplayFrames)
+            assertNull(testStates.displayFrameChannel.tryReceive().getOrNull())
+        }
+    }
+
+    @Test
+    fun checkRTPacketProcessingAfterReconnect() {
+        // Check that the RT packet channel is reset when reconnecting.
+        // The first connection ends after only half of a display frame
+        // arrived. The second connection then receives the other half
+        // of that frame followed by a complete frame. The RT packet
+        // processor of the second connection must process the packets
+        // (meaning that it does not use the channel that was closed
+        // by disconnect()), and it must not complete the frame that
+        // was split across the connections.
+
+        runBlockingWithWatchdog(6000) {
+            val testStates = TestStates(true)
+            val testIO = testStates.testIO
+            val pumpIO = testStates.pumpIO
+
+            val firstRowBytes = List(NUM_RT_DISPLAY_ROW_BYTES) { 0x11.toByte() }
+            val splitRowBytes = List(NUM_RT_DISPLAY_ROW_BYTES) { 0x22.toByte() }
+            val lastRowBytes = List(NUM_RT_DISPLAY_ROW_BYTES) { 0x33.toByte() }
+
+            val referenceAssembler = DisplayFrameAssembler()
+            val expectedFirstDisplayFrame = (0 until 4).map { row ->
+                referenceAssembler.processRTDisplayPayload(0, row, firstRowBytes)
+            }.last()!!
+            val expectedLastDisplayFrame = (0 until 4).map { row ->
+                referenceAssembler.processRTDisplayPayload(2, row, lastRowBytes)
+            }.last()!!
+
+            // First connection.
+
+            testStates.feedInitialPackets()
+
+            pumpIO.connect(runHeartbeat = false)
+
+            for (row in 0 until 4)
+                testStates.feedRTDisplayPacket(0, row, firstRowBytes)
+            assertEquals(expectedFirstDisplayFrame, testStates.displayFrameChannel.receive())
+
+            testStates.feedRTDisplayPacket(1, 0, splitRowBytes)
+            testStates.feedRTDisplayPacket(1, 1, splitRowBytes)
+            // Give the RT packet processor the chance to pick up
+            // the partial frame before the connection is closed.
+            delay(200L)
+
+            pumpIO.disconnect()
+
+            // Second connection.
+
+            testIO.resetSentPacketData()
+            testIO.resetIncomingPacketDataChannel()
+
+            testStates.feedInitialPackets()
+
+            pumpIO.connect(runHeartbeat = false)
+
+            testStates.feedRTDisplayPacket(1, 2, splitRowBytes)
+            testStates.feedRTDisplayPacket(1, 3, splitRowBytes)
+            for (row in 0 until 4)
+                testStates.feedRTDisplayPacket(2, row, lastRowBytes)
+            assertEquals(expectedLastDisplayFrame, testStates.displayFrameChannel.receive())
+
+            pumpIO.disconnect()
+
+            assertNull(testStates.displayFrameChannel.tryReceive().getOrNull())
+        }
+    }
 }
@@ -0,0 +1,129 @@
+package info.nightscout.comboctl.base
+
+import info.nightscout.comboctl.base.testUtils.runBlockingWithWatchdog
+import kotlinx.coroutines.cancelAndJoin
+import kotlinx.coroutines.joinAll
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.yield
+import kotlin.test.Test
+import kotlin.test.assertEquals
+import kotlin.test.assertFalse
+import kotlin.test.assertTrue
+
+class SendSchedulerTest {
+    @Test
+    fun grantTurnsByPriority() {
+        // Queue up coroutines with different priorities while the scheduler
+        // is locked, and check that they get their turns by priority, and
+        // in FIFO order within the same priority class.
+
+        val scheduler = SendScheduler()
+        val turns = mutableListOf<String>()
+
+        runBlockingWithWatchdog(6000) {
+            scheduler.lock(SendPriority.COMMAND)
+
+            val jobs = listOf(
+                Pair(SendPriority.RT_INPUT, "rt1"),
+                Pair(SendPriority.COMMAND, "command"),
+                Pair(SendPriority.RT_INPUT, "rt2"),
+                Pair(SendPriority.CRITICAL, "critical"),
+                Pair(SendPriority.CONTROL, "control")
+            ).map { (priority, name) ->
+                launch {
+                    scheduler.withLock(priority) { turns.add(name) }
+                }
+            }
+
+            // Let all coroutines enqueue themselves.
+            yield()
+
+            val statsWhileLocked = scheduler.getStats()
+            assertEquals(listOf(1, 1, 1, 2), statsWhileLocked.map { it.queueDepth })
+            assertTrue(turns.isEmpty())
+
+            scheduler.unlock()
+            jobs.joinAll()
+
+            assertEquals(listOf("control", "critical", "command", "rt1", "rt2"), turns)
+            assertFalse(scheduler.isLocked)
+
+            val statsAfterUnlock = scheduler.getStats()
+            assertEquals(listOf(0, 0, 0, 0), statsAfterUnlock.map { it.queueDepth })
+            assertEquals(listOf(1, 1, 1, 2), statsAfterUnlock.map { it.maxQueueDepth })
+            // The COMMAND class includes the initial lock() call above.
+            assertEquals(listOf(1L, 1L, 2L, 2L), statsAfterUnlock.map { it.numTurns })
+        }
+    }
+
+    @Test
+    fun cancelWaitingCoroutine() {
+        // Cancel a coroutine that waits for its turn, and check
+        // that it leaves the queue without getting a turn.
+
+        val scheduler = SendScheduler()
+        var gotTurn = false
+
+        runBlockingWithWatchdog(6000) {
+            scheduler.lock(SendPriority.COMMAND)
+
+            val job = launch {
+                scheduler.withLock(SendPriority.CONTROL) { gotTurn = true }
+            }
+            yield()
+
+            assertEquals(1, scheduler.getStats()[SendPriority.CONTROL.ordinal].queueDepth)
+
+            job.cancelAndJoin()
+
+            assertEquals(0, scheduler.getStats()[SendPriority.CONTROL.ordinal].queueDepth)
+
+            scheduler.unlock()
+
+            assertFalse(gotTurn)
+            assertFalse(scheduler.isLocked)
+        }
+    }
+
+    @Test
+    fun cancelCoroutineRightAfterItsTurnWasGranted() {
+        // Grant the turn to a waiting coroutine, and cancel that coroutine
+        // before it got the chance to resume. The turn must be passed on
+        // instead of leaving the scheduler locked forever.
+
+        val scheduler = SendScheduler()
+        var gotTurn = false
+
+        runBlockingWithWatchdog(6000) {
+            scheduler.lock(SendPriority.COMMAND)
+
+            val cancelledJob = launch {
+                scheduler.withLock(SendPriority.CONTROL) { gotTurn = true }
+            }
+            val nextJob = launch {
+                scheduler.withLock(SendPriority.RT_INPUT) { }
+            }
+            yield()
+
+            // runBlocking is single threaded, so the waiting coroutine
+            // cannot resume between these two calls.
+            scheduler.unlock()
+            cancelledJob.cancel()
+
+            cancelledJob.join()
+            nextJob.join()
+
+            assertFalse(gotTurn)
+            assertFalse(scheduler.isLocked)
+
+            // The granted turn is counted, even though it was given up.
+            val stats = scheduler.getStats()
+            assertEquals(1L, stats[SendPriority.CONTROL.ordinal].numTurns)
+            assertEquals(1L, stats[SendPriority.RT_INPUT.ordinal].numTurns)
+
+            // The scheduler must still be usable.
+            scheduler.withLock(SendPriority.COMMAND) { }
+            assertFalse(scheduler.isLocked)
+        }
+    }
+}
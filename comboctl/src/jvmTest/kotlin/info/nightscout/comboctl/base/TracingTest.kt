@@ -0,0 +1,58 @@
+package info.nightscout.comboctl.base
+
+import kotlin.test.Test
+import kotlin.test.assertEquals
+import kotlin.test.assertFailsWith
+
+class TracingTest {
+    private data class RecordedSpan(val category: String, val name: String, val startTimestampInNs: Long, val durationInNs: Long)
+
+    private class TestTraceBackend : TraceBackend {
+        val recordedSpans = mutableListOf<RecordedSpan>()
+        var currentTimestamp = 1000L
+
+        override fun getTimestampInNs(): Long {
+            val timestamp = currentTimestamp
+            currentTimestamp += 500L
+            return timestamp
+        }
+
+        override fun addSpan(category: String, name: String, startTimestampInNs: Long, durationInNs: Long) {
+            recordedSpans.add(RecordedSpan(category, name, startTimestampInNs, durationInNs))
+        }
+    }
+
+    @Test
+    fun checkSpanRecording() {
+        val backend = TestTraceBackend()
+        Tracer.backend = backend
+
+        try {
+            val result = traceSpan("test", "regular span") { 42 }
+            assertEquals(42, result)
+
+            // Spans must also be recorded if the block throws.
+            assertFailsWith<IllegalStateException> {
+                traceSpan("test", "failing span") { throw IllegalStateException() }
+            }
+
+            assertEquals(
+                listOf(
+                    RecordedSpan("test", "regular span", 1000L, 500L),
+                    RecordedSpan("test", "failing span", 2000L, 500L)
+                ),
+                backend.recordedSpans
+            )
+        } finally {
+            Tracer.backend = null
+        }
+    }
+
+    @Test
+    fun checkDisabledTracing() {
+        Tracer.backend = null
+
+        val result = traceSpan("test", "span") { "result" }
+        assertEquals("result", result)
+    }
+}
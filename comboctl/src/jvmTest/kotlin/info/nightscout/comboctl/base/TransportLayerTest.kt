@@ -6,6 +6,8 @@ import info.nightscout.comboctl.base.testUtils.WatchdogTimeoutException
 import info.nightscout.comboctl.base.testUtils.coroutineScopeWithWatchdog
 import info.nightscout.comboctl.base.testUtils.runBlockingWithWatchdog
 import kotlinx.coroutines.Job
+import kotlinx.coroutines.awaitCancellation
+import kotlinx.coroutines.delay
 import kotlinx.datetime.UtcOffset
 import kotlin.test.Test
 import kotlin.test.assertEquals
@@ -106,6 +108,140 @@ class TransportLayerTest {
         assertFalse(packet.verifyCRC16Payload())
     }
 
+    @Test
+    fun encodeOutgoingPackets() {
+        // Encode packets with the OutgoingPacketEncoder and check that
+        // they match the ones produced by the Packet class.
+
+        val key = ByteArray(CIPHER_KEY_SIZE).apply { fill('0'.code.toByte()) }
+        val cipher = Cipher(key)
+        val nonce = Nonce(byteArrayListOfInts(0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0B))
+        val encoder = TransportLayer.OutgoingPacketEncoder()
+
+        // Authenticated DATA packet. The payload is large enough to
+        // require the encoder to enlarge its buffer.
+        val dataPayload = ArrayList<Byte>((0 until 100).map { it.toByte() })
+        val dataPacket = TransportLayer.Packet(
+            command = TransportLayer.Command.DATA,
+            sequenceBit = true,
+            reliabilityBit = true,
+            address = 0x45,
+            nonce = nonce,
+            payload = dataPayload
+        )
+        dataPacket.authenticate(cipher)
+
+        val dataPacketLength = encoder.encode(
+            command = TransportLayer.Command.DATA,
+            sequenceBit = true,
+            reliabilityBit = true,
+            address = 0x45,
+            nonce = nonce,
+            payload = dataPayload,
+            cipher = cipher,
+            withCRC16Payload = false
+        )
+        assertEquals(dataPacket.toByteList(), encoder.packetData.copyOf(dataPacketLength).toList())
+        assertTrue(encoder.toPacket().verifyAuthentication(cipher))
+
+        // CRC packet with a nullbyte MAC. This reuses the enlarged buffer,
+        // so it also checks that the previous packet does not leak into it.
+        val crcPacket = TransportLayer.Packet(
+            command = TransportLayer.Command.REQUEST_PAIRING_CONNECTION,
+            version = 0x42,
+            sequenceBit = true,
+            reliabilityBit = false,
+            address = 0x45,
+            nonce = nonce
+        )
+        crcPacket.computeCRC16Payload()
+
+        val crcPacketLength = encoder.encode(
+            command = TransportLayer.Command.REQUEST_PAIRING_CONNECTION,
+            sequenceBit = true,
+            reliabilityBit = false,
+            address = 0x45,
+            nonce = nonce,
+            payload = listOf(),
+            cipher = null,
+            withCRC16Payload = true,
+            version = 0x42
+        )
+        assertEquals(crcPacket.toByteList(), encoder.packetData.copyOf(crcPacketLength).toList())
+        assertEquals(byteArrayListOfInts(0xE1, 0x7B), encoder.toPacket().payload)
+    }
+
+    @Test
+    fun encodeOutgoingPacketsFromTemplates() {
+        // Encode packets out of templates and check that they match
+        // those that are encoded out of the complete payload.
+
+        val key = ByteArray(CIPHER_KEY_SIZE).apply { fill('0'.code.toByte()) }
+        val cipher = Cipher(key)
+        val nonce = Nonce(byteArrayListOfInts(0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0B))
+        val templateEncoder = TransportLayer.OutgoingPacketEncoder()
+        val referenceEncoder = TransportLayer.OutgoingPacketEncoder()
+
+        // RT_BUTTON_STATUS packet with RT sequence number 0x1234.
+        val rtTemplate = ApplicationLayer.PacketTemplates.RT_NO_BUTTON_STATUS_CHANGED
+        val rtPacketInfo = ApplicationLayer.createRTButtonStatusPacket(ApplicationLayer.RTButton.NO_BUTTON.id, true).toTransportLayerPacketInfo()
+        rtPacketInfo.payload[ApplicationLayer.PAYLOAD_BYTES_OFFSET + 0] = 0x34
+        rtPacketInfo.payload[ApplicationLayer.PAYLOAD_BYTES_OFFSET + 1] = 0x12
+
+        val rtPacketLength = templateEncoder.encode(
+            template = rtTemplate.dataPacketTemplate,
+            sequenceBit = true,
+            address = 0x45,
+            nonce = nonce,
+            cipher = cipher,
+            patchedFieldValue = 0x1234
+        )
+        val rtReferenceLength = referenceEncoder.encode(
+            command = TransportLayer.Command.DATA,
+            sequenceBit = true,
+            reliabilityBit = rtPacketInfo.reliable,
+            address = 0x45,
+            nonce = nonce,
+            payload = rtPacketInfo.payload,
+            cipher = cipher,
+            withCRC16Payload = false
+        )
+        assertTrue(rtTemplate.isRTPacket)
+        assertEquals(
+            referenceEncoder.packetData.copyOf(rtReferenceLength).toList(),
+            templateEncoder.packetData.copyOf(rtPacketLength).toList()
+        )
+
+        // CMD_PING packet, which has no patchable field. The patched
+        // field value must be ignored.
+        val cmdTemplate = ApplicationLayer.PacketTemplates.CMD_PING
+        val cmdPacketInfo = ApplicationLayer.createCMDPingPacket().toTransportLayerPacketInfo()
+
+        val cmdPacketLength = templateEncoder.encode(
+            template = cmdTemplate.dataPacketTemplate,
+            sequenceBit = false,
+            address = 0x45,
+            nonce = nonce,
+            cipher = cipher,
+            patchedFieldValue = 0x1234
+        )
+        val cmdReferenceLength = referenceEncoder.encode(
+            command = TransportLayer.Command.DATA,
+            sequenceBit = false,
+            reliabilityBit = cmdPacketInfo.reliable,
+            address = 0x45,
+            nonce = nonce,
+            payload = cmdPacketInfo.payload,
+            cipher = cipher,
+            withCRC16Payload = false
+        )
+        assertFalse(cmdTemplate.isRTPacket)
+        assertEquals(
+            referenceEncoder.packetData.copyOf(cmdReferenceLength).toList(),
+            templateEncoder.packetData.copyOf(cmdPacketLength).toList()
+        )
+    }
+
     @Test
     fun verifyPacketDataIntegrityWithMAC() {
         // Create packet and verify that the MAC check detects data corruption.
@@ -302,6 +438,51 @@ class TransportLayerTest {
         }
     }
 
+    @Test
+    fun checkOutgoingPacketThrottling() {
+        // Check that consecutive outgoing packets are always spaced apart
+        // by at least PACKET_SEND_INTERVAL_IN_MS, even if the send() calls
+        // arrive at irregular times. The second packet is sent after a short
+        // pause, which previously caused the third packet to be transmitted
+        // too early because the throttling timestamp was recorded before
+        // waiting instead of at the time of the actual transmission.
+
+        runBlockingWithWatchdog(5000) {
+            val testPumpStateStore = TestPumpStateStore()
+            val testBluetoothAddress = BluetoothAddress(byteArrayListOfInts(1, 2, 3, 4, 5, 6))
+            val sendTimestamps = mutableListOf<Long>()
+            val timestampingComboIO = object : ComboIO {
+                override suspend fun send(dataToSend: List<Byte>) {
+                    sendTimestamps.add(getMonotonicTimeInMs())
+                }
+
+                override suspend fun receive(): List<Byte> = awaitCancellation()
+            }
+            val tpLayerIO = TransportLayer.IO(testPumpStateStore, testBluetoothAddress, timestampingComboIO) {}
+
+            tpLayerIO.start(packetReceiverScope = this) { TransportLayer.IO.ReceiverBehavior.FORWARD_PACKET }
+
+            tpLayerIO.send(TransportLayer.createRequestPairingConnectionPacketInfo())
+            delay(50)
+            tpLayerIO.send(TransportLayer.createRequestPairingConnectionPacketInfo())
+            tpLayerIO.send(TransportLayer.createRequestPairingConnectionPacketInfo())
+            tpLayerIO.send(TransportLayer.createRequestPairingConnectionPacketInfo())
+
+            tpLayerIO.stop()
+
+            assertEquals(4, sendTimestamps.size)
+            // Allow for a few ms of tolerance, since the timestamps are
+            // truncated to whole milliseconds.
+            for (timestamps in sendTimestamps.zipWithNext()) {
+                val interval = timestamps.second - timestamps.first
+                assertTrue(
+                    interval >= (TransportLayer.PACKET_SEND_INTERVAL_IN_MS - 5),
+                    "Interval between packets too short: $interval ms"
+                )
+            }
+        }
+    }
+
     @Test
     fun checkCustomIncomingPacketFiltering() {
         // Test the custom incoming packet processing feature and
@@ -13,13 +13,14 @@ import kotlinx.coroutines.async
 import kotlinx.coroutines.cancelAndJoin
 import kotlinx.coroutines.runBlocking
 
-class TestBluetoothDevice(private val testComboIO: ComboIO) : BluetoothDevice(Dispatchers.IO) {
+class TestBluetoothDevice(
+    private val testComboIO: ComboIO,
+    override val address: BluetoothAddress = BluetoothAddress(byteArrayListOfInts(1, 2, 3, 4, 5, 6))
+) : BluetoothDevice(Dispatchers.IO) {
     private val frameParser = ComboFrameParser()
     private var innerJob = SupervisorJob()
     private var innerScope = CoroutineScope(innerJob)
 
-    override val address: BluetoothAddress = BluetoothAddress(byteArrayListOfInts(1, 2, 3, 4, 5, 6))
-
     override fun connect() {
     }
 
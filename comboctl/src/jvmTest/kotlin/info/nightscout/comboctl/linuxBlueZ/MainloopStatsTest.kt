@@ -0,0 +1,51 @@
+package info.nightscout.comboctl.linuxBlueZ
+
+import kotlin.test.Test
+import kotlin.test.assertEquals
+
+class MainloopStatsTest {
+    // Produces the same layout as get_mainloop_stats_impl() in the JNI bindings.
+    private fun histogramValues(upperBounds: List<Long>, bucketCounts: List<Long>, total: Long, max: Long) =
+        listOf(bucketCounts.size.toLong()) + upperBounds + bucketCounts + listOf(bucketCounts.sum(), total, max)
+
+    @Test
+    fun parseStats() {
+        val upperBounds = listOf(100L, 500L, 1000L)
+        val values = (
+            histogramValues(upperBounds, listOf(4L, 3L, 2L, 1L), total = 5000L, max = 2500L) +
+            histogramValues(upperBounds, listOf(10L, 0L, 0L, 0L), total = 300L, max = 90L) +
+            listOf(7L, 2500L, 100000L) +
+            listOf(4L) + "scan".encodeToByteArray().map { it.toLong() }
+        ).toLongArray()
+
+        val stats = parseMainloopStats(values)
+
+        assertEquals(upperBounds, stats.queueLatency.bucketUpperBoundsInMicroseconds)
+        assertEquals(listOf(4L, 3L, 2L, 1L), stats.queueLatency.bucketCounts)
+        assertEquals(10L, stats.queueLatency.numSamples)
+        assertEquals(500L, stats.queueLatency.averageDurationInMicroseconds)
+        assertEquals(2500L, stats.queueLatency.maxDurationInMicroseconds)
+        assertEquals(listOf(10L, 0L, 0L, 0L), stats.dispatchDuration.bucketCounts)
+        assertEquals(30L, stats.dispatchDuration.averageDurationInMicroseconds)
+        assertEquals(7L, stats.numSlowCallbacks)
+        assertEquals(2500L, stats.slowestCallbackDurationInMicroseconds)
+        assertEquals(100000L, stats.slowCallbackBudgetInMicroseconds)
+        assertEquals("scan", stats.slowestCallbackSource)
+    }
+
+    @Test
+    fun parseStatsWithoutSlowestCallback() {
+        val upperBounds = listOf(100L)
+        val values = (
+            histogramValues(upperBounds, listOf(0L, 0L), total = 0L, max = 0L) +
+            histogramValues(upperBounds, listOf(0L, 0L), total = 0L, max = 0L) +
+            listOf(0L, 0L, 100000L, 0L)
+        ).toLongArray()
+
+        val stats = parseMainloopStats(values)
+
+        assertEquals(0L, stats.queueLatency.averageDurationInMicroseconds)
+        assertEquals(0L, stats.numSlowCallbacks)
+        assertEquals("", stats.slowestCallbackSource)
+    }
+}
@@ -0,0 +1,262 @@
+package info.nightscout.comboctl.main
+
+import info.nightscout.comboctl.base.BluetoothAddress
+import info.nightscout.comboctl.base.BluetoothDevice
+import info.nightscout.comboctl.base.BluetoothInterface
+import info.nightscout.comboctl.base.ComboException
+import info.nightscout.comboctl.base.byteArrayListOfInts
+import info.nightscout.comboctl.base.testUtils.PAIRING_TEST_BT_FRIENDLY_NAME
+import info.nightscout.comboctl.base.testUtils.PairingTestComboIO
+import info.nightscout.comboctl.base.testUtils.TestBluetoothDevice
+import info.nightscout.comboctl.base.testUtils.TestPumpStateStore
+import info.nightscout.comboctl.base.testUtils.pairingTestPIN
+import info.nightscout.comboctl.base.testUtils.pairingTestSequence
+import info.nightscout.comboctl.base.testUtils.runBlockingWithWatchdog
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.async
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.yield
+import kotlin.test.Test
+import kotlin.test.assertEquals
+import kotlin.test.assertFalse
+import kotlin.test.assertIs
+import kotlin.test.assertNull
+import kotlin.test.assertTrue
+
+class PumpManagerTest {
+    // BluetoothInterface implementation that lets the test report discovered
+    // devices. Devices pair by replaying the recorded pairing sequence, except
+    // for those in failingDeviceAddresses, for which getDevice() throws.
+    private class TestBluetoothInterface(
+        private val failingDeviceAddresses: Set<BluetoothAddress> = setOf()
+    ) : BluetoothInterface {
+        override var onDeviceUnpaired: (deviceAddress: BluetoothAddress) -> Unit = { }
+        override var deviceFilterCallback: (deviceAddress: BluetoothAddress) -> Boolean = { true }
+        override var discoveryAddressPrefix: List<Byte> = listOf()
+
+        val discoveryStarted = CompletableDeferred<BluetoothInterface.DiscoveryMode>()
+        var discoveryStopped = false
+            private set
+
+        val requestedDeviceAddresses = mutableListOf<BluetoothAddress>()
+        val comboIOs = mutableListOf<PairingTestComboIO>()
+
+        private var onDiscoveryStopped: ((reason: BluetoothInterface.DiscoveryStoppedReason) -> Unit)? = null
+        private var onFoundNewPairedDevice: ((deviceAddress: BluetoothAddress) -> Unit)? = null
+
+        override fun startDiscovery(
+            sdpServiceName: String,
+            sdpServiceProvider: String,
+            sdpServiceDescription: String,
+            btPairingPin: String,
+            discoveryDuration: Int,
+            discoveryMode: BluetoothInterface.DiscoveryMode,
+            onDiscoveryStopped: (reason: BluetoothInterface.DiscoveryStoppedReason) -> Unit,
+            onFoundNewPairedDevice: (deviceAddress: BluetoothAddress) -> Unit
+        ) {
+            this.onDiscoveryStopped = onDiscoveryStopped
+            this.onFoundNewPairedDevice = onFoundNewPairedDevice
+            discoveryStarted.complete(discoveryMode)
+        }
+
+        override fun stopDiscovery() {
+            discoveryStopped = true
+        }
+
+        fun reportFoundDevice(deviceAddress: BluetoothAddress) =
+            onFoundNewPairedDevice!!.invoke(deviceAddress)
+
+        fun reportDiscoveryStopped(reason: BluetoothInterface.DiscoveryStoppedReason) =
+            onDiscoveryStopped!!.invoke(reason)
+
+        override fun getDevice(deviceAddress: BluetoothAddress): BluetoothDevice {
+            requestedDeviceAddresses.add(deviceAddress)
+
+            if (deviceAddress in failingDeviceAddresses)
+                throw ComboException("Simulated failure for device $deviceAddress")
+
+            val comboIO = PairingTestComboIO(pairingTestSequence)
+            comboIOs.add(comboIO)
+            return TestBluetoothDevice(comboIO, deviceAddress)
+        }
+
+        override fun getAdapterFriendlyName() = PAIRING_TEST_BT_FRIENDLY_NAME
+
+        override fun getPairedDeviceAddresses() = setOf<BluetoothAddress>()
+    }
+
+    private fun testPumpAddress(lastByte: Int) =
+        BluetoothAddress(byteArrayListOfInts(0x00, 0x0E, 0x2F, 0x00, 0x00, lastByte))
+
+    @Test
+    fun pairPumpsConcurrently() {
+        // Report several pumps, and only hand out the PIN once all of
+        // them asked for it. This can only happen if the pumps are paired
+        // concurrently; otherwise, the watchdog ends the test.
+
+        val pumpAddresses = listOf(testPumpAddress(1), testPumpAddress(2), testPumpAddress(3))
+        val testBluetoothInterface = TestBluetoothInterface()
+        val testPumpStateStore = TestPumpStateStore()
+        val pumpManager = PumpManager(testBluetoothInterface, testPumpStateStore)
+
+        val pinRequestAddresses = mutableSetOf<BluetoothAddress>()
+        val allPINsRequested = CompletableDeferred<Unit>()
+        val callbackPairedAddresses = mutableListOf<BluetoothAddress>()
+
+        runBlockingWithWatchdog(6000) {
+            val session = async {
+                pumpManager.pairWithNewPumps(
+                    discoveryDuration = 300,
+                    onPumpPaired = { callbackPairedAddresses.add(it.bluetoothAddress) }
+                ) { newPumpAddress, _ ->
+                    pinRequestAddresses.add(newPumpAddress)
+                    if (pinRequestAddresses.size == pumpAddresses.size)
+                        allPINsRequested.complete(Unit)
+                    allPINsRequested.await()
+                    pairingTestPIN
+                }
+            }
+
+            assertEquals(BluetoothInterface.DiscoveryMode.CONTINUOUS, testBluetoothInterface.discoveryStarted.await())
+
+            pumpAddresses.forEach { testBluetoothInterface.reportFoundDevice(it) }
+            allPINsRequested.await()
+
+            // Pairings that are going on when discovery stops must still finish.
+            testBluetoothInterface.reportDiscoveryStopped(BluetoothInterface.DiscoveryStoppedReason.DISCOVERY_TIMEOUT)
+            val result = session.await()
+
+            assertEquals(pumpAddresses.toSet(), result.pairedPumps.map { it.bluetoothAddress }.toSet())
+            assertTrue(result.failedPumps.isEmpty())
+            assertEquals(BluetoothInterface.DiscoveryStoppedReason.DISCOVERY_TIMEOUT, result.discoveryStoppedReason)
+            assertEquals(pumpAddresses.toSet(), callbackPairedAddresses.toSet())
+            assertEquals(pumpAddresses.toSet(), testPumpStateStore.getAvailablePumpStateAddresses())
+            assertTrue(testBluetoothInterface.discoveryStopped)
+            assertFalse(testBluetoothInterface.comboIOs.any { it.testErrorOccurred })
+        }
+    }
+
+    @Test
+    fun stopAtMaxNumPumps() {
+        // Report more pumps at once than maxNumPumps allows. Pairings that
+        // are going on count towards the maximum, so the surplus pump must
+        // be skipped instead of being paired as well.
+
+        val pumpAddresses = listOf(testPumpAddress(1), testPumpAddress(2), testPumpAddress(3))
+        val testBluetoothInterface = TestBluetoothInterface()
+        val testPumpStateStore = TestPumpStateStore()
+        val pumpManager = PumpManager(testBluetoothInterface, testPumpStateStore)
+
+        runBlockingWithWatchdog(6000) {
+            val session = async {
+                pumpManager.pairWithNewPumps(
+                    discoveryDuration = 300,
+                    maxNumPumps = 2
+                ) { _, _ -> pairingTestPIN }
+            }
+
+            testBluetoothInterface.discoveryStarted.await()
+            pumpAddresses.forEach { testBluetoothInterface.reportFoundDevice(it) }
+
+            // The session ends by itself once two pumps are paired.
+            val result = session.await()
+
+            assertEquals(pumpAddresses.take(2), result.pairedPumps.map { it.bluetoothAddress }.sortedBy { it.toString() })
+            assertTrue(result.failedPumps.isEmpty())
+            assertNull(result.discoveryStoppedReason)
+            assertEquals(pumpAddresses.take(2), testBluetoothInterface.requestedDeviceAddresses)
+            assertEquals(pumpAddresses.take(2).toSet(), testPumpStateStore.getAvailablePumpStateAddresses())
+            assertTrue(testBluetoothInterface.discoveryStopped)
+        }
+    }
+
+    @Test
+    fun isolatePairingFailures() {
+        // A pump whose pairing fails must be recorded as failed
+        // without affecting the pairing of the other pumps.
+
+        val pumpAddresses = listOf(testPumpAddress(1), testPumpAddress(2), testPumpAddress(3))
+        val failingPumpAddress = pumpAddresses[1]
+        val testBluetoothInterface = TestBluetoothInterface(failingDeviceAddresses = setOf(failingPumpAddress))
+        val testPumpStateStore = TestPumpStateStore()
+        val pumpManager = PumpManager(testBluetoothInterface, testPumpStateStore)
+
+        val pairedPumpsChannel = Channel<PumpManager.PairingResult.Success>(Channel.UNLIMITED)
+
+        runBlockingWithWatchdog(6000) {
+            val session = async {
+                pumpManager.pairWithNewPumps(
+                    discoveryDuration = 300,
+                    onPumpPaired = { pairedPumpsChannel.trySend(it) }
+                ) { _, _ -> pairingTestPIN }
+            }
+
+            testBluetoothInterface.discoveryStarted.await()
+            pumpAddresses.forEach { testBluetoothInterface.reportFoundDevice(it) }
+
+            // Let discovery go on until the other two pumps are paired.
+            repeat(2) { pairedPumpsChannel.receive() }
+            testBluetoothInterface.reportDiscoveryStopped(BluetoothInterface.DiscoveryStoppedReason.DISCOVERY_TIMEOUT)
+            val result = session.await()
+
+            val expectedPairedAddresses = pumpAddresses.filter { it != failingPumpAddress }.toSet()
+            assertEquals(expectedPairedAddresses, result.pairedPumps.map { it.bluetoothAddress }.toSet())
+            assertEquals(setOf(failingPumpAddress), result.failedPumps.keys)
+            assertIs<ComboException>(result.failedPumps[failingPumpAddress])
+            assertEquals(expectedPairedAddresses, testPumpStateStore.getAvailablePumpStateAddresses())
+        }
+    }
+
+    @Test
+    fun skipDuplicateReports() {
+        // Report a pump again while it is being paired, and once more after
+        // it was paired. Both duplicate reports must be skipped.
+
+        val pumpAddress = testPumpAddress(1)
+        val testBluetoothInterface = TestBluetoothInterface()
+        val testPumpStateStore = TestPumpStateStore()
+        val pumpManager = PumpManager(testBluetoothInterface, testPumpStateStore)
+
+        val pinRequested = CompletableDeferred<Unit>()
+        val providePIN = CompletableDeferred<Unit>()
+        val pairedPumpsChannel = Channel<PumpManager.PairingResult.Success>(Channel.UNLIMITED)
+        var numPINRequests = 0
+
+        runBlockingWithWatchdog(6000) {
+            val session = async {
+                pumpManager.pairWithNewPumps(
+                    discoveryDuration = 300,
+                    onPumpPaired = { pairedPumpsChannel.trySend(it) }
+                ) { _, _ ->
+                    numPINRequests++
+                    pinRequested.complete(Unit)
+                    providePIN.await()
+                    pairingTestPIN
+                }
+            }
+
+            testBluetoothInterface.discoveryStarted.await()
+
+            testBluetoothInterface.reportFoundDevice(pumpAddress)
+            testBluetoothInterface.reportFoundDevice(pumpAddress)
+
+            // The pairing is now going on, and waits for the PIN.
+            pinRequested.await()
+            providePIN.complete(Unit)
+            pairedPumpsChannel.receive()
+
+            // The pump is paired now. Let the coroutine that
+            // handles this report run before discovery stops.
+            testBluetoothInterface.reportFoundDevice(pumpAddress)
+            yield()
+
+            testBluetoothInterface.reportDiscoveryStopped(BluetoothInterface.DiscoveryStoppedReason.DISCOVERY_TIMEOUT)
+            val result = session.await()
+
+            assertEquals(listOf(pumpAddress), result.pairedPumps.map { it.bluetoothAddress })
+            assertTrue(result.failedPumps.isEmpty())
+            assertEquals(listOf(pumpAddress), testBluetoothInterface.requestedDeviceAddresses)
+            assertEquals(1, numPINRequests)
+        }
+    }
+}
@@ -0,0 +1,72 @@
+import java.io.ByteArrayOutputStream
+
+plugins {
+    `cpp-application`
+}
+
+application {
+    baseName.set("comboctl-broker")
+    dependencies {
+        implementation(project(":comboctl:src:linuxBlueZCpp"))
+    }
+}
+
+extensions.configure<CppApplication> {
+    source.from(file("src"))
+    privateHeaders.from(file("src/priv-headers"))
+}
+
+val glibCflagsStdout = ByteArrayOutputStream()
+val glibLibsStdout = ByteArrayOutputStream()
+
+// Native build options are defined in the root build script.
+val nativeDBusBackendEnabled = rootProject.extra["nativeDBusBackendEnabled"] as Boolean
+val allocationTrackingEnabled = rootProject.extra["nativeAllocationTrackingEnabled"] as Boolean
+@Suppress("UNCHECKED_CAST")
+val nativeOptionCflags = rootProject.extra["nativeOptionCflags"] as List<String>
+
+// The native D-Bus backend does not use GLib, so pkg-config is not run for it then.
+fun getGlibCflags(): List<String> =
+    if (!nativeDBusBackendEnabled) glibCflagsStdout.toString().trim().split(" ") else listOf()
+
+fun getGlibLibs(): List<String> =
+    if (!nativeDBusBackendEnabled) glibLibsStdout.toString().trim().split(" ") else listOf()
+
+fun getGccAndClangCflags(): List<String> {
+    return listOf("-Wextra", "-Wall", "-O0", "-g3", "-ggdb", "-std=c++17") +
+    getGlibCflags() +
+    nativeOptionCflags
+}
+
+task<Exec>("glib2PkgConfigCflags") {
+    commandLine("pkg-config", "--cflags", "glib-2.0", "gio-2.0")
+    standardOutput = glibCflagsStdout
+}
+
+task<Exec>("glib2PkgConfigLibs") {
+    commandLine("pkg-config", "--libs", "glib-2.0", "gio-2.0")
+    standardOutput = glibLibsStdout
+}
+
+tasks.withType(CppCompile::class.java).configureEach {
+    if (!nativeDBusBackendEnabled)
+        dependsOn("glib2PkgConfigCflags")
+    compilerArgs.addAll(toolChain.map { toolChain ->
+        when (toolChain) {
+            is Gcc, is Clang -> getGccAndClangCflags()
+            else -> listOf()
+        }
+    })
+}
+
+tasks.withType(LinkExecutable::class.java).configureEach {
+    if (!nativeDBusBackendEnabled)
+        dependsOn("glib2PkgConfigLibs")
+    linkerArgs.addAll(toolChain.map { toolChain ->
+        when (toolChain) {
+            is Gcc, is Clang -> getGlibLibs() + listOf("-pthread") +
+                (if (allocationTrackingEnabled) listOf("-rdynamic") else listOf())
+            else -> listOf()
+        }
+    })
+}
@@ -0,0 +1,632 @@
+#include <assert.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fmt/format.h>
+#include "broker_client.hpp"
+#include "broker_self_test.hpp"
+#include "broker_server.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("BrokerSelfTest")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+// How long the checks wait for something to happen
+// before they consider it as not happening at all.
+constexpr std::chrono::seconds check_timeout(5);
+
+
+// Test side of a loopback device. Its states are shared between
+// the test (which plays the pump) and the loopback_device instance
+// that the broker uses.
+struct loopback_pump
+{
+	std::mutex m_mutex;
+	std::condition_variable m_condvar;
+
+	// connect() waits until this is set, or until it is aborted.
+	bool m_connect_allowed = true;
+	bool m_fail_connect = false;
+
+	// If set, receive() throws once data arrives.
+	bool m_throw_on_receive = false;
+
+	unsigned int m_num_connect_calls = 0;
+	bool m_device_destroyed = false;
+
+	// Pump side of the socket pair. Set once connect() succeeded.
+	int m_pump_fd = -1;
+
+	~loopback_pump()
+	{
+		if (m_pump_fd >= 0)
+			::close(m_pump_fd);
+	}
+
+	void allow_connect()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_connect_allowed = true;
+		m_condvar.notify_all();
+	}
+
+	template<typename Predicate>
+	bool wait_for(Predicate predicate)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_condvar.wait_for(lock, check_timeout, predicate);
+	}
+
+	unsigned int get_num_connect_calls()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_num_connect_calls;
+	}
+
+	bool is_device_destroyed()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_device_destroyed;
+	}
+
+	int get_pump_fd()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_pump_fd;
+	}
+
+	void close_pump_fd()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_pump_fd >= 0)
+		{
+			::close(m_pump_fd);
+			m_pump_fd = -1;
+		}
+	}
+};
+
+
+// broker_device implementation that connects to a loopback_pump
+// through a socket pair. Its cancel_receive() is sticky like the
+// one of rfcomm_connection, since broker_server relies on that.
+class loopback_device
+	: public broker_device
+{
+public:
+	explicit loopback_device(std::shared_ptr<loopback_pump> pump)
+		: m_pump(std::move(pump))
+		, m_device_fd(-1)
+		, m_aborted(false)
+	{
+		m_cancel_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (m_cancel_eventfd < 0)
+			throw io_exception(fmt::format("Could not create eventfd: {} ({})", std::strerror(errno), errno));
+	}
+
+	~loopback_device() override
+	{
+		if (m_device_fd >= 0)
+			::close(m_device_fd);
+		::close(m_cancel_eventfd);
+
+		std::lock_guard<std::mutex> lock(m_pump->m_mutex);
+		m_pump->m_device_destroyed = true;
+		m_pump->m_condvar.notify_all();
+	}
+
+	void connect() override
+	{
+		std::unique_lock<std::mutex> lock(m_pump->m_mutex);
+
+		m_pump->m_num_connect_calls++;
+		m_pump->m_condvar.notify_all();
+
+		m_pump->m_condvar.wait(lock, [&]() { return m_pump->m_connect_allowed || m_aborted; });
+
+		if (m_aborted)
+			throw io_exception("Connect attempt aborted");
+		if (m_pump->m_fail_connect)
+			throw io_exception("Connect attempt failed");
+
+		int fds[2];
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+			throw io_exception(fmt::format("Could not create socket pair: {} ({})", std::strerror(errno), errno));
+
+		m_device_fd = fds[0];
+		m_pump->m_pump_fd = fds[1];
+		m_pump->m_condvar.notify_all();
+	}
+
+	void disconnect() override
+	{
+		std::lock_guard<std::mutex> lock(m_pump->m_mutex);
+
+		m_aborted = true;
+		m_pump->m_condvar.notify_all();
+
+		// Only shut the socket down here. It is closed in the destructor,
+		// since broker_server only disconnects after its thread finished,
+		// so no receive() call can be using the fd at this point anyway.
+		if (m_device_fd >= 0)
+			::shutdown(m_device_fd, SHUT_RDWR);
+	}
+
+	io_result<int> send(void const *src, int num_bytes) override
+	{
+		auto bytes = reinterpret_cast<std::uint8_t const *>(src);
+		int num_bytes_sent = 0;
+
+		while (num_bytes_sent < num_bytes)
+		{
+			ssize_t ret = ::send(m_device_fd, bytes + num_bytes_sent, num_bytes - num_bytes_sent, MSG_NOSIGNAL);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return io_failure{ io_error::failed, std::strerror(errno) };
+			}
+			num_bytes_sent += int(ret);
+		}
+
+		return num_bytes;
+	}
+
+	io_result<int> receive(void *dest, int num_bytes) override
+	{
+		while (true)
+		{
+			struct pollfd fds[2];
+			fds[0].fd = m_device_fd;
+			fds[0].events = POLLIN;
+			fds[1].fd = m_cancel_eventfd;
+			fds[1].events = POLLIN;
+
+			if (::poll(fds, 2, -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return io_failure{ io_error::failed, std::strerror(errno) };
+			}
+
+			if (fds[1].revents & POLLIN)
+			{
+				std::uint64_t value;
+				ssize_t ret = ::read(m_cancel_eventfd, &value, sizeof(value));
+				(void)ret;
+				return io_failure{ io_error::canceled, {} };
+			}
+
+			ssize_t ret = ::recv(m_device_fd, dest, std::size_t(num_bytes), 0);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return io_failure{ io_error::failed, std::strerror(errno) };
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_pump->m_mutex);
+				if (m_pump->m_throw_on_receive)
+					throw link_lost_exception("Link lost while receiving");
+			}
+
+			return int(ret);
+		}
+	}
+
+	void cancel_receive() override
+	{
+		std::uint64_t value = 1;
+		ssize_t ret = ::write(m_cancel_eventfd, &value, sizeof(value));
+		(void)ret;
+	}
+
+
+private:
+	std::shared_ptr<loopback_pump> m_pump;
+	int m_device_fd;
+	int m_cancel_eventfd;
+	// Guarded by the pump's mutex.
+	bool m_aborted;
+};
+
+
+// Runs a broker_server in a background thread, with a loopback_pump
+// for each of the addresses it is constructed with.
+class self_test_broker
+{
+public:
+	explicit self_test_broker(std::map<bluetooth_address, std::shared_ptr<loopback_pump>> pumps)
+		: m_pumps(std::move(pumps))
+	{
+		char dir_template[] = "/tmp/comboctl-broker-self-test-XXXXXX";
+		if (::mkdtemp(dir_template) == nullptr)
+			throw io_exception(fmt::format("Could not create temporary directory: {} ({})", std::strerror(errno), errno));
+		m_dir = dir_template;
+		m_socket_path = m_dir + "/broker.socket";
+
+		m_server = std::make_unique<broker_server>([this](bluetooth_address const &device_address) {
+			return std::make_unique<loopback_device>(m_pumps.at(device_address));
+		});
+		m_server->listen(m_socket_path);
+
+		m_thread = std::thread([this]() {
+			try
+			{
+				m_server->run();
+			}
+			catch (comboctl::exception const &exc)
+			{
+				LOG(error, "Broker server failed: {}", exc.what());
+			}
+		});
+	}
+
+	~self_test_broker()
+	{
+		stop();
+		::rmdir(m_dir.c_str());
+	}
+
+	std::string const & get_socket_path() const
+	{
+		return m_socket_path;
+	}
+
+	// Stops the server and destroys it. Returns how long that took.
+	std::chrono::milliseconds stop()
+	{
+		if (!m_server)
+			return std::chrono::milliseconds(0);
+
+		auto begin_timestamp = std::chrono::steady_clock::now();
+
+		m_server->request_stop();
+		m_thread.join();
+		m_server.reset();
+
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin_timestamp);
+	}
+
+
+private:
+	std::map<bluetooth_address, std::shared_ptr<loopback_pump>> m_pumps;
+	std::string m_dir;
+	std::string m_socket_path;
+	std::unique_ptr<broker_server> m_server;
+	std::thread m_thread;
+};
+
+
+struct receive_result
+{
+	std::string m_data;
+	// Set if receive() threw an exception. This includes
+	// the cancellation in case of a timeout.
+	bool m_failed = false;
+	bool m_timed_out = false;
+};
+
+
+// Calls broker_client::receive(), and cancels it if it takes too long.
+receive_result receive_with_timeout(broker_client &client)
+{
+	std::mutex mutex;
+	std::condition_variable condvar;
+	bool done = false;
+	receive_result result;
+
+	std::thread watchdog([&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!condvar.wait_for(lock, check_timeout, [&]() { return done; }))
+		{
+			result.m_timed_out = true;
+			client.cancel_receive();
+		}
+	});
+
+	try
+	{
+		char buffer[64];
+		int num_bytes = client.receive(buffer, sizeof(buffer));
+		result.m_data.assign(buffer, std::size_t(num_bytes));
+	}
+	catch (comboctl::exception const &exc)
+	{
+		LOG(debug, "Receive failed: {}", exc.what());
+		result.m_failed = true;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+		condvar.notify_all();
+	}
+	watchdog.join();
+
+	return result;
+}
+
+
+bool receive_string(broker_client &client, std::string const &expected_data)
+{
+	return receive_with_timeout(client).m_data == expected_data;
+}
+
+
+bool write_to_device(loopback_pump &pump, std::string const &data)
+{
+	return ::send(pump.get_pump_fd(), data.data(), data.size(), MSG_NOSIGNAL) == ssize_t(data.size());
+}
+
+
+// Reads exactly num_bytes bytes that the broker sent to the pump.
+// Returns an empty string in case of an error or timeout.
+std::string read_from_device(loopback_pump &pump, std::size_t num_bytes)
+{
+	std::string received;
+	auto deadline = std::chrono::steady_clock::now() + check_timeout;
+
+	while (received.size() < num_bytes)
+	{
+		auto remaining_time = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (remaining_time.count() <= 0)
+			return {};
+
+		struct pollfd pfd = { pump.get_pump_fd(), POLLIN, 0 };
+		if (::poll(&pfd, 1, int(remaining_time.count())) <= 0)
+			continue;
+
+		char buffer[64];
+		ssize_t ret = ::recv(pfd.fd, buffer, std::min(sizeof(buffer), num_bytes - received.size()), 0);
+		if (ret <= 0)
+			return {};
+
+		received.append(buffer, std::size_t(ret));
+	}
+
+	return received;
+}
+
+
+void print_check_result(char const *description, bool passed)
+{
+	fmt::print("  {:<36} {}\n", description, passed ? "ok" : "FAILED");
+}
+
+
+} // unnamed namespace end
+
+
+
+
+bool run_broker_self_test()
+{
+	bluetooth_address const shared_address = {{ 0x00, 0x0E, 0x2F, 0x00, 0x00, 0x01 }};
+	bluetooth_address const slow_address = {{ 0x00, 0x0E, 0x2F, 0x00, 0x00, 0x02 }};
+	bluetooth_address const failing_address = {{ 0x00, 0x0E, 0x2F, 0x00, 0x00, 0x03 }};
+	bluetooth_address const stuck_address = {{ 0x00, 0x0E, 0x2F, 0x00, 0x00, 0x04 }};
+	bluetooth_address const throwing_address = {{ 0x00, 0x0E, 0x2F, 0x00, 0x00, 0x05 }};
+
+	auto shared_pump = std::make_shared<loopback_pump>();
+	auto slow_pump = std::make_shared<loopback_pump>();
+	auto failing_pump = std::make_shared<loopback_pump>();
+	auto stuck_pump = std::make_shared<loopback_pump>();
+	auto throwing_pump = std::make_shared<loopback_pump>();
+
+	slow_pump->m_connect_allowed = false;
+	failing_pump->m_fail_connect = true;
+	stuck_pump->m_connect_allowed = false;
+	throwing_pump->m_throw_on_receive = true;
+
+	self_test_broker broker({
+		{ shared_address, shared_pump },
+		{ slow_address, slow_pump },
+		{ failing_address, failing_pump },
+		{ stuck_address, stuck_pump },
+		{ throwing_address, throwing_pump }
+	});
+
+	bool all_passed = true;
+	auto check = [&](char const *description, bool passed) {
+		print_check_result(description, passed);
+		all_passed = all_passed && passed;
+	};
+
+	fmt::print("broker self test:\n");
+
+	// 1. Two sessions share one connection.
+
+	broker_client client_a;
+	broker_client client_b;
+	client_a.connect(broker.get_socket_path());
+	client_b.connect(broker.get_socket_path());
+	client_a.open_device(shared_address);
+	client_b.open_device(shared_address);
+
+	{
+		bool passed = (shared_pump->get_num_connect_calls() == 1)
+			&& write_to_device(*shared_pump, "ping")
+			&& receive_string(client_a, "ping")
+			&& receive_string(client_b, "ping");
+
+		client_a.send("a", 1);
+		client_b.send("b", 1);
+		std::string received = read_from_device(*shared_pump, 2);
+		passed = passed && ((received == "ab") || (received == "ba"));
+
+		check("shared connection", passed);
+	}
+
+	// 2. A slow connect attempt does not stall other sessions. Opening
+	//    the slow device blocks, so it is done in a separate thread.
+
+	broker_client client_c;
+	client_c.connect(broker.get_socket_path());
+
+	{
+		std::atomic<bool> slow_open_succeeded = false;
+		std::thread slow_open_thread([&]() {
+			try
+			{
+				client_c.open_device(slow_address);
+				slow_open_succeeded = true;
+			}
+			catch (comboctl::exception const &exc)
+			{
+				LOG(error, "Could not open slow device: {}", exc.what());
+			}
+		});
+
+		bool passed = slow_pump->wait_for([&]() { return slow_pump->m_num_connect_calls == 1; });
+
+		// While the broker connects to the slow device, a new session
+		// must be able to do its handshake and use the shared device.
+		broker_client client_d;
+		try
+		{
+			client_d.connect(broker.get_socket_path());
+			client_d.open_device(shared_address);
+			passed = passed
+				&& write_to_device(*shared_pump, "pong")
+				&& receive_string(client_d, "pong")
+				&& !slow_open_succeeded;
+			client_d.close_device();
+		}
+		catch (comboctl::exception const &exc)
+		{
+			LOG(error, "Session stalled by slow connect attempt: {}", exc.what());
+			passed = false;
+		}
+
+		slow_pump->allow_connect();
+		slow_open_thread.join();
+
+		passed = passed
+			&& slow_open_succeeded
+			&& write_to_device(*slow_pump, "slow")
+			&& receive_string(client_c, "slow");
+
+		check("slow connect does not stall others", passed);
+
+		// client_a and client_b did not read the "pong" above. Drain
+		// it, otherwise the later checks see it instead of their data.
+		receive_with_timeout(client_a);
+		receive_with_timeout(client_b);
+	}
+
+	// 3. A failed connect attempt is reported.
+
+	{
+		broker_client client_e;
+		client_e.connect(broker.get_socket_path());
+
+		bool passed = false;
+		try
+		{
+			client_e.open_device(failing_address);
+		}
+		catch (io_exception const &)
+		{
+			passed = true;
+		}
+
+		check("failed connect is reported", passed);
+	}
+
+	// 4. Closing the last session that uses a device disconnects it.
+	//    The device's receive thread is blocked in receive() then.
+
+	{
+		client_a.close_device();
+		bool still_connected = !shared_pump->is_device_destroyed();
+		client_b.close_device();
+
+		bool passed = still_connected && shared_pump->wait_for([&]() { return shared_pump->m_device_destroyed; });
+
+		check("last close disconnects the device", passed);
+	}
+
+	// 5. A lost link is reported to the session.
+
+	{
+		slow_pump->close_pump_fd();
+
+		auto result = receive_with_timeout(client_c);
+		bool passed = result.m_failed && !result.m_timed_out;
+
+		check("lost link is reported", passed);
+	}
+
+	// 6. An exception thrown by receive() is reported as a lost link,
+	//    instead of terminating the process.
+
+	{
+		broker_client client_f;
+		client_f.connect(broker.get_socket_path());
+		client_f.open_device(throwing_address);
+
+		bool passed = write_to_device(*throwing_pump, "boom");
+		auto result = receive_with_timeout(client_f);
+		passed = passed && result.m_failed && !result.m_timed_out;
+
+		check("receive exception is reported", passed);
+	}
+
+	// 7. Stopping the server aborts an ongoing connect attempt.
+
+	{
+		broker_client client_g;
+		client_g.connect(broker.get_socket_path());
+
+		std::thread stuck_open_thread([&]() {
+			try
+			{
+				client_g.open_device(stuck_address);
+			}
+			catch (comboctl::exception const &)
+			{
+			}
+		});
+
+		bool passed = stuck_pump->wait_for([&]() { return stuck_pump->m_num_connect_calls == 1; });
+		auto stop_duration = broker.stop();
+		stuck_open_thread.join();
+
+		passed = passed && (stop_duration < check_timeout) && stuck_pump->is_device_destroyed();
+
+		check("server stop aborts connect attempt", passed);
+	}
+
+	fmt::print("result: {}\n", all_passed ? "all checks passed" : "some checks failed");
+
+	return all_passed;
+}
+
+
+} // namespace comboctl end
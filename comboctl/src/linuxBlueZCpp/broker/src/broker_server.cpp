@@ -0,0 +1,996 @@
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include "broker_server.hpp"
+#include "exception.hpp"
+#include "shm_spsc_ring.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("BrokerServer")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+void close_fd(int &fd)
+{
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+
+void signal_eventfd(int fd)
+{
+	std::uint64_t value = 1;
+	// EAGAIN (counter overflow) means the consumer has
+	// not woken up yet anyway, so errors are ignored.
+	ssize_t ret = ::write(fd, &value, sizeof(value));
+	(void)ret;
+}
+
+
+void drain_eventfd(int fd)
+{
+	std::uint64_t value;
+	ssize_t ret = ::read(fd, &value, sizeof(value));
+	(void)ret;
+}
+
+
+void wake_up(int wake_fd)
+{
+	// The pipe is nonblocking. If it is full, the server loop
+	// is going to wake up anyway, so EAGAIN is ignored.
+	char c = 1;
+	ssize_t ret = ::write(wake_fd, &c, 1);
+	(void)ret;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+struct broker_client_session
+{
+	explicit broker_client_session(int control_fd, unsigned int id)
+		: m_control_fd(control_fd)
+		, m_id(id)
+	{
+	}
+
+	~broker_client_session()
+	{
+		if (m_shm != nullptr)
+			::munmap(m_shm, broker_shm_size);
+		close_fd(m_to_client_eventfd);
+		close_fd(m_from_client_eventfd);
+		close_fd(m_control_fd);
+	}
+
+	int m_control_fd;
+	unsigned int const m_id;
+
+	bool m_handshake_done = false;
+	int m_to_client_eventfd = -1;
+	int m_from_client_eventfd = -1;
+	void *m_shm = nullptr;
+	std::optional<shm_spsc_ring> m_to_client_ring;
+	std::optional<shm_spsc_ring> m_from_client_ring;
+
+	std::shared_ptr<broker_shared_device> m_device;
+	// Set while m_device is still connecting. The open_device
+	// reply is sent once the connect attempt is done.
+	bool m_device_open_pending = false;
+
+	// Set when the session shall be closed by the server loop.
+	// Receive threads set this if the client does not drain its ring.
+	std::atomic<bool> m_close_requested = false;
+};
+
+
+
+
+// An RFCOMM connection to a pump, shared by all sessions that opened it.
+//
+// The device's thread first connects to the pump, then receives data
+// and pushes it into the "to client" rings of all subscribed sessions.
+// The subscriber list is protected by a mutex, since the server loop
+// adds and removes subscribers while the thread is running. Holding
+// the mutex while pushing is fine, since pushing into a ring never
+// blocks. Sessions subscribe right away when opening the device, even
+// if it is still connecting, so they do not miss any data.
+//
+// Sending happens in the server loop, not here, because that is
+// where the "from client" rings are drained.
+//
+// The thread wakes up the server loop when the connect attempt is
+// done, when the link is lost, and when the thread finished.
+class broker_shared_device
+{
+public:
+	enum class connect_state
+	{
+		connecting,
+		connected,
+		failed
+	};
+
+	explicit broker_shared_device(bluetooth_address const &address, broker_device_uptr device, int wake_fd)
+		: m_address(address)
+		, m_device(std::move(device))
+		, m_wake_fd(wake_fd)
+		, m_connect_state(connect_state::connecting)
+		, m_stop_requested(false)
+		, m_thread_finished(false)
+		, m_link_lost(false)
+	{
+	}
+
+	~broker_shared_device()
+	{
+		request_stop();
+		join();
+	}
+
+	bluetooth_address const & get_address() const
+	{
+		return m_address;
+	}
+
+	void start()
+	{
+		assert(!m_thread.joinable());
+		m_thread = std::thread([this]() { thread_func(); });
+	}
+
+	// Asks the thread to stop, without waiting for it. An ongoing
+	// connect attempt is aborted, and so is a blocked receive() call.
+	void request_stop()
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+
+		if (m_stop_requested)
+			return;
+
+		m_stop_requested = true;
+
+		// disconnect() is only needed to abort a connect attempt. Once
+		// connected, the sticky cancel_receive() is enough; it also
+		// covers a thread that did not call receive() yet. join()
+		// disconnects after the thread finished.
+		// The thread switches the state while holding the mutex, so
+		// it cannot change between the check and the call here.
+		if (m_connect_state == connect_state::connecting)
+			m_device->disconnect();
+		else
+			m_device->cancel_receive();
+	}
+
+	// Waits until the thread finished, then disconnects. Call
+	// request_stop() first, otherwise this may wait forever.
+	void join()
+	{
+		if (!m_thread.joinable())
+			return;
+
+		m_thread.join();
+		m_device->disconnect();
+
+		LOG(debug, "Stopped shared device {}", to_string(m_address));
+	}
+
+	bool is_thread_finished() const
+	{
+		return m_thread_finished;
+	}
+
+	connect_state get_connect_state() const
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		return m_connect_state;
+	}
+
+	void add_subscriber(broker_client_session &session)
+	{
+		std::lock_guard<std::mutex> lock(m_subscribers_mutex);
+		m_subscribers.push_back(&session);
+	}
+
+	std::size_t remove_subscriber(broker_client_session &session)
+	{
+		std::lock_guard<std::mutex> lock(m_subscribers_mutex);
+		m_subscribers.erase(std::remove(m_subscribers.begin(), m_subscribers.end(), &session), m_subscribers.end());
+		return m_subscribers.size();
+	}
+
+	std::vector<broker_client_session *> take_subscribers()
+	{
+		std::lock_guard<std::mutex> lock(m_subscribers_mutex);
+		return std::move(m_subscribers);
+	}
+
+	void send(void const *src, int num_bytes)
+	{
+		// Like in thread_func(), exceptions are treated as a lost
+		// link, so they do not take down the whole broker loop.
+		try
+		{
+			auto result = m_device->send(src, num_bytes);
+			if (!result)
+			{
+				LOG(error, "Could not send {} byte(s) to device {}: {}", num_bytes, to_string(m_address), result.error_message());
+				mark_link_lost();
+			}
+		}
+		catch (std::exception const &exc)
+		{
+			LOG(error, "Could not send {} byte(s) to device {}: {}", num_bytes, to_string(m_address), exc.what());
+			mark_link_lost();
+		}
+	}
+
+	bool is_link_lost() const
+	{
+		return m_link_lost;
+	}
+
+
+private:
+	void mark_link_lost()
+	{
+		m_link_lost = true;
+		wake_up(m_wake_fd);
+	}
+
+	void thread_func()
+	{
+		bool connected = false;
+
+		try
+		{
+			m_device->connect();
+			connected = true;
+		}
+		catch (comboctl::exception const &exc)
+		{
+			if (!m_stop_requested)
+				LOG(error, "Could not connect to device {}: {}", to_string(m_address), exc.what());
+		}
+
+		bool stop_requested;
+		{
+			std::lock_guard<std::mutex> lock(m_state_mutex);
+			m_connect_state = connected ? connect_state::connected : connect_state::failed;
+			stop_requested = m_stop_requested;
+		}
+
+		if (connected)
+			LOG(info, "Connected to device {}", to_string(m_address));
+
+		wake_up(m_wake_fd);
+
+		// If request_stop() was called while connecting, but did not
+		// manage to abort the connect attempt, stop here. Otherwise,
+		// its cancel_receive() call makes receive_loop() return.
+		if (connected && !stop_requested)
+		{
+			// Devices report IO errors through io_result, but the
+			// broker_device interface does not rule out exceptions
+			// (like link_lost_exception), and allocations can fail.
+			// An exception that escapes this thread would call
+			// std::terminate(), so treat it as a lost link instead.
+			try
+			{
+				receive_loop();
+			}
+			catch (std::exception const &exc)
+			{
+				LOG(error, "Receive thread for device {} caught exception: {}", to_string(m_address), exc.what());
+				mark_link_lost();
+			}
+		}
+
+		m_thread_finished = true;
+		wake_up(m_wake_fd);
+	}
+
+	void receive_loop()
+	{
+		std::vector<std::uint8_t> buffer(broker_max_payload_size);
+
+		LOG(debug, "Receive thread for device {} started", to_string(m_address));
+
+		while (!m_stop_requested)
+		{
+			auto result = m_device->receive(buffer.data(), int(buffer.size()));
+			if (!result)
+			{
+				if (m_stop_requested)
+					break;
+
+				if (result.error() == io_error::canceled)
+					continue;
+
+				LOG(error, "Could not receive from device {}: {}", to_string(m_address), result.error_message());
+				mark_link_lost();
+				break;
+			}
+
+			int num_bytes_received = result.value();
+
+			if (num_bytes_received == 0)
+			{
+				LOG(info, "Device {} closed the connection", to_string(m_address));
+				mark_link_lost();
+				break;
+			}
+
+			bool overflowed = false;
+
+			{
+				std::lock_guard<std::mutex> lock(m_subscribers_mutex);
+
+				for (auto *session : m_subscribers)
+				{
+					if (session->m_close_requested)
+						continue;
+
+					if (session->m_to_client_ring->try_push(buffer.data(), std::uint32_t(num_bytes_received)))
+					{
+						signal_eventfd(session->m_to_client_eventfd);
+					}
+					else
+					{
+						// Dropping data would corrupt the client's view of
+						// the packet stream, so close the session instead.
+						LOG(warn, "Session {} does not drain its ring; closing it", session->m_id);
+						session->m_close_requested = true;
+						overflowed = true;
+					}
+				}
+			}
+
+			if (overflowed)
+				wake_up(m_wake_fd);
+		}
+
+		LOG(debug, "Receive thread for device {} finished", to_string(m_address));
+	}
+
+	bluetooth_address const m_address;
+	broker_device_uptr m_device;
+	int const m_wake_fd;
+
+	std::thread m_thread;
+
+	// Guards m_connect_state, and makes request_stop()
+	// atomic with respect to the state changing.
+	mutable std::mutex m_state_mutex;
+	connect_state m_connect_state;
+
+	std::atomic<bool> m_stop_requested;
+	std::atomic<bool> m_thread_finished;
+	std::atomic<bool> m_link_lost;
+
+	std::mutex m_subscribers_mutex;
+	std::vector<broker_client_session *> m_subscribers;
+};
+
+
+
+
+broker_server::broker_server(broker_device_factory device_factory)
+	: m_device_factory(std::move(device_factory))
+	, m_listen_fd(-1)
+	, m_stop_requested(false)
+	, m_send_buffer(broker_max_payload_size)
+{
+	// request_stop() may be called from a signal handler.
+	static_assert(std::atomic<bool>::is_always_lock_free);
+
+	if (::pipe2(m_wake_pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+		throw io_exception(fmt::format("Could not create wake pipe: {} ({})", std::strerror(errno), errno));
+}
+
+
+broker_server::~broker_server()
+{
+	// Close the sessions first, since they reference the devices.
+	while (!m_sessions.empty())
+		close_session(*m_sessions.front());
+
+	for (auto &entry : m_devices)
+		retire_device(entry.second);
+	m_devices.clear();
+
+	// The devices were all asked to stop above, so they can now be
+	// joined in one go. Their threads stop in parallel that way.
+	for (auto &device : m_stopping_devices)
+		device->join();
+	m_stopping_devices.clear();
+
+	if (m_listen_fd >= 0)
+	{
+		close_fd(m_listen_fd);
+		::unlink(m_socket_path.c_str());
+	}
+
+	close_fd(m_wake_pipe_fds[0]);
+	close_fd(m_wake_pipe_fds[1]);
+}
+
+
+void broker_server::listen(std::string const &socket_path)
+{
+	assert(m_listen_fd < 0);
+
+	struct sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path))
+		throw io_exception(fmt::format("Broker socket path \"{}\" is too long", socket_path));
+	std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+	// Check if another daemon is listening on that path. If connecting
+	// fails, the socket file (if any) is stale and can be removed.
+	{
+		int probe_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (probe_fd < 0)
+			throw io_exception(fmt::format("Could not create socket: {} ({})", std::strerror(errno), errno));
+		bool in_use = (::connect(probe_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0);
+		::close(probe_fd);
+
+		if (in_use)
+			throw io_exception(fmt::format("Another broker is already listening on {}", socket_path));
+
+		if ((::unlink(socket_path.c_str()) < 0) && (errno != ENOENT))
+			throw io_exception(fmt::format("Could not remove stale socket {}: {} ({})", socket_path, std::strerror(errno), errno));
+	}
+
+	int listen_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (listen_fd < 0)
+		throw io_exception(fmt::format("Could not create socket: {} ({})", std::strerror(errno), errno));
+
+	if (::bind(listen_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0)
+	{
+		int error = errno;
+		::close(listen_fd);
+		throw io_exception(fmt::format("Could not bind socket to {}: {} ({})", socket_path, std::strerror(error), error));
+	}
+
+	// Only our own user may connect. accept_client() checks
+	// the peer credentials in addition to this.
+	::chmod(socket_path.c_str(), S_IRUSR | S_IWUSR);
+
+	if (::listen(listen_fd, 16) < 0)
+	{
+		int error = errno;
+		::close(listen_fd);
+		::unlink(socket_path.c_str());
+		throw io_exception(fmt::format("Could not listen on {}: {} ({})", socket_path, std::strerror(error), error));
+	}
+
+	m_listen_fd = listen_fd;
+	m_socket_path = socket_path;
+
+	LOG(info, "Listening on {}", socket_path);
+}
+
+
+void broker_server::run()
+{
+	assert(m_listen_fd >= 0);
+
+	// Sessions whose fds are in m_pollfds, in the same order.
+	// A session has one or two entries there (control socket, and
+	// the "from client" eventfd if it has a device open).
+	std::vector<broker_client_session *> polled_sessions;
+
+	while (!m_stop_requested)
+	{
+		m_pollfds.clear();
+		polled_sessions.clear();
+
+		m_pollfds.push_back({ m_wake_pipe_fds[0], POLLIN, 0 });
+		m_pollfds.push_back({ m_listen_fd, POLLIN, 0 });
+
+		for (auto &session : m_sessions)
+		{
+			m_pollfds.push_back({ session->m_control_fd, POLLIN, 0 });
+			polled_sessions.push_back(session.get());
+
+			if (session->m_device && !session->m_device_open_pending)
+			{
+				m_pollfds.push_back({ session->m_from_client_eventfd, POLLIN, 0 });
+				polled_sessions.push_back(session.get());
+			}
+		}
+
+		if (::poll(m_pollfds.data(), m_pollfds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw io_exception(fmt::format("Could not poll: {} ({})", std::strerror(errno), errno));
+		}
+
+		if (m_pollfds[0].revents & POLLIN)
+			handle_wakeup();
+
+		if (m_pollfds[1].revents & POLLIN)
+			accept_client();
+
+		for (std::size_t i = 0; i < polled_sessions.size(); ++i)
+		{
+			auto &pollfd = m_pollfds[i + 2];
+			auto &session = *(polled_sessions[i]);
+
+			if ((pollfd.revents == 0) || session.m_close_requested)
+				continue;
+
+			try
+			{
+				if (pollfd.fd == session.m_control_fd)
+					handle_control_message(session);
+				else if (session.m_device && !session.m_device_open_pending)
+					forward_client_data(session);
+			}
+			catch (comboctl::exception const &exc)
+			{
+				LOG(warn, "Closing session {} after error: {}", session.m_id, exc.what());
+				session.m_close_requested = true;
+			}
+		}
+
+		for (auto iter = m_sessions.begin(); iter != m_sessions.end();)
+		{
+			auto &session = **iter;
+			++iter;
+			if (session.m_close_requested)
+				close_session(session);
+		}
+	}
+
+	LOG(info, "Stopping");
+
+	while (!m_sessions.empty())
+		close_session(*m_sessions.front());
+}
+
+
+void broker_server::request_stop()
+{
+	m_stop_requested = true;
+	wake_up(m_wake_pipe_fds[1]);
+}
+
+
+void broker_server::accept_client()
+{
+	static unsigned int next_session_id = 1;
+
+	int fd = ::accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+	{
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			LOG(warn, "Could not accept client: {} ({})", std::strerror(errno), errno);
+		return;
+	}
+
+	struct ucred credentials;
+	socklen_t credentials_length = sizeof(credentials);
+	if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) < 0)
+	{
+		LOG(warn, "Could not get client credentials: {} ({}); rejecting client", std::strerror(errno), errno);
+		::close(fd);
+		return;
+	}
+
+	if ((credentials.uid != ::getuid()) && (credentials.uid != 0))
+	{
+		LOG(warn, "Rejecting client with PID {} and foreign UID {}", credentials.pid, credentials.uid);
+		::close(fd);
+		return;
+	}
+
+	auto session = std::make_unique<broker_client_session>(fd, next_session_id++);
+	LOG(info, "Accepted client with PID {} as session {}", credentials.pid, session->m_id);
+	m_sessions.push_back(std::move(session));
+}
+
+
+void broker_server::handle_control_message(broker_client_session &session)
+{
+	broker_message message;
+	if (!receive_broker_message(session.m_control_fd, message))
+	{
+		LOG(info, "Session {} closed by client", session.m_id);
+		session.m_close_requested = true;
+		return;
+	}
+
+	switch (message.m_type)
+	{
+		case broker_message_type::hello:
+			handle_hello(session, message);
+			break;
+
+		case broker_message_type::open_device:
+			handle_open_device(session, message);
+			break;
+
+		case broker_message_type::close_device:
+			handle_close_device(session);
+			break;
+
+		default:
+			throw io_exception(fmt::format("Client sent unexpected message of type {}", unsigned(message.m_type)));
+	}
+}
+
+
+void broker_server::handle_hello(broker_client_session &session, broker_message const &message)
+{
+	broker_message reply = {};
+	reply.m_type = broker_message_type::hello_reply;
+	reply.m_protocol_version = broker_protocol_version;
+
+	if (session.m_handshake_done)
+	{
+		reply.m_status = broker_status::invalid_request;
+		send_broker_message(session.m_control_fd, reply);
+		return;
+	}
+
+	if (message.m_protocol_version != broker_protocol_version)
+	{
+		LOG(warn, "Session {} uses protocol version {}, we use version {}; closing it", session.m_id, message.m_protocol_version, broker_protocol_version);
+		reply.m_status = broker_status::protocol_version_mismatch;
+		send_broker_message(session.m_control_fd, reply);
+		session.m_close_requested = true;
+		return;
+	}
+
+	// The memfd is sealed against resizing. Otherwise, the client
+	// could shrink it, and our next access to the mapping would
+	// cause a SIGBUS that takes down the entire daemon.
+	int shm_fd = ::memfd_create("comboctl-broker-session", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	bool shm_ok = (shm_fd >= 0)
+		&& (::ftruncate(shm_fd, broker_shm_size) == 0)
+		&& (::fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0);
+	void *shm = shm_ok ? ::mmap(nullptr, broker_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0) : MAP_FAILED;
+
+	if (shm == MAP_FAILED)
+	{
+		LOG(error, "Could not set up shared memory for session {}: {} ({})", session.m_id, std::strerror(errno), errno);
+		if (shm_fd >= 0)
+			::close(shm_fd);
+		reply.m_status = broker_status::resource_error;
+		send_broker_message(session.m_control_fd, reply);
+		session.m_close_requested = true;
+		return;
+	}
+
+	session.m_shm = shm;
+
+	session.m_to_client_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	session.m_from_client_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((session.m_to_client_eventfd < 0) || (session.m_from_client_eventfd < 0))
+	{
+		LOG(error, "Could not create eventfds for session {}: {} ({})", session.m_id, std::strerror(errno), errno);
+		::close(shm_fd);
+		reply.m_status = broker_status::resource_error;
+		send_broker_message(session.m_control_fd, reply);
+		session.m_close_requested = true;
+		return;
+	}
+
+	auto shm_bytes = reinterpret_cast<std::uint8_t *>(shm);
+	session.m_to_client_ring = shm_spsc_ring::initialize(shm_bytes + broker_to_client_ring_offset, broker_ring_capacity);
+	session.m_from_client_ring = shm_spsc_ring::initialize(shm_bytes + broker_from_client_ring_offset, broker_ring_capacity);
+
+	reply.m_status = broker_status::ok;
+	reply.m_ring_capacity = broker_ring_capacity;
+
+	int fds[broker_num_session_fds] = { shm_fd, session.m_to_client_eventfd, session.m_from_client_eventfd };
+	try
+	{
+		send_broker_message(session.m_control_fd, reply, fds, broker_num_session_fds);
+	}
+	catch (...)
+	{
+		::close(shm_fd);
+		throw;
+	}
+
+	// The mapping keeps the shared memory alive; the fd is not needed anymore.
+	::close(shm_fd);
+
+	session.m_handshake_done = true;
+
+	LOG(debug, "Session {} set up", session.m_id);
+}
+
+
+void broker_server::handle_open_device(broker_client_session &session, broker_message const &message)
+{
+	broker_message reply = {};
+	reply.m_type = broker_message_type::open_device_reply;
+
+	if (!session.m_handshake_done || session.m_device)
+	{
+		reply.m_status = broker_status::invalid_request;
+		send_broker_message(session.m_control_fd, reply);
+		return;
+	}
+
+	bluetooth_address device_address;
+	std::copy(std::begin(message.m_device_address), std::end(message.m_device_address), device_address.begin());
+
+	auto device_iter = m_devices.find(device_address);
+	if (device_iter != m_devices.end())
+	{
+		// The device's thread may have finished connecting, or noticed
+		// a link loss, without the server loop having handled that yet.
+		// Do that now. Afterwards, the device is either still usable,
+		// or it is gone, and a new connection is set up below.
+		auto device = device_iter->second;
+		complete_pending_opens(device);
+		if (device->is_link_lost())
+			handle_lost_device(device_address);
+		device_iter = m_devices.find(device_address);
+	}
+
+	if (device_iter != m_devices.end())
+	{
+		auto &device = device_iter->second;
+
+		device->add_subscriber(session);
+		session.m_device = device;
+
+		if (device->get_connect_state() == broker_shared_device::connect_state::connecting)
+		{
+			LOG(info, "Session {} waits for ongoing connection attempt to device {}", session.m_id, to_string(device_address));
+			session.m_device_open_pending = true;
+			return;
+		}
+
+		LOG(info, "Session {} shares existing connection to device {}", session.m_id, to_string(device_address));
+	}
+	else
+	{
+		LOG(info, "Session {} opens device {}; connecting", session.m_id, to_string(device_address));
+
+		// Connecting happens in the device's thread, so that the server
+		// loop keeps serving the other sessions in the meantime. The
+		// reply is sent by complete_pending_opens() once that is done.
+		auto shared_device = std::make_shared<broker_shared_device>(device_address, m_device_factory(device_address), m_wake_pipe_fds[1]);
+		shared_device->add_subscriber(session);
+		shared_device->start();
+
+		m_devices.emplace(device_address, shared_device);
+		session.m_device = std::move(shared_device);
+		session.m_device_open_pending = true;
+		return;
+	}
+
+	reply.m_status = broker_status::ok;
+	send_broker_message(session.m_control_fd, reply);
+}
+
+
+void broker_server::handle_close_device(broker_client_session &session)
+{
+	broker_message reply = {};
+	reply.m_type = broker_message_type::close_device_reply;
+	reply.m_status = broker_status::ok;
+
+	close_device(session);
+
+	send_broker_message(session.m_control_fd, reply);
+}
+
+
+void broker_server::forward_client_data(broker_client_session &session)
+{
+	assert(session.m_device);
+
+	// Drain the eventfd _before_ popping. Otherwise, a record pushed
+	// between the last pop and the drain would go unnoticed.
+	drain_eventfd(session.m_from_client_eventfd);
+
+	while (!session.m_device->is_link_lost())
+	{
+		int num_bytes = session.m_from_client_ring->try_pop(m_send_buffer.data(), std::uint32_t(m_send_buffer.size()));
+		if (num_bytes < 0)
+			break;
+		if (num_bytes == 0)
+			continue;
+
+		session.m_device->send(m_send_buffer.data(), num_bytes);
+	}
+}
+
+
+void broker_server::handle_wakeup()
+{
+	char buffer[64];
+	while (::read(m_wake_pipe_fds[0], buffer, sizeof(buffer)) > 0)
+	{
+	}
+
+	// Copy the devices, since complete_pending_opens()
+	// and handle_lost_device() modify m_devices.
+	std::vector<std::shared_ptr<broker_shared_device>> devices;
+	for (auto const &entry : m_devices)
+		devices.push_back(entry.second);
+
+	for (auto const &device : devices)
+	{
+		complete_pending_opens(device);
+		if (device->is_link_lost())
+			handle_lost_device(device->get_address());
+	}
+
+	join_finished_devices();
+}
+
+
+void broker_server::complete_pending_opens(std::shared_ptr<broker_shared_device> const &device)
+{
+	auto connect_state = device->get_connect_state();
+	if (connect_state == broker_shared_device::connect_state::connecting)
+		return;
+
+	bool connected = (connect_state == broker_shared_device::connect_state::connected);
+
+	broker_message reply = {};
+	reply.m_type = broker_message_type::open_device_reply;
+	reply.m_status = connected ? broker_status::ok : broker_status::connect_failed;
+
+	for (auto &session : m_sessions)
+	{
+		if ((session->m_device != device) || !session->m_device_open_pending)
+			continue;
+
+		session->m_device_open_pending = false;
+		if (!connected)
+			session->m_device.reset();
+
+		try
+		{
+			send_broker_message(session->m_control_fd, reply);
+		}
+		catch (comboctl::exception const &exc)
+		{
+			LOG(warn, "Could not send open device reply to session {}: {}", session->m_id, exc.what());
+			session->m_close_requested = true;
+		}
+	}
+
+	if (!connected)
+	{
+		auto device_iter = m_devices.find(device->get_address());
+		if ((device_iter != m_devices.end()) && (device_iter->second == device))
+		{
+			m_devices.erase(device_iter);
+			retire_device(device);
+		}
+	}
+}
+
+
+void broker_server::close_device(broker_client_session &session)
+{
+	if (!session.m_device)
+		return;
+
+	auto device = std::move(session.m_device);
+	session.m_device.reset();
+	session.m_device_open_pending = false;
+
+	std::size_t num_remaining_subscribers = device->remove_subscriber(session);
+	LOG(info, "Session {} closed device {}; {} session(s) still use it", session.m_id, to_string(device->get_address()), num_remaining_subscribers);
+
+	if (num_remaining_subscribers == 0)
+	{
+		auto device_iter = m_devices.find(device->get_address());
+		if ((device_iter != m_devices.end()) && (device_iter->second == device))
+			m_devices.erase(device_iter);
+		retire_device(std::move(device));
+	}
+}
+
+
+void broker_server::handle_lost_device(bluetooth_address const &device_address)
+{
+	auto device_iter = m_devices.find(device_address);
+	if (device_iter == m_devices.end())
+		return;
+
+	auto device = std::move(device_iter->second);
+	m_devices.erase(device_iter);
+
+	LOG(info, "Connection to device {} lost", to_string(device_address));
+
+	retire_device(device);
+
+	broker_message notification = {};
+	notification.m_type = broker_message_type::device_disconnected;
+	std::copy(device_address.begin(), device_address.end(), notification.m_device_address);
+
+	for (auto *session : device->take_subscribers())
+	{
+		session->m_device.reset();
+
+		try
+		{
+			send_broker_message(session->m_control_fd, notification);
+		}
+		catch (comboctl::exception const &exc)
+		{
+			LOG(warn, "Could not notify session {} about lost device: {}", session->m_id, exc.what());
+			session->m_close_requested = true;
+		}
+	}
+}
+
+
+void broker_server::retire_device(std::shared_ptr<broker_shared_device> device)
+{
+	// Only ask the device's thread to stop here. Waiting for it would
+	// stall the server loop if the thread is busy, for example if it
+	// is in a connect attempt that cannot be aborted anymore. The
+	// thread wakes up the server loop once it finished, and
+	// join_finished_devices() then takes care of the rest.
+	device->request_stop();
+	m_stopping_devices.push_back(std::move(device));
+}
+
+
+void broker_server::join_finished_devices()
+{
+	for (auto iter = m_stopping_devices.begin(); iter != m_stopping_devices.end();)
+	{
+		if ((*iter)->is_thread_finished())
+		{
+			(*iter)->join();
+			iter = m_stopping_devices.erase(iter);
+		}
+		else
+			++iter;
+	}
+}
+
+
+void broker_server::close_session(broker_client_session &session)
+{
+	close_device(session);
+
+	LOG(debug, "Closing session {}", session.m_id);
+
+	m_sessions.remove_if([&](session_uptr const &entry) { return entry.get() == &session; });
+}
+
+
+} // namespace comboctl end
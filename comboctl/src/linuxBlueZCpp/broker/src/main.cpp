@@ -0,0 +1,154 @@
+#include <signal.h>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include "bluez_interface.hpp"
+#include "broker_protocol.hpp"
+#include "broker_self_test.hpp"
+#include "broker_server.hpp"
+#include "log.hpp"
+
+
+// comboctl-broker: daemon that owns the BlueZ connection and the
+// RFCOMM connections to pumps, and shares these connections with
+// multiple local client processes. See broker_protocol.hpp for details.
+
+
+namespace
+{
+
+
+comboctl::broker_server *server_for_signal_handler = nullptr;
+
+
+// broker_device that connects to the pump over RFCOMM through BlueZ.
+class bluez_broker_device
+	: public comboctl::broker_device
+{
+public:
+	explicit bluez_broker_device(comboctl::bluez_bluetooth_device_uptr device)
+		: m_device(std::move(device))
+	{
+	}
+
+	void connect() override
+	{
+		m_device->connect();
+	}
+
+	void disconnect() override
+	{
+		m_device->disconnect();
+	}
+
+	comboctl::io_result<int> send(void const *src, int num_bytes) override
+	{
+		return m_device->send(src, num_bytes);
+	}
+
+	comboctl::io_result<int> receive(void *dest, int num_bytes) override
+	{
+		return m_device->receive(dest, num_bytes);
+	}
+
+	void cancel_receive() override
+	{
+		m_device->cancel_receive();
+	}
+
+
+private:
+	comboctl::bluez_bluetooth_device_uptr m_device;
+};
+
+
+void handle_stop_signal(int)
+{
+	if (server_for_signal_handler != nullptr)
+		server_for_signal_handler->request_stop();
+}
+
+
+void print_usage(char const *program_name)
+{
+	std::cerr
+		<< "Usage: " << program_name << " [--socket PATH] [--verbose]\n"
+		<< "       " << program_name << " --self-test [--verbose]\n"
+		<< "\n"
+		<< "  --socket PATH  Path of the control socket (default: " << comboctl::get_default_broker_socket_path() << ")\n"
+		<< "  --self-test    Runs the broker against loopback devices instead of pumps,\n"
+		<< "                 checks its behavior, and exits with status 1 if a check fails\n"
+		<< "  --verbose      Also print debug log lines\n";
+}
+
+
+} // unnamed namespace end
+
+
+
+
+int main(int argc, char *argv[])
+{
+	std::string socket_path = comboctl::get_default_broker_socket_path();
+	comboctl::log_level min_log_level = comboctl::log_level::info;
+	bool self_test = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if ((std::strcmp(argv[i], "--socket") == 0) && ((i + 1) < argc))
+		{
+			socket_path = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--self-test") == 0)
+		{
+			self_test = true;
+		}
+		else if (std::strcmp(argv[i], "--verbose") == 0)
+		{
+			min_log_level = comboctl::log_level::debug;
+		}
+		else
+		{
+			print_usage(argv[0]);
+			return (std::strcmp(argv[i], "--help") == 0) ? 0 : 1;
+		}
+	}
+
+	comboctl::set_min_log_level(min_log_level);
+
+	try
+	{
+		if (self_test)
+			return comboctl::run_broker_self_test() ? 0 : 1;
+
+		comboctl::bluez_interface bluez;
+		comboctl::broker_server server([&bluez](comboctl::bluetooth_address const &device_address) {
+			return std::make_unique<bluez_broker_device>(bluez.get_device(device_address));
+		});
+
+		server.listen(socket_path);
+
+		server_for_signal_handler = &server;
+
+		struct sigaction action = {};
+		action.sa_handler = handle_stop_signal;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGINT, &action, nullptr);
+		sigaction(SIGTERM, &action, nullptr);
+
+		server.run();
+
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		server_for_signal_handler = nullptr;
+	}
+	catch (std::exception const &exc)
+	{
+		std::cerr << "comboctl-broker: " << exc.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
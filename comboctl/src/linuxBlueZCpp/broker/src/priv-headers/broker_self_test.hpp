@@ -0,0 +1,38 @@
+#ifndef COMBOCTL_BROKER_SELF_TEST_HPP
+#define COMBOCTL_BROKER_SELF_TEST_HPP
+
+
+namespace comboctl
+{
+
+
+/**
+ * Checks the broker_server behavior without Bluetooth hardware.
+ *
+ * This runs a broker_server on a temporary socket, with loopback devices
+ * (socket pairs) in place of pumps, and talks to it with broker_client
+ * instances. It checks that:
+ *
+ * 1. Sessions that open the same device share one connection, and
+ *    data flows in both directions for all of them.
+ * 2. A slow connect attempt does not stall the other sessions.
+ * 3. A failed connect attempt is reported to the session.
+ * 4. The device is disconnected once the last session closed it,
+ *    even though its receive thread is blocked in receive().
+ * 5. A lost link is reported to the sessions.
+ * 6. An exception thrown by the device's receive() call is reported
+ *    as a lost link as well.
+ * 7. Stopping the server aborts an ongoing connect attempt.
+ *
+ * The results are printed to stdout.
+ *
+ * @return true if all checks passed.
+ * @throws io_exception if the temporary socket cannot be set up.
+ */
+bool run_broker_self_test();
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_BROKER_SELF_TEST_HPP
@@ -0,0 +1,151 @@
+#ifndef COMBOCTL_BROKER_SERVER_HPP
+#define COMBOCTL_BROKER_SERVER_HPP
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include "broker_protocol.hpp"
+#include "io_result.hpp"
+#include "types.hpp"
+
+
+namespace comboctl
+{
+
+
+struct broker_client_session;
+class broker_shared_device;
+
+
+/**
+ * Connection to a pump, as used by broker_server.
+ *
+ * The daemon implements this with bluez_bluetooth_device (see main.cpp),
+ * the self test with socket pairs (see broker_self_test.hpp). The functions
+ * behave like the bluez_bluetooth_device ones. In particular, disconnect()
+ * aborts an ongoing connect() call, and cancel_receive() cancels the next
+ * receive() call if no receive() call is ongoing.
+ */
+class broker_device
+{
+public:
+	virtual ~broker_device() = default;
+
+	virtual void connect() = 0;
+	virtual void disconnect() = 0;
+	virtual io_result<int> send(void const *src, int num_bytes) = 0;
+	virtual io_result<int> receive(void *dest, int num_bytes) = 0;
+	virtual void cancel_receive() = 0;
+};
+
+
+typedef std::unique_ptr<broker_device> broker_device_uptr;
+
+/**
+ * Creates a (not yet connected) broker_device for the given address.
+ *
+ * This is called in the server loop, so it must not block.
+ */
+typedef std::function<broker_device_uptr(bluetooth_address const &device_address)> broker_device_factory;
+
+
+/**
+ * Server side of the comboctl-broker daemon.
+ *
+ * Accepts clients on a Unix socket, sets up their shared memory
+ * sessions, and forwards data between the sessions and the RFCOMM
+ * connections to pumps. Each open pump has its own thread that
+ * connects to the pump, and then pushes received data into the
+ * rings of all clients that have the pump open. Everything else
+ * happens in the thread that calls run(). That thread never waits
+ * for a pump; connecting and disconnecting happen in the background.
+ */
+class broker_server
+{
+public:
+	/**
+	 * Constructor.
+	 *
+	 * @param device_factory Function to create pump connections with.
+	 */
+	explicit broker_server(broker_device_factory device_factory);
+	~broker_server();
+
+	broker_server(broker_server const &) = delete;
+	broker_server& operator = (broker_server const &) = delete;
+
+	/**
+	 * Creates the control socket and starts listening on it.
+	 *
+	 * If a stale socket file exists at the path (left over by a daemon
+	 * that crashed), it is replaced. If another daemon is listening on
+	 * that path, this fails.
+	 *
+	 * @param socket_path Path of the control socket.
+	 * @throws io_exception in case of an IO error, or if another
+	 *         daemon is already running.
+	 */
+	void listen(std::string const &socket_path);
+
+	/**
+	 * Runs the server loop until request_stop() is called.
+	 *
+	 * Before returning, all client sessions are closed,
+	 * and all pump connections are terminated.
+	 */
+	void run();
+
+	/**
+	 * Makes run() return.
+	 *
+	 * This is async-signal-safe, so it can be called from a signal handler.
+	 */
+	void request_stop();
+
+
+private:
+	typedef std::unique_ptr<broker_client_session> session_uptr;
+
+	void accept_client();
+	void handle_control_message(broker_client_session &session);
+	void handle_hello(broker_client_session &session, broker_message const &message);
+	void handle_open_device(broker_client_session &session, broker_message const &message);
+	void handle_close_device(broker_client_session &session);
+	void forward_client_data(broker_client_session &session);
+	void handle_wakeup();
+	void complete_pending_opens(std::shared_ptr<broker_shared_device> const &device);
+	void close_device(broker_client_session &session);
+	void handle_lost_device(bluetooth_address const &device_address);
+	void retire_device(std::shared_ptr<broker_shared_device> device);
+	void join_finished_devices();
+	void close_session(broker_client_session &session);
+
+	broker_device_factory m_device_factory;
+
+	std::string m_socket_path;
+	int m_listen_fd;
+	// Written to by request_stop() and by receive threads,
+	// to wake up the poll() call in run().
+	int m_wake_pipe_fds[2];
+	std::atomic<bool> m_stop_requested;
+
+	std::list<session_uptr> m_sessions;
+	std::map<bluetooth_address, std::shared_ptr<broker_shared_device>> m_devices;
+	// Devices whose threads were asked to stop, but may still be running.
+	// These are joined once their threads finished (see join_finished_devices()).
+	std::vector<std::shared_ptr<broker_shared_device>> m_stopping_devices;
+
+	std::vector<struct pollfd> m_pollfds;
+	std::vector<std::uint8_t> m_send_buffer;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_BROKER_SERVER_HPP
@@ -11,8 +11,15 @@ library {
     }
 }
 
+// Native build options are defined in the root build script.
+val nativeDBusBackendEnabled = rootProject.extra["nativeDBusBackendEnabled"] as Boolean
+@Suppress("UNCHECKED_CAST")
+val nativeOptionCflags = rootProject.extra["nativeOptionCflags"] as List<String>
+
 extensions.configure<CppLibrary> {
-    source.from(file("src"))
+    // gerror_exception.cpp is only used by GLib based code. mock-bluez always
+    // uses GLib, so it builds that file on its own with the native D-Bus backend.
+    source.from(fileTree("src") { if (nativeDBusBackendEnabled) exclude("gerror_exception.cpp") })
     privateHeaders.from(file("src/priv-headers"))
     publicHeaders.from(file("include"))
 }
@@ -20,9 +27,17 @@ extensions.configure<CppLibrary> {
 val glibCflagsStdout = ByteArrayOutputStream()
 val glibLibsStdout = ByteArrayOutputStream()
 
+// The native D-Bus backend does not use GLib, so pkg-config is not run for it then.
+fun getGlibCflags(): List<String> =
+    if (!nativeDBusBackendEnabled) glibCflagsStdout.toString().trim().split(" ") else listOf()
+
+fun getGlibLibs(): List<String> =
+    if (!nativeDBusBackendEnabled) glibLibsStdout.toString().trim().split(" ") else listOf()
+
 fun getGccAndClangCflags(): List<String> {
     return listOf("-Wextra", "-Wall", "-O0", "-g3", "-ggdb", "-fPIC", "-DPIC", "-std=c++17") +
-    glibCflagsStdout.toString().trim().split(" ")
+    getGlibCflags() +
+    nativeOptionCflags
 }
 
 task<Exec>("glib2PkgConfigCflags") {
@@ -36,7 +51,8 @@ task<Exec>("glib2PkgConfigLibs") {
 }
 
 tasks.withType(CppCompile::class.java).configureEach {
-    dependsOn("glib2PkgConfigCflags")
+    if (!nativeDBusBackendEnabled)
+        dependsOn("glib2PkgConfigCflags")
     compilerArgs.addAll(toolChain.map { toolChain ->
         when (toolChain) {
             is Gcc, is Clang -> getGccAndClangCflags()
@@ -46,10 +62,11 @@ tasks.withType(CppCompile::class.java).configureEach {
 }
 
 tasks.withType(LinkSharedLibrary::class.java).configureEach {
-    dependsOn("glib2PkgConfigLibs")
+    if (!nativeDBusBackendEnabled)
+        dependsOn("glib2PkgConfigLibs")
     linkerArgs.addAll(toolChain.map { toolChain ->
         when (toolChain) {
-            is Gcc, is Clang -> glibLibsStdout.toString().trim().split(" ")
+            is Gcc, is Clang -> getGlibLibs()
             else -> listOf()
         }
     })
@@ -0,0 +1,214 @@
+#ifndef COMBOCTL_ALLOCATION_TRACKING_HPP
+#define COMBOCTL_ALLOCATION_TRACKING_HPP
+
+#include <cstdint>
+#include <string>
+
+
+// Heap allocation tracking for instrumentation builds.
+//
+// The hot paths (RFCOMM send and receive, their JNI bindings, and the
+// mainloop task dispatch) are supposed to not allocate any memory once
+// they reached their steady state. To verify this, build with
+// COMBOCTL_ENABLE_ALLOCATION_TRACKING defined (pass
+// -PcomboctlAllocationTracking to Gradle; this must apply to all native
+// projects, since it changes the classes below). In such a build,
+// malloc() and friends as well as the global operator new are replaced
+// with versions that count allocations per thread and process-wide.
+//
+// The hot paths are marked with no_allocation_scope. Allocations inside
+// such a region are counted separately, and the call stack of each one
+// is recorded, so that format_allocation_site_report() can list where
+// the remaining allocations come from.
+//
+// Note that the replacements only see all allocations in executables
+// (like comboctl-mock-bluez, whose alloc-check mode verifies the steady
+// state). The JVM loads the JNI library with local symbol scope, so
+// other libraries do not use the replacements. Instrumentation builds
+// link the JNI library with -Bsymbolic, so that at least the library's
+// own code uses them. Allocations that GLib or libstdc++ perform
+// internally are not seen there.
+//
+// Without COMBOCTL_ENABLE_ALLOCATION_TRACKING, the scopes compile to
+// nothing, and the counters are always zero.
+
+
+namespace comboctl
+{
+
+
+/**
+ * Allocation counters. See get_thread_allocation_counters()
+ * and get_process_allocation_counters().
+ */
+struct allocation_counters
+{
+	/// Number of allocations (including reallocations).
+	std::uint64_t m_num_allocations = 0;
+
+	/// Number of requested bytes.
+	std::uint64_t m_num_allocated_bytes = 0;
+
+	/// Number of allocations that happened inside a no_allocation_scope.
+	std::uint64_t m_num_region_allocations = 0;
+};
+
+
+#ifdef COMBOCTL_ENABLE_ALLOCATION_TRACKING
+
+
+constexpr bool allocation_tracking_available = true;
+
+
+namespace detail
+{
+
+
+char const * enter_allocation_region(char const *region_name);
+void leave_allocation_region(char const *previous_region_name);
+
+
+} // namespace detail end
+
+
+/**
+ * Marks the enclosing scope of the current thread as a region
+ * that is not supposed to allocate memory.
+ *
+ * Regions can be nested. The innermost region's name is used
+ * when an allocation is recorded.
+ */
+class no_allocation_scope
+{
+public:
+	/**
+	 * Enters the region.
+	 *
+	 * @param region_name Name of the region. Must be a string
+	 *        literal or otherwise remain valid forever.
+	 */
+	explicit no_allocation_scope(char const *region_name)
+		: m_previous_region_name(detail::enter_allocation_region(region_name))
+	{
+	}
+
+	~no_allocation_scope()
+	{
+		detail::leave_allocation_region(m_previous_region_name);
+	}
+
+	no_allocation_scope(no_allocation_scope const &) = delete;
+	no_allocation_scope& operator = (no_allocation_scope const &) = delete;
+
+
+private:
+	char const *m_previous_region_name;
+};
+
+
+/**
+ * Lifts any enclosing no_allocation_scope for the enclosing scope.
+ *
+ * This is used for code that runs inside a region but is not part
+ * of the hot path itself, like the task functions that the mainloop
+ * task dispatch calls.
+ */
+class allocation_allowed_scope
+{
+public:
+	allocation_allowed_scope()
+		: m_previous_region_name(detail::enter_allocation_region(nullptr))
+	{
+	}
+
+	~allocation_allowed_scope()
+	{
+		detail::leave_allocation_region(m_previous_region_name);
+	}
+
+	allocation_allowed_scope(allocation_allowed_scope const &) = delete;
+	allocation_allowed_scope& operator = (allocation_allowed_scope const &) = delete;
+
+
+private:
+	char const *m_previous_region_name;
+};
+
+
+/**
+ * Returns the allocation counters of the calling thread.
+ */
+allocation_counters get_thread_allocation_counters();
+
+/**
+ * Returns the allocation counters of all threads combined.
+ */
+allocation_counters get_process_allocation_counters();
+
+/**
+ * Returns a human readable list of the allocations that happened
+ * inside no_allocation_scope regions, grouped by call stack, with
+ * the most frequent ones first.
+ *
+ * Symbol names in executables are only available if these were
+ * linked with -rdynamic. Otherwise, use addr2line on the addresses.
+ */
+std::string format_allocation_site_report();
+
+/**
+ * Discards the recorded allocation sites.
+ */
+void reset_allocation_site_report();
+
+
+#else
+
+
+constexpr bool allocation_tracking_available = false;
+
+
+class no_allocation_scope
+{
+public:
+	explicit no_allocation_scope(char const *)
+	{
+	}
+};
+
+
+class allocation_allowed_scope
+{
+public:
+	allocation_allowed_scope()
+	{
+	}
+};
+
+
+inline allocation_counters get_thread_allocation_counters()
+{
+	return allocation_counters();
+}
+
+inline allocation_counters get_process_allocation_counters()
+{
+	return allocation_counters();
+}
+
+inline std::string format_allocation_site_report()
+{
+	return "Allocation tracking is not available in this build\n";
+}
+
+inline void reset_allocation_site_report()
+{
+}
+
+
+#endif
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_ALLOCATION_TRACKING_HPP
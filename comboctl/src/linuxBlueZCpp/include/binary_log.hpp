@@ -0,0 +1,394 @@
+#ifndef COMBOCTL_BINARY_LOG_HPP
+#define COMBOCTL_BINARY_LOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "fmt/format.h"
+#include "log.hpp"
+
+
+// Binary logging mode, in the spirit of NanoLog.
+//
+// Formatting log lines is comparatively expensive, and so is moving
+// the resulting strings to a logging backend (for example, to Kotlin
+// through the JNI). In binary mode, the LOG macro skips both. Instead,
+// each LOG call site owns a static binary_log_site descriptor, which
+// gets an ID the first time the site logs something. The descriptor
+// (tag, level, format string, argument types) is written to the log
+// file only once. Each individual log entry then only consists of the
+// site ID, a timestamp, and the raw argument bytes.
+//
+// Entries are written to a per-thread ring buffer without locking any
+// mutex. A background sink thread periodically drains these buffers
+// into the log file. If a ring buffer is full, the entry is dropped
+// (and counted), so logging threads never block on file IO.
+//
+// The log file is rendered to text by tools/decode-binary-log.py.
+// That tool uses Python's str.format(), which understands the subset
+// of the fmt format syntax used in the LOG calls of this code base.
+//
+// File format (all values in host byte order; the decoder expects
+// little endian, which is what all supported platforms use):
+//
+//   Header: 8 byte magic "CCBINLOG", uint32 format version
+//   Records, each starting with a uint8 record type:
+//     1 = site:    uint32 site ID, uint8 log level, uint16 tag length + tag,
+//                  uint16 format length + format, uint8 number of arguments +
+//                  argument type codes (see binary_log_arg)
+//     2 = thread:  uint32 thread ID, uint8 name length + name
+//     3 = entries: uint32 thread ID, uint32 number of bytes + entries
+//     4 = dropped: uint32 thread ID, uint64 number of dropped entries
+//   Entry: uint32 site ID, int64 timestamp (nanoseconds since the
+//          Unix epoch), followed by the encoded arguments.
+
+
+namespace comboctl
+{
+
+
+/**
+ * Configuration for the binary logger.
+ */
+struct binary_log_config
+{
+	/// Path of the log file. An existing file is overwritten.
+	std::string m_path;
+
+	/// Size of each thread's ring buffer, in bytes. Rounded up to a power of two.
+	std::size_t m_buffer_size_per_thread = 64 * 1024;
+
+	/// How often the sink thread drains the ring buffers into the log file.
+	std::chrono::milliseconds m_flush_interval{250};
+
+	/// Entries with this level or higher are additionally passed to the
+	/// regular logging function, so that for example errors still show
+	/// up in the application log. The minimum log level set with
+	/// set_min_log_level() applies to these as well.
+	log_level m_text_log_level = log_level::warn;
+};
+
+
+/**
+ * Statistics about the binary logger.
+ */
+struct binary_log_stats
+{
+	/// Number of entries written to the ring buffers.
+	std::uint64_t m_num_entries = 0;
+
+	/// Number of entries dropped because a ring buffer was full (or the entry was too large).
+	std::uint64_t m_num_dropped_entries = 0;
+
+	/// Number of LOG call sites that were registered so far.
+	std::uint64_t m_num_sites = 0;
+
+	/// Number of bytes written to the current log file.
+	std::uint64_t m_num_bytes_written = 0;
+};
+
+
+/**
+ * Per-call-site descriptor. The LOG macro defines one as a static
+ * local variable. Its ID is assigned when the site first logs
+ * something in binary mode.
+ */
+struct binary_log_site
+{
+	std::atomic<std::uint32_t> m_id{0};
+};
+
+
+namespace detail
+{
+
+
+// Set while the binary logger is running. This is a plain global
+// (and not a member of the binary_logger singleton), so that the
+// check in the LOG macro does not need to go through the singleton's
+// thread-safe static initialization.
+inline std::atomic<bool> binary_logging_active{false};
+
+
+} // namespace detail end
+
+
+/**
+ * Log entry that is being assembled by the logging thread.
+ *
+ * Entries have a fixed maximum size, so assembling them does not
+ * allocate. String arguments are cut off to fit. If a fixed size
+ * argument does not fit anymore, the entry is marked as truncated
+ * and is dropped instead of being committed.
+ */
+class binary_log_entry
+{
+public:
+	static constexpr std::size_t max_size = 2048;
+	static constexpr std::size_t max_string_length = 1024;
+
+	void clear()
+	{
+		m_size = 0;
+		m_truncated = false;
+	}
+
+	void append(void const *src, std::size_t num_bytes)
+	{
+		if (num_bytes > (max_size - m_size))
+		{
+			m_truncated = true;
+			return;
+		}
+
+		std::memcpy(&m_data[m_size], src, num_bytes);
+		m_size += num_bytes;
+	}
+
+	template<typename T>
+	void append_value(T value)
+	{
+		append(&value, sizeof(value));
+	}
+
+	void append_string(std::string_view str)
+	{
+		std::size_t remaining_size = max_size - m_size;
+		std::size_t max_length = (remaining_size > sizeof(std::uint16_t)) ? (remaining_size - sizeof(std::uint16_t)) : 0;
+		std::uint16_t length = std::uint16_t(std::min({ str.size(), max_string_length, max_length }));
+
+		append_value(length);
+		append(str.data(), length);
+	}
+
+	std::uint8_t const * data() const
+	{
+		return m_data;
+	}
+
+	std::size_t size() const
+	{
+		return m_size;
+	}
+
+	bool is_truncated() const
+	{
+		return m_truncated;
+	}
+
+
+private:
+	std::uint8_t m_data[max_size];
+	std::size_t m_size = 0;
+	bool m_truncated = false;
+};
+
+
+/**
+ * Encodes log arguments of type T.
+ *
+ * Each specialization has a type code, which is stored in the site
+ * descriptor, and an encode() function. Types that are not covered by
+ * the specializations below are formatted to a string right away.
+ * That is slower, but works for all types that fmt can format.
+ */
+template<typename T, typename Enable = void>
+struct binary_log_arg
+{
+	static constexpr char type_code = 's';
+
+	static void encode(binary_log_entry &entry, T const &value)
+	{
+		entry.append_string(fmt::format("{}", value));
+	}
+};
+
+template<>
+struct binary_log_arg<bool>
+{
+	static constexpr char type_code = 'b';
+
+	static void encode(binary_log_entry &entry, bool value)
+	{
+		entry.append_value(std::uint8_t(value ? 1 : 0));
+	}
+};
+
+template<>
+struct binary_log_arg<char>
+{
+	static constexpr char type_code = 'c';
+
+	static void encode(binary_log_entry &entry, char value)
+	{
+		entry.append_value(value);
+	}
+};
+
+template<typename T>
+struct binary_log_arg<T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T> && !std::is_same_v<T, char>>>
+{
+	static constexpr char type_code = 'i';
+
+	static void encode(binary_log_entry &entry, T value)
+	{
+		entry.append_value(std::int64_t(value));
+	}
+};
+
+template<typename T>
+struct binary_log_arg<T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>>>
+{
+	static constexpr char type_code = 'u';
+
+	static void encode(binary_log_entry &entry, T value)
+	{
+		entry.append_value(std::uint64_t(value));
+	}
+};
+
+template<typename T>
+struct binary_log_arg<T, std::enable_if_t<std::is_floating_point_v<T>>>
+{
+	static constexpr char type_code = 'd';
+
+	static void encode(binary_log_entry &entry, T value)
+	{
+		entry.append_value(double(value));
+	}
+};
+
+template<typename T>
+struct binary_log_arg<T, std::enable_if_t<std::is_same_v<T, char const *> || std::is_same_v<T, char *>>>
+{
+	static constexpr char type_code = 's';
+
+	static void encode(binary_log_entry &entry, char const *value)
+	{
+		entry.append_string((value != nullptr) ? std::string_view(value) : std::string_view("(null)"));
+	}
+};
+
+template<typename T>
+struct binary_log_arg<T, std::enable_if_t<std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>>>
+{
+	static constexpr char type_code = 's';
+
+	static void encode(binary_log_entry &entry, std::string_view value)
+	{
+		entry.append_string(value);
+	}
+};
+
+
+/**
+ * Null-terminated string with the type codes of the given argument types.
+ */
+template<typename... Args>
+struct binary_log_arg_types
+{
+	static constexpr char value[] = { binary_log_arg<Args>::type_code..., '\0' };
+};
+
+
+/**
+ * Process-wide binary logger.
+ *
+ * Use start() to begin writing a binary log file. From then on, the
+ * LOG macro writes to that file instead of formatting the log lines.
+ * Entries with a level of at least binary_log_config::m_text_log_level
+ * are additionally formatted and passed to the logging function.
+ */
+class binary_logger
+{
+public:
+	/**
+	 * Returns the process-wide binary logger instance.
+	 */
+	static binary_logger& instance();
+
+	/**
+	 * Returns true if the binary logger is running.
+	 */
+	static bool is_active()
+	{
+		return detail::binary_logging_active.load(std::memory_order_relaxed);
+	}
+
+	~binary_logger();
+
+	/**
+	 * Opens the log file and starts the sink thread.
+	 *
+	 * If the binary logger is already running, it is stopped first.
+	 *
+	 * @param config Configuration to use. The path must not be empty.
+	 * @throws io_exception if the log file cannot be opened.
+	 */
+	void start(binary_log_config const &config);
+
+	/**
+	 * Stops the sink thread after it wrote all pending entries, and
+	 * closes the log file. Does nothing if the logger is not running.
+	 *
+	 * Entries that other threads are writing while this is called
+	 * may end up in the next log file instead of the current one.
+	 */
+	void stop();
+
+	/**
+	 * Returns statistics about the binary logger.
+	 */
+	binary_log_stats get_stats() const;
+
+	/**
+	 * Writes a log entry. This is called by the LOG macro.
+	 *
+	 * @return true if the entry should also be logged as text.
+	 */
+	template<typename... Args>
+	bool write(binary_log_site &site, char const *tag, log_level level, char const *format, Args const &... args)
+	{
+		std::uint32_t site_id = site.m_id.load(std::memory_order_acquire);
+		if (site_id == 0)
+			site_id = register_site(site, tag, level, format, binary_log_arg_types<std::decay_t<Args>...>::value);
+
+		binary_log_entry *entry = begin_entry(site_id);
+		if (entry != nullptr)
+		{
+			(binary_log_arg<std::decay_t<Args>>::encode(*entry, args), ...);
+			commit_entry();
+		}
+
+		return level >= m_text_log_level.load(std::memory_order_relaxed);
+	}
+
+	binary_logger(binary_logger const &) = delete;
+	binary_logger& operator = (binary_logger const &) = delete;
+
+
+private:
+	struct impl;
+
+	binary_logger();
+
+	std::uint32_t register_site(binary_log_site &site, char const *tag, log_level level, char const *format, char const *arg_types);
+	binary_log_entry* begin_entry(std::uint32_t site_id);
+	void commit_entry();
+
+	std::atomic<log_level> m_text_log_level;
+	std::unique_ptr<impl> m_impl;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_BINARY_LOG_HPP
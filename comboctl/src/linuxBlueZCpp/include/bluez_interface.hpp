@@ -4,7 +4,17 @@
 #include <memory>
 #include <array>
 #include <functional>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
 #include "types.hpp"
+#include "io_result.hpp"
+#include "device_table_stats.hpp"
+#include "mainloop_stats.hpp"
+#include "rfcomm_flow_control.hpp"
+#include "startup_timings.hpp"
+#include "teardown_timings.hpp"
 
 
 namespace comboctl
@@ -13,6 +23,7 @@ namespace comboctl
 
 class bluez_interface;
 class rfcomm_connection;
+class link_loss_monitor;
 struct bluez_interface_priv;
 
 
@@ -24,7 +35,13 @@ struct bluez_interface_priv;
  * It provides function to send and receive data through an RFCOMM channel.
  * The send() and receive() functions block. To cancel them, corresponding
  * cancel_send() and cancel_receive() functions are availabl. disconnect()
- * implicitely calls these two functions.
+ * implicitely calls these two functions. Canceled operations and other
+ * IO errors are reported through io_result instead of exceptions.
+ *
+ * If BlueZ reports that the device disconnected, ongoing and later send()
+ * and receive() calls are aborted with io_error::link_lost. This detects
+ * a lost link much sooner than the kernel timing out the socket. The next
+ * connect() call clears that state.
  *
  * Instantiating this class does not automatically connect it. connect()
  * has to be called for that purpose. This is done that way to be able to
@@ -49,6 +66,7 @@ public:
 	 * is established.
 	 *
 	 * @throws invalid_call_exception if the connection was already established.
+	 * @throws cancellation_exception if disconnect() aborted the connection attempt.
 	 * @throws io_exception in case of an IO error.
 	 */
 	void connect();
@@ -74,12 +92,15 @@ public:
 	 *        and the region this points to must contain the specified
 	 *        amount of bytes, otherwise crashes can occur.
 	 * @param num_bytes Number of bytes to send. Must not be zero.
-	 * @throws gerror_exception in case of a GLib/GIO error (including when the
-	 *         operation is canceled due to a disconnect() or cancel_send() call;
-	 *         check if the GError category is G_IO_ERROR and the error ID is
-	 *         G_IO_ERROR_CANCELLED).
+	 * @param bypass_coalescing If true, the bytes are not held back by write
+	 *        coalescing (see rfcomm_flow_control_config). Use this for
+	 *        latency critical packets.
+	 * @return Number of bytes sent (always num_bytes), or io_error::canceled
+	 *         if the operation was canceled due to a disconnect() or cancel_send()
+	 *         call, io_error::link_lost if the Bluetooth link to the device was
+	 *         lost, and io_error::failed in case of a socket error.
 	 */
-	void send(void const *src, int num_bytes);
+	io_result<int> send(void const *src, int num_bytes, bool bypass_coalescing = false);
 
 	/**
 	 * Receives a sequence of bytes over RFCOMM.
@@ -93,35 +114,73 @@ public:
 	 *        to contain at least num_bytes bytes, otherwise buffer overflow
 	 *        errors can occur.
 	 * @param num_bytes Maximum number of bytes to receive. Must not be zero.
-	 * @return Actual number of bytes received. This is always <= num_bytes.
-	 * @throws gerror_exception in case of a GLib/GIO error (including when the
-	 *         operation is canceled due to a disconnect() or cancel_send() call;
-	 *         check if the GError category is G_IO_ERROR and the error ID is
-	 *         G_IO_ERROR_CANCELLED).
+	 * @return Actual number of bytes received (always <= num_bytes), or
+	 *         io_error::canceled if the operation was canceled due to a
+	 *         disconnect() or cancel_receive() call, io_error::link_lost if
+	 *         the Bluetooth link to the device was lost, and io_error::failed
+	 *         in case of a socket error.
 	 */
-	int receive(void *dest, int num_bytes);
+	io_result<int> receive(void *dest, int num_bytes);
 
 	/**
 	 * Cancels any ongoing send operation.
 	 *
-	 * If no send operation is ongoing, this effectively does nothing.
+	 * If no send operation is ongoing, the next send() call is
+	 * canceled instead. connect() discards such a pending cancellation.
 	 */
 	void cancel_send();
 
 	/**
 	 * Cancels any ongoing receive operation.
 	 *
-	 * If no receive operation is ongoing, this effectively does nothing.
+	 * If no receive operation is ongoing, the next receive() call is
+	 * canceled instead. connect() discards such a pending cancellation.
 	 */
 	void cancel_receive();
 
+	/**
+	 * Sets the flow control configuration of the RFCOMM connection.
+	 *
+	 * Buffer sizes take effect at the next connect() call. See
+	 * rfcomm_flow_control_config for details. It is safe to call
+	 * this from another thread.
+	 */
+	void set_flow_control_config(rfcomm_flow_control_config const &config);
+
+	/**
+	 * Returns flow control statistics of the RFCOMM connection.
+	 *
+	 * It is safe to call this from another thread.
+	 */
+	rfcomm_flow_control_stats get_flow_control_stats() const;
+
+	/**
+	 * Waits until all bytes that were sent were also transmitted.
+	 *
+	 * send() returns as soon as the kernel accepted the bytes. This
+	 * can be used to find out when they actually left the socket.
+	 * This blocks until the send queue is empty, the deadline is
+	 * reached, cancel_send() was called, disconnect() was called,
+	 * or an error occurs.
+	 *
+	 * @param deadline Point in time when to stop waiting.
+	 * @return true if the send queue is empty, false if the deadline
+	 *         was reached before that, io_error::canceled if the wait
+	 *         was canceled due to a disconnect() or cancel_send() call,
+	 *         io_error::link_lost if the Bluetooth link to the device was
+	 *         lost, and io_error::failed if the send queue could not be
+	 *         queried.
+	 */
+	io_result<bool> wait_until_drained(std::chrono::steady_clock::time_point deadline);
+
 
 private:
-	explicit bluez_bluetooth_device(bluetooth_address const &bt_address, unsigned int rfcomm_channel);
+	explicit bluez_bluetooth_device(bluetooth_address const &bt_address, unsigned int rfcomm_channel, std::shared_ptr<link_loss_monitor> monitor);
 
 	bluetooth_address const m_bt_address;
 	unsigned int const m_rfcomm_channel;
 	std::unique_ptr<rfcomm_connection> m_connection;
+	std::shared_ptr<link_loss_monitor> m_link_loss_monitor;
 };
 
 typedef std::unique_ptr<bluez_bluetooth_device> bluez_bluetooth_device_uptr;
@@ -138,6 +197,21 @@ enum class discovery_stopped_reason
 };
 
 
+/**
+ * What discovery does once it found a new paired device.
+ */
+enum class discovery_mode
+{
+	/// Stop discovery and report the device. This is the classic one-pump pairing.
+	single_device = 0,
+	/// Report the device and keep discovery, the agent, and the SDP
+	/// service running, so that more devices can be paired in the
+	/// same session. Discovery then only stops because of the reasons
+	/// listed in discovery_stopped_reason.
+	continuous = 1
+};
+
+
 /**
  * Simple high level interface to BlueZ.
  *
@@ -150,12 +224,14 @@ public:
 	/**
 	 * Constructor.
 	 *
-	 * Establishes a D-Bus connection to BlueZ and starts
-	 * an internal thread to handle notifications and events.
-	 *
-     * @throws io_exception in case of an IO error.
-     * @throws gerror_exception in case of a GLib/GIO error,
-     *         particularly if BlueZ cannot be connected to.
+	 * Starts an internal thread to handle notifications and events.
+	 * That thread then establishes a D-Bus connection to BlueZ and
+	 * sets up the adapter in the background, so this constructor
+	 * returns right away. get_device() and connecting to already
+	 * paired devices do not need D-Bus and can be used immediately.
+	 * Functions that do need D-Bus wait until the background startup
+	 * finished. If that startup failed, they throw the exception that
+	 * caused the failure. See wait_for_startup().
 	 */
 	bluez_interface();
 
@@ -175,9 +251,45 @@ public:
 	 * Kotlin does not have deterministic destructors, and relying
 	 * on finalizers is generally not recommended, partially because
 	 * they aren't deterministic.
+	 *
+	 * Teardown is bounded by a deadline (see set_teardown_deadline()).
+	 * D-Bus calls that are in flight are cancelled first, and BlueZ
+	 * objects are unregistered without waiting for replies. If the
+	 * internal thread still does not finish in time (for example
+	 * because a run_in_thread() function is stuck), that thread is
+	 * detached, and the resources it uses are leaked. Use
+	 * get_teardown_timings() to see how long the phases took.
+	 *
+	 * Bluetooth devices returned by get_device() are not affected.
+	 * They have to be disconnected separately.
 	 */
 	void teardown();
 
+	/**
+	 * Sets the deadline for teardown().
+	 *
+	 * The default deadline is 2 seconds.
+	 *
+	 * @param deadline New deadline. Must be positive.
+	 */
+	void set_teardown_deadline(std::chrono::milliseconds deadline);
+
+	/**
+	 * Returns the name of the D-Bus backend this library was built with.
+	 *
+	 * This is "glib" for the default GDBus based backend, and "native"
+	 * if the library was built with COMBOCTL_NATIVE_DBUS_BACKEND.
+	 */
+	static char const * get_dbus_backend_name();
+
+	/**
+	 * Returns the durations of the phases of the last teardown() call.
+	 *
+	 * If teardown() was not called yet, all durations are std::nullopt.
+	 * This must not be called while teardown() is running.
+	 */
+	teardown_timings get_teardown_timings() const;
+
 	typedef std::function<void()> thread_func;
 
 	typedef std::function<void()> discovery_started_callback;
@@ -224,10 +336,21 @@ public:
 	 * device that was found and is paired already. Unpaired devices
 	 * are ignored until they get paired.
 	 *
-	 * Once a device is found, discovery stops. In that case however, the
-	 * on_discovery_stopped callback is _not_ called. The invocation of
-	 * on_found_new_device also implictly notifies the user that discovery
-	 * has been stopped (the reason being that a device was discovered).
+	 * In discovery_mode::single_device mode, discovery stops once a device
+	 * is found. In that case however, the on_discovery_stopped callback
+	 * is _not_ called. The invocation of on_found_new_device also implictly
+	 * notifies the user that discovery has been stopped (the reason being
+	 * that a device was discovered).
+	 *
+	 * In discovery_mode::continuous mode, discovery keeps running after
+	 * a device is found, and on_found_new_device is called for each newly
+	 * paired device. The agent and the SDP service stay registered, so
+	 * the setup and teardown costs are paid once per session instead of
+	 * once per device. Such a session ends with an on_discovery_stopped
+	 * call, typically with discovery_stopped_reason::discovery_timeout
+	 * or discovery_stopped_reason::manually_stopped.
+	 *
+	 * Devices that get paired after discovery stopped are not reported.
 	 *
 	 * @param service_name Name the SDP service record shall use.
 	 *        Must not be empty.
@@ -237,6 +360,10 @@ public:
 	 *        the SDP service record. Will be added to the record.
 	 *        Must not be empty.
 	 * @param pairing_pin_code PIN code to use for authenticating pairing requests.
+	 * @param discovery_duration How long discovery shall run, in seconds.
+	 *        Must be between 1 and 300. In continuous mode, this is the
+	 *        duration of the entire session.
+	 * @param mode Whether to stop after the first found device or not.
 	 * @param on_discovery_started Callback to be invoked as soon as the
 	 *        discovery started. Useful for setting up resources that are
 	 *        used during discovery.
@@ -247,8 +374,12 @@ public:
 	 *        paired device is found. The device's Bluetooth address
 	 *        is given to the callback. Only devices that pass the
 	 *        device filter will be passed to this callback.
-	 *        (See set_device_filter() for more.) Discovery is stopped once
-	 *        a device was found, and it is stopped _before_ this is called.
+	 *        (See set_device_filter() for more.) In single_device mode,
+	 *        discovery is stopped once a device was found, and it is stopped
+	 *        _before_ this is called. This is called in the internal thread,
+	 *        so in continuous mode, it must hand the device over to whatever
+	 *        pairs it instead of doing that work right away, otherwise the
+	 *        discovery of further devices is held up.
 	 *        This argument must be set to a valid function.
 	 * @throws invalid_call_exception If the discovery is already ongoing.
 	 * @throws io_exception in case of an IO error.
@@ -260,6 +391,7 @@ public:
 		std::string sdp_service_description,
 		std::string bt_pairing_pin_code,
 		int discovery_duration,
+		discovery_mode mode,
 		discovery_started_callback on_discovery_started,
 		discovery_stopped_callback on_discovery_stopped,
 		found_new_paired_device_callback on_found_new_device
@@ -303,6 +435,20 @@ public:
 	 */
 	void set_device_filter(filter_device_callback callback);
 
+	/**
+	 * Sets the address prefix of the devices that discovery looks for.
+	 *
+	 * This is passed to BlueZ as part of its discovery filter, so
+	 * BlueZ does not report devices with other addresses at all.
+	 * It complements the device filter instead of replacing it,
+	 * since older BlueZ versions ignore it. The new prefix is used
+	 * by the next start_discovery() call.
+	 *
+	 * @param prefix Leading bytes of the addresses to look for.
+	 *        At most 6 bytes long. An empty prefix disables this.
+	 */
+	void set_discovery_address_prefix(std::vector<std::uint8_t> const &prefix);
+
 	/**
 	 * Removes any existing pairing between BlueZ and the specified device.
 	 *
@@ -342,11 +488,132 @@ public:
 	 */
 	bluetooth_address_set get_paired_device_addresses() const;
 
+	/**
+	 * Sets the maximum number of devices the adapter keeps track of.
+	 *
+	 * The adapter records each device that passes the device filter.
+	 * Without a limit, that table would keep growing in environments
+	 * where many unpaired devices come and go. Once the limit is
+	 * reached, the least recently seen devices that are neither
+	 * paired nor connected are evicted. The default is 256.
+	 *
+	 * @param max_num_devices New maximum. Must be at least 1.
+	 */
+	void set_max_observed_devices(std::size_t max_num_devices);
+
+	/**
+	 * Returns statistics about the devices the adapter keeps
+	 * track of, including an estimate of their memory usage.
+	 */
+	device_table_stats get_device_table_stats() const;
+
+	/**
+	 * Waits until the background startup finished.
+	 *
+	 * Calling this is optional. It is useful for detecting
+	 * startup errors early.
+	 *
+	 * @throws io_exception in case of an IO error during startup,
+	 *         particularly if no Bluetooth adapter was found.
+	 * @throws gerror_exception in case of a GLib/GIO error during
+	 *         startup, particularly if BlueZ cannot be connected to.
+	 */
+	void wait_for_startup();
+
+	/**
+	 * Returns the durations of the startup phases.
+	 *
+	 * This does not wait for startup to finish; phases that
+	 * are not finished yet are std::nullopt in the result.
+	 * This can be called from any thread.
+	 */
+	startup_timings get_startup_timings() const;
+
+	/**
+	 * Returns statistics about the internal GLib mainloop thread.
+	 *
+	 * This includes histograms of how long posted tasks wait until
+	 * they are executed and of how long mainloop callbacks take.
+	 * See mainloop_stats for details.
+	 *
+	 * Unlike most other functions, this does not go through the
+	 * internal thread, so it can be used for diagnosing stalls.
+	 * It can be called from any thread.
+	 */
+	mainloop_stats get_mainloop_stats() const;
+
+	/**
+	 * Resets the mainloop statistics.
+	 *
+	 * The slow callback budget is not affected.
+	 * This can be called from any thread.
+	 */
+	void reset_mainloop_stats();
+
+	/**
+	 * Sets the budget for a single mainloop callback.
+	 *
+	 * Mainloop callbacks that take longer than this are logged
+	 * (along with the name of their source) and counted in the
+	 * mainloop statistics. The default budget is 100 ms.
+	 * This can be called from any thread.
+	 *
+	 * @param budget New budget. Must be positive.
+	 */
+	void set_slow_mainloop_callback_budget(std::chrono::microseconds budget);
+
+	/**
+	 * Enables or disables recording of timing spans.
+	 *
+	 * When enabled, the native code records spans for RFCOMM
+	 * sends and receives and for mainloop tasks. Additional
+	 * spans can be added with add_trace_span().
+	 *
+	 * The trace recorder is process-wide, so this affects all
+	 * bluez_interface instances. It is disabled by default.
+	 * This can be called from any thread.
+	 */
+	void set_tracing_enabled(bool enabled);
+
+	/**
+	 * Records a timing span, for example one measured by the Kotlin code.
+	 *
+	 * The span is stored in the calling thread's trace buffer.
+	 * Does nothing if tracing is disabled.
+	 * This can be called from any thread.
+	 *
+	 * @param category Category of the span. Truncated to 15 characters.
+	 * @param name Name of the span. Truncated to 47 characters.
+	 * @param start_timestamp_ns Timestamp of the span's beginning, in
+	 *        nanoseconds, based on the CLOCK_MONOTONIC clock.
+	 * @param duration_ns Duration of the span, in nanoseconds.
+	 */
+	void add_trace_span(std::string const &category, std::string const &name, std::int64_t start_timestamp_ns, std::int64_t duration_ns);
+
+	/**
+	 * Discards all timing spans recorded so far.
+	 *
+	 * This can be called from any thread.
+	 */
+	void clear_trace();
+
+	/**
+	 * Exports the recorded timing spans as Chrome trace event JSON.
+	 *
+	 * The output can be loaded by chrome://tracing and by
+	 * the Perfetto UI. This can be called from any thread,
+	 * even while spans are being recorded.
+	 */
+	std::string export_chrome_trace() const;
+
 
 private:
 	void setup();
 
 	std::unique_ptr<bluez_interface_priv> m_priv;
+
+	std::chrono::milliseconds m_teardown_deadline;
+	teardown_timings m_teardown_timings;
 };
 
 
@@ -0,0 +1,161 @@
+#ifndef COMBOCTL_BROKER_CLIENT_HPP
+#define COMBOCTL_BROKER_CLIENT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+#include "broker_protocol.hpp"
+#include "shm_spsc_ring.hpp"
+#include "types.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Client for the comboctl-broker daemon.
+ *
+ * This is an alternative to bluez_interface and bluez_bluetooth_device
+ * for processes that want to share a pump connection with other
+ * processes. The daemon owns the BlueZ connection and the RFCOMM
+ * connections; this class connects to the daemon and exchanges
+ * data with the pump through shared memory rings.
+ * See broker_protocol.hpp for details.
+ *
+ * Pairing is not done through the daemon. Pumps have to be paired
+ * already, for example by using bluez_interface::start_discovery().
+ *
+ * Like with bluez_bluetooth_device, send() and receive() block.
+ * Only one thread may call send() at a time, and only one thread
+ * may call receive() at a time. open_device() and close_device()
+ * must not be called while receive() is running.
+ */
+class broker_client
+{
+public:
+	broker_client();
+
+	/**
+	 * Destructor.
+	 *
+	 * Calls disconnect().
+	 */
+	~broker_client();
+
+	broker_client(broker_client const &) = delete;
+	broker_client& operator = (broker_client const &) = delete;
+
+	/**
+	 * Connects to the daemon and sets up the shared memory session.
+	 *
+	 * @param socket_path Path of the daemon's control socket.
+	 * @throws invalid_call_exception if the client is already connected.
+	 * @throws io_exception in case of an IO error, or if the daemon
+	 *         uses a different protocol version.
+	 */
+	void connect(std::string const &socket_path = get_default_broker_socket_path());
+
+	/**
+	 * Disconnects from the daemon.
+	 *
+	 * If a device is open, the daemon closes it implicitly. If the
+	 * client is not connected, this call does nothing.
+	 */
+	void disconnect();
+
+	/**
+	 * Opens a pump through the daemon.
+	 *
+	 * If no other client has this pump open, the daemon connects
+	 * to it. This blocks until the daemon has a connection.
+	 *
+	 * @param device_address Bluetooth address of the pump.
+	 * @throws invalid_call_exception if the client is not connected,
+	 *         or if a device is already open.
+	 * @throws io_exception in case of an IO error, or if the
+	 *         daemon could not connect to the pump.
+	 */
+	void open_device(bluetooth_address const &device_address);
+
+	/**
+	 * Closes the open device.
+	 *
+	 * The daemon disconnects from the pump once no
+	 * client has it open anymore. If no device is open,
+	 * this call does nothing.
+	 *
+	 * @throws io_exception in case of an IO error.
+	 */
+	void close_device();
+
+	/**
+	 * Sends a sequence of bytes to the open device.
+	 *
+	 * The bytes are pushed into the shared memory ring as one record.
+	 * If the ring is full, this waits for the daemon to catch up.
+	 *
+	 * @param src Source to get the bytes from. Must be a valid pointer.
+	 * @param num_bytes Number of bytes to send. Must be greater than
+	 *        zero and at most broker_max_payload_size.
+	 * @throws invalid_call_exception if no device is open.
+	 * @throws io_exception if the daemon does not catch up within a
+	 *         second, or if the device connection was lost.
+	 */
+	void send(void const *src, int num_bytes);
+
+	/**
+	 * Receives a sequence of bytes from the open device.
+	 *
+	 * This blocks until some bytes were received (up to num_bytes),
+	 * cancel_receive() was called, or an error occurs. If the daemon
+	 * delivered more bytes than num_bytes in one record, the rest is
+	 * returned by subsequent calls.
+	 *
+	 * @param dest Destination to put the received bytes into.
+	 * @param num_bytes Maximum number of bytes to receive. Must not be zero.
+	 * @return Actual number of bytes received. This is always <= num_bytes.
+	 * @throws invalid_call_exception if no device is open.
+	 * @throws io_exception in case of an IO error, if the device
+	 *         connection was lost, or if cancel_receive() was called.
+	 */
+	int receive(void *dest, int num_bytes);
+
+	/**
+	 * Cancels any ongoing receive operation.
+	 *
+	 * This can be called from any thread. If no receive operation
+	 * is ongoing, the next receive() call is canceled.
+	 */
+	void cancel_receive();
+
+
+private:
+	void wait_for_reply(broker_message_type reply_type, broker_message &reply);
+	void handle_unsolicited_message(broker_message const &message);
+
+	int m_control_fd;
+	int m_cancel_eventfd;
+	int m_to_client_eventfd;
+	int m_from_client_eventfd;
+	void *m_shm;
+	std::optional<shm_spsc_ring> m_to_client_ring;
+	std::optional<shm_spsc_ring> m_from_client_ring;
+
+	bool m_device_open;
+	bool m_device_lost;
+
+	// Holds the rest of a record that did not fit into
+	// the destination buffer of a receive() call.
+	std::vector<std::uint8_t> m_pending_data;
+	std::size_t m_pending_data_offset;
+	std::size_t m_pending_data_size;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_BROKER_CLIENT_HPP
@@ -0,0 +1,163 @@
+#ifndef COMBOCTL_BROKER_PROTOCOL_HPP
+#define COMBOCTL_BROKER_PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include "shm_spsc_ring.hpp"
+
+
+// Protocol between the comboctl-broker daemon and its clients.
+//
+// The daemon owns the BlueZ connection and all RFCOMM connections to
+// pumps. Clients talk to it over a Unix SOCK_SEQPACKET socket (the
+// "control socket"), exchanging fixed-size broker_message structures.
+// Packet payloads do not go through the control socket. Instead, each
+// client session has a shared memory region with two SPSC rings:
+//
+// - The "to client" ring, filled by the daemon with data received from
+//   the pump, and drained by the client.
+// - The "from client" ring, filled by the client with data to send to
+//   the pump, and drained by the daemon.
+//
+// Each ring has an eventfd that the producer writes to after pushing
+// records, so the consumer can wait for data with poll().
+//
+// Session setup:
+//
+// 1. Client connects and sends a hello message with its protocol version.
+// 2. Daemon replies with hello_reply. If the status is ok, the reply
+//    carries three file descriptors (via SCM_RIGHTS), in this order:
+//    the shared memory memfd, the "to client" eventfd, and the
+//    "from client" eventfd. The ring capacity is in the reply.
+// 3. Client sends open_device with the pump's Bluetooth address. The
+//    daemon connects to the pump unless another client already did.
+//    Multiple clients can open the same pump; they share the RFCOMM
+//    connection, and all of them get all data received from the pump.
+// 4. Client exchanges data through the rings.
+// 5. Client sends close_device or simply closes the control socket.
+//
+// If the pump connection is lost, the daemon sends an unsolicited
+// device_disconnected message to all clients that opened the device.
+//
+// The daemon forwards raw bytes. It does not know anything about the
+// Combo protocol. Since the Combo transport layer keeps state (nonces,
+// sequence bits), only one client at a time may send packets to a pump;
+// the other clients can only observe the traffic.
+
+
+namespace comboctl
+{
+
+
+constexpr std::uint32_t broker_protocol_version = 1;
+
+/// Capacity of each of the two rings in a client session.
+constexpr std::uint32_t broker_ring_capacity = 64 * 1024;
+
+/// Maximum size of a single record in the rings.
+constexpr std::uint32_t broker_max_payload_size = shm_spsc_ring::get_max_payload_size(broker_ring_capacity);
+
+/// Number of file descriptors passed along with a successful hello_reply.
+constexpr std::size_t broker_num_session_fds = 3;
+
+
+enum class broker_message_type : std::uint32_t
+{
+	hello = 1,
+	hello_reply,
+	open_device,
+	open_device_reply,
+	close_device,
+	close_device_reply,
+	device_disconnected
+};
+
+
+enum class broker_status : std::int32_t
+{
+	ok = 0,
+	protocol_version_mismatch,
+	invalid_request,
+	resource_error,
+	connect_failed
+};
+
+
+/**
+ * Message exchanged over the control socket.
+ *
+ * Only the fields relevant to the message type are used;
+ * the others are zero.
+ */
+struct broker_message
+{
+	broker_message_type m_type;
+	/// hello, hello_reply: protocol version of the sender.
+	std::uint32_t m_protocol_version;
+	/// Replies: outcome of the request.
+	broker_status m_status;
+	/// hello_reply: capacity of each ring.
+	std::uint32_t m_ring_capacity;
+	/// open_device, device_disconnected: address of the pump.
+	std::uint8_t m_device_address[6];
+	std::uint8_t m_reserved[2];
+};
+
+static_assert(std::is_trivially_copyable_v<broker_message>);
+
+
+/**
+ * Layout of the shared memory region of a client session.
+ *
+ * The rings start at page boundaries.
+ */
+constexpr std::size_t broker_shm_page_size = 4096;
+constexpr std::size_t broker_ring_region_size =
+	(shm_spsc_ring::get_required_memory_size(broker_ring_capacity) + broker_shm_page_size - 1) & ~(broker_shm_page_size - 1);
+constexpr std::size_t broker_to_client_ring_offset = 0;
+constexpr std::size_t broker_from_client_ring_offset = broker_ring_region_size;
+constexpr std::size_t broker_shm_size = broker_ring_region_size * 2;
+
+
+/**
+ * Returns the path of the daemon's control socket.
+ *
+ * This is $XDG_RUNTIME_DIR/comboctl-broker.sock if XDG_RUNTIME_DIR
+ * is set, and /tmp/comboctl-broker-<UID>.sock otherwise.
+ */
+std::string get_default_broker_socket_path();
+
+/**
+ * Sends a message over the control socket, optionally with file descriptors.
+ *
+ * @param socket_fd Control socket.
+ * @param message Message to send.
+ * @param fds File descriptors to pass along. Can be null if num_fds is 0.
+ * @param num_fds Number of file descriptors. At most broker_num_session_fds.
+ * @throws io_exception in case of an IO error.
+ */
+void send_broker_message(int socket_fd, broker_message const &message, int const *fds = nullptr, std::size_t num_fds = 0);
+
+/**
+ * Receives a message from the control socket, optionally with file descriptors.
+ *
+ * Received file descriptors beyond max_num_fds are closed. The caller
+ * owns the returned file descriptors.
+ *
+ * @param socket_fd Control socket.
+ * @param message Where to store the message.
+ * @param fds Where to store received file descriptors. Can be null if max_num_fds is 0.
+ * @param max_num_fds Capacity of fds. At most broker_num_session_fds.
+ * @param num_fds Where to store the number of received file descriptors. Can be null.
+ * @return false if the other side closed the connection, true otherwise.
+ * @throws io_exception in case of an IO error or a malformed message.
+ */
+bool receive_broker_message(int socket_fd, broker_message &message, int *fds = nullptr, std::size_t max_num_fds = 0, std::size_t *num_fds = nullptr);
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_BROKER_PROTOCOL_HPP
@@ -0,0 +1,46 @@
+#ifndef COMBOCTL_DBUS_ERROR_EXCEPTION_HPP
+#define COMBOCTL_DBUS_ERROR_EXCEPTION_HPP
+
+#include <string>
+#include "exception.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Exception containing a D-Bus error.
+ *
+ * This is the native D-Bus backend's counterpart to gerror_exception.
+ * It is thrown when a method call returns an error reply, and when
+ * a blocking call is cancelled or times out (see dbus_connection).
+ */
+class dbus_error_exception
+	: public exception
+{
+public:
+	/// Error name used for calls that were aborted by dbus_connection::cancel().
+	static constexpr char const *cancelled_error_name = "info.nightscout.comboctl.Error.Cancelled";
+
+	dbus_error_exception(std::string error_name, std::string error_message);
+
+	std::string const & get_error_name() const;
+	std::string const & get_error_message() const;
+
+	/**
+	 * Returns true if the call was aborted by dbus_connection::cancel().
+	 */
+	bool is_cancelled() const;
+
+
+private:
+	std::string m_error_name;
+	std::string m_error_message;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_DBUS_ERROR_EXCEPTION_HPP
@@ -0,0 +1,48 @@
+#ifndef COMBOCTL_DEVICE_TABLE_STATS_HPP
+#define COMBOCTL_DEVICE_TABLE_STATS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Statistics about the table of devices the adapter keeps track of.
+ *
+ * The adapter records every device that passes the device filter,
+ * along with its D-Bus object path and pairing status. The table
+ * is bounded (see bluez_interface::set_max_observed_devices()).
+ * Once it is full, the least recently seen devices that are
+ * neither paired nor connected are evicted. Paired devices are
+ * never evicted, so the table can exceed its capacity if there
+ * are more paired devices than that.
+ */
+struct device_table_stats
+{
+	/// Number of devices currently in the table.
+	std::size_t m_num_devices = 0;
+
+	/// Number of paired devices in the table.
+	std::size_t m_num_paired_devices = 0;
+
+	/// Number of connected devices in the table.
+	std::size_t m_num_connected_devices = 0;
+
+	/// Maximum number of devices in the table.
+	std::size_t m_max_num_devices = 0;
+
+	/// Number of devices that were evicted so far.
+	std::uint64_t m_num_evictions = 0;
+
+	/// Estimated number of bytes the table occupies on the heap.
+	std::size_t m_estimated_memory_usage = 0;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_DEVICE_TABLE_STATS_HPP
@@ -48,6 +48,36 @@ public:
 };
 
 
+/**
+ * Thrown when the Bluetooth link to a device was lost.
+ *
+ * This is thrown by send and receive operations that were aborted
+ * because BlueZ reported that the device is no longer connected.
+ * This happens much sooner than the kernel timing out the socket,
+ * so reconnect attempts can start right away.
+ */
+class link_lost_exception
+	: public io_exception
+{
+public:
+	explicit link_lost_exception(std::string description);
+};
+
+
+/**
+ * Thrown when a blocking operation was aborted.
+ *
+ * One example is a connect() call that gets aborted
+ * because disconnect() was called in another thread.
+ */
+class cancellation_exception
+	: public exception
+{
+public:
+	explicit cancellation_exception(std::string const &what);
+};
+
+
 } // namespace comboctl end
 
 
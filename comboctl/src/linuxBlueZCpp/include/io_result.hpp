@@ -0,0 +1,137 @@
+#ifndef COMBOCTL_IO_RESULT_HPP
+#define COMBOCTL_IO_RESULT_HPP
+
+#include <assert.h>
+#include <string>
+#include <utility>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Reasons why an IO operation did not succeed.
+ */
+enum class io_error
+{
+	/// No error; the operation succeeded.
+	none = 0,
+
+	/// The operation was canceled by a cancel or disconnect call.
+	canceled = 1,
+
+	/// The Bluetooth link to the device was lost.
+	link_lost = 2,
+
+	/// The operation failed. The result's error message contains details.
+	failed = 3
+};
+
+
+/**
+ * Returns a human readable description of the given error.
+ */
+char const * to_string(io_error error);
+
+
+/**
+ * Describes a failed IO operation. Converts implicitly to any io_result.
+ */
+struct io_failure
+{
+	io_error m_error;
+
+	/// Details about the error. Typically only set if m_error is io_error::failed.
+	std::string m_message;
+};
+
+
+/**
+ * Result of an IO operation that can either produce a value or fail.
+ *
+ * Cancellations and lost links are expected to happen routinely, for
+ * example during disconnects, so the send and receive functions report
+ * them through this type instead of throwing exceptions. Unwinding the
+ * stack is much more expensive than returning an error code, and the
+ * results of these functions end up as Java exceptions anyway, which
+ * can be raised directly from such an error code.
+ *
+ * Note that only canceled and link_lost results are free of allocations.
+ * Failed results may carry an error message.
+ *
+ * Usage example:
+ *
+ * @code
+ *   auto result = device.receive(buffer, sizeof(buffer));
+ *   if (!result)
+ *   {
+ *       if (result.error() == io_error::canceled)
+ *           return;
+ *       LOG(error, "Receive failed: {}", result.error_message());
+ *   }
+ *   process(buffer, result.value());
+ * @endcode
+ */
+template<typename T>
+class io_result
+{
+public:
+	/// Constructs a successful result with the given value.
+	io_result(T value)
+		: m_value(std::move(value))
+		, m_error(io_error::none)
+	{
+	}
+
+	/// Constructs a failed result.
+	io_result(io_failure failure)
+		: m_value()
+		, m_error(failure.m_error)
+		, m_error_message(std::move(failure.m_message))
+	{
+		assert(m_error != io_error::none);
+	}
+
+	/// Returns true if the operation succeeded.
+	explicit operator bool() const
+	{
+		return m_error == io_error::none;
+	}
+
+	/// Returns the value. Must only be called if the operation succeeded.
+	T const & value() const
+	{
+		assert(m_error == io_error::none);
+		return m_value;
+	}
+
+	/// Returns the error, or io_error::none if the operation succeeded.
+	io_error error() const
+	{
+		return m_error;
+	}
+
+	/**
+	 * Returns a description of the error.
+	 *
+	 * This is the error message if one was set, and the
+	 * error's description (see to_string()) otherwise.
+	 */
+	std::string error_message() const
+	{
+		return m_error_message.empty() ? std::string(to_string(m_error)) : m_error_message;
+	}
+
+
+private:
+	T m_value;
+	io_error m_error;
+	std::string m_error_message;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_IO_RESULT_HPP
@@ -1,18 +1,34 @@
 #ifndef COMBOCTL_LOG_HPP
 #define COMBOCTL_LOG_HPP
 
+#include <atomic>
 #include <string>
 #include <functional>
 #include "fmt/format.h"
 
 
 #define DEFINE_LOGGING_TAG(TAG) \
-	static std::string const LOGGING_TAG = TAG;
-
+	static std::string const LOGGING_TAG = TAG; \
+	static constexpr char const LOGGING_TAG_LITERAL[] = TAG;
+
+// Entries below the minimum log level (see set_min_log_level()) are
+// not formatted at all. If the binary logger is active (see
+// binary_log.hpp), the entry is written to the binary log instead,
+// and formatted only if its level is high enough to also be logged
+// as text.
 #define LOG(LEVEL, ...) \
 	do { \
-		std::string str = fmt::format(__VA_ARGS__); \
-		::comboctl::do_log(LOGGING_TAG, ::comboctl::log_level::LEVEL, std::move(str)); \
+		bool comboctl_log_as_text = ::comboctl::is_log_level_enabled(::comboctl::log_level::LEVEL); \
+		if (::comboctl::binary_logger::is_active()) \
+		{ \
+			static ::comboctl::binary_log_site comboctl_log_site; \
+			comboctl_log_as_text = ::comboctl::binary_logger::instance().write(comboctl_log_site, LOGGING_TAG_LITERAL, ::comboctl::log_level::LEVEL, __VA_ARGS__) && comboctl_log_as_text; \
+		} \
+		if (comboctl_log_as_text) \
+		{ \
+			std::string str = fmt::format(__VA_ARGS__); \
+			::comboctl::do_log(LOGGING_TAG, ::comboctl::log_level::LEVEL, std::move(str)); \
+		} \
 	} while (false)
 
 
@@ -42,7 +58,41 @@ void set_logging_function(logging_function new_logging_function);
 void do_log(std::string const &tag, log_level level, std::string log_string);
 
 
+namespace detail
+{
+
+
+inline std::atomic<log_level> min_log_level{log_level::trace};
+
+
+} // namespace detail end
+
+
+/**
+ * Sets the minimum level of log lines that are passed to the logging function.
+ *
+ * Lines below this level are discarded before they are formatted. This
+ * is much cheaper than discarding them in the logging function, and it
+ * keeps the LOG calls in hot paths like the RFCOMM send and receive
+ * functions from allocating memory. The default is log_level::trace.
+ * It is safe to call this from any thread.
+ */
+void set_min_log_level(log_level level);
+
+/**
+ * Returns true if log lines of the given level are passed to the logging function.
+ */
+inline bool is_log_level_enabled(log_level level)
+{
+	return level >= detail::min_log_level.load(std::memory_order_relaxed);
+}
+
+
 } // namespace comboctl end
 
 
+// Included here, since the LOG macro uses it, and it needs log_level.
+#include "binary_log.hpp"
+
+
 #endif // COMBOCTL_LOG_HPP
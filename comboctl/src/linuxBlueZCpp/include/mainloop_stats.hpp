@@ -0,0 +1,100 @@
+#ifndef COMBOCTL_MAINLOOP_STATS_HPP
+#define COMBOCTL_MAINLOOP_STATS_HPP
+
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <string>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Histogram of durations with fixed, roughly logarithmically spaced buckets.
+ *
+ * Bucket #i counts the samples that are shorter than bucket_upper_bounds[i]
+ * (and not shorter than bucket_upper_bounds[i-1]). The last bucket counts
+ * all samples that are at least as long as the last upper bound.
+ */
+struct duration_histogram
+{
+	static constexpr std::size_t num_buckets = 10;
+
+	static constexpr std::array<std::chrono::microseconds, num_buckets - 1> bucket_upper_bounds = {{
+		std::chrono::microseconds(100),
+		std::chrono::microseconds(500),
+		std::chrono::microseconds(1000),
+		std::chrono::microseconds(5000),
+		std::chrono::microseconds(10000),
+		std::chrono::microseconds(50000),
+		std::chrono::microseconds(100000),
+		std::chrono::microseconds(500000),
+		std::chrono::microseconds(1000000)
+	}};
+
+	std::array<std::uint64_t, num_buckets> m_bucket_counts = {};
+	std::uint64_t m_num_samples = 0;
+	std::chrono::microseconds m_total_duration{0};
+	std::chrono::microseconds m_max_duration{0};
+
+	/**
+	 * Adds a sample to the histogram.
+	 *
+	 * @param duration Duration to add. Negative durations are clamped to 0.
+	 */
+	void add_sample(std::chrono::microseconds duration);
+
+	/**
+	 * Resets all counters to zero.
+	 */
+	void reset();
+};
+
+
+/**
+ * Statistics about the internal mainloop thread of bluez_interface.
+ *
+ * All D-Bus signals, agent calls, run_in_thread() tasks and discovery
+ * timeouts are serialized onto that one thread. These statistics help
+ * with finding out if that thread is saturated or stalled.
+ */
+struct mainloop_stats
+{
+	/**
+	 * Time between a task being posted to the mainloop via run_in_thread()
+	 * (or one of the bluez_interface functions that use it internally)
+	 * and the mainloop starting to execute that task.
+	 */
+	duration_histogram m_queue_latency;
+
+	/**
+	 * How long mainloop callbacks took to run. This includes posted tasks,
+	 * timeouts, D-Bus signal handlers, and D-Bus method calls to the agent.
+	 */
+	duration_histogram m_dispatch_duration;
+
+	/**
+	 * Number of callbacks whose duration exceeded m_slow_callback_budget.
+	 */
+	std::uint64_t m_num_slow_callbacks = 0;
+
+	/**
+	 * Duration and name of the slowest callback observed so far.
+	 * The name is empty if no callback was observed yet.
+	 */
+	std::chrono::microseconds m_slowest_callback_duration{0};
+	std::string m_slowest_callback_source;
+
+	/**
+	 * The currently configured budget for a single callback.
+	 */
+	std::chrono::microseconds m_slow_callback_budget{0};
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MAINLOOP_STATS_HPP
@@ -0,0 +1,121 @@
+#ifndef COMBOCTL_RFCOMM_FLOW_CONTROL_HPP
+#define COMBOCTL_RFCOMM_FLOW_CONTROL_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Configuration for the flow control of an RFCOMM connection.
+ *
+ * send() returns as soon as the kernel accepted the bytes. If the
+ * RFCOMM link is congested, these bytes pile up in the socket's send
+ * queue. Sender-side pacing bounds that queue: if enabled, send()
+ * first waits until the amount of outstanding bytes drops to the
+ * pacing threshold (or until the maximum pacing wait elapses).
+ *
+ * Outstanding bytes are measured the way the kernel accounts for
+ * socket memory, which includes the per-buffer overhead. A single
+ * small packet therefore accounts for several hundred bytes.
+ * Measuring them costs a syscall, so send() only does that if pacing
+ * or send queue tracking is enabled.
+ *
+ * Each send() call normally results in its own write to the socket.
+ * With write coalescing, send() calls from several threads that happen
+ * within a short window are gathered into one write, so the RFCOMM
+ * layer can transmit them in fewer baseband packets. This adds up to
+ * one window of latency to each send() call (unless it bypasses the
+ * coalescing). It is only useful if several threads send at the same
+ * time, which is why it is disabled by default.
+ *
+ * The buffer sizes are applied when the connection is established.
+ * The other settings take effect immediately.
+ */
+struct rfcomm_flow_control_config
+{
+	/// Socket send buffer size (SO_SNDBUF), or 0 to use the kernel default.
+	int m_send_buffer_size = 0;
+
+	/// Socket receive buffer size (SO_RCVBUF), or 0 to use the kernel default.
+	int m_receive_buffer_size = 0;
+
+	/// Outstanding bytes above which send() waits before sending, or 0 to disable pacing.
+	int m_pacing_threshold = 0;
+
+	/// Maximum time send() waits due to pacing. After that, the bytes are sent anyway.
+	std::chrono::milliseconds m_max_pacing_wait{500};
+
+	/// Whether send() records the outstanding bytes in the statistics after sending.
+	bool m_track_send_queue = false;
+
+	/// How long send() waits for other send() calls to join its write, or zero to disable write coalescing.
+	std::chrono::microseconds m_coalescing_window{0};
+
+	/// Number of gathered bytes at which a coalesced write is done without waiting for the rest of the window.
+	std::size_t m_max_coalesced_write_size = 1024;
+};
+
+
+/**
+ * Statistics about the flow control of an RFCOMM connection.
+ *
+ * The buffer sizes are the ones the kernel actually uses, which
+ * can differ from the configured ones (Linux doubles the values
+ * to account for its bookkeeping overhead, and clamps them).
+ */
+struct rfcomm_flow_control_stats
+{
+	/// Actual socket send buffer size, or 0 if not connected.
+	int m_send_buffer_size = 0;
+
+	/// Actual socket receive buffer size, or 0 if not connected.
+	int m_receive_buffer_size = 0;
+
+	/// Outstanding bytes observed by the most recent send() call that measured them.
+	/// Only updated if pacing or send queue tracking is enabled.
+	int m_outstanding_send_bytes = 0;
+
+	/// Highest number of outstanding bytes observed so far.
+	int m_max_outstanding_send_bytes = 0;
+
+	/// Number of send() calls that had to wait due to pacing.
+	std::uint64_t m_num_paced_sends = 0;
+
+	/// Number of send() calls whose pacing wait hit the maximum.
+	std::uint64_t m_num_pacing_timeouts = 0;
+
+	/// Total time send() calls spent waiting due to pacing.
+	std::chrono::microseconds m_total_pacing_wait{0};
+
+	/// Longest time a send() call spent waiting due to pacing.
+	std::chrono::microseconds m_max_pacing_wait{0};
+
+	/// Number of packets (that is, send() calls) whose bytes were written.
+	std::uint64_t m_num_packets_sent = 0;
+
+	/// Number of bytes written.
+	std::uint64_t m_num_bytes_sent = 0;
+
+	/// Number of writes. A coalesced write counts once.
+	std::uint64_t m_num_writes = 0;
+
+	/// Number of write syscalls. This exceeds m_num_writes if the kernel accepted only part of a write.
+	std::uint64_t m_num_write_syscalls = 0;
+
+	/// Number of writes that contained more than one packet.
+	std::uint64_t m_num_coalesced_writes = 0;
+
+	/// Highest number of packets that were contained in one write.
+	std::uint64_t m_max_packets_per_write = 0;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_RFCOMM_FLOW_CONTROL_HPP
@@ -0,0 +1,118 @@
+#ifndef COMBOCTL_RFCOMM_LOOPBACK_CHECK_HPP
+#define COMBOCTL_RFCOMM_LOOPBACK_CHECK_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "rfcomm_flow_control.hpp"
+
+
+namespace comboctl
+{
+
+
+struct rfcomm_loopback_check_options
+{
+	/// Number of packets to exchange before measuring, so that any
+	/// states that are set up lazily are in place when measuring.
+	std::size_t m_num_warmup_packets = 100;
+
+	/// Number of packets to exchange while measuring.
+	std::size_t m_num_packets = 10000;
+
+	/// Size of each packet, in bytes.
+	int m_packet_size = 64;
+
+	/// Flow control configuration of the connection.
+	rfcomm_flow_control_config m_flow_control_config;
+};
+
+
+struct rfcomm_loopback_check_result
+{
+	/// Number of packets exchanged while measuring.
+	std::size_t m_num_packets = 0;
+
+	/// Number of allocations performed by the send() calls while measuring.
+	std::uint64_t m_num_send_allocations = 0;
+
+	/// Number of allocations performed by the receive() calls while measuring.
+	std::uint64_t m_num_receive_allocations = 0;
+
+	/// How long the measured exchanges took in total.
+	std::chrono::microseconds m_duration{0};
+};
+
+
+/**
+ * Exchanges packets through the RFCOMM connection code over a local
+ * socket pair, and counts the allocations of the send and receive calls.
+ *
+ * The connection code is set up the same way as for an actual RFCOMM
+ * connection. An echo thread on the other end of the socket pair sends
+ * every packet back, and each echoed packet is compared to the original.
+ *
+ * The allocations are counted with the allocation tracking counters, so
+ * they are always zero unless allocation tracking is compiled in (see
+ * allocation_tracking.hpp). After the warmup packets, the recorded
+ * allocation sites are discarded (see reset_allocation_site_report()),
+ * so that afterwards, the report only lists the steady state ones.
+ *
+ * @throws io_exception if the socket pair cannot be created, a send
+ *         or receive call fails, or an echoed packet differs.
+ */
+rfcomm_loopback_check_result run_rfcomm_loopback_check(rfcomm_loopback_check_options const &options);
+
+
+struct rfcomm_cancel_latency_options
+{
+	/// Number of send() and receive() calls to cancel, each.
+	std::size_t m_num_iterations = 200;
+
+	/// How long each call blocks before it is canceled.
+	std::chrono::microseconds m_block_duration{2000};
+};
+
+
+struct rfcomm_cancel_latency_stats
+{
+	std::chrono::microseconds m_min{0};
+	std::chrono::microseconds m_median{0};
+	std::chrono::microseconds m_mean{0};
+	std::chrono::microseconds m_max{0};
+};
+
+
+struct rfcomm_cancel_latency_result
+{
+	/// Time from cancel_receive() until the blocked receive() call returned.
+	rfcomm_cancel_latency_stats m_receive;
+
+	/// Time from cancel_send() until the blocked send() call returned.
+	rfcomm_cancel_latency_stats m_send;
+};
+
+
+/**
+ * Measures how quickly blocked send() and receive() calls of the RFCOMM
+ * connection code return after they were canceled.
+ *
+ * Like run_rfcomm_loopback_check(), this uses a local socket pair. The
+ * other end of the pair never reads nor writes, so receive() blocks
+ * right away, and send() blocks once the socket buffers are full. Each
+ * call runs in its own thread, and is canceled from the calling thread
+ * once it had the time to block. The latency includes the wakeup of
+ * the canceled call and its io_result reporting. Afterwards, this checks
+ * that disconnect() aborts a blocked send() and receive() call with
+ * io_error::canceled as well.
+ *
+ * @throws io_exception if the socket pair cannot be created, or if
+ *         a call returns with anything other than io_error::canceled.
+ */
+rfcomm_cancel_latency_result run_rfcomm_cancel_latency_check(rfcomm_cancel_latency_options const &options);
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_RFCOMM_LOOPBACK_CHECK_HPP
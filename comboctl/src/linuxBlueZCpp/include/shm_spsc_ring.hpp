@@ -0,0 +1,281 @@
+#ifndef COMBOCTL_SHM_SPSC_RING_HPP
+#define COMBOCTL_SHM_SPSC_RING_HPP
+
+#include <assert.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include "exception.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Control block of a shared memory SPSC ring buffer.
+ *
+ * This is placed at the beginning of the ring's memory region, and is
+ * directly followed by the data area. The write and read positions are
+ * in separate cache lines to avoid false sharing between the producer
+ * and the consumer. Positions are monotonically increasing byte counts;
+ * the offset into the data area is the position modulo the capacity.
+ */
+struct shm_spsc_ring_header
+{
+	alignas(64) std::atomic<std::uint64_t> m_write_position;
+	alignas(64) std::atomic<std::uint64_t> m_read_position;
+	alignas(64) std::uint32_t m_capacity;
+};
+
+// The atomics are accessed by two processes, each with its own mapping
+// of the shared memory. This only works if they are lock free, since
+// lock based atomics use process-local locks.
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "64-bit atomics must be lock free for shared memory rings");
+
+
+/**
+ * Single-producer single-consumer ring buffer for variable-sized records in shared memory.
+ *
+ * One process pushes records, another one pops them. Neither side blocks
+ * or locks anything; users need a separate notification mechanism (like
+ * an eventfd) to wake up the consumer.
+ *
+ * Each record consists of an 8-byte header (containing the payload size)
+ * and the payload, padded to a multiple of 8 bytes. Records never wrap
+ * around the end of the data area. If a record does not fit in the space
+ * that remains before the end, a wrap marker is written there, and the
+ * record is placed at the beginning of the data area instead.
+ *
+ * Since the other side of the ring may be a different, possibly buggy
+ * process, the consumer validates the positions and record headers, and
+ * throws an io_exception if they are inconsistent.
+ *
+ * This class only holds pointers into the shared memory. It does not own
+ * that memory, and can be copied freely.
+ */
+class shm_spsc_ring
+{
+public:
+	static constexpr std::uint32_t record_header_size = 8;
+	static constexpr std::uint32_t record_alignment = 8;
+
+	/**
+	 * Returns the number of bytes a ring with the given capacity occupies.
+	 */
+	static constexpr std::size_t get_required_memory_size(std::uint32_t capacity)
+	{
+		return sizeof(shm_spsc_ring_header) + capacity;
+	}
+
+	/**
+	 * Returns the maximum payload size of a single record.
+	 *
+	 * Limiting the size to half the capacity guarantees that a record
+	 * always fits once the consumer caught up, even if a wrap marker
+	 * has to be written first.
+	 */
+	static constexpr std::uint32_t get_max_payload_size(std::uint32_t capacity)
+	{
+		return capacity / 2 - record_header_size;
+	}
+
+	/**
+	 * Sets up a new, empty ring in the given memory region.
+	 *
+	 * Only one of the two processes calls this, before handing
+	 * the memory to the other process.
+	 *
+	 * @param memory Start of the memory region. Must be aligned to 64 bytes
+	 *        and at least get_required_memory_size(capacity) bytes large.
+	 * @param capacity Size of the data area. Must be a power of two and >= 64.
+	 */
+	static shm_spsc_ring initialize(void *memory, std::uint32_t capacity)
+	{
+		assert(memory != nullptr);
+		assert(is_valid_capacity(capacity));
+
+		auto header = new (memory) shm_spsc_ring_header;
+		header->m_write_position.store(0, std::memory_order_relaxed);
+		header->m_read_position.store(0, std::memory_order_relaxed);
+		header->m_capacity = capacity;
+
+		return shm_spsc_ring(header);
+	}
+
+	/**
+	 * Attaches to a ring that was set up by initialize().
+	 *
+	 * @param memory Start of the memory region.
+	 * @param memory_size Size of the memory region.
+	 * @throws io_exception if the ring's capacity is invalid or
+	 *         does not fit into the memory region.
+	 */
+	static shm_spsc_ring attach(void *memory, std::size_t memory_size)
+	{
+		assert(memory != nullptr);
+
+		if (memory_size < sizeof(shm_spsc_ring_header))
+			throw io_exception("Shared memory region too small for ring header");
+
+		auto header = reinterpret_cast<shm_spsc_ring_header *>(memory);
+		std::uint32_t capacity = header->m_capacity;
+		if (!is_valid_capacity(capacity) || (get_required_memory_size(capacity) > memory_size))
+			throw io_exception("Shared memory ring has invalid capacity");
+
+		return shm_spsc_ring(header);
+	}
+
+	std::uint32_t get_capacity() const
+	{
+		return m_capacity;
+	}
+
+	std::uint32_t get_max_payload_size() const
+	{
+		return get_max_payload_size(m_capacity);
+	}
+
+	/**
+	 * Pushes a record. Must only be called by the producer.
+	 *
+	 * @param data Payload to push. Must not be null.
+	 * @param size Payload size. Must be at most get_max_payload_size().
+	 * @return true if the record was pushed, false if there was not enough space.
+	 */
+	bool try_push(void const *data, std::uint32_t size)
+	{
+		assert(data != nullptr);
+		assert(size <= get_max_payload_size());
+
+		std::uint32_t record_size = get_record_size(size);
+
+		// We are the only writer of the write position.
+		std::uint64_t write_position = m_header->m_write_position.load(std::memory_order_relaxed);
+		std::uint64_t read_position = m_header->m_read_position.load(std::memory_order_acquire);
+
+		std::uint32_t offset = std::uint32_t(write_position & (m_capacity - 1));
+		std::uint32_t contiguous_space = m_capacity - offset;
+		std::uint32_t padding = (contiguous_space < record_size) ? contiguous_space : 0;
+
+		std::uint64_t used_space = write_position - read_position;
+		if ((used_space + padding + record_size) > m_capacity)
+			return false;
+
+		if (padding > 0)
+		{
+			write_record_header(offset, wrap_marker);
+			write_position += padding;
+			offset = 0;
+		}
+
+		write_record_header(offset, size);
+		std::memcpy(m_data + offset + record_header_size, data, size);
+
+		m_header->m_write_position.store(write_position + record_size, std::memory_order_release);
+
+		return true;
+	}
+
+	/**
+	 * Pops a record. Must only be called by the consumer.
+	 *
+	 * @param dest Where to copy the payload to. Must not be null.
+	 * @param max_size Capacity of dest. Should be get_max_payload_size().
+	 * @return Payload size, or -1 if the ring is empty.
+	 * @throws io_exception if the ring contents are inconsistent,
+	 *         or if the record is larger than max_size.
+	 */
+	int try_pop(void *dest, std::uint32_t max_size)
+	{
+		assert(dest != nullptr);
+
+		// We are the only writer of the read position.
+		std::uint64_t read_position = m_header->m_read_position.load(std::memory_order_relaxed);
+		std::uint64_t write_position = m_header->m_write_position.load(std::memory_order_acquire);
+
+		while (true)
+		{
+			if (read_position == write_position)
+				return -1;
+
+			if ((write_position < read_position) || ((write_position - read_position) > m_capacity))
+				throw io_exception("Shared memory ring has inconsistent positions");
+
+			std::uint32_t offset = std::uint32_t(read_position & (m_capacity - 1));
+			std::uint32_t size = read_record_header(offset);
+
+			if (size == wrap_marker)
+			{
+				read_position += m_capacity - offset;
+				continue;
+			}
+
+			if (size > get_max_payload_size())
+				throw io_exception("Shared memory ring contains an invalid record");
+
+			std::uint32_t record_size = get_record_size(size);
+			if ((record_size > (m_capacity - offset)) || (record_size > (write_position - read_position)))
+				throw io_exception("Shared memory ring contains a truncated record");
+
+			if (size > max_size)
+				throw io_exception("Shared memory ring record does not fit into destination buffer");
+
+			std::memcpy(dest, m_data + offset + record_header_size, size);
+
+			m_header->m_read_position.store(read_position + record_size, std::memory_order_release);
+
+			return int(size);
+		}
+	}
+
+
+private:
+	static constexpr std::uint32_t wrap_marker = 0xFFFFFFFFu;
+
+	explicit shm_spsc_ring(shm_spsc_ring_header *header)
+		: m_header(header)
+		, m_data(reinterpret_cast<std::uint8_t *>(header) + sizeof(shm_spsc_ring_header))
+		, m_capacity(header->m_capacity)
+	{
+	}
+
+	static constexpr bool is_valid_capacity(std::uint32_t capacity)
+	{
+		return (capacity >= 64) && ((capacity & (capacity - 1)) == 0);
+	}
+
+	static constexpr std::uint32_t get_record_size(std::uint32_t payload_size)
+	{
+		return (record_header_size + payload_size + record_alignment - 1) & ~(record_alignment - 1);
+	}
+
+	void write_record_header(std::uint32_t offset, std::uint32_t size)
+	{
+		std::uint8_t record_header[record_header_size] = { 0 };
+		std::memcpy(record_header, &size, sizeof(size));
+		std::memcpy(m_data + offset, record_header, record_header_size);
+	}
+
+	std::uint32_t read_record_header(std::uint32_t offset) const
+	{
+		std::uint32_t size;
+		std::memcpy(&size, m_data + offset, sizeof(size));
+		return size;
+	}
+
+	shm_spsc_ring_header *m_header;
+	std::uint8_t *m_data;
+	// Cached copy of the capacity. The consumer validates it once in
+	// attach(); re-reading it from shared memory later would allow the
+	// other process to change it behind our back.
+	std::uint32_t m_capacity;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_SHM_SPSC_RING_HPP
@@ -0,0 +1,52 @@
+#ifndef COMBOCTL_STARTUP_TIMINGS_HPP
+#define COMBOCTL_STARTUP_TIMINGS_HPP
+
+#include <chrono>
+#include <optional>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Durations of the phases of bluez_interface startup.
+ *
+ * The bluez_interface constructor only starts the internal thread.
+ * That thread then acquires the D-Bus connection and sets up the
+ * adapter in the background. The RFCOMM listener (needed only for
+ * the SDP record) is set up lazily by the first start_discovery()
+ * call. Phases that have not finished yet are std::nullopt.
+ */
+struct startup_timings
+{
+	/**
+	 * Time it took to get the D-Bus system bus connection.
+	 */
+	std::optional<std::chrono::microseconds> m_dbus_connection_duration;
+
+	/**
+	 * Time it took to set up the adapter. This includes enumerating the
+	 * objects BlueZ manages, creating the adapter proxy, and subscribing
+	 * to BlueZ signals.
+	 */
+	std::optional<std::chrono::microseconds> m_adapter_setup_duration;
+
+	/**
+	 * Time from the start of the bluez_interface constructor until
+	 * the background startup finished (successfully or not).
+	 */
+	std::optional<std::chrono::microseconds> m_total_duration;
+
+	/**
+	 * Time it took to set up the RFCOMM listener in the
+	 * first start_discovery() call.
+	 */
+	std::optional<std::chrono::microseconds> m_rfcomm_listener_setup_duration;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_STARTUP_TIMINGS_HPP
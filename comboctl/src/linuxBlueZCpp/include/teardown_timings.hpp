@@ -0,0 +1,57 @@
+#ifndef COMBOCTL_TEARDOWN_TIMINGS_HPP
+#define COMBOCTL_TEARDOWN_TIMINGS_HPP
+
+#include <chrono>
+#include <optional>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Durations of the phases of bluez_interface teardown.
+ *
+ * Teardown first cancels all D-Bus calls that are in flight. It then
+ * stops the discovery and the GLib mainloop. These two phases share
+ * one deadline (see bluez_interface::set_teardown_deadline()). Phases
+ * that did not run (for example because the deadline was already
+ * exceeded) are std::nullopt.
+ */
+struct teardown_timings
+{
+	/**
+	 * Time it took to stop the discovery and to tear down
+	 * the agent and the SDP service.
+	 */
+	std::optional<std::chrono::microseconds> m_stop_discovery_duration;
+
+	/**
+	 * Time it took to stop the GLib mainloop and its thread.
+	 * This includes the adapter teardown in that thread.
+	 */
+	std::optional<std::chrono::microseconds> m_mainloop_stop_duration;
+
+	/**
+	 * Total duration of the teardown.
+	 */
+	std::optional<std::chrono::microseconds> m_total_duration;
+
+	/**
+	 * True if one of the phases did not finish before the deadline.
+	 */
+	bool m_deadline_exceeded = false;
+
+	/**
+	 * True if the GLib mainloop thread did not finish before the
+	 * deadline, and was detached. Its resources are then leaked
+	 * instead of freed, since the thread may still access them.
+	 */
+	bool m_mainloop_thread_abandoned = false;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_TEARDOWN_TIMINGS_HPP
@@ -0,0 +1,130 @@
+#ifndef COMBOCTL_TRACEPOINTS_HPP
+#define COMBOCTL_TRACEPOINTS_HPP
+
+#include <cstdint>
+
+
+// Static tracepoints (USDT probes) for profiling with tools like
+// bpftrace, perf or SystemTap. The probes are only compiled in if
+// <sys/sdt.h> (usually provided by a "systemtap-sdt-dev" package)
+// is available and COMBOCTL_DISABLE_TRACEPOINTS is not defined.
+// Otherwise, the macros below expand to code that is never run.
+//
+// The probes use semaphores. Each tracepoint has a semaphore variable
+// that the tracing tool increments when it attaches to the probe. As
+// long as no tool is attached, the semaphore is 0, and the probe's
+// arguments are not even evaluated. The cost of a disabled probe is
+// then one predictable branch plus the NOP that sys/sdt.h emits.
+//
+// All probes use the "comboctl" provider name. See the scripts in
+// tools/tracing/ for examples of how to use them.
+//
+// To add a new tracepoint, declare it with COMBOCTL_DECLARE_TRACEPOINT()
+// below, and define it with COMBOCTL_DEFINE_TRACEPOINT() in tracepoints.cpp.
+
+#if !defined(COMBOCTL_DISABLE_TRACEPOINTS) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define COMBOCTL_TRACEPOINTS_AVAILABLE 1
+#endif
+#endif
+
+
+#ifdef COMBOCTL_TRACEPOINTS_AVAILABLE
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define COMBOCTL_TRACEPOINT_SEMAPHORE(NAME) comboctl_##NAME##_semaphore
+
+#define COMBOCTL_DECLARE_TRACEPOINT(NAME) \
+	extern "C" volatile unsigned short COMBOCTL_TRACEPOINT_SEMAPHORE(NAME)
+
+#define COMBOCTL_DEFINE_TRACEPOINT(NAME) \
+	extern "C" { __attribute__((section(".probes"))) volatile unsigned short COMBOCTL_TRACEPOINT_SEMAPHORE(NAME) = 0; } \
+	static_assert(true, "")
+
+#define COMBOCTL_TRACEPOINT_IS_ENABLED(NAME) \
+	__builtin_expect(COMBOCTL_TRACEPOINT_SEMAPHORE(NAME) != 0, 0)
+
+#define COMBOCTL_TRACEPOINT(NAME, ...) \
+	do { \
+		if (COMBOCTL_TRACEPOINT_IS_ENABLED(NAME)) \
+			STAP_PROBEV(comboctl, NAME, ##__VA_ARGS__); \
+	} while (false)
+
+#else
+
+namespace comboctl
+{
+namespace detail
+{
+
+// Takes the arguments of a compiled out tracepoint. The call to this
+// is never run, so the arguments are not evaluated, but they still
+// count as used. Otherwise, variables and parameters that are only
+// passed to tracepoints would cause unused variable warnings.
+template<typename... Args>
+inline void discard_tracepoint_args(Args const &...)
+{
+}
+
+} // namespace detail end
+} // namespace comboctl end
+
+#define COMBOCTL_DECLARE_TRACEPOINT(NAME) static_assert(true, "")
+#define COMBOCTL_DEFINE_TRACEPOINT(NAME) static_assert(true, "")
+#define COMBOCTL_TRACEPOINT_IS_ENABLED(NAME) false
+#define COMBOCTL_TRACEPOINT(NAME, ...) \
+	do { \
+		if (false) \
+			::comboctl::detail::discard_tracepoint_args(__VA_ARGS__); \
+	} while (false)
+
+#endif
+
+
+// RFCOMM connection tracepoints.
+//
+// rfcomm_connect_begin(uint channel)
+// rfcomm_connect_end(uint channel, int result)  result: 0 = success, -1 = failure/cancellation
+// rfcomm_send_begin(int num_bytes)
+// rfcomm_send_end(int num_bytes_sent)  -1 in case of an error or cancellation
+// rfcomm_receive_begin(int max_num_bytes)
+// rfcomm_receive_end(int num_bytes_received)  -1 in case of an error or cancellation
+COMBOCTL_DECLARE_TRACEPOINT(rfcomm_connect_begin);
+COMBOCTL_DECLARE_TRACEPOINT(rfcomm_connect_end);
+COMBOCTL_DECLARE_TRACEPOINT(rfcomm_send_begin);
+COMBOCTL_DECLARE_TRACEPOINT(rfcomm_send_end);
+COMBOCTL_DECLARE_TRACEPOINT(rfcomm_receive_begin);
+COMBOCTL_DECLARE_TRACEPOINT(rfcomm_receive_end);
+
+// Mainloop tracepoints. The task ID is an opaque value that
+// is the same in the post and execute tracepoints of a task.
+//
+// mainloop_task_post(uint64 task_id, char const *source_name)
+// mainloop_task_execute_begin(uint64 task_id, char const *source_name)
+// mainloop_task_execute_end(uint64 task_id, char const *source_name)
+COMBOCTL_DECLARE_TRACEPOINT(mainloop_task_post);
+COMBOCTL_DECLARE_TRACEPOINT(mainloop_task_execute_begin);
+COMBOCTL_DECLARE_TRACEPOINT(mainloop_task_execute_end);
+
+// D-Bus handler tracepoints.
+//
+// adapter_signal_begin(char const *signal_name, char const *object_path)
+// adapter_signal_end(char const *signal_name)
+// agent_method_call_begin(char const *method_name)
+// agent_method_call_end(char const *method_name)
+COMBOCTL_DECLARE_TRACEPOINT(adapter_signal_begin);
+COMBOCTL_DECLARE_TRACEPOINT(adapter_signal_end);
+COMBOCTL_DECLARE_TRACEPOINT(agent_method_call_begin);
+COMBOCTL_DECLARE_TRACEPOINT(agent_method_call_end);
+
+// JNI tracepoints.
+//
+// jni_enter(char const *method_name)
+// jni_exit(char const *method_name)
+COMBOCTL_DECLARE_TRACEPOINT(jni_enter);
+COMBOCTL_DECLARE_TRACEPOINT(jni_exit);
+
+
+#endif // COMBOCTL_TRACEPOINTS_HPP
@@ -0,0 +1,67 @@
+import java.io.ByteArrayOutputStream
+
+plugins {
+    `cpp-application`
+}
+
+application {
+    baseName.set("comboctl-mock-bluez")
+    dependencies {
+        implementation(project(":comboctl:src:linuxBlueZCpp"))
+    }
+}
+
+// Native build options are defined in the root build script.
+val nativeDBusBackendEnabled = rootProject.extra["nativeDBusBackendEnabled"] as Boolean
+val allocationTrackingEnabled = rootProject.extra["nativeAllocationTrackingEnabled"] as Boolean
+@Suppress("UNCHECKED_CAST")
+val nativeOptionCflags = rootProject.extra["nativeOptionCflags"] as List<String>
+
+extensions.configure<CppApplication> {
+    source.from(file("src"))
+    // The mock BlueZ service always uses GLib, but with the native D-Bus
+    // backend, the library leaves out gerror_exception.cpp (see its build script).
+    if (nativeDBusBackendEnabled)
+        source.from(file("../src/gerror_exception.cpp"))
+    privateHeaders.from(file("src/priv-headers"))
+}
+
+val glibCflagsStdout = ByteArrayOutputStream()
+val glibLibsStdout = ByteArrayOutputStream()
+
+fun getGccAndClangCflags(): List<String> {
+    return listOf("-Wextra", "-Wall", "-O0", "-g3", "-ggdb", "-std=c++17") +
+    glibCflagsStdout.toString().trim().split(" ") +
+    nativeOptionCflags
+}
+
+task<Exec>("glib2PkgConfigCflags") {
+    commandLine("pkg-config", "--cflags", "glib-2.0", "gio-2.0")
+    standardOutput = glibCflagsStdout
+}
+
+task<Exec>("glib2PkgConfigLibs") {
+    commandLine("pkg-config", "--libs", "glib-2.0", "gio-2.0")
+    standardOutput = glibLibsStdout
+}
+
+tasks.withType(CppCompile::class.java).configureEach {
+    dependsOn("glib2PkgConfigCflags")
+    compilerArgs.addAll(toolChain.map { toolChain ->
+        when (toolChain) {
+            is Gcc, is Clang -> getGccAndClangCflags()
+            else -> listOf()
+        }
+    })
+}
+
+tasks.withType(LinkExecutable::class.java).configureEach {
+    dependsOn("glib2PkgConfigLibs")
+    linkerArgs.addAll(toolChain.map { toolChain ->
+        when (toolChain) {
+            is Gcc, is Clang -> glibLibsStdout.toString().trim().split(" ") + listOf("-pthread") +
+                (if (allocationTrackingEnabled) listOf("-rdynamic") else listOf())
+            else -> listOf()
+        }
+    })
+}
@@ -0,0 +1,245 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+#include "mock_bluez_alloc_check.hpp"
+#include "mock_bluez_bench.hpp"
+#include "mock_bluez_cancel_bench.hpp"
+#include "mock_bluez_filter_check.hpp"
+#include "mock_bluez_script.hpp"
+#include "mock_bluez_service.hpp"
+#include "log.hpp"
+
+
+// comboctl-mock-bluez: stand-in for the BlueZ D-Bus service, for
+// developing and profiling the BlueZ backend without Bluetooth
+// hardware. "serve" runs the mock on an existing bus, optionally
+// driven by a script; "bench" starts a private bus and runs the
+// bluez_interface benchmark (see mock_bluez_bench.hpp); "alloc-check"
+// verifies that the hot paths do not allocate memory in an
+// instrumentation build (see mock_bluez_alloc_check.hpp); "filter-check"
+// verifies the discovery filter setup (see mock_bluez_filter_check.hpp);
+// "cancel-bench" measures how quickly canceled RFCOMM calls return (see
+// mock_bluez_cancel_bench.hpp).
+
+
+namespace
+{
+
+
+std::promise<void> stop_promise;
+
+
+void handle_stop_signal(int)
+{
+	// set_value() is not async-signal-safe in theory, but the
+	// process only waits for this, so it is good enough here.
+	try
+	{
+		stop_promise.set_value();
+	}
+	catch (std::future_error const &)
+	{
+	}
+}
+
+
+void print_usage(char const *program_name)
+{
+	std::cerr
+		<< "Usage: " << program_name << " serve [--latency MS] [--script FILE] [--verbose]\n"
+		<< "       " << program_name << " bench [--devices N] [--rssi-updates N] [--latency MS] [--verbose]\n"
+		<< "       " << program_name << " alloc-check [--packets N] [--packet-size N] [--tasks N] [--verbose]\n"
+		<< "       " << program_name << " filter-check [--verbose]\n"
+		<< "       " << program_name << " cancel-bench [--iterations N] [--verbose]\n"
+		<< "\n"
+		<< "serve: Claims org.bluez on the bus in DBUS_SYSTEM_BUS_ADDRESS and serves\n"
+		<< "       the mock BlueZ API until interrupted. Do not use this on the real\n"
+		<< "       system bus; use a private dbus-daemon instead.\n"
+		<< "bench: Starts a private dbus-daemon, runs bluez_interface against the\n"
+		<< "       mock BlueZ, and prints timings.\n"
+		<< "alloc-check: Checks that the RFCOMM send and receive code and the mainloop\n"
+		<< "       task dispatch do not allocate memory in their steady state. Requires\n"
+		<< "       an instrumentation build (-PcomboctlAllocationTracking). Exits with\n"
+		<< "       status 1 if they do.\n"
+		<< "filter-check: Checks that the discovery filter is set with the address\n"
+		<< "       pattern, set without it if BlueZ rejects patterns, and left out if\n"
+		<< "       BlueZ rejects filters altogether. Exits with status 1 on failure.\n"
+		<< "cancel-bench: Measures how long blocked RFCOMM send and receive calls\n"
+		<< "       take to return after they were canceled. Uses a local socket\n"
+		<< "       pair, so neither Bluetooth hardware nor D-Bus is needed.\n"
+		<< "\n"
+		<< "  --latency MS       Delay of mock BlueZ method call replies (default: 0)\n"
+		<< "  --script FILE      Script with events to trigger (see mock_bluez_script.hpp)\n"
+		<< "  --devices N        Number of unrelated devices (default: 2000)\n"
+		<< "  --rssi-updates N   Number of RSSI signals per burst (default: 20000)\n"
+		<< "  --packets N        Number of RFCOMM loopback packets (default: 10000)\n"
+		<< "  --packet-size N    Size of each RFCOMM loopback packet (default: 64)\n"
+		<< "  --tasks N          Number of mainloop tasks to dispatch (default: 1000)\n"
+		<< "  --iterations N     Number of send and receive calls to cancel (default: 200)\n"
+		<< "  --verbose          Also print debug log lines\n";
+}
+
+
+int serve(std::chrono::milliseconds response_latency, std::string const &script_path)
+{
+	char const *bus_address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+	if (bus_address == nullptr)
+	{
+		std::cerr << "comboctl-mock-bluez: DBUS_SYSTEM_BUS_ADDRESS is not set\n";
+		return 1;
+	}
+
+	std::vector<comboctl::mock_bluez_script_command> script_commands;
+	if (!script_path.empty())
+	{
+		std::ifstream script(script_path);
+		if (!script)
+		{
+			std::cerr << "comboctl-mock-bluez: could not open " << script_path << "\n";
+			return 1;
+		}
+
+		script_commands = comboctl::parse_mock_bluez_script(script);
+	}
+
+	comboctl::mock_bluez_service mock;
+	mock.set_response_latency(response_latency);
+	mock.start(bus_address);
+
+	struct sigaction action = {};
+	action.sa_handler = handle_stop_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+
+	comboctl::run_mock_bluez_script(mock, script_commands);
+
+	stop_promise.get_future().wait();
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	mock.stop();
+
+	return 0;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	std::string mode = argv[1];
+	std::string script_path;
+	comboctl::mock_bluez_bench_options bench_options;
+	comboctl::mock_bluez_alloc_check_options alloc_check_options;
+	comboctl::rfcomm_cancel_latency_options cancel_bench_options;
+	comboctl::log_level min_log_level = comboctl::log_level::info;
+
+	if ((mode != "serve") && (mode != "bench") && (mode != "alloc-check") && (mode != "filter-check") && (mode != "cancel-bench"))
+	{
+		print_usage(argv[0]);
+		return (mode == "--help") ? 0 : 1;
+	}
+
+	try
+	{
+		for (int i = 2; i < argc; ++i)
+		{
+			if ((std::strcmp(argv[i], "--latency") == 0) && ((i + 1) < argc))
+			{
+				bench_options.m_response_latency = std::chrono::milliseconds(std::stoul(argv[++i]));
+			}
+			else if ((std::strcmp(argv[i], "--script") == 0) && ((i + 1) < argc) && (mode == "serve"))
+			{
+				script_path = argv[++i];
+			}
+			else if ((std::strcmp(argv[i], "--devices") == 0) && ((i + 1) < argc) && (mode == "bench"))
+			{
+				bench_options.m_num_devices = std::stoul(argv[++i]);
+			}
+			else if ((std::strcmp(argv[i], "--rssi-updates") == 0) && ((i + 1) < argc) && (mode == "bench"))
+			{
+				bench_options.m_num_rssi_updates = std::stoul(argv[++i]);
+			}
+			else if ((std::strcmp(argv[i], "--packets") == 0) && ((i + 1) < argc) && (mode == "alloc-check"))
+			{
+				alloc_check_options.m_num_packets = std::stoul(argv[++i]);
+			}
+			else if ((std::strcmp(argv[i], "--packet-size") == 0) && ((i + 1) < argc) && (mode == "alloc-check"))
+			{
+				alloc_check_options.m_packet_size = std::stoi(argv[++i]);
+				if (alloc_check_options.m_packet_size <= 0)
+				{
+					print_usage(argv[0]);
+					return 1;
+				}
+			}
+			else if ((std::strcmp(argv[i], "--tasks") == 0) && ((i + 1) < argc) && (mode == "alloc-check"))
+			{
+				alloc_check_options.m_num_tasks = std::stoul(argv[++i]);
+			}
+			else if ((std::strcmp(argv[i], "--iterations") == 0) && ((i + 1) < argc) && (mode == "cancel-bench"))
+			{
+				cancel_bench_options.m_num_iterations = std::stoul(argv[++i]);
+			}
+			else if (std::strcmp(argv[i], "--verbose") == 0)
+			{
+				min_log_level = comboctl::log_level::debug;
+			}
+			else
+			{
+				print_usage(argv[0]);
+				return (std::strcmp(argv[i], "--help") == 0) ? 0 : 1;
+			}
+		}
+	}
+	catch (std::exception const &)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	comboctl::set_min_log_level(min_log_level);
+
+	try
+	{
+		if (mode == "serve")
+			return serve(bench_options.m_response_latency, script_path);
+
+		if (mode == "alloc-check")
+			return comboctl::run_mock_bluez_alloc_check(alloc_check_options) ? 0 : 1;
+
+		if (mode == "filter-check")
+			return comboctl::run_mock_bluez_filter_check() ? 0 : 1;
+
+		if (mode == "cancel-bench")
+		{
+			comboctl::run_mock_bluez_cancel_bench(cancel_bench_options);
+			return 0;
+		}
+
+		comboctl::run_mock_bluez_bench(bench_options);
+	}
+	catch (std::exception const &exc)
+	{
+		std::cerr << "comboctl-mock-bluez: " << exc.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <fmt/format.h>
+#include "mock_bluez_alloc_check.hpp"
+#include "mock_bluez_service.hpp"
+#include "private_dbus_daemon.hpp"
+#include "allocation_tracking.hpp"
+#include "rfcomm_loopback_check.hpp"
+#include "bluez_interface.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("MockBlueZAllocCheck")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+constexpr std::size_t num_warmup_tasks = 100;
+
+
+bool run_rfcomm_loopback_phase(mock_bluez_alloc_check_options const &options)
+{
+	rfcomm_loopback_check_options loopback_options;
+	loopback_options.m_num_packets = options.m_num_packets;
+	loopback_options.m_packet_size = options.m_packet_size;
+
+	rfcomm_loopback_check_result result = run_rfcomm_loopback_check(loopback_options);
+
+	fmt::print("rfcomm loopback:\n");
+	fmt::print("  packets:              {} x {} byte(s) in {} us\n", result.m_num_packets, options.m_packet_size, result.m_duration.count());
+	fmt::print("  send allocations:     {}\n", result.m_num_send_allocations);
+	fmt::print("  receive allocations:  {}\n", result.m_num_receive_allocations);
+	fmt::print("{}", format_allocation_site_report());
+
+	return (result.m_num_send_allocations == 0) && (result.m_num_receive_allocations == 0);
+}
+
+
+bool run_mainloop_dispatch_phase(mock_bluez_alloc_check_options const &options)
+{
+	private_dbus_daemon dbus_daemon;
+
+	// See run_mock_bluez_bench() for why this is set.
+	setenv("DBUS_SYSTEM_BUS_ADDRESS", dbus_daemon.get_address().c_str(), 1);
+
+	mock_bluez_service mock;
+	mock.start(dbus_daemon.get_address());
+	mock.sync();
+
+	std::uint64_t num_dispatch_allocations;
+
+	{
+		bluez_interface bluez;
+		bluez.wait_for_startup();
+
+		for (std::size_t i = 0; i < num_warmup_tasks; ++i)
+			bluez.run_in_thread([]() {});
+
+		reset_allocation_site_report();
+
+		// The dispatch region is the only region that is active in
+		// this phase, so the process-wide counter can be used. The
+		// per-thread counters of the mainloop thread are not accessible.
+		std::uint64_t num_region_allocations_before = get_process_allocation_counters().m_num_region_allocations;
+
+		for (std::size_t i = 0; i < options.m_num_tasks; ++i)
+			bluez.run_in_thread([]() {});
+
+		num_dispatch_allocations = get_process_allocation_counters().m_num_region_allocations - num_region_allocations_before;
+
+		bluez.teardown();
+	}
+
+	mock.stop();
+
+	fmt::print("mainloop task dispatch:\n");
+	fmt::print("  tasks:                {}\n", options.m_num_tasks);
+	fmt::print("  dispatch allocations: {}\n", num_dispatch_allocations);
+	fmt::print("{}", format_allocation_site_report());
+
+	return num_dispatch_allocations == 0;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+bool run_mock_bluez_alloc_check(mock_bluez_alloc_check_options const &options)
+{
+	if (!allocation_tracking_available)
+	{
+		fmt::print("allocation tracking is not available in this build; rebuild with -PcomboctlAllocationTracking\n");
+		return false;
+	}
+
+	bool loopback_passed = run_rfcomm_loopback_phase(options);
+	bool dispatch_passed = run_mainloop_dispatch_phase(options);
+	bool passed = loopback_passed && dispatch_passed;
+
+	fmt::print("result: {}\n", passed ? "no steady state allocations" : "steady state allocations found");
+
+	return passed;
+}
+
+
+} // namespace comboctl end
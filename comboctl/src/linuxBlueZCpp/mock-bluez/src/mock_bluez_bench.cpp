@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <malloc.h>
+#include <time.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <fmt/format.h>
+#include "mock_bluez_bench.hpp"
+#include "mock_bluez_service.hpp"
+#include "private_dbus_daemon.hpp"
+#include "bluez_interface.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("MockBlueZBench")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+typedef std::chrono::steady_clock clock_type;
+
+bluetooth_address const combo_address = {{0x00, 0x0E, 0x2F, 0x11, 0x22, 0x33}};
+bluetooth_address const marker_address = {{0x00, 0x0E, 0x2F, 0x00, 0x00, 0x01}};
+std::chrono::seconds const phase_timeout(30);
+
+
+std::string format_duration(std::optional<std::chrono::microseconds> const &duration)
+{
+	return duration ? fmt::format("{} us", duration->count()) : std::string("n/a");
+}
+
+
+std::chrono::microseconds to_us(clock_type::duration duration)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(duration);
+}
+
+
+std::chrono::nanoseconds get_process_cpu_time()
+{
+	// CPU time of all threads in this process. This includes
+	// the mock BlueZ thread, which runs in-process as well.
+	timespec ts;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return std::chrono::nanoseconds(0);
+	return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+
+struct memory_usage
+{
+	// Bytes in use by malloc, and the resident set size in kB.
+	std::size_t m_heap_in_use = 0;
+	std::optional<std::size_t> m_resident_set_kb;
+};
+
+
+memory_usage get_memory_usage()
+{
+	memory_usage usage;
+
+	struct mallinfo2 info = mallinfo2();
+	usage.m_heap_in_use = info.uordblks;
+
+	std::ifstream status_file("/proc/self/status");
+	std::string line;
+	while (std::getline(status_file, line))
+	{
+		if (line.compare(0, 6, "VmRSS:") == 0)
+		{
+			usage.m_resident_set_kb = std::stoul(line.substr(6));
+			break;
+		}
+	}
+
+	return usage;
+}
+
+
+void print_memory_usage(char const *phase_name, memory_usage const &usage)
+{
+	fmt::print(
+		"  {:<20}  heap {} kB, RSS {}\n",
+		fmt::format("{}:", phase_name),
+		usage.m_heap_in_use / 1024,
+		usage.m_resident_set_kb ? fmt::format("{} kB", *usage.m_resident_set_kb) : std::string("n/a")
+	);
+}
+
+
+void print_startup_timings(bluez_interface const &bluez)
+{
+	startup_timings timings = bluez.get_startup_timings();
+
+	fmt::print("startup:\n");
+	fmt::print("  D-Bus connection:     {}\n", format_duration(timings.m_dbus_connection_duration));
+	fmt::print("  adapter setup:        {}\n", format_duration(timings.m_adapter_setup_duration));
+	fmt::print("  total:                {}\n", format_duration(timings.m_total_duration));
+}
+
+
+void run_discovery_phase(bluez_interface &bluez, mock_bluez_service &mock)
+{
+	// The found_new_device callback runs in the bluez_interface thread,
+	// and may still run after this function returned (for example if
+	// the Combo is found right after the timeout). It therefore shares
+	// ownership of this state, and sets the promise value only once.
+	struct found_state
+	{
+		std::promise<clock_type::time_point> m_promise;
+		std::once_flag m_once_flag;
+	};
+	auto state = std::make_shared<found_state>();
+	std::future<clock_type::time_point> found_future = state->m_promise.get_future();
+
+	fmt::print("discovery:\n");
+
+	clock_type::time_point start_timestamp = clock_type::now();
+
+	try
+	{
+		bluez.start_discovery(
+			"mock-bluez-bench",
+			"ComboCtl",
+			"mock BlueZ benchmark",
+			"1234",
+			int(phase_timeout.count()),
+			discovery_mode::single_device,
+			[]() {},
+			[](discovery_stopped_reason) {},
+			[state](bluetooth_address address) {
+				if (address == combo_address)
+					std::call_once(state->m_once_flag, [&]() { state->m_promise.set_value(clock_type::now()); });
+			}
+		);
+	}
+	catch (std::exception const &exc)
+	{
+		// This happens for example if the RFCOMM listener cannot be set up
+		// because the kernel has no Bluetooth support. The mock does not
+		// cover RFCOMM sockets, so skip this phase.
+		fmt::print("  skipped: {}\n", exc.what());
+		return;
+	}
+
+	bool found = false;
+	clock_type::time_point pair_timestamp;
+
+	if (mock.wait_for_discovery(phase_timeout))
+	{
+		pair_timestamp = clock_type::now();
+		mock.add_device(combo_address, "Combo", false);
+		mock.pair_device(combo_address);
+
+		found = (found_future.wait_for(phase_timeout) == std::future_status::ready);
+		if (!found)
+			fmt::print("  Combo was not found within {} s\n", phase_timeout.count());
+	}
+	else
+		fmt::print("  StartDiscovery was not called within {} s\n", phase_timeout.count());
+
+	// In single device mode, the discovery already stopped if the Combo
+	// was found, and this does nothing. Otherwise, it makes sure that
+	// the later phases do not run with the discovery still going.
+	bluez.stop_discovery();
+
+	if (!found)
+		return;
+
+	clock_type::time_point found_timestamp = found_future.get();
+
+	fmt::print("  until StartDiscovery: {}\n", format_duration(to_us(*mock.get_last_discovery_start_timestamp() - start_timestamp)));
+	fmt::print("  pairing until found:  {}\n", format_duration(to_us(found_timestamp - pair_timestamp)));
+	fmt::print("  total until found:    {}\n", format_duration(to_us(found_timestamp - start_timestamp)));
+}
+
+
+void run_signal_throughput_phase(bluez_interface &bluez, mock_bluez_service &mock, std::size_t num_rssi_updates)
+{
+	std::promise<clock_type::time_point> unpaired_promise;
+	std::future<clock_type::time_point> unpaired_future = unpaired_promise.get_future();
+
+	bluez.on_device_unpaired([&unpaired_promise](bluetooth_address address) {
+		if (address == marker_address)
+			unpaired_promise.set_value(clock_type::now());
+	});
+
+	// The marker device is unpaired after the RSSI burst. Since the
+	// signals are processed in order, the unpaired callback is
+	// invoked once bluez_interface went through the whole burst.
+	mock.add_device(marker_address, "Marker", true);
+	mock.sync();
+
+	bluez.reset_mainloop_stats();
+
+	clock_type::time_point start_timestamp = clock_type::now();
+	std::chrono::nanoseconds start_cpu_time = get_process_cpu_time();
+	mock.emit_rssi_updates(num_rssi_updates);
+	mock.unpair_device(marker_address);
+
+	fmt::print("signal throughput:\n");
+
+	bool finished = (unpaired_future.wait_for(phase_timeout) == std::future_status::ready);
+	bluez.on_device_unpaired(device_unpaired_callback());
+
+	if (!finished)
+	{
+		fmt::print("  marker was not unpaired within {} s\n", phase_timeout.count());
+		return;
+	}
+
+	std::chrono::nanoseconds cpu_time = get_process_cpu_time() - start_cpu_time;
+	std::chrono::microseconds duration = to_us(unpaired_future.get() - start_timestamp);
+	fmt::print("  {} signals:        {}\n", num_rssi_updates, format_duration(duration));
+	if (duration.count() > 0)
+		fmt::print("  signals per second:   {}\n", std::uint64_t(num_rssi_updates) * 1000000 / std::uint64_t(duration.count()));
+
+	// The CPU time includes the mock emitting the signals. The
+	// dispatch duration only covers the handlers in bluez_interface.
+	if (num_rssi_updates > 0)
+		fmt::print("  CPU time per signal:  {} ns\n", cpu_time.count() / std::int64_t(num_rssi_updates));
+
+	mainloop_stats stats = bluez.get_mainloop_stats();
+	if (stats.m_dispatch_duration.m_num_samples > 0)
+	{
+		auto total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(stats.m_dispatch_duration.m_total_duration);
+		fmt::print("  dispatch per signal:  {} ns\n", total_ns.count() / std::int64_t(stats.m_dispatch_duration.m_num_samples));
+	}
+}
+
+
+void run_thread_latency_phase(bluez_interface &bluez, mock_bluez_service &mock, std::size_t num_rssi_updates, std::size_t num_samples)
+{
+	std::vector<std::chrono::microseconds> latencies;
+	latencies.reserve(num_samples);
+
+	mock.emit_rssi_updates(num_rssi_updates);
+
+	for (std::size_t i = 0; i < num_samples; ++i)
+	{
+		std::promise<void> promise;
+		std::future<void> future = promise.get_future();
+
+		clock_type::time_point start_timestamp = clock_type::now();
+		bluez.run_in_thread([&promise]() { promise.set_value(); });
+		future.wait();
+		latencies.push_back(to_us(clock_type::now() - start_timestamp));
+	}
+
+	mock.sync();
+
+	fmt::print("run_in_thread latency during signal burst:\n");
+
+	if (latencies.empty())
+		return;
+
+	std::sort(latencies.begin(), latencies.end());
+	fmt::print("  p50:                  {}\n", format_duration(latencies[latencies.size() / 2]));
+	fmt::print("  p99:                  {}\n", format_duration(latencies[(latencies.size() * 99) / 100]));
+	fmt::print("  max:                  {}\n", format_duration(latencies.back()));
+}
+
+
+void print_teardown_timings(bluez_interface const &bluez)
+{
+	teardown_timings timings = bluez.get_teardown_timings();
+
+	fmt::print("teardown:\n");
+	fmt::print("  stop discovery:       {}\n", format_duration(timings.m_stop_discovery_duration));
+	fmt::print("  mainloop stop:        {}\n", format_duration(timings.m_mainloop_stop_duration));
+	fmt::print("  total:                {}\n", format_duration(timings.m_total_duration));
+	if (timings.m_deadline_exceeded)
+		fmt::print("  deadline exceeded\n");
+}
+
+
+} // unnamed namespace end
+
+
+
+
+void run_mock_bluez_bench(mock_bluez_bench_options const &options)
+{
+	private_dbus_daemon dbus_daemon;
+
+	// Both D-Bus backends use this variable instead of
+	// the default system bus address if it is set, so
+	// this is where bluez_interface will find the mock.
+	setenv("DBUS_SYSTEM_BUS_ADDRESS", dbus_daemon.get_address().c_str(), 1);
+
+	mock_bluez_service mock;
+	mock.set_response_latency(options.m_response_latency);
+	mock.start(dbus_daemon.get_address());
+	mock.add_random_devices(options.m_num_devices);
+	mock.sync();
+
+	fmt::print("mock BlueZ: {} devices, {} ms response latency\n", options.m_num_devices, options.m_response_latency.count());
+	fmt::print("D-Bus backend: {}\n", bluez_interface::get_dbus_backend_name());
+
+	memory_usage before_startup_usage = get_memory_usage();
+	memory_usage after_startup_usage;
+	memory_usage after_burst_usage;
+
+	{
+		bluez_interface bluez;
+
+		bluez.set_device_filter([](bluetooth_address address) {
+			return (address[0] == 0x00) && (address[1] == 0x0E) && (address[2] == 0x2F);
+		});
+		bluez.set_discovery_address_prefix({0x00, 0x0E, 0x2F});
+
+		bluez.wait_for_startup();
+		after_startup_usage = get_memory_usage();
+		print_startup_timings(bluez);
+
+		run_discovery_phase(bluez, mock);
+		run_signal_throughput_phase(bluez, mock, options.m_num_rssi_updates);
+		after_burst_usage = get_memory_usage();
+		run_thread_latency_phase(bluez, mock, options.m_num_rssi_updates, options.m_num_latency_samples);
+
+		bluez.teardown();
+		print_teardown_timings(bluez);
+	}
+
+	// The mock's own device table is part of these numbers
+	// as well, so compare backends with the same options.
+	fmt::print("memory usage:\n");
+	print_memory_usage("before startup", before_startup_usage);
+	print_memory_usage("after startup", after_startup_usage);
+	print_memory_usage("after signal burst", after_burst_usage);
+
+	mock_bluez_service_stats stats = mock.get_stats();
+	fmt::print("mock BlueZ stats:\n");
+	fmt::print("  method calls:         {}\n", stats.m_num_method_calls);
+	fmt::print("  signals emitted:      {}\n", stats.m_num_signals_emitted);
+	fmt::print("  devices filtered out: {}\n", stats.m_num_devices_filtered_out);
+
+	mock.stop();
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,41 @@
+#include <fmt/format.h>
+#include "mock_bluez_cancel_bench.hpp"
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+void print_cancel_latency_stats(char const *name, rfcomm_cancel_latency_stats const &stats)
+{
+	fmt::print(
+		"  {:<8} min {} us, median {} us, mean {} us, max {} us\n",
+		name,
+		stats.m_min.count(),
+		stats.m_median.count(),
+		stats.m_mean.count(),
+		stats.m_max.count()
+	);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+void run_mock_bluez_cancel_bench(rfcomm_cancel_latency_options const &options)
+{
+	rfcomm_cancel_latency_result result = run_rfcomm_cancel_latency_check(options);
+
+	fmt::print("rfcomm cancellation latency ({} call(s) each):\n", options.m_num_iterations);
+	print_cancel_latency_stats("receive:", result.m_receive);
+	print_cancel_latency_stats("send:", result.m_send);
+}
+
+
+} // namespace comboctl end
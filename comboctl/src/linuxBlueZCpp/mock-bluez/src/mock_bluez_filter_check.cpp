@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <optional>
+#include <string>
+#include <fmt/format.h>
+#include "mock_bluez_filter_check.hpp"
+#include "mock_bluez_service.hpp"
+#include "private_dbus_daemon.hpp"
+#include "bluez_interface.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("MockBlueZFilterCheck")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+bluetooth_address const combo_address = {{0x00, 0x0E, 0x2F, 0x11, 0x22, 0x33}};
+std::chrono::seconds const scenario_timeout(30);
+std::size_t const num_unrelated_devices = 50;
+
+
+struct filter_scenario
+{
+	char const *m_name;
+	bool m_filter_supported;
+	bool m_pattern_supported;
+
+	// Expected outcome, as seen by the mock.
+	std::optional<std::string> m_expected_pattern;
+	std::uint64_t m_expected_num_rejections;
+	std::uint64_t m_expected_num_devices_filtered_out;
+};
+
+
+filter_scenario const filter_scenarios[] = {
+	{ "filter with pattern", true, true, std::string("00:0E:2F"), 0, num_unrelated_devices },
+	{ "retry without pattern", true, false, std::string(""), 1, 0 },
+	{ "no filter", false, false, std::nullopt, 2, 0 }
+};
+
+
+enum class scenario_result
+{
+	passed,
+	failed,
+	skipped
+};
+
+
+std::string format_pattern(std::optional<std::string> const &pattern)
+{
+	return pattern ? fmt::format("\"{}\"", *pattern) : std::string("<no filter>");
+}
+
+
+scenario_result run_filter_scenario(private_dbus_daemon const &dbus_daemon, filter_scenario const &scenario)
+{
+	fmt::print("{}:\n", scenario.m_name);
+
+	mock_bluez_service mock;
+	mock.set_discovery_filter_supported(scenario.m_filter_supported);
+	mock.set_discovery_filter_pattern_supported(scenario.m_pattern_supported);
+	mock.start(dbus_daemon.get_address());
+	mock.sync();
+
+	// Declared before the bluez_interface instance, so that it
+	// outlives the mainloop thread that sets its value.
+	std::promise<void> found_promise;
+	std::future<void> found_future = found_promise.get_future();
+
+	bool found;
+	std::optional<std::string> pattern;
+	mock_bluez_service_stats stats;
+
+	{
+		bluez_interface bluez;
+		bluez.set_discovery_address_prefix({0x00, 0x0E, 0x2F});
+		bluez.wait_for_startup();
+
+		try
+		{
+			// Single device mode invokes the callback only once.
+			bluez.start_discovery(
+				"mock-bluez-filter-check",
+				"ComboCtl",
+				"mock BlueZ discovery filter check",
+				"1234",
+				int(scenario_timeout.count()),
+				discovery_mode::single_device,
+				[]() {},
+				[](discovery_stopped_reason) {},
+				[&found_promise](bluetooth_address address) {
+					if (address == combo_address)
+						found_promise.set_value();
+				}
+			);
+		}
+		catch (std::exception const &exc)
+		{
+			// See run_mock_bluez_bench() for why this can happen.
+			fmt::print("  skipped: {}\n", exc.what());
+			return scenario_result::skipped;
+		}
+
+		if (!mock.wait_for_discovery(scenario_timeout))
+		{
+			fmt::print("  StartDiscovery was not called within {} s\n", scenario_timeout.count());
+			return scenario_result::failed;
+		}
+
+		mock.add_random_devices(num_unrelated_devices);
+		mock.add_device(combo_address, "Combo", false);
+		mock.pair_device(combo_address);
+
+		found = (found_future.wait_for(scenario_timeout) == std::future_status::ready);
+
+		mock.sync();
+		pattern = mock.get_discovery_filter_pattern();
+		stats = mock.get_stats();
+
+		bluez.teardown();
+	}
+
+	mock.stop();
+
+	bool passed = found
+	           && (pattern == scenario.m_expected_pattern)
+	           && (stats.m_num_discovery_filters_rejected == scenario.m_expected_num_rejections)
+	           && (stats.m_num_devices_filtered_out == scenario.m_expected_num_devices_filtered_out);
+
+	fmt::print("  filter pattern:       {} (expected: {})\n", format_pattern(pattern), format_pattern(scenario.m_expected_pattern));
+	fmt::print("  rejected filters:     {} (expected: {})\n", stats.m_num_discovery_filters_rejected, scenario.m_expected_num_rejections);
+	fmt::print("  devices filtered out: {} (expected: {})\n", stats.m_num_devices_filtered_out, scenario.m_expected_num_devices_filtered_out);
+	fmt::print("  Combo found:          {}\n", found ? "yes" : "no");
+	fmt::print("  result:               {}\n", passed ? "passed" : "FAILED");
+
+	return passed ? scenario_result::passed : scenario_result::failed;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+bool run_mock_bluez_filter_check()
+{
+	private_dbus_daemon dbus_daemon;
+
+	// See run_mock_bluez_bench() for why this is set.
+	setenv("DBUS_SYSTEM_BUS_ADDRESS", dbus_daemon.get_address().c_str(), 1);
+
+	bool passed = true;
+
+	for (auto const &scenario : filter_scenarios)
+	{
+		if (run_filter_scenario(dbus_daemon, scenario) == scenario_result::failed)
+			passed = false;
+	}
+
+	fmt::print("result: {}\n", passed ? "discovery filter handled correctly" : "discovery filter mishandled");
+
+	return passed;
+}
+
+
+} // namespace comboctl end
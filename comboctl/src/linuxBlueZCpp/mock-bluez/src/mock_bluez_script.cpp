@@ -0,0 +1,194 @@
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <fmt/format.h>
+#include "mock_bluez_script.hpp"
+#include "mock_bluez_service.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("MockBlueZScript")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+struct command_syntax
+{
+	std::size_t m_min_num_args;
+	std::size_t m_max_num_args;
+};
+
+// Names are the rest of the line, so they may contain spaces.
+std::map<std::string, command_syntax> const command_syntaxes = {
+	{ "latency", { 1, 1 } },
+	{ "pattern-support", { 1, 1 } },
+	{ "filter-support", { 1, 1 } },
+	{ "add", { 2, 2 } },
+	{ "add-paired", { 2, 2 } },
+	{ "add-random", { 1, 1 } },
+	{ "remove", { 1, 1 } },
+	{ "pair", { 1, 1 } },
+	{ "unpair", { 1, 1 } },
+	{ "rssi-flood", { 1, 1 } },
+	{ "wait-discovery", { 1, 1 } }
+};
+
+
+[[noreturn]] void throw_parse_error(unsigned int line_number, std::string const &message)
+{
+	throw std::invalid_argument(fmt::format("Line {}: {}", line_number, message));
+}
+
+
+unsigned long parse_number(unsigned int line_number, std::string const &str)
+{
+	std::size_t num_parsed_chars = 0;
+	unsigned long number = 0;
+
+	try
+	{
+		number = std::stoul(str, &num_parsed_chars);
+	}
+	catch (std::exception const &)
+	{
+		num_parsed_chars = 0;
+	}
+
+	if ((num_parsed_chars == 0) || (num_parsed_chars != str.size()))
+		throw_parse_error(line_number, fmt::format("\"{}\" is not a valid number", str));
+
+	return number;
+}
+
+
+bluetooth_address parse_address(unsigned int line_number, std::string const &str)
+{
+	bluetooth_address address;
+	if (!from_string(address, str))
+		throw_parse_error(line_number, fmt::format("\"{}\" is not a valid Bluetooth address", str));
+	return address;
+}
+
+
+void check_command_args(mock_bluez_script_command const &command)
+{
+	std::string const &name = command.m_name;
+	std::string const &first_arg = command.m_args[0];
+	unsigned int line_number = command.m_line_number;
+
+	if ((name == "latency") || (name == "add-random") || (name == "rssi-flood") || (name == "wait-discovery"))
+		parse_number(line_number, first_arg);
+	else if ((name == "pattern-support") || (name == "filter-support"))
+	{
+		if ((first_arg != "on") && (first_arg != "off"))
+			throw_parse_error(line_number, fmt::format("expected \"on\" or \"off\", got \"{}\"", first_arg));
+	}
+	else
+		parse_address(line_number, first_arg);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+std::vector<mock_bluez_script_command> parse_mock_bluez_script(std::istream &script)
+{
+	std::vector<mock_bluez_script_command> commands;
+	std::string line;
+	unsigned int line_number = 0;
+
+	while (std::getline(script, line))
+	{
+		++line_number;
+
+		std::istringstream line_stream(line);
+		std::string delay_str;
+
+		if (!(line_stream >> delay_str) || (delay_str[0] == '#'))
+			continue;
+
+		mock_bluez_script_command command;
+		command.m_line_number = line_number;
+		command.m_delay = std::chrono::milliseconds(parse_number(line_number, delay_str));
+
+		if (!(line_stream >> command.m_name))
+			throw_parse_error(line_number, "missing command");
+
+		auto syntax_iter = command_syntaxes.find(command.m_name);
+		if (syntax_iter == command_syntaxes.end())
+			throw_parse_error(line_number, fmt::format("unknown command \"{}\"", command.m_name));
+		command_syntax const &syntax = syntax_iter->second;
+
+		std::string arg;
+		while ((command.m_args.size() < (syntax.m_max_num_args - 1)) && (line_stream >> arg))
+			command.m_args.push_back(arg);
+
+		// The last argument takes the rest of the line.
+		std::string rest;
+		std::getline(line_stream >> std::ws, rest);
+		if (!rest.empty())
+			command.m_args.push_back(rest);
+
+		if (command.m_args.size() < syntax.m_min_num_args)
+			throw_parse_error(line_number, fmt::format("command \"{}\" needs {} argument(s)", command.m_name, syntax.m_min_num_args));
+
+		check_command_args(command);
+
+		commands.push_back(std::move(command));
+	}
+
+	return commands;
+}
+
+
+void run_mock_bluez_script(mock_bluez_service &mock, std::vector<mock_bluez_script_command> const &commands)
+{
+	for (auto const &command : commands)
+	{
+		std::this_thread::sleep_for(command.m_delay);
+
+		std::string const &name = command.m_name;
+		std::string const &first_arg = command.m_args[0];
+
+		LOG(debug, "Line {}: running command \"{}\"", command.m_line_number, name);
+
+		// The arguments were checked by the parser, so this does not throw.
+		if (name == "latency")
+			mock.set_response_latency(std::chrono::milliseconds(std::stoul(first_arg)));
+		else if (name == "pattern-support")
+			mock.set_discovery_filter_pattern_supported(first_arg == "on");
+		else if (name == "filter-support")
+			mock.set_discovery_filter_supported(first_arg == "on");
+		else if (name == "add")
+			mock.add_device(parse_address(command.m_line_number, first_arg), command.m_args[1], false);
+		else if (name == "add-paired")
+			mock.add_device(parse_address(command.m_line_number, first_arg), command.m_args[1], true);
+		else if (name == "add-random")
+			mock.add_random_devices(std::stoul(first_arg), command.m_line_number);
+		else if (name == "remove")
+			mock.remove_device(parse_address(command.m_line_number, first_arg));
+		else if (name == "pair")
+			mock.pair_device(parse_address(command.m_line_number, first_arg));
+		else if (name == "unpair")
+			mock.unpair_device(parse_address(command.m_line_number, first_arg));
+		else if (name == "rssi-flood")
+			mock.emit_rssi_updates(std::stoul(first_arg));
+		else if (name == "wait-discovery")
+		{
+			if (!mock.wait_for_discovery(std::chrono::milliseconds(std::stoul(first_arg))))
+				LOG(warn, "Line {}: discovery did not start in time", command.m_line_number);
+		}
+	}
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,1062 @@
+#include <assert.h>
+#include <algorithm>
+#include <random>
+#include <fmt/format.h>
+#include "mock_bluez_service.hpp"
+#include "exception.hpp"
+#include "gerror_exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("MockBlueZ")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+std::string const adapter_object_path = "/org/bluez/hci0";
+
+// Introspection data for all interfaces the mock implements. GDBus uses
+// this for validating incoming method call arguments, and for implementing
+// the org.freedesktop.DBus.Properties interface on top of get_property().
+// Only the parts of the BlueZ API that ComboCtl uses are covered.
+std::string const introspection_xml =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+	"<node>"
+	"   <interface name='org.freedesktop.DBus.ObjectManager'>"
+	"       <method name='GetManagedObjects'>"
+	"           <arg type='a{oa{sa{sv}}}' name='objects' direction='out' />"
+	"       </method>"
+	"       <signal name='InterfacesAdded'>"
+	"           <arg type='o' name='object' />"
+	"           <arg type='a{sa{sv}}' name='interfaces' />"
+	"       </signal>"
+	"       <signal name='InterfacesRemoved'>"
+	"           <arg type='o' name='object' />"
+	"           <arg type='as' name='interfaces' />"
+	"       </signal>"
+	"   </interface>"
+	"   <interface name='org.bluez.AgentManager1'>"
+	"       <method name='RegisterAgent'>"
+	"           <arg type='o' name='agent' direction='in' />"
+	"           <arg type='s' name='capability' direction='in' />"
+	"       </method>"
+	"       <method name='UnregisterAgent'>"
+	"           <arg type='o' name='agent' direction='in' />"
+	"       </method>"
+	"       <method name='RequestDefaultAgent'>"
+	"           <arg type='o' name='agent' direction='in' />"
+	"       </method>"
+	"   </interface>"
+	"   <interface name='org.bluez.ProfileManager1'>"
+	"       <method name='RegisterProfile'>"
+	"           <arg type='o' name='profile' direction='in' />"
+	"           <arg type='s' name='UUID' direction='in' />"
+	"           <arg type='a{sv}' name='options' direction='in' />"
+	"       </method>"
+	"       <method name='UnregisterProfile'>"
+	"           <arg type='o' name='profile' direction='in' />"
+	"       </method>"
+	"   </interface>"
+	"   <interface name='org.bluez.Adapter1'>"
+	"       <method name='StartDiscovery' />"
+	"       <method name='StopDiscovery' />"
+	"       <method name='SetDiscoveryFilter'>"
+	"           <arg type='a{sv}' name='properties' direction='in' />"
+	"       </method>"
+	"       <method name='RemoveDevice'>"
+	"           <arg type='o' name='device' direction='in' />"
+	"       </method>"
+	"       <property name='Address' type='s' access='read' />"
+	"       <property name='Name' type='s' access='read' />"
+	"       <property name='Alias' type='s' access='read' />"
+	"       <property name='Powered' type='b' access='read' />"
+	"       <property name='Discovering' type='b' access='read' />"
+	"   </interface>"
+	"   <interface name='org.bluez.Device1'>"
+	"       <method name='Connect' />"
+	"       <method name='Disconnect' />"
+	"       <property name='Address' type='s' access='read' />"
+	"       <property name='Name' type='s' access='read' />"
+	"       <property name='Alias' type='s' access='read' />"
+	"       <property name='Paired' type='b' access='read' />"
+	"       <property name='Connected' type='b' access='read' />"
+	"       <property name='RSSI' type='n' access='read' />"
+	"       <property name='Adapter' type='o' access='read' />"
+	"   </interface>"
+	"</node>";
+
+
+bool starts_with(std::string const &str, std::string const &prefix)
+{
+	return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+mock_bluez_service::mock_bluez_service(bluetooth_address const &adapter_address, std::string adapter_name)
+	: m_adapter_address(to_string(adapter_address))
+	, m_adapter_name(std::move(adapter_name))
+	, m_started(false)
+	, m_context(nullptr)
+	, m_mainloop(nullptr)
+	, m_connection(nullptr)
+	, m_node_info(nullptr)
+	, m_response_latency_ms(0)
+	, m_discovery_filter_pattern_supported(true)
+	, m_discovery_filter_supported(true)
+	, m_discovering(false)
+{
+	GError *error = nullptr;
+
+	m_node_info = g_dbus_node_info_new_for_xml(introspection_xml.c_str(), &error);
+	if (error != nullptr)
+		throw gerror_exception(error);
+
+	m_context = g_main_context_new();
+	m_mainloop = g_main_loop_new(m_context, FALSE);
+}
+
+
+mock_bluez_service::~mock_bluez_service()
+{
+	stop();
+
+	g_main_loop_unref(m_mainloop);
+	g_main_context_unref(m_context);
+	g_dbus_node_info_unref(m_node_info);
+}
+
+
+void mock_bluez_service::start(std::string const &bus_address)
+{
+	if (m_started)
+		throw invalid_call_exception("Mock BlueZ service already started");
+
+	std::promise<std::exception_ptr> startup_promise;
+	std::future<std::exception_ptr> startup_future = startup_promise.get_future();
+
+	m_thread = std::thread([this, bus_address, &startup_promise]() { thread_func(bus_address, startup_promise); });
+
+	std::exception_ptr eptr = startup_future.get();
+	if (eptr)
+	{
+		m_thread.join();
+		std::rethrow_exception(eptr);
+	}
+
+	m_started = true;
+
+	LOG(info, "Mock BlueZ service started on bus {}", bus_address);
+}
+
+
+void mock_bluez_service::stop()
+{
+	if (!m_started)
+		return;
+
+	post([this]() { g_main_loop_quit(m_mainloop); });
+	m_thread.join();
+
+	m_started = false;
+
+	LOG(info, "Mock BlueZ service stopped");
+}
+
+
+void mock_bluez_service::set_response_latency(std::chrono::milliseconds latency)
+{
+	m_response_latency_ms = latency.count();
+}
+
+
+void mock_bluez_service::set_discovery_filter_pattern_supported(bool supported)
+{
+	m_discovery_filter_pattern_supported = supported;
+}
+
+
+void mock_bluez_service::set_discovery_filter_supported(bool supported)
+{
+	m_discovery_filter_supported = supported;
+}
+
+
+void mock_bluez_service::add_device(bluetooth_address const &address, std::string name, bool paired)
+{
+	post([this, address = to_string(address), name = std::move(name), paired]() mutable {
+		add_device_impl(address, std::move(name), paired);
+	});
+}
+
+
+void mock_bluez_service::add_random_devices(std::size_t count, std::uint32_t seed)
+{
+	post([this, count, seed]() {
+		std::mt19937 random_engine(seed);
+		std::uniform_int_distribution<int> byte_distribution(0, 255);
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			bluetooth_address address;
+			for (auto &address_byte : address)
+				address_byte = std::uint8_t(byte_distribution(random_engine));
+
+			// Make sure that no random device is mistaken for a Combo.
+			if ((address[0] == 0x00) && (address[1] == 0x0E) && (address[2] == 0x2F))
+				address[0] = 0x02;
+
+			add_device_impl(to_string(address), fmt::format("Device {}", i), false);
+		}
+	});
+}
+
+
+void mock_bluez_service::remove_device(bluetooth_address const &address)
+{
+	post([this, address = to_string(address)]() {
+		std::string object_path = get_device_object_path(address);
+		if (m_devices.find(object_path) == m_devices.end())
+		{
+			LOG(error, "Cannot remove unknown device {}", address);
+			return;
+		}
+
+		remove_device_impl(object_path);
+	});
+}
+
+
+void mock_bluez_service::pair_device(bluetooth_address const &address)
+{
+	post([this, address = to_string(address)]() {
+		std::string object_path = get_device_object_path(address);
+		if (m_devices.find(object_path) == m_devices.end())
+		{
+			LOG(error, "Cannot pair unknown device {}", address);
+			return;
+		}
+
+		if (!m_agent_owner)
+		{
+			LOG(debug, "No agent registered; pairing device {} without authorization", address);
+			set_device_paired(object_path, true);
+			return;
+		}
+
+		// Like BlueZ, ask the agent for the PIN code. The device only
+		// becomes paired if the agent replies with a PIN code.
+
+		struct pairing_request
+		{
+			mock_bluez_service *m_self;
+			std::string m_object_path;
+		};
+
+		static auto static_request_pin_code_cb = [](GObject *source_object, GAsyncResult *result, gpointer user_data) -> void {
+			std::unique_ptr<pairing_request> request(reinterpret_cast<pairing_request *>(user_data));
+			GError *error = nullptr;
+
+			GVariant *retval = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source_object), result, &error);
+			if (error != nullptr)
+			{
+				LOG(info, "Agent rejected pairing request for device {}: {}", request->m_object_path, error->message);
+				g_error_free(error);
+				return;
+			}
+
+			gchar const *pin_code = nullptr;
+			g_variant_get(retval, "(&s)", &pin_code);
+			LOG(debug, "Agent provided PIN code \"{}\" for device {}", pin_code, request->m_object_path);
+			g_variant_unref(retval);
+
+			request->m_self->set_device_paired(request->m_object_path, true);
+		};
+
+		g_dbus_connection_call(
+			m_connection,
+			m_agent_owner->c_str(),
+			m_agent_path.c_str(),
+			"org.bluez.Agent1",
+			"RequestPinCode",
+			g_variant_new("(o)", object_path.c_str()),
+			G_VARIANT_TYPE("(s)"),
+			G_DBUS_CALL_FLAGS_NONE,
+			-1,
+			nullptr,
+			GAsyncReadyCallback(+static_request_pin_code_cb),
+			gpointer(new pairing_request{this, object_path})
+		);
+	});
+}
+
+
+void mock_bluez_service::unpair_device(bluetooth_address const &address)
+{
+	post([this, address = to_string(address)]() {
+		std::string object_path = get_device_object_path(address);
+		if (m_devices.find(object_path) == m_devices.end())
+		{
+			LOG(error, "Cannot unpair unknown device {}", address);
+			return;
+		}
+
+		set_device_paired(object_path, false);
+		remove_device_impl(object_path);
+	});
+}
+
+
+void mock_bluez_service::emit_rssi_updates(std::size_t count)
+{
+	post([this, count]() {
+		if (m_devices.empty())
+			return;
+
+		std::vector<std::string> object_paths;
+		object_paths.reserve(m_devices.size());
+		for (auto const &entry : m_devices)
+			object_paths.push_back(entry.first);
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			std::string const &object_path = object_paths[i % object_paths.size()];
+			mock_device &device = m_devices[object_path];
+			device.m_rssi = std::int16_t(-40 - int(i % 50));
+
+			GVariantBuilder builder;
+			g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+			g_variant_builder_add(&builder, "{sv}", "RSSI", g_variant_new_int16(device.m_rssi));
+			emit_properties_changed(object_path, "org.bluez.Device1", g_variant_builder_end(&builder));
+		}
+	});
+}
+
+
+void mock_bluez_service::sync()
+{
+	if (!m_started)
+		return;
+
+	std::promise<void> promise;
+	std::future<void> future = promise.get_future();
+	post([&promise]() { promise.set_value(); });
+	future.wait();
+}
+
+
+bool mock_bluez_service::wait_for_discovery(std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(m_state_mutex);
+	return m_discovery_condvar.wait_for(lock, timeout, [this]() { return m_discovering; });
+}
+
+
+std::optional<std::chrono::steady_clock::time_point> mock_bluez_service::get_last_discovery_start_timestamp() const
+{
+	std::lock_guard<std::mutex> lock(m_state_mutex);
+	return m_last_discovery_start_timestamp;
+}
+
+
+std::optional<std::string> mock_bluez_service::get_discovery_filter_pattern() const
+{
+	std::lock_guard<std::mutex> lock(m_state_mutex);
+	return m_discovery_filter_pattern;
+}
+
+
+mock_bluez_service_stats mock_bluez_service::get_stats() const
+{
+	std::lock_guard<std::mutex> lock(m_state_mutex);
+	return m_stats;
+}
+
+
+void mock_bluez_service::thread_func(std::string const &bus_address, std::promise<std::exception_ptr> &startup_promise)
+{
+	// Method calls for objects are dispatched in the thread-default
+	// context that is active when the objects are registered, so
+	// push our context before connecting and registering.
+	g_main_context_push_thread_default(m_context);
+
+	try
+	{
+		connect_and_register(bus_address);
+	}
+	catch (...)
+	{
+		cleanup();
+		g_main_context_pop_thread_default(m_context);
+		startup_promise.set_value(std::current_exception());
+		return;
+	}
+
+	startup_promise.set_value(std::exception_ptr());
+
+	g_main_loop_run(m_mainloop);
+
+	cleanup();
+	g_main_context_pop_thread_default(m_context);
+}
+
+
+void mock_bluez_service::connect_and_register(std::string const &bus_address)
+{
+	GError *error = nullptr;
+
+	m_connection = g_dbus_connection_new_for_address_sync(
+		bus_address.c_str(),
+		GDBusConnectionFlags(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+		nullptr,
+		nullptr,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not connect to bus {}: {}", bus_address, error->message);
+		throw gerror_exception(error);
+	}
+
+	// Objects are registered before claiming the name, so
+	// they are all there once clients can see the service.
+	register_static_objects();
+
+	// Claim the name synchronously (with the DO_NOT_QUEUE flag),
+	// so start() can report failure if another service already
+	// owns it, for example if this is run on the real system bus.
+	GVariant *retval = g_dbus_connection_call_sync(
+		m_connection,
+		"org.freedesktop.DBus",
+		"/org/freedesktop/DBus",
+		"org.freedesktop.DBus",
+		"RequestName",
+		g_variant_new("(su)", "org.bluez", guint32(4)),
+		G_VARIANT_TYPE("(u)"),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		nullptr,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not request org.bluez name: {}", error->message);
+		throw gerror_exception(error);
+	}
+
+	guint32 request_name_result = 0;
+	g_variant_get(retval, "(u)", &request_name_result);
+	g_variant_unref(retval);
+
+	// 1 = DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER
+	if (request_name_result != 1)
+		throw io_exception("The org.bluez name is already owned by another service");
+}
+
+
+void mock_bluez_service::cleanup()
+{
+	if (m_connection == nullptr)
+		return;
+
+	for (auto &entry : m_devices)
+		g_dbus_connection_unregister_object(m_connection, entry.second.m_registration_id);
+	m_devices.clear();
+
+	for (auto registration_id : m_static_registration_ids)
+		g_dbus_connection_unregister_object(m_connection, registration_id);
+	m_static_registration_ids.clear();
+
+	m_agent_owner = std::nullopt;
+	m_profiles.clear();
+	m_discovery_pattern.clear();
+
+	g_dbus_connection_close_sync(m_connection, nullptr, nullptr);
+	g_object_unref(G_OBJECT(m_connection));
+	m_connection = nullptr;
+
+	std::lock_guard<std::mutex> lock(m_state_mutex);
+	m_discovering = false;
+	m_discovery_filter_pattern = std::nullopt;
+	m_stats.m_num_devices = 0;
+}
+
+
+void mock_bluez_service::post(std::function<void()> func)
+{
+	GSource *idle_source = g_idle_source_new();
+	attach_function_source(idle_source, std::move(func));
+	g_source_unref(idle_source);
+}
+
+
+void mock_bluez_service::reply_after_latency(std::function<void()> func)
+{
+	// The state changes a method call causes happen right away,
+	// only the reply is delayed. This keeps the state consistent
+	// with the order of calls, even if replies are delayed.
+
+	std::int64_t latency_ms = m_response_latency_ms;
+	if (latency_ms <= 0)
+	{
+		func();
+		return;
+	}
+
+	GSource *timeout_source = g_timeout_source_new(guint(latency_ms));
+	attach_function_source(timeout_source, std::move(func));
+	g_source_unref(timeout_source);
+}
+
+
+void mock_bluez_service::attach_function_source(GSource *source, std::function<void()> func)
+{
+	g_source_set_callback(
+		source,
+		[](gpointer data) -> gboolean {
+			(*reinterpret_cast<std::function<void()> *>(data))();
+			return G_SOURCE_REMOVE;
+		},
+		gpointer(new std::function<void()>(std::move(func))),
+		[](gpointer data) {
+			delete reinterpret_cast<std::function<void()> *>(data);
+		}
+	);
+	g_source_attach(source, m_context);
+}
+
+
+void mock_bluez_service::register_static_objects()
+{
+	static GDBusInterfaceVTable const vtable = {
+		[](GDBusConnection *, gchar const *sender, gchar const *object_path, gchar const *interface_name, gchar const *method_name, GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data) {
+			reinterpret_cast<mock_bluez_service *>(user_data)->handle_method_call(invocation, sender, object_path, interface_name, method_name, parameters);
+		},
+		[](GDBusConnection *, gchar const *, gchar const *object_path, gchar const *interface_name, gchar const *property_name, GError **error, gpointer user_data) -> GVariant* {
+			return reinterpret_cast<mock_bluez_service *>(user_data)->get_property(object_path, interface_name, property_name, error);
+		},
+		nullptr,
+		{ nullptr }
+	};
+
+	struct static_object
+	{
+		char const *m_object_path;
+		char const *m_interface_name;
+	};
+
+	std::string adapter_path = adapter_object_path;
+
+	static_object const static_objects[] = {
+		{ "/", "org.freedesktop.DBus.ObjectManager" },
+		{ "/org/bluez", "org.bluez.AgentManager1" },
+		{ "/org/bluez", "org.bluez.ProfileManager1" },
+		{ adapter_path.c_str(), "org.bluez.Adapter1" }
+	};
+
+	for (auto const &object : static_objects)
+	{
+		GError *error = nullptr;
+
+		guint registration_id = g_dbus_connection_register_object(
+			m_connection,
+			object.m_object_path,
+			g_dbus_node_info_lookup_interface(m_node_info, object.m_interface_name),
+			&vtable,
+			gpointer(this),
+			nullptr,
+			&error
+		);
+		if (error != nullptr)
+		{
+			LOG(error, "Could not register {} object at {}: {}", object.m_interface_name, object.m_object_path, error->message);
+			throw gerror_exception(error);
+		}
+
+		m_static_registration_ids.push_back(registration_id);
+	}
+}
+
+
+void mock_bluez_service::register_device_object(std::string const &object_path, mock_device &device)
+{
+	static GDBusInterfaceVTable const vtable = {
+		[](GDBusConnection *, gchar const *sender, gchar const *object_path, gchar const *interface_name, gchar const *method_name, GVariant *parameters, GDBusMethodInvocation *invocation, gpointer user_data) {
+			reinterpret_cast<mock_bluez_service *>(user_data)->handle_method_call(invocation, sender, object_path, interface_name, method_name, parameters);
+		},
+		[](GDBusConnection *, gchar const *, gchar const *object_path, gchar const *interface_name, gchar const *property_name, GError **error, gpointer user_data) -> GVariant* {
+			return reinterpret_cast<mock_bluez_service *>(user_data)->get_property(object_path, interface_name, property_name, error);
+		},
+		nullptr,
+		{ nullptr }
+	};
+
+	GError *error = nullptr;
+
+	device.m_registration_id = g_dbus_connection_register_object(
+		m_connection,
+		object_path.c_str(),
+		g_dbus_node_info_lookup_interface(m_node_info, "org.bluez.Device1"),
+		&vtable,
+		gpointer(this),
+		nullptr,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not register device object at {}: {}", object_path, error->message);
+		throw gerror_exception(error);
+	}
+}
+
+
+void mock_bluez_service::handle_method_call(GDBusMethodInvocation *invocation, gchar const *sender, gchar const *object_path, gchar const *interface_name, gchar const *method_name, GVariant *parameters)
+{
+	LOG(trace, "Method call {}.{} on {} from {}", interface_name, method_name, object_path, sender);
+
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		m_stats.m_num_method_calls++;
+	}
+
+	if (g_strcmp0(interface_name, "org.freedesktop.DBus.ObjectManager") == 0)
+	{
+		GVariant *managed_objects = g_variant_ref_sink(g_variant_new("(@a{oa{sa{sv}}})", build_managed_objects()));
+		reply_after_latency([invocation, managed_objects]() {
+			g_dbus_method_invocation_return_value(invocation, managed_objects);
+			g_variant_unref(managed_objects);
+		});
+	}
+	else if (g_strcmp0(interface_name, "org.bluez.Adapter1") == 0)
+		handle_adapter_method_call(invocation, method_name, parameters);
+	else if (g_strcmp0(interface_name, "org.bluez.AgentManager1") == 0)
+		handle_agent_manager_method_call(invocation, sender, method_name, parameters);
+	else if (g_strcmp0(interface_name, "org.bluez.ProfileManager1") == 0)
+		handle_profile_manager_method_call(invocation, method_name, parameters);
+	else
+		g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.NotSupported", "Not supported by the mock BlueZ service");
+}
+
+
+void mock_bluez_service::handle_adapter_method_call(GDBusMethodInvocation *invocation, gchar const *method_name, GVariant *parameters)
+{
+	bool discovering;
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		discovering = m_discovering;
+	}
+
+	if (g_strcmp0(method_name, "StartDiscovery") == 0)
+	{
+		if (discovering)
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.InProgress", "Operation already in progress");
+			return;
+		}
+
+		set_discovering(true);
+	}
+	else if (g_strcmp0(method_name, "StopDiscovery") == 0)
+	{
+		if (!discovering)
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.Failed", "No discovery started");
+			return;
+		}
+
+		set_discovering(false);
+	}
+	else if (g_strcmp0(method_name, "SetDiscoveryFilter") == 0)
+	{
+		// Validate the filter like BlueZ does: unknown keys and
+		// values of the wrong type are rejected as invalid.
+
+		if (!m_discovery_filter_supported)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_state_mutex);
+				m_stats.m_num_discovery_filters_rejected++;
+			}
+
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.NotSupported", "Operation is not supported");
+			return;
+		}
+
+		GVariant *filter_variant = nullptr;
+		g_variant_get(parameters, "(@a{sv})", &filter_variant);
+
+		GVariantIter filter_iter;
+		gchar const *key;
+		GVariant *value;
+		std::string pattern;
+		bool valid = true;
+
+		g_variant_iter_init(&filter_iter, filter_variant);
+		while (valid && g_variant_iter_loop(&filter_iter, "{&sv}", &key, &value))
+		{
+			if (g_strcmp0(key, "Transport") == 0)
+			{
+				valid = g_variant_is_of_type(value, G_VARIANT_TYPE_STRING);
+				if (valid)
+				{
+					gchar const *transport = g_variant_get_string(value, nullptr);
+					valid = (g_strcmp0(transport, "auto") == 0) || (g_strcmp0(transport, "bredr") == 0) || (g_strcmp0(transport, "le") == 0);
+				}
+			}
+			else if ((g_strcmp0(key, "DuplicateData") == 0) || (g_strcmp0(key, "Discoverable") == 0))
+				valid = g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN);
+			else if (g_strcmp0(key, "RSSI") == 0)
+				valid = g_variant_is_of_type(value, G_VARIANT_TYPE_INT16);
+			else if (g_strcmp0(key, "Pathloss") == 0)
+				valid = g_variant_is_of_type(value, G_VARIANT_TYPE_UINT16);
+			else if (g_strcmp0(key, "UUIDs") == 0)
+				valid = g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY);
+			else if ((g_strcmp0(key, "Pattern") == 0) && m_discovery_filter_pattern_supported)
+			{
+				valid = g_variant_is_of_type(value, G_VARIANT_TYPE_STRING);
+				if (valid)
+					pattern = g_variant_get_string(value, nullptr);
+			}
+			else
+				valid = false;
+		}
+
+		g_variant_unref(filter_variant);
+
+		if (!valid)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_state_mutex);
+				m_stats.m_num_discovery_filters_rejected++;
+			}
+
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.InvalidArguments", "Invalid arguments in method call");
+			return;
+		}
+
+		LOG(debug, "Discovery filter set; pattern: \"{}\"", pattern);
+		m_discovery_pattern = pattern;
+
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		m_discovery_filter_pattern = std::move(pattern);
+	}
+	else if (g_strcmp0(method_name, "RemoveDevice") == 0)
+	{
+		gchar const *object_path = nullptr;
+		g_variant_get(parameters, "(&o)", &object_path);
+
+		if (m_devices.find(object_path) == m_devices.end())
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.DoesNotExist", "Does Not Exist");
+			return;
+		}
+
+		remove_device_impl(object_path);
+	}
+
+	reply_after_latency([invocation]() { g_dbus_method_invocation_return_value(invocation, nullptr); });
+}
+
+
+void mock_bluez_service::handle_agent_manager_method_call(GDBusMethodInvocation *invocation, gchar const *sender, gchar const *method_name, GVariant *parameters)
+{
+	gchar const *agent_path = nullptr;
+
+	if (g_strcmp0(method_name, "RegisterAgent") == 0)
+	{
+		gchar const *capability = nullptr;
+		g_variant_get(parameters, "(&o&s)", &agent_path, &capability);
+
+		if (m_agent_owner)
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.AlreadyExists", "Already Exists");
+			return;
+		}
+
+		LOG(debug, "Agent {} of {} registered with capability {}", agent_path, sender, capability);
+		m_agent_owner = sender;
+		m_agent_path = agent_path;
+	}
+	else
+	{
+		g_variant_get(parameters, "(&o)", &agent_path);
+
+		if (!m_agent_owner || (*m_agent_owner != sender) || (m_agent_path != agent_path))
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.DoesNotExist", "Does Not Exist");
+			return;
+		}
+
+		if (g_strcmp0(method_name, "UnregisterAgent") == 0)
+		{
+			LOG(debug, "Agent {} of {} unregistered", agent_path, sender);
+			m_agent_owner = std::nullopt;
+			m_agent_path.clear();
+		}
+	}
+
+	reply_after_latency([invocation]() { g_dbus_method_invocation_return_value(invocation, nullptr); });
+}
+
+
+void mock_bluez_service::handle_profile_manager_method_call(GDBusMethodInvocation *invocation, gchar const *method_name, GVariant *parameters)
+{
+	gchar const *profile_path = nullptr;
+
+	if (g_strcmp0(method_name, "RegisterProfile") == 0)
+	{
+		gchar const *uuid = nullptr;
+		g_variant_get(parameters, "(&o&s@a{sv})", &profile_path, &uuid, nullptr);
+
+		if (m_profiles.find(profile_path) != m_profiles.end())
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.AlreadyExists", "Already Exists");
+			return;
+		}
+
+		LOG(debug, "Profile {} registered with UUID {}", profile_path, uuid);
+		m_profiles[profile_path] = uuid;
+	}
+	else
+	{
+		g_variant_get(parameters, "(&o)", &profile_path);
+
+		auto profile_iter = m_profiles.find(profile_path);
+		if (profile_iter == m_profiles.end())
+		{
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.bluez.Error.DoesNotExist", "Does Not Exist");
+			return;
+		}
+
+		LOG(debug, "Profile {} unregistered", profile_path);
+		m_profiles.erase(profile_iter);
+	}
+
+	reply_after_latency([invocation]() { g_dbus_method_invocation_return_value(invocation, nullptr); });
+}
+
+
+GVariant* mock_bluez_service::get_property(gchar const *object_path, gchar const *interface_name, gchar const *property_name, GError **error)
+{
+	if (g_strcmp0(interface_name, "org.bluez.Adapter1") == 0)
+	{
+		GVariant *properties = g_variant_ref_sink(build_adapter_properties());
+		GVariant *value = g_variant_lookup_value(properties, property_name, nullptr);
+		g_variant_unref(properties);
+		if (value != nullptr)
+			return value;
+	}
+	else if (g_strcmp0(interface_name, "org.bluez.Device1") == 0)
+	{
+		auto device_iter = m_devices.find(object_path);
+		if (device_iter != m_devices.end())
+		{
+			GVariant *properties = g_variant_ref_sink(build_device_properties(device_iter->second));
+			GVariant *value = g_variant_lookup_value(properties, property_name, nullptr);
+			g_variant_unref(properties);
+			if (value != nullptr)
+				return value;
+		}
+	}
+
+	g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property %s.%s", interface_name, property_name);
+	return nullptr;
+}
+
+
+GVariant* mock_bluez_service::build_managed_objects()
+{
+	GVariantBuilder objects_builder;
+	g_variant_builder_init(&objects_builder, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+
+	g_variant_builder_add_parsed(&objects_builder, "{objectpath '/org/bluez', {'org.bluez.AgentManager1': @a{sv} {}, 'org.bluez.ProfileManager1': @a{sv} {}}}");
+
+	{
+		GVariantBuilder interfaces_builder;
+		g_variant_builder_init(&interfaces_builder, G_VARIANT_TYPE("a{sa{sv}}"));
+		g_variant_builder_add(&interfaces_builder, "{s@a{sv}}", "org.bluez.Adapter1", build_adapter_properties());
+		g_variant_builder_add(&objects_builder, "{o@a{sa{sv}}}", adapter_object_path.c_str(), g_variant_builder_end(&interfaces_builder));
+	}
+
+	for (auto const &entry : m_devices)
+	{
+		GVariantBuilder interfaces_builder;
+		g_variant_builder_init(&interfaces_builder, G_VARIANT_TYPE("a{sa{sv}}"));
+		g_variant_builder_add(&interfaces_builder, "{s@a{sv}}", "org.bluez.Device1", build_device_properties(entry.second));
+		g_variant_builder_add(&objects_builder, "{o@a{sa{sv}}}", entry.first.c_str(), g_variant_builder_end(&interfaces_builder));
+	}
+
+	return g_variant_builder_end(&objects_builder);
+}
+
+
+GVariant* mock_bluez_service::build_adapter_properties()
+{
+	bool discovering;
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		discovering = m_discovering;
+	}
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "Address", g_variant_new_string(m_adapter_address.c_str()));
+	g_variant_builder_add(&builder, "{sv}", "Name", g_variant_new_string(m_adapter_name.c_str()));
+	g_variant_builder_add(&builder, "{sv}", "Alias", g_variant_new_string(m_adapter_name.c_str()));
+	g_variant_builder_add(&builder, "{sv}", "Powered", g_variant_new_boolean(TRUE));
+	g_variant_builder_add(&builder, "{sv}", "Discovering", g_variant_new_boolean(discovering));
+	return g_variant_builder_end(&builder);
+}
+
+
+GVariant* mock_bluez_service::build_device_properties(mock_device const &device)
+{
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "Address", g_variant_new_string(device.m_address.c_str()));
+	g_variant_builder_add(&builder, "{sv}", "Name", g_variant_new_string(device.m_name.c_str()));
+	g_variant_builder_add(&builder, "{sv}", "Alias", g_variant_new_string(device.m_name.c_str()));
+	g_variant_builder_add(&builder, "{sv}", "Paired", g_variant_new_boolean(device.m_paired));
+	g_variant_builder_add(&builder, "{sv}", "Connected", g_variant_new_boolean(FALSE));
+	g_variant_builder_add(&builder, "{sv}", "RSSI", g_variant_new_int16(device.m_rssi));
+	g_variant_builder_add(&builder, "{sv}", "Adapter", g_variant_new_object_path(adapter_object_path.c_str()));
+	return g_variant_builder_end(&builder);
+}
+
+
+void mock_bluez_service::add_device_impl(std::string const &address, std::string name, bool paired)
+{
+	std::string object_path = get_device_object_path(address);
+	if (m_devices.find(object_path) != m_devices.end())
+		return;
+
+	bool discovering;
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		discovering = m_discovering;
+	}
+
+	// BlueZ only creates objects for newly found devices
+	// if they match the discovery filter's pattern.
+	if (!paired && discovering && !m_discovery_pattern.empty() && !starts_with(address, m_discovery_pattern) && !starts_with(name, m_discovery_pattern))
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		m_stats.m_num_devices_filtered_out++;
+		return;
+	}
+
+	mock_device &device = m_devices[object_path];
+	device.m_address = address;
+	device.m_name = std::move(name);
+	device.m_paired = paired;
+	register_device_object(object_path, device);
+
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		m_stats.m_num_devices = m_devices.size();
+	}
+
+	GVariantBuilder interfaces_builder;
+	g_variant_builder_init(&interfaces_builder, G_VARIANT_TYPE("a{sa{sv}}"));
+	g_variant_builder_add(&interfaces_builder, "{s@a{sv}}", "org.bluez.Device1", build_device_properties(device));
+
+	emit_signal("/", "org.freedesktop.DBus.ObjectManager", "InterfacesAdded", g_variant_new("(o@a{sa{sv}})", object_path.c_str(), g_variant_builder_end(&interfaces_builder)));
+}
+
+
+void mock_bluez_service::remove_device_impl(std::string const &object_path)
+{
+	auto device_iter = m_devices.find(object_path);
+	assert(device_iter != m_devices.end());
+
+	g_dbus_connection_unregister_object(m_connection, device_iter->second.m_registration_id);
+	m_devices.erase(device_iter);
+
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		m_stats.m_num_devices = m_devices.size();
+	}
+
+	gchar const *removed_interfaces[] = { "org.bluez.Device1", nullptr };
+	emit_signal("/", "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved", g_variant_new("(o^as)", object_path.c_str(), removed_interfaces));
+}
+
+
+void mock_bluez_service::set_device_paired(std::string const &object_path, bool paired)
+{
+	auto device_iter = m_devices.find(object_path);
+	if (device_iter == m_devices.end())
+		return;
+
+	device_iter->second.m_paired = paired;
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "Paired", g_variant_new_boolean(paired));
+	emit_properties_changed(object_path, "org.bluez.Device1", g_variant_builder_end(&builder));
+}
+
+
+void mock_bluez_service::set_discovering(bool discovering)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_state_mutex);
+		m_discovering = discovering;
+		if (discovering)
+			m_last_discovery_start_timestamp = std::chrono::steady_clock::now();
+	}
+
+	m_discovery_condvar.notify_all();
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "Discovering", g_variant_new_boolean(discovering));
+	emit_properties_changed(adapter_object_path, "org.bluez.Adapter1", g_variant_builder_end(&builder));
+}
+
+
+void mock_bluez_service::emit_properties_changed(std::string const &object_path, gchar const *interface_name, GVariant *changed_properties)
+{
+	gchar const *invalidated_properties[] = { nullptr };
+	emit_signal(object_path.c_str(), "org.freedesktop.DBus.Properties", "PropertiesChanged", g_variant_new("(s@a{sv}^as)", interface_name, changed_properties, invalidated_properties));
+}
+
+
+void mock_bluez_service::emit_signal(gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters)
+{
+	GError *error = nullptr;
+
+	g_dbus_connection_emit_signal(m_connection, nullptr, object_path, interface_name, signal_name, parameters, &error);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not emit {}.{} signal: {}", interface_name, signal_name, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_state_mutex);
+	m_stats.m_num_signals_emitted++;
+}
+
+
+std::string mock_bluez_service::get_device_object_path(std::string const &address) const
+{
+	// BlueZ device object paths are the adapter path plus
+	// "dev_" plus the address with colons replaced by underscores.
+	std::string object_path = adapter_object_path + "/dev_" + address;
+	std::replace(object_path.begin() + adapter_object_path.size(), object_path.end(), ':', '_');
+	return object_path;
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,50 @@
+#ifndef COMBOCTL_MOCK_BLUEZ_ALLOC_CHECK_HPP
+#define COMBOCTL_MOCK_BLUEZ_ALLOC_CHECK_HPP
+
+#include <cstddef>
+
+
+namespace comboctl
+{
+
+
+struct mock_bluez_alloc_check_options
+{
+	/// Number of packets to exchange over the RFCOMM loopback.
+	std::size_t m_num_packets = 10000;
+
+	/// Size of each loopback packet, in bytes.
+	int m_packet_size = 64;
+
+	/// Number of run_in_thread() tasks to dispatch.
+	std::size_t m_num_tasks = 1000;
+};
+
+
+/**
+ * Verifies that the hot paths do not allocate memory in their steady state.
+ *
+ * This requires an instrumentation build (see allocation_tracking.hpp).
+ * It runs these phases, each after a warmup:
+ *
+ * 1. RFCOMM loopback: run_rfcomm_loopback_check() exchanges packets
+ *    through the RFCOMM send and receive code over a socket pair.
+ * 2. Mainloop task dispatch: bluez_interface runs against a mock BlueZ
+ *    on a private bus, and dispatches no-op run_in_thread() tasks.
+ *    Only the dispatch itself is checked. Posting a task allocates
+ *    its GSource and function object by design.
+ *
+ * The allocation counts and the call stacks of the remaining
+ * allocations are printed to stdout.
+ *
+ * @return true if no phase allocated any memory.
+ * @throws io_exception if the loopback or the private dbus-daemon fails.
+ * @throws gerror_exception if a D-Bus or GLib operation fails.
+ */
+bool run_mock_bluez_alloc_check(mock_bluez_alloc_check_options const &options);
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MOCK_BLUEZ_ALLOC_CHECK_HPP
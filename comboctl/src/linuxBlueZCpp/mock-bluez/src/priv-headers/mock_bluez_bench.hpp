@@ -0,0 +1,62 @@
+#ifndef COMBOCTL_MOCK_BLUEZ_BENCH_HPP
+#define COMBOCTL_MOCK_BLUEZ_BENCH_HPP
+
+#include <chrono>
+#include <cstddef>
+
+
+namespace comboctl
+{
+
+
+struct mock_bluez_bench_options
+{
+	/// Number of unrelated devices the mock BlueZ knows about.
+	std::size_t m_num_devices = 2000;
+
+	/// Number of RSSI PropertiesChanged signals to emit in
+	/// the signal throughput and run_in_thread latency phases.
+	std::size_t m_num_rssi_updates = 20000;
+
+	/// Latency of the mock BlueZ method call replies.
+	std::chrono::milliseconds m_response_latency{0};
+
+	/// Number of run_in_thread() calls to measure.
+	std::size_t m_num_latency_samples = 200;
+};
+
+
+/**
+ * Runs bluez_interface against a mock BlueZ on a private bus and prints timings.
+ *
+ * This starts a private dbus-daemon, points bluez_interface to it via
+ * the DBUS_SYSTEM_BUS_ADDRESS environment variable, and runs these phases:
+ *
+ * 1. Startup: bluez_interface startup timings, with the mock already
+ *    knowing about m_num_devices devices.
+ * 2. Discovery: time from start_discovery() until BlueZ sees the
+ *    StartDiscovery call, and until a Combo that pairs during the
+ *    discovery is reported to the found_new_device callback.
+ * 3. Signal throughput: time until bluez_interface processed a burst
+ *    of RSSI signals (measured with a marker device at the end), plus
+ *    the process CPU time and mainloop dispatch time per signal.
+ * 4. run_in_thread() latency while such a burst is being processed.
+ * 5. Teardown timings.
+ *
+ * Heap usage (mallinfo2) and resident set size are reported from before
+ * startup, after startup, and after the signal burst. The D-Bus backend
+ * the library was built with is printed as well, so that runs of both
+ * backends can be told apart.
+ *
+ * Results are printed to stdout.
+ *
+ * @throws io_exception if the private dbus-daemon cannot be started.
+ * @throws gerror_exception if a D-Bus or GLib operation fails.
+ */
+void run_mock_bluez_bench(mock_bluez_bench_options const &options);
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MOCK_BLUEZ_BENCH_HPP
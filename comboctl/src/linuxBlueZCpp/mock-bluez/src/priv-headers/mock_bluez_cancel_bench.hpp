@@ -0,0 +1,25 @@
+#ifndef COMBOCTL_MOCK_BLUEZ_CANCEL_BENCH_HPP
+#define COMBOCTL_MOCK_BLUEZ_CANCEL_BENCH_HPP
+
+#include "rfcomm_loopback_check.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Benchmarks how quickly canceled RFCOMM send and receive calls return.
+ *
+ * This runs run_rfcomm_cancel_latency_check(), which needs neither
+ * Bluetooth hardware nor D-Bus, and prints the latencies to stdout.
+ *
+ * @throws io_exception if the loopback fails.
+ */
+void run_mock_bluez_cancel_bench(rfcomm_cancel_latency_options const &options);
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MOCK_BLUEZ_CANCEL_BENCH_HPP
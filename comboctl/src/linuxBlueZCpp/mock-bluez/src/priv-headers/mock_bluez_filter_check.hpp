@@ -0,0 +1,38 @@
+#ifndef COMBOCTL_MOCK_BLUEZ_FILTER_CHECK_HPP
+#define COMBOCTL_MOCK_BLUEZ_FILTER_CHECK_HPP
+
+
+namespace comboctl
+{
+
+
+/**
+ * Checks how bluez_interface sets up the BlueZ discovery filter.
+ *
+ * This runs bluez_interface against a mock BlueZ on a private bus,
+ * with a discovery address prefix set, in these scenarios:
+ *
+ * 1. BlueZ supports the Pattern key: the filter is set with the
+ *    pattern, and BlueZ drops unrelated devices.
+ * 2. BlueZ rejects the Pattern key (versions before 5.54): the
+ *    filter call is retried without the pattern.
+ * 3. BlueZ rejects all filters: discovery continues without one.
+ *
+ * In all scenarios, a Combo that pairs during the discovery must be
+ * reported to the found_new_device callback. If discovery cannot be
+ * started (for example because the kernel has no Bluetooth support,
+ * so the RFCOMM listener cannot be set up), the scenarios are skipped.
+ *
+ * The results are printed to stdout.
+ *
+ * @return true if all scenarios passed or were skipped.
+ * @throws io_exception if the private dbus-daemon cannot be started.
+ * @throws gerror_exception if a D-Bus or GLib operation fails.
+ */
+bool run_mock_bluez_filter_check();
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MOCK_BLUEZ_FILTER_CHECK_HPP
@@ -0,0 +1,70 @@
+#ifndef COMBOCTL_MOCK_BLUEZ_SCRIPT_HPP
+#define COMBOCTL_MOCK_BLUEZ_SCRIPT_HPP
+
+#include <chrono>
+#include <istream>
+#include <string>
+#include <vector>
+
+
+namespace comboctl
+{
+
+
+class mock_bluez_service;
+
+
+/**
+ * One parsed line of a mock BlueZ script.
+ */
+struct mock_bluez_script_command
+{
+	/// Delay relative to the previous command.
+	std::chrono::milliseconds m_delay{0};
+	std::string m_name;
+	std::vector<std::string> m_args;
+	unsigned int m_line_number = 0;
+};
+
+
+/**
+ * Parses a script that drives a mock_bluez_service.
+ *
+ * Each line has the form "<delay in ms> <command> [arguments]", where
+ * the delay is relative to the previous line. Empty lines and lines
+ * starting with '#' are ignored. Supported commands:
+ *
+ *   latency <ms>                  Sets the method call reply latency.
+ *   pattern-support on|off        Enables/disables Pattern discovery filters.
+ *   filter-support on|off         Enables/disables discovery filters altogether.
+ *   add <address> <name>          Adds an unpaired device.
+ *   add-paired <address> <name>   Adds a paired device.
+ *   add-random <count>            Adds unpaired devices with random addresses.
+ *   remove <address>              Removes a device.
+ *   pair <address>                Pairs a device (through the agent).
+ *   unpair <address>              Unpairs and removes a device.
+ *   rssi-flood <count>            Emits RSSI PropertiesChanged signals.
+ *   wait-discovery <ms>           Waits until discovery is running.
+ *
+ * The whole script is parsed (and checked) before anything is run.
+ *
+ * @param script Stream to read the script from.
+ * @return The parsed commands.
+ * @throws std::invalid_argument if the script is malformed. The
+ *         message contains the number of the offending line.
+ */
+std::vector<mock_bluez_script_command> parse_mock_bluez_script(std::istream &script);
+
+/**
+ * Runs commands parsed by parse_mock_bluez_script().
+ *
+ * @param mock Service to run the commands on. Must be started.
+ * @param commands Commands to run.
+ */
+void run_mock_bluez_script(mock_bluez_service &mock, std::vector<mock_bluez_script_command> const &commands);
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MOCK_BLUEZ_SCRIPT_HPP
@@ -0,0 +1,303 @@
+#ifndef COMBOCTL_MOCK_BLUEZ_SERVICE_HPP
+#define COMBOCTL_MOCK_BLUEZ_SERVICE_HPP
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "types.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Statistics about a mock_bluez_service instance.
+ */
+struct mock_bluez_service_stats
+{
+	/// Number of D-Bus method calls the service received.
+	std::uint64_t m_num_method_calls = 0;
+
+	/// Number of D-Bus signals the service emitted.
+	std::uint64_t m_num_signals_emitted = 0;
+
+	/// Number of devices that were not added because they
+	/// did not match the pattern in the discovery filter.
+	std::uint64_t m_num_devices_filtered_out = 0;
+
+	/// Number of SetDiscoveryFilter calls that were rejected.
+	std::uint64_t m_num_discovery_filters_rejected = 0;
+
+	/// Number of devices currently known to the service.
+	std::size_t m_num_devices = 0;
+};
+
+
+/**
+ * Stand-in for the BlueZ D-Bus service.
+ *
+ * This implements the parts of the BlueZ D-Bus API that the adapter,
+ * agent and sdp_service classes use: the ObjectManager at "/", the
+ * AgentManager1 and ProfileManager1 interfaces at "/org/bluez", one
+ * Adapter1 object, and Device1 objects. It claims the "org.bluez" name
+ * on the bus it is started on. That is typically a private dbus-daemon
+ * instance; bluez_interface can be pointed to it by setting the
+ * DBUS_SYSTEM_BUS_ADDRESS environment variable.
+ *
+ * Events like devices showing up or getting paired are triggered by
+ * calling the functions below. This can be done from any thread; the
+ * events are executed in the service's own thread, in the order the
+ * functions were called. Pairing goes through the registered agent
+ * (if any) like with the real BlueZ, so the agent code is exercised.
+ *
+ * Method call replies can be delayed by a configurable latency to
+ * simulate a slow or busy BlueZ.
+ */
+class mock_bluez_service
+{
+public:
+	/**
+	 * Constructor.
+	 *
+	 * @param adapter_address Bluetooth address of the mock adapter.
+	 * @param adapter_name Name of the mock adapter.
+	 */
+	explicit mock_bluez_service(bluetooth_address const &adapter_address = {{0x00, 0x1A, 0x7D, 0xDA, 0x71, 0x13}}, std::string adapter_name = "mock-bluez");
+
+	/**
+	 * Destructor.
+	 *
+	 * Calls stop().
+	 */
+	~mock_bluez_service();
+
+	mock_bluez_service(mock_bluez_service const &) = delete;
+	mock_bluez_service& operator = (mock_bluez_service const &) = delete;
+
+	/**
+	 * Connects to a D-Bus bus and starts serving the BlueZ API there.
+	 *
+	 * This starts the internal thread, and returns once the "org.bluez"
+	 * name was acquired.
+	 *
+	 * @param bus_address D-Bus address of the bus to connect to.
+	 * @throws invalid_call_exception if the service is already started.
+	 * @throws io_exception if the "org.bluez" name is already taken.
+	 * @throws gerror_exception if connecting to the bus fails.
+	 */
+	void start(std::string const &bus_address);
+
+	/**
+	 * Stops the internal thread and disconnects from the bus.
+	 *
+	 * If the service isn't started, this does nothing.
+	 */
+	void stop();
+
+	/**
+	 * Sets how long method call replies are delayed.
+	 *
+	 * The default latency is 0 (replies are sent right away).
+	 */
+	void set_response_latency(std::chrono::milliseconds latency);
+
+	/**
+	 * Enables or disables support for the Pattern key in discovery filters.
+	 *
+	 * BlueZ versions before 5.54 reject discovery filters with that key.
+	 * Disabling this emulates these versions. It is enabled by default.
+	 */
+	void set_discovery_filter_pattern_supported(bool supported);
+
+	/**
+	 * Enables or disables support for discovery filters altogether.
+	 *
+	 * If disabled, all SetDiscoveryFilter calls are rejected, like
+	 * BlueZ does for example if the adapter cannot filter for the
+	 * requested transport. It is enabled by default.
+	 */
+	void set_discovery_filter_supported(bool supported);
+
+	/**
+	 * Adds a device, as if it had been found during discovery.
+	 *
+	 * If a discovery is running and its filter has a pattern, the device
+	 * is only added if its address matches that pattern (or if it is
+	 * paired). If a device with that address already exists, this does
+	 * nothing.
+	 *
+	 * @param address Bluetooth address of the new device.
+	 * @param name Name of the new device.
+	 * @param paired Whether or not the new device is already paired.
+	 */
+	void add_device(bluetooth_address const &address, std::string name, bool paired);
+
+	/**
+	 * Adds a number of unpaired devices with random addresses.
+	 *
+	 * The addresses never start with the Combo's address prefix.
+	 * This is meant for simulating a crowded environment.
+	 *
+	 * @param count Number of devices to add.
+	 * @param seed Seed for the random address generator.
+	 */
+	void add_random_devices(std::size_t count, std::uint32_t seed = 1);
+
+	/**
+	 * Removes a device, as if BlueZ had forgotten it.
+	 */
+	void remove_device(bluetooth_address const &address);
+
+	/**
+	 * Pairs a device, as if the device had initiated pairing.
+	 *
+	 * If an agent is registered, its RequestPinCode method is called first.
+	 * If the agent rejects the request, the device stays unpaired.
+	 */
+	void pair_device(bluetooth_address const &address);
+
+	/**
+	 * Unpairs a device, as if the user had removed it with bluetoothctl.
+	 *
+	 * Like BlueZ, this sets the device's Paired property to false
+	 * and then removes the device object.
+	 */
+	void unpair_device(bluetooth_address const &address);
+
+	/**
+	 * Emits RSSI PropertiesChanged signals for the existing devices.
+	 *
+	 * BlueZ emits these constantly during discovery. The signals are
+	 * distributed over all devices in a round robin fashion.
+	 *
+	 * @param count Number of signals to emit.
+	 */
+	void emit_rssi_updates(std::size_t count);
+
+	/**
+	 * Waits until all events posted so far were executed.
+	 */
+	void sync();
+
+	/**
+	 * Waits until a discovery is running.
+	 *
+	 * @param timeout How long to wait at most.
+	 * @return true if a discovery is running, false if the timeout was reached.
+	 */
+	bool wait_for_discovery(std::chrono::milliseconds timeout);
+
+	/**
+	 * Returns the pattern of the discovery filter that is currently set.
+	 *
+	 * @return The pattern, an empty string if the filter has no pattern,
+	 *         or std::nullopt if no filter was set.
+	 */
+	std::optional<std::string> get_discovery_filter_pattern() const;
+
+	/**
+	 * Returns the time of the most recent StartDiscovery call.
+	 */
+	std::optional<std::chrono::steady_clock::time_point> get_last_discovery_start_timestamp() const;
+
+	/**
+	 * Returns statistics about this service.
+	 *
+	 * This can be called from any thread.
+	 */
+	mock_bluez_service_stats get_stats() const;
+
+
+private:
+	struct mock_device
+	{
+		std::string m_address;
+		std::string m_name;
+		bool m_paired = false;
+		std::int16_t m_rssi = -60;
+		guint m_registration_id = 0;
+	};
+
+	typedef std::map<std::string, mock_device> device_map;
+
+	void thread_func(std::string const &bus_address, std::promise<std::exception_ptr> &startup_promise);
+	void connect_and_register(std::string const &bus_address);
+	void cleanup();
+	void post(std::function<void()> func);
+	void reply_after_latency(std::function<void()> func);
+	void attach_function_source(GSource *source, std::function<void()> func);
+
+	void register_static_objects();
+	void register_device_object(std::string const &object_path, mock_device &device);
+
+	void handle_method_call(GDBusMethodInvocation *invocation, gchar const *sender, gchar const *object_path, gchar const *interface_name, gchar const *method_name, GVariant *parameters);
+	void handle_adapter_method_call(GDBusMethodInvocation *invocation, gchar const *method_name, GVariant *parameters);
+	void handle_agent_manager_method_call(GDBusMethodInvocation *invocation, gchar const *sender, gchar const *method_name, GVariant *parameters);
+	void handle_profile_manager_method_call(GDBusMethodInvocation *invocation, gchar const *method_name, GVariant *parameters);
+	GVariant* get_property(gchar const *object_path, gchar const *interface_name, gchar const *property_name, GError **error);
+
+	GVariant* build_managed_objects();
+	GVariant* build_adapter_properties();
+	GVariant* build_device_properties(mock_device const &device);
+
+	void add_device_impl(std::string const &address, std::string name, bool paired);
+	void remove_device_impl(std::string const &object_path);
+	void set_device_paired(std::string const &object_path, bool paired);
+	void set_discovering(bool discovering);
+	void emit_properties_changed(std::string const &object_path, gchar const *interface_name, GVariant *changed_properties);
+	void emit_signal(gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters);
+
+	std::string get_device_object_path(std::string const &address) const;
+
+	std::string const m_adapter_address;
+	std::string const m_adapter_name;
+
+	std::thread m_thread;
+	bool m_started;
+
+	// These are only accessed by the internal thread,
+	// except for setup and teardown in start() and stop().
+	GMainContext *m_context;
+	GMainLoop *m_mainloop;
+	GDBusConnection *m_connection;
+	GDBusNodeInfo *m_node_info;
+	std::vector<guint> m_static_registration_ids;
+	device_map m_devices;
+	std::optional<std::string> m_agent_owner;
+	std::string m_agent_path;
+	std::map<std::string, std::string> m_profiles;
+	std::string m_discovery_pattern;
+
+	std::atomic<std::int64_t> m_response_latency_ms;
+	std::atomic<bool> m_discovery_filter_pattern_supported;
+	std::atomic<bool> m_discovery_filter_supported;
+
+	// Guards the discovery state and the statistics, since
+	// these can be accessed from outside the internal thread.
+	mutable std::mutex m_state_mutex;
+	std::condition_variable m_discovery_condvar;
+	bool m_discovering;
+	std::optional<std::string> m_discovery_filter_pattern;
+	std::optional<std::chrono::steady_clock::time_point> m_last_discovery_start_timestamp;
+	mock_bluez_service_stats m_stats;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MOCK_BLUEZ_SERVICE_HPP
@@ -0,0 +1,59 @@
+#ifndef COMBOCTL_PRIVATE_DBUS_DAEMON_HPP
+#define COMBOCTL_PRIVATE_DBUS_DAEMON_HPP
+
+#include <glib.h>
+#include <string>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Runs a private dbus-daemon instance as a child process.
+ *
+ * The daemon uses the session bus configuration, so it does not need
+ * root privileges, and it does not interfere with the system bus.
+ * The daemon is stopped by the destructor.
+ */
+class private_dbus_daemon
+{
+public:
+	/**
+	 * Constructor.
+	 *
+	 * Starts the daemon and waits until it printed its address.
+	 *
+	 * @param dbus_daemon_path Path to the dbus-daemon executable.
+	 *        If it contains no slash, it is looked up in PATH.
+	 * @throws io_exception if the daemon cannot be started
+	 *         or if it does not print its address.
+	 */
+	explicit private_dbus_daemon(std::string const &dbus_daemon_path = "dbus-daemon");
+
+	/**
+	 * Destructor.
+	 *
+	 * Terminates the daemon and waits until it exited.
+	 */
+	~private_dbus_daemon();
+
+	private_dbus_daemon(private_dbus_daemon const &) = delete;
+	private_dbus_daemon& operator = (private_dbus_daemon const &) = delete;
+
+	/**
+	 * Returns the D-Bus address clients can connect to.
+	 */
+	std::string const & get_address() const;
+
+
+private:
+	GPid m_pid;
+	std::string m_address;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_PRIVATE_DBUS_DAEMON_HPP
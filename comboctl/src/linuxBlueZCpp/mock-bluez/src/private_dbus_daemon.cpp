@@ -0,0 +1,103 @@
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <fmt/format.h>
+#include "private_dbus_daemon.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("PrivateDBusDaemon")
+
+
+namespace comboctl
+{
+
+
+private_dbus_daemon::private_dbus_daemon(std::string const &dbus_daemon_path)
+	: m_pid(0)
+{
+	GError *error = nullptr;
+	gint stdout_fd = -1;
+
+	gchar *argv[] = {
+		const_cast<gchar *>(dbus_daemon_path.c_str()),
+		const_cast<gchar *>("--session"),
+		const_cast<gchar *>("--nofork"),
+		const_cast<gchar *>("--nopidfile"),
+		const_cast<gchar *>("--print-address=1"),
+		nullptr
+	};
+
+	gboolean spawned = g_spawn_async_with_pipes(
+		nullptr,
+		argv,
+		nullptr,
+		GSpawnFlags(G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD),
+		nullptr,
+		nullptr,
+		&m_pid,
+		nullptr,
+		&stdout_fd,
+		nullptr,
+		&error
+	);
+	if (!spawned)
+	{
+		std::string message = fmt::format("Could not start {}: {}", dbus_daemon_path, (error != nullptr) ? error->message : "<unknown error>");
+		if (error != nullptr)
+			g_error_free(error);
+		throw io_exception(message);
+	}
+
+	// The daemon prints its address as one line once it is ready
+	// to accept connections. Read byte by byte until the newline
+	// to not consume anything that comes after it.
+	while (true)
+	{
+		char c;
+		ssize_t num_read = read(stdout_fd, &c, 1);
+
+		if ((num_read < 0) && (errno == EINTR))
+			continue;
+
+		if (num_read <= 0)
+		{
+			close(stdout_fd);
+			kill(m_pid, SIGTERM);
+			waitpid(m_pid, nullptr, 0);
+			g_spawn_close_pid(m_pid);
+			throw io_exception(fmt::format("{} exited without printing its address", dbus_daemon_path));
+		}
+
+		if (c == '\n')
+			break;
+
+		m_address += c;
+	}
+
+	close(stdout_fd);
+
+	LOG(debug, "Started private dbus-daemon with PID {} and address {}", m_pid, m_address);
+}
+
+
+private_dbus_daemon::~private_dbus_daemon()
+{
+	kill(m_pid, SIGTERM);
+	waitpid(m_pid, nullptr, 0);
+	g_spawn_close_pid(m_pid);
+
+	LOG(debug, "Stopped private dbus-daemon with PID {}", m_pid);
+}
+
+
+std::string const & private_dbus_daemon::get_address() const
+{
+	return m_address;
+}
+
+
+} // namespace comboctl end
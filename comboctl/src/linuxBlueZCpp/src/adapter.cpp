@@ -1,9 +1,7 @@
 #include <optional>
 #include <assert.h>
-#include "scope_guard.hpp"
-#include "gerror_exception.hpp"
 #include "adapter.hpp"
-#include "glib_misc.hpp"
+#include "exception.hpp"
 #include "log.hpp"
 
 
@@ -14,23 +12,8 @@ namespace comboctl
 {
 
 
-namespace
-{
-
-
-constexpr gchar const *obj_array_gvformat_string = "(a{oa{sa{sv}}})";
-
-
-} // unnamed namespace end
-
-
-adapter::adapter()
-	: m_dbus_connection(nullptr)
-	, m_adapter_proxy(nullptr)
-	, m_dbus_connection_signal_subscription(0)
-	, m_discovery_started(false)
-{
-}
+// The constructor, setup(), teardown(), get_name(), and the send_*_call()
+// and process_*() functions are in the backend specific source files.
 
 
 adapter::~adapter()
@@ -39,178 +22,32 @@ adapter::~adapter()
 }
 
 
-void adapter::setup(GDBusConnection *dbus_connection)
+void adapter::on_device_unpaired(device_unpaired_callback callback)
 {
-	// Prerequisites.
-
-	GError *error = nullptr;
-
-	assert(dbus_connection != nullptr);
-
-	if (m_dbus_connection_signal_subscription != 0)
-		throw invalid_call_exception("Adapter already set up");
-
-	// Store the arguments.
-	m_dbus_connection = dbus_connection;
-
-	// Install scope guard to call teardown() if something
-	// goes wrong. This makes sure that any changes done
-	// by this function are rolled back then.
-	auto guard = make_scope_guard([&]() { teardown(); });
-
-	std::string adapter_object_path;
-
-	// Go through all of BlueZ's managed D-Bus objects
-	// to find the first Bluetooth adapter available.
-	{
-		gvariant_uptr managed_objects_gvariant = get_managed_bluez_objects();
-		gvariant_iter_uptr object_iter = get_gvariant_iter_from(managed_objects_gvariant, obj_array_gvformat_string);
-
-		gchar *object_path;
-		GVariant *interfaces_dict_variant;
-		while (g_variant_iter_loop(object_iter.get(), "{o*}", &object_path, &interfaces_dict_variant))
-		{
-			gvariant_iter_uptr interface_iter = get_gvariant_iter_from(interfaces_dict_variant, "a{sa{sv}}");
-
-			GVariantIter *properties_iter;
-			gchar const *interface_name;
-			while (g_variant_iter_loop(interface_iter.get(), "{sa{sv}}", &interface_name, &properties_iter))
-			{
-				if (g_strcmp0(interface_name, "org.bluez.Adapter1") == 0)
-				{
-					adapter_object_path = object_path;
-
-					LOG(trace, "Found adapter object path {}", adapter_object_path);
-					break;
-				}
-			}
-		}
-	}
-
-	if (adapter_object_path.empty())
-		throw comboctl::io_exception("No Bluetooth adapter found");
-
-	// Get the proxy object for future adapter calls.
-	m_adapter_proxy = g_dbus_proxy_new_sync(
-		m_dbus_connection,
-		G_DBUS_PROXY_FLAGS_NONE,
-		nullptr,
-		"org.bluez",
-		adapter_object_path.c_str(),
-		"org.bluez.Adapter1",
-		nullptr,
-		&error
-	);
-	if (error != nullptr)
-	{
-		LOG(error, "Could not create Adapter GDBus proxy: {}", error->message);
-		throw gerror_exception(error);
-	}
-
-	// Set up our BlueZ D-Bus signal handler so we can get
-	// notifications when Bluetooth devices appear / vanish.
-
-	static auto static_dbus_connection_signal_cb = [](GDBusConnection *, gchar const *sender_name, gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters, gpointer user_data) -> void
-	{
-		LOG(trace,
-			"Got DBus signal \"{}\" from sender \"{}\" (object path = \"{}\" interface name = \"{}\" parameters type = \"{}\"; parameters = {})",
-			signal_name,
-			sender_name,
-			object_path,
-			interface_name,
-			g_variant_get_type_string(parameters),
-			to_string(parameters)
-		);
-
-		reinterpret_cast<adapter*>(user_data)->dbus_connection_signal_cb(
-			object_path,
-			interface_name,
-			signal_name,
-			parameters
-		);
-	};
-
-	m_dbus_connection_signal_subscription = g_dbus_connection_signal_subscribe(
-		m_dbus_connection,
-		"org.bluez",
-		nullptr,
-		nullptr,
-		nullptr,
-		nullptr,
-		G_DBUS_SIGNAL_FLAGS_NONE,
-		static_dbus_connection_signal_cb,
-		gpointer(this),
-		nullptr
-	);
-
-	// Look up what Bluetooth devices BlueZ already knows
-	// of (that is, were discovered earlier already).
-	gvariant_uptr managed_objects_gvariant = get_managed_bluez_objects();
-
-	LOG(debug, "Got list of DBus objects currently managed by BlueZ");
-
-	// We are ready to iterate over the enumerated objects. Get
-	// an iterator out of the retval GVariant and look at
-	// each enumerated object to see if it has the relevant
-	// Bluetooth device interface.
-	gvariant_iter_uptr iter = get_gvariant_iter_from(managed_objects_gvariant, obj_array_gvformat_string);
-
-	gchar *object_path;
-	GVariant *interfaces_dict_variant;
-	while (g_variant_iter_loop(iter.get(), "{o*}", &object_path, &interfaces_dict_variant))
-		process_added_dbus_object_interfaces(object_path, interfaces_dict_variant);
-
-	// Our adapter is ready. Dismiss the guard to make
-	// sure it is not torn down again.
-
-	guard.dismiss();
-
-	LOG(debug, "Adapter set up");
+	m_on_device_unpaired = std::move(callback);
 }
 
 
-void adapter::teardown()
+void adapter::on_device_link_lost(device_link_lost_callback callback)
 {
-	// Stop any ongoing discovery.
-	stop_discovery();
-
-	if (m_dbus_connection_signal_subscription != 0)
-	{
-		g_dbus_connection_signal_unsubscribe(m_dbus_connection, m_dbus_connection_signal_subscription);
-		m_dbus_connection_signal_subscription = 0;
-	}
-
-	if (m_adapter_proxy != nullptr)
-	{
-		g_object_unref(G_OBJECT(m_adapter_proxy));
-		m_adapter_proxy = nullptr;
-	}
-
-	m_dbus_connection = nullptr;
-
-	// Clear the map to make sure there is no leftover stale data.
-	m_bt_address_dbus_object_paths.clear();
-
-	LOG(debug, "Adapter torn down");
+	m_on_device_link_lost = std::move(callback);
 }
 
 
-void adapter::on_device_unpaired(device_unpaired_callback callback)
+void adapter::set_device_filter(filter_device_callback callback)
 {
-	m_on_device_unpaired = std::move(callback);
+	m_device_filter = std::move(callback);
 }
 
 
-void adapter::set_device_filter(filter_device_callback callback)
+void adapter::set_discovery_address_pattern(std::string pattern)
 {
-	m_device_filter = std::move(callback);
+	m_discovery_address_pattern = std::move(pattern);
 }
 
 
 void adapter::start_discovery(found_new_paired_device_callback on_found_new_device)
 {
-	GError *error = nullptr;
-
 	// on_found_new_device must be valid.
 	assert(on_found_new_device);
 
@@ -227,7 +64,9 @@ void adapter::start_discovery(found_new_paired_device_callback on_found_new_devi
 		return;
 	}
 
-	// Start the discovery.
+	// Let BlueZ drop devices we are not interested in before
+	// they reach us. Then start the discovery.
+	set_discovery_filter();
 	send_discovery_call(true);
 
 	m_discovery_started = true;
@@ -236,12 +75,12 @@ void adapter::start_discovery(found_new_paired_device_callback on_found_new_devi
 }
 
 
-void adapter::stop_discovery()
+void adapter::stop_discovery(std::optional<std::chrono::steady_clock::time_point> reply_deadline)
 {
 	if (!m_discovery_started)
 		return;
 
-	send_discovery_call(false);
+	send_discovery_call(false, reply_deadline);
 
 	m_discovery_started = false;
 
@@ -252,430 +91,264 @@ void adapter::stop_discovery()
 void adapter::remove_device(bluetooth_address const &device_address)
 {
 	// Get the D-Bus object path for the device with this address.
-	auto bt_object_path_iter = m_bt_address_dbus_object_paths.left.find(device_address);
-	if (bt_object_path_iter == m_bt_address_dbus_object_paths.left.end())
+	device_table::entry const *device_entry = m_observed_devices.find(device_address);
+	if ((device_entry == nullptr) || device_entry->m_object_path.empty())
 	{
 		LOG(debug, "No device with Bluetooth address {} known; nothing to remove", to_string(device_address));
 		return;
 	}
 
-	std::string const &object_path = bt_object_path_iter->second;
+	std::string const &object_path = device_entry->m_object_path;
 
 	LOG(debug, "Removing device with Bluetooth address {} and DBus object path {}", to_string(device_address), object_path);
 
-	g_dbus_proxy_call_sync(
-		m_adapter_proxy,
-		"RemoveDevice",
-		g_variant_new("(o)", object_path.c_str()),
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		nullptr,
-		nullptr
-	);
+	send_remove_device_call(object_path);
 
-	m_bt_address_dbus_object_paths.left.erase(bt_object_path_iter);
+	m_observed_devices.clear_object_path(device_address);
 }
 
 
-std::string adapter::get_name() const
+bluetooth_address_set adapter::get_paired_device_addresses() const
 {
-	GVariant *variant = g_dbus_proxy_get_cached_property(m_adapter_proxy, "Name");
-	if (variant == nullptr)
-		throw io_exception("DBus Adapter object has no Name property");
-
-	gsize name_cstr_size = 0;
-	gchar const *name_cstr = g_variant_get_string(variant, &name_cstr_size);
-	if (name_cstr == nullptr)
-	{
-		throw io_exception("DBus Adapter object has Name property that is not a string");
-	}
-
-	std::string name(name_cstr, name_cstr_size);
+	return m_observed_devices.get_paired_device_addresses();
+}
 
-	LOG(debug, "Got friendly name for Bluetooth adapter: \"{}\"", name);
 
-	return name;
+std::optional<bluetooth_address> adapter::find_device_address(std::string const &object_path) const
+{
+	return m_observed_devices.find_address(object_path);
 }
 
 
-bluetooth_address_set adapter::get_paired_device_addresses() const
+void adapter::set_max_observed_devices(std::size_t max_num_devices)
 {
-	bluetooth_address_set addresses;
+	m_observed_devices.set_max_num_devices(max_num_devices);
+}
 
-	for (auto const &element : m_observed_devices)
-	{
-		bool is_paired = element.second;
-		if (is_paired)
-			addresses.insert(element.first);
-	}
 
-	return addresses;
+device_table_stats adapter::get_device_table_stats() const
+{
+	return m_observed_devices.get_stats();
 }
 
 
-void adapter::send_discovery_call(bool do_start)
+void adapter::set_discovery_filter()
 {
-	GError *error = nullptr;
-
-	g_dbus_proxy_call_sync(
-		m_adapter_proxy,
-		do_start ? "StartDiscovery" : "StopDiscovery",
-		nullptr,
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		nullptr,
-		&error
-	);
-	if (error != nullptr)
+	// Without a filter, BlueZ scans for LE and BR/EDR devices,
+	// and emits signals for every device in range, all of which
+	// then have to go through our device filter. With the filter,
+	// BlueZ only scans for BR/EDR devices (which shortens the
+	// discovery cycles) and only creates objects for devices whose
+	// address matches the pattern. The Pattern key was added in
+	// BlueZ 5.54; older versions reject the whole filter as invalid,
+	// so in that case, we retry without the pattern. If even that
+	// fails, we continue without a filter; the device filter still
+	// makes sure that only the devices we want get through.
+
+	bool include_pattern = !m_discovery_address_pattern.empty();
+
+	if (send_set_discovery_filter_call(include_pattern))
+		return;
+
+	if (include_pattern && send_set_discovery_filter_call(false))
 	{
-		LOG(error, "Could not {} discovery: {}", do_start ? "start" : "stop", error->message);
-		if (do_start)
-			throw gerror_exception(error);
+		LOG(info, "BlueZ does not support discovery filter patterns; filtering by address ourselves");
+		return;
 	}
+
+	LOG(warn, "Could not set discovery filter; discovering without filter");
 }
 
 
-void adapter::handle_observed_device(bluetooth_address const &bdaddr, bool is_paired)
+void adapter::add_observed_device(std::string_view object_path, bluetooth_address const &bdaddr, bool is_paired, bool is_connected)
 {
-	// This is called when a new device shows up (handled in
-	// process_added_dbus_object_interfaces) or if the Device1
-	// property in its D-Bus object has its "Paired" property
-	// changed (process_dbus_object_interface_property_changes()
-	// deals with this). In all cases, the device filter is
-	// applied first; that is, this is never called for a device
-	// that does not pass that filter.
-
-	auto device_iter = m_observed_devices.find(bdaddr);
-	std::optional<bool> old_is_paired_flag;
-
-	if (device_iter != m_observed_devices.end())
-		old_is_paired_flag = device_iter->second;
-	else
-		old_is_paired_flag = std::nullopt;
+	LOG(debug, "Found new Bluetooth device:  object path: {}  Bluetooth address: {}  paired: {}", object_path, to_string(bdaddr), is_paired);
 
-	m_observed_devices[bdaddr] = is_paired;
+	// Check if the device passes the filter.
+	// If not, we skip the entire device.
+	if (!filter_device(bdaddr))
+		return;
 
-	if (is_paired)
-	{
-		if ((old_is_paired_flag == std::nullopt) || !(*old_is_paired_flag))
-		{
-			// Invoke m_on_found_new_device and catch any thrown
-			// exceptions. It is important to do that, since we
-			// reach this point after dbus_connection_signal_cb()
-			// was called by GLib, and an exception traveling
-			// through there results in undefined behavior.
-			if (m_on_found_new_device)
-			{
-				try
-				{
-					m_on_found_new_device(bdaddr);
-				}
-				catch (comboctl::exception const &exc)
-				{
-					LOG(error, "Caught exception: {}", exc.what());
-				}
-			}
-		}
-	}
-	else
-	{
-		if ((old_is_paired_flag != std::nullopt) && (*old_is_paired_flag))
-		{
-			// Invoke m_on_device_unpaired and catch any thrown
-			// exceptions. It is important to do that, since we
-			// reach this point after dbus_connection_signal_cb()
-			// was called by GLib, and an exception traveling
-			// through there results in undefined behavior.
-			if (m_on_device_unpaired)
-			{
-				try
-				{
-					m_on_device_unpaired(bdaddr);
-				}
-				catch (comboctl::exception const &exc)
-				{
-					LOG(error, "Caught exception: {}", exc.what());
-				}
-			}
-		}
-	}
+	m_observed_devices.add(bdaddr, std::string(object_path), is_connected);
+
+	handle_observed_device(bdaddr, is_paired);
 }
 
 
-void adapter::process_added_dbus_object_interfaces(gchar const *object_path, GVariant *interfaces_dict_variant)
+void adapter::handle_removed_device_object(std::string_view object_path)
 {
-	GVariantIter *properties_iter;
-	gchar const *interface_name;
-	gchar const *property_name;
-	GVariant *property_value;
+	// This is called when the org.bluez.Device1 interface was removed
+	// from a D-Bus object, which happens most notably when the object
+	// is removed, for example because the Bluetooth device was deleted
+	// from the list of known devices.
 
-	// Look through the GVariant data. Access requires type
-	// information at runtime (which is what strings like "{sv}"
-	// are for), and is somewhat complex, since the data is
-	// made of nested structures.
+	std::optional<bluetooth_address> found_bdaddr = m_observed_devices.find_address(object_path);
+	if (!found_bdaddr)
+	{
+		LOG(trace, "No device with D-Bus object path {} known; ignoring removed interface", object_path);
+		return;
+	}
 
-	gvariant_iter_uptr interface_iter = get_gvariant_iter_from(interfaces_dict_variant, "a{sa{sv}}");
+	bluetooth_address bdaddr = *found_bdaddr;
+	bool is_paired = m_observed_devices.find(bdaddr)->m_paired.value_or(false);
 
-	while (g_variant_iter_loop(interface_iter.get(), "{sa{sv}}", &interface_name, &properties_iter))
-	{
-		// We are only interested in the org.bluez.Device1 interface.
-		if (g_strcmp0(interface_name, "org.bluez.Device1") != 0)
-			continue;
+	// Check if the device passes the filter.
+	// If not, we skip the entire device.
+	if (!filter_device(bdaddr))
+		return;
 
-		std::optional<bluetooth_address> bdaddr;
-		bool is_paired = false;
+	// Remove the device from the table of observed devices.
+	m_observed_devices.erase(bdaddr);
 
-		// Look at the properties of the interface. We are interested
-		// in the "Address" (the Bluetooth address) and the "Paired"
-		// (whether or not this device is paired) properties.
-		while (g_variant_iter_loop(properties_iter, "{sv}", &property_name, &property_value))
+	// Invoke m_on_device_unpaired and catch any thrown
+	// exceptions. It is important to do that, since we
+	// reach this point from a D-Bus signal handler, and
+	// an exception traveling through the D-Bus signal
+	// dispatching results in undefined behavior.
+	if (m_on_device_unpaired && is_paired)
+	{
+		try
 		{
-			if (g_strcmp0(property_name, "Address") == 0)
-			{
-				gchar const *prop_str = g_variant_get_string(property_value, nullptr);
-
-				bluetooth_address found_bdaddr;
-				if (!comboctl::from_string(found_bdaddr, prop_str))
-				{
-					// Skip invalid Bluetooth addresses.
-					LOG(error, "Invalid Bluetooth address \"{}\"", prop_str);
-					continue;
-				}
-				bdaddr = std::move(found_bdaddr);
-			}
-			else if (g_strcmp0(property_name, "Paired") == 0)
-			{
-				is_paired = g_variant_get_boolean(property_value);
-			}
+			m_on_device_unpaired(bdaddr);
 		}
-
-		if (bdaddr)
+		catch (comboctl::exception const &exc)
 		{
-			LOG(debug, "Found new Bluetooth device:  object path: {}  Bluetooth address: {}  paired: {}", object_path, to_string(*bdaddr), is_paired);
-
-			// Check if the device passes the filter.
-			// If not, we skip the entire device.
-			if (!filter_device(*bdaddr))
-				return;
-
-			m_bt_address_dbus_object_paths.insert(bt_address_dbus_object_paths_map::value_type(*bdaddr, std::string(object_path)));
-
-			handle_observed_device(*bdaddr, is_paired);
+			LOG(error, "Caught exception: {}", exc.what());
 		}
-
-		break;
 	}
 }
 
 
-void adapter::process_removed_dbus_object_interfaces(gchar const *object_path, GVariant *interfaces_array_variant)
+void adapter::handle_device_property_changes(std::string_view object_path, std::optional<bool> is_connected, std::optional<bool> is_paired)
 {
-	gchar const *interface_name;
-
-	// Look through the GVariant data. Access requires type
-	// information at runtime (which is what strings like "{sv}"
-	// are for), and is somewhat complex, since the data is
-	// made of nested structures.
-
-	auto bt_address_iter = m_bt_address_dbus_object_paths.right.find(object_path);
-	if (bt_address_iter == m_bt_address_dbus_object_paths.right.end())
+	std::optional<bluetooth_address> found_bdaddr = m_observed_devices.find_address(object_path);
+	if (!found_bdaddr)
 	{
-		LOG(trace, "No device with D-Bus object path {} known; ignoring removed interface", object_path);
+		// The device may have been evicted from the table of observed
+		// devices while BlueZ kept its object (see device_table). Such
+		// a device must not be missed if it gets paired, so re-admit
+		// it, using the properties of its object. Devices that did not
+		// pass the filter end up here as well; they are dropped again
+		// by add_observed_device().
+		if (is_paired && *is_paired)
+		{
+			LOG(debug, "Unknown device with D-Bus object path {} got paired; fetching its properties", object_path);
+			readmit_device_object(object_path);
+		}
+		else
+			LOG(trace, "No device with D-Bus object path {} known; not checking property modifications", object_path);
 		return;
 	}
 
-	bluetooth_address bdaddr = std::move(bt_address_iter->second);
+	bluetooth_address const &bdaddr = *found_bdaddr;
 
-	auto observed_devices_iter = m_observed_devices.find(bdaddr);
-	if (observed_devices_iter == m_observed_devices.end())
-	{
-		LOG(trace, "No device with Bluetooth address {} known; ignoring removed interface", to_string(bdaddr));
-		return;
-	}
+	// Any property change (RSSI updates in particular)
+	// means that the device was seen recently.
+	m_observed_devices.touch(bdaddr);
 
-	bool is_paired = observed_devices_iter->second;
+	if (is_connected)
+	{
+		bool was_connected = m_observed_devices.set_connected(bdaddr, *is_connected);
 
-	gvariant_iter_uptr interface_iter = get_gvariant_iter_from(interfaces_array_variant, "as");
+		LOG(debug, "Device with Bluetooth address {} is now {}", to_string(bdaddr), *is_connected ? "connected" : "disconnected");
 
-	while (g_variant_iter_loop(interface_iter.get(), "s", &interface_name))
-	{
-		// We are only interested in the org.bluez.Device1 interface.
-		if (g_strcmp0(interface_name, "org.bluez.Device1") != 0)
-			continue;
-
-		// Check if the device passes the filter.
-		// If not, we skip the entire device.
-		if (!filter_device(bdaddr))
-			return;
-
-		// Remove the device from the bimap.
-		m_bt_address_dbus_object_paths.right.erase(bt_address_iter);
-		bt_address_iter = m_bt_address_dbus_object_paths.right.end();
-
-		// Remove the device from the list of observed devices.
-		m_observed_devices.erase(observed_devices_iter);
-
-		// Invoke m_on_device_unpaired and catch any thrown
-		// exceptions. It is important to do that, since we
-		// reach this point after dbus_connection_signal_cb()
-		// was called by GLib, and an exception traveling
-		// through there results in undefined behavior.
-		if (m_on_device_unpaired && is_paired)
+		if (was_connected && !(*is_connected) && m_on_device_link_lost)
 		{
+			// Same as with the other callbacks, exceptions
+			// must not travel through the signal handling.
 			try
 			{
-				m_on_device_unpaired(bdaddr);
+				m_on_device_link_lost(bdaddr);
 			}
 			catch (comboctl::exception const &exc)
 			{
 				LOG(error, "Caught exception: {}", exc.what());
 			}
 		}
-
-		break;
 	}
-}
 
-
-void adapter::process_dbus_object_interface_property_changes(gchar const *object_path, gchar const *interface_name, GVariant *property_changes_dict_variant)
-{
-	if (g_strcmp0(interface_name, "org.bluez.Device1") != 0)
-		return;
-
-	auto bt_address_iter = m_bt_address_dbus_object_paths.right.find(object_path);
-	if (bt_address_iter == m_bt_address_dbus_object_paths.right.end())
-	{
-		LOG(trace, "No device with D-Bus object path {} known; not checking property modifications", object_path);
-		return;
-	}
-
-	bluetooth_address const &bdaddr = bt_address_iter->second;
-
-	GVariant *paired_value_variant = g_variant_lookup_value(property_changes_dict_variant, "Paired", nullptr);
-	if (paired_value_variant == nullptr)
-	{
-		LOG(trace, "Property changes for D-Bus object {} contain no changes to the Paired value; ignoring changes", object_path);
-		return;
-	}
-	if (!g_variant_is_of_type(paired_value_variant, G_VARIANT_TYPE_BOOLEAN))
+	if (!is_paired)
 	{
-		LOG(trace, "Property changes for D-Bus object {} contain changes to the Paired value, but value is not a boolean; ignoring changes", object_path);
+		LOG(trace, "Property changes for D-Bus object {} contain no boolean Paired value; ignoring changes", object_path);
 		return;
 	}
 
-	bool is_paired = g_variant_get_boolean(paired_value_variant);
-
 	LOG(
 		trace,
 		"Paired status of device with Bluetooth address {} and D-Bus object path {} is now: {}",
 		comboctl::to_string(bdaddr),
 		object_path,
-		is_paired
+		*is_paired
 	);
 
-	if (!is_paired)
+	if (!(*is_paired))
 		return;
 
-	handle_observed_device(bdaddr, is_paired);
+	handle_observed_device(bdaddr, *is_paired);
 }
 
 
-void adapter::dbus_connection_signal_cb(gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters)
+void adapter::handle_observed_device(bluetooth_address const &bdaddr, bool is_paired)
 {
-	if (g_strcmp0(interface_name, "org.freedesktop.DBus.ObjectManager") == 0)
-	{
-		if (g_strcmp0(signal_name, "InterfacesAdded") == 0)
-		{
-			// An interface was added to a D-Bus object. This is how we
-			// can find devices that got detected by BlueZ. When one is
-			// detected, BlueZ creates a new D-Bus object and adds an
-			// org.bluez.Device1 interface to it.
-
-			gchar *added_if_object_path;
-			GVariant *interfaces_dict_variant;
-			g_variant_get(parameters, "(o*)", &added_if_object_path, &interfaces_dict_variant);
+	// This is called when a new device shows up (handled in
+	// add_observed_device()) or if the Device1 property in
+	// its D-Bus object has its "Paired" property changed
+	// (handle_device_property_changes() deals with this).
+	// In all cases, the device filter is applied first;
+	// that is, this is never called for a device that
+	// does not pass that filter.
 
-			auto dict_variant_guard = make_scope_guard([&]() {
-				g_free(added_if_object_path);
-				g_variant_unref(interfaces_dict_variant);
-			});
+	std::optional<bool> old_is_paired_flag = m_observed_devices.set_paired(bdaddr, is_paired);
 
-			process_added_dbus_object_interfaces(added_if_object_path, interfaces_dict_variant);
-		}
-		else if (g_strcmp0(signal_name, "InterfacesRemoved") == 0)
+	if (is_paired)
+	{
+		if ((old_is_paired_flag == std::nullopt) || !(*old_is_paired_flag))
 		{
-			// An interface was removed from a D-Bus object. This happens
-			// most notably when an object is removed, for example because
-			// the Bluetooth device was deleted from the list of known
-			// devices. In that case, we want to remove that device from
-			// the m_bt_address_dbus_object_paths bimap.
-
-			gchar *added_if_object_path;
-			GVariant *interfaces_array_variant;
-			g_variant_get(parameters, "(o*)", &added_if_object_path, &interfaces_array_variant);
-
-			auto dict_variant_guard = make_scope_guard([&]() {
-				g_free(added_if_object_path);
-				g_variant_unref(interfaces_array_variant);
-			});
-
-			process_removed_dbus_object_interfaces(added_if_object_path, interfaces_array_variant);
+			// Invoke m_on_found_new_device and catch any thrown
+			// exceptions. It is important to do that, since we
+			// reach this point after dbus_connection_signal_cb()
+			// was called by the D-Bus signal dispatching, and an
+			// exception traveling through there results in
+			// undefined behavior.
+			if (m_on_found_new_device)
+			{
+				try
+				{
+					m_on_found_new_device(bdaddr);
+				}
+				catch (comboctl::exception const &exc)
+				{
+					LOG(error, "Caught exception: {}", exc.what());
+				}
+			}
 		}
 	}
-	else if (g_strcmp0(interface_name, "org.freedesktop.DBus.Properties") == 0)
+	else
 	{
-		if (g_strcmp0(signal_name, "PropertiesChanged") == 0)
+		if ((old_is_paired_flag != std::nullopt) && (*old_is_paired_flag))
 		{
-			// A D-Bus object's properties got changed. We check this
-			// to see if the paired status changed.
-
-			gchar *changed_interface_name;
-			GVariant *property_changes_dict_variant;
-			GVariantIter *removed_properties_iter;
-			g_variant_get(parameters, "(s*as)", &changed_interface_name, &property_changes_dict_variant, &removed_properties_iter);
-
-			auto dict_variant_guard = make_scope_guard([&]() {
-				g_free(changed_interface_name);
-				g_variant_unref(property_changes_dict_variant);
-				g_variant_iter_free(removed_properties_iter);
-			});
-
-			process_dbus_object_interface_property_changes(object_path, changed_interface_name, property_changes_dict_variant);
+			// Invoke m_on_device_unpaired and catch any thrown
+			// exceptions. It is important to do that, since we
+			// reach this point after dbus_connection_signal_cb()
+			// was called by the D-Bus signal dispatching, and an
+			// exception traveling through there results in
+			// undefined behavior.
+			if (m_on_device_unpaired)
+			{
+				try
+				{
+					m_on_device_unpaired(bdaddr);
+				}
+				catch (comboctl::exception const &exc)
+				{
+					LOG(error, "Caught exception: {}", exc.what());
+				}
+			}
 		}
 	}
 }
 
 
-gvariant_uptr adapter::get_managed_bluez_objects()
-{
-	GError *error = nullptr;
-
-	// Look up what Bluetooth devices BlueZ already knows
-	// of (that is, were discovered earlier already).
-	GVariant *retval = g_dbus_connection_call_sync(
-		m_dbus_connection,
-		"org.bluez",
-		"/",
-		"org.freedesktop.DBus.ObjectManager",
-		"GetManagedObjects",
-		nullptr,
-		G_VARIANT_TYPE("(a{oa{sa{sv}}})"),
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		nullptr,
-		&error
-	);
-	if (error != nullptr)
-	{
-		LOG(error, "Could not get managed objects: {}", error->message);
-		send_discovery_call(false);
-		throw gerror_exception(error);
-	}
-
-	return make_gvariant_uptr(retval);
-}
-
-
 bool adapter::filter_device(bluetooth_address device_address)
 {
 	bool retval = (m_device_filter) ? m_device_filter(device_address) : true;
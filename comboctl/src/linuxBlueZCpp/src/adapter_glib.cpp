@@ -0,0 +1,594 @@
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
+
+#include <optional>
+#include <assert.h>
+#include "scope_guard.hpp"
+#include "gerror_exception.hpp"
+#include "adapter.hpp"
+#include "glib_misc.hpp"
+#include "tracepoints.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("BlueZAdapter")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+constexpr gchar const *obj_array_gvformat_string = "(a{oa{sa{sv}}})";
+
+
+} // unnamed namespace end
+
+
+adapter::adapter()
+	: m_mainloop_monitor(nullptr)
+	, m_dbus_connection(nullptr)
+	, m_cancellable(nullptr)
+	, m_adapter_proxy(nullptr)
+	, m_dbus_connection_signal_subscription(0)
+	, m_discovery_started(false)
+{
+}
+
+
+void adapter::setup(GDBusConnection *dbus_connection, mainloop_monitor *monitor, GCancellable *cancellable)
+{
+	// Prerequisites.
+
+	GError *error = nullptr;
+
+	assert(dbus_connection != nullptr);
+
+	if (m_dbus_connection_signal_subscription != 0)
+		throw invalid_call_exception("Adapter already set up");
+
+	// Store the arguments.
+	m_dbus_connection = dbus_connection;
+	m_mainloop_monitor = monitor;
+	m_cancellable = cancellable;
+
+	// Install scope guard to call teardown() if something
+	// goes wrong. This makes sure that any changes done
+	// by this function are rolled back then.
+	auto guard = make_scope_guard([&]() { teardown(); });
+
+	// Set up our BlueZ D-Bus signal handler so we can get
+	// notifications when Bluetooth devices appear / vanish.
+	// This is done _before_ enumerating the objects BlueZ
+	// already knows of, so that no device that shows up in
+	// between is missed. (Devices that show up in both are
+	// handled fine, since observed devices are kept in maps.)
+	// Signals are only dispatched once the mainloop runs.
+
+	static auto static_dbus_connection_signal_cb = [](GDBusConnection *, gchar const *sender_name, gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters, gpointer user_data) -> void
+	{
+		adapter *self = reinterpret_cast<adapter*>(user_data);
+
+		scoped_dispatch_timer dispatch_timer(self->m_mainloop_monitor, "adapter D-Bus signal handler", signal_name);
+
+		COMBOCTL_TRACEPOINT(adapter_signal_begin, signal_name, object_path);
+		auto tracepoint_end_guard = make_scope_guard([signal_name]() { COMBOCTL_TRACEPOINT(adapter_signal_end, signal_name); });
+
+		LOG(trace,
+			"Got DBus signal \"{}\" from sender \"{}\" (object path = \"{}\" interface name = \"{}\" parameters type = \"{}\"; parameters = {})",
+			signal_name,
+			sender_name,
+			object_path,
+			interface_name,
+			g_variant_get_type_string(parameters),
+			to_string(parameters)
+		);
+
+		self->dbus_connection_signal_cb(
+			object_path,
+			interface_name,
+			signal_name,
+			parameters
+		);
+	};
+
+	m_dbus_connection_signal_subscription = g_dbus_connection_signal_subscribe(
+		m_dbus_connection,
+		"org.bluez",
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		static_dbus_connection_signal_cb,
+		gpointer(this),
+		nullptr
+	);
+
+	// Get all of BlueZ's managed D-Bus objects with one
+	// GetManagedObjects call. This list is used for finding
+	// the adapter and for looking up what Bluetooth devices
+	// BlueZ already knows of (that is, were discovered earlier).
+	gvariant_uptr managed_objects_gvariant = get_managed_bluez_objects();
+
+	LOG(debug, "Got list of DBus objects currently managed by BlueZ");
+
+	// Go through the objects to find the first Bluetooth adapter available.
+	std::string adapter_object_path;
+	{
+		gvariant_iter_uptr object_iter = get_gvariant_iter_from(managed_objects_gvariant, obj_array_gvformat_string);
+
+		gchar *object_path;
+		GVariant *interfaces_dict_variant;
+		while (g_variant_iter_loop(object_iter.get(), "{o*}", &object_path, &interfaces_dict_variant))
+		{
+			gvariant_iter_uptr interface_iter = get_gvariant_iter_from(interfaces_dict_variant, "a{sa{sv}}");
+
+			GVariantIter *properties_iter;
+			gchar const *interface_name;
+			while (g_variant_iter_loop(interface_iter.get(), "{sa{sv}}", &interface_name, &properties_iter))
+			{
+				if (g_strcmp0(interface_name, "org.bluez.Adapter1") == 0)
+				{
+					adapter_object_path = object_path;
+
+					LOG(trace, "Found adapter object path {}", adapter_object_path);
+					break;
+				}
+			}
+		}
+	}
+
+	if (adapter_object_path.empty())
+		throw comboctl::io_exception("No Bluetooth adapter found");
+
+	// Get the proxy object for future adapter calls.
+	m_adapter_proxy = g_dbus_proxy_new_sync(
+		m_dbus_connection,
+		G_DBUS_PROXY_FLAGS_NONE,
+		nullptr,
+		"org.bluez",
+		adapter_object_path.c_str(),
+		"org.bluez.Adapter1",
+		m_cancellable,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not create Adapter GDBus proxy: {}", error->message);
+		throw gerror_exception(error);
+	}
+
+	// Now process the enumerated objects to see if they
+	// have the relevant Bluetooth device interface.
+	gvariant_iter_uptr iter = get_gvariant_iter_from(managed_objects_gvariant, obj_array_gvformat_string);
+
+	gchar *object_path;
+	GVariant *interfaces_dict_variant;
+	while (g_variant_iter_loop(iter.get(), "{o*}", &object_path, &interfaces_dict_variant))
+		process_added_dbus_object_interfaces(object_path, interfaces_dict_variant);
+
+	// Our adapter is ready. Dismiss the guard to make
+	// sure it is not torn down again.
+
+	guard.dismiss();
+
+	LOG(debug, "Adapter set up");
+}
+
+
+void adapter::teardown(std::optional<std::chrono::steady_clock::time_point> reply_deadline)
+{
+	// Stop any ongoing discovery.
+	stop_discovery(reply_deadline);
+
+	if (m_dbus_connection_signal_subscription != 0)
+	{
+		g_dbus_connection_signal_unsubscribe(m_dbus_connection, m_dbus_connection_signal_subscription);
+		m_dbus_connection_signal_subscription = 0;
+	}
+
+	if (m_adapter_proxy != nullptr)
+	{
+		g_object_unref(G_OBJECT(m_adapter_proxy));
+		m_adapter_proxy = nullptr;
+	}
+
+	m_dbus_connection = nullptr;
+
+	// Clear the table to make sure there is no leftover stale data.
+	m_observed_devices.clear();
+
+	LOG(debug, "Adapter torn down");
+}
+
+
+std::string adapter::get_name() const
+{
+	GVariant *variant = g_dbus_proxy_get_cached_property(m_adapter_proxy, "Name");
+	if (variant == nullptr)
+		throw io_exception("DBus Adapter object has no Name property");
+
+	gsize name_cstr_size = 0;
+	gchar const *name_cstr = g_variant_get_string(variant, &name_cstr_size);
+	if (name_cstr == nullptr)
+	{
+		throw io_exception("DBus Adapter object has Name property that is not a string");
+	}
+
+	std::string name(name_cstr, name_cstr_size);
+
+	LOG(debug, "Got friendly name for Bluetooth adapter: \"{}\"", name);
+
+	return name;
+}
+
+
+void adapter::send_discovery_call(bool do_start, std::optional<std::chrono::steady_clock::time_point> reply_deadline)
+{
+	GError *error = nullptr;
+
+	if (m_adapter_proxy == nullptr)
+		return;
+
+	if (!do_start)
+	{
+		// Wait for the reply so that errors show up in the log, but
+		// never past the reply deadline; see stop_discovery(). With
+		// a deadline, the cancellable is not used, since teardown
+		// already cancelled it at this point.
+		gint timeout_msec = -1;
+		GCancellable *cancellable = m_cancellable;
+		if (reply_deadline)
+		{
+			auto timeout = std::chrono::ceil<std::chrono::milliseconds>(*reply_deadline - std::chrono::steady_clock::now());
+			if (timeout.count() <= 0)
+			{
+				// Passing a null callback sets the
+				// G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED flag.
+				LOG(warn, "Reply deadline reached; sending StopDiscovery call without waiting for the reply");
+				g_dbus_proxy_call(
+					m_adapter_proxy,
+					"StopDiscovery",
+					nullptr,
+					G_DBUS_CALL_FLAGS_NONE,
+					-1,
+					nullptr,
+					nullptr,
+					nullptr
+				);
+				return;
+			}
+
+			timeout_msec = static_cast<gint>(timeout.count());
+			cancellable = nullptr;
+		}
+
+		GVariant *retval = g_dbus_proxy_call_sync(
+			m_adapter_proxy,
+			"StopDiscovery",
+			nullptr,
+			G_DBUS_CALL_FLAGS_NONE,
+			timeout_msec,
+			cancellable,
+			&error
+		);
+		if (error != nullptr)
+		{
+			LOG(error, "Could not stop discovery: {}", error->message);
+			g_error_free(error);
+		}
+		else
+			g_variant_unref(retval);
+
+		return;
+	}
+
+	g_dbus_proxy_call_sync(
+		m_adapter_proxy,
+		"StartDiscovery",
+		nullptr,
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		m_cancellable,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not start discovery: {}", error->message);
+		throw gerror_exception(error);
+	}
+}
+
+
+bool adapter::send_set_discovery_filter_call(bool include_pattern)
+{
+	GError *error = nullptr;
+
+	GVariantBuilder filter_builder;
+	g_variant_builder_init(&filter_builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&filter_builder, "{sv}", "Transport", g_variant_new_string("bredr"));
+	g_variant_builder_add(&filter_builder, "{sv}", "DuplicateData", g_variant_new_boolean(FALSE));
+	if (include_pattern)
+		g_variant_builder_add(&filter_builder, "{sv}", "Pattern", g_variant_new_string(m_discovery_address_pattern.c_str()));
+
+	GVariant *retval = g_dbus_proxy_call_sync(
+		m_adapter_proxy,
+		"SetDiscoveryFilter",
+		g_variant_new("(a{sv})", &filter_builder),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		m_cancellable,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(debug, "SetDiscoveryFilter call {} pattern failed: {}", include_pattern ? "with" : "without", error->message);
+		g_error_free(error);
+		return false;
+	}
+
+	g_variant_unref(retval);
+
+	LOG(debug, "Set discovery filter (pattern: \"{}\")", include_pattern ? m_discovery_address_pattern : "");
+
+	return true;
+}
+
+
+void adapter::send_remove_device_call(std::string const &object_path)
+{
+	g_dbus_proxy_call_sync(
+		m_adapter_proxy,
+		"RemoveDevice",
+		g_variant_new("(o)", object_path.c_str()),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		m_cancellable,
+		nullptr
+	);
+}
+
+
+void adapter::readmit_device_object(std::string_view object_path)
+{
+	GError *error = nullptr;
+	std::string object_path_str(object_path);
+
+	GVariant *retval = g_dbus_connection_call_sync(
+		m_dbus_connection,
+		"org.bluez",
+		object_path_str.c_str(),
+		"org.freedesktop.DBus.Properties",
+		"GetAll",
+		g_variant_new("(s)", "org.bluez.Device1"),
+		G_VARIANT_TYPE("(a{sv})"),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		m_cancellable,
+		&error
+	);
+	if (error != nullptr)
+	{
+		// This is called from a signal handler, so do not throw.
+		LOG(error, "Could not get properties of D-Bus object {}: {}", object_path, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	GVariantIter *properties_iter;
+	g_variant_get(retval, "(a{sv})", &properties_iter);
+	process_device_properties(object_path_str.c_str(), properties_iter);
+
+	g_variant_iter_free(properties_iter);
+	g_variant_unref(retval);
+}
+
+
+void adapter::process_added_dbus_object_interfaces(gchar const *object_path, GVariant *interfaces_dict_variant)
+{
+	GVariantIter *properties_iter;
+	gchar const *interface_name;
+
+	// Look through the GVariant data. Access requires type
+	// information at runtime (which is what strings like "{sv}"
+	// are for), and is somewhat complex, since the data is
+	// made of nested structures.
+
+	gvariant_iter_uptr interface_iter = get_gvariant_iter_from(interfaces_dict_variant, "a{sa{sv}}");
+
+	while (g_variant_iter_loop(interface_iter.get(), "{sa{sv}}", &interface_name, &properties_iter))
+	{
+		// We are only interested in the org.bluez.Device1 interface.
+		if (g_strcmp0(interface_name, "org.bluez.Device1") != 0)
+			continue;
+
+		process_device_properties(object_path, properties_iter);
+
+		break;
+	}
+}
+
+
+void adapter::process_device_properties(gchar const *object_path, GVariantIter *properties_iter)
+{
+	gchar const *property_name;
+	GVariant *property_value;
+
+	std::optional<bluetooth_address> bdaddr;
+	bool is_paired = false;
+	bool is_connected = false;
+
+	// Look at the properties of the interface. We are interested
+	// in the "Address" (the Bluetooth address) and the "Paired"
+	// (whether or not this device is paired) properties.
+	while (g_variant_iter_loop(properties_iter, "{sv}", &property_name, &property_value))
+	{
+		if (g_strcmp0(property_name, "Address") == 0)
+		{
+			gchar const *prop_str = g_variant_get_string(property_value, nullptr);
+
+			bluetooth_address found_bdaddr;
+			if (!comboctl::from_string(found_bdaddr, prop_str))
+			{
+				// Skip invalid Bluetooth addresses.
+				LOG(error, "Invalid Bluetooth address \"{}\"", prop_str);
+				continue;
+			}
+			bdaddr = std::move(found_bdaddr);
+		}
+		else if (g_strcmp0(property_name, "Paired") == 0)
+		{
+			is_paired = g_variant_get_boolean(property_value);
+		}
+		else if (g_strcmp0(property_name, "Connected") == 0)
+		{
+			is_connected = g_variant_get_boolean(property_value);
+		}
+	}
+
+	if (bdaddr)
+		add_observed_device(object_path, *bdaddr, is_paired, is_connected);
+}
+
+
+void adapter::process_removed_dbus_object_interfaces(gchar const *object_path, GVariant *interfaces_array_variant)
+{
+	gchar const *interface_name;
+
+	gvariant_iter_uptr interface_iter = get_gvariant_iter_from(interfaces_array_variant, "as");
+
+	while (g_variant_iter_loop(interface_iter.get(), "s", &interface_name))
+	{
+		// We are only interested in the org.bluez.Device1 interface.
+		if (g_strcmp0(interface_name, "org.bluez.Device1") != 0)
+			continue;
+
+		handle_removed_device_object(object_path);
+
+		break;
+	}
+}
+
+
+void adapter::process_dbus_object_interface_property_changes(gchar const *object_path, gchar const *interface_name, GVariant *property_changes_dict_variant)
+{
+	if (g_strcmp0(interface_name, "org.bluez.Device1") != 0)
+		return;
+
+	auto lookup_boolean = [property_changes_dict_variant](gchar const *property_name) -> std::optional<bool> {
+		GVariant *value_variant = g_variant_lookup_value(property_changes_dict_variant, property_name, G_VARIANT_TYPE_BOOLEAN);
+		if (value_variant == nullptr)
+			return std::nullopt;
+
+		bool value = g_variant_get_boolean(value_variant);
+		g_variant_unref(value_variant);
+		return value;
+	};
+
+	handle_device_property_changes(object_path, lookup_boolean("Connected"), lookup_boolean("Paired"));
+}
+
+
+void adapter::dbus_connection_signal_cb(gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters)
+{
+	if (g_strcmp0(interface_name, "org.freedesktop.DBus.ObjectManager") == 0)
+	{
+		if (g_strcmp0(signal_name, "InterfacesAdded") == 0)
+		{
+			// An interface was added to a D-Bus object. This is how we
+			// can find devices that got detected by BlueZ. When one is
+			// detected, BlueZ creates a new D-Bus object and adds an
+			// org.bluez.Device1 interface to it.
+
+			gchar *added_if_object_path;
+			GVariant *interfaces_dict_variant;
+			g_variant_get(parameters, "(o*)", &added_if_object_path, &interfaces_dict_variant);
+
+			auto dict_variant_guard = make_scope_guard([&]() {
+				g_free(added_if_object_path);
+				g_variant_unref(interfaces_dict_variant);
+			});
+
+			process_added_dbus_object_interfaces(added_if_object_path, interfaces_dict_variant);
+		}
+		else if (g_strcmp0(signal_name, "InterfacesRemoved") == 0)
+		{
+			// An interface was removed from a D-Bus object. This happens
+			// most notably when an object is removed, for example because
+			// the Bluetooth device was deleted from the list of known
+			// devices. In that case, we want to remove that device from
+			// the m_bt_address_dbus_object_paths bimap.
+
+			gchar *added_if_object_path;
+			GVariant *interfaces_array_variant;
+			g_variant_get(parameters, "(o*)", &added_if_object_path, &interfaces_array_variant);
+
+			auto dict_variant_guard = make_scope_guard([&]() {
+				g_free(added_if_object_path);
+				g_variant_unref(interfaces_array_variant);
+			});
+
+			process_removed_dbus_object_interfaces(added_if_object_path, interfaces_array_variant);
+		}
+	}
+	else if (g_strcmp0(interface_name, "org.freedesktop.DBus.Properties") == 0)
+	{
+		if (g_strcmp0(signal_name, "PropertiesChanged") == 0)
+		{
+			// A D-Bus object's properties got changed. We check this
+			// to see if the paired status changed.
+
+			gchar *changed_interface_name;
+			GVariant *property_changes_dict_variant;
+			GVariantIter *removed_properties_iter;
+			g_variant_get(parameters, "(s*as)", &changed_interface_name, &property_changes_dict_variant, &removed_properties_iter);
+
+			auto dict_variant_guard = make_scope_guard([&]() {
+				g_free(changed_interface_name);
+				g_variant_unref(property_changes_dict_variant);
+				g_variant_iter_free(removed_properties_iter);
+			});
+
+			process_dbus_object_interface_property_changes(object_path, changed_interface_name, property_changes_dict_variant);
+		}
+	}
+}
+
+
+gvariant_uptr adapter::get_managed_bluez_objects()
+{
+	GError *error = nullptr;
+
+	// Look up what Bluetooth devices BlueZ already knows
+	// of (that is, were discovered earlier already).
+	GVariant *retval = g_dbus_connection_call_sync(
+		m_dbus_connection,
+		"org.bluez",
+		"/",
+		"org.freedesktop.DBus.ObjectManager",
+		"GetManagedObjects",
+		nullptr,
+		G_VARIANT_TYPE("(a{oa{sa{sv}}})"),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		m_cancellable,
+		&error
+	);
+	if (error != nullptr)
+	{
+		LOG(error, "Could not get managed objects: {}", error->message);
+		send_discovery_call(false);
+		throw gerror_exception(error);
+	}
+
+	return make_gvariant_uptr(retval);
+}
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_NATIVE_DBUS_BACKEND
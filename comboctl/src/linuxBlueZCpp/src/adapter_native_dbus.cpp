@@ -0,0 +1,533 @@
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+
+#include <optional>
+#include <assert.h>
+#include "scope_guard.hpp"
+#include "dbus_error_exception.hpp"
+#include "adapter.hpp"
+#include "tracepoints.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("BlueZAdapter")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+// Only the adapter subscribes to signals on the BlueZ D-Bus connection,
+// so with this rule, the bus only forwards signals sent by BlueZ to us.
+// (The bus itself sends NameAcquired signals regardless; these are
+// filtered out by their interface.)
+constexpr char const *bluez_signal_match_rule = "type='signal',sender='org.bluez'";
+
+
+std::optional<bool> get_boolean_from_variant(dbus_value_reader variant_reader)
+{
+	if (variant_reader.get_current_type() != 'b')
+		return std::nullopt;
+	return variant_reader.read_boolean();
+}
+
+
+} // unnamed namespace end
+
+
+adapter::adapter()
+	: m_mainloop_monitor(nullptr)
+	, m_dbus_connection(nullptr)
+	, m_signal_subscription(0)
+	, m_discovery_started(false)
+{
+}
+
+
+void adapter::setup(dbus_connection *dbus_connection, mainloop_monitor *monitor)
+{
+	// Prerequisites.
+
+	assert(dbus_connection != nullptr);
+
+	if (m_signal_subscription != 0)
+		throw invalid_call_exception("Adapter already set up");
+
+	// Store the arguments.
+	m_dbus_connection = dbus_connection;
+	m_mainloop_monitor = monitor;
+
+	// Install scope guard to call teardown() if something
+	// goes wrong. This makes sure that any changes done
+	// by this function are rolled back then.
+	auto guard = make_scope_guard([&]() { teardown(); });
+
+	// Set up our BlueZ D-Bus signal handler so we can get
+	// notifications when Bluetooth devices appear / vanish.
+	// Like in the GLib backend, this is done _before_ enumerating
+	// the objects BlueZ already knows of. Signals that arrive
+	// during the GetManagedObjects call are kept by the connection
+	// and dispatched once the reactor runs.
+	m_signal_subscription = m_dbus_connection->subscribe_signals(
+		bluez_signal_match_rule,
+		[this](dbus_message const &message) {
+			// The string views point into the message data, where
+			// strings are always null-terminated, so data() can be
+			// passed where C strings are expected.
+			char const *signal_name = message.get_member().data();
+
+			scoped_dispatch_timer dispatch_timer(m_mainloop_monitor, "adapter D-Bus signal handler", signal_name);
+
+			COMBOCTL_TRACEPOINT(adapter_signal_begin, signal_name, message.get_path().data());
+			auto tracepoint_end_guard = make_scope_guard([signal_name]() { COMBOCTL_TRACEPOINT(adapter_signal_end, signal_name); });
+
+			LOG(trace,
+				"Got DBus signal \"{}\" from sender \"{}\" (object path = \"{}\" interface name = \"{}\" signature = \"{}\")",
+				message.get_member(),
+				message.get_sender(),
+				message.get_path(),
+				message.get_interface(),
+				message.get_signature()
+			);
+
+			dbus_connection_signal_cb(message);
+		}
+	);
+
+	// Get all of BlueZ's managed D-Bus objects with one
+	// GetManagedObjects call. This list is used for finding
+	// the adapter and for looking up what Bluetooth devices
+	// BlueZ already knows of (that is, were discovered earlier).
+	std::optional<dbus_message> managed_objects_reply;
+	try
+	{
+		managed_objects_reply = m_dbus_connection->call(dbus_message_builder::method_call(
+			"org.bluez",
+			"/",
+			"org.freedesktop.DBus.ObjectManager",
+			"GetManagedObjects"
+		));
+	}
+	catch (dbus_error_exception const &exc)
+	{
+		LOG(error, "Could not get managed objects: {}", exc.what());
+		throw;
+	}
+
+	if (managed_objects_reply->get_signature() != "a{oa{sa{sv}}}")
+		throw io_exception(fmt::format("GetManagedObjects reply has unexpected signature \"{}\"", managed_objects_reply->get_signature()));
+
+	LOG(debug, "Got list of DBus objects currently managed by BlueZ");
+
+	// Go through the objects to find the first Bluetooth adapter available.
+	{
+		dbus_value_reader object_iter = managed_objects_reply->get_body_reader().enter_container();
+		while (!object_iter.at_end() && m_adapter_object_path.empty())
+		{
+			dbus_value_reader object_entry = object_iter.enter_container();
+			std::string_view object_path = object_entry.read_string();
+			dbus_value_reader interface_iter = object_entry.enter_container();
+
+			while (!interface_iter.at_end())
+			{
+				dbus_value_reader interface_entry = interface_iter.enter_container();
+				if (interface_entry.read_string() != "org.bluez.Adapter1")
+					continue;
+
+				m_adapter_object_path = object_path;
+				process_adapter_property_changes(interface_entry.enter_container());
+
+				LOG(trace, "Found adapter object path {}", m_adapter_object_path);
+				break;
+			}
+		}
+	}
+
+	if (m_adapter_object_path.empty())
+		throw comboctl::io_exception("No Bluetooth adapter found");
+
+	// Now process the enumerated objects to see if they
+	// have the relevant Bluetooth device interface.
+	dbus_value_reader object_iter = managed_objects_reply->get_body_reader().enter_container();
+	while (!object_iter.at_end())
+	{
+		dbus_value_reader object_entry = object_iter.enter_container();
+		std::string_view object_path = object_entry.read_string();
+		process_added_dbus_object_interfaces(object_path, object_entry.enter_container());
+	}
+
+	// Our adapter is ready. Dismiss the guard to make
+	// sure it is not torn down again.
+
+	guard.dismiss();
+
+	LOG(debug, "Adapter set up");
+}
+
+
+void adapter::teardown(std::optional<std::chrono::steady_clock::time_point> reply_deadline)
+{
+	// Stop any ongoing discovery.
+	stop_discovery(reply_deadline);
+
+	if (m_signal_subscription != 0)
+	{
+		m_dbus_connection->unsubscribe_signals(m_signal_subscription);
+		m_signal_subscription = 0;
+	}
+
+	m_adapter_object_path.clear();
+	m_adapter_name.clear();
+
+	m_dbus_connection = nullptr;
+
+	// Clear the table to make sure there is no leftover stale data.
+	m_observed_devices.clear();
+
+	LOG(debug, "Adapter torn down");
+}
+
+
+std::string adapter::get_name() const
+{
+	if (m_adapter_object_path.empty())
+		throw io_exception("DBus Adapter object has no Name property");
+
+	LOG(debug, "Got friendly name for Bluetooth adapter: \"{}\"", m_adapter_name);
+
+	return m_adapter_name;
+}
+
+
+void adapter::send_discovery_call(bool do_start, std::optional<std::chrono::steady_clock::time_point> reply_deadline)
+{
+	if (m_adapter_object_path.empty())
+		return;
+
+	dbus_message_builder discovery_call = dbus_message_builder::method_call(
+		"org.bluez",
+		m_adapter_object_path,
+		"org.bluez.Adapter1",
+		do_start ? "StartDiscovery" : "StopDiscovery"
+	);
+
+	if (!do_start)
+	{
+		// Wait for the reply so that errors show up in the log, but
+		// never past the reply deadline; see stop_discovery().
+		std::optional<std::chrono::milliseconds> timeout;
+		if (reply_deadline)
+		{
+			timeout = std::chrono::ceil<std::chrono::milliseconds>(*reply_deadline - std::chrono::steady_clock::now());
+			if (timeout->count() <= 0)
+			{
+				LOG(warn, "Reply deadline reached; sending StopDiscovery call without waiting for the reply");
+				discovery_call.set_no_reply_expected();
+
+				try
+				{
+					if (m_dbus_connection->is_open())
+						m_dbus_connection->send(discovery_call);
+				}
+				catch (io_exception const &exc)
+				{
+					LOG(error, "Could not send StopDiscovery call: {}", exc.what());
+				}
+
+				return;
+			}
+		}
+
+		try
+		{
+			if (timeout)
+				m_dbus_connection->call(discovery_call, *timeout, true);
+			else
+				m_dbus_connection->call(discovery_call);
+		}
+		catch (std::exception const &exc)
+		{
+			LOG(error, "Could not stop discovery: {}", exc.what());
+		}
+
+		return;
+	}
+
+	try
+	{
+		m_dbus_connection->call(discovery_call);
+	}
+	catch (dbus_error_exception const &exc)
+	{
+		LOG(error, "Could not start discovery: {}", exc.what());
+		throw;
+	}
+}
+
+
+bool adapter::send_set_discovery_filter_call(bool include_pattern)
+{
+	dbus_message_builder filter_call = dbus_message_builder::method_call("org.bluez", m_adapter_object_path, "org.bluez.Adapter1", "SetDiscoveryFilter");
+
+	dbus_value_writer &filter_writer = filter_call.body();
+	filter_writer.open_array("{sv}");
+
+	auto add_filter_entry = [&](char const *key, char const *signature, auto const &append_value) {
+		filter_writer.open_dict_entry();
+		filter_writer.append_string(key);
+		filter_writer.open_variant(signature);
+		append_value();
+		filter_writer.close_variant();
+		filter_writer.close_dict_entry();
+	};
+
+	add_filter_entry("Transport", "s", [&]() { filter_writer.append_string("bredr"); });
+	add_filter_entry("DuplicateData", "b", [&]() { filter_writer.append_boolean(false); });
+	if (include_pattern)
+		add_filter_entry("Pattern", "s", [&]() { filter_writer.append_string(m_discovery_address_pattern); });
+
+	filter_writer.close_array();
+
+	try
+	{
+		m_dbus_connection->call(filter_call);
+	}
+	catch (dbus_error_exception const &exc)
+	{
+		LOG(debug, "SetDiscoveryFilter call {} pattern failed: {}", include_pattern ? "with" : "without", exc.what());
+		return false;
+	}
+
+	LOG(debug, "Set discovery filter (pattern: \"{}\")", include_pattern ? m_discovery_address_pattern : "");
+
+	return true;
+}
+
+
+void adapter::send_remove_device_call(std::string const &object_path)
+{
+	dbus_message_builder remove_device_call = dbus_message_builder::method_call("org.bluez", m_adapter_object_path, "org.bluez.Adapter1", "RemoveDevice");
+	remove_device_call.body().append_object_path(object_path);
+
+	// Like in the GLib backend, errors are ignored here. If the
+	// device is already gone, there is nothing left to remove.
+	try
+	{
+		m_dbus_connection->call(remove_device_call);
+	}
+	catch (dbus_error_exception const &exc)
+	{
+		LOG(debug, "RemoveDevice call failed: {}", exc.what());
+	}
+}
+
+
+void adapter::readmit_device_object(std::string_view object_path)
+{
+	// The object path refers to the signal that is being dispatched.
+	// dbus_connection keeps that valid during the blocking call below.
+	dbus_message_builder get_all_call = dbus_message_builder::method_call("org.bluez", object_path, "org.freedesktop.DBus.Properties", "GetAll");
+	get_all_call.body().append_string("org.bluez.Device1");
+
+	std::optional<dbus_message> properties_reply;
+	try
+	{
+		properties_reply = m_dbus_connection->call(get_all_call);
+	}
+	catch (std::exception const &exc)
+	{
+		// This is called from a signal handler, so do not throw.
+		LOG(error, "Could not get properties of D-Bus object {}: {}", object_path, exc.what());
+		return;
+	}
+
+	if (properties_reply->get_signature() != "a{sv}")
+	{
+		LOG(error, "GetAll reply for D-Bus object {} has unexpected signature \"{}\"", object_path, properties_reply->get_signature());
+		return;
+	}
+
+	process_device_properties(object_path, properties_reply->get_body_reader().enter_container());
+}
+
+
+void adapter::process_added_dbus_object_interfaces(std::string_view object_path, dbus_value_reader interfaces_dict_reader)
+{
+	// The reader walks the a{sa{sv}} dictionary in place. Nothing
+	// is copied unless a device that passes the filter is found.
+
+	while (!interfaces_dict_reader.at_end())
+	{
+		dbus_value_reader interface_entry = interfaces_dict_reader.enter_container();
+
+		// We are only interested in the org.bluez.Device1 interface.
+		if (interface_entry.read_string() != "org.bluez.Device1")
+			continue;
+
+		process_device_properties(object_path, interface_entry.enter_container());
+
+		break;
+	}
+}
+
+
+void adapter::process_device_properties(std::string_view object_path, dbus_value_reader properties_dict_reader)
+{
+	std::optional<bluetooth_address> bdaddr;
+	bool is_paired = false;
+	bool is_connected = false;
+
+	// Look at the properties of the interface. We are interested
+	// in the "Address" (the Bluetooth address) and the "Paired"
+	// (whether or not this device is paired) properties.
+	while (!properties_dict_reader.at_end())
+	{
+		dbus_value_reader property_entry = properties_dict_reader.enter_container();
+		std::string_view property_name = property_entry.read_string();
+		dbus_value_reader property_value = property_entry.enter_container();
+
+		if (property_name == "Address")
+		{
+			if (property_value.get_current_type() != 's')
+				continue;
+
+			std::string_view prop_str = property_value.read_string();
+
+			bluetooth_address found_bdaddr;
+			if (!comboctl::from_string(found_bdaddr, prop_str))
+			{
+				// Skip invalid Bluetooth addresses.
+				LOG(error, "Invalid Bluetooth address \"{}\"", prop_str);
+				continue;
+			}
+			bdaddr = std::move(found_bdaddr);
+		}
+		else if (property_name == "Paired")
+		{
+			is_paired = get_boolean_from_variant(property_value).value_or(false);
+		}
+		else if (property_name == "Connected")
+		{
+			is_connected = get_boolean_from_variant(property_value).value_or(false);
+		}
+	}
+
+	if (bdaddr)
+		add_observed_device(object_path, *bdaddr, is_paired, is_connected);
+}
+
+
+void adapter::process_removed_dbus_object_interfaces(std::string_view object_path, dbus_value_reader interfaces_array_reader)
+{
+	while (!interfaces_array_reader.at_end())
+	{
+		// We are only interested in the org.bluez.Device1 interface.
+		if (interfaces_array_reader.read_string() != "org.bluez.Device1")
+			continue;
+
+		handle_removed_device_object(object_path);
+
+		break;
+	}
+}
+
+
+void adapter::process_adapter_property_changes(dbus_value_reader property_changes_dict_reader)
+{
+	// With GDBus, the adapter proxy caches the adapter properties.
+	// Here, only the Name property is needed, so only that one
+	// is kept, in m_adapter_name.
+
+	while (!property_changes_dict_reader.at_end())
+	{
+		dbus_value_reader property_entry = property_changes_dict_reader.enter_container();
+		if (property_entry.read_string() != "Name")
+			continue;
+
+		dbus_value_reader property_value = property_entry.enter_container();
+		if (property_value.get_current_type() != 's')
+			throw io_exception("DBus Adapter object has Name property that is not a string");
+
+		m_adapter_name = property_value.read_string();
+	}
+}
+
+
+void adapter::process_device_property_changes(std::string_view object_path, dbus_value_reader property_changes_dict_reader)
+{
+	std::optional<bool> is_connected;
+	std::optional<bool> is_paired;
+
+	while (!property_changes_dict_reader.at_end())
+	{
+		dbus_value_reader property_entry = property_changes_dict_reader.enter_container();
+		std::string_view property_name = property_entry.read_string();
+
+		if (property_name == "Connected")
+			is_connected = get_boolean_from_variant(property_entry.enter_container());
+		else if (property_name == "Paired")
+			is_paired = get_boolean_from_variant(property_entry.enter_container());
+	}
+
+	handle_device_property_changes(object_path, is_connected, is_paired);
+}
+
+
+void adapter::dbus_connection_signal_cb(dbus_message const &message)
+{
+	if (message.is_signal("org.freedesktop.DBus.ObjectManager", "InterfacesAdded"))
+	{
+		// An interface was added to a D-Bus object. This is how we
+		// can find devices that got detected by BlueZ. When one is
+		// detected, BlueZ creates a new D-Bus object and adds an
+		// org.bluez.Device1 interface to it.
+
+		if (message.get_signature() != "oa{sa{sv}}")
+			return;
+
+		dbus_value_reader parameters = message.get_body_reader();
+		std::string_view added_if_object_path = parameters.read_string();
+		process_added_dbus_object_interfaces(added_if_object_path, parameters.enter_container());
+	}
+	else if (message.is_signal("org.freedesktop.DBus.ObjectManager", "InterfacesRemoved"))
+	{
+		// An interface was removed from a D-Bus object. This happens
+		// most notably when an object is removed, for example because
+		// the Bluetooth device was deleted from the list of known
+		// devices. In that case, we want to remove that device from
+		// the table of observed devices.
+
+		if (message.get_signature() != "oas")
+			return;
+
+		dbus_value_reader parameters = message.get_body_reader();
+		std::string_view removed_if_object_path = parameters.read_string();
+		process_removed_dbus_object_interfaces(removed_if_object_path, parameters.enter_container());
+	}
+	else if (message.is_signal("org.freedesktop.DBus.Properties", "PropertiesChanged"))
+	{
+		// A D-Bus object's properties got changed. We check this
+		// to see if the paired status changed, and to keep the
+		// adapter name up to date.
+
+		if (message.get_signature() != "sa{sv}as")
+			return;
+
+		dbus_value_reader parameters = message.get_body_reader();
+		std::string_view changed_interface_name = parameters.read_string();
+
+		if (changed_interface_name == "org.bluez.Device1")
+			process_device_property_changes(message.get_path(), parameters.enter_container());
+		else if ((changed_interface_name == "org.bluez.Adapter1") && (message.get_path() == m_adapter_object_path))
+			process_adapter_property_changes(parameters.enter_container());
+	}
+}
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_NATIVE_DBUS_BACKEND
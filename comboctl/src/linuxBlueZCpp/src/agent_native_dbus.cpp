@@ -0,0 +1,197 @@
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+
+#include <assert.h>
+#include "dbus_error_exception.hpp"
+#include "agent.hpp"
+#include "scope_guard.hpp"
+#include "tracepoints.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("BlueZAgent")
+
+
+namespace comboctl
+{
+
+
+agent::agent()
+	: m_mainloop_monitor(nullptr)
+	, m_dbus_connection(nullptr)
+	, m_agent_object_registered(false)
+	, m_agent_registered(false)
+{
+}
+
+
+void agent::setup(
+	dbus_connection *dbus_connection,
+	std::string pairing_pin_code,
+	mainloop_monitor *monitor
+)
+{
+	// Prerequisites.
+
+	assert(dbus_connection != nullptr);
+
+	if (m_agent_object_registered)
+		throw invalid_call_exception("Agent already set up");
+
+	// Store the arguments.
+	m_dbus_connection = dbus_connection;
+	m_pairing_pin_code = std::move(pairing_pin_code);
+	m_mainloop_monitor = monitor;
+
+	// Install scope guard to call teardown() if something
+	// goes wrong. This makes sure that any changes done
+	// by this function are rolled back then.
+	auto guard = make_scope_guard([&]() { teardown(); });
+
+	// Register our agent object. This does not yet
+	// register it as a BlueZ agent, it just makes
+	// it appears as an object in D-Bus. Unlike GDBus,
+	// dbus_connection does not need an introspection
+	// XML description of the object's interface.
+	m_dbus_connection->register_object(agent_path, [this](dbus_message const &message) {
+		// See adapter_native_dbus.cpp for why data() is usable as a C string here.
+		char const *method_name = message.get_member().data();
+
+		scoped_dispatch_timer dispatch_timer(m_mainloop_monitor, "agent D-Bus method call", method_name);
+
+		COMBOCTL_TRACEPOINT(agent_method_call_begin, method_name);
+		auto tracepoint_end_guard = make_scope_guard([method_name]() { COMBOCTL_TRACEPOINT(agent_method_call_end, method_name); });
+
+		handle_agent_method_call(message);
+	});
+	m_agent_object_registered = true;
+
+	// This is now the actual agent registration.
+	try
+	{
+		dbus_message_builder register_agent_call = dbus_message_builder::method_call("org.bluez", "/org/bluez", "org.bluez.AgentManager1", "RegisterAgent");
+		register_agent_call.body().append_object_path(agent_path);
+		register_agent_call.body().append_string("DisplayYesNo");
+		m_dbus_connection->call(register_agent_call);
+	}
+	catch (dbus_error_exception const &exc)
+	{
+		LOG(error, "Could not register agent: {}", exc.what());
+		throw;
+	}
+
+	m_agent_registered = true;
+
+	LOG(trace, "Registered object {} as agent", agent_path);
+
+	try
+	{
+		dbus_message_builder request_default_agent_call = dbus_message_builder::method_call("org.bluez", "/org/bluez", "org.bluez.AgentManager1", "RequestDefaultAgent");
+		request_default_agent_call.body().append_object_path(agent_path);
+		m_dbus_connection->call(request_default_agent_call);
+	}
+	catch (dbus_error_exception const &exc)
+	{
+		LOG(error, "Could not set agent as default: {}", exc.what());
+		throw;
+	}
+
+	// Our agent is ready. Dismiss the guard to make
+	// sure it is not torn down again.
+
+	guard.dismiss();
+
+	LOG(trace, "Agent set up");
+}
+
+
+void agent::teardown()
+{
+	if (m_agent_registered)
+	{
+		// Do not wait for the reply, for the same reasons
+		// as in the GLib backend (see agent_glib.cpp).
+		dbus_message_builder unregister_agent_call = dbus_message_builder::method_call("org.bluez", "/org/bluez", "org.bluez.AgentManager1", "UnregisterAgent");
+		unregister_agent_call.set_no_reply_expected();
+		unregister_agent_call.body().append_object_path(agent_path);
+
+		try
+		{
+			if (m_dbus_connection->is_open())
+				m_dbus_connection->send(unregister_agent_call);
+		}
+		catch (io_exception const &exc)
+		{
+			LOG(debug, "Could not send UnregisterAgent call: {}", exc.what());
+		}
+
+		m_agent_registered = false;
+
+		LOG(trace, "Unregistered object {} as agent", agent_path);
+	}
+
+	if (m_agent_object_registered)
+	{
+		LOG(trace, "Unregistering object {}", agent_path);
+		m_dbus_connection->unregister_object(agent_path);
+		m_agent_object_registered = false;
+	}
+
+	m_dbus_connection = nullptr;
+
+	LOG(trace, "Agent torn down");
+}
+
+
+void agent::handle_agent_method_call(dbus_message const &message)
+{
+	LOG(trace,
+		"Agent method \"{}\" called by sender \"{}\" (object path \"{}\" interface name \"{}\" signature = \"{}\")",
+		message.get_member(),
+		message.get_sender(),
+		message.get_path(),
+		message.get_interface(),
+		message.get_signature()
+	);
+
+	if (message.get_interface() != "org.bluez.Agent1")
+	{
+		m_dbus_connection->send(dbus_message_builder::error(message, "org.freedesktop.DBus.Error.UnknownMethod", "Unknown interface"));
+		return;
+	}
+
+	std::string_view method_name = message.get_member();
+
+	if ((method_name == "RequestPinCode") && (message.get_signature() == "o"))
+	{
+		std::string_view device_object_path = message.get_body_reader().read_string();
+
+		if (!authorize_pin_code_request(device_object_path))
+		{
+			m_dbus_connection->send(dbus_message_builder::error(message, "org.bluez.Error.Rejected", "Not supported"));
+			return;
+		}
+
+		// Accept the request by returning the PIN code.
+		dbus_message_builder reply = dbus_message_builder::method_return(message);
+		reply.body().append_string(m_pairing_pin_code);
+		m_dbus_connection->send(reply);
+	}
+	else if ((method_name == "Release") || (method_name == "Cancel") || (method_name == "DisplayPinCode") || (method_name == "DisplayPasskey"))
+	{
+		// These are notifications that expect an empty reply.
+		m_dbus_connection->send(dbus_message_builder::method_return(message));
+	}
+	else
+	{
+		// Any other kind of authentication is not supported.
+		// The GLib backend does not reply to these at all,
+		// which makes BlueZ wait for its call timeout.
+		m_dbus_connection->send(dbus_message_builder::error(message, "org.bluez.Error.Rejected", "Not supported"));
+	}
+}
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_NATIVE_DBUS_BACKEND
@@ -0,0 +1,400 @@
+#ifdef COMBOCTL_ENABLE_ALLOCATION_TRACKING
+
+#include <execinfo.h>
+#include <stdlib.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <fmt/format.h>
+#include "allocation_tracking.hpp"
+
+
+// glibc's internal allocation functions. The replacements
+// below forward to these. Unlike looking up the next malloc()
+// with dlsym(), this works right from the start of the process.
+extern "C"
+{
+void * __libc_malloc(std::size_t size);
+void * __libc_calloc(std::size_t num_elements, std::size_t element_size);
+void * __libc_realloc(void *ptr, std::size_t size);
+void * __libc_memalign(std::size_t alignment, std::size_t size);
+}
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+constexpr int max_stack_depth = 24;
+
+// backtrace() also returns the frames of record_allocation()
+// and of the replaced allocation function that called it.
+constexpr int num_skipped_frames = 2;
+
+constexpr std::size_t max_num_sites = 256;
+
+
+struct thread_state
+{
+	allocation_counters m_counters;
+	char const *m_region_name;
+
+	// Set while an allocation site is being recorded. backtrace()
+	// itself may allocate, and these allocations must not be
+	// recorded, otherwise this would recurse endlessly.
+	bool m_recording;
+};
+
+
+// The initial-exec TLS model makes sure that accessing this does not
+// allocate. (With the default model, the first access from a thread
+// may call malloc() to set up the TLS block of a dlopen()ed library.)
+__attribute__((tls_model("initial-exec"))) thread_local thread_state current_thread_state = { {}, nullptr, false };
+
+std::atomic<std::uint64_t> total_num_allocations{0};
+std::atomic<std::uint64_t> total_num_allocated_bytes{0};
+std::atomic<std::uint64_t> total_num_region_allocations{0};
+
+
+struct allocation_site
+{
+	char const *m_region_name;
+	std::array<void *, max_stack_depth> m_frames;
+	int m_num_frames;
+	std::uint64_t m_num_allocations;
+	std::uint64_t m_num_allocated_bytes;
+};
+
+// A fixed table, since allocating memory for new
+// entries is obviously not possible in here.
+std::mutex sites_mutex;
+std::array<allocation_site, max_num_sites> sites;
+std::size_t num_sites = 0;
+std::uint64_t num_unlisted_allocations = 0;
+
+
+// backtrace() loads libgcc_s when it is called for the first time.
+// Do that right away instead of in the middle of a region.
+int const backtrace_primer = []() {
+	void *frame;
+	return backtrace(&frame, 1);
+}();
+
+
+class recording_guard
+{
+public:
+	recording_guard()
+		: m_previous_recording(current_thread_state.m_recording)
+	{
+		current_thread_state.m_recording = true;
+	}
+
+	~recording_guard()
+	{
+		current_thread_state.m_recording = m_previous_recording;
+	}
+
+	recording_guard(recording_guard const &) = delete;
+	recording_guard& operator = (recording_guard const &) = delete;
+
+
+private:
+	bool m_previous_recording;
+};
+
+
+void record_site(char const *region_name, void * const *frames, int num_frames, std::size_t size)
+{
+	std::lock_guard<std::mutex> lock(sites_mutex);
+
+	auto sites_end = sites.begin() + num_sites;
+	auto site_iter = std::find_if(sites.begin(), sites_end, [&](allocation_site const &site) {
+		return (site.m_region_name == region_name)
+		    && (site.m_num_frames == num_frames)
+		    && std::equal(frames, frames + num_frames, site.m_frames.begin());
+	});
+
+	if (site_iter == sites_end)
+	{
+		if (num_sites == max_num_sites)
+		{
+			num_unlisted_allocations++;
+			return;
+		}
+
+		site_iter = sites_end;
+		site_iter->m_region_name = region_name;
+		std::copy(frames, frames + num_frames, site_iter->m_frames.begin());
+		site_iter->m_num_frames = num_frames;
+		site_iter->m_num_allocations = 0;
+		site_iter->m_num_allocated_bytes = 0;
+		num_sites++;
+	}
+
+	site_iter->m_num_allocations++;
+	site_iter->m_num_allocated_bytes += size;
+}
+
+
+// This must not be inlined, otherwise num_skipped_frames is wrong.
+__attribute__((noinline)) void record_allocation(std::size_t size)
+{
+	thread_state &state = current_thread_state;
+
+	state.m_counters.m_num_allocations++;
+	state.m_counters.m_num_allocated_bytes += size;
+	total_num_allocations.fetch_add(1, std::memory_order_relaxed);
+	total_num_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+
+	if ((state.m_region_name == nullptr) || state.m_recording)
+		return;
+
+	state.m_counters.m_num_region_allocations++;
+	total_num_region_allocations.fetch_add(1, std::memory_order_relaxed);
+
+	recording_guard guard;
+
+	std::array<void *, max_stack_depth + num_skipped_frames> frames;
+	int num_frames = backtrace(frames.data(), int(frames.size()));
+	if (num_frames <= num_skipped_frames)
+		return;
+
+	record_site(state.m_region_name, frames.data() + num_skipped_frames, num_frames - num_skipped_frames, size);
+}
+
+
+void * allocate_for_operator_new(std::size_t size, std::size_t alignment)
+{
+	// operator new must return a unique pointer even
+	// for zero-sized allocations, and never null.
+	size = std::max(size, std::size_t(1));
+
+	void *ptr = (alignment != 0) ? __libc_memalign(alignment, size) : __libc_malloc(size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+
+} // unnamed namespace end
+
+
+namespace detail
+{
+
+
+char const * enter_allocation_region(char const *region_name)
+{
+	char const *previous_region_name = current_thread_state.m_region_name;
+	current_thread_state.m_region_name = region_name;
+	return previous_region_name;
+}
+
+
+void leave_allocation_region(char const *previous_region_name)
+{
+	current_thread_state.m_region_name = previous_region_name;
+}
+
+
+} // namespace detail end
+
+
+allocation_counters get_thread_allocation_counters()
+{
+	return current_thread_state.m_counters;
+}
+
+
+allocation_counters get_process_allocation_counters()
+{
+	allocation_counters counters;
+	counters.m_num_allocations = total_num_allocations.load(std::memory_order_relaxed);
+	counters.m_num_allocated_bytes = total_num_allocated_bytes.load(std::memory_order_relaxed);
+	counters.m_num_region_allocations = total_num_region_allocations.load(std::memory_order_relaxed);
+	return counters;
+}
+
+
+std::string format_allocation_site_report()
+{
+	// Building the report allocates. In case this is called
+	// inside a region, do not record these allocations, since
+	// recording them would try to lock sites_mutex again.
+	recording_guard guard;
+
+	std::vector<allocation_site> sites_copy;
+	std::uint64_t num_unlisted;
+	{
+		std::lock_guard<std::mutex> lock(sites_mutex);
+		sites_copy.assign(sites.begin(), sites.begin() + num_sites);
+		num_unlisted = num_unlisted_allocations;
+	}
+
+	if (sites_copy.empty())
+		return "No allocations inside no-allocation regions\n";
+
+	std::sort(sites_copy.begin(), sites_copy.end(), [](allocation_site const &first, allocation_site const &second) {
+		return first.m_num_allocations > second.m_num_allocations;
+	});
+
+	fmt::memory_buffer report;
+
+	for (auto const &site : sites_copy)
+	{
+		fmt::format_to(
+			report,
+			"{} allocation(s), {} byte(s) in region \"{}\":\n",
+			site.m_num_allocations,
+			site.m_num_allocated_bytes,
+			site.m_region_name
+		);
+
+		char **symbols = backtrace_symbols(site.m_frames.data(), site.m_num_frames);
+		for (int i = 0; i < site.m_num_frames; ++i)
+		{
+			if (symbols != nullptr)
+				fmt::format_to(report, "  #{} {}\n", i, symbols[i]);
+			else
+				fmt::format_to(report, "  #{} {}\n", i, site.m_frames[i]);
+		}
+		free(symbols);
+	}
+
+	if (num_unlisted > 0)
+		fmt::format_to(report, "{} more allocation(s) not listed, since the site table is full\n", num_unlisted);
+
+	return fmt::to_string(report);
+}
+
+
+void reset_allocation_site_report()
+{
+	std::lock_guard<std::mutex> lock(sites_mutex);
+	num_sites = 0;
+	num_unlisted_allocations = 0;
+}
+
+
+} // namespace comboctl end
+
+
+
+
+// The replaced allocation functions. Memory from these is freed with
+// the regular free() (and the default operator delete, which calls
+// free()), so these do not need to be replaced.
+
+extern "C"
+{
+
+
+void * malloc(std::size_t size) noexcept
+{
+	comboctl::record_allocation(size);
+	return __libc_malloc(size);
+}
+
+
+void * calloc(std::size_t num_elements, std::size_t element_size) noexcept
+{
+	comboctl::record_allocation(num_elements * element_size);
+	return __libc_calloc(num_elements, element_size);
+}
+
+
+void * realloc(void *ptr, std::size_t size) noexcept
+{
+	comboctl::record_allocation(size);
+	return __libc_realloc(ptr, size);
+}
+
+
+void * memalign(std::size_t alignment, std::size_t size) noexcept
+{
+	comboctl::record_allocation(size);
+	return __libc_memalign(alignment, size);
+}
+
+
+void * aligned_alloc(std::size_t alignment, std::size_t size) noexcept
+{
+	comboctl::record_allocation(size);
+	return __libc_memalign(alignment, size);
+}
+
+
+int posix_memalign(void **ptr, std::size_t alignment, std::size_t size) noexcept
+{
+	comboctl::record_allocation(size);
+
+	if ((alignment == 0) || ((alignment & (alignment - 1)) != 0) || ((alignment % sizeof(void *)) != 0))
+		return EINVAL;
+
+	void *allocated_ptr = __libc_memalign(alignment, size);
+	if (allocated_ptr == nullptr)
+		return ENOMEM;
+
+	*ptr = allocated_ptr;
+	return 0;
+}
+
+
+} // extern "C" end
+
+
+void * operator new(std::size_t size)
+{
+	comboctl::record_allocation(size);
+	return comboctl::allocate_for_operator_new(size, 0);
+}
+
+
+void * operator new[](std::size_t size)
+{
+	comboctl::record_allocation(size);
+	return comboctl::allocate_for_operator_new(size, 0);
+}
+
+
+void * operator new(std::size_t size, std::align_val_t alignment)
+{
+	comboctl::record_allocation(size);
+	return comboctl::allocate_for_operator_new(size, std::size_t(alignment));
+}
+
+
+void * operator new[](std::size_t size, std::align_val_t alignment)
+{
+	comboctl::record_allocation(size);
+	return comboctl::allocate_for_operator_new(size, std::size_t(alignment));
+}
+
+
+void * operator new(std::size_t size, std::nothrow_t const &) noexcept
+{
+	comboctl::record_allocation(size);
+	return __libc_malloc(std::max(size, std::size_t(1)));
+}
+
+
+void * operator new[](std::size_t size, std::nothrow_t const &) noexcept
+{
+	comboctl::record_allocation(size);
+	return __libc_malloc(std::max(size, std::size_t(1)));
+}
+
+
+#endif // COMBOCTL_ENABLE_ALLOCATION_TRACKING
@@ -0,0 +1,482 @@
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "binary_log.hpp"
+#include "exception.hpp"
+
+
+DEFINE_LOGGING_TAG("BinaryLog")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+constexpr char file_magic[8] = { 'C', 'C', 'B', 'I', 'N', 'L', 'O', 'G' };
+constexpr std::uint32_t file_format_version = 1;
+
+enum record_type : std::uint8_t
+{
+	site_record = 1,
+	thread_record = 2,
+	entries_record = 3,
+	dropped_record = 4
+};
+
+// Like in the trace recorder, buffers of exited threads are pruned
+// once this many are registered. (Their entries are written first.)
+constexpr std::size_t max_num_thread_buffers_before_pruning = 64;
+
+
+std::size_t round_up_to_power_of_two(std::size_t value)
+{
+	std::size_t result = 1;
+	while (result < value)
+		result <<= 1;
+	return result;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+// Per-thread single-producer / single-consumer byte ring. Only the
+// owning thread writes entries into it, and only the sink thread
+// reads from it. m_head and m_tail are monotonically increasing
+// byte counters; the ring positions are these modulo the capacity.
+struct thread_binary_log_buffer
+{
+	explicit thread_binary_log_buffer(std::size_t capacity)
+		: m_thread_id(std::uint32_t(syscall(SYS_gettid)))
+		, m_ring(capacity)
+		, m_head(0)
+		, m_tail(0)
+		, m_num_entries(0)
+		, m_num_dropped_entries(0)
+		, m_num_reported_dropped_entries(0)
+		, m_thread_record_written(false)
+		, m_thread_exited(false)
+	{
+		// Linux limits thread names to 16 bytes including the null terminator.
+		char thread_name[16] = { 0 };
+		if (pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name)) == 0)
+			m_thread_name = thread_name;
+	}
+
+	std::uint32_t m_thread_id;
+	std::string m_thread_name;
+
+	// Used by the owning thread to assemble an entry before
+	// it is copied into the ring.
+	binary_log_entry m_entry;
+
+	std::vector<std::uint8_t> m_ring;
+	std::atomic<std::uint64_t> m_head;
+	std::atomic<std::uint64_t> m_tail;
+
+	std::atomic<std::uint64_t> m_num_entries;
+	std::atomic<std::uint64_t> m_num_dropped_entries;
+
+	// Only accessed by the sink thread.
+	std::uint64_t m_num_reported_dropped_entries;
+	bool m_thread_record_written;
+
+	std::atomic<bool> m_thread_exited;
+};
+
+
+namespace
+{
+
+
+// Keeps the calling thread's buffer alive and marks it as
+// belonging to an exited thread once the thread finishes.
+struct binary_log_buffer_holder
+{
+	~binary_log_buffer_holder()
+	{
+		if (m_buffer)
+			m_buffer->m_thread_exited = true;
+	}
+
+	std::shared_ptr<thread_binary_log_buffer> m_buffer;
+};
+
+thread_local binary_log_buffer_holder tls_buffer_holder;
+
+
+} // unnamed namespace end
+
+
+
+
+struct binary_logger::impl
+{
+	struct site_info
+	{
+		std::uint32_t m_id;
+		log_level m_level;
+		std::string m_tag;
+		std::string m_format;
+		std::string m_arg_types;
+	};
+
+	void sink_thread_func();
+	void drain();
+	void write_bytes(void const *bytes, std::size_t num_bytes);
+	template<typename T> void write_value(T value)
+	{
+		write_bytes(&value, sizeof(value));
+	}
+	void write_site_record(site_info const &site);
+
+	// Guards the site registry and the list of thread buffers.
+	mutable std::mutex m_registry_mutex;
+	std::vector<site_info> m_sites;
+	std::size_t m_num_sites_written = 0;
+	std::vector<std::shared_ptr<thread_binary_log_buffer>> m_thread_buffers;
+	std::size_t m_buffer_size_per_thread = 64 * 1024;
+
+	// Guards the sink thread state below.
+	std::mutex m_sink_mutex;
+	std::condition_variable m_sink_condvar;
+	std::thread m_sink_thread;
+	bool m_stop_requested = false;
+	std::chrono::milliseconds m_flush_interval{250};
+
+	// Only accessed by the sink thread (and by start()
+	// and stop() while the sink thread is not running).
+	std::FILE *m_file = nullptr;
+
+	std::atomic<std::uint64_t> m_num_bytes_written{0};
+};
+
+
+binary_logger& binary_logger::instance()
+{
+	static binary_logger logger;
+	return logger;
+}
+
+
+binary_logger::binary_logger()
+	: m_text_log_level(log_level::warn)
+	, m_impl(std::make_unique<impl>())
+{
+}
+
+
+binary_logger::~binary_logger()
+{
+	stop();
+}
+
+
+void binary_logger::start(binary_log_config const &config)
+{
+	assert(!config.m_path.empty());
+	assert(config.m_flush_interval.count() > 0);
+
+	stop();
+
+	std::FILE *file = std::fopen(config.m_path.c_str(), "wb");
+	if (file == nullptr)
+		throw io_exception(fmt::format("Could not open binary log file \"{}\": {} ({})", config.m_path, std::strerror(errno), errno));
+
+	m_impl->m_file = file;
+	m_impl->m_num_bytes_written = 0;
+	m_impl->write_bytes(file_magic, sizeof(file_magic));
+	m_impl->write_value(file_format_version);
+
+	{
+		std::lock_guard<std::mutex> lock(m_impl->m_registry_mutex);
+		m_impl->m_buffer_size_per_thread = round_up_to_power_of_two(std::max(config.m_buffer_size_per_thread, std::size_t(1024)));
+		// Sites that were registered while logging to a previous
+		// file need to be written to this file again.
+		m_impl->m_num_sites_written = 0;
+		for (auto &buffer : m_impl->m_thread_buffers)
+			buffer->m_thread_record_written = false;
+	}
+
+	m_impl->m_stop_requested = false;
+	m_impl->m_flush_interval = config.m_flush_interval;
+	m_text_log_level = config.m_text_log_level;
+
+	m_impl->m_sink_thread = std::thread([this]() { m_impl->sink_thread_func(); });
+
+	detail::binary_logging_active = true;
+
+	LOG(info, "Writing binary log to \"{}\"", config.m_path);
+}
+
+
+void binary_logger::stop()
+{
+	if (!m_impl->m_sink_thread.joinable())
+		return;
+
+	detail::binary_logging_active = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_impl->m_sink_mutex);
+		m_impl->m_stop_requested = true;
+	}
+	m_impl->m_sink_condvar.notify_one();
+	m_impl->m_sink_thread.join();
+
+	std::fclose(m_impl->m_file);
+	m_impl->m_file = nullptr;
+}
+
+
+binary_log_stats binary_logger::get_stats() const
+{
+	binary_log_stats stats;
+
+	std::lock_guard<std::mutex> lock(m_impl->m_registry_mutex);
+
+	for (auto const &buffer : m_impl->m_thread_buffers)
+	{
+		stats.m_num_entries += buffer->m_num_entries.load(std::memory_order_relaxed);
+		stats.m_num_dropped_entries += buffer->m_num_dropped_entries.load(std::memory_order_relaxed);
+	}
+
+	stats.m_num_sites = m_impl->m_sites.size();
+	stats.m_num_bytes_written = m_impl->m_num_bytes_written.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
+
+std::uint32_t binary_logger::register_site(binary_log_site &site, char const *tag, log_level level, char const *format, char const *arg_types)
+{
+	std::lock_guard<std::mutex> lock(m_impl->m_registry_mutex);
+
+	// Another thread may have registered the site in the meantime.
+	std::uint32_t site_id = site.m_id.load(std::memory_order_relaxed);
+	if (site_id != 0)
+		return site_id;
+
+	site_id = std::uint32_t(m_impl->m_sites.size() + 1);
+	m_impl->m_sites.push_back({ site_id, level, tag, format, arg_types });
+
+	site.m_id.store(site_id, std::memory_order_release);
+
+	return site_id;
+}
+
+
+binary_log_entry* binary_logger::begin_entry(std::uint32_t site_id)
+{
+	thread_binary_log_buffer *buffer = tls_buffer_holder.m_buffer.get();
+
+	if (buffer == nullptr)
+	{
+		// This is the thread's first entry. Register a buffer for it.
+		// If that fails, the entry is dropped; logging must not throw.
+		try
+		{
+			std::lock_guard<std::mutex> lock(m_impl->m_registry_mutex);
+
+			auto new_buffer = std::make_shared<thread_binary_log_buffer>(m_impl->m_buffer_size_per_thread);
+
+			if (m_impl->m_thread_buffers.size() >= max_num_thread_buffers_before_pruning)
+			{
+				// Only prune buffers whose entries were all written.
+				m_impl->m_thread_buffers.erase(
+					std::remove_if(m_impl->m_thread_buffers.begin(), m_impl->m_thread_buffers.end(), [](auto const &existing_buffer) {
+						return existing_buffer->m_thread_exited.load()
+						    && (existing_buffer->m_head.load() == existing_buffer->m_tail.load());
+					}),
+					m_impl->m_thread_buffers.end()
+				);
+			}
+
+			m_impl->m_thread_buffers.push_back(new_buffer);
+			tls_buffer_holder.m_buffer = std::move(new_buffer);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+
+		buffer = tls_buffer_holder.m_buffer.get();
+	}
+
+	std::int64_t timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	buffer->m_entry.clear();
+	buffer->m_entry.append_value(site_id);
+	buffer->m_entry.append_value(timestamp_ns);
+
+	return &(buffer->m_entry);
+}
+
+
+void binary_logger::commit_entry()
+{
+	thread_binary_log_buffer &buffer = *(tls_buffer_holder.m_buffer);
+
+	std::size_t capacity = buffer.m_ring.size();
+	std::size_t entry_size = buffer.m_entry.size();
+
+	// Only this thread modifies m_head, so a relaxed load is enough.
+	std::uint64_t head = buffer.m_head.load(std::memory_order_relaxed);
+	std::uint64_t tail = buffer.m_tail.load(std::memory_order_acquire);
+
+	// The counters are only modified by this thread. Plain loads and
+	// stores are therefore enough, and avoid locked instructions.
+
+	if (buffer.m_entry.is_truncated() || ((capacity - (head - tail)) < entry_size))
+	{
+		buffer.m_num_dropped_entries.store(buffer.m_num_dropped_entries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+
+	std::size_t position = std::size_t(head & (capacity - 1));
+	std::size_t first_part_size = std::min(entry_size, capacity - position);
+	std::memcpy(&buffer.m_ring[position], buffer.m_entry.data(), first_part_size);
+	std::memcpy(&buffer.m_ring[0], buffer.m_entry.data() + first_part_size, entry_size - first_part_size);
+
+	buffer.m_head.store(head + entry_size, std::memory_order_release);
+	buffer.m_num_entries.store(buffer.m_num_entries.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+
+void binary_logger::impl::sink_thread_func()
+{
+	pthread_setname_np(pthread_self(), "binary-log-sink");
+
+	std::unique_lock<std::mutex> lock(m_sink_mutex);
+
+	while (true)
+	{
+		m_sink_condvar.wait_for(lock, m_flush_interval, [this]() { return m_stop_requested; });
+		bool stop_requested = m_stop_requested;
+
+		lock.unlock();
+		drain();
+		lock.lock();
+
+		if (stop_requested)
+			break;
+	}
+}
+
+
+void binary_logger::impl::drain()
+{
+	// Take snapshots of the ring heads first, and only then write the
+	// site records. Sites are registered before their first entry is
+	// committed, so this guarantees that all sites used by entries up
+	// to these heads are written before the entries are.
+
+	std::vector<std::shared_ptr<thread_binary_log_buffer>> thread_buffers;
+	{
+		std::lock_guard<std::mutex> lock(m_registry_mutex);
+		thread_buffers = m_thread_buffers;
+	}
+
+	std::vector<std::uint64_t> heads(thread_buffers.size());
+	for (std::size_t i = 0; i < thread_buffers.size(); ++i)
+		heads[i] = thread_buffers[i]->m_head.load(std::memory_order_acquire);
+
+	{
+		std::lock_guard<std::mutex> lock(m_registry_mutex);
+		for (; m_num_sites_written < m_sites.size(); ++m_num_sites_written)
+			write_site_record(m_sites[m_num_sites_written]);
+	}
+
+	for (std::size_t i = 0; i < thread_buffers.size(); ++i)
+	{
+		thread_binary_log_buffer &buffer = *(thread_buffers[i]);
+
+		if (!buffer.m_thread_record_written)
+		{
+			std::uint8_t name_length = std::uint8_t(buffer.m_thread_name.size());
+			write_value(thread_record);
+			write_value(buffer.m_thread_id);
+			write_value(name_length);
+			write_bytes(buffer.m_thread_name.data(), name_length);
+			buffer.m_thread_record_written = true;
+		}
+
+		std::uint64_t num_dropped_entries = buffer.m_num_dropped_entries.load(std::memory_order_relaxed);
+		if (num_dropped_entries != buffer.m_num_reported_dropped_entries)
+		{
+			write_value(dropped_record);
+			write_value(buffer.m_thread_id);
+			write_value(std::uint64_t(num_dropped_entries - buffer.m_num_reported_dropped_entries));
+			buffer.m_num_reported_dropped_entries = num_dropped_entries;
+		}
+
+		std::uint64_t tail = buffer.m_tail.load(std::memory_order_relaxed);
+		std::uint64_t head = heads[i];
+		if (head == tail)
+			continue;
+
+		std::size_t capacity = buffer.m_ring.size();
+		std::size_t num_bytes = std::size_t(head - tail);
+		std::size_t position = std::size_t(tail & (capacity - 1));
+		std::size_t first_part_size = std::min(num_bytes, capacity - position);
+
+		write_value(entries_record);
+		write_value(buffer.m_thread_id);
+		write_value(std::uint32_t(num_bytes));
+		write_bytes(&buffer.m_ring[position], first_part_size);
+		write_bytes(&buffer.m_ring[0], num_bytes - first_part_size);
+
+		// Hand the space back to the owning thread only after
+		// the bytes were copied out of the ring.
+		buffer.m_tail.store(head, std::memory_order_release);
+	}
+
+	std::fflush(m_file);
+}
+
+
+void binary_logger::impl::write_bytes(void const *bytes, std::size_t num_bytes)
+{
+	if (num_bytes == 0)
+		return;
+
+	// Errors are ignored on purpose. There is nowhere to log them
+	// to (logging them would feed back into this binary log).
+	std::size_t num_written_bytes = std::fwrite(bytes, 1, num_bytes, m_file);
+	m_num_bytes_written.fetch_add(num_written_bytes, std::memory_order_relaxed);
+}
+
+
+void binary_logger::impl::write_site_record(site_info const &site)
+{
+	std::uint16_t tag_length = std::uint16_t(std::min(site.m_tag.size(), std::size_t(UINT16_MAX)));
+	std::uint16_t format_length = std::uint16_t(std::min(site.m_format.size(), std::size_t(UINT16_MAX)));
+	std::uint8_t num_args = std::uint8_t(std::min(site.m_arg_types.size(), std::size_t(UINT8_MAX)));
+
+	write_value(site_record);
+	write_value(site.m_id);
+	write_value(std::uint8_t(site.m_level));
+	write_value(tag_length);
+	write_bytes(site.m_tag.data(), tag_length);
+	write_value(format_length);
+	write_bytes(site.m_format.data(), format_length);
+	write_value(num_args);
+	write_bytes(site.m_arg_types.data(), num_args);
+}
+
+
+} // namespace comboctl end
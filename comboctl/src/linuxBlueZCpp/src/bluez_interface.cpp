@@ -1,17 +1,32 @@
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 #include <glib.h>
 #include <gio/gio.h>
+#endif
 #include <thread>
 #include <future>
 #include <set>
 #include <assert.h>
 #include <optional>
+#include <mutex>
+#include <atomic>
 #include "bluez_interface.hpp"
 #include "agent.hpp"
 #include "adapter.hpp"
 #include "sdp_service.hpp"
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+#include "dbus_connection.hpp"
+#include "dbus_error_exception.hpp"
+#include "epoll_reactor.hpp"
+#else
 #include "gerror_exception.hpp"
+#endif
 #include "rfcomm_listener.hpp"
 #include "rfcomm_connection.hpp"
+#include "link_loss_monitor.hpp"
+#include "mainloop_monitor.hpp"
+#include "allocation_tracking.hpp"
+#include "tracepoints.hpp"
+#include "trace_recorder.hpp"
 #include "scope_guard.hpp"
 #include "log.hpp"
 
@@ -69,11 +84,19 @@ struct bluez_interface_priv
 	std::thread m_thread;
 	bool m_thread_started = false;
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	// The reactor takes the place of the GLib mainloop, and
+	// dispatches the D-Bus connection's incoming messages.
+	epoll_reactor m_reactor;
+	dbus_connection m_dbus_connection;
+#else
 	GMainContext *m_mainloop_context = nullptr;
 	GMainLoop *m_mainloop = nullptr;
 	GDBusConnection *m_gdbus_connection = nullptr;
+#endif
 
 	rfcomm_listener m_rfcomm_listener;
+	bool m_rfcomm_listener_started = false;
 	sdp_service m_sdp_service;
 	agent m_agent;
 	adapter m_adapter;
@@ -86,9 +109,61 @@ struct bluez_interface_priv
 
 	bool m_discovery_started = false;
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	std::optional<epoll_reactor::timer_id> m_discovery_timeout_timer;
+#else
 	GSource *m_discovery_timeout_gsource = nullptr;
+#endif
 
+	mainloop_monitor m_mainloop_monitor;
 
+	// Shared with the bluez_bluetooth_device instances,
+	// since these may outlive the bluez_interface.
+	std::shared_ptr<link_loss_monitor> m_link_loss_monitor = std::make_shared<link_loss_monitor>();
+
+	// Set by the internal thread once the D-Bus connection and the
+	// adapter are set up. The value is the exception that occurred
+	// during startup, or a null exception_ptr if startup succeeded.
+	std::promise<std::exception_ptr> m_startup_promise;
+	std::shared_future<std::exception_ptr> m_startup_future;
+	std::chrono::steady_clock::time_point m_startup_begin_timestamp;
+
+	// Guards m_startup_timings, since these are written by the
+	// internal thread, and can be read from any thread.
+	mutable std::mutex m_startup_timings_mutex;
+	startup_timings m_startup_timings;
+
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
+	// Passed to all blocking D-Bus calls. teardown() cancels it
+	// to abort any such call that is in flight at that moment.
+	// (With the native backend, the dbus_connection itself is
+	// cancelled instead.)
+	GCancellable *m_shutdown_cancellable = nullptr;
+#endif
+
+	// Set by the internal thread right before it finishes. Unlike
+	// std::thread::join(), waiting for this supports a deadline.
+	std::promise<void> m_thread_finished_promise;
+	std::future<void> m_thread_finished_future;
+
+	// Set by teardown() before it stops the mainloop. The internal
+	// thread waits for the reply to the adapter's StopDiscovery call
+	// only until then. Atomic, since it is written by another thread.
+	std::atomic<std::chrono::steady_clock::time_point> m_stop_discovery_reply_deadline { std::chrono::steady_clock::time_point::max() };
+
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	bluez_interface_priv() = default;
+
+
+	~bluez_interface_priv()
+	{
+		// Pending tasks are discarded along with the reactor. Their
+		// function_data instances set the promises in their destructors.
+		if (m_discovery_timeout_timer)
+			m_reactor.remove_timer(*m_discovery_timeout_timer);
+	}
+#else
 	bluez_interface_priv()
 	{
 		// Start our own GLib mainloop where all GDBus activities
@@ -118,15 +193,20 @@ struct bluez_interface_priv
 			g_source_unref(m_discovery_timeout_gsource);
 		}
 
+		if (m_shutdown_cancellable != nullptr)
+			g_object_unref(G_OBJECT(m_shutdown_cancellable));
+
 		g_main_loop_unref(m_mainloop);
 		g_main_context_unref(m_mainloop_context);
 	}
+#endif
 
 
 	void thread_func()
 	{
 		LOG(trace, "Starting internal BlueZ thread");
 
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 		// Set our custom context as the new default one in
 		// this thread (-> this is a thread-local configuration).
 		// Any calls that always take the default context (like
@@ -135,74 +215,225 @@ struct bluez_interface_priv
 		// happen in this same thread, so we don't have to worry
 		// about calls in other threads not using our context.
 		g_main_context_push_thread_default(m_mainloop_context);
+#endif
 
 		if (m_on_thread_starting)
 			m_on_thread_starting();
 
-		// Unlike the agent and the SDP service, we start
-		// the adapter here. This is because we only need
-		// the agent and SDP service during discovery, while
-		// we do need the adapter all the time (to be able to
-		// detect unpaired devices).
-		m_adapter.setup(m_gdbus_connection);
+		run_startup();
 
+		// Run the mainloop even if startup failed. Otherwise,
+		// tasks posted by run_in_thread() would never finish.
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		m_reactor.run();
+#else
 		g_main_loop_run(m_mainloop);
+#endif
 
 		LOG(trace, "Stopping internal BlueZ thread");
 
-		m_adapter.teardown();
+		auto stop_discovery_reply_deadline = m_stop_discovery_reply_deadline.load();
+		if (stop_discovery_reply_deadline == std::chrono::steady_clock::time_point::max())
+			m_adapter.teardown();
+		else
+			m_adapter.teardown(stop_discovery_reply_deadline);
 
 		if (m_on_thread_stopping)
 			m_on_thread_stopping();
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		// Close the connection here, since it must only be
+		// used by this thread. This also detaches it from the
+		// reactor. BlueZ drops the agent and the profile of a
+		// closed connection by itself.
+		m_dbus_connection.close();
+#else
 		// Unset our custom context as the default one
 		// as part of our cleanup here.
 		g_main_context_pop_thread_default(m_mainloop_context);
+#endif
+
+		m_thread_finished_promise.set_value();
 	}
 
 
-	void stop_glib_mainloop()
+	void run_startup()
 	{
-		if (m_mainloop != nullptr)
-			g_main_loop_quit(m_mainloop);
+		// This runs in the internal thread before the mainloop starts,
+		// so the bluez_interface constructor does not have to wait for
+		// D-Bus round trips. Tasks posted via run_in_thread() in the
+		// meantime are queued and run once the mainloop starts, that
+		// is, after startup finished. Functions that do not need D-Bus
+		// (like get_device() and bluez_bluetooth_device::connect())
+		// can be used right away.
+
+		std::exception_ptr eptr;
+
+		try
+		{
+			auto phase_begin_timestamp = std::chrono::steady_clock::now();
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+			LOG(trace, "Connecting to the D-Bus system bus");
+
+			m_dbus_connection.open(dbus_connection::get_system_bus_address());
+			m_dbus_connection.attach(m_reactor);
+#else
+			LOG(trace, "Getting GLib D-Bus connection");
+
+			GError *gerror = nullptr;
+			m_gdbus_connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, m_shutdown_cancellable, &gerror);
+			if (gerror != nullptr)
+			{
+				LOG(error, "Could not get GLib DBus connection: {}", gerror->message);
+				throw gerror_exception(gerror);
+			}
+#endif
+
+			record_startup_phase(&startup_timings::m_dbus_connection_duration, phase_begin_timestamp);
+
+			// Unlike the agent and the SDP service, we set up
+			// the adapter right away. This is because we only need
+			// the agent and SDP service during discovery, while
+			// we do need the adapter all the time (to be able to
+			// detect unpaired devices).
+			phase_begin_timestamp = std::chrono::steady_clock::now();
+			m_adapter.on_device_link_lost([this](bluetooth_address device_address) {
+				m_link_loss_monitor->notify_link_lost(device_address);
+			});
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+			m_adapter.setup(&m_dbus_connection, &m_mainloop_monitor);
+#else
+			m_adapter.setup(m_gdbus_connection, &m_mainloop_monitor, m_shutdown_cancellable);
+#endif
+			record_startup_phase(&startup_timings::m_adapter_setup_duration, phase_begin_timestamp);
+		}
+		catch (std::exception const &exc)
+		{
+			LOG(error, "BlueZ interface startup failed: {}", exc.what());
+			eptr = std::current_exception();
+		}
+
+		record_startup_phase(&startup_timings::m_total_duration, m_startup_begin_timestamp);
+
+		{
+			std::lock_guard<std::mutex> lock(m_startup_timings_mutex);
+			LOG(debug,
+				"BlueZ interface startup finished; D-Bus connection: {} us, adapter setup: {} us, total: {} us",
+				m_startup_timings.m_dbus_connection_duration.value_or(std::chrono::microseconds(-1)).count(),
+				m_startup_timings.m_adapter_setup_duration.value_or(std::chrono::microseconds(-1)).count(),
+				m_startup_timings.m_total_duration.value_or(std::chrono::microseconds(-1)).count()
+			);
+		}
+
+		try_set_promise_value(m_startup_promise, eptr);
 	}
 
 
-	std::future<std::exception_ptr> run_thread_func_in_gsource(GSource *gsource, bluez_interface::thread_func func)
+	void record_startup_phase(std::optional<std::chrono::microseconds> startup_timings::*phase, std::chrono::steady_clock::time_point phase_begin_timestamp)
 	{
-		// This runs the given function object in the GLib
-		// mainloop thread (m_thread). This makes things
-		// easier, since otherwise, many mutex locks would
-		// potentially be required. The function is assigned
-		// to the given GSource, which is then executed by
-		// the GLib mainloop in a manner depending on the
-		// particular type of the GSource.
-		//
-		// In case callers want to wait until the function is
-		// executed, an std::future is used. An std::promise
-		// instance is created, the corresponding future is
-		// retrieved, and the promise is passed to the GSource
-		// along with the function object itself Once the function
-		// object was executed, that promise's value is set to
-		// the default-constructed exception_ptr(). Should an
-		// exception occur, that exception is captured using
-		// std::current_exception(), and used as the promise's
-		// value. Meanwhile, the future's get() function blocks
-		// until the promise's value is set.
-
-		struct function_data
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - phase_begin_timestamp);
+		std::lock_guard<std::mutex> lock(m_startup_timings_mutex);
+		m_startup_timings.*phase = duration;
+	}
+
+
+	void wait_for_startup()
+	{
+		std::exception_ptr eptr = m_startup_future.get();
+		if (eptr)
+			std::rethrow_exception(eptr);
+	}
+
+
+	void ensure_rfcomm_listener_started()
+	{
+		if (m_rfcomm_listener_started)
+			return;
+
+		// Start the RFCOMM listener. We only need it
+		// so we can provide the SDP service with an
+		// RFCOMM channel number. By specifying channel
+		// #0 we instruct the listener to automatically
+		// pick any free channel (its get_channel() function
+		// will then return that picked channel).
+		// This is done lazily, since many users of this
+		// class never start discovery, and just connect
+		// to already paired devices.
+		LOG(trace, "Starting RFCOMM listener");
+		auto begin_timestamp = std::chrono::steady_clock::now();
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		m_rfcomm_listener.listen(m_reactor, 0);
+#else
+		m_rfcomm_listener.listen(0);
+#endif
+		record_startup_phase(&startup_timings::m_rfcomm_listener_setup_duration, begin_timestamp);
+
+		m_rfcomm_listener_started = true;
+	}
+
+
+	void stop_mainloop()
+	{
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		// quit() posts a task, so like with the idle source below,
+		// a quit request made during startup is not lost.
+		m_reactor.quit();
+#else
+		// Quit the mainloop from inside an idle source instead of
+		// calling g_main_loop_quit() directly. If the internal thread
+		// is still busy with startup, g_main_loop_run() has not been
+		// called yet, and would reset a quit request made before it.
+		// The idle source is only dispatched by a running loop.
+
+		if (m_mainloop == nullptr)
+			return;
+
+		GSource *idle_source = g_idle_source_new();
+		g_source_set_callback(
+			idle_source,
+			[](gpointer data) -> gboolean {
+				g_main_loop_quit(reinterpret_cast<GMainLoop *>(data));
+				return G_SOURCE_REMOVE;
+			},
+			gpointer(m_mainloop),
+			nullptr
+		);
+		g_source_attach(idle_source, m_mainloop_context);
+		g_source_unref(idle_source);
+#endif
+	}
+
+
+	// Function object that is to be run in the mainloop thread,
+	// along with the promise for its outcome and the details
+	// for the mainloop monitor. See create_function_data().
+	struct function_data
+	{
+		bluez_interface::thread_func m_function;
+		std::promise<std::exception_ptr> m_promise;
+		mainloop_monitor *m_monitor;
+		char const *m_source_name;
+		std::optional<mainloop_monitor::clock::time_point> m_posting_timestamp;
+
+		~function_data()
 		{
-			bluez_interface::thread_func m_function;
-			std::promise<std::exception_ptr> m_promise;
-		};
+			// Make sure that the promise is always set to
+			// a value, even if the function is never run
+			// (because its source or task was discarded).
+			try_set_promise_value(m_promise, std::exception_ptr());
+		}
 
-		// The supplied function must be valid.
-		assert(func);
+		void execute()
+		{
+			// The dispatch itself must not allocate. The function
+			// object is exempt, since it can do anything.
+			no_allocation_scope allocation_scope("mainloop task dispatch");
 
-		// This is the callback that is executed when
-		// the GSsource is run by the GLib mainloop.
-		static auto callback = [](gpointer data) -> gboolean {
-			function_data *func_data = reinterpret_cast<function_data*>(data);
+			COMBOCTL_TRACEPOINT(mainloop_task_execute_begin, std::uintptr_t(this), m_source_name);
+
+			if (m_posting_timestamp)
+				m_monitor->record_queue_latency(mainloop_monitor::clock::now() - *m_posting_timestamp);
 
 			std::exception_ptr eptr;
 
@@ -211,27 +442,114 @@ struct bluez_interface_priv
 			// it properly later via future.get().
 			try
 			{
-				func_data->m_function();
+				scoped_dispatch_timer dispatch_timer(m_monitor, m_source_name);
+				scoped_trace_span trace_span("mainloop", m_source_name);
+				allocation_allowed_scope function_allocation_scope;
+				m_function();
 			}
 			catch (...)
 			{
 				eptr = std::current_exception();
 			}
 
-			try_set_promise_value(func_data->m_promise, eptr);
+			COMBOCTL_TRACEPOINT(mainloop_task_execute_end, std::uintptr_t(this), m_source_name);
 
-			return G_SOURCE_REMOVE;
+			try_set_promise_value(m_promise, eptr);
+		}
+	};
+
+
+	function_data * create_function_data(char const *source_name, bool measure_queue_latency, bluez_interface::thread_func func)
+	{
+		// This prepares running the given function object in the
+		// mainloop thread (m_thread). This makes things easier,
+		// since otherwise, many mutex locks would potentially be
+		// required. The function_data is then handed over to a
+		// GSource (see run_thread_func_in_gsource()) or, with the
+		// native D-Bus backend, to a reactor task or timer.
+		//
+		// In case callers want to wait until the function is
+		// executed, an std::future is used. The function_data
+		// contains an std::promise instance, whose corresponding
+		// future callers retrieve before handing over the
+		// function_data. Once the function object was executed,
+		// that promise's value is set to the default-constructed
+		// exception_ptr(). Should an exception occur, that
+		// exception is captured using std::current_exception(),
+		// and used as the promise's value. Meanwhile, the future's
+		// get() function blocks until the promise's value is set.
+		//
+		// The execution is also timed and reported to the mainloop
+		// monitor under the given source name. If measure_queue_latency
+		// is true, the time between posting and executing the function
+		// is recorded as well. This is only meaningful for functions
+		// that are supposed to run right away (idle sources and posted
+		// tasks), not for timeouts.
+		//
+		// Posting and executing are also marked with tracepoints.
+		// The address of the heap-allocated function_data is used
+		// as the task ID, which lets tracing scripts pair up the
+		// post and execute tracepoints of a task. The post tracepoint
+		// is emitted here, since the function_data may already be
+		// freed once it is handed over.
+
+		// The supplied function must be valid.
+		assert(func);
+
+		function_data *func_data = new function_data{
+			std::move(func),
+			std::promise<std::exception_ptr>(),
+			&m_mainloop_monitor,
+			source_name,
+			measure_queue_latency ? std::make_optional(mainloop_monitor::clock::now()) : std::nullopt
 		};
 
-		// Set up the promise and future objects.
-		std::promise<std::exception_ptr> promise;
-		std::future<std::exception_ptr> future = promise.get_future();
+		COMBOCTL_TRACEPOINT(mainloop_task_post, std::uintptr_t(func_data), source_name);
+
+		return func_data;
+	}
+
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	std::future<std::exception_ptr> post_thread_func(char const *source_name, bluez_interface::thread_func func)
+	{
+		// Run the function object in the reactor as soon as it
+		// is done with the tasks and events that are due already.
+		// The task holds the function_data through a shared_ptr,
+		// since std::function requires copyable function objects.
+		// If the task is discarded without being run, the
+		// function_data destructor sets the promise.
+
+		std::shared_ptr<function_data> func_data(create_function_data(source_name, true, std::move(func)));
+		std::future<std::exception_ptr> future = func_data->m_promise.get_future();
+
+		m_reactor.post([func_data]() { func_data->execute(); });
+
+		return future;
+	}
+#else
+	std::future<std::exception_ptr> run_thread_func_in_gsource(GSource *gsource, char const *source_name, bool measure_queue_latency, bluez_interface::thread_func func)
+	{
+		// This runs the given function object in the GLib
+		// mainloop thread. The function is assigned to the
+		// given GSource, which is then executed by the GLib
+		// mainloop in a manner depending on the particular
+		// type of the GSource. See create_function_data()
+		// for details about the returned future.
 
 		// Set up the data for the GSource. We have
 		// to allocate this in the heap, since the
 		// GSource only accepts a userdata pointer
 		// as context information.
-		function_data *func_data = new function_data{std::move(func), std::move(promise)};
+		function_data *func_data = create_function_data(source_name, measure_queue_latency, std::move(func));
+		std::future<std::exception_ptr> future = func_data->m_promise.get_future();
+
+		// This is the callback that is executed when
+		// the GSsource is run by the GLib mainloop.
+		static auto callback = [](gpointer data) -> gboolean {
+			reinterpret_cast<function_data*>(data)->execute();
+			return G_SOURCE_REMOVE;
+		};
 
 		g_source_set_callback(
 			gsource,
@@ -241,33 +559,34 @@ struct bluez_interface_priv
 				// This is run when the GSource is discarded.
 				// With this, we make sure that the previously
 				// heap-allocated function_data context is
-				// freed, and that the promise is always set
-				// to a value, even if the GSource is never run.
-
-				function_data *func_data = reinterpret_cast<function_data*>(data);
-
-				try_set_promise_value(func_data->m_promise, std::exception_ptr());
-
-				delete func_data;
+				// freed, and (through its destructor) that
+				// the promise is always set to a value, even
+				// if the GSource is never run.
+				delete reinterpret_cast<function_data*>(data);
 			}
 		);
 		g_source_attach(gsource, g_main_loop_get_context(m_mainloop));
 
 		return future;
 	}
+#endif
 
 
-	void run_in_thread(bluez_interface::thread_func func)
+	void run_in_thread(char const *source_name, bluez_interface::thread_func func)
 	{
-		// Run the function object in the GLib mainloop as soon
+		// Run the function object in the mainloop as soon
 		// as the loop has no other tasks to take care of.
-		// We use idle GSources for this purpose.
+		// With GLib, we use idle GSources for this purpose.
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		auto future = post_thread_func(source_name, std::move(func));
+#else
 		GSource *idle_source = g_idle_source_new();
-		auto future = run_thread_func_in_gsource(idle_source, func);
+		auto future = run_thread_func_in_gsource(idle_source, source_name, true, func);
 		g_source_unref(idle_source);
+#endif
 
-		// Wait for the GSource to run, and get any resulting
+		// Wait for the function to run, and get any resulting
 		// captured exception. If one was captured, rethrow it
 		// here, in the thread that called run_in_thread().
 		// That way, exceptions are propagated across threads.
@@ -277,7 +596,45 @@ struct bluez_interface_priv
 	}
 
 
-	GSource* run_in_thread(guint timeout, bluez_interface::thread_func func)
+	bool run_in_thread_until(char const *source_name, std::chrono::steady_clock::time_point deadline, bluez_interface::thread_func func)
+	{
+		// Like run_in_thread(), except that this stops waiting
+		// once the deadline is reached, and returns false then.
+		// The GSource (or task) stays in the mainloop in that
+		// case, and may still run later, so the function object
+		// must not reference anything that can be gone by then.
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		auto future = post_thread_func(source_name, std::move(func));
+#else
+		GSource *idle_source = g_idle_source_new();
+		auto future = run_thread_func_in_gsource(idle_source, source_name, true, std::move(func));
+		g_source_unref(idle_source);
+#endif
+
+		if (future.wait_until(deadline) != std::future_status::ready)
+			return false;
+
+		std::exception_ptr eptr = future.get();
+		if (eptr)
+			std::rethrow_exception(eptr);
+
+		return true;
+	}
+
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	epoll_reactor::timer_id run_in_thread(char const *source_name, std::chrono::seconds timeout, bluez_interface::thread_func func)
+	{
+		// Counterpart to the GSource variant below. The returned
+		// timer ID can be passed to epoll_reactor::remove_timer()
+		// to cancel the timeout.
+
+		std::shared_ptr<function_data> func_data(create_function_data(source_name, false, std::move(func)));
+		return m_reactor.add_timer(timeout, [func_data]() { func_data->execute(); });
+	}
+#else
+	GSource* run_in_thread(char const *source_name, guint timeout, bluez_interface::thread_func func)
 	{
 		// Run the function object in a timeout GSource and
 		// run that GSource in the GLib mainloop. Unlike in
@@ -287,9 +644,10 @@ struct bluez_interface_priv
 		// that timeout.
 
 		GSource *timeout_source = g_timeout_source_new_seconds(timeout);
-		run_thread_func_in_gsource(timeout_source, func);
+		run_thread_func_in_gsource(timeout_source, source_name, false, func);
 		return timeout_source;
 	}
+#endif
 
 
 	void start_discovery_impl(
@@ -298,6 +656,7 @@ struct bluez_interface_priv
 		std::string sdp_service_description,
 		std::string bt_pairing_pin_code,
 		int discovery_duration,
+		discovery_mode mode,
 		bluez_interface::discovery_started_callback on_discovery_started,
 		bluez_interface::discovery_stopped_callback on_discovery_stopped,
 		found_new_paired_device_callback on_found_new_device
@@ -318,10 +677,15 @@ struct bluez_interface_priv
 				on_discovery_stopped(discovery_stopped_reason::discovery_error);
 		});
 
-		m_discovery_timeout_gsource = run_in_thread(discovery_duration, [&]() {
+		auto on_discovery_timeout = [&]() {
 			LOG(debug, "discovery timeout reached; stopping discovery");
 			stop_discovery_impl(discovery_stopped_reason::discovery_timeout);
-		});
+		};
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		m_discovery_timeout_timer = run_in_thread("discovery timeout", std::chrono::seconds(discovery_duration), on_discovery_timeout);
+#else
+		m_discovery_timeout_gsource = run_in_thread("discovery timeout", discovery_duration, on_discovery_timeout);
+#endif
 
 		// Store the callbacks for later use.
 		m_on_found_new_device = std::move(on_found_new_device);
@@ -329,23 +693,46 @@ struct bluez_interface_priv
 
 		// Set up all components.
 
+		ensure_rfcomm_listener_started();
+
+		m_agent.set_device_address_lookup([this](std::string const &object_path) {
+			return m_adapter.find_device_address(object_path);
+		});
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		m_agent.setup(
+			&m_dbus_connection,
+			std::move(bt_pairing_pin_code),
+			&m_mainloop_monitor
+		);
+		m_sdp_service.setup(
+			&m_dbus_connection,
+			std::move(sdp_service_name),
+			std::move(sdp_service_provider),
+			std::move(sdp_service_description),
+			m_rfcomm_listener.get_channel()
+		);
+#else
 		m_agent.setup(
 			m_gdbus_connection,
-			std::move(bt_pairing_pin_code)
+			std::move(bt_pairing_pin_code),
+			&m_mainloop_monitor,
+			m_shutdown_cancellable
 		);
 		m_sdp_service.setup(
 			m_gdbus_connection,
 			std::move(sdp_service_name),
 			std::move(sdp_service_provider),
 			std::move(sdp_service_description),
-			m_rfcomm_listener.get_channel()
+			m_rfcomm_listener.get_channel(),
+			m_shutdown_cancellable
 		);
+#endif
 
 		// Start the discovery process. Note that the
 		// supplied callbacks will not be invoked until
 		// the mainloop got a chance to iterate.
 		m_adapter.start_discovery(
-			[this](bluetooth_address device_address) {
+			[this, mode](bluetooth_address device_address) {
 				// In here, we get notified about newly found
 				// paired devices.
 				// We are only interested in paired devices,
@@ -357,15 +744,30 @@ struct bluez_interface_priv
 				// a filter if one is defined, so we only get
 				// devices here that passed that filter.
 
+				// The adapter keeps reporting devices after the
+				// discovery session ended. Those are not announced,
+				// since nobody is waiting for them anymore.
+				if (!m_discovery_started)
+				{
+					LOG(debug, "Ignoring device {} that got paired outside of a discovery session", to_string(device_address));
+					return;
+				}
+
 				try
 				{
-					// As requested by the API documentation, we
-					// stop the discovery after discovering a device,
-					// _without_ invoking the m_on_discovery_stopped
-					// callback (hence the std::nullopt argument).
-					// Also, first stop discoverry, then announce the
-					// newly discovered device.
-					stop_discovery_impl(std::nullopt);
+					// As requested by the API documentation, in
+					// single device mode, we stop the discovery
+					// after discovering a device, _without_ invoking
+					// the m_on_discovery_stopped callback (hence the
+					// std::nullopt argument). Also, first stop
+					// discoverry, then announce the newly discovered
+					// device. In continuous mode, the agent and the
+					// SDP service stay set up for the next device.
+					if (mode == discovery_mode::single_device)
+						stop_discovery_impl(std::nullopt);
+					else
+						LOG(debug, "Found device {}; continuing discovery", to_string(device_address));
+
 					m_on_found_new_device(device_address);
 				}
 				catch (std::exception const &exc)
@@ -397,12 +799,20 @@ struct bluez_interface_priv
 		m_agent.teardown();
 		m_sdp_service.teardown();
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+		if (m_discovery_timeout_timer)
+		{
+			m_reactor.remove_timer(*m_discovery_timeout_timer);
+			m_discovery_timeout_timer = std::nullopt;
+		}
+#else
 		if (m_discovery_timeout_gsource != nullptr)
 		{
 			g_source_destroy(m_discovery_timeout_gsource);
 			g_source_unref(m_discovery_timeout_gsource);
 			m_discovery_timeout_gsource = nullptr;
 		}
+#endif
 	}
 
 
@@ -426,11 +836,13 @@ struct bluez_interface_priv
 // after it has been destroyed.
 
 
-bluez_bluetooth_device::bluez_bluetooth_device(bluetooth_address const &bt_address, unsigned int rfcomm_channel)
+bluez_bluetooth_device::bluez_bluetooth_device(bluetooth_address const &bt_address, unsigned int rfcomm_channel, std::shared_ptr<link_loss_monitor> monitor)
 	: m_bt_address(bt_address)
 	, m_rfcomm_channel(rfcomm_channel)
+	, m_link_loss_monitor(std::move(monitor))
 {
 	m_connection = std::make_unique<rfcomm_connection>();
+	m_link_loss_monitor->add_connection(m_bt_address, m_connection.get());
 }
 
 void bluez_bluetooth_device::connect()
@@ -440,6 +852,7 @@ void bluez_bluetooth_device::connect()
 
 bluez_bluetooth_device::~bluez_bluetooth_device()
 {
+	m_link_loss_monitor->remove_connection(m_bt_address, m_connection.get());
 	disconnect();
 }
 
@@ -452,12 +865,12 @@ void bluez_bluetooth_device::disconnect()
 	m_connection->disconnect();
 }
 
-void bluez_bluetooth_device::send(void const *src, int num_bytes)
+io_result<int> bluez_bluetooth_device::send(void const *src, int num_bytes, bool bypass_coalescing)
 {
-	m_connection->send(src, num_bytes);
+	return m_connection->send(src, num_bytes, bypass_coalescing);
 }
 
-int bluez_bluetooth_device::receive(void *dest, int num_bytes)
+io_result<int> bluez_bluetooth_device::receive(void *dest, int num_bytes)
 {
 	return m_connection->receive(dest, num_bytes);
 }
@@ -472,10 +885,26 @@ void bluez_bluetooth_device::cancel_receive()
 	m_connection->cancel_receive();
 }
 
+void bluez_bluetooth_device::set_flow_control_config(rfcomm_flow_control_config const &config)
+{
+	m_connection->set_flow_control_config(config);
+}
+
+rfcomm_flow_control_stats bluez_bluetooth_device::get_flow_control_stats() const
+{
+	return m_connection->get_flow_control_stats();
+}
+
+io_result<bool> bluez_bluetooth_device::wait_until_drained(std::chrono::steady_clock::time_point deadline)
+{
+	return m_connection->wait_until_drained(deadline);
+}
+
 
 
 
 bluez_interface::bluez_interface()
+	: m_teardown_deadline(std::chrono::seconds(2))
 {
 	m_priv = std::make_unique<bluez_interface_priv>();
 	setup();
@@ -494,32 +923,34 @@ void bluez_interface::setup()
 	if (m_priv->m_thread_started)
 		return;
 
-	LOG(trace, "Getting GLib D-Bus connection");
-
-	// Get GLib D-Bus connection for D-Bus calls.
-	GError *gerror = nullptr;
-	m_priv->m_gdbus_connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, nullptr, &gerror);
-	if (gerror != nullptr)
+	m_priv->m_startup_begin_timestamp = std::chrono::steady_clock::now();
+	m_priv->m_startup_promise = std::promise<std::exception_ptr>();
+	m_priv->m_startup_future = m_priv->m_startup_promise.get_future().share();
 	{
-		LOG(error, "Could not get GLib DBus connection: {}", gerror->message);
-		throw gerror_exception(gerror);
+		std::lock_guard<std::mutex> lock(m_priv->m_startup_timings_mutex);
+		m_priv->m_startup_timings = startup_timings();
 	}
 
-	// Start the RFCOMM listener. We only need it
-	// so we can provide the SDP service with an
-	// RFCOMM channel number. By specifying channel
-	// #0 we instruct the listener to automatically
-	// pick any free channel (its get_channel() function
-	// will then return that picked channel).
-	LOG(trace, "Starting RFCOMM listener");
-	m_priv->m_rfcomm_listener.listen(0);
-
-	// Finally, start the GLib mainloop thread.
-	LOG(trace, "Starting GLib mainloop thread");
-	m_priv->m_thread = std::thread([this]() { m_priv->thread_func(); });
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	m_priv->m_dbus_connection.reset_cancellation();
+#else
+	m_priv->m_shutdown_cancellable = g_cancellable_new();
+#endif
+	m_priv->m_thread_finished_promise = std::promise<void>();
+	m_priv->m_stop_discovery_reply_deadline = std::chrono::steady_clock::time_point::max();
+	m_priv->m_thread_finished_future = m_priv->m_thread_finished_promise.get_future();
+
+	// Start the mainloop thread. It gets the D-Bus
+	// connection and sets up the adapter by itself; see
+	// run_startup() for details.
+	LOG(trace, "Starting mainloop thread (D-Bus backend: {})", get_dbus_backend_name());
+	// The thread captures the priv pointer instead of "this", since
+	// teardown() replaces m_priv if it has to abandon the thread.
+	bluez_interface_priv *priv = m_priv.get();
+	m_priv->m_thread = std::thread([priv]() { priv->thread_func(); });
 	m_priv->m_thread_started = true;
 
-	LOG(trace, "BlueZ interface set up");
+	LOG(trace, "BlueZ interface startup initiated");
 }
 
 
@@ -530,27 +961,104 @@ void bluez_interface::teardown()
 	// Catch redundant calls.
 	if (!m_priv->m_thread_started)
 	{
-		LOG(trace, "GLib mainloop thread is not running; nothing to tear down");
+		LOG(trace, "Mainloop thread is not running; nothing to tear down");
 		return;
 	}
 
-	stop_discovery();
+	auto to_microseconds = [](std::chrono::steady_clock::duration duration) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(duration);
+	};
+
+	m_teardown_timings = teardown_timings();
+
+	auto const begin_timestamp = std::chrono::steady_clock::now();
+	auto const deadline = begin_timestamp + m_teardown_deadline;
+
+	// Abort all blocking D-Bus calls that are in flight right now,
+	// like a RegisterAgent call or the startup's GetManagedObjects
+	// call to a BlueZ instance that does not respond. Subsequent
+	// blocking calls fail immediately. This frees up the internal
+	// thread so it can process the steps below. The teardown itself
+	// mostly sends to BlueZ without waiting for replies. The one
+	// exception is the adapter's StopDiscovery call, whose reply is
+	// awaited until the deadline, so that errors are not hidden.
+	LOG(trace, "Cancelling in-flight D-Bus calls");
+	m_priv->m_stop_discovery_reply_deadline = deadline;
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	m_priv->m_dbus_connection.cancel();
+#else
+	g_cancellable_cancel(m_priv->m_shutdown_cancellable);
+#endif
+
+	// The tasks posted below may still run after this function
+	// returned if the deadline is exceeded, so they capture the
+	// priv pointer directly instead of "this".
+	bluez_interface_priv *priv = m_priv.get();
+
+	LOG(trace, "Stopping discovery");
+	auto phase_begin_timestamp = std::chrono::steady_clock::now();
+	try
+	{
+		if (priv->run_in_thread_until("teardown stop_discovery()", deadline, [priv]() { priv->stop_discovery_impl(discovery_stopped_reason::manually_stopped); }))
+		{
+			m_teardown_timings.m_stop_discovery_duration = to_microseconds(std::chrono::steady_clock::now() - phase_begin_timestamp);
+		}
+		else
+		{
+			LOG(error, "Stopping discovery did not finish before the teardown deadline");
+			m_teardown_timings.m_deadline_exceeded = true;
+		}
+	}
+	catch (std::exception const &exc)
+	{
+		// Continue with the teardown anyway. Otherwise,
+		// the mainloop thread would never finish.
+		LOG(error, "Error while stopping discovery during teardown: {}", exc.what());
+	}
 
-	// Stop the GLib mainloop, otherwise its thread
+	// Stop the mainloop, otherwise its thread
 	// will never finish.
-	LOG(trace, "Stopping GLib mainloop");
-	m_priv->stop_glib_mainloop();
+	LOG(trace, "Stopping mainloop");
+	phase_begin_timestamp = std::chrono::steady_clock::now();
+	priv->stop_mainloop();
+
+	// Now that we instructed the mainloop to stop, wait until
+	// its thread finishes. If it does not finish in time, something
+	// in that thread is stuck (for example, a run_in_thread() function
+	// that blocks). Detach the thread in that case. Since it may still
+	// access the priv instance, that instance is deliberately leaked
+	// and replaced with a new one that has no running thread. This way,
+	// this object stays in a consistent torn-down state.
+	LOG(trace, "Stopping mainloop thread");
+	if (priv->m_thread_finished_future.wait_until(deadline) != std::future_status::ready)
+	{
+		m_teardown_timings.m_deadline_exceeded = true;
+		m_teardown_timings.m_mainloop_thread_abandoned = true;
+		m_teardown_timings.m_total_duration = to_microseconds(std::chrono::steady_clock::now() - begin_timestamp);
+
+		LOG(error,
+			"Mainloop thread did not finish within the teardown deadline of {} ms; abandoning it",
+			m_teardown_deadline.count()
+		);
+
+		priv->m_thread.detach();
+		m_priv.release();
+		m_priv = std::make_unique<bluez_interface_priv>();
+
+		return;
+	}
 
-	// Now that we instructed the GLib mainloop
-	// to stop, wait until its thread finishes.
-	LOG(trace, "Stopping GLib mainloop thread");
 	m_priv->m_thread.join();
+	m_teardown_timings.m_mainloop_stop_duration = to_microseconds(std::chrono::steady_clock::now() - phase_begin_timestamp);
 
 	// Reset the RFCOMM listener for future setup() calls.
 	LOG(trace, "Resetting RFCOMM listener");
 	m_priv->m_rfcomm_listener = rfcomm_listener();
+	m_priv->m_rfcomm_listener_started = false;
 
-	// Discard the GLib D-Bus connection.
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
+	// Discard the GLib D-Bus connection. (The native backend's
+	// connection was already closed by the mainloop thread.)
 	if (m_priv->m_gdbus_connection != nullptr)
 	{
 		LOG(trace, "Discarding GLib D-Bus connection");
@@ -558,16 +1066,50 @@ void bluez_interface::teardown()
 		m_priv->m_gdbus_connection = nullptr;
 	}
 
+	g_object_unref(G_OBJECT(m_priv->m_shutdown_cancellable));
+	m_priv->m_shutdown_cancellable = nullptr;
+#endif
+
+	m_teardown_timings.m_total_duration = to_microseconds(std::chrono::steady_clock::now() - begin_timestamp);
+
 	// We are done.
-	LOG(trace, "BlueZ interface torn down");
+	LOG(debug,
+		"BlueZ interface torn down; stopping discovery: {} us, stopping mainloop: {} us, total: {} us",
+		m_teardown_timings.m_stop_discovery_duration.value_or(std::chrono::microseconds(-1)).count(),
+		m_teardown_timings.m_mainloop_stop_duration.value_or(std::chrono::microseconds(-1)).count(),
+		m_teardown_timings.m_total_duration->count()
+	);
 	m_priv->m_thread_started = false;
 }
 
 
+char const * bluez_interface::get_dbus_backend_name()
+{
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	return "native";
+#else
+	return "glib";
+#endif
+}
+
+
+void bluez_interface::set_teardown_deadline(std::chrono::milliseconds deadline)
+{
+	assert(deadline.count() > 0);
+	m_teardown_deadline = deadline;
+}
+
+
+teardown_timings bluez_interface::get_teardown_timings() const
+{
+	return m_teardown_timings;
+}
+
+
 void bluez_interface::run_in_thread(thread_func func)
 {
 	assert(func);
-	m_priv->run_in_thread(std::move(func));
+	m_priv->run_in_thread("run_in_thread() task", std::move(func));
 }
 
 
@@ -583,6 +1125,7 @@ void bluez_interface::start_discovery(
 	std::string sdp_service_description,
 	std::string bt_pairing_pin_code,
 	int discovery_duration,
+	discovery_mode mode,
 	discovery_started_callback on_discovery_started,
 	discovery_stopped_callback on_discovery_stopped,
 	found_new_paired_device_callback on_found_new_device
@@ -592,13 +1135,17 @@ void bluez_interface::start_discovery(
 	assert(m_priv->m_thread_started);
 	assert((discovery_duration >= 1) && (discovery_duration <= 300));
 
-	m_priv->run_in_thread([=]() mutable {
-		m_priv->start_discovery_impl(
+	m_priv->wait_for_startup();
+
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("start_discovery()", [=]() mutable {
+		priv->start_discovery_impl(
 			std::move(sdp_service_name),
 			std::move(sdp_service_provider),
 			std::move(sdp_service_description),
 			std::move(bt_pairing_pin_code),
 			discovery_duration,
+			mode,
 			std::move(on_discovery_started),
 			std::move(on_discovery_stopped),
 			std::move(on_found_new_device)
@@ -612,7 +1159,8 @@ void bluez_interface::stop_discovery()
 	if (!m_priv->m_thread_started)
 		return;
 
-	m_priv->run_in_thread([this]() { m_priv->stop_discovery_impl(discovery_stopped_reason::manually_stopped); });
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("stop_discovery()", [priv]() { priv->stop_discovery_impl(discovery_stopped_reason::manually_stopped); });
 }
 
 
@@ -620,8 +1168,9 @@ void bluez_interface::on_device_unpaired(device_unpaired_callback callback)
 {
 	assert(m_priv->m_thread_started);
 
-	m_priv->run_in_thread([this, callback = std::move(callback)]() mutable {
-		m_priv->m_adapter.on_device_unpaired(callback);
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("on_device_unpaired()", [priv, callback = std::move(callback)]() mutable {
+		priv->m_adapter.on_device_unpaired(callback);
 	});
 }
 
@@ -630,9 +1179,32 @@ void bluez_interface::set_device_filter(filter_device_callback callback)
 {
 	assert(m_priv->m_thread_started);
 
-	m_priv->run_in_thread([this, callback = std::move(callback)]() mutable {
-		m_priv->m_adapter.set_device_filter(callback);
-		m_priv->m_agent.set_device_filter(callback);
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("set_device_filter()", [priv, callback = std::move(callback)]() mutable {
+		priv->m_adapter.set_device_filter(callback);
+		priv->m_agent.set_device_filter(callback);
+	});
+}
+
+
+void bluez_interface::set_discovery_address_prefix(std::vector<std::uint8_t> const &prefix)
+{
+	assert(m_priv->m_thread_started);
+	assert(prefix.size() <= std::tuple_size<bluetooth_address>::value);
+
+	// Convert to the notation BlueZ uses for addresses
+	// (uppercase hex digits, separated by colons).
+	std::string pattern;
+	for (auto address_byte : prefix)
+	{
+		if (!pattern.empty())
+			pattern += ':';
+		pattern += fmt::format("{:02X}", address_byte);
+	}
+
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("set_discovery_address_prefix()", [priv, pattern = std::move(pattern)]() mutable {
+		priv->m_adapter.set_discovery_address_pattern(std::move(pattern));
 	});
 }
 
@@ -640,7 +1212,9 @@ void bluez_interface::set_device_filter(filter_device_callback callback)
 void bluez_interface::unpair_device(bluetooth_address device_address)
 {
 	assert(m_priv->m_thread_started);
-	m_priv->run_in_thread([=]() mutable { m_priv->unpair_device_impl(device_address); });
+	m_priv->wait_for_startup();
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("unpair_device()", [priv, device_address]() { priv->unpair_device_impl(device_address); });
 }
 
 
@@ -653,7 +1227,7 @@ bluez_bluetooth_device_uptr bluez_interface::get_device(bluetooth_address device
 	// of bluez_bluetooth_device is private. bluez_interface is
 	// marked as a friend class, but make_unique() doesn't have
 	// the same privileges.
-	return bluez_bluetooth_device_uptr(new bluez_bluetooth_device(device_address, 1));
+	return bluez_bluetooth_device_uptr(new bluez_bluetooth_device(device_address, 1, m_priv->m_link_loss_monitor));
 }
 
 
@@ -661,8 +1235,11 @@ std::string bluez_interface::get_adapter_friendly_name() const
 {
 	assert(m_priv->m_thread_started);
 
+	m_priv->wait_for_startup();
+
 	std::string name;
-	m_priv->run_in_thread([&]() mutable { name = m_priv->m_adapter.get_name(); });
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("get_adapter_friendly_name()", [priv, &name]() { name = priv->m_adapter.get_name(); });
 
 	return name;
 }
@@ -672,11 +1249,96 @@ bluetooth_address_set bluez_interface::get_paired_device_addresses() const
 {
 	assert(m_priv->m_thread_started);
 
+	m_priv->wait_for_startup();
+
 	bluetooth_address_set addresses;
-	m_priv->run_in_thread([&]() mutable { addresses = m_priv->m_adapter.get_paired_device_addresses(); });
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("get_paired_device_addresses()", [priv, &addresses]() { addresses = priv->m_adapter.get_paired_device_addresses(); });
 
 	return addresses;
 }
 
 
+void bluez_interface::set_max_observed_devices(std::size_t max_num_devices)
+{
+	assert(m_priv->m_thread_started);
+	assert(max_num_devices >= 1);
+
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("set_max_observed_devices()", [priv, max_num_devices]() { priv->m_adapter.set_max_observed_devices(max_num_devices); });
+}
+
+
+device_table_stats bluez_interface::get_device_table_stats() const
+{
+	assert(m_priv->m_thread_started);
+
+	device_table_stats stats;
+	bluez_interface_priv *priv = m_priv.get();
+	priv->run_in_thread("get_device_table_stats()", [priv, &stats]() { stats = priv->m_adapter.get_device_table_stats(); });
+
+	return stats;
+}
+
+
+void bluez_interface::wait_for_startup()
+{
+	assert(m_priv->m_thread_started);
+	m_priv->wait_for_startup();
+}
+
+
+startup_timings bluez_interface::get_startup_timings() const
+{
+	std::lock_guard<std::mutex> lock(m_priv->m_startup_timings_mutex);
+	return m_priv->m_startup_timings;
+}
+
+
+mainloop_stats bluez_interface::get_mainloop_stats() const
+{
+	// Deliberately not using run_in_thread() here and in the
+	// functions below. The monitor is thread safe, and going
+	// through the mainloop would make it impossible to get
+	// statistics while the mainloop is stalled.
+	return m_priv->m_mainloop_monitor.get_stats();
+}
+
+
+void bluez_interface::reset_mainloop_stats()
+{
+	m_priv->m_mainloop_monitor.reset_stats();
+}
+
+
+void bluez_interface::set_slow_mainloop_callback_budget(std::chrono::microseconds budget)
+{
+	m_priv->m_mainloop_monitor.set_slow_callback_budget(budget);
+}
+
+
+void bluez_interface::set_tracing_enabled(bool enabled)
+{
+	trace_recorder::instance().set_enabled(enabled);
+}
+
+
+void bluez_interface::add_trace_span(std::string const &category, std::string const &name, std::int64_t start_timestamp_ns, std::int64_t duration_ns)
+{
+	trace_recorder::instance().add_span(category.c_str(), name.c_str(), start_timestamp_ns, duration_ns);
+}
+
+
+void bluez_interface::clear_trace()
+{
+	trace_recorder::instance().clear();
+}
+
+
+std::string bluez_interface::export_chrome_trace() const
+{
+	return trace_recorder::instance().export_chrome_trace_json();
+}
+
+
 } // namespace comboctl end
@@ -0,0 +1,402 @@
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include "scope_guard.hpp"
+#include "broker_client.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("BrokerClient")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+// How long send() waits for the daemon to make room in a full ring.
+constexpr auto full_ring_timeout = std::chrono::seconds(1);
+
+
+void close_fd(int &fd)
+{
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+
+void signal_eventfd(int fd)
+{
+	std::uint64_t value = 1;
+	// The only possible error with a nonblocking eventfd is EAGAIN,
+	// which happens when the counter would overflow. The consumer
+	// is awake in that case anyway, so this can be ignored.
+	ssize_t ret = ::write(fd, &value, sizeof(value));
+	(void)ret;
+}
+
+
+void drain_eventfd(int fd)
+{
+	std::uint64_t value;
+	ssize_t ret = ::read(fd, &value, sizeof(value));
+	(void)ret;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+broker_client::broker_client()
+	: m_control_fd(-1)
+	, m_cancel_eventfd(-1)
+	, m_to_client_eventfd(-1)
+	, m_from_client_eventfd(-1)
+	, m_shm(nullptr)
+	, m_device_open(false)
+	, m_device_lost(false)
+	, m_pending_data_offset(0)
+	, m_pending_data_size(0)
+{
+	// The cancel eventfd exists for the entire lifetime of the client,
+	// so that cancel_receive() can be called at any time without racing
+	// against connect() and disconnect().
+	m_cancel_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_cancel_eventfd < 0)
+		throw io_exception(fmt::format("Could not create eventfd: {} ({})", std::strerror(errno), errno));
+}
+
+
+broker_client::~broker_client()
+{
+	disconnect();
+	close_fd(m_cancel_eventfd);
+}
+
+
+void broker_client::connect(std::string const &socket_path)
+{
+	if (m_control_fd >= 0)
+		throw invalid_call_exception("Already connected to broker");
+
+	struct sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path))
+		throw io_exception(fmt::format("Broker socket path \"{}\" is too long", socket_path));
+	std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+	LOG(debug, "Connecting to broker at {}", socket_path);
+
+	auto disconnect_guard = make_scope_guard([&]() { disconnect(); });
+
+	m_control_fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (m_control_fd < 0)
+		throw io_exception(fmt::format("Could not create broker socket: {} ({})", std::strerror(errno), errno));
+
+	if (::connect(m_control_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0)
+		throw io_exception(fmt::format("Could not connect to broker at {}: {} ({})", socket_path, std::strerror(errno), errno));
+
+	broker_message hello = {};
+	hello.m_type = broker_message_type::hello;
+	hello.m_protocol_version = broker_protocol_version;
+	send_broker_message(m_control_fd, hello);
+
+	broker_message reply;
+	int fds[broker_num_session_fds];
+	std::size_t num_fds = 0;
+	if (!receive_broker_message(m_control_fd, reply, fds, broker_num_session_fds, &num_fds))
+		throw io_exception("Broker closed the connection during the handshake");
+
+	// Wrap the received fds right away so they get closed on error.
+	auto fds_guard = make_scope_guard([&]() {
+		for (std::size_t i = 0; i < num_fds; ++i)
+			::close(fds[i]);
+	});
+
+	if (reply.m_type != broker_message_type::hello_reply)
+		throw io_exception("Broker sent unexpected message during the handshake");
+	if (reply.m_status == broker_status::protocol_version_mismatch)
+		throw io_exception(fmt::format("Broker uses protocol version {}, we use version {}", reply.m_protocol_version, broker_protocol_version));
+	if (reply.m_status != broker_status::ok)
+		throw io_exception(fmt::format("Broker rejected the handshake (status {})", int(reply.m_status)));
+	if (num_fds != broker_num_session_fds)
+		throw io_exception(fmt::format("Broker passed {} file descriptor(s) instead of {}", num_fds, broker_num_session_fds));
+
+	int shm_fd = fds[0];
+
+	// Check the size first. Mapping more than the actual size of
+	// the memfd would cause SIGBUS when accessing the excess pages.
+	struct stat shm_stat;
+	if (::fstat(shm_fd, &shm_stat) < 0)
+		throw io_exception(fmt::format("Could not stat broker shared memory: {} ({})", std::strerror(errno), errno));
+	if (std::size_t(shm_stat.st_size) != broker_shm_size)
+		throw io_exception(fmt::format("Broker shared memory has unexpected size {}", shm_stat.st_size));
+
+	void *shm = ::mmap(nullptr, broker_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (shm == MAP_FAILED)
+		throw io_exception(fmt::format("Could not map broker shared memory: {} ({})", std::strerror(errno), errno));
+	m_shm = shm;
+
+	// The mapping keeps the shared memory alive; the fd is not needed anymore.
+	::close(shm_fd);
+	m_to_client_eventfd = fds[1];
+	m_from_client_eventfd = fds[2];
+	fds_guard.dismiss();
+
+	auto shm_bytes = reinterpret_cast<std::uint8_t *>(m_shm);
+	m_to_client_ring = shm_spsc_ring::attach(shm_bytes + broker_to_client_ring_offset, broker_ring_region_size);
+	m_from_client_ring = shm_spsc_ring::attach(shm_bytes + broker_from_client_ring_offset, broker_ring_region_size);
+
+	m_pending_data.resize(m_to_client_ring->get_max_payload_size());
+	m_pending_data_offset = 0;
+	m_pending_data_size = 0;
+
+	disconnect_guard.dismiss();
+
+	LOG(info, "Connected to broker at {}; ring capacity: {} byte(s)", socket_path, m_to_client_ring->get_capacity());
+}
+
+
+void broker_client::disconnect()
+{
+	if (m_shm != nullptr)
+	{
+		::munmap(m_shm, broker_shm_size);
+		m_shm = nullptr;
+	}
+
+	m_to_client_ring.reset();
+	m_from_client_ring.reset();
+
+	close_fd(m_to_client_eventfd);
+	close_fd(m_from_client_eventfd);
+
+	// Closing the control socket implicitly closes any open
+	// device on the daemon side, so there is no need to send
+	// a close_device message here.
+	if (m_control_fd >= 0)
+	{
+		LOG(debug, "Disconnecting from broker");
+		close_fd(m_control_fd);
+	}
+
+	m_device_open = false;
+	m_device_lost = false;
+	m_pending_data_size = 0;
+}
+
+
+void broker_client::open_device(bluetooth_address const &device_address)
+{
+	if (!m_to_client_ring)
+		throw invalid_call_exception("Not connected to broker");
+	if (m_device_open)
+		throw invalid_call_exception("A device is already open");
+
+	broker_message request = {};
+	request.m_type = broker_message_type::open_device;
+	std::copy(device_address.begin(), device_address.end(), request.m_device_address);
+	send_broker_message(m_control_fd, request);
+
+	LOG(debug, "Requested broker to open device {}", to_string(device_address));
+
+	broker_message reply;
+	wait_for_reply(broker_message_type::open_device_reply, reply);
+
+	if (reply.m_status != broker_status::ok)
+		throw io_exception(fmt::format("Broker could not open device {} (status {})", to_string(device_address), int(reply.m_status)));
+
+	m_device_open = true;
+	m_device_lost = false;
+	m_pending_data_size = 0;
+
+	LOG(info, "Opened device {} through broker", to_string(device_address));
+}
+
+
+void broker_client::close_device()
+{
+	if (!m_device_open)
+		return;
+
+	m_device_open = false;
+	m_pending_data_size = 0;
+
+	// If the link was lost, the daemon already closed the device.
+	if (m_device_lost)
+		return;
+
+	broker_message request = {};
+	request.m_type = broker_message_type::close_device;
+	send_broker_message(m_control_fd, request);
+
+	broker_message reply;
+	wait_for_reply(broker_message_type::close_device_reply, reply);
+
+	LOG(info, "Closed device through broker");
+}
+
+
+void broker_client::send(void const *src, int num_bytes)
+{
+	assert(src != nullptr);
+	assert(num_bytes > 0);
+
+	if (!m_device_open)
+		throw invalid_call_exception("No device is open");
+	if (m_device_lost)
+		throw io_exception("Connection to device was lost");
+	if (std::uint32_t(num_bytes) > m_from_client_ring->get_max_payload_size())
+		throw invalid_call_exception(fmt::format("Cannot send {} byte(s) at once; maximum is {}", num_bytes, m_from_client_ring->get_max_payload_size()));
+
+	// The daemon drains the ring in its main loop, which never waits
+	// for pumps, so the ring is only full for short periods of time.
+	// Polling with a short sleep is therefore sufficient here, and
+	// avoids the need for a second "space available" eventfd.
+	auto deadline = std::chrono::steady_clock::now() + full_ring_timeout;
+	while (!m_from_client_ring->try_push(src, std::uint32_t(num_bytes)))
+	{
+		if (std::chrono::steady_clock::now() >= deadline)
+			throw io_exception("Broker did not drain the send ring in time");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	signal_eventfd(m_from_client_eventfd);
+
+	LOG(trace, "Pushed {} byte(s) to broker", num_bytes);
+}
+
+
+int broker_client::receive(void *dest, int num_bytes)
+{
+	assert(dest != nullptr);
+	assert(num_bytes > 0);
+
+	if (!m_device_open)
+		throw invalid_call_exception("No device is open");
+
+	while (true)
+	{
+		if (m_pending_data_size > 0)
+		{
+			std::size_t num_bytes_to_copy = std::min(m_pending_data_size, std::size_t(num_bytes));
+			std::memcpy(dest, m_pending_data.data() + m_pending_data_offset, num_bytes_to_copy);
+			m_pending_data_offset += num_bytes_to_copy;
+			m_pending_data_size -= num_bytes_to_copy;
+			return int(num_bytes_to_copy);
+		}
+
+		// Records that were received before the link was lost
+		// are still delivered; the error comes afterwards.
+		int record_size = m_to_client_ring->try_pop(m_pending_data.data(), std::uint32_t(m_pending_data.size()));
+		if (record_size > 0)
+		{
+			m_pending_data_offset = 0;
+			m_pending_data_size = std::size_t(record_size);
+			continue;
+		}
+		else if (record_size == 0)
+			continue;
+
+		if (m_device_lost)
+			throw io_exception("Connection to device was lost");
+
+		struct pollfd fds[3];
+		fds[0].fd = m_to_client_eventfd;
+		fds[0].events = POLLIN;
+		fds[1].fd = m_cancel_eventfd;
+		fds[1].events = POLLIN;
+		fds[2].fd = m_control_fd;
+		fds[2].events = POLLIN;
+
+		if (::poll(fds, 3, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw io_exception(fmt::format("Could not poll broker fds: {} ({})", std::strerror(errno), errno));
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			drain_eventfd(m_cancel_eventfd);
+			LOG(debug, "Receive canceled");
+			throw io_exception("Receive canceled");
+		}
+
+		if (fds[0].revents & POLLIN)
+			drain_eventfd(m_to_client_eventfd);
+
+		if (fds[2].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			broker_message message;
+			if (!receive_broker_message(m_control_fd, message))
+			{
+				m_device_lost = true;
+				throw io_exception("Broker closed the connection");
+			}
+			handle_unsolicited_message(message);
+		}
+	}
+}
+
+
+void broker_client::cancel_receive()
+{
+	signal_eventfd(m_cancel_eventfd);
+}
+
+
+void broker_client::wait_for_reply(broker_message_type reply_type, broker_message &reply)
+{
+	while (true)
+	{
+		if (!receive_broker_message(m_control_fd, reply))
+			throw io_exception("Broker closed the connection");
+
+		if (reply.m_type == reply_type)
+			return;
+
+		handle_unsolicited_message(reply);
+	}
+}
+
+
+void broker_client::handle_unsolicited_message(broker_message const &message)
+{
+	switch (message.m_type)
+	{
+		case broker_message_type::device_disconnected:
+		{
+			bluetooth_address device_address;
+			std::copy(std::begin(message.m_device_address), std::end(message.m_device_address), device_address.begin());
+			LOG(info, "Broker reports that the connection to device {} was lost", to_string(device_address));
+			m_device_lost = true;
+			break;
+		}
+
+		default:
+			throw io_exception(fmt::format("Broker sent unexpected message of type {}", unsigned(message.m_type)));
+	}
+}
+
+
+} // namespace comboctl end
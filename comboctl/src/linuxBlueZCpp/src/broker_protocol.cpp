@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include "broker_protocol.hpp"
+#include "exception.hpp"
+
+
+namespace comboctl
+{
+
+
+std::string get_default_broker_socket_path()
+{
+	char const *runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+	if ((runtime_dir != nullptr) && (runtime_dir[0] != '\0'))
+		return fmt::format("{}/comboctl-broker.sock", runtime_dir);
+	else
+		return fmt::format("/tmp/comboctl-broker-{}.sock", getuid());
+}
+
+
+void send_broker_message(int socket_fd, broker_message const &message, int const *fds, std::size_t num_fds)
+{
+	assert(num_fds <= broker_num_session_fds);
+	assert((num_fds == 0) || (fds != nullptr));
+
+	struct iovec iov;
+	iov.iov_base = const_cast<broker_message *>(&message);
+	iov.iov_len = sizeof(message);
+
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int) * broker_num_session_fds)];
+		struct cmsghdr align;
+	} control_buffer;
+	std::memset(&control_buffer, 0, sizeof(control_buffer));
+
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (num_fds > 0)
+	{
+		msg.msg_control = control_buffer.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	while (true)
+	{
+		ssize_t num_bytes_sent = ::sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+		if (num_bytes_sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw io_exception(fmt::format("Could not send broker message: {} ({})", std::strerror(errno), errno));
+		}
+
+		// SOCK_SEQPACKET sockets transmit messages atomically.
+		assert(std::size_t(num_bytes_sent) == sizeof(message));
+		break;
+	}
+}
+
+
+bool receive_broker_message(int socket_fd, broker_message &message, int *fds, std::size_t max_num_fds, std::size_t *num_fds)
+{
+	assert(max_num_fds <= broker_num_session_fds);
+	assert((max_num_fds == 0) || (fds != nullptr));
+
+	if (num_fds != nullptr)
+		*num_fds = 0;
+
+	struct iovec iov;
+	iov.iov_base = &message;
+	iov.iov_len = sizeof(message);
+
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int) * broker_num_session_fds)];
+		struct cmsghdr align;
+	} control_buffer;
+
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control_buffer.buf;
+	msg.msg_controllen = sizeof(control_buffer.buf);
+
+	ssize_t num_bytes_received;
+	while (true)
+	{
+		num_bytes_received = ::recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+		if (num_bytes_received < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw io_exception(fmt::format("Could not receive broker message: {} ({})", std::strerror(errno), errno));
+		}
+		break;
+	}
+
+	// Take ownership of any passed file descriptors first, even if
+	// the message turns out to be malformed, to not leak them.
+	std::size_t num_received_fds = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		std::size_t num_cmsg_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (std::size_t i = 0; i < num_cmsg_fds; ++i)
+		{
+			int fd;
+			std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+			if (num_received_fds < max_num_fds)
+				fds[num_received_fds++] = fd;
+			else
+				::close(fd);
+		}
+	}
+
+	if (num_fds != nullptr)
+		*num_fds = num_received_fds;
+
+	if (num_bytes_received == 0)
+		return false;
+
+	if ((std::size_t(num_bytes_received) != sizeof(message)) || ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0))
+		throw io_exception(fmt::format("Received malformed broker message ({} byte(s))", num_bytes_received));
+
+	return true;
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,74 @@
+#include <assert.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <cstdint>
+#include "cancellable.hpp"
+
+
+namespace comboctl
+{
+
+
+cancellable::cancellable()
+	: m_canceled(false)
+{
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	// Like the connect pipe in rfcomm_connection, this only fails
+	// if hard system-wide resource limits were reached.
+	assert(m_event_fd >= 0);
+}
+
+
+cancellable::~cancellable()
+{
+	::close(m_event_fd);
+}
+
+
+void cancellable::cancel()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_canceled)
+		return;
+
+	// Set the flag before writing to the eventfd, so that
+	// operations that are woken up by it see the flag.
+	m_canceled = true;
+
+	std::uint64_t value = 1;
+	ssize_t posix_ret = ::write(m_event_fd, &value, sizeof(value));
+	assert(posix_ret == sizeof(value));
+}
+
+
+void cancellable::reset()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_canceled)
+		return;
+
+	// Reading an eventfd resets its counter to zero,
+	// which makes the file descriptor unreadable again.
+	std::uint64_t value;
+	ssize_t posix_ret = ::read(m_event_fd, &value, sizeof(value));
+	assert(posix_ret == sizeof(value));
+
+	m_canceled = false;
+}
+
+
+bool cancellable::is_canceled() const
+{
+	return m_canceled;
+}
+
+
+int cancellable::get_fd() const
+{
+	return m_event_fd;
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,818 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "dbus_connection.hpp"
+#include "dbus_error_exception.hpp"
+#include "scope_guard.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("DBusConnection")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+constexpr char const *default_system_bus_address = "unix:path=/var/run/dbus/system_bus_socket";
+
+constexpr char const *bus_name = "org.freedesktop.DBus";
+constexpr char const *bus_path = "/org/freedesktop/DBus";
+constexpr char const *bus_interface = "org.freedesktop.DBus";
+
+constexpr std::size_t min_read_size = 16 * 1024;
+constexpr std::size_t max_auth_line_length = 512;
+
+
+std::string unescape_address_value(std::string_view value)
+{
+	std::string result;
+
+	for (std::size_t i = 0; i < value.size(); ++i)
+	{
+		if ((value[i] == '%') && ((i + 2) < value.size()))
+		{
+			result += char(std::stoi(std::string(value.substr(i + 1, 2)), nullptr, 16));
+			i += 2;
+		}
+		else
+			result += value[i];
+	}
+
+	return result;
+}
+
+
+// Fills in the socket address for the first supported entry of a
+// D-Bus address (like "unix:path=/run/dbus/system_bus_socket").
+// Returns the size of the address, or 0 if there is no supported entry.
+socklen_t parse_bus_address(std::string const &address, struct sockaddr_un &socket_address)
+{
+	std::string_view remaining_address = address;
+
+	while (!remaining_address.empty())
+	{
+		std::size_t entry_end = remaining_address.find(';');
+		std::string_view entry = remaining_address.substr(0, entry_end);
+		remaining_address = (entry_end == std::string_view::npos) ? std::string_view() : remaining_address.substr(entry_end + 1);
+
+		if (entry.substr(0, 5) != "unix:")
+			continue;
+
+		std::string_view parameters = entry.substr(5);
+		while (!parameters.empty())
+		{
+			std::size_t parameter_end = parameters.find(',');
+			std::string_view parameter = parameters.substr(0, parameter_end);
+			parameters = (parameter_end == std::string_view::npos) ? std::string_view() : parameters.substr(parameter_end + 1);
+
+			bool is_abstract;
+			if (parameter.substr(0, 5) == "path=")
+				is_abstract = false;
+			else if (parameter.substr(0, 9) == "abstract=")
+				is_abstract = true;
+			else
+				continue;
+
+			std::string path = unescape_address_value(parameter.substr(parameter.find('=') + 1));
+
+			// Abstract socket names start with a null byte instead of a slash.
+			std::size_t path_offset = is_abstract ? 1 : 0;
+			if ((path_offset + path.size()) >= sizeof(socket_address.sun_path))
+				throw io_exception(fmt::format("D-Bus socket path \"{}\" is too long", path));
+
+			socket_address = {};
+			socket_address.sun_family = AF_UNIX;
+			std::memcpy(socket_address.sun_path + path_offset, path.data(), path.size());
+
+			return socklen_t(offsetof(struct sockaddr_un, sun_path) + path_offset + path.size() + (is_abstract ? 0 : 1));
+		}
+	}
+
+	return 0;
+}
+
+
+int get_poll_timeout(std::chrono::steady_clock::time_point deadline)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (deadline <= now)
+		return 0;
+
+	return int(std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count());
+}
+
+
+} // unnamed namespace end
+
+
+
+
+dbus_connection::dbus_connection()
+	: m_socket_fd(-1)
+	, m_next_serial(1)
+	, m_reactor(nullptr)
+	, m_dispatch_posted(false)
+	, m_read_begin(0)
+	, m_read_end(0)
+	, m_dispatch_depth(0)
+	, m_next_subscription_id(1)
+{
+	m_cancel_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_cancel_fd < 0)
+		throw io_exception(fmt::format("Could not create eventfd: {} ({})", std::strerror(errno), errno));
+}
+
+
+dbus_connection::~dbus_connection()
+{
+	close();
+	::close(m_cancel_fd);
+}
+
+
+std::string dbus_connection::get_system_bus_address()
+{
+	char const *address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+	return (address != nullptr) ? address : default_system_bus_address;
+}
+
+
+void dbus_connection::open(std::string const &address)
+{
+	if (is_open())
+		throw invalid_call_exception("D-Bus connection already open");
+
+	if (is_cancelled())
+		throw dbus_error_exception(dbus_error_exception::cancelled_error_name, "Operation was cancelled");
+
+	auto close_guard = make_scope_guard([&]() { close(); });
+
+	auto deadline = std::chrono::steady_clock::now() + default_call_timeout;
+
+	connect_socket(address);
+	authenticate(deadline);
+
+	// Every connection has to call Hello before it can do anything
+	// else on the bus. The reply contains our unique bus name.
+	dbus_message reply = call(dbus_message_builder::method_call(bus_name, bus_path, bus_interface, "Hello"));
+	m_unique_name = reply.get_body_reader().read_string();
+
+	close_guard.dismiss();
+
+	LOG(debug, "Connected to D-Bus at {} with unique name {}", address, m_unique_name);
+}
+
+
+void dbus_connection::close()
+{
+	if (!is_open())
+		return;
+
+	detach();
+
+	::close(m_socket_fd);
+	m_socket_fd = -1;
+
+	m_unique_name.clear();
+	m_stashed_messages.clear();
+	m_read_begin = m_read_end = 0;
+	if (m_dispatch_depth == 0)
+		m_retired_read_buffers.clear();
+}
+
+
+bool dbus_connection::is_open() const
+{
+	return m_socket_fd >= 0;
+}
+
+
+void dbus_connection::cancel()
+{
+	std::uint64_t increment = 1;
+	if (::write(m_cancel_fd, &increment, sizeof(increment)) < 0)
+		LOG(trace, "Could not write to cancel eventfd: {} ({})", std::strerror(errno), errno);
+}
+
+
+void dbus_connection::reset_cancellation()
+{
+	std::uint64_t counter;
+	while (::read(m_cancel_fd, &counter, sizeof(counter)) > 0);
+}
+
+
+std::string const & dbus_connection::get_unique_name() const
+{
+	return m_unique_name;
+}
+
+
+void dbus_connection::attach(epoll_reactor &reactor)
+{
+	throw_if_not_open();
+	assert(m_reactor == nullptr);
+
+	m_reactor = &reactor;
+	m_reactor->add_fd(m_socket_fd, EPOLLIN, [this](std::uint32_t) {
+		try
+		{
+			read_from_socket();
+			dispatch();
+		}
+		catch (std::exception const &exc)
+		{
+			handle_connection_error(exc);
+		}
+	});
+
+	// Messages may have been stashed before attaching,
+	// for example by the Hello call in open().
+	if (!m_stashed_messages.empty())
+		post_dispatch();
+}
+
+
+void dbus_connection::detach()
+{
+	if (m_reactor == nullptr)
+		return;
+
+	m_reactor->remove_fd(m_socket_fd);
+	m_reactor = nullptr;
+}
+
+
+dbus_message dbus_connection::call(dbus_message_builder const &message, std::chrono::milliseconds timeout, bool ignore_cancellation)
+{
+	assert(message.get_type() == dbus_message_type::method_call);
+	assert(!message.is_no_reply_expected());
+
+	throw_if_not_open();
+
+	if (!ignore_cancellation && is_cancelled())
+		throw dbus_error_exception(dbus_error_exception::cancelled_error_name, "Operation was cancelled");
+
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	std::uint32_t serial = send_message(message);
+
+	while (true)
+	{
+		std::optional<dbus_message> incoming_message;
+		while (take_buffered_message(incoming_message))
+		{
+			bool is_reply = ((incoming_message->get_type() == dbus_message_type::method_return) || (incoming_message->get_type() == dbus_message_type::error))
+			             && (incoming_message->get_reply_serial() == serial);
+
+			if (!is_reply)
+			{
+				stash_message(*incoming_message);
+				continue;
+			}
+
+			if (incoming_message->get_type() == dbus_message_type::error)
+				throw dbus_error_exception(std::string(incoming_message->get_error_name()), std::string(incoming_message->get_error_message()));
+
+			return incoming_message->make_owned_copy();
+		}
+
+		if (!wait_for_socket(POLLIN, deadline, ignore_cancellation))
+			throw dbus_error_exception("org.freedesktop.DBus.Error.NoReply", "Timed out waiting for a reply");
+
+		read_from_socket();
+	}
+}
+
+
+void dbus_connection::send(dbus_message_builder const &message)
+{
+	throw_if_not_open();
+	send_message(message);
+}
+
+
+unsigned int dbus_connection::subscribe_signals(std::string match_rule, message_handler handler)
+{
+	assert(handler);
+
+	dbus_message_builder add_match_call = dbus_message_builder::method_call(bus_name, bus_path, bus_interface, "AddMatch");
+	add_match_call.body().append_string(match_rule);
+	call(add_match_call);
+
+	unsigned int subscription_id = m_next_subscription_id++;
+	m_signal_subscriptions.push_back({ subscription_id, std::move(match_rule), std::move(handler) });
+
+	return subscription_id;
+}
+
+
+void dbus_connection::unsubscribe_signals(unsigned int subscription_id)
+{
+	auto subscription_iter = std::find_if(m_signal_subscriptions.begin(), m_signal_subscriptions.end(), [subscription_id](signal_subscription const &subscription) {
+		return subscription.m_id == subscription_id;
+	});
+	if (subscription_iter == m_signal_subscriptions.end())
+		return;
+
+	if (is_open())
+	{
+		dbus_message_builder remove_match_call = dbus_message_builder::method_call(bus_name, bus_path, bus_interface, "RemoveMatch");
+		remove_match_call.set_no_reply_expected();
+		remove_match_call.body().append_string(subscription_iter->m_match_rule);
+
+		try
+		{
+			send(remove_match_call);
+		}
+		catch (std::exception const &exc)
+		{
+			LOG(debug, "Could not send RemoveMatch call: {}", exc.what());
+		}
+	}
+
+	m_signal_subscriptions.erase(subscription_iter);
+}
+
+
+void dbus_connection::register_object(std::string object_path, message_handler handler)
+{
+	assert(handler);
+
+	if (m_objects.find(object_path) != m_objects.end())
+		throw invalid_call_exception(fmt::format("D-Bus object {} already registered", object_path));
+
+	m_objects.emplace(std::move(object_path), std::move(handler));
+}
+
+
+void dbus_connection::unregister_object(std::string const &object_path)
+{
+	m_objects.erase(object_path);
+}
+
+
+void dbus_connection::connect_socket(std::string const &address)
+{
+	struct sockaddr_un socket_address;
+	socklen_t socket_address_size = parse_bus_address(address, socket_address);
+	if (socket_address_size == 0)
+		throw io_exception(fmt::format("Unsupported D-Bus address \"{}\"", address));
+
+	m_socket_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (m_socket_fd < 0)
+		throw io_exception(fmt::format("Could not create D-Bus socket: {} ({})", std::strerror(errno), errno));
+
+	// Unix domain sockets connect right away, unless
+	// the listening socket's backlog is full.
+	if (::connect(m_socket_fd, reinterpret_cast<struct sockaddr *>(&socket_address), socket_address_size) < 0)
+	{
+		if ((errno != EAGAIN) && (errno != EINPROGRESS))
+			throw io_exception(fmt::format("Could not connect to D-Bus at {}: {} ({})", address, std::strerror(errno), errno));
+
+		if (!wait_for_socket(POLLOUT, std::chrono::steady_clock::now() + default_call_timeout))
+			throw io_exception(fmt::format("Timed out connecting to D-Bus at {}", address));
+
+		int socket_error = 0;
+		socklen_t socket_error_size = sizeof(socket_error);
+		::getsockopt(m_socket_fd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_size);
+		if (socket_error != 0)
+			throw io_exception(fmt::format("Could not connect to D-Bus at {}: {} ({})", address, std::strerror(socket_error), socket_error));
+	}
+}
+
+
+void dbus_connection::authenticate(std::chrono::steady_clock::time_point deadline)
+{
+	// The EXTERNAL mechanism authenticates us with the credentials
+	// of the socket. The argument is the hex-encoded decimal UID.
+	// The initial null byte is required by the protocol.
+
+	std::string uid_string = std::to_string(::getuid());
+	std::string auth_command = std::string(1, '\0') + "AUTH EXTERNAL ";
+	for (char uid_char : uid_string)
+		auth_command += fmt::format("{:02x}", int(uid_char));
+	auth_command += "\r\n";
+
+	struct iovec auth_iovec = { auth_command.data(), auth_command.size() };
+	write_all(&auth_iovec, 1);
+
+	std::string response = read_auth_line(deadline);
+	if (response.substr(0, 3) != "OK ")
+		throw io_exception(fmt::format("D-Bus authentication failed: {}", response));
+
+	std::string begin_command = "BEGIN\r\n";
+	struct iovec begin_iovec = { begin_command.data(), begin_command.size() };
+	write_all(&begin_iovec, 1);
+}
+
+
+std::string dbus_connection::read_auth_line(std::chrono::steady_clock::time_point deadline)
+{
+	// Read byte by byte, since the bus does not send anything after
+	// the OK line until we sent BEGIN, and anything after that
+	// belongs to the message stream.
+
+	std::string line;
+
+	while (true)
+	{
+		char c;
+		ssize_t num_read_bytes = ::recv(m_socket_fd, &c, 1, 0);
+
+		if (num_read_bytes == 0)
+			throw io_exception("D-Bus connection closed during authentication");
+
+		if (num_read_bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				throw io_exception(fmt::format("Could not read from D-Bus socket: {} ({})", std::strerror(errno), errno));
+
+			if (!wait_for_socket(POLLIN, deadline))
+				throw io_exception("Timed out during D-Bus authentication");
+
+			continue;
+		}
+
+		line += c;
+		if ((line.size() >= 2) && (line.compare(line.size() - 2, 2, "\r\n") == 0))
+		{
+			line.resize(line.size() - 2);
+			return line;
+		}
+
+		if (line.size() > max_auth_line_length)
+			throw io_exception("D-Bus authentication line too long");
+	}
+}
+
+
+std::uint32_t dbus_connection::send_message(dbus_message_builder const &message)
+{
+	std::uint32_t serial = m_next_serial++;
+	if (m_next_serial == 0)
+		m_next_serial = 1;
+
+	// Send the header and the body in one go, without
+	// first copying them into a contiguous buffer.
+	std::vector<std::uint8_t> header = message.build_header(serial);
+	std::vector<std::uint8_t> const &body = message.get_body_data();
+
+	struct iovec iovecs[2];
+	iovecs[0] = { header.data(), header.size() };
+	iovecs[1] = { const_cast<std::uint8_t *>(body.data()), body.size() };
+
+	write_all(iovecs, body.empty() ? 1 : 2);
+
+	return serial;
+}
+
+
+void dbus_connection::write_all(struct iovec *iovecs, int num_iovecs)
+{
+	struct msghdr message_header = {};
+	message_header.msg_iov = iovecs;
+	message_header.msg_iovlen = num_iovecs;
+
+	while (message_header.msg_iovlen > 0)
+	{
+		ssize_t num_written_bytes = ::sendmsg(m_socket_fd, &message_header, MSG_NOSIGNAL);
+
+		if (num_written_bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				throw io_exception(fmt::format("Could not write to D-Bus socket: {} ({})", std::strerror(errno), errno));
+
+			// The socket buffer is full. Wait without a deadline, since
+			// the bus eventually reads the data, unless it is stuck, in
+			// which case the cancellation gets us out of here.
+			try
+			{
+				wait_for_socket(POLLOUT, std::chrono::steady_clock::time_point::max());
+			}
+			catch (dbus_error_exception const &)
+			{
+				// A partially written message would corrupt the stream.
+				LOG(debug, "Write to D-Bus socket cancelled; closing connection");
+				close();
+				throw;
+			}
+
+			continue;
+		}
+
+		// Skip what was written.
+		std::size_t num_remaining_bytes = num_written_bytes;
+		while ((message_header.msg_iovlen > 0) && (num_remaining_bytes >= message_header.msg_iov->iov_len))
+		{
+			num_remaining_bytes -= message_header.msg_iov->iov_len;
+			++message_header.msg_iov;
+			--message_header.msg_iovlen;
+		}
+		if (message_header.msg_iovlen > 0)
+		{
+			message_header.msg_iov->iov_base = reinterpret_cast<std::uint8_t *>(message_header.msg_iov->iov_base) + num_remaining_bytes;
+			message_header.msg_iov->iov_len -= num_remaining_bytes;
+		}
+	}
+}
+
+
+bool dbus_connection::wait_for_socket(short events, std::chrono::steady_clock::time_point deadline, bool ignore_cancellation)
+{
+	while (true)
+	{
+		struct pollfd fds[2];
+		fds[0].fd = m_socket_fd;
+		fds[0].events = events;
+		fds[0].revents = 0;
+		fds[1].fd = m_cancel_fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		int timeout = (deadline == std::chrono::steady_clock::time_point::max()) ? -1 : get_poll_timeout(deadline);
+
+		// Leaving out the eventfd is enough to ignore the cancellation.
+		int num_ready_fds = ::poll(fds, ignore_cancellation ? 1 : 2, timeout);
+		if (num_ready_fds < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw io_exception(fmt::format("Could not poll D-Bus socket: {} ({})", std::strerror(errno), errno));
+		}
+
+		if (fds[1].revents & POLLIN)
+			throw dbus_error_exception(dbus_error_exception::cancelled_error_name, "Operation was cancelled");
+
+		// Errors and hangups are reported by the subsequent read or write.
+		if (fds[0].revents != 0)
+			return true;
+
+		if (num_ready_fds == 0)
+			return false;
+	}
+}
+
+
+bool dbus_connection::is_cancelled() const
+{
+	struct pollfd fd = { m_cancel_fd, POLLIN, 0 };
+	return (::poll(&fd, 1, 0) > 0) && (fd.revents & POLLIN);
+}
+
+
+void dbus_connection::throw_if_not_open() const
+{
+	if (!is_open())
+		throw io_exception("D-Bus connection is not open");
+}
+
+
+std::size_t dbus_connection::read_from_socket()
+{
+	prepare_read_buffer();
+
+	while (true)
+	{
+		ssize_t num_read_bytes = ::recv(m_socket_fd, m_read_buffer.data() + m_read_end, m_read_buffer.size() - m_read_end, 0);
+
+		if (num_read_bytes == 0)
+			throw io_exception("D-Bus connection closed by the bus");
+
+		if (num_read_bytes < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			throw io_exception(fmt::format("Could not read from D-Bus socket: {} ({})", std::strerror(errno), errno));
+		}
+
+		m_read_end += num_read_bytes;
+		return std::size_t(num_read_bytes);
+	}
+}
+
+
+void dbus_connection::prepare_read_buffer()
+{
+	std::size_t num_unconsumed_bytes = m_read_end - m_read_begin;
+
+	if (m_dispatch_depth == 0)
+	{
+		// No messages refer to the buffer, so the unconsumed
+		// data can be moved to the front, and retired buffers
+		// are no longer needed.
+		if (m_read_begin > 0)
+		{
+			std::memmove(m_read_buffer.data(), m_read_buffer.data() + m_read_begin, num_unconsumed_bytes);
+			m_read_begin = 0;
+			m_read_end = num_unconsumed_bytes;
+		}
+
+		m_retired_read_buffers.clear();
+	}
+
+	// Make sure there is enough room for the rest of the current
+	// message, if its size is known, and for at least min_read_size.
+	std::size_t required_free_space = min_read_size;
+	std::size_t message_size = dbus_message::get_message_size(m_read_buffer.data() + m_read_begin, num_unconsumed_bytes);
+	if (message_size > num_unconsumed_bytes)
+		required_free_space = std::max(required_free_space, message_size - num_unconsumed_bytes);
+
+	if ((m_read_buffer.size() - m_read_end) >= required_free_space)
+		return;
+
+	std::size_t new_size = std::max(m_read_buffer.size() * 2, num_unconsumed_bytes + required_free_space);
+
+	if (m_dispatch_depth == 0)
+	{
+		m_read_buffer.resize(new_size);
+	}
+	else
+	{
+		std::vector<std::uint8_t> new_read_buffer(new_size);
+		std::memcpy(new_read_buffer.data(), m_read_buffer.data() + m_read_begin, num_unconsumed_bytes);
+
+		m_retired_read_buffers.push_back(std::move(m_read_buffer));
+		m_read_buffer = std::move(new_read_buffer);
+		m_read_begin = 0;
+		m_read_end = num_unconsumed_bytes;
+	}
+}
+
+
+bool dbus_connection::take_buffered_message(std::optional<dbus_message> &message)
+{
+	std::uint8_t const *data = m_read_buffer.data() + m_read_begin;
+	std::size_t num_unconsumed_bytes = m_read_end - m_read_begin;
+
+	std::size_t message_size = dbus_message::get_message_size(data, num_unconsumed_bytes);
+	if ((message_size == 0) || (message_size > num_unconsumed_bytes))
+		return false;
+
+	message.emplace(data, message_size);
+	m_read_begin += message_size;
+
+	return true;
+}
+
+
+void dbus_connection::stash_message(dbus_message const &message)
+{
+	m_stashed_messages.push_back(message.make_owned_copy());
+
+	if (m_reactor != nullptr)
+		post_dispatch();
+}
+
+
+void dbus_connection::post_dispatch()
+{
+	// The socket may not become readable again, so the
+	// reactor is told to dispatch the stashed messages.
+
+	if (m_dispatch_posted)
+		return;
+
+	m_dispatch_posted = true;
+	m_reactor->post([this]() {
+		m_dispatch_posted = false;
+		if (!is_open())
+			return;
+
+		try
+		{
+			dispatch();
+		}
+		catch (std::exception const &exc)
+		{
+			handle_connection_error(exc);
+		}
+	});
+}
+
+
+void dbus_connection::dispatch()
+{
+	++m_dispatch_depth;
+	auto depth_guard = make_scope_guard([&]() { --m_dispatch_depth; });
+
+	// Messages that a blocking call received while waiting for its reply
+	// arrived before anything that is still in the read buffer, so they
+	// are dispatched first. A handler may in turn make a blocking call,
+	// which stashes more messages, so this is checked after each message.
+	while (is_open())
+	{
+		if (!m_stashed_messages.empty())
+		{
+			dbus_message message = std::move(m_stashed_messages.front());
+			m_stashed_messages.pop_front();
+			handle_message(message);
+			continue;
+		}
+
+		std::optional<dbus_message> message;
+		if (!take_buffered_message(message))
+			break;
+
+		handle_message(*message);
+	}
+}
+
+
+void dbus_connection::handle_message(dbus_message const &message)
+{
+	switch (message.get_type())
+	{
+		case dbus_message_type::method_call:
+			handle_method_call(message);
+			break;
+
+		case dbus_message_type::signal:
+			// Use indices, since handlers may unsubscribe.
+			for (std::size_t i = 0; i < m_signal_subscriptions.size(); ++i)
+			{
+				try
+				{
+					m_signal_subscriptions[i].m_handler(message);
+				}
+				catch (std::exception const &exc)
+				{
+					LOG(error, "Caught exception while handling D-Bus signal {}.{}: {}", message.get_interface(), message.get_member(), exc.what());
+				}
+			}
+			break;
+
+		default:
+			// Replies that nobody waits for (anymore), for
+			// example to calls that timed out, are dropped.
+			LOG(trace, "Dropping unexpected D-Bus message of type {} (reply serial {})", int(message.get_type()), message.get_reply_serial().value_or(0));
+			break;
+	}
+}
+
+
+void dbus_connection::handle_method_call(dbus_message const &message)
+{
+	bool reply_expected = !(message.get_flags() & dbus_flag_no_reply_expected);
+
+	if (message.is_method_call("org.freedesktop.DBus.Peer", "Ping"))
+	{
+		if (reply_expected)
+			send(dbus_message_builder::method_return(message));
+		return;
+	}
+
+	auto object_iter = m_objects.find(message.get_path());
+	if (object_iter == m_objects.end())
+	{
+		LOG(debug, "Got method call {}.{} for unknown object {}", message.get_interface(), message.get_member(), message.get_path());
+		if (reply_expected)
+			send(dbus_message_builder::error(message, "org.freedesktop.DBus.Error.UnknownObject", fmt::format("No such object path '{}'", message.get_path())));
+		return;
+	}
+
+	try
+	{
+		object_iter->second(message);
+	}
+	catch (std::exception const &exc)
+	{
+		LOG(error, "Caught exception while handling D-Bus method call {}.{}: {}", message.get_interface(), message.get_member(), exc.what());
+		if (reply_expected && is_open())
+			send(dbus_message_builder::error(message, "org.freedesktop.DBus.Error.Failed", exc.what()));
+	}
+}
+
+
+void dbus_connection::handle_connection_error(std::exception const &exc)
+{
+	// There is no way to recover from errors like malformed messages
+	// or a bus that went away, and leaving the socket in the reactor
+	// would make it report the socket as ready over and over.
+	LOG(error, "D-Bus connection error: {}; closing connection", exc.what());
+	close();
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,34 @@
+#include "dbus_error_exception.hpp"
+
+
+namespace comboctl
+{
+
+
+dbus_error_exception::dbus_error_exception(std::string error_name, std::string error_message)
+	: exception("D-Bus error " + error_name + ": " + error_message)
+	, m_error_name(std::move(error_name))
+	, m_error_message(std::move(error_message))
+{
+}
+
+
+std::string const & dbus_error_exception::get_error_name() const
+{
+	return m_error_name;
+}
+
+
+std::string const & dbus_error_exception::get_error_message() const
+{
+	return m_error_message;
+}
+
+
+bool dbus_error_exception::is_cancelled() const
+{
+	return m_error_name == cancelled_error_name;
+}
+
+
+} // namespace comboctl end
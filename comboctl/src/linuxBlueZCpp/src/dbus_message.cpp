@@ -0,0 +1,1022 @@
+#include <cstring>
+#include <assert.h>
+#include <fmt/format.h>
+#include "dbus_message.hpp"
+#include "exception.hpp"
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+// Limits from the D-Bus specification.
+constexpr std::size_t max_message_size = 128 * 1024 * 1024;
+constexpr std::size_t max_array_size = 64 * 1024 * 1024;
+constexpr unsigned int max_nesting_depth = 64;
+
+constexpr std::size_t fixed_header_size = 16;
+
+constexpr bool host_is_big_endian = (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+
+enum header_field_code : std::uint8_t
+{
+	header_field_path = 1,
+	header_field_interface = 2,
+	header_field_member = 3,
+	header_field_error_name = 4,
+	header_field_reply_serial = 5,
+	header_field_destination = 6,
+	header_field_sender = 7,
+	header_field_signature = 8
+};
+
+
+[[noreturn]] void throw_malformed(char const *reason)
+{
+	throw io_exception(fmt::format("Malformed D-Bus message: {}", reason));
+}
+
+
+std::size_t get_alignment(char type_code)
+{
+	switch (type_code)
+	{
+		case 'y':
+		case 'g':
+		case 'v':
+			return 1;
+		case 'n':
+		case 'q':
+			return 2;
+		case 'x':
+		case 't':
+		case 'd':
+		case '(':
+		case '{':
+			return 8;
+		default:
+			return 4;
+	}
+}
+
+
+bool is_basic_type(char type_code)
+{
+	return std::strchr("ybnqiuxtdsogh", type_code) != nullptr;
+}
+
+
+// Returns the length of the single complete type
+// that starts at the given index of the signature.
+std::size_t get_complete_type_length(std::string_view signature, std::size_t index, unsigned int depth = 0)
+{
+	if (depth > max_nesting_depth)
+		throw_malformed("signature nested too deeply");
+	if (index >= signature.size())
+		throw_malformed("incomplete signature");
+
+	char type_code = signature[index];
+
+	if (is_basic_type(type_code) || (type_code == 'v'))
+		return 1;
+
+	switch (type_code)
+	{
+		case 'a':
+			return 1 + get_complete_type_length(signature, index + 1, depth + 1);
+
+		case '(':
+		{
+			std::size_t end_index = index + 1;
+			while (true)
+			{
+				if (end_index >= signature.size())
+					throw_malformed("unterminated struct in signature");
+				if (signature[end_index] == ')')
+					break;
+				end_index += get_complete_type_length(signature, end_index, depth + 1);
+			}
+
+			if (end_index == (index + 1))
+				throw_malformed("empty struct in signature");
+
+			return end_index + 1 - index;
+		}
+
+		case '{':
+		{
+			if (((index + 1) >= signature.size()) || !is_basic_type(signature[index + 1]))
+				throw_malformed("dict entry key is not a basic type");
+
+			std::size_t end_index = index + 2 + get_complete_type_length(signature, index + 2, depth + 1);
+			if ((end_index >= signature.size()) || (signature[end_index] != '}'))
+				throw_malformed("unterminated dict entry in signature");
+
+			return end_index + 1 - index;
+		}
+
+		default:
+			throw_malformed("invalid type code in signature");
+	}
+}
+
+
+void check_single_complete_type(std::string_view signature)
+{
+	if (signature.empty() || (get_complete_type_length(signature, 0) != signature.size()))
+		throw_malformed("variant signature is not a single complete type");
+}
+
+
+} // unnamed namespace end
+
+
+
+
+dbus_value_reader::dbus_value_reader(std::uint8_t const *data, std::size_t begin, std::size_t end, std::string_view signature, bool is_big_endian)
+	: dbus_value_reader(data, begin, end, signature, is_big_endian, false, 0)
+{
+}
+
+
+dbus_value_reader::dbus_value_reader(std::uint8_t const *data, std::size_t begin, std::size_t end, std::string_view signature, bool is_big_endian, bool is_array, unsigned int depth)
+	: m_data(data)
+	, m_position(begin)
+	, m_end(end)
+	, m_signature(signature)
+	, m_signature_position(0)
+	, m_is_big_endian(is_big_endian)
+	, m_is_array(is_array)
+	, m_depth(depth)
+{
+	if (m_depth > max_nesting_depth)
+		throw_malformed("values nested too deeply");
+}
+
+
+bool dbus_value_reader::at_end() const
+{
+	if (m_is_array)
+		return m_position >= m_end;
+	else
+		return m_signature_position >= m_signature.size();
+}
+
+
+char dbus_value_reader::get_current_type() const
+{
+	return at_end() ? '\0' : m_signature[m_signature_position];
+}
+
+
+std::uint8_t dbus_value_reader::read_byte()
+{
+	begin_value('y');
+	check_size(1);
+	return m_data[m_position++];
+}
+
+
+bool dbus_value_reader::read_boolean()
+{
+	begin_value('b');
+	return read_raw_uint32() != 0;
+}
+
+
+std::int16_t dbus_value_reader::read_int16()
+{
+	begin_value('n');
+	return std::int16_t(read_raw_uint16());
+}
+
+
+std::uint16_t dbus_value_reader::read_uint16()
+{
+	begin_value('q');
+	return read_raw_uint16();
+}
+
+
+std::int32_t dbus_value_reader::read_int32()
+{
+	begin_value('i');
+	return std::int32_t(read_raw_uint32());
+}
+
+
+std::uint32_t dbus_value_reader::read_uint32()
+{
+	begin_value('u');
+	return read_raw_uint32();
+}
+
+
+std::int64_t dbus_value_reader::read_int64()
+{
+	begin_value('x');
+	return std::int64_t(read_raw_uint64());
+}
+
+
+std::uint64_t dbus_value_reader::read_uint64()
+{
+	begin_value('t');
+	return read_raw_uint64();
+}
+
+
+double dbus_value_reader::read_double()
+{
+	begin_value('d');
+	std::uint64_t raw_value = read_raw_uint64();
+	double value;
+	std::memcpy(&value, &raw_value, sizeof(value));
+	return value;
+}
+
+
+std::string_view dbus_value_reader::read_string()
+{
+	char type_code = get_current_type();
+	if ((type_code != 's') && (type_code != 'o') && (type_code != 'g'))
+		begin_value('s'); // Throws the type mismatch error.
+	else
+		begin_value(type_code);
+
+	std::size_t length;
+	if (type_code == 'g')
+	{
+		check_size(1);
+		length = m_data[m_position++];
+	}
+	else
+		length = read_raw_uint32();
+
+	check_size(length + 1);
+	if (m_data[m_position + length] != 0)
+		throw_malformed("string is not null-terminated");
+
+	std::string_view value(reinterpret_cast<char const *>(m_data + m_position), length);
+	m_position += length + 1;
+
+	return value;
+}
+
+
+dbus_value_reader dbus_value_reader::enter_container()
+{
+	if (at_end())
+		throw_malformed("no more values");
+
+	std::size_t signature_position = m_signature_position;
+	std::size_t type_length = get_complete_type_length(m_signature, signature_position);
+	char type_code = begin_value(get_current_type());
+
+	switch (type_code)
+	{
+		case 'a':
+		{
+			std::string_view element_signature = m_signature.substr(signature_position + 1, type_length - 1);
+
+			std::size_t array_size = read_raw_uint32();
+			if (array_size > max_array_size)
+				throw_malformed("array too large");
+
+			align(get_alignment(element_signature[0]));
+			check_size(array_size);
+
+			dbus_value_reader array_reader(m_data, m_position, m_position + array_size, element_signature, m_is_big_endian, true, m_depth + 1);
+			m_position += array_size;
+
+			return array_reader;
+		}
+
+		case '(':
+		case '{':
+		{
+			std::string_view member_signature = m_signature.substr(signature_position + 1, type_length - 2);
+
+			// Struct members are not prefixed with their size,
+			// so the struct has to be walked to find its end.
+			dbus_value_reader struct_reader(m_data, m_position, m_end, member_signature, m_is_big_endian, false, m_depth + 1);
+			dbus_value_reader skipping_reader(struct_reader);
+			while (!skipping_reader.at_end())
+				skipping_reader.skip();
+
+			struct_reader.m_end = skipping_reader.m_position;
+			m_position = skipping_reader.m_position;
+
+			return struct_reader;
+		}
+
+		case 'v':
+		{
+			check_size(1);
+			std::size_t signature_length = m_data[m_position++];
+			check_size(signature_length + 1);
+			std::string_view variant_signature(reinterpret_cast<char const *>(m_data + m_position), signature_length);
+			m_position += signature_length + 1;
+
+			check_single_complete_type(variant_signature);
+
+			dbus_value_reader variant_reader(m_data, m_position, m_end, variant_signature, m_is_big_endian, false, m_depth + 1);
+			dbus_value_reader skipping_reader(variant_reader);
+			skipping_reader.skip();
+
+			variant_reader.m_end = skipping_reader.m_position;
+			m_position = skipping_reader.m_position;
+
+			return variant_reader;
+		}
+
+		default:
+			throw_malformed("value is not a container");
+	}
+}
+
+
+void dbus_value_reader::skip()
+{
+	switch (get_current_type())
+	{
+		case 'y': read_byte(); break;
+		case 'b': read_boolean(); break;
+		case 'n': read_int16(); break;
+		case 'q': read_uint16(); break;
+		case 'i': read_int32(); break;
+		case 'h':
+		case 'u':
+			begin_value(get_current_type());
+			read_raw_uint32();
+			break;
+		case 'x': read_int64(); break;
+		case 't': read_uint64(); break;
+		case 'd': read_double(); break;
+		case 's':
+		case 'o':
+		case 'g':
+			read_string();
+			break;
+		case 'a':
+		case '(':
+		case '{':
+		case 'v':
+			enter_container();
+			break;
+		default:
+			throw_malformed("no value left to skip");
+	}
+}
+
+
+char dbus_value_reader::begin_value(char expected_type)
+{
+	if (at_end())
+		throw_malformed("no more values");
+
+	char type_code = m_signature[m_signature_position];
+	if (type_code != expected_type)
+		throw_malformed("unexpected value type");
+
+	align(get_alignment(type_code));
+
+	m_signature_position += get_complete_type_length(m_signature, m_signature_position);
+	if (m_is_array && (m_signature_position >= m_signature.size()))
+		m_signature_position = 0;
+
+	return type_code;
+}
+
+
+void dbus_value_reader::align(std::size_t alignment)
+{
+	std::size_t aligned_position = (m_position + alignment - 1) & ~(alignment - 1);
+	if (aligned_position > m_end)
+		throw_malformed("value exceeds its container");
+	m_position = aligned_position;
+}
+
+
+void dbus_value_reader::check_size(std::size_t num_bytes) const
+{
+	if ((m_position > m_end) || (num_bytes > (m_end - m_position)))
+		throw_malformed("value exceeds its container");
+}
+
+
+std::uint16_t dbus_value_reader::read_raw_uint16()
+{
+	check_size(2);
+	std::uint16_t value;
+	std::memcpy(&value, m_data + m_position, sizeof(value));
+	m_position += sizeof(value);
+	return (m_is_big_endian != host_is_big_endian) ? __builtin_bswap16(value) : value;
+}
+
+
+std::uint32_t dbus_value_reader::read_raw_uint32()
+{
+	check_size(4);
+	std::uint32_t value;
+	std::memcpy(&value, m_data + m_position, sizeof(value));
+	m_position += sizeof(value);
+	return (m_is_big_endian != host_is_big_endian) ? __builtin_bswap32(value) : value;
+}
+
+
+std::uint64_t dbus_value_reader::read_raw_uint64()
+{
+	check_size(8);
+	std::uint64_t value;
+	std::memcpy(&value, m_data + m_position, sizeof(value));
+	m_position += sizeof(value);
+	return (m_is_big_endian != host_is_big_endian) ? __builtin_bswap64(value) : value;
+}
+
+
+
+
+dbus_value_writer::dbus_value_writer()
+	: m_num_unrecorded_levels(0)
+{
+}
+
+
+void dbus_value_writer::append_byte(std::uint8_t value)
+{
+	begin_value('y', 1);
+	m_data.push_back(value);
+}
+
+
+void dbus_value_writer::append_boolean(bool value)
+{
+	begin_value('b', 4);
+	std::uint32_t raw_value = value ? 1 : 0;
+	append_raw(&raw_value, sizeof(raw_value));
+}
+
+
+void dbus_value_writer::append_int16(std::int16_t value)
+{
+	begin_value('n', 2);
+	append_raw(&value, sizeof(value));
+}
+
+
+void dbus_value_writer::append_uint16(std::uint16_t value)
+{
+	begin_value('q', 2);
+	append_raw(&value, sizeof(value));
+}
+
+
+void dbus_value_writer::append_int32(std::int32_t value)
+{
+	begin_value('i', 4);
+	append_raw(&value, sizeof(value));
+}
+
+
+void dbus_value_writer::append_uint32(std::uint32_t value)
+{
+	begin_value('u', 4);
+	append_raw(&value, sizeof(value));
+}
+
+
+void dbus_value_writer::append_int64(std::int64_t value)
+{
+	begin_value('x', 8);
+	append_raw(&value, sizeof(value));
+}
+
+
+void dbus_value_writer::append_uint64(std::uint64_t value)
+{
+	begin_value('t', 8);
+	append_raw(&value, sizeof(value));
+}
+
+
+void dbus_value_writer::append_string(std::string_view value)
+{
+	append_string_data('s', value);
+}
+
+
+void dbus_value_writer::append_object_path(std::string_view value)
+{
+	append_string_data('o', value);
+}
+
+
+void dbus_value_writer::append_signature(std::string_view value)
+{
+	append_string_data('g', value);
+}
+
+
+void dbus_value_writer::open_array(std::string_view element_signature)
+{
+	assert(!element_signature.empty());
+
+	begin_value('a', 4);
+	if (m_num_unrecorded_levels == 0)
+		m_signature.append(element_signature);
+
+	std::size_t length_position = m_data.size();
+	std::uint32_t placeholder_length = 0;
+	append_raw(&placeholder_length, sizeof(placeholder_length));
+
+	// The padding up to the first element is there
+	// even if the array ends up being empty.
+	align(get_alignment(element_signature[0]));
+
+	m_open_containers.push_back({ 'a', length_position, m_data.size() });
+	++m_num_unrecorded_levels;
+}
+
+
+void dbus_value_writer::close_array()
+{
+	assert(!m_open_containers.empty() && (m_open_containers.back().m_type == 'a'));
+
+	open_container const &array = m_open_containers.back();
+	std::uint32_t length = m_data.size() - array.m_elements_position;
+	std::memcpy(m_data.data() + array.m_length_position, &length, sizeof(length));
+
+	m_open_containers.pop_back();
+	--m_num_unrecorded_levels;
+}
+
+
+void dbus_value_writer::open_struct()
+{
+	begin_value('(', 8);
+	m_open_containers.push_back({ '(', 0, 0 });
+}
+
+
+void dbus_value_writer::close_struct()
+{
+	assert(!m_open_containers.empty() && (m_open_containers.back().m_type == '('));
+
+	if (m_num_unrecorded_levels == 0)
+		m_signature += ')';
+
+	m_open_containers.pop_back();
+}
+
+
+void dbus_value_writer::open_dict_entry()
+{
+	// Dict entries only exist inside arrays, whose
+	// element signature was already recorded.
+	assert(m_num_unrecorded_levels > 0);
+
+	begin_value('{', 8);
+	m_open_containers.push_back({ '{', 0, 0 });
+}
+
+
+void dbus_value_writer::close_dict_entry()
+{
+	assert(!m_open_containers.empty() && (m_open_containers.back().m_type == '{'));
+	m_open_containers.pop_back();
+}
+
+
+void dbus_value_writer::open_variant(std::string_view signature)
+{
+	begin_value('v', 1);
+
+	m_data.push_back(std::uint8_t(signature.size()));
+	m_data.insert(m_data.end(), signature.begin(), signature.end());
+	m_data.push_back(0);
+
+	m_open_containers.push_back({ 'v', 0, 0 });
+	++m_num_unrecorded_levels;
+}
+
+
+void dbus_value_writer::close_variant()
+{
+	assert(!m_open_containers.empty() && (m_open_containers.back().m_type == 'v'));
+
+	m_open_containers.pop_back();
+	--m_num_unrecorded_levels;
+}
+
+
+std::string const & dbus_value_writer::get_signature() const
+{
+	return m_signature;
+}
+
+
+std::vector<std::uint8_t> const & dbus_value_writer::get_data() const
+{
+	return m_data;
+}
+
+
+void dbus_value_writer::begin_value(char type_code, std::size_t alignment)
+{
+	if (m_num_unrecorded_levels == 0)
+		m_signature += type_code;
+
+	align(alignment);
+}
+
+
+void dbus_value_writer::align(std::size_t alignment)
+{
+	m_data.resize((m_data.size() + alignment - 1) & ~(alignment - 1), 0);
+}
+
+
+void dbus_value_writer::append_raw(void const *value, std::size_t size)
+{
+	std::uint8_t const *bytes = reinterpret_cast<std::uint8_t const *>(value);
+	m_data.insert(m_data.end(), bytes, bytes + size);
+}
+
+
+void dbus_value_writer::append_string_data(char type_code, std::string_view value)
+{
+	if (type_code == 'g')
+	{
+		begin_value('g', 1);
+		m_data.push_back(std::uint8_t(value.size()));
+	}
+	else
+	{
+		begin_value(type_code, 4);
+		std::uint32_t length = value.size();
+		append_raw(&length, sizeof(length));
+	}
+
+	m_data.insert(m_data.end(), value.begin(), value.end());
+	m_data.push_back(0);
+}
+
+
+
+
+std::size_t dbus_message::get_message_size(std::uint8_t const *data, std::size_t size)
+{
+	if (size < fixed_header_size)
+		return 0;
+
+	if ((data[0] != 'l') && (data[0] != 'B'))
+		throw_malformed("invalid byte order");
+	if (data[3] != 1)
+		throw_malformed("unsupported protocol version");
+
+	bool is_big_endian = (data[0] == 'B');
+	auto read_uint32 = [&](std::size_t offset) {
+		std::uint32_t value;
+		std::memcpy(&value, data + offset, sizeof(value));
+		return (is_big_endian != host_is_big_endian) ? __builtin_bswap32(value) : value;
+	};
+
+	std::size_t body_size = read_uint32(4);
+	std::size_t header_fields_size = read_uint32(12);
+	if ((body_size > max_message_size) || (header_fields_size > max_array_size))
+		throw_malformed("message too large");
+
+	std::size_t body_offset = (fixed_header_size + header_fields_size + 7) & ~std::size_t(7);
+	std::size_t message_size = body_offset + body_size;
+	if (message_size > max_message_size)
+		throw_malformed("message too large");
+
+	return message_size;
+}
+
+
+dbus_message::dbus_message(std::uint8_t const *data, std::size_t size)
+	: m_data(data)
+	, m_size(size)
+{
+	parse();
+}
+
+
+dbus_message::dbus_message(std::vector<std::uint8_t> data)
+	: m_owned_data(std::move(data))
+	, m_data(m_owned_data.data())
+	, m_size(m_owned_data.size())
+{
+	parse();
+}
+
+
+dbus_message dbus_message::make_owned_copy() const
+{
+	return dbus_message(std::vector<std::uint8_t>(m_data, m_data + m_size));
+}
+
+
+dbus_message_type dbus_message::get_type() const
+{
+	return m_type;
+}
+
+
+std::uint8_t dbus_message::get_flags() const
+{
+	return m_flags;
+}
+
+
+std::uint32_t dbus_message::get_serial() const
+{
+	return m_serial;
+}
+
+
+std::optional<std::uint32_t> dbus_message::get_reply_serial() const
+{
+	return m_reply_serial;
+}
+
+
+std::string_view dbus_message::get_path() const
+{
+	return m_path;
+}
+
+
+std::string_view dbus_message::get_interface() const
+{
+	return m_interface;
+}
+
+
+std::string_view dbus_message::get_member() const
+{
+	return m_member;
+}
+
+
+std::string_view dbus_message::get_error_name() const
+{
+	return m_error_name;
+}
+
+
+std::string_view dbus_message::get_destination() const
+{
+	return m_destination;
+}
+
+
+std::string_view dbus_message::get_sender() const
+{
+	return m_sender;
+}
+
+
+std::string_view dbus_message::get_signature() const
+{
+	return m_signature;
+}
+
+
+bool dbus_message::is_method_call(std::string_view interface, std::string_view member) const
+{
+	return (m_type == dbus_message_type::method_call) && (m_interface == interface) && (m_member == member);
+}
+
+
+bool dbus_message::is_signal(std::string_view interface, std::string_view member) const
+{
+	return (m_type == dbus_message_type::signal) && (m_interface == interface) && (m_member == member);
+}
+
+
+dbus_value_reader dbus_message::get_body_reader() const
+{
+	return dbus_value_reader(m_data, m_body_offset, m_size, m_signature, m_is_big_endian);
+}
+
+
+std::string_view dbus_message::get_error_message() const
+{
+	if (m_signature.empty() || (m_signature[0] != 's'))
+		return std::string_view();
+
+	return get_body_reader().read_string();
+}
+
+
+void dbus_message::parse()
+{
+	std::size_t message_size = get_message_size(m_data, m_size);
+	if ((message_size == 0) || (message_size != m_size))
+		throw_malformed("size mismatch");
+
+	m_is_big_endian = (m_data[0] == 'B');
+	m_type = dbus_message_type(m_data[1]);
+	m_flags = m_data[2];
+
+	// The header is made of 4 bytes, two uint32 values, and an
+	// array of (byte, variant) structs with the header fields.
+	// Read it with a value reader to get alignment and byte
+	// order right.
+	dbus_value_reader header_reader(m_data, 4, m_size, "uua(yv)", m_is_big_endian);
+	// get_message_size() already checked that the body fits.
+	m_body_offset = m_size - header_reader.read_uint32();
+	m_serial = header_reader.read_uint32();
+
+	dbus_value_reader header_fields_reader = header_reader.enter_container();
+	while (!header_fields_reader.at_end())
+	{
+		dbus_value_reader header_field_reader = header_fields_reader.enter_container();
+		std::uint8_t field_code = header_field_reader.read_byte();
+		dbus_value_reader value_reader = header_field_reader.enter_container();
+
+		switch (field_code)
+		{
+			case header_field_path: m_path = value_reader.read_string(); break;
+			case header_field_interface: m_interface = value_reader.read_string(); break;
+			case header_field_member: m_member = value_reader.read_string(); break;
+			case header_field_error_name: m_error_name = value_reader.read_string(); break;
+			case header_field_reply_serial: m_reply_serial = value_reader.read_uint32(); break;
+			case header_field_destination: m_destination = value_reader.read_string(); break;
+			case header_field_sender: m_sender = value_reader.read_string(); break;
+			case header_field_signature: m_signature = value_reader.read_string(); break;
+			// Unknown fields must be ignored.
+			default: break;
+		}
+	}
+
+	if (m_serial == 0)
+		throw_malformed("serial is zero");
+
+	switch (m_type)
+	{
+		case dbus_message_type::method_call:
+			if (m_path.empty() || m_member.empty())
+				throw_malformed("method call without path or member");
+			break;
+		case dbus_message_type::signal:
+			if (m_path.empty() || m_interface.empty() || m_member.empty())
+				throw_malformed("signal without path, interface, or member");
+			break;
+		case dbus_message_type::method_return:
+			if (!m_reply_serial)
+				throw_malformed("method return without reply serial");
+			break;
+		case dbus_message_type::error:
+			if (m_error_name.empty() || !m_reply_serial)
+				throw_malformed("error without error name or reply serial");
+			break;
+		default:
+			// Unknown message types must be ignored.
+			break;
+	}
+}
+
+
+
+
+dbus_message_builder dbus_message_builder::method_call(std::string_view destination, std::string_view path, std::string_view interface, std::string_view member)
+{
+	dbus_message_builder builder(dbus_message_type::method_call);
+	builder.m_destination = destination;
+	builder.m_path = path;
+	builder.m_interface = interface;
+	builder.m_member = member;
+	return builder;
+}
+
+
+dbus_message_builder dbus_message_builder::signal(std::string_view path, std::string_view interface, std::string_view member)
+{
+	dbus_message_builder builder(dbus_message_type::signal);
+	builder.m_path = path;
+	builder.m_interface = interface;
+	builder.m_member = member;
+	return builder;
+}
+
+
+dbus_message_builder dbus_message_builder::method_return(dbus_message const &call)
+{
+	dbus_message_builder builder(dbus_message_type::method_return);
+	builder.m_destination = call.get_sender();
+	builder.m_reply_serial = call.get_serial();
+	return builder;
+}
+
+
+dbus_message_builder dbus_message_builder::error(dbus_message const &call, std::string_view error_name, std::string_view error_message)
+{
+	dbus_message_builder builder(dbus_message_type::error);
+	builder.m_destination = call.get_sender();
+	builder.m_reply_serial = call.get_serial();
+	builder.m_error_name = error_name;
+	builder.m_body.append_string(error_message);
+	return builder;
+}
+
+
+dbus_message_type dbus_message_builder::get_type() const
+{
+	return m_type;
+}
+
+
+void dbus_message_builder::set_no_reply_expected()
+{
+	m_flags |= dbus_flag_no_reply_expected;
+}
+
+
+bool dbus_message_builder::is_no_reply_expected() const
+{
+	return (m_flags & dbus_flag_no_reply_expected) != 0;
+}
+
+
+dbus_value_writer & dbus_message_builder::body()
+{
+	return m_body;
+}
+
+
+std::vector<std::uint8_t> const & dbus_message_builder::get_body_data() const
+{
+	return m_body.get_data();
+}
+
+
+std::vector<std::uint8_t> dbus_message_builder::build_header(std::uint32_t serial) const
+{
+	dbus_value_writer header;
+
+	header.append_byte(host_is_big_endian ? 'B' : 'l');
+	header.append_byte(std::uint8_t(m_type));
+	header.append_byte(m_flags);
+	header.append_byte(1);
+	header.append_uint32(m_body.get_data().size());
+	header.append_uint32(serial);
+
+	auto append_string_field = [&](std::uint8_t field_code, char type_code, std::string const &value) {
+		if (value.empty())
+			return;
+
+		header.open_struct();
+		header.append_byte(field_code);
+		header.open_variant(std::string_view(&type_code, 1));
+		switch (type_code)
+		{
+			case 'o': header.append_object_path(value); break;
+			case 'g': header.append_signature(value); break;
+			default: header.append_string(value); break;
+		}
+		header.close_variant();
+		header.close_struct();
+	};
+
+	header.open_array("(yv)");
+	append_string_field(header_field_path, 'o', m_path);
+	append_string_field(header_field_interface, 's', m_interface);
+	append_string_field(header_field_member, 's', m_member);
+	append_string_field(header_field_error_name, 's', m_error_name);
+	append_string_field(header_field_destination, 's', m_destination);
+	append_string_field(header_field_signature, 'g', m_body.get_signature());
+	if (m_reply_serial)
+	{
+		header.open_struct();
+		header.append_byte(header_field_reply_serial);
+		header.open_variant("u");
+		header.append_uint32(*m_reply_serial);
+		header.close_variant();
+		header.close_struct();
+	}
+	header.close_array();
+
+	// The body starts at the next 8-byte boundary.
+	std::vector<std::uint8_t> data = header.get_data();
+	data.resize((data.size() + 7) & ~std::size_t(7), 0);
+
+	return data;
+}
+
+
+dbus_message_builder::dbus_message_builder(dbus_message_type type)
+	: m_type(type)
+	, m_flags(0)
+{
+}
+
+
+} // namespace comboctl end
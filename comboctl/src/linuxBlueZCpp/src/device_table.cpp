@@ -0,0 +1,241 @@
+#include <assert.h>
+#include <functional>
+#include "device_table.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("DeviceTable")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+// Each multi_index node holds the entry plus the links of all three
+// indices: two pointers for the sequenced index, and three for each
+// of the two ordered indices (the color is packed into a pointer).
+constexpr std::size_t num_link_pointers_per_node = 2 + 3 + 3;
+
+
+} // unnamed namespace end
+
+
+
+
+device_table::device_table()
+	: m_max_num_devices(default_max_num_devices)
+	, m_num_evictions(0)
+{
+}
+
+
+void device_table::set_max_num_devices(std::size_t max_num_devices)
+{
+	assert(max_num_devices >= 1);
+
+	m_max_num_devices = max_num_devices;
+	evict_excess_devices(nullptr);
+}
+
+
+void device_table::add(bluetooth_address const &address, std::string object_path, bool connected)
+{
+	auto &address_index = m_entries.get<by_address>();
+
+	auto entry_iter = address_index.find(address);
+	if (entry_iter != address_index.end())
+	{
+		address_index.modify(entry_iter, [&](entry &existing_entry) {
+			existing_entry.m_object_path = std::move(object_path);
+			existing_entry.m_connected = connected;
+		});
+		touch(address);
+		return;
+	}
+
+	entry new_entry;
+	new_entry.m_address = address;
+	new_entry.m_object_path = std::move(object_path);
+	new_entry.m_connected = connected;
+	m_entries.get<by_recency>().push_back(std::move(new_entry));
+
+	evict_excess_devices(&address);
+}
+
+
+void device_table::erase(bluetooth_address const &address)
+{
+	m_entries.get<by_address>().erase(address);
+}
+
+
+void device_table::clear()
+{
+	m_entries.clear();
+}
+
+
+device_table::entry const * device_table::find(bluetooth_address const &address) const
+{
+	auto const &address_index = m_entries.get<by_address>();
+	auto entry_iter = address_index.find(address);
+	return (entry_iter != address_index.end()) ? &(*entry_iter) : nullptr;
+}
+
+
+std::optional<bluetooth_address> device_table::find_address(std::string_view object_path) const
+{
+	// Entries with an empty object path are not reachable over D-Bus.
+	if (object_path.empty())
+		return std::nullopt;
+
+	auto const &object_path_index = m_entries.get<by_object_path>();
+	// std::less<> compares std::string keys with the string_view directly.
+	auto entry_iter = object_path_index.find(object_path, std::less<>());
+	if (entry_iter == object_path_index.end())
+		return std::nullopt;
+
+	return entry_iter->m_address;
+}
+
+
+void device_table::touch(bluetooth_address const &address)
+{
+	auto &address_index = m_entries.get<by_address>();
+	auto entry_iter = address_index.find(address);
+	if (entry_iter == address_index.end())
+		return;
+
+	auto &recency_index = m_entries.get<by_recency>();
+	recency_index.relocate(recency_index.end(), m_entries.project<by_recency>(entry_iter));
+}
+
+
+std::optional<bool> device_table::set_paired(bluetooth_address const &address, bool paired)
+{
+	auto &address_index = m_entries.get<by_address>();
+	auto entry_iter = address_index.find(address);
+	if (entry_iter == address_index.end())
+		return std::nullopt;
+
+	std::optional<bool> old_paired = entry_iter->m_paired;
+	address_index.modify(entry_iter, [paired](entry &existing_entry) { existing_entry.m_paired = paired; });
+	touch(address);
+
+	return old_paired;
+}
+
+
+bool device_table::set_connected(bluetooth_address const &address, bool connected)
+{
+	auto &address_index = m_entries.get<by_address>();
+	auto entry_iter = address_index.find(address);
+	if (entry_iter == address_index.end())
+		return false;
+
+	bool old_connected = entry_iter->m_connected;
+	address_index.modify(entry_iter, [connected](entry &existing_entry) { existing_entry.m_connected = connected; });
+	touch(address);
+
+	return old_connected;
+}
+
+
+void device_table::clear_object_path(bluetooth_address const &address)
+{
+	auto &address_index = m_entries.get<by_address>();
+	auto entry_iter = address_index.find(address);
+	if (entry_iter == address_index.end())
+		return;
+
+	address_index.modify(entry_iter, [](entry &existing_entry) { existing_entry.m_object_path.clear(); });
+}
+
+
+bluetooth_address_set device_table::get_paired_device_addresses() const
+{
+	bluetooth_address_set addresses;
+
+	for (auto const &device_entry : m_entries)
+	{
+		if (device_entry.m_paired.value_or(false))
+			addresses.insert(device_entry.m_address);
+	}
+
+	return addresses;
+}
+
+
+device_table_stats device_table::get_stats() const
+{
+	device_table_stats stats;
+
+	stats.m_num_devices = m_entries.size();
+	stats.m_max_num_devices = m_max_num_devices;
+	stats.m_num_evictions = m_num_evictions;
+
+	std::size_t const small_string_capacity = std::string().capacity();
+
+	for (auto const &device_entry : m_entries)
+	{
+		if (device_entry.m_paired.value_or(false))
+			stats.m_num_paired_devices++;
+		if (device_entry.m_connected)
+			stats.m_num_connected_devices++;
+
+		stats.m_estimated_memory_usage += sizeof(entry) + num_link_pointers_per_node * sizeof(void *);
+
+		// Object paths that do not fit in the small string
+		// buffer occupy an additional heap block.
+		if (device_entry.m_object_path.capacity() > small_string_capacity)
+			stats.m_estimated_memory_usage += device_entry.m_object_path.capacity() + 1;
+	}
+
+	// The container's header node.
+	stats.m_estimated_memory_usage += sizeof(entry) + num_link_pointers_per_node * sizeof(void *);
+
+	return stats;
+}
+
+
+void device_table::evict_excess_devices(bluetooth_address const *protected_address)
+{
+	auto &recency_index = m_entries.get<by_recency>();
+
+	// Look at each entry at most once. Entries that must not be evicted
+	// are moved to the back, so later evictions do not have to skip
+	// them again. This makes a long-lived paired device look "recently
+	// seen", which is harmless, since such devices are never evicted.
+	std::size_t num_entries_to_check = recency_index.size();
+
+	while ((recency_index.size() > m_max_num_devices) && (num_entries_to_check > 0))
+	{
+		--num_entries_to_check;
+
+		auto entry_iter = recency_index.begin();
+		bool evictable = !entry_iter->m_paired.value_or(false)
+		              && !entry_iter->m_connected
+		              && ((protected_address == nullptr) || (entry_iter->m_address != *protected_address));
+
+		if (!evictable)
+		{
+			recency_index.relocate(recency_index.end(), entry_iter);
+			continue;
+		}
+
+		LOG(trace, "Evicting device {} from device table", to_string(entry_iter->m_address));
+
+		recency_index.erase(entry_iter);
+		m_num_evictions++;
+	}
+
+	if (recency_index.size() > m_max_num_devices)
+		LOG(trace, "Device table holds {} devices, more than its maximum of {}, since none of the excess ones can be evicted", recency_index.size(), m_max_num_devices);
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,305 @@
+#include <assert.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include "epoll_reactor.hpp"
+#include "exception.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("EPollReactor")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+constexpr int max_events_per_iteration = 16;
+
+
+} // unnamed namespace end
+
+
+
+
+epoll_reactor::epoll_reactor()
+	: m_epoll_fd(-1)
+	, m_wakeup_fd(-1)
+	, m_quit_requested(false)
+	, m_dispatching_fd_event(false)
+	, m_next_timer_id(1)
+{
+	m_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll_fd < 0)
+		throw io_exception(fmt::format("Could not create epoll instance: {} ({})", std::strerror(errno), errno));
+
+	m_wakeup_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakeup_fd < 0)
+	{
+		int error = errno;
+		::close(m_epoll_fd);
+		throw io_exception(fmt::format("Could not create eventfd: {} ({})", std::strerror(error), error));
+	}
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = m_wakeup_fd;
+	::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event);
+}
+
+
+epoll_reactor::~epoll_reactor()
+{
+	::close(m_wakeup_fd);
+	::close(m_epoll_fd);
+}
+
+
+void epoll_reactor::run()
+{
+	struct epoll_event events[max_events_per_iteration];
+
+	m_quit_requested = false;
+
+	while (!m_quit_requested)
+	{
+		int num_events = ::epoll_wait(m_epoll_fd, events, max_events_per_iteration, get_epoll_timeout());
+		if (num_events < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG(fatal, "epoll_wait() failed: {} ({})", std::strerror(errno), errno);
+			std::terminate();
+		}
+
+		for (int i = 0; i < num_events; ++i)
+		{
+			if (events[i].data.fd == m_wakeup_fd)
+			{
+				std::uint64_t counter;
+				while (::read(m_wakeup_fd, &counter, sizeof(counter)) > 0);
+			}
+			else
+				dispatch_fd_event(events[i].data.fd, events[i].events);
+		}
+
+		run_due_timers();
+		run_posted_tasks();
+	}
+}
+
+
+void epoll_reactor::quit()
+{
+	post([this]() { m_quit_requested = true; });
+}
+
+
+void epoll_reactor::post(task func)
+{
+	assert(func);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_posted_tasks.push_back(std::move(func));
+	}
+
+	wake_up();
+}
+
+
+epoll_reactor::timer_id epoll_reactor::add_timer(std::chrono::milliseconds delay, task func)
+{
+	assert(func);
+
+	timer_id id;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		id = m_next_timer_id++;
+		m_timers.push_back({ id, std::chrono::steady_clock::now() + delay, std::move(func) });
+	}
+
+	// Wake up the reactor so it recomputes its epoll timeout.
+	wake_up();
+
+	return id;
+}
+
+
+void epoll_reactor::remove_timer(timer_id id)
+{
+	task removed_func;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto timer_iter = std::find_if(m_timers.begin(), m_timers.end(), [id](timer const &t) { return t.m_id == id; });
+		if (timer_iter == m_timers.end())
+			return;
+
+		// Destroy the task outside of the lock, since its
+		// destructor may do anything, including posting.
+		removed_func = std::move(timer_iter->m_func);
+		m_timers.erase(timer_iter);
+	}
+}
+
+
+void epoll_reactor::add_fd(int fd, std::uint32_t events, fd_callback callback)
+{
+	assert(callback);
+
+	struct epoll_event event = {};
+	event.events = events;
+	event.data.fd = fd;
+	if (::epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		throw io_exception(fmt::format("Could not add file descriptor to epoll instance: {} ({})", std::strerror(errno), errno));
+
+	m_fd_watches.push_back(std::make_unique<fd_watch>(fd_watch{ fd, std::move(callback) }));
+}
+
+
+void epoll_reactor::remove_fd(int fd)
+{
+	auto watch_iter = std::find_if(m_fd_watches.begin(), m_fd_watches.end(), [fd](auto const &watch) { return watch->m_fd == fd; });
+	if (watch_iter == m_fd_watches.end())
+		return;
+
+	::epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+	// A callback may remove its own watch, so during dispatching,
+	// the watch is only marked. dispatch_fd_event() erases it.
+	if (m_dispatching_fd_event)
+		(*watch_iter)->m_fd = -1;
+	else
+		m_fd_watches.erase(watch_iter);
+}
+
+
+void epoll_reactor::wake_up()
+{
+	std::uint64_t increment = 1;
+	// This can only fail if the counter overflows, in which
+	// case the eventfd is readable anyway.
+	if (::write(m_wakeup_fd, &increment, sizeof(increment)) < 0)
+		LOG(trace, "Could not write to wakeup eventfd: {} ({})", std::strerror(errno), errno);
+}
+
+
+int epoll_reactor::get_epoll_timeout()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_posted_tasks.empty())
+		return 0;
+	if (m_timers.empty())
+		return -1;
+
+	auto earliest_deadline = std::min_element(m_timers.begin(), m_timers.end(), [](timer const &a, timer const &b) {
+		return a.m_deadline < b.m_deadline;
+	})->m_deadline;
+
+	auto now = std::chrono::steady_clock::now();
+	if (earliest_deadline <= now)
+		return 0;
+
+	// Round up, otherwise the reactor would wake up
+	// too early and spin until the deadline is reached.
+	auto timeout = std::chrono::ceil<std::chrono::milliseconds>(earliest_deadline - now);
+	return int(std::min<std::chrono::milliseconds::rep>(timeout.count(), 60 * 1000));
+}
+
+
+void epoll_reactor::dispatch_fd_event(int fd, std::uint32_t events)
+{
+	// Look up the watch for each event, since callbacks
+	// of earlier events may have removed it.
+	auto watch_iter = std::find_if(m_fd_watches.begin(), m_fd_watches.end(), [fd](auto const &watch) { return watch->m_fd == fd; });
+	if (watch_iter == m_fd_watches.end())
+		return;
+
+	// The watch is heap allocated, so it stays where it is even if
+	// the callback adds watches. If the callback removes its own
+	// watch, remove_fd() only marks it, and it is erased afterwards.
+	fd_watch *watch = watch_iter->get();
+
+	m_dispatching_fd_event = true;
+	watch->m_callback(events);
+	m_dispatching_fd_event = false;
+
+	m_fd_watches.erase(
+		std::remove_if(m_fd_watches.begin(), m_fd_watches.end(), [](auto const &watch) { return watch->m_fd < 0; }),
+		m_fd_watches.end()
+	);
+}
+
+
+void epoll_reactor::run_due_timers()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		task func;
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto timer_iter = std::find_if(m_timers.begin(), m_timers.end(), [now](timer const &t) { return t.m_deadline <= now; });
+			if (timer_iter == m_timers.end())
+				return;
+
+			func = std::move(timer_iter->m_func);
+			m_timers.erase(timer_iter);
+		}
+
+		func();
+	}
+}
+
+
+void epoll_reactor::run_posted_tasks()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::swap(m_posted_tasks, m_running_tasks);
+	}
+
+	for (auto &func : m_running_tasks)
+	{
+		func();
+		// Destroy the task right away, so that anything it
+		// captured is released before the next task runs.
+		func = nullptr;
+
+		if (m_quit_requested)
+			break;
+	}
+
+	if (m_quit_requested)
+	{
+		// Put back the tasks that did not run yet, ahead of the ones
+		// posted in the meantime, so that a later run() call (or the
+		// destructor) sees them in the original order.
+		auto first_pending_task = std::find_if(m_running_tasks.begin(), m_running_tasks.end(), [](task const &func) { return bool(func); });
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_posted_tasks.insert(
+			m_posted_tasks.begin(),
+			std::make_move_iterator(first_pending_task),
+			std::make_move_iterator(m_running_tasks.end())
+		);
+	}
+
+	m_running_tasks.clear();
+}
+
+
+} // namespace comboctl end
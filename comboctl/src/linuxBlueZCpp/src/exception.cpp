@@ -27,4 +27,20 @@ io_exception::io_exception(std::string description)
 }
 
 
+
+
+link_lost_exception::link_lost_exception(std::string description)
+	: io_exception(std::move(description))
+{
+}
+
+
+
+
+cancellation_exception::cancellation_exception(std::string const &what)
+	: exception(what)
+{
+}
+
+
 } // namespace comboctl end
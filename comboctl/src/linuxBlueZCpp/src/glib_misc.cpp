@@ -1,3 +1,5 @@
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
+
 #include "glib_misc.hpp"
 
 
@@ -58,3 +60,6 @@ gvariant_uptr get_gvariant_from(gvariant_uptr &value, gchar const *format_string
 
 
 } // namespace comboctl end
+
+
+#endif // COMBOCTL_NATIVE_DBUS_BACKEND
@@ -0,0 +1,21 @@
+#include "io_result.hpp"
+
+
+namespace comboctl
+{
+
+
+char const * to_string(io_error error)
+{
+	switch (error)
+	{
+		case io_error::none: return "No error";
+		case io_error::canceled: return "Operation canceled";
+		case io_error::link_lost: return "Bluetooth link lost";
+		case io_error::failed: return "Operation failed";
+		default: return "<invalid>";
+	}
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,55 @@
+#include "link_loss_monitor.hpp"
+#include "rfcomm_connection.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("LinkLossMonitor")
+
+
+namespace comboctl
+{
+
+
+void link_loss_monitor::add_connection(bluetooth_address const &address, rfcomm_connection *connection)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_connections.emplace(address, connection);
+}
+
+
+void link_loss_monitor::remove_connection(bluetooth_address const &address, rfcomm_connection *connection)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto range = m_connections.equal_range(address);
+	for (auto iter = range.first; iter != range.second; ++iter)
+	{
+		if (iter->second == connection)
+		{
+			m_connections.erase(iter);
+			break;
+		}
+	}
+}
+
+
+void link_loss_monitor::notify_link_lost(bluetooth_address const &address)
+{
+	// Keep the mutex locked while signaling, so a device cannot
+	// be destroyed (and its connection freed) in the meantime.
+	// signal_link_lost() does not block, so this is fine.
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto range = m_connections.equal_range(address);
+	if (range.first == range.second)
+	{
+		LOG(trace, "Device {} disconnected, but it has no open connections", to_string(address));
+		return;
+	}
+
+	for (auto iter = range.first; iter != range.second; ++iter)
+		iter->second->signal_link_lost();
+}
+
+
+} // namespace comboctl end
@@ -53,6 +53,12 @@ void set_logging_function(logging_function new_logging_function)
 }
 
 
+void set_min_log_level(log_level level)
+{
+	detail::min_log_level.store(level, std::memory_order_relaxed);
+}
+
+
 void do_log(std::string const &tag, log_level level, std::string log_string)
 {
 	assert(current_logging_function);
@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <algorithm>
+#include "mainloop_monitor.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("MainloopMonitor")
+
+
+namespace comboctl
+{
+
+
+mainloop_monitor::mainloop_monitor()
+	: m_slowest_callback_source_length(0)
+{
+	m_stats.m_slow_callback_budget = default_slow_callback_budget;
+}
+
+
+void mainloop_monitor::set_slow_callback_budget(std::chrono::microseconds budget)
+{
+	assert(budget.count() > 0);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stats.m_slow_callback_budget = budget;
+}
+
+
+void mainloop_monitor::record_queue_latency(clock::duration latency)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stats.m_queue_latency.add_sample(std::chrono::duration_cast<std::chrono::microseconds>(latency));
+}
+
+
+void mainloop_monitor::record_dispatch(char const *source, char const *detail, clock::duration duration)
+{
+	assert(source != nullptr);
+
+	auto duration_us = std::chrono::duration_cast<std::chrono::microseconds>(duration);
+	std::chrono::microseconds budget;
+	bool is_slow;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_stats.m_dispatch_duration.add_sample(duration_us);
+
+		budget = m_stats.m_slow_callback_budget;
+		is_slow = (duration_us > budget);
+		if (is_slow)
+			m_stats.m_num_slow_callbacks++;
+
+		// Only build the source string for the slowest callback,
+		// since this is called for every single mainloop callback.
+		if ((m_slowest_callback_source_length == 0) || (duration_us > m_stats.m_slowest_callback_duration))
+		{
+			m_stats.m_slowest_callback_duration = duration_us;
+
+			auto result = (detail != nullptr)
+				? fmt::format_to_n(m_slowest_callback_source.data(), m_slowest_callback_source.size(), "{} ({})", source, detail)
+				: fmt::format_to_n(m_slowest_callback_source.data(), m_slowest_callback_source.size(), "{}", source);
+			m_slowest_callback_source_length = std::min(result.size, m_slowest_callback_source.size());
+		}
+	}
+
+	// Log outside of the lock. The logging function may be
+	// arbitrarily slow (it may for example call into the JVM).
+	if (is_slow)
+	{
+		if (detail != nullptr)
+			LOG(warn, "Slow mainloop callback: {} ({}) took {} us; budget: {} us", source, detail, duration_us.count(), budget.count());
+		else
+			LOG(warn, "Slow mainloop callback: {} took {} us; budget: {} us", source, duration_us.count(), budget.count());
+	}
+}
+
+
+mainloop_stats mainloop_monitor::get_stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	mainloop_stats stats = m_stats;
+	stats.m_slowest_callback_source.assign(m_slowest_callback_source.data(), m_slowest_callback_source_length);
+
+	return stats;
+}
+
+
+void mainloop_monitor::reset_stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto budget = m_stats.m_slow_callback_budget;
+	m_stats = mainloop_stats();
+	m_stats.m_slow_callback_budget = budget;
+	m_slowest_callback_source_length = 0;
+}
+
+
+
+
+scoped_dispatch_timer::scoped_dispatch_timer(mainloop_monitor *monitor, char const *source, char const *detail)
+	: m_monitor(monitor)
+	, m_source(source)
+	, m_detail(detail)
+	, m_start(mainloop_monitor::clock::now())
+{
+}
+
+
+scoped_dispatch_timer::~scoped_dispatch_timer()
+{
+	if (m_monitor == nullptr)
+		return;
+
+	// Exceptions must never exit a destructor. Recording
+	// statistics is not essential, so just drop them.
+	try
+	{
+		m_monitor->record_dispatch(m_source, m_detail, mainloop_monitor::clock::now() - m_start);
+	}
+	catch (...)
+	{
+	}
+}
+
+
+} // namespace comboctl end
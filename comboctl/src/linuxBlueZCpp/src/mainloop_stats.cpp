@@ -0,0 +1,37 @@
+#include <algorithm>
+#include "mainloop_stats.hpp"
+
+
+namespace comboctl
+{
+
+
+void duration_histogram::add_sample(std::chrono::microseconds duration)
+{
+	if (duration.count() < 0)
+		duration = std::chrono::microseconds(0);
+
+	// upper_bound() finds the first bucket whose upper bound is
+	// greater than the duration. If there is none, the index
+	// equals bucket_upper_bounds.size(), which is the index
+	// of the last, open-ended bucket.
+	auto bucket_iter = std::upper_bound(bucket_upper_bounds.begin(), bucket_upper_bounds.end(), duration);
+	std::size_t bucket_index = std::distance(bucket_upper_bounds.begin(), bucket_iter);
+
+	m_bucket_counts[bucket_index]++;
+	m_num_samples++;
+	m_total_duration += duration;
+	m_max_duration = std::max(m_max_duration, duration);
+}
+
+
+void duration_histogram::reset()
+{
+	m_bucket_counts.fill(0);
+	m_num_samples = 0;
+	m_total_duration = std::chrono::microseconds(0);
+	m_max_duration = std::chrono::microseconds(0);
+}
+
+
+} // namespace comboctl end
@@ -3,14 +3,20 @@
 
 #include <functional>
 #include <string>
+#include <string_view>
 #include <optional>
-#include <map>
+#include <memory>
+#include <chrono>
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+#include "dbus_connection.hpp"
+#else
 #include <glib.h>
 #include <gio/gio.h>
-#include <memory>
-#include <boost/bimap.hpp>
-#include "types.hpp"
 #include "glib_misc.hpp"
+#endif
+#include "device_table.hpp"
+#include "types.hpp"
+#include "mainloop_monitor.hpp"
 
 
 namespace comboctl
@@ -20,7 +26,11 @@ namespace comboctl
 /**
  * BlueZ Bluetooth adapter interface for discovery and for removing (= unpairing) devices.
  *
- * This requires a running GLib mainloop in order to function properly.
+ * This requires a running mainloop in order to function properly (the
+ * GLib mainloop, or the epoll_reactor with the native D-Bus backend).
+ *
+ * The D-Bus specific parts are in adapter_glib.cpp and
+ * adapter_native_dbus.cpp; adapter.cpp contains the rest.
  */
 class adapter
 {
@@ -39,25 +49,49 @@ public:
 	 */
 	~adapter();
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	/**
+	 * Subscribes to BlueZ signals coming over D-Bus using the
+	 * specified D-Bus connection.
+	 *
+	 * @param dbus_connection D-Bus connection to use. Must not be null.
+	 *        Must be attached to the reactor of the calling thread,
+	 *        and must outlive this adapter (or its teardown() call).
+	 * @param monitor Mainloop monitor to report D-Bus signal handler
+	 *        durations to. Can be null.
+	 * @throws invalid_call_exception if this adapter is already subscribed.
+	 * @throws io_exception in case of an IO error.
+	 * @throws dbus_error_exception if a D-Bus call fails.
+	 */
+	void setup(dbus_connection *dbus_connection, mainloop_monitor *monitor);
+#else
 	/**
 	 * Subscribes to BlueZ signals coming over D-Bus using the
 	 * specified D-Bus connection.
 	 *
 	 * @param dbus_connection D-Bus connection to use. Must not be null.
+	 * @param monitor Mainloop monitor to report D-Bus signal handler
+	 *        durations to. Can be null.
+	 * @param cancellable GCancellable to pass to blocking D-Bus calls.
+	 *        Cancelling it makes ongoing calls return immediately.
+	 *        Can be null. Must outlive this adapter.
 	 * @throws invalid_call_exception if this adapter is already subscribed.
 	 * @throws io_exception in case of an IO error.
 	 * @throws gerror_exception if something D-Bus related or GLib related fails.
 	 */
-	void setup(GDBusConnection *dbus_connection);
+	void setup(GDBusConnection *dbus_connection, mainloop_monitor *monitor, GCancellable *cancellable);
+#endif
 
 	/**
 	 * Unsubscribes this adapter from getting BlueZ signal over D-Bus.
 	 *
-	 * This also stops any ongoing discovery process.
+	 * This also stops any ongoing discovery process (see stop_discovery()).
 	 *
 	 * If this adapter isn't subscribed, this function does nothing.
+	 *
+	 * @param reply_deadline Passed on to stop_discovery().
 	 */
-	void teardown();
+	void teardown(std::optional<std::chrono::steady_clock::time_point> reply_deadline = std::nullopt);
 
 	/**
 	 * Sets up a callback to be invoked when a previously paired device got unpaired.
@@ -68,6 +102,21 @@ public:
 	 */
 	void on_device_unpaired(device_unpaired_callback callback);
 
+	typedef std::function<void(bluetooth_address device_address)> device_link_lost_callback;
+
+	/**
+	 * Sets up a callback to be invoked when a connected device disconnected.
+	 *
+	 * This is based on the Connected property of BlueZ device objects.
+	 * BlueZ updates it as soon as the baseband link is gone, which is
+	 * typically much sooner than RFCOMM sockets notice it.
+	 *
+	 * Only devices that passed the device filter are reported.
+	 *
+	 * @param callback New callback to use.
+	 */
+	void on_device_link_lost(device_link_lost_callback callback);
+
 	/**
 	 * Installs a callback used for filtering devices by their Bluetooth address.
 	 *
@@ -81,9 +130,31 @@ public:
 	 */
 	void set_device_filter(filter_device_callback callback);
 
+	/**
+	 * Sets the address pattern to pass to BlueZ's discovery filter.
+	 *
+	 * BlueZ only reports devices whose address (or name) starts
+	 * with this pattern. This reduces the number of D-Bus signals
+	 * during discovery. It does not replace the device filter,
+	 * since older BlueZ versions do not support patterns.
+	 *
+	 * The new pattern is used by the next start_discovery() call.
+	 *
+	 * @param pattern Address prefix in BlueZ notation, for example
+	 *        "00:0E:2F". Hex digits must be uppercase. An empty
+	 *        string disables the pattern.
+	 */
+	void set_discovery_address_pattern(std::string pattern);
+
 	/**
 	 * Asynchronously starts the Bluetooth discovery process.
 	 *
+	 * Before starting, a discovery filter is set that limits the
+	 * discovery to BR/EDR devices (the Combo is not an LE device),
+	 * disables duplicate reports, and applies the address pattern
+	 * (see set_discovery_address_pattern()). If BlueZ rejects the
+	 * filter, the discovery is started without it.
+	 *
 	 * This will invoke the on_found_new_device callback for every
 	 * device that was found. This includes already paired devices.
 	 *
@@ -92,7 +163,8 @@ public:
 	 *        pairing status are given to the callback.
 	 *        This argument must be set to a valid function.
 	 * @throws invalid_call_exception If the discovery is already ongoing.
-	 * @throws gerror_exception if something D-Bus related or GLib related fails.
+	 * @throws gerror_exception (dbus_error_exception with the native D-Bus
+	 *         backend) if something D-Bus related fails.
 	 */
 	void start_discovery(found_new_paired_device_callback on_found_new_device);
 
@@ -101,11 +173,20 @@ public:
 	 *
 	 * If no discovery is going on, this function does nothing.
 	 *
+	 * This waits for BlueZ to reply to the StopDiscovery call. Errors
+	 * are logged, but not thrown, since this is called during teardown.
+	 * If a reply deadline is given, the wait ends at that point in time,
+	 * and is not aborted by the cancellable (or by cancelling the D-Bus
+	 * connection), since that is already cancelled when tearing down the
+	 * BlueZ interface. If the deadline was already reached, the call is
+	 * sent without waiting for a reply.
+	 *
 	 * The destructor automatically calls this function.
 	 *
-	 * @throws gerror_exception if something D-Bus related or GLib related fails.
+	 * @param reply_deadline Optional point in time when to stop
+	 *        waiting for the reply.
 	 */
-	void stop_discovery();
+	void stop_discovery(std::optional<std::chrono::steady_clock::time_point> reply_deadline = std::nullopt);
 
 	/**
 	 * Removes a device from the list of paired Bluetooth devices.
@@ -128,38 +209,96 @@ public:
 	 */
 	bluetooth_address_set get_paired_device_addresses() const;
 
+	/**
+	 * Returns the Bluetooth address of the device with the given D-Bus object path.
+	 *
+	 * Only devices that passed the device filter are known. This does
+	 * not involve any D-Bus calls.
+	 *
+	 * @return The address, or std::nullopt if no such device is known.
+	 */
+	std::optional<bluetooth_address> find_device_address(std::string const &object_path) const;
+
+	/**
+	 * Sets the maximum number of devices the adapter keeps track of.
+	 *
+	 * See device_table for details.
+	 *
+	 * @param max_num_devices New maximum. Must be at least 1.
+	 */
+	void set_max_observed_devices(std::size_t max_num_devices);
+
+	/**
+	 * Returns statistics about the devices the adapter keeps track of.
+	 */
+	device_table_stats get_device_table_stats() const;
 
-private:
-	void send_discovery_call(bool do_start);
 
+private:
+	// Backend specific.
+	void send_discovery_call(bool do_start, std::optional<std::chrono::steady_clock::time_point> reply_deadline = std::nullopt);
+	bool send_set_discovery_filter_call(bool include_pattern);
+	void send_remove_device_call(std::string const &object_path);
+	void readmit_device_object(std::string_view object_path);
+
+	void set_discovery_filter();
+
+	// These are called by the backend specific code after it
+	// extracted the relevant details from the D-Bus messages.
+	void add_observed_device(std::string_view object_path, bluetooth_address const &bdaddr, bool is_paired, bool is_connected);
+	void handle_removed_device_object(std::string_view object_path);
+	void handle_device_property_changes(std::string_view object_path, std::optional<bool> is_connected, std::optional<bool> is_paired);
 	void handle_observed_device(bluetooth_address const &bdaddr, bool is_paired);
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	void process_added_dbus_object_interfaces(std::string_view object_path, dbus_value_reader interfaces_dict_reader);
+	void process_device_properties(std::string_view object_path, dbus_value_reader properties_dict_reader);
+	void process_removed_dbus_object_interfaces(std::string_view object_path, dbus_value_reader interfaces_array_reader);
+	void process_adapter_property_changes(dbus_value_reader property_changes_dict_reader);
+	void process_device_property_changes(std::string_view object_path, dbus_value_reader property_changes_dict_reader);
+
+	void dbus_connection_signal_cb(dbus_message const &message);
+#else
 	void process_added_dbus_object_interfaces(gchar const *object_path, GVariant *interfaces_dict_variant);
+	void process_device_properties(gchar const *object_path, GVariantIter *properties_iter);
 	void process_removed_dbus_object_interfaces(gchar const *object_path, GVariant *interfaces_array_variant);
 	void process_dbus_object_interface_property_changes(gchar const *object_path, gchar const *interface_name, GVariant *property_changes_dict_variant);
 
 	void dbus_connection_signal_cb(gchar const *object_path, gchar const *interface_name, gchar const *signal_name, GVariant *parameters);
 
 	gvariant_uptr get_managed_bluez_objects();
+#endif
 
 	bool filter_device(bluetooth_address device_address);
 
 
 	found_new_paired_device_callback m_on_found_new_device;
 	device_unpaired_callback m_on_device_unpaired;
+	device_link_lost_callback m_on_device_link_lost;
 	filter_device_callback m_device_filter;
-
+	std::string m_discovery_address_pattern;
+
+	mainloop_monitor *m_mainloop_monitor;
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	dbus_connection *m_dbus_connection;
+	std::string m_adapter_object_path;
+	// The adapter's Name property, taken from GetManagedObjects
+	// and kept up to date through PropertiesChanged signals.
+	std::string m_adapter_name;
+	unsigned int m_signal_subscription;
+#else
 	GDBusConnection *m_dbus_connection;
+	GCancellable *m_cancellable;
 	GDBusProxy *m_adapter_proxy;
 	guint m_dbus_connection_signal_subscription;
+#endif
 
 	bool m_discovery_started;
 
-	typedef boost::bimap<bluetooth_address, std::string> bt_address_dbus_object_paths_map;
-	bt_address_dbus_object_paths_map m_bt_address_dbus_object_paths;
-
-	typedef std::map<bluetooth_address, bool> observed_devices_map;
-	observed_devices_map m_observed_devices;
+	// Devices that passed the device filter, along with their
+	// D-Bus object paths and their pairing status.
+	device_table m_observed_devices;
 };
 
 
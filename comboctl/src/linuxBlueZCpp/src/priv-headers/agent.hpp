@@ -1,11 +1,19 @@
 #ifndef COMBOCTL_AGENT_HPP
 #define COMBOCTL_AGENT_HPP
 
-#include <glib.h>
-#include <gio/gio.h>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+#include "dbus_connection.hpp"
+#else
+#include <glib.h>
+#include <gio/gio.h>
+#endif
 #include "types.hpp"
+#include "mainloop_monitor.hpp"
 
 
 namespace comboctl
@@ -15,7 +23,11 @@ namespace comboctl
 /**
  * BlueZ Bluetooth agent interface for authenticating pairing requests.
  *
- * This requires a running GLib mainloop in order to function properly.
+ * This requires a running mainloop in order to function properly (the
+ * GLib mainloop, or the epoll_reactor with the native D-Bus backend).
+ *
+ * The D-Bus specific parts are in agent_glib.cpp and
+ * agent_native_dbus.cpp; agent.cpp contains the rest.
  */
 class agent
 {
@@ -34,6 +46,28 @@ public:
 	 */
 	~agent();
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	/**
+	 * Registers this agent in BlueZ as the default agent for incoming
+	 * pairing requests.
+	 *
+	 * This also registers the agent object on the specified D-Bus connection.
+	 *
+	 * @param dbus_connection D-Bus connection to use. Must not be null.
+	 *        Must outlive this agent (or its teardown() call).
+	 * @param pairing_pin_code PIN code to use for authenticating pairing requests.
+	 * @param monitor Mainloop monitor to report agent method call
+	 *        durations to. Can be null.
+	 * @throws invalid_call_exception If the agent was set up already.
+	 * @throws dbus_error_exception if a D-Bus call fails.
+	 * @throws io_exception in case of an IO error.
+	 */
+	void setup(
+		dbus_connection *dbus_connection,
+		std::string pairing_pin_code,
+		mainloop_monitor *monitor
+	);
+#else
 	/**
 	 * Registers this agent in BlueZ as the default agent for incoming
 	 * pairing requests.
@@ -43,17 +77,28 @@ public:
 	 *
 	 * @param dbus_connection D-Bus connection to use. Must not be null.
 	 * @param pairing_pin_code PIN code to use for authenticating pairing requests.
+	 * @param monitor Mainloop monitor to report agent method call
+	 *        durations to. Can be null.
+	 * @param cancellable GCancellable to pass to blocking D-Bus calls.
+	 *        Cancelling it makes ongoing calls return immediately.
+	 *        Can be null. Must outlive this agent.
 	 * @throws invalid_call_exception If the agent was set up already.
 	 * @throws gerror_exception if something D-Bus related or GLib related fails.
 	 */
 	void setup(
 		GDBusConnection *dbus_connection,
-		std::string pairing_pin_code
+		std::string pairing_pin_code,
+		mainloop_monitor *monitor,
+		GCancellable *cancellable
 	);
+#endif
 
 	/**
 	 * Unregisters this agent from BlueZ, and unsubscribes it from D-Bus.
 	 *
+	 * The UnregisterAgent call is sent without waiting for a reply,
+	 * so this does not block even if BlueZ is unresponsive.
+	 *
 	 * If this agent isn't registered, this function does nothing.
 	 */
 	void teardown();
@@ -71,18 +116,53 @@ public:
 	 */
 	void set_device_filter(filter_device_callback callback);
 
+	typedef std::function<std::optional<bluetooth_address>(std::string const &object_path)> device_address_lookup_callback;
+
+	/**
+	 * Installs a callback for looking up a device's Bluetooth address by its D-Bus object path.
+	 *
+	 * The agent uses this to find out which device requests a PIN code
+	 * without having to ask BlueZ over D-Bus. If the callback is not set
+	 * or returns std::nullopt, the address is taken from the object path
+	 * itself, since BlueZ encodes addresses in device object paths.
+	 *
+	 * @param callback New callback to use.
+	 */
+	void set_device_address_lookup(device_address_lookup_callback callback);
+
 
 private:
+	static constexpr char const *agent_path = "/io/bluetooth/comboctl/bluetoothAgent";
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	void handle_agent_method_call(dbus_message const &message);
+#else
 	void handle_agent_method_call(GDBusConnection *, gchar const *sender, gchar const *object_path, gchar const *interface_name, gchar const *method_name, GVariant *parameters, GDBusMethodInvocation *invocation);
+#endif
+
+	/**
+	 * Checks if the device with the given D-Bus object path may get
+	 * the PIN code. Used by the backends for RequestPinCode calls.
+	 */
+	bool authorize_pin_code_request(std::string_view device_object_path);
 
 
 	std::string m_pairing_pin_code;
 
 	filter_device_callback m_device_filter;
+	device_address_lookup_callback m_device_address_lookup;
+
+	mainloop_monitor *m_mainloop_monitor;
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	dbus_connection *m_dbus_connection;
+	bool m_agent_object_registered;
+#else
 	GDBusConnection *m_dbus_connection;
+	GCancellable *m_cancellable;
 	GDBusProxy *m_agent_manager_proxy;
 	guint m_agent_object_id;
+#endif
 	bool m_agent_registered;
 };
 
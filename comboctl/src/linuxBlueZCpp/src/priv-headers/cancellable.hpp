@@ -0,0 +1,69 @@
+#ifndef COMBOCTL_CANCELLABLE_HPP
+#define COMBOCTL_CANCELLABLE_HPP
+
+#include <atomic>
+#include <mutex>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Cancellation flag for blocking socket operations.
+ *
+ * This is a minimal counterpart to GLib's GCancellable, based on an
+ * eventfd. Blocking operations poll() its file descriptor along with
+ * their socket, so that a cancel() call from another thread wakes them
+ * up. The flag stays set until reset() is called, so a cancel() call
+ * that happens right before a blocking operation starts is not lost.
+ *
+ * is_canceled() only reads an atomic flag, so checking for a
+ * cancellation does not cost a syscall.
+ */
+class cancellable
+{
+public:
+	cancellable();
+	~cancellable();
+
+	// Disable copy semantics for this class.
+	cancellable(cancellable const &) = delete;
+	cancellable& operator = (cancellable const &) = delete;
+
+	/**
+	 * Sets the flag and makes the file descriptor readable.
+	 *
+	 * Calling this while the flag is already set does nothing.
+	 * It is safe to call this from another thread.
+	 */
+	void cancel();
+
+	/**
+	 * Clears the flag and drains the file descriptor.
+	 *
+	 * It is safe to call this from another thread.
+	 */
+	void reset();
+
+	bool is_canceled() const;
+
+	/**
+	 * Returns the file descriptor that becomes readable once cancel() is called.
+	 *
+	 * It stays readable until reset() is called.
+	 */
+	int get_fd() const;
+
+
+private:
+	int m_event_fd;
+	std::mutex m_mutex;
+	std::atomic<bool> m_canceled;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_CANCELLABLE_HPP
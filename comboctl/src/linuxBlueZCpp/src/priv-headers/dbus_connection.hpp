@@ -0,0 +1,255 @@
+#ifndef COMBOCTL_DBUS_CONNECTION_HPP
+#define COMBOCTL_DBUS_CONNECTION_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/uio.h>
+#include "dbus_message.hpp"
+#include "epoll_reactor.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Connection to a D-Bus message bus, used by the native D-Bus backend.
+ *
+ * This implements the client side of the D-Bus protocol over a Unix
+ * domain socket, with EXTERNAL authentication. It is meant to be used
+ * from a single thread, which also runs the epoll_reactor the
+ * connection is attached to. Only cancel() and reset_cancellation()
+ * may be called from other threads.
+ *
+ * Method calls are synchronous, like the g_dbus_*_call_sync() calls in
+ * the GLib backend. Signals and method calls to registered objects
+ * that arrive while waiting for a reply are kept, and dispatched by the
+ * reactor afterwards, in the order they arrived. Incoming messages are
+ * parsed in place in the read buffer; handlers get a dbus_message that
+ * refers to that buffer, so it must not be used after the handler
+ * returns. Use dbus_message::make_owned_copy() to keep a message.
+ *
+ * Errors are reported with io_exception (for socket and protocol
+ * errors) and with dbus_error_exception (for error replies, timeouts,
+ * and cancelled calls).
+ */
+class dbus_connection
+{
+public:
+	typedef std::function<void(dbus_message const &message)> message_handler;
+
+	/// Timeout of blocking calls. Same as the D-Bus reference implementation's default.
+	static constexpr std::chrono::milliseconds default_call_timeout = std::chrono::seconds(25);
+
+	/**
+	 * Constructor.
+	 *
+	 * @throws io_exception if the cancellation eventfd cannot be created.
+	 */
+	dbus_connection();
+
+	/**
+	 * Destructor.
+	 *
+	 * Calls close().
+	 */
+	~dbus_connection();
+
+	dbus_connection(dbus_connection const &) = delete;
+	dbus_connection& operator = (dbus_connection const &) = delete;
+
+	/**
+	 * Returns the address of the system bus.
+	 *
+	 * This is the value of DBUS_SYSTEM_BUS_ADDRESS if it
+	 * is set, and the well-known default address otherwise.
+	 */
+	static std::string get_system_bus_address();
+
+	/**
+	 * Connects to the bus at the given address, authenticates,
+	 * and registers with the bus (by calling Hello).
+	 *
+	 * Only unix:path= and unix:abstract= addresses are supported.
+	 * If the address lists several, the first supported one is used.
+	 *
+	 * @throws invalid_call_exception if the connection is already open.
+	 * @throws io_exception if connecting or authenticating fails.
+	 * @throws dbus_error_exception if the Hello call fails or this
+	 *         connection was cancelled.
+	 */
+	void open(std::string const &address);
+
+	/**
+	 * Detaches the connection from its reactor and closes the socket.
+	 *
+	 * Pending stashed messages are discarded. Registered objects and
+	 * signal subscriptions are kept, but no longer receive anything.
+	 * If the connection is not open, this does nothing.
+	 */
+	void close();
+
+	bool is_open() const;
+
+	/**
+	 * Aborts any blocking call that is currently in progress, and makes
+	 * subsequent blocking calls fail immediately, with a
+	 * dbus_error_exception whose is_cancelled() function returns true.
+	 *
+	 * send() still works, unless the socket is not writable, so that
+	 * teardown code can still notify the peer. Thread safe.
+	 */
+	void cancel();
+
+	/**
+	 * Undoes cancel(). Must not be called while a call is in progress.
+	 */
+	void reset_cancellation();
+
+	/**
+	 * Returns the unique bus name the bus assigned to this connection.
+	 */
+	std::string const & get_unique_name() const;
+
+	/**
+	 * Makes the reactor dispatch incoming messages.
+	 *
+	 * @throws invalid_call_exception if the connection is not open.
+	 */
+	void attach(epoll_reactor &reactor);
+
+	/**
+	 * Stops dispatching incoming messages through the reactor.
+	 */
+	void detach();
+
+	/**
+	 * Sends a method call and waits for its reply.
+	 *
+	 * If ignore_cancellation is true, the wait for the reply is not
+	 * aborted by cancel(), and the call is made even if the connection
+	 * was already cancelled. Teardown code uses this for calls whose
+	 * reply it still wants to see, together with a short timeout.
+	 *
+	 * @return The reply. It owns its data.
+	 * @throws dbus_error_exception if the peer replied with an error,
+	 *         if no reply arrived within the timeout, or if this
+	 *         connection was cancelled.
+	 * @throws io_exception in case of a socket or protocol error.
+	 */
+	dbus_message call(dbus_message_builder const &message, std::chrono::milliseconds timeout = default_call_timeout, bool ignore_cancellation = false);
+
+	/**
+	 * Sends a message without waiting for a reply.
+	 *
+	 * Method calls sent with this function should have the
+	 * no-reply-expected flag set, so that the peer does not send a
+	 * reply that nobody waits for. (Such replies are ignored though.)
+	 *
+	 * @throws io_exception in case of a socket error.
+	 */
+	void send(dbus_message_builder const &message);
+
+	/**
+	 * Installs a signal handler and adds the given match rule to the bus.
+	 *
+	 * Handlers get all signals that arrive on this connection, not
+	 * just the ones matching their own rule, so they must check the
+	 * interface and member of the signals themselves.
+	 *
+	 * @return ID for unsubscribe_signals().
+	 * @throws dbus_error_exception if the AddMatch call fails.
+	 */
+	unsigned int subscribe_signals(std::string match_rule, message_handler handler);
+
+	/**
+	 * Removes a signal handler and its match rule. The RemoveMatch
+	 * call is sent without waiting for a reply.
+	 */
+	void unsubscribe_signals(unsigned int subscription_id);
+
+	/**
+	 * Registers a handler for method calls to the given object path.
+	 *
+	 * The handler must send a reply (see dbus_message_builder::method_return()
+	 * and dbus_message_builder::error()), unless the call has the
+	 * no-reply-expected flag set. If it throws, an error reply is sent.
+	 * Calls to paths without a handler get an UnknownObject error reply.
+	 *
+	 * @throws invalid_call_exception if the path already has a handler.
+	 */
+	void register_object(std::string object_path, message_handler handler);
+
+	void unregister_object(std::string const &object_path);
+
+
+private:
+	struct signal_subscription
+	{
+		unsigned int m_id;
+		std::string m_match_rule;
+		message_handler m_handler;
+	};
+
+	void connect_socket(std::string const &address);
+	void authenticate(std::chrono::steady_clock::time_point deadline);
+	std::string read_auth_line(std::chrono::steady_clock::time_point deadline);
+
+	std::uint32_t send_message(dbus_message_builder const &message);
+	void write_all(struct iovec *iovecs, int num_iovecs);
+	bool wait_for_socket(short events, std::chrono::steady_clock::time_point deadline, bool ignore_cancellation = false);
+	bool is_cancelled() const;
+	void throw_if_not_open() const;
+
+	std::size_t read_from_socket();
+	void prepare_read_buffer();
+	bool take_buffered_message(std::optional<dbus_message> &message);
+	void stash_message(dbus_message const &message);
+	void post_dispatch();
+
+	void dispatch();
+	void handle_message(dbus_message const &message);
+	void handle_method_call(dbus_message const &message);
+	void handle_connection_error(std::exception const &exc);
+
+	int m_socket_fd;
+	int m_cancel_fd;
+	std::string m_unique_name;
+	std::uint32_t m_next_serial;
+
+	epoll_reactor *m_reactor;
+	bool m_dispatch_posted;
+
+	// Incoming data. Messages are parsed in place, and handlers get
+	// messages that refer to this buffer. For that reason, while
+	// messages are being dispatched (m_dispatch_depth > 0), the data
+	// must not move. If a blocking call made by a handler needs more
+	// space, a new buffer is allocated, and the old one is retired
+	// until the dispatching is done.
+	std::vector<std::uint8_t> m_read_buffer;
+	std::size_t m_read_begin;
+	std::size_t m_read_end;
+	unsigned int m_dispatch_depth;
+	std::vector<std::vector<std::uint8_t>> m_retired_read_buffers;
+
+	// Messages that arrived while a blocking call waited for its reply.
+	std::deque<dbus_message> m_stashed_messages;
+
+	std::vector<signal_subscription> m_signal_subscriptions;
+	unsigned int m_next_subscription_id;
+	std::map<std::string, message_handler, std::less<>> m_objects;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_DBUS_CONNECTION_HPP
@@ -0,0 +1,347 @@
+#ifndef COMBOCTL_DBUS_MESSAGE_HPP
+#define COMBOCTL_DBUS_MESSAGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Minimal implementation of the D-Bus wire format, used by the native
+// D-Bus backend (see dbus_connection.hpp). It covers all types except
+// Unix file descriptors, which the BlueZ code does not need. Incoming
+// messages are parsed in place: strings are returned as views into the
+// message data, and containers are walked with sub-readers, so reading
+// the few properties we are interested in does not copy anything.
+// Validation is limited to what is needed to never read out of bounds;
+// malformed data results in an io_exception.
+
+
+namespace comboctl
+{
+
+
+enum class dbus_message_type : std::uint8_t
+{
+	invalid = 0,
+	method_call = 1,
+	method_return = 2,
+	error = 3,
+	signal = 4
+};
+
+
+/// Message flag telling the receiver that no reply is wanted.
+constexpr std::uint8_t dbus_flag_no_reply_expected = 0x1;
+
+
+/**
+ * Reader for marshalled D-Bus values.
+ *
+ * A reader covers a sequence of values described by a signature. For
+ * arrays, the element signature is repeated until the end of the
+ * array data. Readers are cheap to copy; they only refer to the data.
+ * Strings returned by the reader are only valid as long as that data is.
+ */
+class dbus_value_reader
+{
+public:
+	/**
+	 * Constructor.
+	 *
+	 * @param data Start of the message. Alignment is relative to this.
+	 * @param begin Offset of the first value.
+	 * @param end Offset right after the last byte the values may occupy.
+	 * @param signature Signature of the values.
+	 * @param is_big_endian Byte order of the data.
+	 */
+	dbus_value_reader(std::uint8_t const *data, std::size_t begin, std::size_t end, std::string_view signature, bool is_big_endian);
+
+	/**
+	 * Returns true if there are no more values to read.
+	 */
+	bool at_end() const;
+
+	/**
+	 * Returns the type code of the next value, or '\0' if at_end() is true.
+	 *
+	 * Container types use the first character of their signature,
+	 * that is, 'a', '(', '{', and 'v'.
+	 */
+	char get_current_type() const;
+
+	std::uint8_t read_byte();
+	bool read_boolean();
+	std::int16_t read_int16();
+	std::uint16_t read_uint16();
+	std::int32_t read_int32();
+	std::uint32_t read_uint32();
+	std::int64_t read_int64();
+	std::uint64_t read_uint64();
+	double read_double();
+
+	/**
+	 * Reads a string, object path, or signature.
+	 */
+	std::string_view read_string();
+
+	/**
+	 * Returns a reader for the contents of the next value, which must be
+	 * an array, a struct, a dict entry, or a variant, and skips that value.
+	 *
+	 * A variant's reader covers the single value inside it; use
+	 * get_current_type() to check its type.
+	 */
+	dbus_value_reader enter_container();
+
+	/**
+	 * Skips the next value, whatever its type.
+	 */
+	void skip();
+
+
+private:
+	dbus_value_reader(std::uint8_t const *data, std::size_t begin, std::size_t end, std::string_view signature, bool is_big_endian, bool is_array, unsigned int depth);
+
+	char begin_value(char expected_type);
+	void align(std::size_t alignment);
+	void check_size(std::size_t num_bytes) const;
+	std::uint16_t read_raw_uint16();
+	std::uint32_t read_raw_uint32();
+	std::uint64_t read_raw_uint64();
+
+	std::uint8_t const *m_data;
+	std::size_t m_position;
+	std::size_t m_end;
+	std::string_view m_signature;
+	std::size_t m_signature_position;
+	bool m_is_big_endian;
+	bool m_is_array;
+	unsigned int m_depth;
+};
+
+
+/**
+ * Writer for marshalled D-Bus values.
+ *
+ * Values are appended to an internal buffer. The signature of the
+ * top level values is recorded automatically, so it does not have
+ * to be specified separately. Containers are written by calling the
+ * matching open and close functions around their contents.
+ */
+class dbus_value_writer
+{
+public:
+	dbus_value_writer();
+
+	void append_byte(std::uint8_t value);
+	void append_boolean(bool value);
+	void append_int16(std::int16_t value);
+	void append_uint16(std::uint16_t value);
+	void append_int32(std::int32_t value);
+	void append_uint32(std::uint32_t value);
+	void append_int64(std::int64_t value);
+	void append_uint64(std::uint64_t value);
+	void append_string(std::string_view value);
+	void append_object_path(std::string_view value);
+	void append_signature(std::string_view value);
+
+	/**
+	 * Opens an array.
+	 *
+	 * @param element_signature Signature of the array elements,
+	 *        for example "{sv}" for a dictionary of variants.
+	 */
+	void open_array(std::string_view element_signature);
+	void close_array();
+	void open_struct();
+	void close_struct();
+	void open_dict_entry();
+	void close_dict_entry();
+
+	/**
+	 * Opens a variant.
+	 *
+	 * @param signature Signature of the single value inside the variant.
+	 */
+	void open_variant(std::string_view signature);
+	void close_variant();
+
+	std::string const & get_signature() const;
+	std::vector<std::uint8_t> const & get_data() const;
+
+
+private:
+	struct open_container
+	{
+		char m_type;
+		std::size_t m_length_position;
+		std::size_t m_elements_position;
+	};
+
+	void begin_value(char type_code, std::size_t alignment);
+	void align(std::size_t alignment);
+	void append_raw(void const *value, std::size_t size);
+	void append_string_data(char type_code, std::string_view value);
+
+	std::vector<std::uint8_t> m_data;
+	std::string m_signature;
+	std::vector<open_container> m_open_containers;
+	unsigned int m_num_unrecorded_levels;
+};
+
+
+/**
+ * Parsed D-Bus message.
+ *
+ * The header fields are parsed right away, the body only on demand
+ * through get_body_reader(). A message either refers to data owned by
+ * someone else (like the read buffer of a dbus_connection) or owns its
+ * data. Moving a message keeps the string views valid, since the owned
+ * data stays at the same address; copying is not possible.
+ */
+class dbus_message
+{
+public:
+	/**
+	 * Returns the size of the message that starts with the given
+	 * bytes, or 0 if more bytes are needed to determine it.
+	 *
+	 * @throws io_exception if the bytes do not start a valid message.
+	 */
+	static std::size_t get_message_size(std::uint8_t const *data, std::size_t size);
+
+	/**
+	 * Parses a message without copying it. The data must
+	 * stay valid for as long as this message is used.
+	 *
+	 * @throws io_exception if the message is malformed.
+	 */
+	dbus_message(std::uint8_t const *data, std::size_t size);
+
+	/**
+	 * Parses a message and takes ownership of its data.
+	 *
+	 * @throws io_exception if the message is malformed.
+	 */
+	explicit dbus_message(std::vector<std::uint8_t> data);
+
+	dbus_message(dbus_message &&other) = default;
+	dbus_message& operator = (dbus_message &&other) = default;
+	dbus_message(dbus_message const &) = delete;
+	dbus_message& operator = (dbus_message const &) = delete;
+
+	/**
+	 * Returns a copy of this message that owns its data.
+	 */
+	dbus_message make_owned_copy() const;
+
+	dbus_message_type get_type() const;
+	std::uint8_t get_flags() const;
+	std::uint32_t get_serial() const;
+	std::optional<std::uint32_t> get_reply_serial() const;
+
+	/// The header fields below are empty if the message does not have them.
+	std::string_view get_path() const;
+	std::string_view get_interface() const;
+	std::string_view get_member() const;
+	std::string_view get_error_name() const;
+	std::string_view get_destination() const;
+	std::string_view get_sender() const;
+	std::string_view get_signature() const;
+
+	bool is_method_call(std::string_view interface, std::string_view member) const;
+	bool is_signal(std::string_view interface, std::string_view member) const;
+
+	/**
+	 * Returns a reader for the message body.
+	 */
+	dbus_value_reader get_body_reader() const;
+
+	/**
+	 * Returns the first string of an error message's body, which by
+	 * convention is the error description, or an empty view.
+	 */
+	std::string_view get_error_message() const;
+
+
+private:
+	void parse();
+
+	std::vector<std::uint8_t> m_owned_data;
+	std::uint8_t const *m_data;
+	std::size_t m_size;
+	std::size_t m_body_offset;
+	bool m_is_big_endian;
+
+	dbus_message_type m_type;
+	std::uint8_t m_flags;
+	std::uint32_t m_serial;
+	std::optional<std::uint32_t> m_reply_serial;
+	std::string_view m_path;
+	std::string_view m_interface;
+	std::string_view m_member;
+	std::string_view m_error_name;
+	std::string_view m_destination;
+	std::string_view m_sender;
+	std::string_view m_signature;
+};
+
+
+/**
+ * Builder for outgoing D-Bus messages.
+ *
+ * The header and the body are kept in separate buffers, so
+ * that dbus_connection can send them with one sendmsg() call
+ * without first copying them into a contiguous buffer.
+ */
+class dbus_message_builder
+{
+public:
+	static dbus_message_builder method_call(std::string_view destination, std::string_view path, std::string_view interface, std::string_view member);
+	static dbus_message_builder signal(std::string_view path, std::string_view interface, std::string_view member);
+	static dbus_message_builder method_return(dbus_message const &call);
+	static dbus_message_builder error(dbus_message const &call, std::string_view error_name, std::string_view error_message);
+
+	dbus_message_type get_type() const;
+
+	void set_no_reply_expected();
+	bool is_no_reply_expected() const;
+
+	/**
+	 * Returns the writer for the message body.
+	 */
+	dbus_value_writer & body();
+
+	std::vector<std::uint8_t> const & get_body_data() const;
+
+	/**
+	 * Marshals the header for the given serial number.
+	 *
+	 * The body must be complete at this point. The header
+	 * includes the padding that has to follow it.
+	 */
+	std::vector<std::uint8_t> build_header(std::uint32_t serial) const;
+
+
+private:
+	explicit dbus_message_builder(dbus_message_type type);
+
+	dbus_message_type m_type;
+	std::uint8_t m_flags;
+	std::string m_path;
+	std::string m_interface;
+	std::string m_member;
+	std::string m_error_name;
+	std::string m_destination;
+	std::optional<std::uint32_t> m_reply_serial;
+	dbus_value_writer m_body;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_DBUS_MESSAGE_HPP
@@ -0,0 +1,169 @@
+#ifndef COMBOCTL_DEVICE_TABLE_HPP
+#define COMBOCTL_DEVICE_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include "device_table_stats.hpp"
+#include "types.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Bounded table of Bluetooth devices the adapter knows about.
+ *
+ * Devices can be looked up by Bluetooth address and by D-Bus object
+ * path. The table also tracks in which order devices were last seen.
+ * If adding a device makes the table exceed its maximum size, the
+ * least recently seen devices that are neither paired nor connected
+ * are evicted. Paired and connected devices are never evicted.
+ *
+ * This class is not thread safe. The adapter only accesses it from
+ * the GLib mainloop thread.
+ */
+class device_table
+{
+public:
+	struct entry
+	{
+		bluetooth_address m_address;
+
+		/// D-Bus object path of the device. Empty if the device
+		/// was removed through the adapter, since BlueZ deletes
+		/// the object in that case.
+		std::string m_object_path;
+
+		/// Pairing status. std::nullopt if the device was added, but
+		/// its pairing status was not seen yet by the adapter.
+		std::optional<bool> m_paired;
+
+		bool m_connected = false;
+	};
+
+	static constexpr std::size_t default_max_num_devices = 256;
+
+	device_table();
+
+	/**
+	 * Sets the maximum number of devices.
+	 *
+	 * If the table currently has more devices, evictable
+	 * devices are evicted right away.
+	 *
+	 * @param max_num_devices New maximum. Must be at least 1.
+	 */
+	void set_max_num_devices(std::size_t max_num_devices);
+
+	/**
+	 * Adds a device, or updates its object path if it is already in the table.
+	 *
+	 * The device becomes the most recently seen one. This may evict
+	 * other devices, but never the one that is added here.
+	 */
+	void add(bluetooth_address const &address, std::string object_path, bool connected);
+
+	/**
+	 * Removes a device. Does nothing if the device is not in the table.
+	 */
+	void erase(bluetooth_address const &address);
+
+	/**
+	 * Removes all devices. The eviction counter is not reset.
+	 */
+	void clear();
+
+	/**
+	 * Returns the entry for the given address, or null if there is none.
+	 *
+	 * The pointer is valid until the table is modified.
+	 */
+	entry const * find(bluetooth_address const &address) const;
+
+	/**
+	 * Returns the address of the device with the given object path.
+	 *
+	 * This takes a string_view so that object paths that were parsed
+	 * in place from D-Bus messages can be looked up without copying.
+	 */
+	std::optional<bluetooth_address> find_address(std::string_view object_path) const;
+
+	/**
+	 * Marks the device as the most recently seen one.
+	 */
+	void touch(bluetooth_address const &address);
+
+	/**
+	 * Sets the pairing status of a device and returns the previous one.
+	 *
+	 * The previous status is std::nullopt if it was not set before.
+	 * Does nothing (and returns std::nullopt) if the device is not
+	 * in the table.
+	 */
+	std::optional<bool> set_paired(bluetooth_address const &address, bool paired);
+
+	/**
+	 * Sets the connection status of a device and returns the previous one.
+	 *
+	 * Does nothing (and returns false) if the device is not in the table.
+	 */
+	bool set_connected(bluetooth_address const &address, bool connected);
+
+	/**
+	 * Clears the object path of a device, keeping the rest of its entry.
+	 */
+	void clear_object_path(bluetooth_address const &address);
+
+	bluetooth_address_set get_paired_device_addresses() const;
+
+	/**
+	 * Returns statistics about the table.
+	 *
+	 * This iterates over all devices to compute
+	 * the memory usage, so it is not O(1).
+	 */
+	device_table_stats get_stats() const;
+
+
+private:
+	struct by_recency {};
+	struct by_address {};
+	struct by_object_path {};
+
+	// The sequenced index keeps the entries ordered by when they were
+	// last seen, most recently seen last, so evicting starts at the front.
+	typedef boost::multi_index_container<
+		entry,
+		boost::multi_index::indexed_by<
+			boost::multi_index::sequenced<boost::multi_index::tag<by_recency>>,
+			boost::multi_index::ordered_unique<
+				boost::multi_index::tag<by_address>,
+				boost::multi_index::member<entry, bluetooth_address, &entry::m_address>
+			>,
+			boost::multi_index::ordered_non_unique<
+				boost::multi_index::tag<by_object_path>,
+				boost::multi_index::member<entry, std::string, &entry::m_object_path>
+			>
+		>
+	> entry_container;
+
+	void evict_excess_devices(bluetooth_address const *protected_address);
+
+	entry_container m_entries;
+	std::size_t m_max_num_devices;
+	std::uint64_t m_num_evictions;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_DEVICE_TABLE_HPP
@@ -0,0 +1,139 @@
+#ifndef COMBOCTL_EPOLL_REACTOR_HPP
+#define COMBOCTL_EPOLL_REACTOR_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace comboctl
+{
+
+
+/**
+ * Minimal event loop based on epoll, used by the native D-Bus backend
+ * in place of the GLib mainloop.
+ *
+ * It dispatches readiness events of file descriptors, one-shot timers,
+ * and tasks posted from any thread. Tasks run in the order they were
+ * posted, after the file descriptor events and timers that were ready
+ * in the same iteration, similar to GLib idle sources.
+ *
+ * post(), quit(), add_timer() and remove_timer() are thread safe. The
+ * file descriptor functions must be called in the thread that runs the
+ * reactor (or before it runs). Tasks that are still pending when the
+ * reactor is destroyed are destroyed without being run.
+ */
+class epoll_reactor
+{
+public:
+	typedef std::function<void()> task;
+	typedef std::function<void(std::uint32_t events)> fd_callback;
+	typedef std::uint64_t timer_id;
+
+	/**
+	 * Constructor.
+	 *
+	 * @throws io_exception if the epoll instance or the
+	 *         wakeup eventfd cannot be created.
+	 */
+	epoll_reactor();
+	~epoll_reactor();
+
+	epoll_reactor(epoll_reactor const &) = delete;
+	epoll_reactor& operator = (epoll_reactor const &) = delete;
+
+	/**
+	 * Dispatches events until quit() is called.
+	 */
+	void run();
+
+	/**
+	 * Makes run() return.
+	 *
+	 * This posts a task, so tasks posted before this call
+	 * still run. If run() was not called yet, it returns
+	 * as soon as it reaches that task.
+	 */
+	void quit();
+
+	/**
+	 * Schedules a task to be run by the reactor thread.
+	 */
+	void post(task func);
+
+	/**
+	 * Schedules a task to be run once the given delay elapsed.
+	 *
+	 * @return ID for remove_timer().
+	 */
+	timer_id add_timer(std::chrono::milliseconds delay, task func);
+
+	/**
+	 * Removes a timer that has not run yet. The task is destroyed
+	 * without being run. Unknown IDs are ignored.
+	 */
+	void remove_timer(timer_id id);
+
+	/**
+	 * Starts watching a file descriptor.
+	 *
+	 * @param fd File descriptor to watch. Must not be watched already.
+	 * @param events epoll event mask, like EPOLLIN.
+	 * @param callback Called with the ready events. It may
+	 *        call add_fd() and remove_fd().
+	 * @throws io_exception if the descriptor cannot be added.
+	 */
+	void add_fd(int fd, std::uint32_t events, fd_callback callback);
+
+	/**
+	 * Stops watching a file descriptor. Unknown descriptors are ignored.
+	 */
+	void remove_fd(int fd);
+
+
+private:
+	struct fd_watch
+	{
+		int m_fd;
+		fd_callback m_callback;
+	};
+
+	struct timer
+	{
+		timer_id m_id;
+		std::chrono::steady_clock::time_point m_deadline;
+		task m_func;
+	};
+
+	void wake_up();
+	int get_epoll_timeout();
+	void dispatch_fd_event(int fd, std::uint32_t events);
+	void run_due_timers();
+	void run_posted_tasks();
+
+	int m_epoll_fd;
+	int m_wakeup_fd;
+	bool m_quit_requested;
+	bool m_dispatching_fd_event;
+
+	std::vector<std::unique_ptr<fd_watch>> m_fd_watches;
+
+	// Guards the timers and the posted tasks.
+	std::mutex m_mutex;
+	std::vector<timer> m_timers;
+	timer_id m_next_timer_id;
+	std::vector<task> m_posted_tasks;
+	// Swapped with m_posted_tasks for running them. Both vectors keep
+	// their capacity, so dispatching does not allocate once warmed up.
+	std::vector<task> m_running_tasks;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_EPOLL_REACTOR_HPP
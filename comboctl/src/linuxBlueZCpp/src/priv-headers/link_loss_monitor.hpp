@@ -0,0 +1,50 @@
+#ifndef COMBOCTL_LINK_LOSS_MONITOR_HPP
+#define COMBOCTL_LINK_LOSS_MONITOR_HPP
+
+#include <map>
+#include <mutex>
+#include "types.hpp"
+
+
+namespace comboctl
+{
+
+
+class rfcomm_connection;
+
+
+/**
+ * Keeps track of the RFCOMM connections of open Bluetooth devices.
+ *
+ * bluez_bluetooth_device instances register their connection here.
+ * When the adapter sees that a device is no longer connected, it
+ * calls notify_link_lost(), which aborts blocked send and receive
+ * operations of that device's connections right away.
+ *
+ * All functions are thread safe. Devices hold a shared pointer to
+ * the monitor, so the monitor outlives them even if the
+ * bluez_interface is destroyed first.
+ */
+class link_loss_monitor
+{
+public:
+	void add_connection(bluetooth_address const &address, rfcomm_connection *connection);
+	void remove_connection(bluetooth_address const &address, rfcomm_connection *connection);
+
+	/**
+	 * Calls rfcomm_connection::signal_link_lost() on all
+	 * connections registered for the given address.
+	 */
+	void notify_link_lost(bluetooth_address const &address);
+
+
+private:
+	std::mutex m_mutex;
+	std::multimap<bluetooth_address, rfcomm_connection *> m_connections;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_LINK_LOSS_MONITOR_HPP
@@ -0,0 +1,125 @@
+#ifndef COMBOCTL_MAINLOOP_MONITOR_HPP
+#define COMBOCTL_MAINLOOP_MONITOR_HPP
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include "mainloop_stats.hpp"
+
+
+namespace comboctl
+{
+
+
+/**
+ * Collects dispatch timing statistics for the internal GLib mainloop thread.
+ *
+ * The mainloop code reports queue latencies and callback durations to this
+ * class. Callbacks that take longer than the configured budget are logged
+ * together with the name of their source.
+ *
+ * This class is thread safe. Statistics are typically recorded in the
+ * mainloop thread and read from other threads. Reading them does not
+ * involve the mainloop, so it works even if the mainloop is stalled.
+ */
+class mainloop_monitor
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	/**
+	 * Default budget for a single mainloop callback.
+	 *
+	 * Some callbacks (like the one that starts discovery) perform
+	 * synchronous D-Bus calls, so this must not be too tight.
+	 */
+	static constexpr std::chrono::microseconds default_slow_callback_budget = std::chrono::milliseconds(100);
+
+	/**
+	 * Constructor.
+	 *
+	 * Sets up zeroed statistics and the default slow callback budget.
+	 */
+	mainloop_monitor();
+
+	/**
+	 * Sets the budget for a single mainloop callback.
+	 *
+	 * Callbacks that exceed this budget are counted and logged.
+	 *
+	 * @param budget New budget. Must be positive.
+	 */
+	void set_slow_callback_budget(std::chrono::microseconds budget);
+
+	/**
+	 * Records the time between posting a task and it starting to run.
+	 */
+	void record_queue_latency(clock::duration latency);
+
+	/**
+	 * Records the duration of a mainloop callback.
+	 *
+	 * @param source Name of the callback's source. Must not be null.
+	 * @param detail Optional additional detail, like the name of a
+	 *        D-Bus signal. Can be null.
+	 * @param duration How long the callback ran.
+	 */
+	void record_dispatch(char const *source, char const *detail, clock::duration duration);
+
+	/**
+	 * Returns a copy of the current statistics.
+	 */
+	mainloop_stats get_stats() const;
+
+	/**
+	 * Resets all statistics. The slow callback budget is retained.
+	 */
+	void reset_stats();
+
+
+private:
+	mutable std::mutex m_mutex;
+	mainloop_stats m_stats;
+
+	// record_dispatch() is called for every mainloop callback, so it
+	// must not allocate. The name of the slowest callback is therefore
+	// kept in this fixed buffer (cut off if necessary), and only copied
+	// into the stats' string by get_stats().
+	std::array<char, 128> m_slowest_callback_source;
+	std::size_t m_slowest_callback_source_length;
+};
+
+
+/**
+ * RAII helper for timing a mainloop callback.
+ *
+ * The time between construction and destruction is reported
+ * to the monitor as the callback's dispatch duration. If the
+ * monitor is null, nothing is recorded.
+ *
+ * The source and detail strings must stay valid until this
+ * object is destroyed.
+ */
+class scoped_dispatch_timer
+{
+public:
+	scoped_dispatch_timer(mainloop_monitor *monitor, char const *source, char const *detail = nullptr);
+	~scoped_dispatch_timer();
+
+	scoped_dispatch_timer(scoped_dispatch_timer const &) = delete;
+	scoped_dispatch_timer& operator = (scoped_dispatch_timer const &) = delete;
+
+
+private:
+	mainloop_monitor *m_monitor;
+	char const *m_source;
+	char const *m_detail;
+	mainloop_monitor::clock::time_point m_start;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_MAINLOOP_MONITOR_HPP
@@ -1,14 +1,19 @@
 #ifndef COMBOCTL_RFCOMM_CONNECTION_HPP
 #define COMBOCTL_RFCOMM_CONNECTION_HPP
 
-#include <glib.h>
-#include <gio/gio.h>
+#include <sys/uio.h>
 #include <array>
+#include <atomic>
 #include <vector>
 #include <cstdint>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <string>
 #include "types.hpp"
+#include "io_result.hpp"
+#include "cancellable.hpp"
+#include "rfcomm_flow_control.hpp"
 
 
 namespace comboctl
@@ -22,6 +27,10 @@ namespace comboctl
  * a connection attempt, call disconnect(). send() and receive() too block
  * and have cancel_send() / cancel_receive() functions to cancel ongoing
  * send / receive operations.
+ *
+ * Since canceled operations and lost links are expected to happen routinely,
+ * the send and receive functions do not throw exceptions for these or other
+ * IO errors. Instead, they report them through io_result.
  */
 class rfcomm_connection
 {
@@ -50,19 +59,42 @@ public:
 	 * This blocks until an error occurs, disconnect() is called, or the connection
 	 * is established.
 	 *
+	 * This must not be called while send() or receive() calls are ongoing,
+	 * since it closes the socket of the previous connection.
+	 *
 	 * @param device_address Bluetooth address of device to connect to.
 	 * @param rfcomm_channel RFCOMM channel to use for the connection. Must be at least 1.
 	 * @throws invalid_call_exception if the connection was already established.
+	 * @throws cancellation_exception if disconnect() aborted the connection attempt.
 	 * @throws io_exception in case of an IO error.
 	 */
 	void connect(bluetooth_address const &device_address, unsigned int rfcomm_channel);
 
+	/**
+	 * Uses an already connected stream socket instead of an RFCOMM connection.
+	 *
+	 * This lets loopback checks and benchmarks exercise send() and receive()
+	 * without Bluetooth hardware (see run_rfcomm_loopback_check() and
+	 * run_rfcomm_cancel_latency_check()). The socket is set up just like
+	 * an RFCOMM socket after connect() established the connection. Once
+	 * this succeeded, the connection owns the socket, and closes it when
+	 * disconnecting. The same restrictions as for connect() apply.
+	 *
+	 * @param socket_fd File descriptor of a connected stream socket.
+	 * @throws invalid_call_exception if the connection was already established.
+	 * @throws io_exception if the socket cannot be set up.
+	 */
+	void attach_connected_socket(int socket_fd);
+
 	/**
 	 * Terminates an existing connection.
 	 *
 	 * It is safe to call this from another thread. Doing so aborts an ongoing
 	 * connect() call. In fact, this is the proper way to cancel the connection
-	 * operation.
+	 * operation. Ongoing send() and receive() calls are aborted as well.
+	 * The socket is only shut down here; it is closed by the next connect()
+	 * call or by the destructor, so concurrent send() and receive() calls
+	 * never access a closed socket.
 	 *
 	 * If there is no connection, this call does nothing.
 	 */
@@ -74,16 +106,28 @@ public:
 	 * This blocks until all of the bytes were sent, cancel_send() was called,
 	 * disconnect() was called, or an error occurs.
 	 *
+	 * If write coalescing is enabled (see rfcomm_flow_control_config), the
+	 * bytes may be written together with the bytes of send() calls made by
+	 * other threads within the coalescing window. This call then also blocks
+	 * until the coalesced write is done. Otherwise, concurrent send() calls
+	 * write their bytes one after the other, in no particular order. Either
+	 * way, only one thread writes to the socket at a time.
+	 *
 	 * @param src Source to get the bytes from. Must be a valid pointer,
 	 *        and the region this points to must contain the specified
 	 *        amount of bytes, otherwise crashes can occur.
 	 * @param num_bytes Number of bytes to send. Must not be zero.
-	 * @throws gerror_exception in case of a GLib/GIO error (including when the
-	 *         operation is canceled due to a disconnect() or cancel_send() call;
-	 *         check if the GError category is G_IO_ERROR and the error ID is
-	 *         G_IO_ERROR_CANCELLED).
+	 * @param bypass_coalescing If true, and write coalescing is enabled, the
+	 *        bytes are written right away (along with any bytes that are
+	 *        already waiting for the coalescing window to elapse) instead
+	 *        of waiting for the coalescing window. Use this for latency
+	 *        critical packets.
+	 * @return Number of bytes sent (always num_bytes), or io_error::canceled
+	 *         if the operation was canceled due to a disconnect() or cancel_send()
+	 *         call, io_error::link_lost if signal_link_lost() was called, and
+	 *         io_error::failed in case of a socket error.
 	 */
-	void send(void const *src, int num_bytes);
+	io_result<int> send(void const *src, int num_bytes, bool bypass_coalescing = false);
 
 	/**
 	 * Receives a sequence of bytes over RFCOMM.
@@ -97,40 +141,168 @@ public:
 	 *        to contain at least num_bytes bytes, otherwise buffer overflow
 	 *        errors can occur.
 	 * @param num_bytes Maximum number of bytes to receive. Must not be zero.
-	 * @return Actual number of bytes received. This is always <= num_bytes.
-	 * @throws gerror_exception in case of a GLib/GIO error (including when the
-	 *         operation is canceled due to a disconnect() or cancel_send() call;
-	 *         check if the GError category is G_IO_ERROR and the error ID is
-	 *         G_IO_ERROR_CANCELLED).
+	 * @return Actual number of bytes received (always <= num_bytes), or
+	 *         io_error::canceled if the operation was canceled due to a
+	 *         disconnect() or cancel_receive() call, io_error::link_lost if
+	 *         signal_link_lost() was called, and io_error::failed in case
+	 *         of a socket error.
 	 */
-	int receive(void *dest, int num_bytes);
+	io_result<int> receive(void *dest, int num_bytes);
 
 	/**
 	 * Cancels any ongoing send operation.
 	 *
-	 * If no send operation is ongoing, this effectively does nothing.
+	 * This cancels all ongoing send() and wait_until_drained() calls,
+	 * including send() calls that wait for their bytes to be written
+	 * together with others. If no send operation is ongoing, the next
+	 * one is canceled instead, like with cancel_receive(). connect()
+	 * discards such a pending cancellation.
 	 */
 	void cancel_send();
 
 	/**
 	 * Cancels any ongoing receive operation.
 	 *
-	 * If no receive operation is ongoing, this effectively does nothing.
+	 * If no receive operation is ongoing, the next receive() call is
+	 * canceled instead. This makes sure that a cancel_receive() call
+	 * that races with the start of a receive() call is not lost.
+	 * connect() discards such a pending cancellation.
 	 */
 	void cancel_receive();
 
+	/**
+	 * Marks the link as lost and aborts ongoing send and receive operations.
+	 *
+	 * Aborted operations, and any later ones, fail with io_error::link_lost
+	 * until the next connect() call. This is called when BlueZ reports
+	 * that the device disconnected, which is much sooner than the kernel
+	 * noticing it at the socket level. It is safe to call this from
+	 * another thread.
+	 */
+	void signal_link_lost();
+
+	/**
+	 * Sets the flow control configuration.
+	 *
+	 * See rfcomm_flow_control_config for details. It is safe to call
+	 * this from another thread.
+	 */
+	void set_flow_control_config(rfcomm_flow_control_config const &config);
+
+	/**
+	 * Returns flow control statistics.
+	 *
+	 * It is safe to call this from another thread.
+	 */
+	rfcomm_flow_control_stats get_flow_control_stats() const;
+
+	/**
+	 * Returns the number of bytes in the socket's send queue that
+	 * were not yet transmitted.
+	 *
+	 * This is measured as described in rfcomm_flow_control_config.
+	 * Like send(), this must not be called while connect() or
+	 * disconnect() run in another thread.
+	 *
+	 * @return Number of outstanding bytes, 0 if not connected, or
+	 *         io_error::failed if the send queue could not be queried.
+	 */
+	io_result<int> get_outstanding_send_bytes() const;
+
+	/**
+	 * Waits until all bytes in the socket's send queue were transmitted.
+	 *
+	 * This blocks until the send queue is empty, the deadline is reached,
+	 * cancel_send() was called, disconnect() was called, or an error occurs.
+	 *
+	 * @param deadline Point in time when to stop waiting.
+	 * @return true if the send queue is empty, false if the deadline was
+	 *         reached before that, io_error::canceled if the wait was canceled
+	 *         due to a disconnect() or cancel_send() call, io_error::link_lost
+	 *         if signal_link_lost() was called, and io_error::failed if the
+	 *         send queue could not be queried.
+	 */
+	io_result<bool> wait_until_drained(std::chrono::steady_clock::time_point deadline);
+
 
 private:
+	// A write that waits to be coalesced with others. These
+	// live on the stack of the send() call that queued them.
+	struct pending_write
+	{
+		void const *m_src;
+		int m_num_bytes;
+		// Value of m_num_reported_send_cancellations when the
+		// send() call started. The write is canceled once
+		// m_num_send_cancellations differs from this.
+		std::uint64_t m_cancel_baseline;
+		bool m_in_flight;
+		bool m_done;
+		io_error m_error;
+		std::string m_error_message;
+	};
+
 	void disconnect_impl(bool is_shutting_down);
+	void release_disconnected_socket();
+	void reset_cancellations();
+	void set_up_socket(int socket_fd);
+	void apply_socket_buffer_sizes(int socket_fd);
+	io_result<bool> wait_for_send_queue(int max_outstanding_bytes, std::chrono::steady_clock::time_point deadline);
+	io_result<bool> pace_send(rfcomm_flow_control_config const &config);
+	io_result<bool> acquire_send_turn(std::unique_lock<std::mutex> &lock, std::uint64_t cancel_baseline, char const *operation_name);
+	void release_send_turn();
+	io_failure report_send_cancellation(char const *operation_name);
+	io_result<int> send_coalesced(std::unique_lock<std::mutex> &lock, pending_write &write, bool bypass_coalescing, rfcomm_flow_control_config const &config);
+	void write_pending_writes(std::unique_lock<std::mutex> &lock, rfcomm_flow_control_config const &config);
+	io_result<int> write_vectors(struct iovec *vectors, int num_vectors, std::size_t num_packets);
+	void record_outstanding_send_bytes(int outstanding_bytes);
 
-	GSocket *m_socket;
-	GCancellable *m_send_cancellable;
-	GCancellable *m_receive_cancellable;
+	// Non-blocking socket file descriptor, or -1 if not connected.
+	// Atomic, since disconnect() may be called from another thread
+	// while send() or receive() are running. disconnect() only shuts
+	// down the socket and moves it to m_disconnected_socket_fd. It is
+	// closed once no send() or receive() call can use it anymore.
+	std::atomic<int> m_socket_fd;
+	std::atomic<int> m_disconnected_socket_fd;
+	cancellable m_send_cancellable;
+	cancellable m_receive_cancellable;
 	std::array<int, 2> m_connect_pipe_fds;
 	std::mutex m_connect_pipe_mutex;
 	std::condition_variable m_connecting_condvar;
 	bool m_is_connecting;
 	bool m_is_shutting_down;
+	std::atomic<bool> m_link_lost;
+
+	// Actual socket send buffer size, or 0 if not connected. This
+	// is needed for measuring the outstanding bytes. It is cached,
+	// since it does not change once the socket is set up, and
+	// querying it on every send() call would cost a syscall.
+	// Atomic for the same reason as m_socket_fd.
+	std::atomic<int> m_send_buffer_size;
+
+	// Guards the flow control configuration and statistics.
+	mutable std::mutex m_flow_control_mutex;
+	rfcomm_flow_control_config m_flow_control_config;
+	rfcomm_flow_control_stats m_flow_control_stats;
+
+	// Guards the send turn, the send cancellation counters, and the
+	// write coalescing states. Only the holder of the send turn uses
+	// the socket and m_send_cancellable on the sending side, which
+	// makes it the only one that may reset m_send_cancellable. All
+	// other calls detect cancellations through the counters instead,
+	// so such a reset cannot make them miss their cancellation.
+	// The vectors with the in-flight writes are only accessed by
+	// the holder of the send turn.
+	std::mutex m_send_mutex;
+	std::condition_variable m_send_condvar;
+	bool m_send_turn_taken;
+	std::uint64_t m_num_send_cancellations;
+	std::uint64_t m_num_reported_send_cancellations;
+	std::vector<pending_write *> m_pending_writes;
+	std::vector<pending_write *> m_in_flight_writes;
+	std::vector<struct iovec> m_coalesced_write_vectors;
+	std::size_t m_num_pending_bytes;
+	bool m_has_urgent_pending_write;
 };
 
 
@@ -1,8 +1,12 @@
 #ifndef COMBOCTL_RFCOMM_LISTENER_HPP
 #define COMBOCTL_RFCOMM_LISTENER_HPP
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+#include "epoll_reactor.hpp"
+#else
 #include <glib.h>
 #include <gio/gio.h>
+#endif
 
 
 namespace comboctl
@@ -19,6 +23,11 @@ namespace comboctl
  * Of particular importance is its ability to pick an unused RFCOMM
  * channel automatically for the SDP service (which needs to have
  * an RFCOMM channel assigned).
+ *
+ * Incoming connections are accepted and closed right away by the
+ * mainloop. With the native D-Bus backend, there is no GLib mainloop
+ * that could dispatch GSocketListener's accept callbacks, so there,
+ * the listener socket is watched by the epoll_reactor instead.
  */
 class rfcomm_listener
 {
@@ -46,6 +55,28 @@ public:
 	rfcomm_listener(rfcomm_listener const &) = delete;
 	rfcomm_listener& operator = (rfcomm_listener const &) = delete;
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	/**
+	 * Starts listening by setting up an RFCOMM listener socket.
+	 *
+	 * Optionally, a specific RFCOMm channel for the listener
+	 * socket to listen to can be used. The default channel is
+	 * the special value 0, which instructs the function to
+	 * pick the next available RFCOMM channel in the system.
+	 * If 0 is used, get_channel() returns the channel that
+	 * was picked (not 0).
+	 *
+	 * @param reactor Reactor that accepts (and closes) incoming
+	 *        connections. Must outlive this listener (or its
+	 *        stop_listening() call), and must not be running
+	 *        while stop_listening() is called from another thread.
+	 * @param rfcomm_channel RFCOMM channel to use for listening,
+	 *        or 0 to automatically pick the next unused one.
+	 * @throws invalid_call_exception if there is already a listening socket.
+	 * @throws io_exception in case of an IO error.
+	 */
+	void listen(epoll_reactor &reactor, unsigned int rfcomm_channel = 0);
+#else
 	/**
 	 * Starts listening by setting up an RFCOMM listener socket.
 	 *
@@ -63,6 +94,7 @@ public:
 	 * @throws gerror_exception in case of a GLib/GIO error.
 	 */
 	void listen(unsigned int rfcomm_channel = 0);
+#endif
 
 	/**
 	 * Stops listening for incoming RFCOMM connections and shuts
@@ -84,10 +116,15 @@ public:
 
 
 private:
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	epoll_reactor *m_reactor;
+	int m_socket_fd;
+#else
 	void close_socket_listener();
 
 	GSocketListener *m_socket_listener;
 	GCancellable *m_socket_listener_accept_cancellable;
+#endif
 
 	unsigned int m_rfcomm_channel;
 };
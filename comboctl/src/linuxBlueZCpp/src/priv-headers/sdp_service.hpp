@@ -2,8 +2,12 @@
 #define COMBOCTL_BLUEZ_SDP_SERVICE_HPP
 
 #include <string>
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+#include "dbus_connection.hpp"
+#else
 #include <glib.h>
 #include <gio/gio.h>
+#endif
 
 
 namespace comboctl
@@ -20,6 +24,9 @@ namespace comboctl
  * An RFCOMM listener channel number is required for valid
  * SerialPort services. The rfcomm_listener class is used
  * for establishing such a listener.
+ *
+ * The D-Bus specific parts are in sdp_service_glib.cpp and
+ * sdp_service_native_dbus.cpp; sdp_service.cpp contains the rest.
  */
 class sdp_service
 {
@@ -39,6 +46,33 @@ public:
 	 */
 	~sdp_service();
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	/**
+	 * Sets up the SDP service record and subscribes this object to D-Bus.
+	 *
+	 * Once the SDP service record is set up, the Combo can find
+	 * this platform while it scans for Bluetooth devices.
+	 *
+	 * This sets up a service record of the SerialPort class. This
+	 * class requires an RFCOMM channel number. To have a valid
+	 * RFCOMM channel, use the rfcomm_listener class.
+	 *
+	 * @param dbus_connection D-Bus connection to use. Must not be null.
+	 *        Must outlive this object (or its teardown() call).
+	 * @param service_name Name the SDP service record shall use.
+	 *        Must not be empty.
+	 * @param service_provider Name of the provider that shall be added
+	 *        to this service record. Must not be empty.
+	 * @param service_description Additional human-readable description of
+	 *        the service. Will be added to the record. Must not be empty.
+	 * @param rfcomm_channel RFCOMM channel number to add to this SerialPort
+	 *        SDP service record. Must not be 0.
+	 * @throws invalid_call_exception if this SDP service record is already
+	 *         set up.
+	 * @throws dbus_error_exception if a D-Bus call fails.
+	 */
+	void setup(dbus_connection *dbus_connection, std::string service_name, std::string service_provider, std::string service_description, unsigned int rfcomm_channel);
+#else
 	/**
 	 * Sets up the SDP service record and subscribes this object to D-Bus.
 	 *
@@ -58,21 +92,39 @@ public:
 	 *        the service. Will be added to the record. Must not be empty.
 	 * @param rfcomm_channel RFCOMM channel number to add to this SerialPort
 	 *        SDP service record. Must not be 0.
+	 * @param cancellable GCancellable to pass to blocking D-Bus calls.
+	 *        Cancelling it makes ongoing calls return immediately.
+	 *        Can be null. Must outlive this object.
 	 * @throws invalid_call_exception if this SDP service record is already
 	 *         set up.
 	 */
-	void setup(GDBusConnection *dbus_connection, std::string service_name, std::string service_provider, std::string service_description, unsigned int rfcomm_channel);
+	void setup(GDBusConnection *dbus_connection, std::string service_name, std::string service_provider, std::string service_description, unsigned int rfcomm_channel, GCancellable *cancellable);
+#endif
 
 	/**
 	 * Tears down the SDP service record, and unsubscribes this object from D-Bus.
+	 *
+	 * The UnregisterProfile call is sent without waiting for a reply,
+	 * so this does not block even if BlueZ is unresponsive.
 	 */
 	void teardown();
 
 
 private:
+	static constexpr char const *profile_path = "/io/bluetooth/comboctl/sdpProfile";
+	static constexpr char const *serial_port_profile_uuid_str = "00001101-0000-1000-8000-00805f9b34fb";
+
+	static std::string build_service_record_xml(std::string const &service_name, std::string const &service_provider, std::string const &service_description, unsigned int rfcomm_channel);
+
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+	dbus_connection *m_dbus_connection;
+	bool m_profile_object_registered;
+#else
 	GDBusConnection *m_dbus_connection;
+	GCancellable *m_cancellable;
 	GDBusProxy *m_profile_manager_proxy;
 	guint m_profile_object_id;
+#endif
 	bool m_profile_registered;
 };
 
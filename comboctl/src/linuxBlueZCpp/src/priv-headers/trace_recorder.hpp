@@ -0,0 +1,163 @@
+#ifndef COMBOCTL_TRACE_RECORDER_HPP
+#define COMBOCTL_TRACE_RECORDER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace comboctl
+{
+
+
+struct thread_trace_buffer;
+
+
+/**
+ * Process-wide recorder for timing spans.
+ *
+ * Spans are stored in per-thread ring buffers. Recording a span
+ * does not lock any mutex; only the very first span of a thread
+ * briefly locks the registry mutex to register that thread's
+ * buffer. If a ring buffer is full, the oldest spans in it are
+ * overwritten.
+ *
+ * Recording is disabled by default. While it is disabled, add_span()
+ * returns right away, and no per-thread buffers are allocated.
+ *
+ * The recorded spans can be exported in the Chrome trace event
+ * JSON format, which can be loaded by chrome://tracing and by
+ * the Perfetto UI (https://ui.perfetto.dev).
+ *
+ * Timestamps are taken from std::chrono::steady_clock, which on
+ * Linux uses CLOCK_MONOTONIC. This is the same clock as the one
+ * used by the JVM's System.nanoTime(), so spans recorded by the
+ * Kotlin code fit into the same timeline.
+ */
+class trace_recorder
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	/// Maximum length of span names and categories, excluding the null terminator.
+	/// Longer strings are truncated.
+	static constexpr std::size_t max_name_length = 47;
+	static constexpr std::size_t max_category_length = 15;
+
+	/// Number of spans each per-thread ring buffer can hold.
+	static constexpr std::size_t num_spans_per_thread = 1024;
+
+	/**
+	 * Returns the process-wide trace recorder instance.
+	 */
+	static trace_recorder& instance();
+
+	/**
+	 * Enables or disables recording.
+	 *
+	 * Disabling recording does not discard already recorded spans.
+	 */
+	void set_enabled(bool enabled);
+
+	bool is_enabled() const
+	{
+		return m_enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Records a span in the calling thread's ring buffer.
+	 *
+	 * Does nothing if recording is disabled.
+	 *
+	 * @param category Category of the span, like "io". Must not be null.
+	 * @param name Name of the span. Must not be null.
+	 * @param start_timestamp_ns Timestamp of the span's beginning, in nanoseconds,
+	 *        based on the CLOCK_MONOTONIC clock.
+	 * @param duration_ns Duration of the span, in nanoseconds.
+	 */
+	void add_span(char const *category, char const *name, std::int64_t start_timestamp_ns, std::int64_t duration_ns);
+
+	/**
+	 * Discards all spans recorded so far.
+	 *
+	 * This does not actually touch the ring buffers (which are owned
+	 * by their threads). Instead, spans that began before this call
+	 * are skipped when exporting.
+	 */
+	void clear();
+
+	/**
+	 * Exports all recorded spans in the Chrome trace event JSON format.
+	 *
+	 * This can be called while other threads are recording spans.
+	 * Spans that are overwritten during the export are skipped.
+	 */
+	std::string export_chrome_trace_json() const;
+
+	/**
+	 * Converts a clock time point to a nanosecond timestamp for add_span().
+	 */
+	static std::int64_t to_timestamp_ns(clock::time_point time_point)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time_point.time_since_epoch()).count();
+	}
+
+
+private:
+	trace_recorder();
+
+	thread_trace_buffer* get_thread_buffer();
+
+	std::atomic<bool> m_enabled;
+	std::atomic<std::int64_t> m_cleared_at_timestamp_ns;
+
+	mutable std::mutex m_registry_mutex;
+	std::vector<std::shared_ptr<thread_trace_buffer>> m_thread_buffers;
+};
+
+
+/**
+ * RAII helper for recording a span that covers a scope.
+ *
+ * The category and name strings must stay valid until
+ * this object is destroyed. If recording is disabled at
+ * construction time, this does not read the clock at all.
+ */
+class scoped_trace_span
+{
+public:
+	scoped_trace_span(char const *category, char const *name)
+		: m_category(category)
+		, m_name(name)
+		, m_start_timestamp_ns(trace_recorder::instance().is_enabled() ? trace_recorder::to_timestamp_ns(trace_recorder::clock::now()) : -1)
+	{
+	}
+
+	~scoped_trace_span()
+	{
+		if (m_start_timestamp_ns < 0)
+			return;
+
+		std::int64_t end_timestamp_ns = trace_recorder::to_timestamp_ns(trace_recorder::clock::now());
+		trace_recorder::instance().add_span(m_category, m_name, m_start_timestamp_ns, end_timestamp_ns - m_start_timestamp_ns);
+	}
+
+	scoped_trace_span(scoped_trace_span const &) = delete;
+	scoped_trace_span& operator = (scoped_trace_span const &) = delete;
+
+
+private:
+	char const *m_category;
+	char const *m_name;
+	std::int64_t m_start_timestamp_ns;
+};
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_TRACE_RECORDER_HPP
@@ -2,15 +2,21 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <poll.h>
 #include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include "scope_guard.hpp"
 #include "rfcomm_connection.hpp"
+#include "allocation_tracking.hpp"
 #include "exception.hpp"
-#include "gerror_exception.hpp"
 #include "bluez_misc.hpp"
+#include "tracepoints.hpp"
+#include "trace_recorder.hpp"
 #include "log.hpp"
 
 
@@ -37,18 +43,149 @@ void set_fd_blocking(int fd, bool blocking)
 }
 
 
+// Emits the rfcomm_connect_begin and rfcomm_connect_end tracepoints.
+// The end tracepoint is emitted by the destructor, so it is also
+// emitted if connect() exits early or throws an exception.
+class connect_tracepoint_scope
+{
+public:
+	explicit connect_tracepoint_scope(unsigned int rfcomm_channel)
+		: m_rfcomm_channel(rfcomm_channel)
+		, m_succeeded(false)
+	{
+		COMBOCTL_TRACEPOINT(rfcomm_connect_begin, m_rfcomm_channel);
+	}
+
+	~connect_tracepoint_scope()
+	{
+		COMBOCTL_TRACEPOINT(rfcomm_connect_end, m_rfcomm_channel, m_succeeded ? 0 : -1);
+	}
+
+	void mark_as_succeeded()
+	{
+		m_succeeded = true;
+	}
+
+private:
+	unsigned int m_rfcomm_channel;
+	bool m_succeeded;
+};
+
+
+// Emits the rfcomm_send_begin and rfcomm_send_end tracepoints. Like
+// connect_tracepoint_scope, the end tracepoint is emitted by the
+// destructor. It reports -1 unless set_num_bytes() was called.
+class send_tracepoint_scope
+{
+public:
+	explicit send_tracepoint_scope(int num_bytes)
+		: m_num_bytes(-1)
+	{
+		COMBOCTL_TRACEPOINT(rfcomm_send_begin, num_bytes);
+	}
+
+	~send_tracepoint_scope()
+	{
+		COMBOCTL_TRACEPOINT(rfcomm_send_end, m_num_bytes);
+	}
+
+	void set_num_bytes(int num_bytes)
+	{
+		m_num_bytes = num_bytes;
+	}
+
+private:
+	int m_num_bytes;
+};
+
+
+// Receive counterpart of send_tracepoint_scope.
+class receive_tracepoint_scope
+{
+public:
+	explicit receive_tracepoint_scope(int max_num_bytes)
+		: m_num_bytes(-1)
+	{
+		COMBOCTL_TRACEPOINT(rfcomm_receive_begin, max_num_bytes);
+	}
+
+	~receive_tracepoint_scope()
+	{
+		COMBOCTL_TRACEPOINT(rfcomm_receive_end, m_num_bytes);
+	}
+
+	void set_num_bytes(int num_bytes)
+	{
+		m_num_bytes = num_bytes;
+	}
+
+private:
+	int m_num_bytes;
+};
+
+
+// How often the send queue is checked while waiting for it to drain.
+// The kernel does not notify about the send queue shrinking below
+// an arbitrary level, so it has to be polled.
+constexpr std::chrono::milliseconds send_queue_poll_interval(5);
+
+
+int get_socket_buffer_size(int fd, int option)
+{
+	int size = 0;
+	socklen_t size_len = sizeof(size);
+
+	if (getsockopt(fd, SOL_SOCKET, option, &size, &size_len) < 0)
+		throw io_exception(fmt::format("Could not get socket buffer size: {} ({})", std::strerror(errno), errno));
+
+	return size;
+}
+
+
+io_failure to_errno_failure(int error_number)
+{
+	return io_failure{ io_error::failed, fmt::format("{} ({})", std::strerror(error_number), error_number) };
+}
+
+
+// Waits until the non-blocking socket is ready for the given poll()
+// events, or until the cancellable is canceled. Returns false in the
+// latter case. Socket errors are not reported here; the send or
+// receive call that follows the wakeup reports them.
+io_result<bool> wait_for_socket(int socket_fd, short events, cancellable const &op_cancellable)
+{
+	std::array<struct pollfd, 2> pfds = {};
+	pfds[0].fd = socket_fd;
+	pfds[0].events = events;
+	pfds[1].fd = op_cancellable.get_fd();
+	pfds[1].events = POLLIN;
+
+	while (poll(&pfds[0], pfds.size(), -1) < 0)
+	{
+		if (errno != EINTR)
+			return to_errno_failure(errno);
+	}
+
+	return !(pfds[1].revents & POLLIN);
+}
+
+
 } // unnamed namespace end
 
 
 rfcomm_connection::rfcomm_connection()
-	: m_socket(nullptr)
+	: m_socket_fd(-1)
+	, m_disconnected_socket_fd(-1)
 	, m_is_connecting(false)
 	, m_is_shutting_down(false)
+	, m_link_lost(false)
+	, m_send_buffer_size(0)
+	, m_send_turn_taken(false)
+	, m_num_send_cancellations(0)
+	, m_num_reported_send_cancellations(0)
+	, m_num_pending_bytes(0)
+	, m_has_urgent_pending_write(false)
 {
-	// GLib cancellables so we can abort send/receive attempts later.
-	m_send_cancellable = g_cancellable_new();
-	m_receive_cancellable = g_cancellable_new();
-
 	// We create a POSIX pipe to be able to use the self-pipe trick
 	// in the connect() function. See the comments there for more.
 	int posix_ret = pipe(&m_connect_pipe_fds[0]);
@@ -73,8 +210,9 @@ rfcomm_connection::~rfcomm_connection()
 	// we can set the m_is_shutting_down flag in a thread safe manner.
 	disconnect_impl(true);
 
-	g_object_unref(G_OBJECT(m_send_cancellable));
-	g_object_unref(G_OBJECT(m_receive_cancellable));
+	// No send or receive call can be ongoing anymore at this point,
+	// so the socket that disconnect_impl() shut down can be freed.
+	release_disconnected_socket();
 
 	::close(m_connect_pipe_fds[0]);
 	::close(m_connect_pipe_fds[1]);
@@ -83,13 +221,8 @@ rfcomm_connection::~rfcomm_connection()
 
 void rfcomm_connection::connect(bluetooth_address const &bt_address, unsigned int rfcomm_channel)
 {
-	// In here, we first set up the RFCOMM socket directly via
-	// POSIX functions, then we hand over the POSIX file descriptor
-	// to a GLib GSocket. Currently, GLib has no functions for
-	// setting up an RFCOMM socket, so we have to do this on our
-	// own. And, due to this fact, we also have to implement
-	// a custom way to be able to cancel a connect attempt, since
-	// GCancellable only works with GLib. To that end, we use
+	// In here, we set up the RFCOMM socket directly via POSIX
+	// functions. To be able to cancel a connect attempt, we use
 	// a POSIX pipe (created in the constructor), together with
 	// a poll() call. The poll() call wakes up in one of these
 	// cases:
@@ -120,19 +253,31 @@ void rfcomm_connection::connect(bluetooth_address const &bt_address, unsigned in
 	// process happens in the background (since it is not
 	// supposed to block). poll() then gets notified once the
 	// connection process finished, or an error occurred.
+	// The socket stays in non-blocking mode afterwards, since
+	// send() and receive() wait with poll() as well.
 
 
-	GError *gerror = nullptr;
-	GSocket *rfcomm_gsocket = nullptr;
 	int socket_fd = -1;
 
 
 	assert(rfcomm_channel >= 1);
 
 
-	if (m_socket != nullptr)
+	connect_tracepoint_scope tracepoint_scope(rfcomm_channel);
+
+
+	if (m_socket_fd >= 0)
 		throw invalid_call_exception("Connection already established");
 
+	m_link_lost = false;
+
+	// Close the socket of the previous connection. send() and receive()
+	// must not be called concurrently with connect(), so they cannot
+	// be using that socket anymore.
+	release_disconnected_socket();
+
+	reset_cancellations();
+
 
 	LOG(debug, "Attempting to open RFCOMM connection to device {} on channel {}", to_string(bt_address), rfcomm_channel);
 
@@ -150,14 +295,6 @@ void rfcomm_connection::connect(bluetooth_address const &bt_address, unsigned in
 		}
 	});
 
-	auto rfcomm_gsocket_guard = make_scope_guard([&]() {
-		if (rfcomm_gsocket != nullptr)
-		{
-			g_object_unref(G_OBJECT(rfcomm_gsocket));
-			rfcomm_gsocket = nullptr;
-		}
-	});
-
 
 	// We must surround the rest of this function's code with
 	// a mutex to make sure it cannot run at the same time
@@ -271,6 +408,11 @@ void rfcomm_connection::connect(bluetooth_address const &bt_address, unsigned in
 	if (socket_fd < 0)
 		throw io_exception(fmt::format("Could not create RFCOMM socket: {} ({})", std::strerror(errno), errno));
 
+	// The buffer sizes have to be set before connecting,
+	// since the kernel sizes the RFCOMM link's buffers
+	// based on them when the connection is established.
+	apply_socket_buffer_sizes(socket_fd);
+
 	// Copy the Bluetooth address bytes into the bdaddr_t structure
 	// that is used in the sockaddr_rc structure. Note that bdaddr_t
 	// stores the bytes in opposite order.
@@ -365,14 +507,14 @@ void rfcomm_connection::connect(bluetooth_address const &bt_address, unsigned in
 	if (pfds[0].revents & (POLLIN | POLLERR))
 	{
 		// A dummy message was received through the pipe. This implies
-		// that disconnect() was called. Abort with a gerror_exception
-		// exception informing the caller that this operation was cancelled.
+		// that disconnect() was called. Abort with a cancellation_exception
+		// informing the caller that this operation was cancelled.
 
 		char dummy_buf[1024];
 		::read(pfds[0].fd, dummy_buf, sizeof(dummy_buf));
 
 		LOG(debug, "Aborting connection attempt due to it being cancelled by disconnect call");
-		throw gerror_exception(g_error_new(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Connection attempt aborted by disconnect call"));
+		throw cancellation_exception("Connection attempt aborted by disconnect call");
 	}
 
 	if (pfds[1].revents & POLLOUT)
@@ -411,28 +553,42 @@ void rfcomm_connection::connect(bluetooth_address const &bt_address, unsigned in
 		LOG(trace, "Connection established");
 	}
 
-	// We can enable blocking mode again (we only need
-	// non-blocking mode for the connection attempt).
-	set_fd_blocking(socket_fd, true);
-
-	// We set up the file descriptor. Now we can hand it over to GLib.
-	rfcomm_gsocket = g_socket_new_from_fd(socket_fd, &gerror);
-	if (rfcomm_gsocket == nullptr)
-	{
-		LOG(error, "Could not create RFCOMM GSocket: {}", gerror->message);
-		throw gerror_exception(gerror);
-	}
+	set_up_socket(socket_fd);
 
-	// We are done. Dismiss the guards.
+	// We are done. Dismiss the guard.
 	rfcomm_fd_guard.dismiss();
-	rfcomm_gsocket_guard.dismiss();
 
-	m_socket = rfcomm_gsocket;
+	m_socket_fd = socket_fd;
+
+	tracepoint_scope.mark_as_succeeded();
 
 	LOG(info, "Opened RFCOMM connection to device {} on channel {}", to_string(bt_address), rfcomm_channel);
 }
 
 
+void rfcomm_connection::attach_connected_socket(int socket_fd)
+{
+	assert(socket_fd >= 0);
+
+	if (m_socket_fd >= 0)
+		throw invalid_call_exception("Connection already established");
+
+	m_link_lost = false;
+
+	// See connect() for why these are done here.
+	release_disconnected_socket();
+	reset_cancellations();
+
+	apply_socket_buffer_sizes(socket_fd);
+	set_fd_blocking(socket_fd, false);
+
+	set_up_socket(socket_fd);
+	m_socket_fd = socket_fd;
+
+	LOG(info, "Attached connected socket (fd {})", socket_fd);
+}
+
+
 void rfcomm_connection::disconnect()
 {
 	disconnect_impl(false);
@@ -445,17 +601,46 @@ void rfcomm_connection::disconnect_impl(bool is_shutting_down)
 
 	LOG(trace, "Disconnecting RFCOMM connection");
 
+	auto begin_timestamp = std::chrono::steady_clock::now();
+
+	// The send and receive operations, the socket teardown, and
+	// the connect attempt are all aborted first, and only then
+	// do we wait for the connect attempt to finish aborting.
+	// That way, these run in parallel instead of one after the
+	// other, and the overall disconnect duration is bounded by
+	// the slowest one of them, not by their sum.
+
 	LOG(trace, "Canceling any ongoing send operation");
-	g_cancellable_cancel(m_send_cancellable);
+	cancel_send();
 
 	LOG(trace, "Canceling any ongoing receive operation");
-	g_cancellable_cancel(m_receive_cancellable);
-
-	if (m_socket != nullptr)
+	m_receive_cancellable.cancel();
+
+	// Only shut the socket down here, and do not close it yet. Another
+	// thread may be inside send() or receive() right now, and still be
+	// using the socket. Shutting it down immediately wakes up these
+	// calls if they did not react to the cancellables yet, and lets the
+	// kernel start the RFCOMM disconnect right away. Closing it here
+	// could let a new socket reuse its file descriptor number while
+	// these calls still use it. The socket is closed by the next
+	// connect() call or by the destructor, since at that point, no
+	// send() or receive() call can be ongoing anymore.
+	int socket_fd = m_socket_fd.exchange(-1);
+	if (socket_fd >= 0)
 	{
-		LOG(trace, "Tearing down socket");
-		g_object_unref(G_OBJECT(m_socket));
-		m_socket = nullptr;
+		LOG(trace, "Shutting down socket");
+		::shutdown(socket_fd, SHUT_RDWR);
+
+		int previous_socket_fd = m_disconnected_socket_fd.exchange(socket_fd);
+		if (previous_socket_fd >= 0)
+			::close(previous_socket_fd);
+
+		m_send_buffer_size = 0;
+
+		std::lock_guard<std::mutex> flow_control_lock(m_flow_control_mutex);
+		m_flow_control_stats.m_send_buffer_size = 0;
+		m_flow_control_stats.m_receive_buffer_size = 0;
+		m_flow_control_stats.m_outstanding_send_bytes = 0;
 	}
  
  	LOG(trace, "Aborting any ongoing connect attempt");
@@ -502,102 +687,702 @@ void rfcomm_connection::disconnect_impl(bool is_shutting_down)
 	while (m_is_connecting)
 		m_connecting_condvar.wait(lock);
 
- 	LOG(trace, "RFCOMM connection disconnected");
+	LOG(
+		debug,
+		"RFCOMM connection disconnected after {} us",
+		std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin_timestamp).count()
+	);
 }
 
 
-void rfcomm_connection::send(void const *src, int num_bytes)
+io_result<int> rfcomm_connection::send(void const *src, int num_bytes, bool bypass_coalescing)
 {
 	assert(src != nullptr);
 	assert(num_bytes > 0);
 
-	GError *gerror = nullptr;
-
-	int remaining_bytes_to_send = num_bytes;
+	send_tracepoint_scope tracepoint_scope(num_bytes);
+	scoped_trace_span trace_span("io", "rfcomm send");
+	no_allocation_scope allocation_scope("rfcomm send");
 
-	// Reset the cancellable in case cancel_send() was called earlier.
-	g_cancellable_reset(m_send_cancellable);
+	// signal_link_lost() may have been called before
+	// this send() call started, so check for that first.
+	if (m_link_lost)
+		return io_failure{ io_error::link_lost, {} };
 
-	do
+	rfcomm_flow_control_config config;
 	{
-		gchar const *src_bytes = reinterpret_cast<gchar const *>(src) + (num_bytes - remaining_bytes_to_send);
+		std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+		config = m_flow_control_config;
+	}
 
-		gssize num_bytes_sent = g_socket_send(
-			m_socket,
-			src_bytes,
-			remaining_bytes_to_send,
-			m_send_cancellable,
-			&gerror
-		);
-		if (num_bytes_sent < 0)
-		{
-			if (g_error_matches(gerror, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-			{
-				LOG(debug, "Send canceled");
-				throw gerror_exception(gerror);
-			}
-			else
-			{
-				LOG(error, "Could not send {} byte(s): {}", num_bytes, gerror->message);
-				throw gerror_exception(gerror);
-			}
-		}
+	std::unique_lock<std::mutex> lock(m_send_mutex);
 
-		assert(num_bytes_sent <= remaining_bytes_to_send);
-		remaining_bytes_to_send -= num_bytes_sent;
+	// Like in receive(), the cancellable is not reset here, so
+	// a cancel_send() call that happens right before this send()
+	// call cancels it instead of getting lost. Since send() calls
+	// can wait for each other, the cancellable alone cannot tell
+	// which calls a cancellation was meant for. This is why
+	// cancel_send() also counts cancellations: This call is
+	// canceled by all of them that were not yet reported when
+	// it started, and by all that happen afterwards.
+	pending_write write = { src, num_bytes, m_num_reported_send_cancellations, false, false, io_error::none, {} };
 
-		LOG(trace, "Sent {} byte(s); remaining: {}", num_bytes_sent, remaining_bytes_to_send);
+	auto result = [&]() -> io_result<int> {
+		// This releases the lock before returning.
+		if (config.m_coalescing_window.count() > 0)
+			return send_coalesced(lock, write, bypass_coalescing, config);
+
+		auto turn_result = acquire_send_turn(lock, write.m_cancel_baseline, "Send");
+		if (!turn_result)
+			return io_failure{ turn_result.error(), turn_result.error_message() };
+
+		lock.unlock();
+		auto send_turn_guard = make_scope_guard([&]() { release_send_turn(); });
+
+		auto pacing_result = pace_send(config);
+		if (!pacing_result)
+			return io_failure{ pacing_result.error(), pacing_result.error_message() };
+
+		struct iovec vector = { const_cast<void *>(src), std::size_t(num_bytes) };
+		return write_vectors(&vector, 1, 1);
+	}();
+
+	if (!result)
+		return result;
+
+	tracepoint_scope.set_num_bytes(num_bytes);
+
+	// Querying the send queue costs an ioctl() call, so only do
+	// this if requested. If the query fails, only log that, since
+	// the bytes were sent, and the send() call therefore succeeded.
+	if (config.m_track_send_queue)
+	{
+		auto outstanding_bytes = get_outstanding_send_bytes();
+		if (outstanding_bytes)
+			record_outstanding_send_bytes(outstanding_bytes.value());
+		else
+			LOG(debug, "Could not record outstanding send bytes: {}", outstanding_bytes.error_message());
 	}
-	while (remaining_bytes_to_send > 0);
+
+	return num_bytes;
 }
 
 
-int rfcomm_connection::receive(void *dest, int num_bytes)
+io_result<int> rfcomm_connection::receive(void *dest, int num_bytes)
 {
 	assert(dest != nullptr);
 	assert(num_bytes > 0);
 
-	GError *gerror = nullptr;
+	// See write_vectors() for why the socket is loaded only once.
+	int socket_fd = m_socket_fd.load();
+	if (socket_fd < 0)
+		return io_failure{ io_error::failed, "RFCOMM connection is not established" };
 
-	// Reset the cancellable in case cancel_receive() was called earlier.
-	g_cancellable_reset(m_receive_cancellable);
+	receive_tracepoint_scope tracepoint_scope(num_bytes);
+	scoped_trace_span trace_span("io", "rfcomm receive");
+	no_allocation_scope allocation_scope("rfcomm receive");
 
-	gssize num_bytes_received = g_socket_receive(
-		m_socket,
-		reinterpret_cast<gchar *>(dest),
-		num_bytes,
-		m_receive_cancellable,
-		&gerror
-	);
-	if (num_bytes_received < 0)
+	// The cancellable is not reset here. A cancel_receive() call
+	// that happens right before this receive() call therefore
+	// cancels it instead of getting lost. The cancellable is
+	// reset below, once a receive() call reported the cancellation.
+	if (m_link_lost)
+		return io_failure{ io_error::link_lost, {} };
+
+	ssize_t num_bytes_received;
+
+	while (true)
 	{
-		if (g_error_matches(gerror, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		if (m_receive_cancellable.is_canceled())
 		{
+			// signal_link_lost() aborts operations by canceling them,
+			// so a cancellation means a lost link if that flag is set.
+			if (m_link_lost)
+			{
+				LOG(debug, "Receive aborted because the Bluetooth link was lost");
+				return io_failure{ io_error::link_lost, {} };
+			}
+
 			LOG(debug, "Receive canceled");
-			throw gerror_exception(gerror);
+			m_receive_cancellable.reset();
+			return io_failure{ io_error::canceled, {} };
 		}
+
+		num_bytes_received = ::recv(socket_fd, dest, num_bytes, 0);
+		if (num_bytes_received > 0)
+			break;
+
+		// disconnect() cancels the cancellable before it shuts down
+		// the socket. If the shutdown is what ended this call, the
+		// check above therefore reports a cancellation instead of
+		// an end-of-stream or a socket error.
+		if (m_receive_cancellable.is_canceled())
+			continue;
+
+		if (num_bytes_received == 0)
+			break;
+
+		if (errno == EINTR)
+			continue;
+
+		io_result<bool> wait_result = true;
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			wait_result = wait_for_socket(socket_fd, POLLIN, m_receive_cancellable);
 		else
+			wait_result = to_errno_failure(errno);
+
+		if (!wait_result)
 		{
-			LOG(error, "Could not receive {} byte(s): {}", num_bytes, gerror->message);
-			throw gerror_exception(gerror);
+			LOG(error, "Could not receive {} byte(s): {}", num_bytes, wait_result.error_message());
+			return io_failure{ wait_result.error(), wait_result.error_message() };
 		}
+
+		// If the wait was canceled, the check at the beginning
+		// of the loop reports that.
 	}
 
+	tracepoint_scope.set_num_bytes(int(num_bytes_received));
+
 	LOG(trace, "Received {} byte(s); requested: max {}", num_bytes_received, num_bytes);
 
-	return num_bytes_received;
+	return int(num_bytes_received);
+}
+
+
+void rfcomm_connection::release_disconnected_socket()
+{
+	int socket_fd = m_disconnected_socket_fd.exchange(-1);
+	if (socket_fd >= 0)
+		::close(socket_fd);
+}
+
+
+void rfcomm_connection::reset_cancellations()
+{
+	// Clear cancellations left over from the previous connection.
+	// disconnect() cancels the cancellables, and send() and receive()
+	// only reset them if a call reported the cancellation.
+	{
+		std::lock_guard<std::mutex> lock(m_send_mutex);
+		m_num_reported_send_cancellations = m_num_send_cancellations;
+		m_send_cancellable.reset();
+	}
+	m_receive_cancellable.reset();
+}
+
+
+void rfcomm_connection::set_up_socket(int socket_fd)
+{
+	// Record the buffer sizes the kernel actually uses. These
+	// can differ from the configured ones; see rfcomm_flow_control_stats.
+	{
+		std::lock_guard<std::mutex> flow_control_lock(m_flow_control_mutex);
+		m_send_buffer_size = get_socket_buffer_size(socket_fd, SO_SNDBUF);
+		m_flow_control_stats.m_send_buffer_size = m_send_buffer_size;
+		m_flow_control_stats.m_receive_buffer_size = get_socket_buffer_size(socket_fd, SO_RCVBUF);
+		m_flow_control_stats.m_outstanding_send_bytes = 0;
+		LOG(
+			debug,
+			"Socket send buffer size: {} byte(s); receive buffer size: {} byte(s)",
+			m_flow_control_stats.m_send_buffer_size,
+			m_flow_control_stats.m_receive_buffer_size
+		);
+	}
 }
 
 
 void rfcomm_connection::cancel_send()
 {
-	g_cancellable_cancel(m_send_cancellable);
+	// Count the cancellation and cancel the cancellable while
+	// holding the lock. That way, the holder of the send turn
+	// cannot reset the cancellable between these two steps.
+	std::lock_guard<std::mutex> lock(m_send_mutex);
+	m_num_send_cancellations++;
+	m_send_cancellable.cancel();
+	// Wake up send() calls that wait for the send turn
+	// or for their coalesced write, so they can see this.
+	m_send_condvar.notify_all();
 }
 
 
 void rfcomm_connection::cancel_receive()
 {
-	g_cancellable_cancel(m_receive_cancellable);
+	m_receive_cancellable.cancel();
+}
+
+
+void rfcomm_connection::signal_link_lost()
+{
+	LOG(info, "Bluetooth link lost; aborting send and receive operations");
+
+	// Set the flag before cancelling, so the aborted
+	// operations see it when they wake up.
+	m_link_lost = true;
+	cancel_send();
+	m_receive_cancellable.cancel();
+}
+
+
+void rfcomm_connection::set_flow_control_config(rfcomm_flow_control_config const &config)
+{
+	assert(config.m_send_buffer_size >= 0);
+	assert(config.m_receive_buffer_size >= 0);
+	assert(config.m_pacing_threshold >= 0);
+	assert(config.m_coalescing_window.count() >= 0);
+
+	std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+	m_flow_control_config = config;
+}
+
+
+rfcomm_flow_control_stats rfcomm_connection::get_flow_control_stats() const
+{
+	std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+	return m_flow_control_stats;
+}
+
+
+io_result<int> rfcomm_connection::get_outstanding_send_bytes() const
+{
+	// See write_vectors() for why the socket is loaded only once.
+	int socket_fd = m_socket_fd.load();
+	if (socket_fd < 0)
+		return 0;
+
+	// With Bluetooth sockets, TIOCOUTQ does not report the number of
+	// bytes in the send queue like it does with TCP sockets. Instead,
+	// it reports how much space is left in the send buffer (see
+	// bt_sock_ioctl() in the kernel's net/bluetooth/af_bluetooth.c).
+	// The outstanding bytes are therefore the difference between
+	// the send buffer size and that value.
+	int free_send_buffer_space = 0;
+	if (ioctl(socket_fd, TIOCOUTQ, &free_send_buffer_space) < 0)
+		return io_failure{ io_error::failed, fmt::format("Could not query socket send queue: {} ({})", std::strerror(errno), errno) };
+
+	return std::max(m_send_buffer_size - free_send_buffer_space, 0);
+}
+
+
+io_result<bool> rfcomm_connection::wait_until_drained(std::chrono::steady_clock::time_point deadline)
+{
+	scoped_trace_span trace_span("io", "rfcomm wait until drained");
+
+	if (m_link_lost)
+		return io_failure{ io_error::link_lost, {} };
+
+	// See send() for how cancellations are detected. Waiting
+	// for the send turn makes sure that this does not return
+	// while a send() call is still writing to the socket.
+	{
+		std::unique_lock<std::mutex> lock(m_send_mutex);
+		auto turn_result = acquire_send_turn(lock, m_num_reported_send_cancellations, "Wait for send queue");
+		if (!turn_result)
+			return turn_result;
+	}
+	auto send_turn_guard = make_scope_guard([&]() { release_send_turn(); });
+
+	auto result = wait_for_send_queue(0, deadline);
+	if (result && !result.value())
+		LOG(debug, "Send queue did not drain before the deadline");
+
+	return result;
+}
+
+
+void rfcomm_connection::apply_socket_buffer_sizes(int socket_fd)
+{
+	rfcomm_flow_control_config config;
+	{
+		std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+		config = m_flow_control_config;
+	}
+
+	// Failing to set a buffer size is not fatal, since
+	// the connection still works with the default sizes.
+
+	if (config.m_send_buffer_size > 0)
+	{
+		if (setsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &config.m_send_buffer_size, sizeof(config.m_send_buffer_size)) < 0)
+			LOG(warn, "Could not set socket send buffer size to {} byte(s): {} ({})", config.m_send_buffer_size, std::strerror(errno), errno);
+	}
+
+	if (config.m_receive_buffer_size > 0)
+	{
+		if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &config.m_receive_buffer_size, sizeof(config.m_receive_buffer_size)) < 0)
+			LOG(warn, "Could not set socket receive buffer size to {} byte(s): {} ({})", config.m_receive_buffer_size, std::strerror(errno), errno);
+	}
+}
+
+
+io_result<bool> rfcomm_connection::wait_for_send_queue(int max_outstanding_bytes, std::chrono::steady_clock::time_point deadline)
+{
+	// The cancellable's file descriptor is polled instead of just
+	// sleeping between the checks, so that cancel_send(), disconnect()
+	// and signal_link_lost() wake up this wait right away.
+	struct pollfd cancellable_pfd = {};
+	cancellable_pfd.fd = m_send_cancellable.get_fd();
+	cancellable_pfd.events = POLLIN;
+
+	while (true)
+	{
+		// This is only called by the holder of the send turn, so
+		// the cancellable is only canceled if this wait was canceled.
+		if (m_send_cancellable.is_canceled())
+			return report_send_cancellation("Wait for send queue");
+
+		auto outstanding_bytes = get_outstanding_send_bytes();
+		if (!outstanding_bytes)
+			return io_failure{ outstanding_bytes.error(), outstanding_bytes.error_message() };
+
+		if (outstanding_bytes.value() <= max_outstanding_bytes)
+			return true;
+
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline)
+			return false;
+
+		auto timeout = std::min(
+			std::chrono::ceil<std::chrono::milliseconds>(deadline - now),
+			send_queue_poll_interval
+		);
+
+		// An interruption by a signal or an error here only ends
+		// this wait early, and the checks above are repeated anyway.
+		poll(&cancellable_pfd, 1, int(timeout.count()));
+	}
+}
+
+
+io_result<bool> rfcomm_connection::pace_send(rfcomm_flow_control_config const &config)
+{
+	if (config.m_pacing_threshold <= 0)
+		return true;
+
+	auto outstanding_bytes = get_outstanding_send_bytes();
+	if (!outstanding_bytes)
+		return io_failure{ outstanding_bytes.error(), outstanding_bytes.error_message() };
+
+	record_outstanding_send_bytes(outstanding_bytes.value());
+
+	if (outstanding_bytes.value() <= config.m_pacing_threshold)
+		return true;
+
+	LOG(
+		trace,
+		"{} byte(s) outstanding in send queue; threshold: {}; waiting for up to {} ms",
+		outstanding_bytes.value(),
+		config.m_pacing_threshold,
+		config.m_max_pacing_wait.count()
+	);
+
+	scoped_trace_span trace_span("io", "rfcomm send pacing");
+
+	auto begin_timestamp = std::chrono::steady_clock::now();
+	auto wait_result = wait_for_send_queue(config.m_pacing_threshold, begin_timestamp + config.m_max_pacing_wait);
+	auto wait_duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin_timestamp);
+
+	if (!wait_result)
+		return wait_result;
+
+	bool reached_threshold = wait_result.value();
+	if (!reached_threshold)
+		LOG(debug, "Send queue did not shrink below pacing threshold after {} us; sending anyway", wait_duration.count());
+
+	std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+	m_flow_control_stats.m_num_paced_sends++;
+	if (!reached_threshold)
+		m_flow_control_stats.m_num_pacing_timeouts++;
+	m_flow_control_stats.m_total_pacing_wait += wait_duration;
+	m_flow_control_stats.m_max_pacing_wait = std::max(m_flow_control_stats.m_max_pacing_wait, wait_duration);
+
+	return reached_threshold;
+}
+
+
+io_result<bool> rfcomm_connection::acquire_send_turn(std::unique_lock<std::mutex> &lock, std::uint64_t cancel_baseline, char const *operation_name)
+{
+	while (true)
+	{
+		if (m_num_send_cancellations != cancel_baseline)
+		{
+			lock.unlock();
+			return report_send_cancellation(operation_name);
+		}
+
+		if (!m_send_turn_taken)
+			break;
+
+		m_send_condvar.wait(lock);
+	}
+
+	m_send_turn_taken = true;
+
+	// The cancellable may still be canceled by a cancel_send() call
+	// that was meant for calls that did not report it yet. These
+	// calls do not use the cancellable, and this call was not
+	// canceled, so resetting the cancellable here is safe.
+	m_send_cancellable.reset();
+
+	return true;
+}
+
+
+void rfcomm_connection::release_send_turn()
+{
+	std::lock_guard<std::mutex> lock(m_send_mutex);
+	m_send_turn_taken = false;
+	m_send_condvar.notify_all();
+}
+
+
+io_failure rfcomm_connection::report_send_cancellation(char const *operation_name)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_send_mutex);
+		m_num_reported_send_cancellations = m_num_send_cancellations;
+	}
+
+	// signal_link_lost() aborts operations by canceling
+	// them, so a cancellation means a lost link if that
+	// flag is set.
+	if (m_link_lost)
+	{
+		LOG(debug, "{} aborted because the Bluetooth link was lost", operation_name);
+		return io_failure{ io_error::link_lost, {} };
+	}
+
+	LOG(debug, "{} canceled", operation_name);
+	return io_failure{ io_error::canceled, {} };
+}
+
+
+io_result<int> rfcomm_connection::send_coalesced(std::unique_lock<std::mutex> &lock, pending_write &write, bool bypass_coalescing, rfcomm_flow_control_config const &config)
+{
+	// Coalescing works like a group commit. The first send() call that
+	// finds the send turn available becomes the writer. It waits for the
+	// coalescing window to elapse, gathers all writes that were queued
+	// up in the meantime (including its own), and writes them with one
+	// sendmsg() call. The other send() calls wait until the writer is
+	// done with their bytes. Writes that arrive while the writer is busy
+	// with the socket are taken care of by the next writer. This keeps
+	// the order of the bytes intact, and makes sure that only one thread
+	// writes to the socket at a time. An urgent write ends the window
+	// right away instead of being written separately, since the latter
+	// could otherwise overtake or interleave with the queued writes.
+
+	m_pending_writes.push_back(&write);
+	m_num_pending_bytes += std::size_t(write.m_num_bytes);
+	m_has_urgent_pending_write = m_has_urgent_pending_write || bypass_coalescing;
+
+	// Wake up a writer that is waiting for the window to elapse,
+	// in case this write is urgent or fills up the write.
+	m_send_condvar.notify_all();
+
+	while (!write.m_done)
+	{
+		// A write that is not in flight yet can be withdrawn
+		// right away if it is canceled. Writes that are in
+		// flight get their cancellation from the writer.
+		if (!write.m_in_flight && (m_num_send_cancellations != write.m_cancel_baseline))
+		{
+			m_pending_writes.erase(std::find(m_pending_writes.begin(), m_pending_writes.end(), &write));
+			m_num_pending_bytes -= std::size_t(write.m_num_bytes);
+			lock.unlock();
+			return report_send_cancellation("Send");
+		}
+
+		if (!m_send_turn_taken)
+		{
+			m_send_turn_taken = true;
+			write_pending_writes(lock, config);
+			m_send_turn_taken = false;
+			m_send_condvar.notify_all();
+		}
+		else
+			m_send_condvar.wait(lock);
+	}
+
+	lock.unlock();
+
+	if (write.m_error != io_error::none)
+		return io_failure{ write.m_error, std::move(write.m_error_message) };
+
+	return write.m_num_bytes;
+}
+
+
+void rfcomm_connection::write_pending_writes(std::unique_lock<std::mutex> &lock, rfcomm_flow_control_config const &config)
+{
+	// Also end the window early if a cancel_send() call happens,
+	// so the canceled writes are withdrawn without delay.
+	std::uint64_t num_send_cancellations = m_num_send_cancellations;
+	m_send_condvar.wait_for(lock, config.m_coalescing_window, [&]() {
+		return m_has_urgent_pending_write
+		    || (m_num_pending_bytes >= config.m_max_coalesced_write_size)
+		    || (m_num_send_cancellations != num_send_cancellations);
+	});
+
+	// Swap the vectors instead of copying them to retain
+	// their capacities. That way, no allocations are
+	// needed once the vectors reached their typical size.
+	// Canceled writes are put back into the pending writes,
+	// so their send() calls can withdraw them.
+	m_in_flight_writes.swap(m_pending_writes);
+	m_num_pending_bytes = 0;
+	m_has_urgent_pending_write = false;
+
+	m_coalesced_write_vectors.clear();
+	std::size_t num_in_flight_writes = 0;
+	for (pending_write *pending : m_in_flight_writes)
+	{
+		if (m_num_send_cancellations != pending->m_cancel_baseline)
+		{
+			m_pending_writes.push_back(pending);
+			m_num_pending_bytes += std::size_t(pending->m_num_bytes);
+			continue;
+		}
+
+		pending->m_in_flight = true;
+		m_in_flight_writes[num_in_flight_writes++] = pending;
+		m_coalesced_write_vectors.push_back({ const_cast<void *>(pending->m_src), std::size_t(pending->m_num_bytes) });
+	}
+	m_in_flight_writes.resize(num_in_flight_writes);
+
+	if (m_in_flight_writes.empty())
+		return;
+
+	// See acquire_send_turn() for why this is safe.
+	m_send_cancellable.reset();
+
+	// Do not hold the lock while writing, so
+	// other send() calls can queue up writes.
+	lock.unlock();
+
+	auto result = [&]() -> io_result<int> {
+		// Pace the coalesced write as a whole, since
+		// it is transmitted as one unit.
+		auto pacing_result = pace_send(config);
+		if (!pacing_result)
+			return io_failure{ pacing_result.error(), pacing_result.error_message() };
+
+		return write_vectors(m_coalesced_write_vectors.data(), int(m_coalesced_write_vectors.size()), m_in_flight_writes.size());
+	}();
+
+	lock.lock();
+
+	for (pending_write *in_flight_write : m_in_flight_writes)
+	{
+		in_flight_write->m_done = true;
+		if (!result)
+		{
+			in_flight_write->m_error = result.error();
+			in_flight_write->m_error_message = result.error_message();
+		}
+	}
+	m_in_flight_writes.clear();
+}
+
+
+io_result<int> rfcomm_connection::write_vectors(struct iovec *vectors, int num_vectors, std::size_t num_packets)
+{
+	// Load the socket only once, since disconnect() may concurrently
+	// replace m_socket_fd. The socket itself stays open until connect()
+	// is called again or this object is destroyed.
+	int socket_fd = m_socket_fd.load();
+	if (socket_fd < 0)
+		return io_failure{ io_error::failed, "RFCOMM connection is not established" };
+
+	std::size_t num_bytes = 0;
+	for (int i = 0; i < num_vectors; ++i)
+		num_bytes += vectors[i].iov_len;
+
+	std::size_t remaining_bytes_to_send = num_bytes;
+	std::uint64_t num_syscalls = 0;
+
+	do
+	{
+		// This is only called by the holder of the send turn, so
+		// the cancellable is only canceled if this write was canceled.
+		if (m_send_cancellable.is_canceled())
+			return report_send_cancellation("Send");
+
+		struct msghdr message = {};
+		message.msg_iov = vectors;
+		message.msg_iovlen = std::size_t(num_vectors);
+
+		// MSG_NOSIGNAL makes sure that sending over a socket whose
+		// connection was terminated reports EPIPE instead of raising
+		// SIGPIPE, which would terminate the process.
+		ssize_t num_bytes_sent = ::sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+		++num_syscalls;
+
+		if (num_bytes_sent < 0)
+		{
+			// Like in receive(), an error caused by disconnect()
+			// shutting down the socket is reported as a cancellation
+			// by the check at the beginning of the loop.
+			if ((errno == EINTR) || m_send_cancellable.is_canceled())
+				continue;
+
+			io_result<bool> wait_result = true;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				wait_result = wait_for_socket(socket_fd, POLLOUT, m_send_cancellable);
+			else
+				wait_result = to_errno_failure(errno);
+
+			if (!wait_result)
+			{
+				LOG(error, "Could not send {} byte(s): {}", num_bytes, wait_result.error_message());
+				return io_failure{ wait_result.error(), wait_result.error_message() };
+			}
+
+			continue;
+		}
+
+		assert(std::size_t(num_bytes_sent) <= remaining_bytes_to_send);
+		remaining_bytes_to_send -= std::size_t(num_bytes_sent);
+
+		LOG(trace, "Sent {} byte(s); remaining: {}", num_bytes_sent, remaining_bytes_to_send);
+
+		// In case of a partial write, skip the vectors that were
+		// written completely, and adjust the first partially
+		// written one so it refers to its remaining bytes.
+		std::size_t num_bytes_to_skip = std::size_t(num_bytes_sent);
+		while ((num_vectors > 0) && (num_bytes_to_skip >= vectors[0].iov_len))
+		{
+			num_bytes_to_skip -= vectors[0].iov_len;
+			++vectors;
+			--num_vectors;
+		}
+		if (num_bytes_to_skip > 0)
+		{
+			vectors[0].iov_base = reinterpret_cast<std::uint8_t *>(vectors[0].iov_base) + num_bytes_to_skip;
+			vectors[0].iov_len -= num_bytes_to_skip;
+		}
+	}
+	while (remaining_bytes_to_send > 0);
+
+	if (num_packets > 1)
+		LOG(trace, "Coalesced {} packet(s) with {} byte(s) into one write", num_packets, num_bytes);
+
+	std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+	m_flow_control_stats.m_num_packets_sent += num_packets;
+	m_flow_control_stats.m_num_bytes_sent += num_bytes;
+	m_flow_control_stats.m_num_writes++;
+	m_flow_control_stats.m_num_write_syscalls += num_syscalls;
+	if (num_packets > 1)
+		m_flow_control_stats.m_num_coalesced_writes++;
+	m_flow_control_stats.m_max_packets_per_write = std::max(m_flow_control_stats.m_max_packets_per_write, std::uint64_t(num_packets));
+
+	return int(num_bytes);
+}
+
+
+void rfcomm_connection::record_outstanding_send_bytes(int outstanding_bytes)
+{
+	std::lock_guard<std::mutex> lock(m_flow_control_mutex);
+	m_flow_control_stats.m_outstanding_send_bytes = outstanding_bytes;
+	m_flow_control_stats.m_max_outstanding_send_bytes = std::max(m_flow_control_stats.m_max_outstanding_send_bytes, outstanding_bytes);
 }
 
 
@@ -1,12 +1,17 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+#include <sys/epoll.h>
+#endif
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 #include "scope_guard.hpp"
 #include "rfcomm_listener.hpp"
 #include "exception.hpp"
+#ifndef COMBOCTL_NATIVE_DBUS_BACKEND
 #include "gerror_exception.hpp"
+#endif
 #include "bluez_misc.hpp"
 #include "log.hpp"
 
@@ -18,6 +23,141 @@ namespace comboctl
 {
 
 
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+
+
+rfcomm_listener::rfcomm_listener()
+	: m_reactor(nullptr)
+	, m_socket_fd(-1)
+{
+}
+
+
+rfcomm_listener::~rfcomm_listener()
+{
+	stop_listening();
+}
+
+
+rfcomm_listener::rfcomm_listener(rfcomm_listener && other)
+	: m_reactor(other.m_reactor)
+	, m_socket_fd(other.m_socket_fd)
+	, m_rfcomm_channel(other.m_rfcomm_channel)
+{
+	// The reactor's callback refers to the listener object,
+	// so only moving listeners that do not listen is supported.
+	assert(other.m_socket_fd < 0);
+	other.m_socket_fd = -1;
+}
+
+
+rfcomm_listener& rfcomm_listener::operator = (rfcomm_listener && other)
+{
+	assert(other.m_socket_fd < 0);
+
+	stop_listening();
+
+	m_reactor = other.m_reactor;
+	m_socket_fd = other.m_socket_fd;
+	m_rfcomm_channel = other.m_rfcomm_channel;
+
+	other.m_socket_fd = -1;
+
+	return *this;
+}
+
+
+void rfcomm_listener::listen(epoll_reactor &reactor, unsigned int rfcomm_channel)
+{
+	if (m_socket_fd >= 0)
+		throw invalid_call_exception("Listener socket already set up");
+
+	int socket_fd = ::socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_RFCOMM);
+	if (socket_fd < 0)
+		throw io_exception(fmt::format("Could not create RFCOMM socket: {} ({})", std::strerror(errno), errno));
+
+	auto rfcomm_fd_guard = make_scope_guard([&]() { ::close(socket_fd); });
+
+	// See the GLib variant of this function for
+	// why sockaddr_storage is used here.
+	static_assert(sizeof(struct sockaddr_rc) <= sizeof(struct sockaddr_storage));
+	struct sockaddr_storage sock_addr = {};
+	struct sockaddr_rc *rfcomm_addr = reinterpret_cast<struct sockaddr_rc *>(&sock_addr);
+	rfcomm_addr->rc_family = AF_BLUETOOTH;
+	rfcomm_addr->rc_bdaddr = bdaddr_any; // We allow for incoming connections from any Bluetooth address.
+	rfcomm_addr->rc_channel = rfcomm_channel;
+
+	if (::bind(socket_fd, reinterpret_cast<struct sockaddr *>(rfcomm_addr), sizeof(*rfcomm_addr)) < 0)
+		throw io_exception(fmt::format("Could not bind RFCOMM listener socket: {} ({})", std::strerror(errno), errno));
+
+	if (::listen(socket_fd, 1) < 0)
+		throw io_exception(fmt::format("Could not set RFCOMM socket to listen: {} ({})", std::strerror(errno), errno));
+
+	// As with the GSocketListener in the GLib variant, we
+	// don't actually care about incoming connections, so
+	// close these immediately.
+	reactor.add_fd(socket_fd, EPOLLIN, [this](std::uint32_t) {
+		while (true)
+		{
+			int connection_fd = ::accept4(m_socket_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (connection_fd < 0)
+			{
+				if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+					LOG(error, "Could not accept RFCOMM connection: {} ({})", std::strerror(errno), errno);
+				return;
+			}
+
+			LOG(debug, "Closing accepted RFCOMM socket (since we don't use client connections)");
+			::close(connection_fd);
+		}
+	});
+
+	rfcomm_fd_guard.dismiss();
+	m_reactor = &reactor;
+	m_socket_fd = socket_fd;
+
+	// Like in the GLib variant, the channel number can only
+	// be retrieved once the socket is set to listen.
+	if (rfcomm_channel == 0)
+	{
+		socklen_t rfcomm_addr_length = sizeof(*rfcomm_addr);
+
+		if (::getsockname(socket_fd, reinterpret_cast<struct sockaddr *>(rfcomm_addr), &rfcomm_addr_length) < 0)
+		{
+			int error = errno;
+			stop_listening();
+			throw io_exception(fmt::format("Could not get dynamically picked channel because getsockname() failed: {} ({})", std::strerror(error), error));
+		}
+
+		m_rfcomm_channel = rfcomm_addr->rc_channel;
+		LOG(info, "Using dynamically picked RFCOMM channel {}", m_rfcomm_channel);
+	}
+	else
+	{
+		m_rfcomm_channel = rfcomm_channel;
+		LOG(info, "Using specified RFCOMM channel {}", m_rfcomm_channel);
+	}
+
+	LOG(info, "Listening for incoming RFCOMM connections on channel {}", m_rfcomm_channel);
+}
+
+
+void rfcomm_listener::stop_listening()
+{
+	if (m_socket_fd < 0)
+		return;
+
+	m_reactor->remove_fd(m_socket_fd);
+	::close(m_socket_fd);
+	m_socket_fd = -1;
+
+	LOG(info, "Stopped listening for incoming RFCOMM connections on channel {}", m_rfcomm_channel);
+}
+
+
+#else
+
+
 rfcomm_listener::rfcomm_listener()
 	: m_socket_listener(nullptr)
 	, m_socket_listener_accept_cancellable(nullptr)
@@ -265,15 +405,26 @@ void rfcomm_listener::stop_listening()
 
 	if (m_socket_listener != nullptr)
 	{
-		g_socket_listener_close(m_socket_listener);
-		g_object_unref(G_OBJECT(m_socket_listener));
-		m_socket_listener = nullptr;
-
+		close_socket_listener();
 		LOG(info, "Stopped listening for incoming RFCOMM connections on channel {}", m_rfcomm_channel);
 	}
 }
 
 
+void rfcomm_listener::close_socket_listener()
+{
+	if (m_socket_listener == nullptr)
+		return;
+
+	g_socket_listener_close(m_socket_listener);
+	g_object_unref(G_OBJECT(m_socket_listener));
+	m_socket_listener = nullptr;
+}
+
+
+#endif
+
+
 unsigned int rfcomm_listener::get_channel() const
 {
 	return m_rfcomm_channel;
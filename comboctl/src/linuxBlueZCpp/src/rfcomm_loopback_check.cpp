@@ -0,0 +1,331 @@
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <vector>
+#include "rfcomm_loopback_check.hpp"
+#include "rfcomm_connection.hpp"
+#include "allocation_tracking.hpp"
+#include "exception.hpp"
+#include "scope_guard.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("RfcommLoopbackCheck")
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+struct allocation_tally
+{
+	std::uint64_t m_num_send_allocations = 0;
+	std::uint64_t m_num_receive_allocations = 0;
+};
+
+
+void run_echo_loop(int fd)
+{
+	std::array<char, 4096> buffer;
+
+	while (true)
+	{
+		ssize_t num_read_bytes = ::read(fd, buffer.data(), buffer.size());
+		if ((num_read_bytes < 0) && (errno == EINTR))
+			continue;
+		if (num_read_bytes <= 0)
+			return;
+
+		ssize_t num_written_bytes = 0;
+		while (num_written_bytes < num_read_bytes)
+		{
+			ssize_t ret = ::write(fd, buffer.data() + num_written_bytes, num_read_bytes - num_written_bytes);
+			if ((ret < 0) && (errno == EINTR))
+				continue;
+			if (ret < 0)
+				return;
+			num_written_bytes += ret;
+		}
+	}
+}
+
+
+std::uint64_t get_num_thread_allocations()
+{
+	return get_thread_allocation_counters().m_num_allocations;
+}
+
+
+void exchange_packet(rfcomm_connection &connection, std::size_t packet_index, std::vector<std::uint8_t> &packet, std::vector<std::uint8_t> &echo, allocation_tally &tally)
+{
+	int packet_size = int(packet.size());
+
+	for (std::size_t i = 0; i < packet.size(); ++i)
+		packet[i] = std::uint8_t(packet_index + i);
+
+	std::uint64_t num_allocations_before = get_num_thread_allocations();
+	auto send_result = connection.send(packet.data(), packet_size);
+	tally.m_num_send_allocations += get_num_thread_allocations() - num_allocations_before;
+
+	if (!send_result)
+		throw io_exception(fmt::format("Loopback send failed: {}", send_result.error_message()));
+
+	// The socket pair is a stream, so the echo may arrive in pieces.
+	int num_received_bytes = 0;
+	while (num_received_bytes < packet_size)
+	{
+		num_allocations_before = get_num_thread_allocations();
+		auto receive_result = connection.receive(echo.data() + num_received_bytes, packet_size - num_received_bytes);
+		tally.m_num_receive_allocations += get_num_thread_allocations() - num_allocations_before;
+
+		if (!receive_result)
+			throw io_exception(fmt::format("Loopback receive failed: {}", receive_result.error_message()));
+		if (receive_result.value() == 0)
+			throw io_exception("Loopback socket was closed by the echo thread");
+
+		num_received_bytes += receive_result.value();
+	}
+
+	if (echo != packet)
+		throw io_exception(fmt::format("Echo of loopback packet #{} differs from the sent packet", packet_index));
+}
+
+
+// Starts a thread that runs the blocking call, cancels that call
+// after the block duration, and returns how long it took from the
+// cancellation until the blocking call returned.
+template<typename BlockingCall, typename CancelCall>
+std::chrono::microseconds measure_cancel_latency(char const *call_name, BlockingCall blocking_call, CancelCall cancel_call, std::chrono::microseconds block_duration)
+{
+	io_error error = io_error::none;
+	std::chrono::steady_clock::time_point return_timestamp;
+
+	std::thread call_thread([&]() {
+		error = blocking_call();
+		return_timestamp = std::chrono::steady_clock::now();
+	});
+
+	std::this_thread::sleep_for(block_duration);
+
+	auto cancel_timestamp = std::chrono::steady_clock::now();
+	cancel_call();
+	call_thread.join();
+
+	if (error != io_error::canceled)
+		throw io_exception(fmt::format("Loopback {} call was not canceled; result: {}", call_name, to_string(error)));
+
+	return std::chrono::duration_cast<std::chrono::microseconds>(return_timestamp - cancel_timestamp);
+}
+
+
+rfcomm_cancel_latency_stats summarize_cancel_latencies(std::vector<std::chrono::microseconds> &latencies)
+{
+	rfcomm_cancel_latency_stats stats;
+
+	if (latencies.empty())
+		return stats;
+
+	std::sort(latencies.begin(), latencies.end());
+
+	std::chrono::microseconds total{0};
+	for (auto latency : latencies)
+		total += latency;
+
+	stats.m_min = latencies.front();
+	stats.m_median = latencies[latencies.size() / 2];
+	stats.m_mean = total / latencies.size();
+	stats.m_max = latencies.back();
+
+	return stats;
+}
+
+
+} // unnamed namespace end
+
+
+
+
+rfcomm_loopback_check_result run_rfcomm_loopback_check(rfcomm_loopback_check_options const &options)
+{
+	assert(options.m_packet_size > 0);
+
+	std::array<int, 2> socket_fds;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds.data()) < 0)
+		throw io_exception(fmt::format("Could not create socket pair: {} ({})", std::strerror(errno), errno));
+
+	rfcomm_connection connection;
+	connection.set_flow_control_config(options.m_flow_control_config);
+
+	try
+	{
+		connection.attach_connected_socket(socket_fds[0]);
+	}
+	catch (...)
+	{
+		::close(socket_fds[0]);
+		::close(socket_fds[1]);
+		throw;
+	}
+
+	std::thread echo_thread(run_echo_loop, socket_fds[1]);
+
+	auto echo_thread_guard = make_scope_guard([&]() {
+		// Disconnecting closes the connection's end of the
+		// socket pair, which makes the echo loop exit.
+		connection.disconnect();
+		echo_thread.join();
+		::close(socket_fds[1]);
+	});
+
+	std::vector<std::uint8_t> packet(std::size_t(options.m_packet_size));
+	std::vector<std::uint8_t> echo(std::size_t(options.m_packet_size));
+	allocation_tally tally;
+
+	for (std::size_t i = 0; i < options.m_num_warmup_packets; ++i)
+		exchange_packet(connection, i, packet, echo, tally);
+
+	// Only the steady state is of interest from here on.
+	tally = allocation_tally();
+	reset_allocation_site_report();
+
+	auto start_timestamp = std::chrono::steady_clock::now();
+
+	for (std::size_t i = 0; i < options.m_num_packets; ++i)
+		exchange_packet(connection, options.m_num_warmup_packets + i, packet, echo, tally);
+
+	rfcomm_loopback_check_result result;
+	result.m_num_packets = options.m_num_packets;
+	result.m_num_send_allocations = tally.m_num_send_allocations;
+	result.m_num_receive_allocations = tally.m_num_receive_allocations;
+	result.m_duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_timestamp);
+
+	LOG(
+		debug,
+		"Exchanged {} loopback packet(s) in {} us; allocations: {} in send calls, {} in receive calls",
+		result.m_num_packets,
+		result.m_duration.count(),
+		result.m_num_send_allocations,
+		result.m_num_receive_allocations
+	);
+
+	return result;
+}
+
+
+rfcomm_cancel_latency_result run_rfcomm_cancel_latency_check(rfcomm_cancel_latency_options const &options)
+{
+	std::array<int, 2> socket_fds;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds.data()) < 0)
+		throw io_exception(fmt::format("Could not create socket pair: {} ({})", std::strerror(errno), errno));
+
+	// A small send buffer makes the socket pair fill up quickly.
+	// The packet that is sent is much larger than the buffers, so
+	// every send() call blocks, since the other end never reads.
+	rfcomm_flow_control_config flow_control_config;
+	flow_control_config.m_send_buffer_size = 4096;
+
+	rfcomm_connection connection;
+	connection.set_flow_control_config(flow_control_config);
+
+	try
+	{
+		connection.attach_connected_socket(socket_fds[0]);
+	}
+	catch (...)
+	{
+		::close(socket_fds[0]);
+		::close(socket_fds[1]);
+		throw;
+	}
+
+	auto socket_guard = make_scope_guard([&]() {
+		connection.disconnect();
+		::close(socket_fds[1]);
+	});
+
+	std::vector<std::uint8_t> packet(1024 * 1024);
+	std::vector<std::uint8_t> receive_buffer(1024);
+	std::vector<std::chrono::microseconds> receive_latencies;
+	std::vector<std::chrono::microseconds> send_latencies;
+	receive_latencies.reserve(options.m_num_iterations);
+	send_latencies.reserve(options.m_num_iterations);
+
+	for (std::size_t i = 0; i < options.m_num_iterations; ++i)
+	{
+		receive_latencies.push_back(measure_cancel_latency(
+			"receive",
+			[&]() {
+				auto result = connection.receive(receive_buffer.data(), int(receive_buffer.size()));
+				return result ? io_error::none : result.error();
+			},
+			[&]() { connection.cancel_receive(); },
+			options.m_block_duration
+		));
+	}
+
+	for (std::size_t i = 0; i < options.m_num_iterations; ++i)
+	{
+		send_latencies.push_back(measure_cancel_latency(
+			"send",
+			[&]() {
+				auto result = connection.send(packet.data(), int(packet.size()));
+				return result ? io_error::none : result.error();
+			},
+			[&]() { connection.cancel_send(); },
+			options.m_block_duration
+		));
+	}
+
+	// disconnect() aborts blocked calls by canceling them and shutting
+	// down the socket. Whichever of the two wakes up a call first, it
+	// has to report a cancellation, not an end-of-stream or an error.
+	{
+		io_error receive_error = io_error::none;
+		io_error send_error = io_error::none;
+
+		std::thread receive_thread([&]() {
+			auto receive_result = connection.receive(receive_buffer.data(), int(receive_buffer.size()));
+			receive_error = receive_result ? io_error::none : receive_result.error();
+		});
+		std::thread send_thread([&]() {
+			auto send_result = connection.send(packet.data(), int(packet.size()));
+			send_error = send_result ? io_error::none : send_result.error();
+		});
+
+		std::this_thread::sleep_for(options.m_block_duration);
+		connection.disconnect();
+		receive_thread.join();
+		send_thread.join();
+
+		if (receive_error != io_error::canceled)
+			throw io_exception(fmt::format("Loopback receive call was not canceled by disconnect; result: {}", to_string(receive_error)));
+		if (send_error != io_error::canceled)
+			throw io_exception(fmt::format("Loopback send call was not canceled by disconnect; result: {}", to_string(send_error)));
+	}
+
+	rfcomm_cancel_latency_result result;
+	result.m_receive = summarize_cancel_latencies(receive_latencies);
+	result.m_send = summarize_cancel_latencies(send_latencies);
+
+	LOG(
+		debug,
+		"Canceled {} blocked receive and send call(s) each; median latency: receive {} us, send {} us",
+		options.m_num_iterations,
+		result.m_receive.m_median.count(),
+		result.m_send.m_median.count()
+	);
+
+	return result;
+}
+
+
+} // namespace comboctl end
@@ -0,0 +1,157 @@
+#ifdef COMBOCTL_NATIVE_DBUS_BACKEND
+
+#include <assert.h>
+#include "scope_guard.hpp"
+#include "dbus_error_exception.hpp"
+#include "sdp_service.hpp"
+#include "log.hpp"
+
+
+DEFINE_LOGGING_TAG("SdpService")
+
+
+namespace comboctl
+{
+
+
+sdp_service::sdp_service()
+	: m_dbus_connection(nullptr)
+	, m_profile_object_registered(false)
+	, m_profile_registered(false)
+{
+}
+
+
+void sdp_service::setup(dbus_connection *dbus_connection, std::string service_name, std::string service_provider, std::string service_description, unsigned int rfcomm_channel)
+{
+	// Prerequisites.
+
+	assert(dbus_connection != nullptr);
+
+	if (m_profile_object_registered)
+		throw invalid_call_exception("SDP service already set up");
+
+	// Store the arguments.
+	m_dbus_connection = dbus_connection;
+
+	// Install scope guard to call teardown() if something
+	// goes wrong. This makes sure that any changes done
+	// by this function are rolled back then.
+	auto guard = make_scope_guard([&]() { teardown(); });
+
+	// Register our profile object. This does not yet
+	// register it as a BlueZ profile, it just makes
+	// it appears as an object in D-Bus. BlueZ only calls
+	// Release on it, since AutoConnect is disabled and
+	// connections are accepted by rfcomm_listener instead.
+	// (NewConnection could not be delivered anyway, since
+	// this connection does not support passing file
+	// descriptors.) Anything else is rejected.
+	m_dbus_connection->register_object(profile_path, [this](dbus_message const &message) {
+		if (message.is_method_call("org.bluez.Profile1", "Release"))
+			m_dbus_connection->send(dbus_message_builder::method_return(message));
+		else
+			m_dbus_connection->send(dbus_message_builder::error(message, "org.bluez.Error.Rejected", "Not supported"));
+	});
+	m_profile_object_registered = true;
+
+	// This is now the actual profile registration.
+	{
+		// We Use a manual service record XML, since
+		// the profile manager interface for creating
+		// service records is very limited.
+
+		std::string sdp_service_record_xml = build_service_record_xml(service_name, service_provider, service_description, rfcomm_channel);
+
+		dbus_message_builder register_profile_call = dbus_message_builder::method_call("org.bluez", "/org/bluez", "org.bluez.ProfileManager1", "RegisterProfile");
+		dbus_value_writer &profile_writer = register_profile_call.body();
+
+		profile_writer.append_object_path(profile_path);
+		profile_writer.append_string(serial_port_profile_uuid_str);
+
+		profile_writer.open_array("{sv}");
+
+		profile_writer.open_dict_entry();
+		profile_writer.append_string("Channel");
+		profile_writer.open_variant("q");
+		profile_writer.append_uint16(rfcomm_channel);
+		profile_writer.close_variant();
+		profile_writer.close_dict_entry();
+
+		profile_writer.open_dict_entry();
+		profile_writer.append_string("ServiceRecord");
+		profile_writer.open_variant("s");
+		profile_writer.append_string(sdp_service_record_xml);
+		profile_writer.close_variant();
+		profile_writer.close_dict_entry();
+
+		profile_writer.open_dict_entry();
+		profile_writer.append_string("AutoConnect");
+		profile_writer.open_variant("b");
+		profile_writer.append_boolean(false);
+		profile_writer.close_variant();
+		profile_writer.close_dict_entry();
+
+		profile_writer.close_array();
+
+		try
+		{
+			m_dbus_connection->call(register_profile_call);
+		}
+		catch (dbus_error_exception const &exc)
+		{
+			LOG(error, "Could not register profile: {}", exc.what());
+			throw;
+		}
+
+		m_profile_registered = true;
+	}
+
+	// Our SDP service record is ready. Dismiss the guard to make
+	// sure it is not torn down again.
+
+	guard.dismiss();
+
+	LOG(trace, "SDP service set up");
+}
+
+
+void sdp_service::teardown()
+{
+	if (m_profile_registered)
+	{
+		// Sent without waiting for the reply so that teardown
+		// does not block if BlueZ is unresponsive.
+		dbus_message_builder unregister_profile_call = dbus_message_builder::method_call("org.bluez", "/org/bluez", "org.bluez.ProfileManager1", "UnregisterProfile");
+		unregister_profile_call.set_no_reply_expected();
+		unregister_profile_call.body().append_object_path(profile_path);
+
+		try
+		{
+			if (m_dbus_connection->is_open())
+				m_dbus_connection->send(unregister_profile_call);
+		}
+		catch (io_exception const &exc)
+		{
+			LOG(debug, "Could not send UnregisterProfile call: {}", exc.what());
+		}
+
+		m_profile_registered = false;
+	}
+
+	if (m_profile_object_registered)
+	{
+		m_dbus_connection->unregister_object(profile_path);
+		m_profile_object_registered = false;
+	}
+
+	m_dbus_connection = nullptr;
+
+	LOG(trace, "SDP service torn down");
+}
+
+
+} // namespace comboctl end
+
+
+#endif // COMBOCTL_NATIVE_DBUS_BACKEND
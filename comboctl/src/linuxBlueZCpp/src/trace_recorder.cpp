@@ -0,0 +1,342 @@
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fmt/format.h>
+#include "trace_recorder.hpp"
+
+
+namespace comboctl
+{
+
+
+namespace
+{
+
+
+// Once this many thread buffers are registered, buffers of threads
+// that exited are discarded when registering a new buffer. Otherwise,
+// applications that frequently spawn short-lived threads would keep
+// accumulating buffers.
+constexpr std::size_t max_num_thread_buffers_before_pruning = 64;
+
+
+template<std::size_t NumWords>
+void store_truncated_string(std::array<std::atomic<std::uint64_t>, NumWords> &words, char const *src)
+{
+	char buffer[NumWords * 8] = { 0 };
+	std::size_t length = std::min(std::strlen(src), sizeof(buffer) - 1);
+	std::memcpy(buffer, src, length);
+
+	for (std::size_t i = 0; i < NumWords; ++i)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, &buffer[i * 8], 8);
+		words[i].store(word, std::memory_order_relaxed);
+	}
+}
+
+
+template<std::size_t NumWords>
+void load_string(std::array<std::atomic<std::uint64_t>, NumWords> const &words, char (&dest)[NumWords * 8])
+{
+	for (std::size_t i = 0; i < NumWords; ++i)
+	{
+		std::uint64_t word = words[i].load(std::memory_order_relaxed);
+		std::memcpy(&dest[i * 8], &word, 8);
+	}
+
+	// Guard against a missing null terminator in case of a torn read.
+	dest[NumWords * 8 - 1] = '\0';
+}
+
+
+void append_json_string(std::string &output, char const *str)
+{
+	output += '"';
+
+	for (; *str != '\0'; ++str)
+	{
+		char c = *str;
+		switch (c)
+		{
+			case '"': output += "\\\""; break;
+			case '\\': output += "\\\\"; break;
+			case '\n': output += "\\n"; break;
+			case '\r': output += "\\r"; break;
+			case '\t': output += "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+					output += fmt::format("\\u{:04x}", int(c));
+				else
+					output += c;
+		}
+	}
+
+	output += '"';
+}
+
+
+// Chrome trace events use microsecond timestamps. Fractional
+// values are allowed, so we can retain nanosecond precision.
+std::string format_as_microseconds(std::int64_t nanoseconds)
+{
+	return fmt::format("{}.{:03}", nanoseconds / 1000, nanoseconds % 1000);
+}
+
+
+} // unnamed namespace end
+
+
+
+
+// A slot in a per-thread ring buffer. Slots are written only by the
+// thread that owns the buffer, and read by export_chrome_trace_json().
+// To detect torn reads, each slot is guarded by a sequence number
+// (seqlock): it is odd while the slot is being written, and advanced
+// to the next even value once the write is done. The reader accepts
+// a slot only if it sees the same even sequence number before and
+// after copying the slot's contents.
+//
+// The contents are stored in relaxed atomics (the strings packed
+// into 64-bit words), since with plain fields, the reader's copy
+// would formally be a data race. On common CPUs, relaxed atomic
+// loads and stores compile to ordinary loads and stores.
+struct trace_span_slot
+{
+	static constexpr std::size_t num_category_words = (trace_recorder::max_category_length + 1) / 8;
+	static constexpr std::size_t num_name_words = (trace_recorder::max_name_length + 1) / 8;
+	static_assert(((trace_recorder::max_category_length + 1) % 8) == 0);
+	static_assert(((trace_recorder::max_name_length + 1) % 8) == 0);
+
+	std::atomic<std::uint64_t> m_sequence { 0 };
+	std::atomic<std::int64_t> m_start_timestamp_ns { 0 };
+	std::atomic<std::int64_t> m_duration_ns { 0 };
+	std::array<std::atomic<std::uint64_t>, num_category_words> m_category_words = {};
+	std::array<std::atomic<std::uint64_t>, num_name_words> m_name_words = {};
+};
+
+
+struct thread_trace_buffer
+{
+	thread_trace_buffer()
+		: m_thread_id(syscall(SYS_gettid))
+		, m_num_written_spans(0)
+		, m_thread_exited(false)
+	{
+		// Linux limits thread names to 16 bytes including the null terminator.
+		char thread_name[16] = { 0 };
+		if (pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name)) == 0)
+			m_thread_name = thread_name;
+	}
+
+	long m_thread_id;
+	std::string m_thread_name;
+	std::array<trace_span_slot, trace_recorder::num_spans_per_thread> m_slots;
+	std::atomic<std::uint64_t> m_num_written_spans;
+	std::atomic<bool> m_thread_exited;
+};
+
+
+namespace
+{
+
+
+// Keeps the calling thread's buffer alive and marks it as
+// belonging to an exited thread once the thread finishes.
+// The registry keeps the buffer alive as well, so spans
+// of exited threads can still be exported.
+struct thread_buffer_holder
+{
+	~thread_buffer_holder()
+	{
+		if (m_buffer)
+			m_buffer->m_thread_exited = true;
+	}
+
+	std::shared_ptr<thread_trace_buffer> m_buffer;
+};
+
+thread_local thread_buffer_holder tls_thread_buffer_holder;
+
+
+} // unnamed namespace end
+
+
+
+
+trace_recorder& trace_recorder::instance()
+{
+	static trace_recorder recorder;
+	return recorder;
+}
+
+
+trace_recorder::trace_recorder()
+	: m_enabled(false)
+	, m_cleared_at_timestamp_ns(0)
+{
+}
+
+
+void trace_recorder::set_enabled(bool enabled)
+{
+	m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+void trace_recorder::add_span(char const *category, char const *name, std::int64_t start_timestamp_ns, std::int64_t duration_ns)
+{
+	assert(category != nullptr);
+	assert(name != nullptr);
+
+	if (!is_enabled())
+		return;
+
+	// This is called from destructors (see scoped_trace_span),
+	// so it must not throw. The only thing that can throw here
+	// is the allocation of a new thread buffer. In that case,
+	// the span is simply dropped.
+	thread_trace_buffer *buffer;
+	try
+	{
+		buffer = get_thread_buffer();
+	}
+	catch (...)
+	{
+		return;
+	}
+
+	// Only the owning thread writes to the buffer,
+	// so a relaxed load of the counter is enough here.
+	std::uint64_t span_index = buffer->m_num_written_spans.load(std::memory_order_relaxed);
+	trace_span_slot &slot = buffer->m_slots[span_index % num_spans_per_thread];
+
+	std::uint64_t sequence = slot.m_sequence.load(std::memory_order_relaxed);
+	slot.m_sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.m_start_timestamp_ns.store(start_timestamp_ns, std::memory_order_relaxed);
+	slot.m_duration_ns.store(duration_ns, std::memory_order_relaxed);
+	store_truncated_string(slot.m_category_words, category);
+	store_truncated_string(slot.m_name_words, name);
+
+	slot.m_sequence.store(sequence + 2, std::memory_order_release);
+	buffer->m_num_written_spans.store(span_index + 1, std::memory_order_release);
+}
+
+
+void trace_recorder::clear()
+{
+	m_cleared_at_timestamp_ns.store(to_timestamp_ns(clock::now()), std::memory_order_relaxed);
+}
+
+
+std::string trace_recorder::export_chrome_trace_json() const
+{
+	std::vector<std::shared_ptr<thread_trace_buffer>> thread_buffers;
+	{
+		std::lock_guard<std::mutex> lock(m_registry_mutex);
+		thread_buffers = m_thread_buffers;
+	}
+
+	std::int64_t cleared_at_timestamp_ns = m_cleared_at_timestamp_ns.load(std::memory_order_relaxed);
+	long process_id = getpid();
+
+	std::string output = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first_event = true;
+
+	auto begin_event = [&]() {
+		if (!first_event)
+			output += ",\n";
+		first_event = false;
+	};
+
+	for (auto const &buffer : thread_buffers)
+	{
+		if (!buffer->m_thread_name.empty())
+		{
+			begin_event();
+			output += fmt::format("{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},\"args\":{{\"name\":", process_id, buffer->m_thread_id);
+			append_json_string(output, buffer->m_thread_name.c_str());
+			output += "}}";
+		}
+
+		std::uint64_t num_written_spans = buffer->m_num_written_spans.load(std::memory_order_acquire);
+		std::uint64_t first_span_index = (num_written_spans > num_spans_per_thread) ? (num_written_spans - num_spans_per_thread) : 0;
+
+		for (std::uint64_t span_index = first_span_index; span_index < num_written_spans; ++span_index)
+		{
+			trace_span_slot const &slot = buffer->m_slots[span_index % num_spans_per_thread];
+
+			std::uint64_t sequence_before = slot.m_sequence.load(std::memory_order_acquire);
+			if ((sequence_before & 1) != 0)
+				continue;
+
+			std::int64_t start_timestamp_ns = slot.m_start_timestamp_ns.load(std::memory_order_relaxed);
+			std::int64_t duration_ns = slot.m_duration_ns.load(std::memory_order_relaxed);
+			char category[max_category_length + 1];
+			char name[max_name_length + 1];
+			load_string(slot.m_category_words, category);
+			load_string(slot.m_name_words, name);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.m_sequence.load(std::memory_order_relaxed) != sequence_before)
+				continue;
+
+			if (start_timestamp_ns < cleared_at_timestamp_ns)
+				continue;
+
+			begin_event();
+			output += "{\"name\":";
+			append_json_string(output, name);
+			output += ",\"cat\":";
+			append_json_string(output, category);
+			output += fmt::format(
+				",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{},\"dur\":{}}}",
+				process_id,
+				buffer->m_thread_id,
+				format_as_microseconds(start_timestamp_ns),
+				format_as_microseconds(std::max(duration_ns, std::int64_t(0)))
+			);
+		}
+	}
+
+	output += "]}\n";
+
+	return output;
+}
+
+
+thread_trace_buffer* trace_recorder::get_thread_buffer()
+{
+	if (tls_thread_buffer_holder.m_buffer)
+		return tls_thread_buffer_holder.m_buffer.get();
+
+	auto buffer = std::make_shared<thread_trace_buffer>();
+
+	{
+		std::lock_guard<std::mutex> lock(m_registry_mutex);
+
+		if (m_thread_buffers.size() >= max_num_thread_buffers_before_pruning)
+		{
+			m_thread_buffers.erase(
+				std::remove_if(m_thread_buffers.begin(), m_thread_buffers.end(), [](auto const &existing_buffer) {
+					return existing_buffer->m_thread_exited.load();
+				}),
+				m_thread_buffers.end()
+			);
+		}
+
+		m_thread_buffers.push_back(buffer);
+	}
+
+	tls_thread_buffer_holder.m_buffer = std::move(buffer);
+	return tls_thread_buffer_holder.m_buffer.get();
+}
+
+
+} // namespace comboctl end
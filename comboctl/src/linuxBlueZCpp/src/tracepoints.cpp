@@ -0,0 +1,25 @@
+#include "tracepoints.hpp"
+
+
+// Semaphore definitions for the tracepoints declared in tracepoints.hpp.
+// These must be defined exactly once, and must have C linkage, since
+// sys/sdt.h refers to them by their unmangled symbol names.
+
+COMBOCTL_DEFINE_TRACEPOINT(rfcomm_connect_begin);
+COMBOCTL_DEFINE_TRACEPOINT(rfcomm_connect_end);
+COMBOCTL_DEFINE_TRACEPOINT(rfcomm_send_begin);
+COMBOCTL_DEFINE_TRACEPOINT(rfcomm_send_end);
+COMBOCTL_DEFINE_TRACEPOINT(rfcomm_receive_begin);
+COMBOCTL_DEFINE_TRACEPOINT(rfcomm_receive_end);
+
+COMBOCTL_DEFINE_TRACEPOINT(mainloop_task_post);
+COMBOCTL_DEFINE_TRACEPOINT(mainloop_task_execute_begin);
+COMBOCTL_DEFINE_TRACEPOINT(mainloop_task_execute_end);
+
+COMBOCTL_DEFINE_TRACEPOINT(adapter_signal_begin);
+COMBOCTL_DEFINE_TRACEPOINT(adapter_signal_end);
+COMBOCTL_DEFINE_TRACEPOINT(agent_method_call_begin);
+COMBOCTL_DEFINE_TRACEPOINT(agent_method_call_end);
+
+COMBOCTL_DEFINE_TRACEPOINT(jni_enter);
+COMBOCTL_DEFINE_TRACEPOINT(jni_exit);
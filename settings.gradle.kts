@@ -7,6 +7,8 @@ if (env["idea.platform.prefix"] != "AndroidStudio") {
     include(":javafxApp")
     include(":comboctl:src:linuxBlueZCpp")
     include(":comboctl:src:linuxBlueZCpp:external:fmtlib")
+    include(":comboctl:src:linuxBlueZCpp:broker")
+    include(":comboctl:src:linuxBlueZCpp:mock-bluez")
     include(":comboctl:src:jvmMain:cpp:linuxBlueZCppJNI")
 } else {
     logger.lifecycle("Building with Android Studio; disabling javafxApp, enabling androidApp")
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+
+# This tool renders binary log files written by the native BlueZ code's
+# binary logger (see comboctl/src/linuxBlueZCpp/include/binary_log.hpp
+# for details about the file format) to text.
+#
+# Entries are printed in timestamp order, one per line, in the form:
+#
+#   <timestamp> [<level>] [<tag>] [<thread>] <message>
+#
+# The format strings use the fmt library syntax. The subset of it that
+# the native code uses is compatible with Python's str.format(). Should
+# an entry's format string not be compatible, the format string and the
+# raw arguments are printed instead.
+
+import sys, struct, argparse, datetime
+
+FILE_MAGIC = b'CCBINLOG'
+SUPPORTED_FORMAT_VERSION = 1
+
+SITE_RECORD = 1
+THREAD_RECORD = 2
+ENTRIES_RECORD = 3
+DROPPED_RECORD = 4
+
+LOG_LEVELS = ['trace', 'debug', 'info', 'warn', 'error', 'fatal']
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def at_end(self):
+        return self.offset >= len(self.data)
+
+    def read(self, fmt):
+        values = struct.unpack_from('<' + fmt, self.data, self.offset)
+        self.offset += struct.calcsize('<' + fmt)
+        return values[0] if len(values) == 1 else values
+
+    def read_bytes(self, num_bytes):
+        if self.offset + num_bytes > len(self.data):
+            raise struct.error('unexpected end of data')
+        result = self.data[self.offset:self.offset + num_bytes]
+        self.offset += num_bytes
+        return result
+
+    def read_string(self, length_fmt):
+        return self.read_bytes(self.read(length_fmt)).decode('utf-8', errors='replace')
+
+
+def read_argument(reader, type_code):
+    if type_code == 'b':
+        return 'true' if reader.read('B') != 0 else 'false'
+    elif type_code == 'c':
+        return reader.read_bytes(1).decode('latin-1')
+    elif type_code == 'i':
+        return reader.read('q')
+    elif type_code == 'u':
+        return reader.read('Q')
+    elif type_code == 'd':
+        return reader.read('d')
+    elif type_code == 's':
+        return reader.read_string('H')
+    else:
+        raise ValueError(f'unknown argument type code "{type_code}"')
+
+
+def format_message(format_string, args):
+    try:
+        return format_string.format(*args)
+    except (ValueError, IndexError, KeyError) as e:
+        return f'{format_string} {args!r} (could not format: {e})'
+
+
+def format_timestamp(timestamp_ns):
+    timestamp = datetime.datetime.fromtimestamp(timestamp_ns // 1000000000, tz=datetime.timezone.utc)
+    return timestamp.strftime('%Y-%m-%d %H:%M:%S') + f'.{timestamp_ns % 1000000000:09d}'
+
+
+def decode(data):
+    reader = Reader(data)
+
+    if reader.read_bytes(len(FILE_MAGIC)) != FILE_MAGIC:
+        raise ValueError('not a binary log file')
+    version = reader.read('I')
+    if version != SUPPORTED_FORMAT_VERSION:
+        raise ValueError(f'unsupported format version {version}')
+
+    sites = {}
+    thread_names = {}
+    # Each line is (timestamp, sequence number, text). The sequence
+    # number keeps the order of entries that have the same timestamp.
+    lines = []
+
+    def thread_label(thread_id):
+        name = thread_names.get(thread_id)
+        return f'{thread_id}:{name}' if name else str(thread_id)
+
+    while not reader.at_end():
+        record_type = reader.read('B')
+
+        if record_type == SITE_RECORD:
+            site_id, level = reader.read('IB')
+            tag = reader.read_string('H')
+            format_string = reader.read_string('H')
+            arg_types = reader.read_string('B')
+            sites[site_id] = (level, tag, format_string, arg_types)
+
+        elif record_type == THREAD_RECORD:
+            thread_id = reader.read('I')
+            thread_names[thread_id] = reader.read_string('B')
+
+        elif record_type == ENTRIES_RECORD:
+            thread_id, num_bytes = reader.read('II')
+            entries = Reader(reader.read_bytes(num_bytes))
+            while not entries.at_end():
+                site_id, timestamp_ns = entries.read('Iq')
+                level, tag, format_string, arg_types = sites[site_id]
+                args = [read_argument(entries, type_code) for type_code in arg_types]
+                level_name = LOG_LEVELS[level] if level < len(LOG_LEVELS) else str(level)
+                text = f'{format_timestamp(timestamp_ns)} [{level_name}] [{tag}] [{thread_label(thread_id)}] {format_message(format_string, args)}'
+                lines.append((timestamp_ns, len(lines), text))
+
+        elif record_type == DROPPED_RECORD:
+            thread_id, num_dropped_entries = reader.read('IQ')
+            # No timestamp is recorded for drops. Sort them
+            # right after the last entry decoded so far.
+            timestamp_ns = lines[-1][0] if lines else 0
+            text = f'{format_timestamp(timestamp_ns)} [warn] [BinaryLog] [{thread_label(thread_id)}] {num_dropped_entries} entries dropped (ring buffer full)'
+            lines.append((timestamp_ns, len(lines), text))
+
+        else:
+            raise ValueError(f'unknown record type {record_type} at offset {reader.offset - 1}')
+
+    lines.sort()
+    return [text for _, _, text in lines]
+
+
+argparser = argparse.ArgumentParser(description='Renders a ComboCtl binary log file to text')
+argparser.add_argument('input', help='Binary log file to read from')
+argparser.add_argument('-o', '--output', help='Text file to write to (default: stdout)')
+
+args = argparser.parse_args()
+
+try:
+    with open(args.input, 'rb') as f:
+        data = f.read()
+    lines = decode(data)
+except (OSError, ValueError, KeyError, struct.error) as e:
+    sys.stderr.write(f'Could not decode "{args.input}": {e}\n')
+    sys.exit(1)
+
+output = open(args.output, 'w') if args.output else sys.stdout
+for line in lines:
+    output.write(line + '\n')
+if args.output:
+    output.close()